@@ -0,0 +1,325 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program measures the throughput of SlicedNonbondedForce in water boxes of increasing size
+ * and compares it with that of OpenMM's NonbondedForce applied to the same systems.  Each option
+ * takes a comma-separated list of values, and all combinations of them are benchmarked:
+ *
+ *     --platform=CUDA                  the platform to use
+ *     --atoms=10000,100000,1000000     approximate number of atoms of each water box
+ *     --subsets=2                      number of particle subsets
+ *     --parameters=0,1                 number of scaling parameters
+ *     --derivatives=false,true         whether derivatives of the scaling parameters are requested
+ *     --methods=PME                    PME, LJPME, Ewald, or CutoffPeriodic
+ *     --precision=mixed                single, mixed, or double (ignored if not supported)
+ *     --fft=default                    default, vkfft, cufft, or auto (only used by CUDA)
+ *     --pmestream=on                   on or off, whether PME runs on its own stream or queue
+ *     --steps=200                      number of time steps for measuring ns/day
+ *     --evaluations=50                 number of force evaluations for measuring ms/evaluation
+ *     --plugins=DIR                    an additional directory from which to load plugins
+ *     --output=FILE                    a file to which the JSON report is written (default: stdout)
+ *
+ * The report is a JSON array with one entry per combination.  The host memory is the resident
+ * set size of this process right after the Context has been created.
+ */
+
+#ifdef WIN32
+  #define _USE_MATH_DEFINES // Needed to get M_PI
+#endif
+#include "SlicedNonbondedForce.h"
+#include "openmm/Context.h"
+#include "openmm/NonbondedForce.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/State.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+const double WATER_DENSITY = 33.4;  // molecules/nm^3
+const double OH_DISTANCE = 0.09572;
+const double HH_DISTANCE = 0.15139;
+const double HOH_ANGLE = 104.52*M_PI/180.0;
+const double TIME_STEP = 0.002;
+
+struct Measurement {
+    double nsPerDay;
+    double msPerEvaluation;
+    double hostMemoryMB;
+};
+
+vector<string> split(const string& text) {
+    vector<string> items;
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ','))
+        if (item != "")
+            items.push_back(item);
+    return items;
+}
+
+bool parseBool(const string& text) {
+    if (text == "true" || text == "1")
+        return true;
+    if (text == "false" || text == "0")
+        return false;
+    throw OpenMMException("Invalid boolean value: "+text);
+}
+
+NonbondedForce::NonbondedMethod parseMethod(const string& name) {
+    if (name == "PME")
+        return NonbondedForce::PME;
+    if (name == "LJPME")
+        return NonbondedForce::LJPME;
+    if (name == "Ewald")
+        return NonbondedForce::Ewald;
+    if (name == "CutoffPeriodic")
+        return NonbondedForce::CutoffPeriodic;
+    throw OpenMMException("Unsupported nonbonded method: "+name);
+}
+
+double getResidentMemoryMB() {
+    ifstream statm("/proc/self/statm");
+    long pages, resident;
+    if (statm >> pages >> resident)
+        return resident*4096.0/(1024.0*1024.0);
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss/(1024.0*1024.0);
+#else
+    return usage.ru_maxrss/1024.0;
+#endif
+#else
+    return -1.0;
+#endif
+}
+
+/**
+ * Create a box of rigid TIP3P water molecules placed on a cubic lattice, together with a
+ * NonbondedForce describing their interactions.
+ */
+void createWaterBox(int numAtoms, System& system, NonbondedForce& nonbonded, vector<Vec3>& positions) {
+    int numMolecules = max(1, numAtoms/3);
+    int perSide = (int) ceil(cbrt((double) numMolecules));
+    double L = cbrt(numMolecules/WATER_DENSITY);
+    double spacing = L/perSide;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    vector<pair<int, int> > bonds;
+    for (int m = 0; m < numMolecules; m++) {
+        Vec3 origin = Vec3(m%perSide, (m/perSide)%perSide, m/(perSide*perSide))*spacing;
+        int oxygen = system.addParticle(15.99943);
+        int hydrogen1 = system.addParticle(1.007947);
+        int hydrogen2 = system.addParticle(1.007947);
+        nonbonded.addParticle(-0.834, 0.315061, 0.636386);
+        nonbonded.addParticle(0.417, 1.0, 0.0);
+        nonbonded.addParticle(0.417, 1.0, 0.0);
+        positions.push_back(origin);
+        positions.push_back(origin+Vec3(OH_DISTANCE, 0, 0));
+        positions.push_back(origin+Vec3(OH_DISTANCE*cos(HOH_ANGLE), OH_DISTANCE*sin(HOH_ANGLE), 0));
+        system.addConstraint(oxygen, hydrogen1, OH_DISTANCE);
+        system.addConstraint(oxygen, hydrogen2, OH_DISTANCE);
+        system.addConstraint(hydrogen1, hydrogen2, HH_DISTANCE);
+        bonds.push_back(make_pair(oxygen, hydrogen1));
+        bonds.push_back(make_pair(oxygen, hydrogen2));
+    }
+    nonbonded.createExceptionsFromBonds(bonds, 0.0, 0.0);
+}
+
+/**
+ * Turn a NonbondedForce into a SlicedNonbondedForce.  The first few water molecules are spread
+ * among the subsets other than 0, and the scaling parameters are assigned to distinct slices,
+ * starting with those involving subset 0.
+ */
+SlicedNonbondedForce* createSlicedForce(const NonbondedForce& nonbonded, int numSubsets, int numParameters, bool derivatives) {
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(nonbonded, numSubsets);
+    int numMolecules = nonbonded.getNumParticles()/3;
+    if (numSubsets > 1)
+        for (int m = 0; m < min(numMolecules, 10*(numSubsets-1)); m++)
+            for (int j = 0; j < 3; j++)
+                force->setParticleSubset(3*m+j, 1+m%(numSubsets-1));
+    vector<pair<int, int> > slices;
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = max(i, 1); j < numSubsets; j++)
+            slices.push_back(make_pair(i, j));
+    if (numParameters > (int) slices.size())
+        throw OpenMMException("Too many scaling parameters for "+to_string(numSubsets)+" subsets");
+    for (int k = 0; k < numParameters; k++) {
+        string name = "lambda"+to_string(k);
+        force->addGlobalParameter(name, 0.5);
+        force->addScalingParameter(name, slices[k].first, slices[k].second, true, true);
+        if (derivatives)
+            force->addScalingParameterDerivative(name);
+    }
+    return force;
+}
+
+Measurement measure(const System& system, const vector<Vec3>& positions, Platform& platform,
+                    const map<string, string>& properties, bool derivatives, int numSteps, int numEvaluations) {
+    typedef chrono::steady_clock Clock;
+    VerletIntegrator integrator(TIME_STEP);
+    Context context(system, integrator, platform, properties);
+    context.setPositions(positions);
+    context.applyConstraints(1e-6);
+    Measurement result;
+    result.hostMemoryMB = getResidentMemoryMB();
+    int types = State::Energy | State::Forces | (derivatives ? State::ParameterDerivatives : 0);
+    context.getState(types);
+    integrator.step(10);
+    context.getState(State::Positions);
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < numEvaluations; i++) {
+        context.setPositions(positions);
+        context.getState(types);
+    }
+    result.msPerEvaluation = 1e3*chrono::duration<double>(Clock::now()-start).count()/numEvaluations;
+
+    context.setPositions(positions);
+    context.applyConstraints(1e-6);
+    start = Clock::now();
+    integrator.step(numSteps);
+    context.getState(State::Positions);
+    double seconds = chrono::duration<double>(Clock::now()-start).count();
+    result.nsPerDay = numSteps*TIME_STEP*86400.0/seconds;
+    return result;
+}
+
+void writeMeasurement(ostream& out, const Measurement& measurement) {
+    out << "{\"nsPerDay\": " << measurement.nsPerDay;
+    out << ", \"msPerEvaluation\": " << measurement.msPerEvaluation;
+    out << ", \"hostMemoryMB\": " << measurement.hostMemoryMB << "}";
+}
+
+int main(int argc, char* argv[]) {
+    map<string, string> options;
+    options["platform"] = "CUDA";
+    options["atoms"] = "10000,100000,1000000";
+    options["subsets"] = "2";
+    options["parameters"] = "0,1";
+    options["derivatives"] = "false,true";
+    options["methods"] = "PME";
+    options["precision"] = "mixed";
+    options["fft"] = "default";
+    options["pmestream"] = "on";
+    options["steps"] = "200";
+    options["evaluations"] = "50";
+    options["plugins"] = "";
+    options["output"] = "";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || equals == string::npos || options.find(arg.substr(2, equals-2)) == options.end()) {
+            cerr << "Invalid option: " << arg << endl;
+            return 1;
+        }
+        options[arg.substr(2, equals-2)] = arg.substr(equals+1);
+    }
+    try {
+        Platform::loadPluginsFromDirectory(Platform::getDefaultPluginsDirectory());
+        if (options["plugins"] != "")
+            Platform::loadPluginsFromDirectory(options["plugins"]);
+        Platform& platform = Platform::getPlatformByName(options["platform"]);
+        const vector<string>& propertyNames = platform.getPropertyNames();
+        bool hasPrecision = find(propertyNames.begin(), propertyNames.end(), "Precision") != propertyNames.end();
+        bool hasPmeStream = find(propertyNames.begin(), propertyNames.end(), "DisablePmeStream") != propertyNames.end();
+        int numSteps = stoi(options["steps"]);
+        int numEvaluations = stoi(options["evaluations"]);
+
+        ofstream file;
+        if (options["output"] != "")
+            file.open(options["output"]);
+        ostream& out = (options["output"] != "" ? file : cout);
+        out << "[";
+        bool first = true;
+        for (string atoms : split(options["atoms"]))
+            for (string methodName : split(options["methods"]))
+            for (string precision : split(options["precision"]))
+            for (string pmeStream : split(options["pmestream"])) {
+                if (pmeStream != "on" && pmeStream != "off")
+                    throw OpenMMException("Unknown PME stream option: "+pmeStream);
+                map<string, string> properties;
+                if (hasPrecision)
+                    properties["Precision"] = precision;
+                if (hasPmeStream)
+                    properties["DisablePmeStream"] = (pmeStream == "off" ? "true" : "false");
+                System stockSystem;
+                NonbondedForce* nonbonded = new NonbondedForce();
+                vector<Vec3> positions;
+                createWaterBox(stoi(atoms), stockSystem, *nonbonded, positions);
+                nonbonded->setNonbondedMethod(parseMethod(methodName));
+                nonbonded->setCutoffDistance(1.0);
+                stockSystem.addForce(nonbonded);
+                Measurement stock = measure(stockSystem, positions, platform, properties, false, numSteps, numEvaluations);
+                for (string subsets : split(options["subsets"]))
+                for (string parameters : split(options["parameters"]))
+                for (string derivatives : split(options["derivatives"]))
+                for (string fft : split(options["fft"])) {
+                    bool useDerivatives = parseBool(derivatives);
+                    if (useDerivatives && stoi(parameters) == 0)
+                        continue;
+                    System system;
+                    NonbondedForce water;
+                    vector<Vec3> unused;
+                    createWaterBox(stoi(atoms), system, water, unused);
+                    SlicedNonbondedForce* force = createSlicedForce(*nonbonded, stoi(subsets), stoi(parameters), useDerivatives);
+                    if (fft == "cufft")
+                        force->setUseCuFFT(true);
+                    else if (fft == "auto")
+                        force->setAutoselectFFT(true);
+                    else if (fft != "default" && fft != "vkfft")
+                        throw OpenMMException("Unknown FFT backend: "+fft);
+                    system.addForce(force);
+                    Measurement sliced = measure(system, positions, platform, properties, useDerivatives, numSteps, numEvaluations);
+                    out << (first ? "\n" : ",\n");
+                    first = false;
+                    out << "  {\"platform\": \"" << platform.getName() << "\"";
+                    out << ", \"atoms\": " << system.getNumParticles();
+                    out << ", \"method\": \"" << methodName << "\"";
+                    out << ", \"precision\": \"" << (hasPrecision ? precision : "default") << "\"";
+                    out << ", \"subsets\": " << subsets;
+                    out << ", \"parameters\": " << parameters;
+                    out << ", \"derivatives\": " << (useDerivatives ? "true" : "false");
+                    out << ", \"fft\": \"" << fft << "\"";
+                    out << ", \"pmeStream\": \"" << (hasPmeStream ? pmeStream : "default") << "\"";
+                    out << ",\n   \"sliced\": ";
+                    writeMeasurement(out, sliced);
+                    out << ",\n   \"stock\": ";
+                    writeMeasurement(out, stock);
+                    out << ",\n   \"relativeSpeed\": " << sliced.nsPerDay/stock.nsPerDay << "}";
+                    out.flush();
+                }
+            }
+        out << "\n]" << endl;
+    }
+    catch (const exception& e) {
+        cerr << "exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include "openmm/KernelImpl.h"
 #include "openmm/Platform.h"
 #include "openmm/System.h"
+#include <map>
 #include <string>
 
 using namespace OpenMM;
@@ -64,6 +65,15 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     virtual void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force) = 0;
+    /**
+     * Move some particles to other subsets without copying any other parameter.  The cost is meant
+     * to be proportional to the number of moved particles.
+     *
+     * @param context    the context in which to move the particles
+     * @param force      the SlicedNonbondedForce, which already holds the new subsets
+     * @param particles  the indices of the moved particles
+     */
+    virtual void reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const std::vector<int>& particles) = 0;
     /**
      * Get the parameters being used for PME.
      *
@@ -82,6 +92,93 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     virtual void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const = 0;
+    /**
+     * Get the name of the FFT library used for the reciprocal space sums, or an empty string if
+     * no FFTs are performed.
+     */
+    virtual std::string getFFTBackendName() const = 0;
+    /**
+     * Get the configuration chosen by PME grid tuning and FFT library selection, formatted by
+     * SlicedNonbondedForceImpl::formatTunedConfiguration(), or an empty string if nothing was tuned.
+     */
+    virtual std::string getTunedConfiguration() const = 0;
+    /**
+     * Get the total time taken by each stage of the calculation, in seconds.  The map is empty
+     * unless stage profiling was enabled when the context was created.
+     */
+    virtual std::map<std::string, double> getStageTimings() const = 0;
+    /**
+     * Get the number of bytes of device memory saved by storing the PME grids in compact form, or 0
+     * if compact grids are not in use.
+     */
+    virtual long long getPMEGridMemorySavings() const = 0;
+    /**
+     * Get the number of bytes of device memory taken by each array allocated by this kernel, or an
+     * empty map if the kernel does not run on a device.
+     */
+    virtual std::map<std::string, long long> getMemoryUsage() const = 0;
+    /**
+     * Get the forces that a slice contributed to the last evaluation that computed forces.  These are
+     * only accumulated if slice forces were enabled when the context was created.
+     *
+     * @param slice   the index of the slice
+     * @param forces  on exit, the force on each particle due to the slice
+     * @return false if no evaluation has computed forces yet, in which case forces is not set
+     */
+    virtual bool getSliceForces(int slice, std::vector<Vec3>& forces) = 0;
+    /**
+     * Get the Coulomb and Lennard-Jones energies of every slice in the last evaluation, which are not
+     * multiplied by the scaling parameters.  These are only accumulated if slice energies were enabled
+     * when the context was created.
+     *
+     * @param energies  on exit, the Coulomb and Lennard-Jones energies of each slice
+     * @param lambdas   on exit, the Coulomb and Lennard-Jones scaling factors applied to each slice in
+     *                  that evaluation
+     * @return false if the last evaluation did not compute the energy, in which case nothing is set
+     */
+    virtual bool getSliceEnergies(std::vector<double>& energies, std::vector<double>& lambdas) = 0;
+    /**
+     * Set the values that the scaling parameters take at each step of a nonequilibrium protocol,
+     * starting from the current step of the context.  While a schedule is set, these values replace
+     * those of the context parameters, and the protocol work is accumulated in the first evaluation
+     * at each step.  Setting a schedule resets the accumulated work.
+     *
+     * @param context     the context in which the protocol is run
+     * @param parameters  the names of the scheduled scaling parameters, or an empty vector to remove
+     *                    the schedule
+     * @param schedule    the values of the scheduled parameters at each step
+     */
+    virtual void setScalingParameterSchedule(ContextImpl& context, const std::vector<std::string>& parameters, const std::vector<std::vector<double> >& schedule) = 0;
+    /**
+     * Get the work accumulated since the schedule was set, which is the sum over steps of the energy
+     * derivative with respect to each scheduled parameter times the change of that parameter.
+     */
+    virtual double getProtocolWork() = 0;
+    /**
+     * Set the force groups included in the next evaluation.  This is only called when the slices are
+     * distributed among different force groups, before each call to execute().
+     *
+     * @param groups  a bit mask of the force groups to include
+     */
+    virtual void setIncludedForceGroups(int groups) = 0;
+    /**
+     * Start copying the positions of a frame to the device without changing those of the context.
+     * On GPU platforms, the copy runs on its own stream, so that it overlaps any evaluation launched
+     * before applyStagedPositions() is called.  Two frames are staged in alternate buffers, and this
+     * waits until the copy of the frame staged two calls earlier has finished.
+     *
+     * @param context    the context for which the positions are staged
+     * @param positions  the positions of all particles, in nm, stored as x, y, and z for each particle
+     */
+    virtual void stagePositions(ContextImpl& context, const double* positions) = 0;
+    /**
+     * Make the positions staged by the last call to stagePositions() the positions of the context.
+     * On GPU platforms, the atoms are not reordered, and subsequent kernels wait for the copy without
+     * blocking the host.
+     *
+     * @param context    the context whose positions are replaced
+     */
+    virtual void applyStagedPositions(ContextImpl& context) = 0;
 };
 
 } // namespace NonbondedSlicing
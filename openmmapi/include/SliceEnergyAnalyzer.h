@@ -0,0 +1,106 @@
+#ifndef OPENMM_SLICEENERGYANALYZER_H_
+#define OPENMM_SLICEENERGYANALYZER_H_
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "SlicedNonbondedForce.h"
+#include "internal/windowsExportNonbondedSlicing.h"
+#include "openmm/Context.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+namespace NonbondedSlicing {
+
+/**
+ * This class computes the Coulomb and Lennard-Jones energies of every slice of a SlicedNonbondedForce
+ * for many frames of a trajectory.  It owns a private Context that contains nothing but a copy of the
+ * force, in which each contribution of each slice is multiplied by its own scaling parameter with
+ * value 1.  The slice energies are then obtained as derivatives, without computing any forces.
+ * On GPU platforms, the positions of each frame are copied to the device on a separate stream while
+ * the previous frame is computed.
+ *
+ * The computed energies are not multiplied by the scaling parameters of the original force.
+ */
+
+class OPENMM_EXPORT_NONBONDED_SLICING SliceEnergyAnalyzer {
+public:
+    /**
+     * Create a SliceEnergyAnalyzer.
+     *
+     * @param system      the System that contains the force
+     * @param force       the SlicedNonbondedForce whose slice energies are to be computed
+     * @param platform    the Platform to use for the calculations
+     * @param properties  a set of values for platform-specific properties
+     */
+    SliceEnergyAnalyzer(const System& system, const SlicedNonbondedForce& force, Platform& platform,
+                        const map<string, string>& properties=map<string, string>());
+    /**
+     * Get the number of particles in each frame.
+     */
+    int getNumParticles() const {
+        return numParticles;
+    }
+    /**
+     * Get the number of slices of the force.
+     */
+    int getNumSlices() const {
+        return numSlices;
+    }
+    /**
+     * Set the value of a global parameter of the force, such as one used in parameter offsets.
+     *
+     * @param name   the name of the parameter
+     * @param value  the value of the parameter
+     */
+    void setParameter(const string& name, double value);
+    /**
+     * Compute the slice energies for a set of frames.
+     *
+     * @param positions    the particle positions in all frames, in nm, stored as x, y, and z for every
+     *                     particle of the first frame, then of the second frame, and so on
+     * @param boxVectors   the periodic box vectors of all frames, in nm, stored as the nine components
+     *                     of the three vectors of each frame.  If empty, the default box vectors of the
+     *                     System are used in all frames.
+     * @return the energies in kJ/mol, stored as the Coulomb and Lennard-Jones energies of each slice
+     *         of the first frame, then of the second frame, and so on
+     */
+    vector<double> computeSliceEnergies(const vector<double>& positions, const vector<double>& boxVectors=vector<double>());
+    /**
+     * Compute the slice energies for a set of frames stored in contiguous arrays, with the same layouts
+     * as in the other version of this method.
+     *
+     * @param numFrames    the number of frames
+     * @param positions    the 3*numParticles*numFrames coordinates of the particles in all frames, in nm
+     * @param boxVectors   the 9*numFrames components of the periodic box vectors of all frames, in nm, or
+     *                     NULL to use the default box vectors of the System in all frames
+     * @param energies     on exit, the 2*numSlices*numFrames energies, in kJ/mol
+     */
+    void computeSliceEnergies(int numFrames, const double* positions, const double* boxVectors, double* energies);
+private:
+    int numParticles, numSlices;
+    vector<string> parameterNames;
+    System system;
+    VerletIntegrator integrator;
+    SlicedNonbondedForce* copy;
+    unique_ptr<Context> context;
+};
+
+} // namespace NonbondedSlicing
+
+#endif /*OPENMM_SLICEENERGYANALYZER_H_*/
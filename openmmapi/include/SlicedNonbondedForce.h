@@ -13,8 +13,11 @@
 
 #include "internal/windowsExportNonbondedSlicing.h"
 #include "openmm/NonbondedForce.h"
+#include "openmm/System.h"
 #include "openmm/internal/AssertionUtilities.h"
+#include <functional>
 #include <map>
+#include <vector>
 
 using namespace OpenMM;
 using namespace std;
@@ -25,11 +28,24 @@ namespace NonbondedSlicing {
 
 class OPENMM_EXPORT_NONBONDED_SLICING SlicedNonbondedForce : public NonbondedForce {
 public:
+    typedef std::function<void(long long step, const vector<double>& values)> SliceEnergyCallback;
     SlicedNonbondedForce(int numSubsets);
-    SlicedNonbondedForce(const OpenMM::NonbondedForce& force, int numSubsets);
+    SlicedNonbondedForce(const OpenMM::NonbondedForce& force, int numSubsets, const vector<int>& subsets = vector<int>());
     void getPMEParametersInContext(const Context& context, double& alpha, int& nx, int& ny, int& nz) const;
     void getLJPMEParametersInContext(const Context& context, double& alpha, int& nx, int& ny, int& nz) const;
+    string getFFTBackendInContext(const Context& context) const;
+    string getTunedConfigurationInContext(const Context& context) const;
+    map<string, double> getStageTimingsInContext(const Context& context) const;
+    long long getPMEGridMemorySavingsInContext(const Context& context) const;
+    map<string, long long> getMemoryUsageInContext(const Context& context) const;
+    map<string, long long> estimateMemoryUsage(const System& system, const string& precision="single", int numThreadBlocks=1024) const;
     void updateParametersInContext(Context& context);
+    void reassignSubsetsInContext(Context& context, const vector<int>& particles, const vector<int>& subsets);
+    vector<double> computeStateEnergiesInContext(Context& context, const vector<string>& parameters, const vector<vector<double>>& states);
+    vector<double> getSliceEnergiesInContext(Context& context);
+    vector<Vec3> getSliceForcesInContext(Context& context, int slice);
+    void setScalingParameterScheduleInContext(Context& context, const vector<string>& parameters, const vector<vector<double>>& schedule);
+    double getProtocolWorkInContext(Context& context);
     string getNonbondedMethodName() const;
     int getNumSubsets() const {
         return numSubsets;
@@ -45,29 +61,190 @@ public:
     }
     void setParticleSubset(int index, int subset);
     int getParticleSubset(int index) const;
+    void setParticleSubsets(const vector<int>& subsets);
+    vector<int> getParticleSubsets() const;
     int addScalingParameter(const string& parameter, int subset1, int subset2, bool includeCoulomb, bool includeLJ);
     void getScalingParameter(int index, string& parameter, int& subset1, int& subset2, bool& includeCoulomb, bool& includeLJ) const;
     void setScalingParameter(int index, const string& parameter, int subset1, int subset2, bool includeCoulomb, bool includeLJ);
     int addScalingParameterDerivative(const string& parameter);
     const string& getScalingParameterDerivativeName(int index) const;
     void setScalingParameterDerivative(int index, const string& parameter);
+    int getSliceForceGroup(int slice) const;
+    void setSliceForceGroup(int slice, int group);
+    int getSliceReciprocalSpaceForceGroup(int slice) const;
+    void setSliceReciprocalSpaceForceGroup(int slice, int group);
     bool getUseCudaFFT() const {
         return useCudaFFT;
     };
     void setUseCuFFT(bool use) {
         useCudaFFT = use;
     };
+    bool getSkipDecoupledSlices() const {
+        return skipDecoupledSlices;
+    };
+    void setSkipDecoupledSlices(bool skip) {
+        skipDecoupledSlices = skip;
+    };
+    bool getUseCudaGraphs() const {
+        return useCudaGraphs;
+    };
+    void setUseCudaGraphs(bool use) {
+        useCudaGraphs = use;
+    };
+    bool getProfileStages() const {
+        return profileStages;
+    };
+    void setProfileStages(bool profile) {
+        profileStages = profile;
+    };
+    bool getAutoselectFFT() const {
+        return autoselectFFT;
+    };
+    void setAutoselectFFT(bool autoselect) {
+        autoselectFFT = autoselect;
+    };
+    bool getAutotunePME() const {
+        return autotunePME;
+    };
+    void setAutotunePME(bool autotune) {
+        autotunePME = autotune;
+    };
+    bool getUseCompactPMEGrids() const {
+        return useCompactPMEGrids;
+    };
+    void setUseCompactPMEGrids(bool use) {
+        useCompactPMEGrids = use;
+    };
+    bool getUseEnergyCache() const {
+        return useEnergyCache;
+    };
+    void setUseEnergyCache(bool use) {
+        useEnergyCache = use;
+    };
+    bool getUseDerivativesOnDemand() const {
+        return useDerivativesOnDemand;
+    };
+    void setUseDerivativesOnDemand(bool use) {
+        useDerivativesOnDemand = use;
+    };
+    bool getUseCpuPme() const {
+        return useCpuPme;
+    };
+    void setUseCpuPme(bool use) {
+        useCpuPme = use;
+    };
+    bool getUseConcurrentLJPME() const {
+        return useConcurrentLJPME;
+    };
+    void setUseConcurrentLJPME(bool use) {
+        useConcurrentLJPME = use;
+    };
+    bool getUseOptimalInfluenceFunction() const {
+        return useOptimalInfluenceFunction;
+    };
+    void setUseOptimalInfluenceFunction(bool use) {
+        useOptimalInfluenceFunction = use;
+    };
+    bool getUseLoadBalancing() const {
+        return useLoadBalancing;
+    };
+    void setUseLoadBalancing(bool use) {
+        useLoadBalancing = use;
+    };
+    bool getUseCachedBSplines() const {
+        return useCachedBSplines;
+    };
+    void setUseCachedBSplines(bool use) {
+        useCachedBSplines = use;
+    };
+    bool getUseSliceForces() const {
+        return useSliceForces;
+    };
+    void setUseSliceForces(bool use) {
+        useSliceForces = use;
+    };
+    bool getUseSliceEnergies() const {
+        return useSliceEnergies;
+    };
+    void setUseSliceEnergies(bool use) {
+        useSliceEnergies = use;
+    };
+    bool getUseTreeCode() const {
+        return useTreeCode;
+    };
+    void setUseTreeCode(bool use) {
+        useTreeCode = use;
+    };
+    double getTreeCodeOpeningAngle() const {
+        return treeCodeOpeningAngle;
+    };
+    void setTreeCodeOpeningAngle(double angle);
+    const string& getTunedConfiguration() const {
+        return tunedConfiguration;
+    };
+    void setTunedConfiguration(const string& configuration) {
+        tunedConfiguration = configuration;
+    };
+    int getSmallSubsetThreshold() const {
+        return smallSubsetThreshold;
+    };
+    void setSmallSubsetThreshold(int threshold);
+    int getPMEInterpolationOrder() const {
+        return pmeInterpolationOrder;
+    };
+    void setPMEInterpolationOrder(int order);
+    int getSliceEnergyReportInterval() const {
+        return sliceEnergyReportInterval;
+    };
+    void setSliceEnergyReportInterval(int steps);
+    const string& getSliceEnergyReportFile() const {
+        return sliceEnergyReportFile;
+    };
+    void setSliceEnergyReportFile(const string& file) {
+        sliceEnergyReportFile = file;
+    };
+    const SliceEnergyCallback& getSliceEnergyCallback() const {
+        return sliceEnergyCallback;
+    };
+    void setSliceEnergyCallback(SliceEnergyCallback callback) {
+        sliceEnergyCallback = callback;
+    };
 protected:
+    friend class SliceEnergyAnalyzer;
     ForceImpl* createImpl() const;
 private:
     int getGlobalParameterIndex(const string& parameter) const;
     int getScalingParameterIndex(const string& parameter) const;
     class ScalingParameterInfo;
     int numSubsets;
-    map<int, int> subsets;
+    vector<int> subsets;
     vector<ScalingParameterInfo> scalingParameters;
     vector<int> scalingParameterDerivatives;
+    vector<int> sliceForceGroups, sliceReciprocalSpaceForceGroups;
     bool useCudaFFT;
+    bool skipDecoupledSlices;
+    bool useCudaGraphs;
+    bool autotunePME;
+    bool autoselectFFT;
+    bool profileStages;
+    bool useCompactPMEGrids;
+    bool useEnergyCache;
+    bool useDerivativesOnDemand;
+    bool useCpuPme;
+    bool useConcurrentLJPME;
+    bool useOptimalInfluenceFunction;
+    bool useLoadBalancing;
+    bool useCachedBSplines;
+    bool useSliceForces;
+    bool useSliceEnergies;
+    bool useTreeCode;
+    double treeCodeOpeningAngle;
+    int smallSubsetThreshold;
+    int pmeInterpolationOrder;
+    int sliceEnergyReportInterval;
+    string sliceEnergyReportFile;
+    string tunedConfiguration;
+    SliceEnergyCallback sliceEnergyCallback;
 };
 
 /**
@@ -0,0 +1,107 @@
+#ifndef OPENMM_SLICEDNONBONDEDREPLICABATCH_H_
+#define OPENMM_SLICEDNONBONDEDREPLICABATCH_H_
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "SlicedNonbondedForce.h"
+#include "internal/windowsExportNonbondedSlicing.h"
+#include "openmm/State.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+using namespace std;
+
+namespace NonbondedSlicing {
+
+/**
+ * This class packs several replicas of a SlicedNonbondedForce, which share the same particles and
+ * exceptions but have their own positions and parameter values, into a single force that can be
+ * evaluated in one Context.  All replicas share the same periodic box.
+ *
+ * Replica r contains the particles with indices from r*N to (r+1)*N-1, where N is the number of
+ * particles of the original force.  Subset s of the original force becomes subset r*n+s, where n is
+ * the original number of subsets, so that the grids of all replicas are transformed in a single
+ * batch.  Every global parameter p of the original force becomes one global parameter per replica,
+ * whose name is returned by getParameterName(r, p).  The slices that involve two different replicas
+ * are multiplied by an extra scaling parameter fixed at zero, so that replicas do not interact.  The
+ * skipping of decoupled slices is always enabled, so that such pairs cost no interaction evaluations.
+ *
+ * The energy of each replica is recovered from the derivatives with respect to its own scaling
+ * parameters.  For this, every slice of a replica that is not multiplied by a scaling parameter of
+ * the original force is multiplied by an extra one whose value is 1.
+ *
+ * Only the SlicedNonbondedForce is replicated.  The particles and any other forces of the System
+ * must be replicated by the caller, in the same order.
+ */
+
+class OPENMM_EXPORT_NONBONDED_SLICING SlicedNonbondedReplicaBatch {
+public:
+    /**
+     * Create a SlicedNonbondedReplicaBatch.
+     *
+     * @param force        the SlicedNonbondedForce to replicate
+     * @param numReplicas  the number of replicas
+     */
+    SlicedNonbondedReplicaBatch(const SlicedNonbondedForce& force, int numReplicas);
+    SlicedNonbondedReplicaBatch(const SlicedNonbondedReplicaBatch&) = delete;
+    SlicedNonbondedReplicaBatch& operator=(const SlicedNonbondedReplicaBatch&) = delete;
+    /**
+     * Get the number of replicas.
+     */
+    int getNumReplicas() const {
+        return numReplicas;
+    }
+    /**
+     * Get the number of particles of each replica.
+     */
+    int getNumParticlesPerReplica() const {
+        return numParticles;
+    }
+    /**
+     * Get the index, in the batched force, of a particle of a replica.
+     *
+     * @param replica   the index of the replica
+     * @param particle  the index of the particle in the original force
+     */
+    int getParticleIndex(int replica, int particle) const;
+    /**
+     * Get the name of the global parameter that stands for a global parameter of the original force
+     * in a replica.
+     *
+     * @param replica    the index of the replica
+     * @param parameter  the name of the global parameter in the original force
+     */
+    string getParameterName(int replica, const string& parameter) const;
+    /**
+     * Create a new SlicedNonbondedForce that contains all replicas.  The caller takes ownership of it,
+     * which is usually passed on to a System with System::addForce().
+     */
+    SlicedNonbondedForce* createForce() const;
+    /**
+     * Get the energy of each replica from a State created by a Context that contains the batched force.
+     * The State must include parameters and parameter derivatives.  Only the energy of the batched force
+     * is included.
+     *
+     * @param state  the State
+     * @return the potential energy of each replica, in kJ/mol
+     */
+    vector<double> getReplicaEnergies(const State& state) const;
+private:
+    int numReplicas, numParticles;
+    unique_ptr<SlicedNonbondedForce> batchedForce;
+    vector<vector<string> > replicaScalingParameters;
+};
+
+} // namespace NonbondedSlicing
+
+#endif /*OPENMM_SLICEDNONBONDEDREPLICABATCH_H_*/
@@ -0,0 +1,125 @@
+#ifndef OPENMM_SLICEENERGYWRITER_H_
+#define OPENMM_SLICEENERGYWRITER_H_
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "SlicedNonbondedForce.h"
+#include "internal/windowsExportNonbondedSlicing.h"
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace NonbondedSlicing {
+
+/**
+ * This class delivers the slice energies reported by a kernel from a background thread, so that
+ * neither waiting for the data nor writing it ever stalls the thread that drives the simulation.
+ *
+ * A kernel submits each report together with a function that blocks until the data is available
+ * on the host and then returns it.  Reports are handled in the order they are submitted.  At most
+ * getCapacity() reports can be pending at any time, so a kernel can reuse a ring of that many
+ * staging buffers, provided that it calls waitForCapacity() before filling the next one.
+ *
+ * When a file is given, it starts with the characters "NBSE", a 32-bit integer with the number N of
+ * values per report, and the N names, each one stored as a 32-bit length followed by its characters.
+ * Each report is then stored as a 64-bit step index followed by N double precision values.
+ */
+
+class OPENMM_EXPORT_NONBONDED_SLICING SliceEnergyWriter {
+public:
+    typedef std::function<std::vector<double>()> Fetch;
+    /**
+     * Create a SliceEnergyWriter.
+     *
+     * @param names     the names of the reported values
+     * @param file      the file to write the reports to, or an empty string for no file
+     * @param callback  a function to call for each report, or an empty function for none
+     * @param capacity  the maximum number of pending reports
+     */
+    SliceEnergyWriter(const std::vector<std::string>& names, const std::string& file, SlicedNonbondedForce::SliceEnergyCallback callback, int capacity=8);
+    /**
+     * Deliver all pending reports and stop the background thread.
+     */
+    ~SliceEnergyWriter();
+    /**
+     * Get whether a SlicedNonbondedForce requests periodic reports of its slice energies, which
+     * requires a report interval, a file or a callback, and at least one scaling parameter derivative.
+     */
+    static bool isRequested(const SlicedNonbondedForce& force) {
+        return force.getSliceEnergyReportInterval() > 0 && force.getNumScalingParameterDerivatives() > 0 &&
+               (force.getSliceEnergyReportFile() != "" || force.getSliceEnergyCallback());
+    }
+    /**
+     * Get the names of the values reported for a SlicedNonbondedForce, which are its requested
+     * scaling parameter derivatives.
+     */
+    static std::vector<std::string> getReportedNames(const SlicedNonbondedForce& force) {
+        std::vector<std::string> names;
+        for (int i = 0; i < force.getNumScalingParameterDerivatives(); i++)
+            names.push_back(force.getScalingParameterDerivativeName(i));
+        return names;
+    }
+    /**
+     * Get whether a report is due at a given step.  Each step is reported at most once, even if the
+     * forces are evaluated several times at that step.
+     *
+     * @param step      the index of the current step
+     * @param interval  the number of steps between reports
+     */
+    bool isDue(long long step, int interval) const {
+        return step%interval == 0 && step != lastStep;
+    }
+    /**
+     * Get the maximum number of pending reports.
+     */
+    int getCapacity() const {
+        return capacity;
+    }
+    /**
+     * Get the number of reports submitted so far.
+     */
+    long long getNumSubmitted() const {
+        return numSubmitted;
+    }
+    /**
+     * Wait until fewer than getCapacity() reports are pending.  After this, the staging buffer of
+     * slot getNumSubmitted()%getCapacity() is no longer in use and can be overwritten.
+     */
+    void waitForCapacity();
+    /**
+     * Submit a report.  This blocks only if getCapacity() reports are already pending.
+     *
+     * @param step   the index of the step at which the energies were computed
+     * @param fetch  a function that waits for the reported values and returns them
+     */
+    void submit(long long step, Fetch fetch);
+private:
+    void run();
+    std::vector<std::string> names;
+    std::ofstream stream;
+    SlicedNonbondedForce::SliceEnergyCallback callback;
+    int capacity;
+    long long numSubmitted, lastStep;
+    bool finished;
+    std::deque<std::pair<long long, Fetch> > pending;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread thread;
+};
+
+} // namespace NonbondedSlicing
+
+#endif /*OPENMM_SLICEENERGYWRITER_H_*/
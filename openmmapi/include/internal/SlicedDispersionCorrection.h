@@ -0,0 +1,99 @@
+#ifndef OPENMM_SLICEDDISPERSIONCORRECTION_H_
+#define OPENMM_SLICEDDISPERSIONCORRECTION_H_
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "SlicedNonbondedForce.h"
+#include "internal/windowsExportNonbondedSlicing.h"
+#include "openmm/System.h"
+#include "openmm/internal/ContextImpl.h"
+#include <string>
+#include <vector>
+
+namespace NonbondedSlicing {
+
+/**
+ * This class computes the coefficients of the long range dispersion correction of every slice of a
+ * SlicedNonbondedForce, and keeps them up to date as the global parameters that offset the
+ * Lennard-Jones parameters of some particles change.
+ *
+ * With Lorentz-Berthelot mixing, the correction of a slice is a sum over pairs of particles of
+ * sqrt(epsilon1*epsilon2)*((sigma1+sigma2)/2)^n, with n = 6 and 12 (the switching function only
+ * changes the coefficients of these two sums).  Expanding the binomials turns each sum into products
+ * of the per-subset moments sum(count*sqrt(epsilon)*sigma^k), k = 0, ..., 12, of the particle classes.
+ * The moments of the classes without offsets are computed once, so an update only needs to visit
+ * the classes whose parameters depend on global parameters.
+ */
+
+class OPENMM_EXPORT_NONBONDED_SLICING SlicedDispersionCorrection {
+public:
+    /**
+     * Create a SlicedDispersionCorrection.  The coefficients are initially computed with the
+     * default values of all global parameters.
+     *
+     * @param system  the System to which the force belongs
+     * @param force   the SlicedNonbondedForce for which to compute the correction
+     */
+    SlicedDispersionCorrection(const OpenMM::System& system, const SlicedNonbondedForce& force);
+    /**
+     * Get the names of the global parameters on which the coefficients depend.
+     */
+    const std::vector<std::string>& getParameterNames() const {
+        return paramNames;
+    }
+    /**
+     * Get the current coefficient of each slice.  The correction to the energy of a slice is its
+     * coefficient divided by the volume of the periodic box.
+     */
+    const std::vector<double>& getCoefficients() const {
+        return coefficients;
+    }
+    /**
+     * Update the coefficients to the values of the global parameters in a Context.  Nothing is
+     * computed unless some of these values have changed since the previous update.
+     *
+     * @param context  the context from which to take the parameter values
+     * @return true if the coefficients have changed
+     */
+    bool update(OpenMM::ContextImpl& context);
+    /**
+     * Update the coefficients after some particles have been moved to other subsets.  The cost is
+     * proportional to the number of moved particles.  Their other parameters must be the same as
+     * when this object was created.
+     *
+     * @param force       the SlicedNonbondedForce, which already holds the new subsets
+     * @param particles   the indices of the moved particles
+     * @param oldSubsets  the subsets to which these particles belonged before
+     */
+    void moveParticles(const SlicedNonbondedForce& force, const std::vector<int>& particles, const std::vector<int>& oldSubsets);
+private:
+    static const int NumMoments = 13;
+    struct VariableClass;
+    void computeCoefficients();
+    int numSubsets, numSlices;
+    double prefactor, c12, c6;
+    std::vector<std::string> paramNames;
+    std::vector<double> paramValues;
+    std::vector<VariableClass> variableClasses;
+    std::vector<int> particleClasses;
+    std::vector<double> fixedMoments, fixedDiagonal6, fixedDiagonal12;
+    std::vector<double> coefficients;
+};
+
+struct SlicedDispersionCorrection::VariableClass {
+    double sigma, epsilon, count;
+    int subset;
+    std::vector<std::pair<int, std::pair<double, double> > > offsets;
+};
+
+} // namespace NonbondedSlicing
+
+#endif /*OPENMM_SLICEDDISPERSIONCORRECTION_H_*/
@@ -14,6 +14,7 @@
 #include "SlicedNonbondedForce.h"
 #include "openmm/internal/NonbondedForceImpl.h"
 #include "openmm/Kernel.h"
+#include <map>
 #include <utility>
 #include <set>
 #include <string>
@@ -37,14 +38,195 @@ public:
     double calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups);
     std::vector<std::string> getKernelNames();
     void updateParametersInContext(ContextImpl& context);
+    void reassignSubsets(ContextImpl& context, const vector<int>& particles);
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    std::string getFFTBackendName() const;
+    std::string getTunedConfiguration() const;
+    std::map<std::string, double> getStageTimings() const;
+    long long getPMEGridMemorySavings() const;
+    std::map<std::string, long long> getMemoryUsage() const;
+    /**
+     * Get the forces that a slice contributed to the last evaluation that computed forces.
+     *
+     * @param slice   the index of the slice
+     * @param forces  on exit, the force on each particle due to the slice
+     * @return false if no evaluation has computed forces yet, in which case forces is not set
+     */
+    bool getSliceForces(int slice, vector<Vec3>& forces);
+    /**
+     * Get the Coulomb and Lennard-Jones energies of every slice in the last evaluation, which are not
+     * multiplied by the scaling parameters, along with the scaling factors applied to them.  The last
+     * evaluation must have computed the energy.
+     *
+     * @param energies  on exit, the Coulomb and Lennard-Jones energies of each slice
+     * @param lambdas   on exit, the Coulomb and Lennard-Jones scaling factors of each slice
+     */
+    void getSliceEnergies(vector<double>& energies, vector<double>& lambdas);
+    void setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double>>& schedule);
+    double getProtocolWork();
+    /**
+     * Start copying the positions of a frame to the device of the context without changing its current
+     * positions, so that the copy overlaps the evaluations launched before applyStagedPositions().
+     *
+     * @param context    the context for which the positions are staged
+     * @param positions  the positions of all particles, in nm, stored as x, y, and z for each particle
+     */
+    void stagePositions(ContextImpl& context, const double* positions);
+    /**
+     * Make the positions staged by the last call to stagePositions() the positions of the context.
+     */
+    void applyStagedPositions(ContextImpl& context);
     static double calcDispersionCorrection(const System& system, const SlicedNonbondedForce& force);
     static vector<double> calcDispersionCorrections(const System& system, const SlicedNonbondedForce& force);
+    /**
+     * Compute the coefficients of sigma^12 and sigma^6 in the indefinite integral of the Lennard-Jones
+     * interaction multiplied by the switching function.
+     */
+    static void evalIntegralCoefficients(double r, double rs, double rc, double& c12, double& c6);
+    static vector<int> calcEffectiveSlices(const SlicedNonbondedForce& force);
+    /**
+     * Determine whether the slicing of a force is trivial, i.e., whether all slices are always added
+     * together with unit weights.  Such a force is evaluated with the platform's NonbondedForce kernel.
+     */
+    static bool isSlicingTrivial(const SlicedNonbondedForce& force);
+    /**
+     * Determine whether any option of a force differs from its default value in a way that changes how
+     * the force is evaluated, so that the platform's NonbondedForce kernel cannot stand in for it.
+     */
+    static bool hasNonstandardEvaluation(const SlicedNonbondedForce& force);
+    /**
+     * Get the force groups of the direct and reciprocal space parts of every slice, with the default
+     * value -1 replaced by the corresponding group of the force.
+     */
+    static void getSliceForceGroups(const SlicedNonbondedForce& force, vector<int>& directGroups, vector<int>& reciprocalGroups);
+    /**
+     * Determine whether the slices of a force are distributed among more than one direct space or
+     * reciprocal space force group.
+     */
+    static bool hasSliceForceGroups(const SlicedNonbondedForce& force);
+    /**
+     * Get a bit mask of all force groups in which some part of a force is evaluated.
+     */
+    static int calcForceGroupsMask(const SlicedNonbondedForce& force);
+    /**
+     * When the number of effective slices exceeds this value, reciprocal space energies are evaluated
+     * by tiled kernels, in which each thread accumulates only a few slices and the energy buffer holds
+     * one entry per thread block instead of one per thread.
+     */
+    static const int MaxUntiledEffectiveSlices = 36;
+    /**
+     * The optimal influence function of a grid frequency k sums the Ewald kernel over the aliases
+     * k+n*gridSize for which every component of n lies between -InfluenceFunctionAliases and
+     * InfluenceFunctionAliases.  Farther aliases have relative weights below 1e-4 for cubic B-splines,
+     * and these decrease quickly with the interpolation order.
+     */
+    static const int InfluenceFunctionAliases = 2;
+    /**
+     * Compute the separation parameter and the grid dimensions for PME or LJPME.  This differs from
+     * NonbondedForceImpl::calcPMEParameters in that automatically chosen dimensions meet the error
+     * tolerance for the interpolation order and influence function of the force, rather than for fifth
+     * order B-splines and the smooth PME influence function.
+     */
+    static void calcPMEParameters(const System& system, const SlicedNonbondedForce& force, double& alpha, int& xsize, int& ysize, int& zsize, bool lj);
+    /**
+     * Estimate the mean squared error of the reciprocal space force between two unit charges, or two
+     * unit dispersion coefficients if lj is true, averaged over their positions, for PME with B-splines
+     * of the given order and either the smooth PME or the optimal influence function.  This sums, over
+     * every frequency of the grid, the squared errors of the components of the pair force at that
+     * frequency and at its aliases, as in the error functional of Hockney and Eastwood for analytically
+     * differentiated interpolation.  The Ewald kernel is neglected beyond the Nyquist frequency, which is
+     * accurate for any grid that meets a usual error tolerance.  The result is only meaningful relative
+     * to other grids for the same box and separation parameter.
+     *
+     * @param boxVectors        the periodic box vectors, of which only the diagonal is used
+     * @param alpha             the separation parameter
+     * @param gridSize          the number of grid points along each axis
+     * @param order             the order of the B-splines
+     * @param optimalInfluence  whether to use the optimal influence function instead of the smooth PME one
+     * @param lj                whether to estimate the dispersion error instead of the Coulomb one
+     */
+    static double estimatePmeForceError(const Vec3 boxVectors[3], double alpha, const int gridSize[3], int order, bool optimalInfluence, bool lj);
+    /**
+     * Compute the sizes, in bytes, of the two grids shared by the reciprocal space sums of all subsets.
+     * Charges are spread onto an extended real grid stored in the second one, gathered into a plain real
+     * grid stored in the first one, and then transformed into a complex grid stored in the second one.
+     * By default, both grids are as large as an extended complex grid, as in OpenMM's NonbondedForce.
+     * Compact grids only take what each of those steps needs, which is roughly half of that.
+     *
+     * @param xsize       the number of grid points along the X axis
+     * @param ysize       the number of grid points along the Y axis
+     * @param zsize       the number of grid points along the Z axis
+     * @param pmeOrder    the order of the B-spline interpolation
+     * @param numSubsets  the number of particle subsets, each of which has its own grid
+     * @param realSize    the size of a real value on the device
+     * @param spreadSize  the size of a value of the extended grid, which is 8 for fixed point spreading
+     * @param compact     whether to compute the sizes of compact grids
+     * @param grid1Bytes  the size of the first grid
+     * @param grid2Bytes  the size of the second grid
+     */
+    static void computePmeGridBytes(int xsize, int ysize, int zsize, int pmeOrder, int numSubsets, int realSize, int spreadSize, bool compact,
+                                    long long& grid1Bytes, long long& grid2Bytes);
+    /**
+     * Estimate the device memory taken by the largest arrays that a GPU platform allocates for a force,
+     * without creating a context.  The keys are the names of the arrays, as in getMemoryUsage().
+     *
+     * @param system           the system to which the force belongs
+     * @param force            the force whose memory usage is estimated
+     * @param precision        the precision mode of the platform, which is "single", "mixed", or "double"
+     * @param numThreadBlocks  the number of thread blocks launched by the platform's kernels
+     */
+    static std::map<std::string, long long> estimateMemoryUsage(const System& system, const SlicedNonbondedForce& force, const std::string& precision, int numThreadBlocks);
+    /**
+     * The choices made by PME grid tuning and FFT library selection in a context, which later contexts
+     * for the same device model and system size can reuse instead of timing the transforms again.  Grid
+     * dimensions of zero and a register boost of zero mean that the grid or the FFT library, respectively,
+     * was not tuned.
+     */
+    struct TunedConfiguration {
+        std::string device;
+        int numParticles, numSubsets;
+        double alpha, dispersionAlpha;
+        int grid[3], dispersionGrid[3];
+        bool useVendorFFT;
+        int registerBoost;
+        TunedConfiguration() : numParticles(0), numSubsets(0), alpha(0.0), dispersionAlpha(0.0), grid{0, 0, 0},
+                dispersionGrid{0, 0, 0}, useVendorFFT(false), registerBoost(0) {
+        }
+    };
+    /**
+     * Format a tuned configuration as a single line of text, in the form stored by
+     * SlicedNonbondedForce::setTunedConfiguration().
+     */
+    static std::string formatTunedConfiguration(const TunedConfiguration& config);
+    /**
+     * Find the configuration tuned for a device model and system size among the lines of text returned
+     * by SlicedNonbondedForce::getTunedConfiguration().  A configuration whose separation parameters
+     * differ from the given ones was tuned for other settings of the force, and is ignored.
+     *
+     * @param configurations   the tuned configurations, one per line
+     * @param device           the name of the device model
+     * @param numParticles     the number of particles in the system
+     * @param numSubsets       the number of particle subsets
+     * @param alpha            the separation parameter of the Coulomb sums
+     * @param dispersionAlpha  the separation parameter of the dispersion sums, or 0 if LJPME is not used
+     * @param config           on exit, the matching configuration, if any
+     * @return whether a matching configuration was found
+     */
+    static bool findTunedConfiguration(const std::string& configurations, const std::string& device, int numParticles, int numSubsets,
+                                       double alpha, double dispersionAlpha, TunedConfiguration& config);
+    /**
+     * Merge two sets of tuned configurations, one per line.  The configurations of the second set replace
+     * those of the first one for the same device model and system size.
+     */
+    static std::string mergeTunedConfigurations(const std::string& configurations, const std::string& newConfigurations);
 private:
     static double evalIntegral(double r, double rs, double rc, double sigma);
     const SlicedNonbondedForce& owner;
     Kernel kernel;
+    bool trivialSlicing, useSliceForceGroups, useSliceForces, useSliceEnergies;
+    int directGroupsMask, reciprocalGroupsMask;
+    vector<Vec3> stagedPositions;
 };
 
 } // namespace NonbondedSlicing
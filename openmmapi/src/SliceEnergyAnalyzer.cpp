@@ -0,0 +1,110 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "SliceEnergyAnalyzer.h"
+#include "internal/SlicedNonbondedForceImpl.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/State.h"
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+SliceEnergyAnalyzer::SliceEnergyAnalyzer(const System& system, const SlicedNonbondedForce& force, Platform& platform,
+                                         const map<string, string>& properties) : integrator(1.0), copy(NULL) {
+    numParticles = system.getNumParticles();
+    numSlices = force.getNumSlices();
+    for (int i = 0; i < numParticles; i++)
+        this->system.addParticle(system.getParticleMass(i));
+    Vec3 a, b, c;
+    system.getDefaultPeriodicBoxVectors(a, b, c);
+    this->system.setDefaultPeriodicBoxVectors(a, b, c);
+
+    // The copy keeps the parameters and the global parameters of the original force, but not its scaling
+    // parameters.  Every contribution of every slice gets its own one instead.
+
+    int numSubsets = force.getNumSubsets();
+    copy = new SlicedNonbondedForce(force, numSubsets, force.getParticleSubsets());
+    copy->setForceGroup(0);
+    copy->setReciprocalSpaceForceGroup(-1);
+    copy->setUseCuFFT(force.getUseCudaFFT());
+    copy->setAutotunePME(force.getAutotunePME());
+    copy->setAutoselectFFT(force.getAutoselectFFT());
+    copy->setTunedConfiguration(force.getTunedConfiguration());
+    parameterNames.resize(2*numSlices);
+    for (int subset1 = 0; subset1 < numSubsets; subset1++)
+        for (int subset2 = subset1; subset2 < numSubsets; subset2++) {
+            int slice = sliceIndex(subset1, subset2);
+            string suffix = to_string(subset1)+"_"+to_string(subset2);
+            parameterNames[2*slice] = "sliceEnergyAnalyzerCoulomb"+suffix;
+            parameterNames[2*slice+1] = "sliceEnergyAnalyzerLJ"+suffix;
+            for (int term = 0; term < 2; term++) {
+                copy->addGlobalParameter(parameterNames[2*slice+term], 1.0);
+                copy->addScalingParameter(parameterNames[2*slice+term], subset1, subset2, term == 0, term == 1);
+                copy->addScalingParameterDerivative(parameterNames[2*slice+term]);
+            }
+        }
+    this->system.addForce(copy);
+    context.reset(new Context(this->system, integrator, platform, properties));
+
+    // The positions of the frames are staged by the force without the context knowing about it, so it is
+    // told once that they have been set.
+
+    context->setPositions(vector<Vec3>(numParticles));
+}
+
+void SliceEnergyAnalyzer::setParameter(const string& name, double value) {
+    context->setParameter(name, value);
+}
+
+vector<double> SliceEnergyAnalyzer::computeSliceEnergies(const vector<double>& positions, const vector<double>& boxVectors) {
+    if (positions.size()%(3*numParticles) != 0)
+        throw OpenMMException("SliceEnergyAnalyzer: the number of coordinates is not a multiple of 3 times the number of particles");
+    int numFrames = positions.size()/(3*numParticles);
+    if (boxVectors.size() != 0 && boxVectors.size() != 9*numFrames)
+        throw OpenMMException("SliceEnergyAnalyzer: nine box vector components are required for each frame");
+    vector<double> energies(2*numSlices*numFrames);
+    if (numFrames > 0)
+        computeSliceEnergies(numFrames, &positions[0], boxVectors.size() != 0 ? &boxVectors[0] : NULL, &energies[0]);
+    return energies;
+}
+
+void SliceEnergyAnalyzer::computeSliceEnergies(int numFrames, const double* positions, const double* boxVectors, double* energies) {
+    if (numFrames == 0)
+        return;
+
+    // Without box vectors, the default ones are restored, since an earlier call may have changed them.
+
+    if (boxVectors == NULL) {
+        Vec3 a, b, c;
+        system.getDefaultPeriodicBoxVectors(a, b, c);
+        context->setPeriodicBoxVectors(a, b, c);
+    }
+
+    // The positions of each frame are copied to the device while the previous frame is computed, in
+    // one of two buffers that alternate between frames.
+
+    SlicedNonbondedForceImpl& impl = dynamic_cast<SlicedNonbondedForceImpl&>(copy->getImplInContext(*context));
+    ContextImpl& contextImpl = copy->getContextImpl(*context);
+    impl.stagePositions(contextImpl, positions);
+    for (int frame = 0; frame < numFrames; frame++) {
+        if (boxVectors != NULL) {
+            const double* box = boxVectors+9*frame;
+            context->setPeriodicBoxVectors(Vec3(box[0], box[1], box[2]), Vec3(box[3], box[4], box[5]), Vec3(box[6], box[7], box[8]));
+        }
+        impl.applyStagedPositions(contextImpl);
+        if (frame+1 < numFrames)
+            impl.stagePositions(contextImpl, positions+3*numParticles*(frame+1));
+        State state = context->getState(State::ParameterDerivatives);
+        const map<string, double>& derivatives = state.getEnergyParameterDerivatives();
+        for (int k = 0; k < 2*numSlices; k++)
+            energies[2*numSlices*frame+k] = derivatives.at(parameterNames[k]);
+    }
+}
@@ -0,0 +1,97 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/SliceEnergyWriter.h"
+#include "openmm/OpenMMException.h"
+#include <cstdint>
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+SliceEnergyWriter::SliceEnergyWriter(const vector<string>& names, const string& file, SlicedNonbondedForce::SliceEnergyCallback callback, int capacity) :
+        names(names), callback(callback), capacity(capacity), numSubmitted(0), lastStep(-1), finished(false) {
+    if (file != "") {
+        stream.open(file.c_str(), ios::out | ios::binary | ios::trunc);
+        if (!stream.is_open())
+            throw OpenMMException("SlicedNonbondedForce: cannot open slice energy report file "+file);
+        stream.write("NBSE", 4);
+        int32_t numValues = names.size();
+        stream.write((char*) &numValues, sizeof(int32_t));
+        for (const string& name : names) {
+            int32_t length = name.size();
+            stream.write((char*) &length, sizeof(int32_t));
+            stream.write(name.c_str(), length);
+        }
+        stream.flush();
+    }
+    thread = std::thread(&SliceEnergyWriter::run, this);
+}
+
+SliceEnergyWriter::~SliceEnergyWriter() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    condition.notify_all();
+    thread.join();
+    if (stream.is_open())
+        stream.close();
+}
+
+void SliceEnergyWriter::waitForCapacity() {
+    unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] {return (int) pending.size() < capacity;});
+}
+
+void SliceEnergyWriter::submit(long long step, Fetch fetch) {
+    unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] {return (int) pending.size() < capacity;});
+    pending.push_back(make_pair(step, fetch));
+    numSubmitted++;
+    lastStep = step;
+    lock.unlock();
+    condition.notify_all();
+}
+
+void SliceEnergyWriter::run() {
+    while (true) {
+        pair<long long, Fetch> report;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [&] {return finished || !pending.empty();});
+            if (pending.empty())
+                return;
+            report = pending.front();
+        }
+
+        // The report stays in the queue until it has been handled, so that the kernel does not
+        // reuse its staging buffer too early.
+
+        try {
+            vector<double> values = report.second();
+            if (stream.is_open()) {
+                int64_t step = report.first;
+                stream.write((char*) &step, sizeof(int64_t));
+                stream.write((char*) values.data(), values.size()*sizeof(double));
+            }
+            if (callback)
+                callback(report.first, values);
+        }
+        catch (...) {
+            // An exception cannot be propagated from this thread, so the report is discarded.
+        }
+        {
+            lock_guard<std::mutex> lock(mutex);
+            pending.pop_front();
+        }
+        condition.notify_all();
+    }
+}
@@ -0,0 +1,252 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#ifdef WIN32
+  #define _USE_MATH_DEFINES // Needed to get M_PI
+#endif
+#include "internal/SlicedDispersionCorrection.h"
+#include "internal/SlicedNonbondedForceImpl.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+namespace {
+
+// A particle class is defined by its base sigma and epsilon, its subset, and the global parameters
+// (with their scales) that offset its sigma and epsilon.
+
+typedef vector<pair<int, pair<double, double> > > OffsetList;
+typedef tuple<double, double, int, OffsetList> ParticleClass;
+
+struct ParticleClassHash {
+    size_t operator()(const ParticleClass& key) const {
+        hash<double> hashDouble;
+        size_t seed = hashDouble(get<0>(key));
+        auto combine = [&seed] (size_t value) {
+            seed ^= value + 0x9e3779b9 + (seed<<6) + (seed>>2);
+        };
+        combine(hashDouble(get<1>(key)));
+        combine(hash<int>()(get<2>(key)));
+        for (auto& offset : get<3>(key)) {
+            combine(hash<int>()(offset.first));
+            combine(hashDouble(offset.second.first));
+            combine(hashDouble(offset.second.second));
+        }
+        return seed;
+    }
+};
+
+void addMoments(double count, double sigma, double epsilon, double* moments, double& diagonal6, double& diagonal12) {
+    double factor = count*sqrt(epsilon);
+    for (int k = 0; k < 13; k++) {
+        moments[k] += factor;
+        factor *= sigma;
+    }
+    double sigma2 = sigma*sigma;
+    double sigma6 = sigma2*sigma2*sigma2;
+    diagonal6 += count*epsilon*sigma6;
+    diagonal12 += count*epsilon*sigma6*sigma6;
+}
+
+}
+
+SlicedDispersionCorrection::SlicedDispersionCorrection(const System& system, const SlicedNonbondedForce& force) {
+    numSubsets = force.getNumSubsets();
+    numSlices = force.getNumSlices();
+    fixedMoments.resize(numSubsets*NumMoments, 0.0);
+    fixedDiagonal6.resize(numSubsets, 0.0);
+    fixedDiagonal12.resize(numSubsets, 0.0);
+    coefficients.resize(numSlices, 0.0);
+    if (force.getNonbondedMethod() == SlicedNonbondedForce::NoCutoff ||
+        force.getNonbondedMethod() == SlicedNonbondedForce::CutoffNonPeriodic)
+        return;
+
+    // Collect the offsets of sigma and epsilon for every particle.
+
+    int numParticles = system.getNumParticles();
+    vector<OffsetList> offsets(numParticles);
+    for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
+        string parameter;
+        int index;
+        double chargeScale, sigmaScale, epsilonScale;
+        force.getParticleParameterOffset(i, parameter, index, chargeScale, sigmaScale, epsilonScale);
+        if (sigmaScale == 0.0 && epsilonScale == 0.0)
+            continue;
+        auto position = find(paramNames.begin(), paramNames.end(), parameter);
+        int paramIndex = position-paramNames.begin();
+        if (position == paramNames.end())
+            paramNames.push_back(parameter);
+        offsets[index].push_back(make_pair(paramIndex, make_pair(sigmaScale, epsilonScale)));
+    }
+    for (OffsetList& list : offsets)
+        sort(list.begin(), list.end());
+    map<string, double> defaults;
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        defaults[force.getGlobalParameterName(i)] = force.getGlobalParameterDefaultValue(i);
+    for (const string& name : paramNames)
+        paramValues.push_back(defaults[name]);
+
+    // Identify all particle classes and count the number of particles in each class.
+
+    vector<int> subsets = force.getParticleSubsets();
+    unordered_map<ParticleClass, int, ParticleClassHash> classCounts;
+    for (int i = 0; i < numParticles; i++) {
+        double charge, sigma, epsilon;
+        force.getParticleParameters(i, charge, sigma, epsilon);
+        classCounts[make_tuple(sigma, epsilon, subsets[i], offsets[i])]++;
+    }
+
+    // The classes without offsets contribute fixed moments.  The others are kept for the updates,
+    // and the class of each particle is recorded so that it can be moved to another subset.
+
+    unordered_map<ParticleClass, int, ParticleClassHash> classIndices;
+    for (auto& entry : classCounts) {
+        double sigma = get<0>(entry.first);
+        double epsilon = get<1>(entry.first);
+        int subset = get<2>(entry.first);
+        const OffsetList& list = get<3>(entry.first);
+        if (list.empty())
+            addMoments(entry.second, sigma, epsilon, &fixedMoments[subset*NumMoments], fixedDiagonal6[subset], fixedDiagonal12[subset]);
+        else {
+            VariableClass variable = {sigma, epsilon, (double) entry.second, subset, list};
+            classIndices[entry.first] = variableClasses.size();
+            variableClasses.push_back(variable);
+        }
+    }
+    particleClasses.resize(numParticles, -1);
+    for (int i = 0; i < numParticles; i++)
+        if (!offsets[i].empty()) {
+            double charge, sigma, epsilon;
+            force.getParticleParameters(i, charge, sigma, epsilon);
+            particleClasses[i] = classIndices[make_tuple(sigma, epsilon, subsets[i], offsets[i])];
+        }
+
+    // Compute the factors that multiply the sums over pairs.  The number of interactions includes
+    // the self interactions, as in NonbondedForce.
+
+    double cutoff = force.getCutoffDistance();
+    double numInteractions = 0.5*numParticles*(numParticles+1.0);
+    prefactor = 8*M_PI*numParticles*numParticles/numInteractions;
+    c12 = 1/(9*pow(cutoff, 9));
+    c6 = -1/(3*pow(cutoff, 3));
+    if (force.getUseSwitchingFunction()) {
+        double switchDist = force.getSwitchingDistance();
+        double upper12, upper6, lower12, lower6;
+        SlicedNonbondedForceImpl::evalIntegralCoefficients(cutoff, switchDist, cutoff, upper12, upper6);
+        SlicedNonbondedForceImpl::evalIntegralCoefficients(switchDist, switchDist, cutoff, lower12, lower6);
+        c12 += upper12-lower12;
+        c6 += upper6-lower6;
+    }
+    computeCoefficients();
+}
+
+bool SlicedDispersionCorrection::update(ContextImpl& context) {
+    bool changed = false;
+    for (int i = 0; i < paramNames.size(); i++) {
+        double value = context.getParameter(paramNames[i]);
+        if (value != paramValues[i]) {
+            paramValues[i] = value;
+            changed = true;
+        }
+    }
+    if (changed)
+        computeCoefficients();
+    return changed;
+}
+
+void SlicedDispersionCorrection::moveParticles(const SlicedNonbondedForce& force, const vector<int>& particles, const vector<int>& oldSubsets) {
+    if (particleClasses.size() == 0)
+        return; // There is no correction with this nonbonded method.
+    for (int k = 0; k < particles.size(); k++) {
+        int particle = particles[k];
+        int oldSubset = oldSubsets[k];
+        int newSubset = force.getParticleSubset(particle);
+        if (newSubset == oldSubset)
+            continue;
+        int index = particleClasses[particle];
+        if (index == -1) {
+            double charge, sigma, epsilon;
+            force.getParticleParameters(particle, charge, sigma, epsilon);
+            addMoments(-1, sigma, epsilon, &fixedMoments[oldSubset*NumMoments], fixedDiagonal6[oldSubset], fixedDiagonal12[oldSubset]);
+            addMoments(1, sigma, epsilon, &fixedMoments[newSubset*NumMoments], fixedDiagonal6[newSubset], fixedDiagonal12[newSubset]);
+        }
+        else {
+            // Move the particle to the class that only differs from its current one by the subset,
+            // which is created if needed.  Emptied classes are kept, since they contribute nothing.
+
+            VariableClass moved = variableClasses[index];
+            variableClasses[index].count -= 1;
+            moved.subset = newSubset;
+            moved.count = 1;
+            int target = -1;
+            for (int j = 0; j < variableClasses.size() && target == -1; j++) {
+                const VariableClass& variable = variableClasses[j];
+                if (variable.subset == newSubset && variable.sigma == moved.sigma && variable.epsilon == moved.epsilon && variable.offsets == moved.offsets)
+                    target = j;
+            }
+            if (target == -1) {
+                target = variableClasses.size();
+                variableClasses.push_back(moved);
+            }
+            else
+                variableClasses[target].count += 1;
+            particleClasses[particle] = target;
+        }
+    }
+    computeCoefficients();
+}
+
+void SlicedDispersionCorrection::computeCoefficients() {
+    vector<double> moments = fixedMoments, diagonal6 = fixedDiagonal6, diagonal12 = fixedDiagonal12;
+    for (const VariableClass& variable : variableClasses) {
+        double sigma = variable.sigma, epsilon = variable.epsilon;
+        for (auto& offset : variable.offsets) {
+            sigma += paramValues[offset.first]*offset.second.first;
+            epsilon += paramValues[offset.first]*offset.second.second;
+        }
+        addMoments(variable.count, sigma, epsilon, &moments[variable.subset*NumMoments], diagonal6[variable.subset], diagonal12[variable.subset]);
+    }
+
+    // The sum of sqrt(epsilon1*epsilon2)*((sigma1+sigma2)/2)^n over all pairs of particles from
+    // subsets s1 and s2 is the binomial sum of products of their moments.  Within a subset, each
+    // unordered pair must be counted once, which requires adding the self interactions and halving.
+
+    double binomial6[7], binomial12[13];
+    binomial6[0] = binomial12[0] = 1;
+    for (int k = 1; k <= 12; k++) {
+        binomial12[k] = binomial12[k-1]*(13-k)/k;
+        if (k <= 6)
+            binomial6[k] = binomial6[k-1]*(7-k)/k;
+    }
+    for (int s1 = 0; s1 < numSubsets; s1++)
+        for (int s2 = 0; s2 <= s1; s2++) {
+            const double* m1 = &moments[s1*NumMoments];
+            const double* m2 = &moments[s2*NumMoments];
+            double sum6 = 0, sum12 = 0;
+            for (int k = 0; k <= 6; k++)
+                sum6 += binomial6[k]*m1[k]*m2[6-k];
+            for (int k = 0; k <= 12; k++)
+                sum12 += binomial12[k]*m1[k]*m2[12-k];
+            sum6 /= 64;
+            sum12 /= 4096;
+            if (s1 == s2) {
+                sum6 = 0.5*(sum6+diagonal6[s1]);
+                sum12 = 0.5*(sum12+diagonal12[s1]);
+            }
+            coefficients[sliceIndex(s1, s2)] = prefactor*(c12*sum12 + c6*sum6);
+        }
+}
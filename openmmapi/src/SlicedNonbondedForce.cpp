@@ -12,6 +12,8 @@
 #include "internal/SlicedNonbondedForceImpl.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/OpenMMException.h"
+#include "openmm/Context.h"
+#include "openmm/State.h"
 #include <string.h>
 #include <algorithm>
 #include <iostream>
@@ -29,10 +31,12 @@ using namespace NonbondedSlicing;
 }
 
 SlicedNonbondedForce::SlicedNonbondedForce(int numSubsets) :
-    NonbondedForce(), numSubsets(numSubsets), useCudaFFT(false) {
+    NonbondedForce(), numSubsets(numSubsets), useCudaFFT(false), skipDecoupledSlices(false), useCudaGraphs(false), autotunePME(false), autoselectFFT(false), profileStages(false), useCompactPMEGrids(false), useEnergyCache(false), useDerivativesOnDemand(false), useCpuPme(false), useConcurrentLJPME(false), useOptimalInfluenceFunction(false), useLoadBalancing(false), useCachedBSplines(false), useSliceForces(false), useSliceEnergies(false), useTreeCode(false), treeCodeOpeningAngle(0.3), smallSubsetThreshold(0), pmeInterpolationOrder(5), sliceEnergyReportInterval(0) {
+    sliceForceGroups.resize(getNumSlices(), -1);
+    sliceReciprocalSpaceForceGroups.resize(getNumSlices(), -1);
 }
 
-SlicedNonbondedForce::SlicedNonbondedForce(const NonbondedForce& force, int numSubsets) : SlicedNonbondedForce(numSubsets) {
+SlicedNonbondedForce::SlicedNonbondedForce(const NonbondedForce& force, int numSubsets, const vector<int>& subsets) : SlicedNonbondedForce(numSubsets) {
     setForceGroup(force.getForceGroup());
     setName(force.getName());
     setNonbondedMethod((SlicedNonbondedForce::NonbondedMethod) force.getNonbondedMethod());
@@ -61,6 +65,8 @@ SlicedNonbondedForce::SlicedNonbondedForce(const NonbondedForce& force, int numS
         force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
         addException(particle1, particle2, chargeProd, sigma, epsilon);
     }
+    if (subsets.size() > 0)
+        setParticleSubsets(subsets);
     setExceptionsUsePeriodicBoundaryConditions(force.getExceptionsUsePeriodicBoundaryConditions());
     for (int i = 0; i < force.getNumGlobalParameters(); i++)
         addGlobalParameter(force.getGlobalParameterName(i), force.getGlobalParameterDefaultValue(i));
@@ -101,13 +107,76 @@ string SlicedNonbondedForce::getNonbondedMethodName() const {
 void SlicedNonbondedForce::setParticleSubset(int index, int subset) {
     ASSERT_VALID("Index", index, getNumParticles());
     ASSERT_VALID("Subset", subset, numSubsets);
+    if (index >= subsets.size())
+        subsets.resize(getNumParticles(), 0);
     subsets[index] = subset;
 }
 
 int SlicedNonbondedForce::getParticleSubset(int index) const {
     ASSERT_VALID("Index", index, getNumParticles());
-    auto element = subsets.find(index);
-    return element == subsets.end() ? 0 : element->second;
+    return index < subsets.size() ? subsets[index] : 0;
+}
+
+void SlicedNonbondedForce::setParticleSubsets(const vector<int>& subsets) {
+    if (subsets.size() != getNumParticles())
+        throwException(__FILE__, __LINE__, "The number of subsets must be equal to the number of particles");
+    for (int subset : subsets)
+        ASSERT_VALID("Subset", subset, numSubsets);
+    this->subsets = subsets;
+}
+
+int SlicedNonbondedForce::getSliceForceGroup(int slice) const {
+    ASSERT_VALID("Slice", slice, getNumSlices());
+    return sliceForceGroups[slice];
+}
+
+void SlicedNonbondedForce::setSliceForceGroup(int slice, int group) {
+    ASSERT_VALID("Slice", slice, getNumSlices());
+    if (group < -1 || group > 31)
+        throwException(__FILE__, __LINE__, "Force group must be between -1 and 31");
+    sliceForceGroups[slice] = group;
+}
+
+int SlicedNonbondedForce::getSliceReciprocalSpaceForceGroup(int slice) const {
+    ASSERT_VALID("Slice", slice, getNumSlices());
+    return sliceReciprocalSpaceForceGroups[slice];
+}
+
+void SlicedNonbondedForce::setSliceReciprocalSpaceForceGroup(int slice, int group) {
+    ASSERT_VALID("Slice", slice, getNumSlices());
+    if (group < -1 || group > 31)
+        throwException(__FILE__, __LINE__, "Force group must be between -1 and 31");
+    sliceReciprocalSpaceForceGroups[slice] = group;
+}
+
+void SlicedNonbondedForce::setSmallSubsetThreshold(int threshold) {
+    if (threshold < 0)
+        throwException(__FILE__, __LINE__, "The small subset threshold cannot be negative");
+    smallSubsetThreshold = threshold;
+}
+
+void SlicedNonbondedForce::setTreeCodeOpeningAngle(double angle) {
+    if (angle <= 0.0 || angle > 1.0)
+        throwException(__FILE__, __LINE__, "The tree code opening angle must be greater than 0 and at most 1");
+    treeCodeOpeningAngle = angle;
+}
+
+void SlicedNonbondedForce::setPMEInterpolationOrder(int order) {
+    if (order < 3)
+        throwException(__FILE__, __LINE__, "The PME interpolation order must be at least 3");
+    pmeInterpolationOrder = order;
+}
+
+void SlicedNonbondedForce::setSliceEnergyReportInterval(int steps) {
+    if (steps < 0)
+        throwException(__FILE__, __LINE__, "The slice energy report interval cannot be negative");
+    sliceEnergyReportInterval = steps;
+}
+
+vector<int> SlicedNonbondedForce::getParticleSubsets() const {
+    vector<int> result(subsets.begin(), subsets.begin()+min((int) subsets.size(), getNumParticles()));
+    result.resize(getNumParticles(), 0);
+    return result;
 }
 
 int SlicedNonbondedForce::getGlobalParameterIndex(const string& parameter) const {
@@ -196,10 +265,133 @@ void SlicedNonbondedForce::getPMEParametersInContext(const Context& context, dou
     dynamic_cast<const SlicedNonbondedForceImpl&>(getImplInContext(context)).getPMEParameters(alpha, nx, ny, nz);
 }
 
+map<string, double> SlicedNonbondedForce::getStageTimingsInContext(const Context& context) const {
+    return dynamic_cast<const SlicedNonbondedForceImpl&>(getImplInContext(context)).getStageTimings();
+}
+
+long long SlicedNonbondedForce::getPMEGridMemorySavingsInContext(const Context& context) const {
+    return dynamic_cast<const SlicedNonbondedForceImpl&>(getImplInContext(context)).getPMEGridMemorySavings();
+}
+
+map<string, long long> SlicedNonbondedForce::getMemoryUsageInContext(const Context& context) const {
+    return dynamic_cast<const SlicedNonbondedForceImpl&>(getImplInContext(context)).getMemoryUsage();
+}
+
+map<string, long long> SlicedNonbondedForce::estimateMemoryUsage(const System& system, const string& precision, int numThreadBlocks) const {
+    if (getNumParticles() != system.getNumParticles())
+        throw OpenMMException("estimateMemoryUsage: The force must have exactly as many particles as the System");
+    return SlicedNonbondedForceImpl::estimateMemoryUsage(system, *this, precision, numThreadBlocks);
+}
+
+string SlicedNonbondedForce::getFFTBackendInContext(const Context& context) const {
+    return dynamic_cast<const SlicedNonbondedForceImpl&>(getImplInContext(context)).getFFTBackendName();
+}
+
+string SlicedNonbondedForce::getTunedConfigurationInContext(const Context& context) const {
+    string configuration = dynamic_cast<const SlicedNonbondedForceImpl&>(getImplInContext(context)).getTunedConfiguration();
+    return SlicedNonbondedForceImpl::mergeTunedConfigurations(tunedConfiguration, configuration);
+}
+
 void SlicedNonbondedForce::getLJPMEParametersInContext(const Context& context, double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const SlicedNonbondedForceImpl&>(getImplInContext(context)).getLJPMEParameters(alpha, nx, ny, nz);
 }
 
 void SlicedNonbondedForce::updateParametersInContext(Context& context) {
     dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).updateParametersInContext(getContextImpl(context));
-}
\ No newline at end of file
+}
+
+void SlicedNonbondedForce::reassignSubsetsInContext(Context& context, const vector<int>& particles, const vector<int>& subsets) {
+    if (particles.size() != subsets.size())
+        throw OpenMMException("reassignSubsetsInContext: The numbers of particles and subsets must be equal");
+    for (int k = 0; k < particles.size(); k++)
+        setParticleSubset(particles[k], subsets[k]);
+    dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).reassignSubsets(getContextImpl(context), particles);
+}
+
+vector<double> SlicedNonbondedForce::computeStateEnergiesInContext(Context& context, const vector<string>& parameters, const vector<vector<double>>& states) {
+    for (const string& name : parameters) {
+        getScalingParameterIndex(name);
+        if (count(parameters.begin(), parameters.end(), name) > 1)
+            throw OpenMMException("computeStateEnergiesInContext: Scaling parameter '"+name+"' is given more than once");
+    }
+    for (auto& values : states)
+        if (values.size() != parameters.size())
+            throw OpenMMException("computeStateEnergiesInContext: Each state must contain one value per given parameter");
+
+    // Find which of the given parameters multiplies each term of each slice.  The other terms keep the
+    // scaling factors of the evaluation.
+
+    vector<int> columns(2*getNumSlices(), -1);
+    for (auto& info : scalingParameters) {
+        int column = find(parameters.begin(), parameters.end(), getGlobalParameterName(info.globalParamIndex))-parameters.begin();
+        if (column == parameters.size())
+            continue;
+        if (info.includeCoulomb)
+            columns[2*info.getSlice()] = column;
+        if (info.includeLJ)
+            columns[2*info.getSlice()+1] = column;
+    }
+
+    // The energy is linear in the scaling factors, so the slice energies of a single evaluation
+    // determine the energy at any other combination of values.
+
+    SlicedNonbondedForceImpl& impl = dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context));
+    context.getState(State::Energy, false, SlicedNonbondedForceImpl::calcForceGroupsMask(*this));
+    vector<double> sliceEnergies, sliceLambdas;
+    impl.getSliceEnergies(sliceEnergies, sliceLambdas);
+    vector<double> energies;
+    for (auto& values : states) {
+        double energy = 0.0;
+        for (int i = 0; i < columns.size(); i++)
+            energy += (columns[i] == -1 ? sliceLambdas[i] : values[columns[i]])*sliceEnergies[i];
+        energies.push_back(energy);
+    }
+    return energies;
+}
+
+vector<double> SlicedNonbondedForce::getSliceEnergiesInContext(Context& context) {
+    SlicedNonbondedForceImpl& impl = dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context));
+    context.getState(State::Energy, false, SlicedNonbondedForceImpl::calcForceGroupsMask(*this));
+    vector<double> energies, lambdas;
+    impl.getSliceEnergies(energies, lambdas);
+    return energies;
+}
+
+vector<Vec3> SlicedNonbondedForce::getSliceForcesInContext(Context& context, int slice) {
+    ASSERT_VALID("Slice", slice, getNumSlices());
+    SlicedNonbondedForceImpl& impl = dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context));
+
+    // The slice forces are accumulated along with the total force, so an evaluation is only needed if
+    // none has computed forces since the context was created.
+
+    vector<Vec3> forces;
+    if (!impl.getSliceForces(slice, forces)) {
+        context.getState(State::Forces, false, SlicedNonbondedForceImpl::calcForceGroupsMask(*this));
+        impl.getSliceForces(slice, forces);
+    }
+    return forces;
+}
+
+void SlicedNonbondedForce::setScalingParameterScheduleInContext(Context& context, const vector<string>& parameters, const vector<vector<double>>& schedule) {
+    vector<string> derivatives;
+    for (int i = 0; i < getNumScalingParameterDerivatives(); i++)
+        derivatives.push_back(getScalingParameterDerivativeName(i));
+    for (const string& name : parameters) {
+        getScalingParameterIndex(name);
+        if (find(derivatives.begin(), derivatives.end(), name) == derivatives.end())
+            throw OpenMMException("setScalingParameterScheduleInContext: No derivative has been requested for scaling parameter '"+name+"'");
+        if (count(parameters.begin(), parameters.end(), name) > 1)
+            throw OpenMMException("setScalingParameterScheduleInContext: Scaling parameter '"+name+"' is scheduled more than once");
+    }
+    if (parameters.size() > 0 && schedule.size() == 0)
+        throw OpenMMException("setScalingParameterScheduleInContext: The schedule must contain at least one step");
+    for (auto& values : schedule)
+        if (values.size() != parameters.size())
+            throw OpenMMException("setScalingParameterScheduleInContext: Each step must contain one value per scheduled parameter");
+    SlicedNonbondedForceImpl& impl = dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context));
+    impl.setScalingParameterSchedule(getContextImpl(context), parameters, parameters.size() > 0 ? schedule : vector<vector<double>>());
+}
+
+double SlicedNonbondedForce::getProtocolWorkInContext(Context& context) {
+    return dynamic_cast<SlicedNonbondedForceImpl&>(getImplInContext(context)).getProtocolWork();
+}
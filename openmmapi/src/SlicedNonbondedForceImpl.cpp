@@ -12,26 +12,45 @@
   #define _USE_MATH_DEFINES // Needed to get M_PI
 #endif
 #include "internal/SlicedNonbondedForceImpl.h"
+#include "internal/SlicedDispersionCorrection.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/ContextImpl.h"
 #include "NonbondedSlicingKernels.h"
+#include "openmm/kernels.h"
 #include <cmath>
 #include <map>
+#include <set>
 #include <sstream>
+#include <stdexcept>
 #include <algorithm>
 
 using namespace NonbondedSlicing;
 using namespace OpenMM;
 using namespace std;
 
-SlicedNonbondedForceImpl::SlicedNonbondedForceImpl(const SlicedNonbondedForce& owner) : NonbondedForceImpl(owner), owner(owner) {
+SlicedNonbondedForceImpl::SlicedNonbondedForceImpl(const SlicedNonbondedForce& owner) : NonbondedForceImpl(owner), owner(owner),
+        trivialSlicing(false), useSliceForceGroups(false), useSliceForces(false), useSliceEnergies(false), directGroupsMask(0), reciprocalGroupsMask(0) {
 }
 
 SlicedNonbondedForceImpl::~SlicedNonbondedForceImpl() {
 }
 
 void SlicedNonbondedForceImpl::initialize(ContextImpl& context) {
-    kernel = context.getPlatform().createKernel(CalcSlicedNonbondedForceKernel::Name(), context);
+    trivialSlicing = isSlicingTrivial(owner);
+    useSliceForceGroups = hasSliceForceGroups(owner);
+    useSliceForces = owner.getUseSliceForces();
+    useSliceEnergies = owner.getUseSliceEnergies();
+    vector<int> directGroups, reciprocalGroups;
+    getSliceForceGroups(owner, directGroups, reciprocalGroups);
+    directGroupsMask = reciprocalGroupsMask = 0;
+    for (int slice = 0; slice < owner.getNumSlices(); slice++) {
+        directGroupsMask |= 1<<directGroups[slice];
+        reciprocalGroupsMask |= 1<<reciprocalGroups[slice];
+    }
+    if (trivialSlicing)
+        kernel = context.getPlatform().createKernel(CalcNonbondedForceKernel::Name(), context);
+    else
+        kernel = context.getPlatform().createKernel(CalcSlicedNonbondedForceKernel::Name(), context);
 
     // Check for errors in the specification of exceptions.
 
@@ -129,34 +148,479 @@ void SlicedNonbondedForceImpl::initialize(ContextImpl& context) {
         if (offsetParams.find(parameter) != offsetParams.end())
             throw OpenMMException("SlicedNonbondedForce: Cannot use a global parameter for both slice energy scaling and parameter offset.");
     }
-    kernel.getAs<CalcSlicedNonbondedForceKernel>().initialize(context.getSystem(), owner);
+    if (trivialSlicing)
+        kernel.getAs<CalcNonbondedForceKernel>().initialize(context.getSystem(), owner);
+    else
+        kernel.getAs<CalcSlicedNonbondedForceKernel>().initialize(context.getSystem(), owner);
 }
 
-double SlicedNonbondedForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
-    bool includeDirect = (owner.getIncludeDirectSpace() && (groups&(1<<owner.getForceGroup())) != 0);
-    int reciprocalGroup = owner.getReciprocalSpaceForceGroup();
+bool SlicedNonbondedForceImpl::isSlicingTrivial(const SlicedNonbondedForce& force) {
+    // Without scaling parameters, every slice has unit weight and no derivatives can be requested, so
+    // the force is just a NonbondedForce, unless some option selects an evaluation path of its own.
+
+    return force.getNumScalingParameters() == 0 && !hasSliceForceGroups(force) && !hasNonstandardEvaluation(force);
+}
+
+bool SlicedNonbondedForceImpl::hasNonstandardEvaluation(const SlicedNonbondedForce& force) {
+    // Every option that changes the evaluation path must be listed here.  Those that only act on scaling
+    // parameters or their derivatives (such as the energy cache, derivatives on demand, skipping of
+    // decoupled slices, and slice energy reports) are inert when there are none, and are omitted.
+
+    SlicedNonbondedForce::NonbondedMethod method = force.getNonbondedMethod();
+    bool usesPME = (method == SlicedNonbondedForce::PME || method == SlicedNonbondedForce::LJPME);
+    vector<bool> nonstandardOptions = {
+        force.getProfileStages(),
+        force.getUseLoadBalancing(),
+        usesPME && force.getUseCudaFFT(),
+        usesPME && force.getUseCudaGraphs(),
+        usesPME && force.getAutotunePME(),
+        usesPME && force.getAutoselectFFT(),
+        usesPME && force.getUseCompactPMEGrids(),
+        usesPME && force.getUseCpuPme(),
+        usesPME && force.getUseOptimalInfluenceFunction(),
+        usesPME && force.getUseCachedBSplines(),
+        force.getUseSliceForces(),
+        force.getUseSliceEnergies(),
+        usesPME && force.getSmallSubsetThreshold() != 0,
+        usesPME && force.getPMEInterpolationOrder() != 5,
+        usesPME && force.getTunedConfiguration() != "",
+        method == SlicedNonbondedForce::LJPME && force.getUseConcurrentLJPME(),
+        method == SlicedNonbondedForce::NoCutoff && force.getUseTreeCode()
+    };
+    return find(nonstandardOptions.begin(), nonstandardOptions.end(), true) != nonstandardOptions.end();
+}
+
+void SlicedNonbondedForceImpl::getSliceForceGroups(const SlicedNonbondedForce& force, vector<int>& directGroups, vector<int>& reciprocalGroups) {
+    int forceGroup = force.getForceGroup();
+    int reciprocalGroup = force.getReciprocalSpaceForceGroup();
     if (reciprocalGroup < 0)
-        reciprocalGroup = owner.getForceGroup();
-    bool includeReciprocal = ((groups&(1<<reciprocalGroup)) != 0);
-    return kernel.getAs<CalcSlicedNonbondedForceKernel>().execute(context, includeForces, includeEnergy, includeDirect, includeReciprocal);
+        reciprocalGroup = forceGroup;
+    int numSlices = force.getNumSlices();
+    directGroups.resize(numSlices);
+    reciprocalGroups.resize(numSlices);
+    for (int slice = 0; slice < numSlices; slice++) {
+        directGroups[slice] = force.getSliceForceGroup(slice);
+        if (directGroups[slice] < 0)
+            directGroups[slice] = forceGroup;
+        reciprocalGroups[slice] = force.getSliceReciprocalSpaceForceGroup(slice);
+        if (reciprocalGroups[slice] < 0)
+            reciprocalGroups[slice] = reciprocalGroup;
+    }
+}
+
+bool SlicedNonbondedForceImpl::hasSliceForceGroups(const SlicedNonbondedForce& force) {
+    vector<int> directGroups, reciprocalGroups;
+    getSliceForceGroups(force, directGroups, reciprocalGroups);
+    for (int slice = 1; slice < force.getNumSlices(); slice++)
+        if (directGroups[slice] != directGroups[0] || reciprocalGroups[slice] != reciprocalGroups[0])
+            return true;
+    return false;
+}
+
+int SlicedNonbondedForceImpl::calcForceGroupsMask(const SlicedNonbondedForce& force) {
+    vector<int> directGroups, reciprocalGroups;
+    getSliceForceGroups(force, directGroups, reciprocalGroups);
+    int groups = 0;
+    for (int slice = 0; slice < force.getNumSlices(); slice++)
+        groups |= (1<<directGroups[slice]) | (1<<reciprocalGroups[slice]);
+    return groups;
+}
+
+vector<int> SlicedNonbondedForceImpl::calcEffectiveSlices(const SlicedNonbondedForce& force) {
+    // Slices multiplied by the same Coulomb and Lennard-Jones scaling parameters (or by none at all)
+    // can have their energies accumulated together, since they only differ in the pairs involved.
+    // Their reciprocal space energies must also be included in the same force evaluations.  With
+    // slice energies, no slices are merged, since the energy of each one is needed.
+
+    int numSlices = force.getNumSlices();
+    vector<int> effectiveSlices(numSlices);
+    if (force.getUseSliceEnergies()) {
+        for (int slice = 0; slice < numSlices; slice++)
+            effectiveSlices[slice] = slice;
+        return effectiveSlices;
+    }
+    vector<int> directGroups, reciprocalGroups;
+    getSliceForceGroups(force, directGroups, reciprocalGroups);
+    vector<pair<pair<string, string>, int> > sliceParams(numSlices);
+    for (int index = 0; index < force.getNumScalingParameters(); index++) {
+        string parameter;
+        int subset1, subset2;
+        bool includeCoulomb, includeLJ;
+        force.getScalingParameter(index, parameter, subset1, subset2, includeCoulomb, includeLJ);
+        int slice = sliceIndex(subset1, subset2);
+        if (includeCoulomb)
+            sliceParams[slice].first.first = parameter;
+        if (includeLJ)
+            sliceParams[slice].first.second = parameter;
+    }
+    for (int slice = 0; slice < numSlices; slice++)
+        sliceParams[slice].second = reciprocalGroups[slice];
+    map<pair<pair<string, string>, int>, int> groups;
+    for (int slice = 0; slice < numSlices; slice++) {
+        auto group = groups.find(sliceParams[slice]);
+        if (group == groups.end())
+            group = groups.insert(make_pair(sliceParams[slice], (int) groups.size())).first;
+        effectiveSlices[slice] = group->second;
+    }
+    return effectiveSlices;
+}
+
+void SlicedNonbondedForceImpl::calcPMEParameters(const System& system, const SlicedNonbondedForce& force, double& alpha, int& xsize, int& ysize, int& zsize, bool lj) {
+    NonbondedForceImpl::calcPMEParameters(system, force, alpha, xsize, ysize, zsize, lj);
+    double givenAlpha;
+    int nx, ny, nz;
+    if (lj)
+        force.getLJPMEParameters(givenAlpha, nx, ny, nz);
+    else
+        force.getPMEParameters(givenAlpha, nx, ny, nz);
+    int order = force.getPMEInterpolationOrder();
+    bool optimalInfluence = force.getUseOptimalInfluenceFunction();
+    if (givenAlpha != 0.0 || (order == 5 && !optimalInfluence))
+        return;
+
+    // NonbondedForceImpl chooses the grid for fifth order B-splines and the smooth PME influence function,
+    // so that the error tolerance means only what it means there.  For any other order or influence
+    // function, the grid is scaled uniformly to the smallest size whose estimated force error does not
+    // exceed that of the fifth order grid.  The optimal influence function minimizes the error in the
+    // energies, which drops by an order of magnitude or more, but it reduces that in the forces much
+    // less, so that the grids are at most slightly coarser.
+
+    Vec3 boxVectors[3];
+    system.getDefaultPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
+    int fifthOrderSize[3] = {xsize, ysize, zsize};
+    int longest = max(xsize, max(ysize, zsize));
+    int minimum = max(6, order);
+    auto scaledSize = [&] (int points, int size[3]) {
+        for (int i = 0; i < 3; i++)
+            size[i] = max((int) ceil(fifthOrderSize[i]*(double) points/longest), minimum);
+    };
+    double maxError = estimatePmeForceError(boxVectors, alpha, fifthOrderSize, 5, false, lj);
+    auto meetsTolerance = [&] (int points) {
+        int size[3];
+        scaledSize(points, size);
+        return (estimatePmeForceError(boxVectors, alpha, size, order, optimalInfluence, lj) <= maxError);
+    };
+    int lower = 0, upper = longest;
+    while (!meetsTolerance(upper)) {
+        lower = upper;
+        upper *= 2;
+    }
+    while (upper-lower > 1) {
+        int points = (lower+upper)/2;
+        if (meetsTolerance(points))
+            upper = points;
+        else
+            lower = points;
+    }
+    int size[3];
+    scaledSize(upper, size);
+    xsize = size[0];
+    ysize = size[1];
+    zsize = size[2];
+}
+
+/**
+ * The largest number of nonnegative frequencies along each axis included in the estimate of the PME error.
+ */
+static const int MaxPmeErrorFrequencies = 32;
+
+/**
+ * The Fourier transforms of the B-splines along one axis of the grid, for the frequencies 2*pi*m/length
+ * with m from 0 to n/2 and their aliases.  The frequencies farther than InfluenceFunctionAliases grid
+ * periods are neglected, as for the optimal influence function.
+ */
+struct PmeAxisTransforms {
+    vector<double> frequency, primary, moduli, aliasSquares, aliasSquaredFrequencies;
+    PmeAxisTransforms(int n, double length, int order) {
+        const int aliases = SlicedNonbondedForceImpl::InfluenceFunctionAliases;
+        for (int m = 0; m <= n/2; m++) {
+            double theta = M_PI*m/n, sum = 0, squares = 0, squaredFrequencies = 0;
+            for (int a = -aliases; a <= aliases; a++) {
+                double x = theta+M_PI*a;
+                double w = (x == 0 ? 1.0 : pow(sin(x)/x, order));
+                sum += w;
+                if (a == 0)
+                    primary.push_back(w);
+                else {
+                    squares += w*w;
+                    squaredFrequencies += w*w*(2*x*n/length)*(2*x*n/length);
+                }
+            }
+            frequency.push_back(2*M_PI*m/length);
+            moduli.push_back(sum*sum);
+            aliasSquares.push_back(squares);
+            aliasSquaredFrequencies.push_back(squaredFrequencies);
+        }
+
+        // The moduli vanish at the Nyquist frequency for odd orders, in which case PME replaces them by
+        // the average of their neighbors.
+
+        for (int m = 1; m <= n/2; m++)
+            if (moduli[m] < 1e-7)
+                moduli[m] = (2*m == n ? moduli[m-1] : 0.5*(moduli[m-1]+moduli[m+1]));
+    }
+};
+
+double SlicedNonbondedForceImpl::estimatePmeForceError(const Vec3 boxVectors[3], double alpha, const int gridSize[3], int order,
+                                                       bool optimalInfluence, bool lj) {
+    vector<PmeAxisTransforms> axes;
+    for (int i = 0; i < 3; i++)
+        axes.push_back(PmeAxisTransforms(gridSize[i], boxVectors[i][i], order));
+
+    // With the transforms w(k) of the B-splines along all axes and the influence function G(k), the pair
+    // force component at alias k' of frequency k is G(k)*w(k')*w(k'')*k' for every alias k'', while the
+    // exact one is phi(k')*k' at alias k' = k'' only.  Each error term is written so that it does not
+    // depend on the cancellation of large terms, since the aliases are small at low frequencies.  On fine
+    // grids, the terms vary slowly between neighboring frequencies, so that only every stride-th one
+    // along each axis is included, with a proportionally larger weight.
+
+    int stride[3];
+    for (int i = 0; i < 3; i++)
+        stride[i] = max(1, gridSize[i]/(2*MaxPmeErrorFrequencies));
+    double error = 0.0;
+    int m[3];
+    for (m[0] = 0; m[0] <= gridSize[0]/2; m[0] += stride[0])
+        for (m[1] = 0; m[1] <= gridSize[1]/2; m[1] += stride[1])
+            for (m[2] = 0; m[2] <= gridSize[2]/2; m[2] += stride[2]) {
+                if (m[0] == 0 && m[1] == 0 && m[2] == 0)
+                    continue;
+
+                // The frequency stands for all those with the same components up to their signs.
+
+                double weight = 1.0, k2 = 0.0, logRatio = 0.0;
+                double primary[3], aliases[3], primaryFrequencies[3], aliasFrequencies[3];
+                for (int i = 0; i < 3; i++) {
+                    const PmeAxisTransforms& axis = axes[i];
+                    if (m[i] > 0 && 2*m[i] != gridSize[i])
+                        weight *= 2;
+                    weight *= stride[i];
+                    double k = axis.frequency[m[i]];
+                    k2 += k*k;
+                    primary[i] = axis.primary[m[i]]*axis.primary[m[i]];
+                    aliases[i] = axis.aliasSquares[m[i]];
+                    primaryFrequencies[i] = primary[i]*k*k;
+                    aliasFrequencies[i] = axis.aliasSquaredFrequencies[m[i]];
+                    if (optimalInfluence)
+                        logRatio -= 2*log1p(aliases[i]/primary[i]);
+                    else
+                        logRatio += log(primary[i]/axis.moduli[m[i]]);
+                }
+                double phi;
+                if (lj) {
+                    double b = sqrt(k2)/(2*alpha);
+                    phi = (1-2*b*b)*exp(-b*b) + 2*b*b*b*sqrt(M_PI)*erfc(b);
+                }
+                else
+                    phi = exp(-k2/(4*alpha*alpha))/k2;
+                if (phi == 0.0)
+                    continue;
+
+                // The sums of w^2 and w^2*k^2 over all combinations of aliases other than the frequency
+                // itself, computed one axis at a time.
+
+                auto aliasProduct = [&] (int skip) {
+                    double sum = 0.0, product = 1.0;
+                    for (int i = 0; i < 3; i++)
+                        if (i != skip) {
+                            sum = sum*(primary[i]+aliases[i]) + product*aliases[i];
+                            product *= primary[i];
+                        }
+                    return sum;
+                };
+                double squares = aliasProduct(-1);
+                double squaredFrequencies = 0.0;
+                for (int i = 0; i < 3; i++) {
+                    double others = 1.0;
+                    for (int j = 0; j < 3; j++)
+                        if (j != i)
+                            others *= primary[j]+aliases[j];
+                    squaredFrequencies += aliasFrequencies[i]*others + primaryFrequencies[i]*aliasProduct(i);
+                }
+
+                // G(k)*w(k)^2 = phi(k)*exp(logRatio).  For the smooth PME influence function, the ratio is
+                // that of w(k)^2 to the B-spline moduli.  The optimal one divides the sum of w^2*phi over
+                // the aliases by the squared sum of w^2, in which phi is negligible beyond the frequency
+                // itself, so that the ratio is that of w(k)^4 to the squared sum of w^2.
+
+                double w2 = primary[0]*primary[1]*primary[2];
+                double g = exp(logRatio)/w2;
+                double primaryError = k2*expm1(logRatio)*expm1(logRatio);
+                double aliasError = g*g*(w2*squaredFrequencies + squares*w2*k2 + squares*squaredFrequencies);
+                error += weight*phi*phi*(primaryError+aliasError);
+            }
+    return error/(boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2]);
+}
+
+void SlicedNonbondedForceImpl::computePmeGridBytes(int xsize, int ysize, int zsize, int pmeOrder, int numSubsets, int realSize, int spreadSize, bool compact,
+                                                   long long& grid1Bytes, long long& grid2Bytes) {
+    long long numColumns = (long long) xsize*ysize*numSubsets;
+    long long roundedZSize = pmeOrder*((zsize+pmeOrder-1)/pmeOrder);
+    if (compact) {
+        grid1Bytes = numColumns*zsize*realSize;
+        grid2Bytes = max(numColumns*roundedZSize*spreadSize, numColumns*(zsize/2+1)*2*realSize);
+    }
+    else
+        grid1Bytes = grid2Bytes = numColumns*roundedZSize*2*realSize;
+}
+
+map<string, long long> SlicedNonbondedForceImpl::estimateMemoryUsage(const System& system, const SlicedNonbondedForce& force, const string& precision, int numThreadBlocks) {
+    if (precision != "single" && precision != "mixed" && precision != "double")
+        throw OpenMMException("estimateMemoryUsage: Precision must be single, mixed, or double");
+    if (numThreadBlocks < 1)
+        throw OpenMMException("estimateMemoryUsage: The number of thread blocks must be positive");
+    map<string, long long> usage;
+    if (isSlicingTrivial(force))
+        return usage; // The force is evaluated by the standard NonbondedForce kernel.
+
+    // These settings are shared by the CUDA and OpenCL platforms.  Charges are assumed to be
+    // spread in fixed point, which only makes the estimate slightly larger on the CUDA platform.
+
+    const int threadBlockSize = 64, tileSize = 32, spreadSize = sizeof(long long);
+    int pmeOrder = force.getPMEInterpolationOrder();
+    long long realSize = (precision == "double" ? sizeof(double) : sizeof(float));
+    long long energySize = (precision == "single" ? sizeof(float) : sizeof(double));
+    long long numParticles = system.getNumParticles();
+    long long paddedNumParticles = tileSize*((numParticles+tileSize-1)/tileSize);
+    int numSubsets = force.getNumSubsets();
+    vector<int> effectiveSlices = calcEffectiveSlices(force);
+    long long numEffectiveSlices = *max_element(effectiveSlices.begin(), effectiveSlices.end())+1;
+    long long bufferSize = numThreadBlocks*(numEffectiveSlices > MaxUntiledEffectiveSlices ? 1 : threadBlockSize);
+
+    // Per particle and per exception parameters.
+
+    usage["subsets"] = paddedNumParticles*sizeof(int);
+    usage["charges"] = paddedNumParticles*realSize;
+    usage["baseParticleParams"] = paddedNumParticles*4*sizeof(float);
+    usage["sigmaEpsilon"] = paddedNumParticles*2*sizeof(float);
+    usage["particleOffsetIndices"] = (paddedNumParticles+1)*sizeof(int);
+    usage["particleParamOffsets"] = max(force.getNumParticleParameterOffsets(), 1)*4*sizeof(float);
+    usage["sliceLambdas"] = force.getNumSlices()*2*realSize;
+    if (force.getUseSliceForces())
+        usage["sliceForces"] = force.getNumSlices()*3*paddedNumParticles*sizeof(long long);
+    if (force.getUseSliceEnergies())
+        usage["sliceEnergies"] = force.getNumSlices()*2*paddedNumParticles*sizeof(long long);
+    vector<char> hasOffset(force.getNumExceptions(), 0);
+    for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
+        string param;
+        int exception;
+        double charge, sigma, epsilon;
+        force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
+        hasOffset[exception] = 1;
+    }
+    long long numExceptions = 0;
+    for (int i = 0; i < force.getNumExceptions(); i++) {
+        int particle1, particle2;
+        double chargeProd, sigma, epsilon;
+        force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
+        if (chargeProd != 0.0 || epsilon != 0.0 || hasOffset[i])
+            numExceptions++;
+    }
+    if (numExceptions > 0) {
+        usage["exceptionParams"] = numExceptions*4*sizeof(float);
+        usage["baseExceptionParams"] = numExceptions*4*sizeof(float);
+        usage["exceptionPairs"] = numExceptions*2*sizeof(int);
+        usage["exceptionSlices"] = numExceptions*sizeof(int);
+    }
+
+    // Reciprocal space data structures.
+
+    SlicedNonbondedForce::NonbondedMethod method = force.getNonbondedMethod();
+    bool doLJPME = (method == SlicedNonbondedForce::LJPME);
+    if (method == SlicedNonbondedForce::Ewald || method == SlicedNonbondedForce::PME || doLJPME) {
+        long long numExclusions = force.getNumExceptions();
+        if (numExclusions > 0) {
+            usage["exclusionAtoms"] = numExclusions*2*sizeof(int);
+            usage["exclusionParams"] = numExclusions*4*sizeof(float);
+        }
+    }
+    if (method == SlicedNonbondedForce::Ewald) {
+        double alpha;
+        int kmaxx, kmaxy, kmaxz;
+        calcEwaldParameters(system, force, alpha, kmaxx, kmaxy, kmaxz);
+        usage["cosSinSums"] = (long long) (2*kmaxx-1)*(2*kmaxy-1)*(2*kmaxz-1)*numSubsets*2*realSize;
+        usage["pmeEnergyBuffer"] = numEffectiveSlices*bufferSize*2*realSize;
+    }
+    else if (method == SlicedNonbondedForce::PME || doLJPME) {
+        double alpha;
+        int gridSize[2][3];
+        calcPMEParameters(system, force, alpha, gridSize[0][0], gridSize[0][1], gridSize[0][2], false);
+        long long gridBytes[2];
+        computePmeGridBytes(gridSize[0][0], gridSize[0][1], gridSize[0][2], pmeOrder, numSubsets, realSize, spreadSize, force.getUseCompactPMEGrids(), gridBytes[0], gridBytes[1]);
+        if (doLJPME) {
+            calcPMEParameters(system, force, alpha, gridSize[1][0], gridSize[1][1], gridSize[1][2], true);
+            long long dispersionBytes[2];
+            computePmeGridBytes(gridSize[1][0], gridSize[1][1], gridSize[1][2], pmeOrder, numSubsets, realSize, spreadSize, force.getUseCompactPMEGrids(), dispersionBytes[0], dispersionBytes[1]);
+            if (force.getUseConcurrentLJPME()) {
+                // The dispersion pipeline has grids and atom grid indices of its own.
+
+                for (int i = 0; i < 2; i++)
+                    usage["dispersionGrid"+to_string(i+1)] = 2*realSize*((dispersionBytes[i]+2*realSize-1)/(2*realSize));
+                usage["dispersionAtomGridIndex"] = numParticles*2*sizeof(int);
+            }
+            else {
+                gridBytes[0] = max(gridBytes[0], dispersionBytes[0]);
+                gridBytes[1] = max(gridBytes[1], dispersionBytes[1]);
+            }
+        }
+        for (int i = 0; i < 2; i++)
+            usage["pmeGrid"+to_string(i+1)] = 2*realSize*((gridBytes[i]+2*realSize-1)/(2*realSize));
+        for (int axis = 0; axis < 3; axis++) {
+            string name = string(1, 'X'+axis);
+            usage["pmeBsplineModuli"+name] = gridSize[0][axis]*realSize;
+            if (doLJPME)
+                usage["pmeDispersionBsplineModuli"+name] = gridSize[1][axis]*realSize;
+        }
+        if (force.getUseOptimalInfluenceFunction()) {
+            usage["influenceFunction"] = (long long) gridSize[0][0]*gridSize[0][1]*(gridSize[0][2]/2+1)*realSize;
+            if (doLJPME)
+                usage["dispersionInfluenceFunction"] = (long long) gridSize[1][0]*gridSize[1][1]*(gridSize[1][2]/2+1)*realSize;
+        }
+        usage["pmeAtomGridIndex"] = numParticles*2*sizeof(int);
+        usage["pmeEnergyBuffer"] = numEffectiveSlices*bufferSize*energySize;
+        if (doLJPME)
+            usage["ljpmeEnergyBuffer"] = numEffectiveSlices*bufferSize*energySize;
+    }
+    return usage;
+}
+
+double SlicedNonbondedForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
+    bool includeDirect = (owner.getIncludeDirectSpace() && (groups&directGroupsMask) != 0);
+    bool includeReciprocal = ((groups&reciprocalGroupsMask) != 0);
+    if (trivialSlicing)
+        return kernel.getAs<CalcNonbondedForceKernel>().execute(context, includeForces, includeEnergy, includeDirect, includeReciprocal);
+    CalcSlicedNonbondedForceKernel& slicedKernel = kernel.getAs<CalcSlicedNonbondedForceKernel>();
+    if (useSliceForceGroups)
+        slicedKernel.setIncludedForceGroups(groups);
+    return slicedKernel.execute(context, includeForces, includeEnergy, includeDirect, includeReciprocal);
 }
 
 std::vector<std::string> SlicedNonbondedForceImpl::getKernelNames() {
     std::vector<std::string> names;
-    names.push_back(CalcSlicedNonbondedForceKernel::Name());
+    if (isSlicingTrivial(owner))
+        names.push_back(CalcNonbondedForceKernel::Name());
+    else
+        names.push_back(CalcSlicedNonbondedForceKernel::Name());
     return names;
 }
 
 double SlicedNonbondedForceImpl::evalIntegral(double r, double rs, double rc, double sigma) {
+    double c12, c6;
+    evalIntegralCoefficients(r, rs, rc, c12, c6);
+    double sig2 = sigma*sigma;
+    double sig6 = sig2*sig2*sig2;
+    return (c12*sig6 + c6)*sig6;
+}
+
+void SlicedNonbondedForceImpl::evalIntegralCoefficients(double r, double rs, double rc, double& c12, double& c6) {
     // Compute the indefinite integral of the LJ interaction multiplied by the switching function.
     // This is a large and somewhat horrifying expression, though it does grow on you if you look
     // at it long enough.  Perhaps it could be simplified further, but I got tired of working on it.
+    // It only depends on sigma through the factors sigma^12 and sigma^6, whose coefficients are
+    // returned separately.
 
     double A = 1/(rc-rs);
     double A2 = A*A;
     double A3 = A2*A;
-    double sig2 = sigma*sigma;
-    double sig6 = sig2*sig2*sig2;
     double rs2 = rs*rs;
     double rs3 = rs*rs2;
     double r2 = r*r;
@@ -165,18 +629,19 @@ double SlicedNonbondedForceImpl::evalIntegral(double r, double rs, double rc, do
     double r5 = r*r4;
     double r6 = r*r5;
     double r9 = r3*r6;
-    return sig6*A3*((
-        sig6*(
+    c12 = A3*(
             + rs3*28*(6*rs2*A2 + 15*rs*A + 10)
             - r*rs2*945*(rs2*A2 + 2*rs*A + 1)
             + r2*rs*1080*(2*rs2*A2 + 3*rs*A + 1)
             - r3*420*(6*rs2*A2 + 6*rs*A + 1)
             + r4*756*(2*rs*A2 + A)
-            - r5*378*A2)
+            - r5*378*A2
+        )/(252*r9);
+    c6 = A3*(
         -r6*(
             + rs3*84*(6*rs2*A2 + 15*rs*A + 10)
             - r*rs2*3780*(rs2*A2 + 2*rs*A + 1)
-            + r2*rs*7560*(2*rs2*A2 + 3*rs*A + 1))
+            + r2*rs*7560*(2*rs2*A2 + 3*rs*A + 1)
         )/(252*r9)
      - log(r)*10*(6*rs2*A2 + 6*rs*A + 1)
      + r*15*(2*rs*A2 + A)
@@ -261,107 +726,210 @@ double SlicedNonbondedForceImpl::calcDispersionCorrection(const System& system,
 }
 
 vector<double> SlicedNonbondedForceImpl::calcDispersionCorrections(const System& system, const SlicedNonbondedForce& force) {
-    int numSlices = force.getNumSlices();
-    vector<double> dispersionCorrections(numSlices, 0.0);
-    if (force.getNonbondedMethod() == SlicedNonbondedForce::NoCutoff ||
-        force.getNonbondedMethod() == SlicedNonbondedForce::CutoffNonPeriodic)
-        return dispersionCorrections;
+    return SlicedDispersionCorrection(system, force).getCoefficients();
+}
 
-    // Record sigma and epsilon for every particle, including the default value
-    // for every offset parameter.
+void SlicedNonbondedForceImpl::updateParametersInContext(ContextImpl& context) {
+    if (isSlicingTrivial(owner) != trivialSlicing)
+        throw OpenMMException("updateParametersInContext: The presence of scaling parameters has changed");
+    if (trivialSlicing)
+        kernel.getAs<CalcNonbondedForceKernel>().copyParametersToContext(context, owner);
+    else
+        kernel.getAs<CalcSlicedNonbondedForceKernel>().copyParametersToContext(context, owner);
+    context.systemChanged();
+}
 
-    int numParticles = system.getNumParticles();
-    vector<double> sigma(numParticles), epsilon(numParticles);
-    vector<int> subset(numParticles);
-    for (int i = 0; i < numParticles; i++) {
-        double charge;
-        force.getParticleParameters(i, charge, sigma[i], epsilon[i]);
-        subset[i] = force.getParticleSubset(i);
-    }
-    map<string, double> param;
-    for (int i = 0; i < force.getNumGlobalParameters(); i++)
-        param[force.getGlobalParameterName(i)] = force.getGlobalParameterDefaultValue(i);
-    for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
-        string parameter;
-        int index;
-        double chargeScale, sigmaScale, epsilonScale;
-        force.getParticleParameterOffset(i, parameter, index, chargeScale, sigmaScale, epsilonScale);
-        sigma[index] += param[parameter]*sigmaScale;
-        epsilon[index] += param[parameter]*epsilonScale;
-    }
+void SlicedNonbondedForceImpl::reassignSubsets(ContextImpl& context, const vector<int>& particles) {
+    if (trivialSlicing)
+        return; // All slices are added together with unit weights, so the subsets do not matter.
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().reassignSubsets(context, owner, particles);
+    context.systemChanged();
+}
 
-    // Identify all particle classes (defined by sigma, epsilon, and subset), and count the number of
-    // particles in each class.
+void SlicedNonbondedForceImpl::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
+    if (trivialSlicing)
+        kernel.getAs<CalcNonbondedForceKernel>().getPMEParameters(alpha, nx, ny, nz);
+    else
+        kernel.getAs<CalcSlicedNonbondedForceKernel>().getPMEParameters(alpha, nx, ny, nz);
+}
 
-    typedef tuple<double, double, int> ParticleClass;
-    map<ParticleClass, int> classCounts;
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        ParticleClass key = make_tuple(sigma[i], epsilon[i], subset[i]);
-        map<ParticleClass, int>::iterator entry = classCounts.find(key);
-        if (entry == classCounts.end())
-            classCounts[key] = 1;
-        else
-            entry->second++;
+map<string, double> SlicedNonbondedForceImpl::getStageTimings() const {
+    if (trivialSlicing)
+        return map<string, double>(); // The standard NonbondedForce kernel is not instrumented.
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getStageTimings();
+}
+
+long long SlicedNonbondedForceImpl::getPMEGridMemorySavings() const {
+    if (trivialSlicing)
+        return 0; // The standard NonbondedForce kernel always uses full size grids.
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getPMEGridMemorySavings();
+}
+
+map<string, long long> SlicedNonbondedForceImpl::getMemoryUsage() const {
+    if (trivialSlicing)
+        return map<string, long long>(); // The standard NonbondedForce kernel does not report its arrays.
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getMemoryUsage();
+}
+
+bool SlicedNonbondedForceImpl::getSliceForces(int slice, vector<Vec3>& forces) {
+    if (!useSliceForces)
+        throw OpenMMException("getSliceForcesInContext: Slice forces must be enabled with setUseSliceForces() before the context is created");
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getSliceForces(slice, forces);
+}
+
+void SlicedNonbondedForceImpl::getSliceEnergies(vector<double>& energies, vector<double>& lambdas) {
+    if (!useSliceEnergies)
+        throw OpenMMException("Slice energies must be enabled with setUseSliceEnergies() before the context is created");
+    if (!kernel.getAs<CalcSlicedNonbondedForceKernel>().getSliceEnergies(energies, lambdas))
+        throw OpenMMException("The last evaluation did not compute the slice energies");
+}
+
+void SlicedNonbondedForceImpl::setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double>>& schedule) {
+    if (trivialSlicing)
+        throw OpenMMException("setScalingParameterScheduleInContext: Schedules require at least one scaling parameter");
+    kernel.getAs<CalcSlicedNonbondedForceKernel>().setScalingParameterSchedule(context, parameters, schedule);
+}
+
+double SlicedNonbondedForceImpl::getProtocolWork() {
+    if (trivialSlicing)
+        return 0.0; // Without scaling parameters, no schedule can have been set.
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getProtocolWork();
+}
+
+void SlicedNonbondedForceImpl::stagePositions(ContextImpl& context, const double* positions) {
+    if (trivialSlicing) {
+        // The standard NonbondedForce kernel cannot stage positions, so they are set when applied.
+
+        stagedPositions.resize(context.getSystem().getNumParticles());
+        for (int i = 0; i < stagedPositions.size(); i++)
+            stagedPositions[i] = Vec3(positions[3*i], positions[3*i+1], positions[3*i+2]);
     }
+    else
+        kernel.getAs<CalcSlicedNonbondedForceKernel>().stagePositions(context, positions);
+}
 
-    // Loop over all pairs of classes to compute the coefficients.
+void SlicedNonbondedForceImpl::applyStagedPositions(ContextImpl& context) {
+    if (!trivialSlicing)
+        kernel.getAs<CalcSlicedNonbondedForceKernel>().applyStagedPositions(context);
+    else if (stagedPositions.size() > 0)
+        context.setPositions(stagedPositions);
+    else
+        throw OpenMMException("SlicedNonbondedForce: No positions have been staged");
+}
 
-    vector<double> sum1(numSlices, 0), sum2(numSlices, 0), sum3(numSlices, 0);
-    bool useSwitch = force.getUseSwitchingFunction();
-    double cutoff = force.getCutoffDistance();
-    double switchDist = force.getSwitchingDistance();
-    for (map<ParticleClass, int>::const_iterator entry = classCounts.begin(); entry != classCounts.end(); ++entry) {
-        double sigma = get<0>(entry->first);
-        double epsilon = get<1>(entry->first);
-        int subset = get<2>(entry->first);
-        int count = entry->second*(entry->second+1)/2;
-        double sigmaSq = sigma*sigma;
-        double sigma6 = sigmaSq*sigmaSq*sigmaSq;
-        int slice = subset*(subset+3)/2;
-        sum1[slice] += count*epsilon*sigma6*sigma6;
-        sum2[slice] += count*epsilon*sigma6;
-        if (useSwitch)
-            sum3[slice] += count*epsilon*(evalIntegral(cutoff, switchDist, cutoff, sigma)-evalIntegral(switchDist, switchDist, cutoff, sigma));
-    }
-    for (map<ParticleClass, int>::const_iterator class1 = classCounts.begin(); class1 != classCounts.end(); ++class1) {
-        double sigma1 = get<0>(class1->first);
-        double epsilon1 = get<1>(class1->first);
-        int s1 = get<2>(class1->first);
-        for (map<ParticleClass, int>::const_iterator class2 = classCounts.begin(); class2 != class1; ++class2) {
-            double sigma2 = get<0>(class2->first);
-            double epsilon2 = get<1>(class2->first);
-            int s2 = get<2>(class2->first);
-            double sigma = 0.5*(sigma1+sigma2);
-            double epsilon = sqrt(epsilon1*epsilon2);
-            int slice = sliceIndex(s1, s2);
-            int count = class1->second*class2->second;
-            double sigmaSq = sigma*sigma;
-            double sigma6 = sigmaSq*sigmaSq*sigmaSq;
-            sum1[slice] += count*epsilon*sigma6*sigma6;
-            sum2[slice] += count*epsilon*sigma6;
-            if (useSwitch)
-                sum3[slice] += count*epsilon*(evalIntegral(cutoff, switchDist, cutoff, sigma)-evalIntegral(switchDist, switchDist, cutoff, sigma));
+string SlicedNonbondedForceImpl::getTunedConfiguration() const {
+    if (trivialSlicing)
+        return ""; // The standard NonbondedForce kernel does not tune anything.
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getTunedConfiguration();
+}
+
+string SlicedNonbondedForceImpl::getFFTBackendName() const {
+    if (trivialSlicing)
+        return ""; // The standard NonbondedForce kernel does not report its FFT library.
+    return kernel.getAs<CalcSlicedNonbondedForceKernel>().getFFTBackendName();
+}
+
+void SlicedNonbondedForceImpl::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
+    if (trivialSlicing)
+        kernel.getAs<CalcNonbondedForceKernel>().getLJPMEParameters(alpha, nx, ny, nz);
+    else
+        kernel.getAs<CalcSlicedNonbondedForceKernel>().getLJPMEParameters(alpha, nx, ny, nz);
+}
+
+/**
+ * A tuned configuration is a line of semicolon separated key=value pairs.  Unknown keys are ignored, so
+ * that configurations stored by later versions can still be read.
+ */
+static void parseTunedConfiguration(const string& line, SlicedNonbondedForceImpl::TunedConfiguration& config) {
+    stringstream entries(line);
+    string entry;
+    try {
+        while (getline(entries, entry, ';')) {
+            size_t separator = entry.find('=');
+            if (separator == string::npos)
+                throw invalid_argument(entry);
+            string key = entry.substr(0, separator);
+            string value = entry.substr(separator+1);
+            int* grid = (key == "grid" ? config.grid : key == "dispersionGrid" ? config.dispersionGrid : NULL);
+            if (key == "device")
+                config.device = value;
+            else if (key == "particles")
+                config.numParticles = stoi(value);
+            else if (key == "subsets")
+                config.numSubsets = stoi(value);
+            else if (key == "alpha")
+                config.alpha = stod(value);
+            else if (key == "dispersionAlpha")
+                config.dispersionAlpha = stod(value);
+            else if (key == "vendorFFT")
+                config.useVendorFFT = (stoi(value) != 0);
+            else if (key == "registerBoost")
+                config.registerBoost = stoi(value);
+            else if (grid != NULL) {
+                stringstream sizes(value);
+                char comma1, comma2;
+                sizes >> grid[0] >> comma1 >> grid[1] >> comma2 >> grid[2];
+                if (sizes.fail() || comma1 != ',' || comma2 != ',')
+                    throw invalid_argument(entry);
+            }
         }
     }
-    double numInteractions = (numParticles*(numParticles+1))/2;
-    for (int slice = 0; slice < numSlices; slice++) {
-        sum1[slice] /= numInteractions;
-        sum2[slice] /= numInteractions;
-        sum3[slice] /= numInteractions;
-        dispersionCorrections[slice] = 8*numParticles*numParticles*M_PI*(sum1[slice]/(9*pow(cutoff, 9))-sum2[slice]/(3*pow(cutoff, 3))+sum3[slice]);
+    catch (const exception& e) {
+        throw OpenMMException("Invalid tuned configuration: "+line);
     }
-    return dispersionCorrections;
 }
 
-void SlicedNonbondedForceImpl::updateParametersInContext(ContextImpl& context) {
-    kernel.getAs<CalcSlicedNonbondedForceKernel>().copyParametersToContext(context, owner);
-    context.systemChanged();
+string SlicedNonbondedForceImpl::formatTunedConfiguration(const TunedConfiguration& config) {
+    stringstream line;
+    line.precision(17);
+    line<<"device="<<config.device<<";particles="<<config.numParticles<<";subsets="<<config.numSubsets;
+    line<<";alpha="<<config.alpha<<";grid="<<config.grid[0]<<","<<config.grid[1]<<","<<config.grid[2];
+    line<<";dispersionAlpha="<<config.dispersionAlpha<<";dispersionGrid="<<config.dispersionGrid[0]<<","<<config.dispersionGrid[1]<<","<<config.dispersionGrid[2];
+    line<<";vendorFFT="<<config.useVendorFFT<<";registerBoost="<<config.registerBoost;
+    return line.str();
 }
 
-void SlicedNonbondedForceImpl::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
-    kernel.getAs<CalcSlicedNonbondedForceKernel>().getPMEParameters(alpha, nx, ny, nz);
+bool SlicedNonbondedForceImpl::findTunedConfiguration(const string& configurations, const string& device, int numParticles, int numSubsets,
+                                                      double alpha, double dispersionAlpha, TunedConfiguration& config) {
+    stringstream lines(configurations);
+    string line;
+    while (getline(lines, line)) {
+        if (line.empty())
+            continue;
+        TunedConfiguration candidate;
+        parseTunedConfiguration(line, candidate);
+        if (candidate.device == device && candidate.numParticles == numParticles && candidate.numSubsets == numSubsets &&
+                fabs(candidate.alpha-alpha) <= 1e-10*alpha && fabs(candidate.dispersionAlpha-dispersionAlpha) <= 1e-10*dispersionAlpha) {
+            config = candidate;
+            return true;
+        }
+    }
+    return false;
 }
 
-void SlicedNonbondedForceImpl::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
-    kernel.getAs<CalcSlicedNonbondedForceKernel>().getLJPMEParameters(alpha, nx, ny, nz);
+string SlicedNonbondedForceImpl::mergeTunedConfigurations(const string& configurations, const string& newConfigurations) {
+    vector<pair<TunedConfiguration, string> > merged;
+    for (const string* text : {&configurations, &newConfigurations}) {
+        stringstream lines(*text);
+        string line;
+        while (getline(lines, line)) {
+            if (line.empty())
+                continue;
+            TunedConfiguration config;
+            parseTunedConfiguration(line, config);
+            auto sameKey = [&] (const pair<TunedConfiguration, string>& entry) {
+                return entry.first.device == config.device && entry.first.numParticles == config.numParticles &&
+                       entry.first.numSubsets == config.numSubsets;
+            };
+            auto position = find_if(merged.begin(), merged.end(), sameKey);
+            if (position == merged.end())
+                merged.push_back(make_pair(config, line));
+            else
+                position->second = line;
+        }
+    }
+    string result;
+    for (auto& entry : merged)
+        result += entry.second+"\n";
+    return result;
 }
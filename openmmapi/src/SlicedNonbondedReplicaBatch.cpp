@@ -0,0 +1,196 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "SlicedNonbondedReplicaBatch.h"
+#include "openmm/OpenMMException.h"
+#include <map>
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+static const string couplingParameter = "replicaCoupling";
+static const string unitParameter = "replicaScale";
+
+SlicedNonbondedReplicaBatch::SlicedNonbondedReplicaBatch(const SlicedNonbondedForce& force, int numReplicas) :
+        numReplicas(numReplicas), numParticles(force.getNumParticles()) {
+    if (numReplicas < 1)
+        throw OpenMMException("SlicedNonbondedReplicaBatch: the number of replicas must be positive");
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        if (force.getGlobalParameterName(i) == couplingParameter || force.getGlobalParameterName(i) == unitParameter)
+            throw OpenMMException("SlicedNonbondedReplicaBatch: the global parameter name "+force.getGlobalParameterName(i)+" is reserved");
+    int numSubsets = force.getNumSubsets();
+    int numExceptions = force.getNumExceptions();
+    batchedForce.reset(new SlicedNonbondedForce(numReplicas*numSubsets));
+    SlicedNonbondedForce* batch = batchedForce.get();
+    batch->setForceGroup(force.getForceGroup());
+    batch->setName(force.getName());
+    batch->setNonbondedMethod(force.getNonbondedMethod());
+    batch->setCutoffDistance(force.getCutoffDistance());
+    batch->setUseSwitchingFunction(force.getUseSwitchingFunction());
+    batch->setSwitchingDistance(force.getSwitchingDistance());
+    batch->setEwaldErrorTolerance(force.getEwaldErrorTolerance());
+    batch->setReactionFieldDielectric(force.getReactionFieldDielectric());
+    batch->setUseDispersionCorrection(force.getUseDispersionCorrection());
+    batch->setIncludeDirectSpace(force.getIncludeDirectSpace());
+    batch->setExceptionsUsePeriodicBoundaryConditions(force.getExceptionsUsePeriodicBoundaryConditions());
+    batch->setReciprocalSpaceForceGroup(force.getReciprocalSpaceForceGroup());
+    double alpha;
+    int nx, ny, nz;
+    force.getPMEParameters(alpha, nx, ny, nz);
+    batch->setPMEParameters(alpha, nx, ny, nz);
+    force.getLJPMEParameters(alpha, nx, ny, nz);
+    batch->setLJPMEParameters(alpha, nx, ny, nz);
+    batch->setUseCuFFT(force.getUseCudaFFT());
+    batch->setSkipDecoupledSlices(true);
+    batch->setUseCudaGraphs(force.getUseCudaGraphs());
+    batch->setAutotunePME(force.getAutotunePME());
+    batch->setAutoselectFFT(force.getAutoselectFFT());
+    batch->setTunedConfiguration(force.getTunedConfiguration());
+    batch->setProfileStages(force.getProfileStages());
+    batch->setUseCompactPMEGrids(force.getUseCompactPMEGrids());
+    batch->setUseEnergyCache(force.getUseEnergyCache());
+    batch->setUseDerivativesOnDemand(force.getUseDerivativesOnDemand());
+    batch->setUseCpuPme(force.getUseCpuPme());
+    batch->setUseConcurrentLJPME(force.getUseConcurrentLJPME());
+    batch->setUseOptimalInfluenceFunction(force.getUseOptimalInfluenceFunction());
+    batch->setUseLoadBalancing(force.getUseLoadBalancing());
+    batch->setUseCachedBSplines(force.getUseCachedBSplines());
+    batch->setUseTreeCode(force.getUseTreeCode());
+    batch->setTreeCodeOpeningAngle(force.getTreeCodeOpeningAngle());
+    batch->setSmallSubsetThreshold(force.getSmallSubsetThreshold());
+    batch->setPMEInterpolationOrder(force.getPMEInterpolationOrder());
+
+    // Replicate the global parameters, the particles, the exceptions, and their offsets.
+
+    for (int replica = 0; replica < numReplicas; replica++) {
+        for (int i = 0; i < force.getNumGlobalParameters(); i++)
+            batch->addGlobalParameter(getParameterName(replica, force.getGlobalParameterName(i)), force.getGlobalParameterDefaultValue(i));
+        batch->addGlobalParameter(getParameterName(replica, unitParameter), 1.0);
+    }
+    batch->addGlobalParameter(couplingParameter, 0.0);
+    vector<int> subsets(numReplicas*numParticles);
+    vector<int> originalSubsets = force.getParticleSubsets();
+    for (int replica = 0; replica < numReplicas; replica++)
+        for (int i = 0; i < numParticles; i++) {
+            double charge, sigma, epsilon;
+            force.getParticleParameters(i, charge, sigma, epsilon);
+            batch->addParticle(charge, sigma, epsilon);
+            subsets[replica*numParticles+i] = replica*numSubsets+originalSubsets[i];
+        }
+    batch->setParticleSubsets(subsets);
+    for (int replica = 0; replica < numReplicas; replica++)
+        for (int i = 0; i < numExceptions; i++) {
+            int particle1, particle2;
+            double chargeProd, sigma, epsilon;
+            force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
+            batch->addException(getParticleIndex(replica, particle1), getParticleIndex(replica, particle2), chargeProd, sigma, epsilon);
+        }
+    for (int replica = 0; replica < numReplicas; replica++) {
+        for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
+            string parameter;
+            int index;
+            double chargeScale, sigmaScale, epsilonScale;
+            force.getParticleParameterOffset(i, parameter, index, chargeScale, sigmaScale, epsilonScale);
+            batch->addParticleParameterOffset(getParameterName(replica, parameter), getParticleIndex(replica, index), chargeScale, sigmaScale, epsilonScale);
+        }
+        for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
+            string parameter;
+            int index;
+            double chargeProdScale, sigmaScale, epsilonScale;
+            force.getExceptionParameterOffset(i, parameter, index, chargeProdScale, sigmaScale, epsilonScale);
+            batch->addExceptionParameterOffset(getParameterName(replica, parameter), replica*numExceptions+index, chargeProdScale, sigmaScale, epsilonScale);
+        }
+    }
+
+    // Every contribution of every slice of a replica is multiplied either by a scaling parameter of the
+    // original force or by the replica's unit parameter.  Derivatives are requested for all of them.
+
+    vector<pair<string, string> > sliceParams(force.getNumSlices());
+    for (int i = 0; i < force.getNumScalingParameters(); i++) {
+        string parameter;
+        int subset1, subset2;
+        bool includeCoulomb, includeLJ;
+        force.getScalingParameter(i, parameter, subset1, subset2, includeCoulomb, includeLJ);
+        int slice = sliceIndex(subset1, subset2);
+        if (includeCoulomb)
+            sliceParams[slice].first = parameter;
+        if (includeLJ)
+            sliceParams[slice].second = parameter;
+    }
+    replicaScalingParameters.resize(numReplicas);
+    for (int replica = 0; replica < numReplicas; replica++) {
+        map<string, bool> requested;
+        for (int subset1 = 0; subset1 < numSubsets; subset1++)
+            for (int subset2 = subset1; subset2 < numSubsets; subset2++) {
+                const pair<string, string>& params = sliceParams[sliceIndex(subset1, subset2)];
+                string coulomb = getParameterName(replica, params.first == "" ? unitParameter : params.first);
+                string lj = getParameterName(replica, params.second == "" ? unitParameter : params.second);
+                int batchSubset1 = replica*numSubsets+subset1;
+                int batchSubset2 = replica*numSubsets+subset2;
+                int batchSlice = sliceIndex(batchSubset1, batchSubset2);
+                batch->setSliceForceGroup(batchSlice, force.getSliceForceGroup(sliceIndex(subset1, subset2)));
+                batch->setSliceReciprocalSpaceForceGroup(batchSlice, force.getSliceReciprocalSpaceForceGroup(sliceIndex(subset1, subset2)));
+                if (coulomb == lj)
+                    batch->addScalingParameter(coulomb, batchSubset1, batchSubset2, true, true);
+                else {
+                    batch->addScalingParameter(coulomb, batchSubset1, batchSubset2, true, false);
+                    batch->addScalingParameter(lj, batchSubset1, batchSubset2, false, true);
+                }
+                for (const string& name : {coulomb, lj})
+                    if (!requested[name]) {
+                        requested[name] = true;
+                        batch->addScalingParameterDerivative(name);
+                        replicaScalingParameters[replica].push_back(name);
+                    }
+            }
+    }
+
+    // Decouple the replicas from each other.
+
+    for (int replica1 = 0; replica1 < numReplicas; replica1++)
+        for (int replica2 = replica1+1; replica2 < numReplicas; replica2++)
+            for (int subset1 = 0; subset1 < numSubsets; subset1++)
+                for (int subset2 = 0; subset2 < numSubsets; subset2++)
+                    batch->addScalingParameter(couplingParameter, replica1*numSubsets+subset1, replica2*numSubsets+subset2, true, true);
+}
+
+int SlicedNonbondedReplicaBatch::getParticleIndex(int replica, int particle) const {
+    if (replica < 0 || replica >= numReplicas || particle < 0 || particle >= numParticles)
+        throw OpenMMException("SlicedNonbondedReplicaBatch: replica or particle index out of range");
+    return replica*numParticles+particle;
+}
+
+string SlicedNonbondedReplicaBatch::getParameterName(int replica, const string& parameter) const {
+    if (replica < 0 || replica >= numReplicas)
+        throw OpenMMException("SlicedNonbondedReplicaBatch: replica index out of range");
+    return parameter+"_replica"+to_string(replica);
+}
+
+SlicedNonbondedForce* SlicedNonbondedReplicaBatch::createForce() const {
+    return new SlicedNonbondedForce(*batchedForce);
+}
+
+vector<double> SlicedNonbondedReplicaBatch::getReplicaEnergies(const State& state) const {
+    // The energy of a replica is a homogeneous linear function of its scaling parameters.
+
+    const map<string, double>& values = state.getParameters();
+    const map<string, double>& derivatives = state.getEnergyParameterDerivatives();
+    vector<double> energies(numReplicas, 0.0);
+    for (int replica = 0; replica < numReplicas; replica++)
+        for (const string& name : replicaScalingParameters[replica]) {
+            auto value = values.find(name);
+            auto derivative = derivatives.find(name);
+            if (value == values.end() || derivative == derivatives.end())
+                throw OpenMMException("SlicedNonbondedReplicaBatch: the State must include parameters and parameter derivatives");
+            energies[replica] += value->second*derivative->second;
+        }
+    return energies;
+}
@@ -14,9 +14,512 @@
 #include "NonbondedSlicingKernels.h"
 #include "openmm/common/ComputeContext.h"
 #include "openmm/common/ComputeArray.h"
+#include "openmm/internal/ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace NonbondedSlicing {
 
+/**
+ * Find the index ranges in which two arrays of plain data differ.  Ranges separated by no more
+ * than maxGap unchanged elements are merged, so that each one can be copied to the device with
+ * a single transfer.
+ *
+ * @param oldValues  the values currently stored on the device
+ * @param newValues  the updated values, with the same size as oldValues
+ * @param maxGap     the maximum number of unchanged elements allowed inside a range
+ * @return a list of half-open ranges [begin, end) of changed elements
+ */
+template <class T>
+std::vector<std::pair<int, int> > findChangedRanges(const std::vector<T>& oldValues, const std::vector<T>& newValues, int maxGap=256) {
+    std::vector<std::pair<int, int> > ranges;
+    int size = newValues.size();
+    for (int i = 0; i < size; i++) {
+        if (memcmp(&oldValues[i], &newValues[i], sizeof(T)) == 0)
+            continue;
+        if (ranges.size() > 0 && i-ranges.back().second <= maxGap)
+            ranges.back().second = i+1;
+        else
+            ranges.push_back(std::make_pair(i, i+1));
+    }
+    return ranges;
+}
+
+/**
+ * Sort the indices of exceptions or exclusions by the slices they belong to, keeping their original
+ * order within each slice.
+ *
+ * @param indices  the indices to be sorted
+ * @param slices   the slice of each exception or exclusion, which is indexed by the values in indices
+ */
+inline void sortBySlice(std::vector<int>& indices, const std::vector<int>& slices) {
+    std::stable_sort(indices.begin(), indices.end(), [&slices] (int i, int j) {return slices[i] < slices[j];});
+}
+
+/**
+ * Execute a loop over the indices from 0 to size-1 with the threads of a pool, each of which processes
+ * a contiguous block of indices.  The loop body receives the first index of its block and one past the
+ * last one.  It runs on the worker threads, so it must not throw exceptions.
+ */
+inline void parallelFor(OpenMM::ThreadPool& threads, int size, const std::function<void(int, int)>& loop) {
+    if (size == 0)
+        return;
+    int numThreads = threads.getNumThreads();
+    threads.execute([&] (OpenMM::ThreadPool& pool, int thread) {
+        loop((int) ((long long) thread*size/numThreads), (int) ((long long) (thread+1)*size/numThreads));
+    });
+    threads.waitForThreads();
+}
+
+/**
+ * Read the particles and parameters of all exceptions of a force in parallel, and find those that must
+ * be computed explicitly because their charge product or epsilon is nonzero or they have parameter
+ * offsets.  The others are plain exclusions.  The arrays are resized but not reallocated if they are
+ * already large enough, so that they can be reused by consecutive calls.
+ *
+ * @param force        the force whose exceptions are read
+ * @param threads      the pool of threads that read them
+ * @param atoms        on exit, the two particles of each exception, in consecutive elements
+ * @param params       on exit, the charge product, sigma, and epsilon of each exception, in consecutive elements
+ * @param nonExcluded  on exit, the indices of the exceptions computed explicitly, in increasing order
+ */
+inline void readExceptions(const SlicedNonbondedForce& force, OpenMM::ThreadPool& threads, std::vector<int>& atoms,
+                           std::vector<double>& params, std::vector<int>& nonExcluded) {
+    int numExceptions = force.getNumExceptions();
+    std::vector<char> isExplicit(numExceptions, 0);
+    for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
+        std::string param;
+        int exception;
+        double charge, sigma, epsilon;
+        force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
+        isExplicit[exception] = 1;
+    }
+    atoms.resize(2*numExceptions);
+    params.resize(3*numExceptions);
+    parallelFor(threads, numExceptions, [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
+            force.getExceptionParameters(i, atoms[2*i], atoms[2*i+1], params[3*i], params[3*i+1], params[3*i+2]);
+            if (params[3*i] != 0.0 || params[3*i+2] != 0.0)
+                isExplicit[i] = 1;
+        }
+    });
+    nonExcluded.clear();
+    for (int i = 0; i < numExceptions; i++)
+        if (isExplicit[i])
+            nonExcluded.push_back(i);
+}
+
+/**
+ * Format a list of integers as a comma-separated array initializer to be inserted into kernel code.
+ */
+inline std::string toInitializerList(const std::vector<int>& values) {
+    std::stringstream list;
+    for (int i = 0; i < values.size(); i++)
+        list<<(i == 0 ? "" : ", ")<<values[i];
+    return list.str();
+}
+
+/**
+ * The thread block size of the tiled reciprocal space energy kernels.
+ */
+const int SliceEnergyBlockSize = 128;
+
+/**
+ * The thread block size of the kernel that sums up the self energies of the subsets.
+ */
+const int SelfEnergyBlockSize = 128;
+
+/**
+ * The thread block size of the kernel that sums up the reported energy parameter derivatives.
+ */
+const int ReportBlockSize = 128;
+
+/**
+ * The thread block size of the kernel that sums up the Coulomb and Lennard-Jones energies of every slice.
+ */
+const int SliceEnergySumBlockSize = 128;
+
+/**
+ * Group the slices by effective slice.  The member slices of effective slice e, given as pairs of
+ * subsets, are stored as (memberSubsets[2*k], memberSubsets[2*k+1]) for k between memberStart[e]
+ * and memberStart[e+1]-1.
+ */
+inline void groupSlicesByEffectiveSlice(const std::vector<int>& effectiveSlices, int numSubsets, std::vector<int>& memberStart, std::vector<int>& memberSubsets) {
+    int numEffectiveSlices = 0;
+    for (int slice : effectiveSlices)
+        numEffectiveSlices = std::max(numEffectiveSlices, slice+1);
+    memberStart.assign(numEffectiveSlices+1, 0);
+    for (int slice : effectiveSlices)
+        memberStart[slice+1]++;
+    for (int i = 0; i < numEffectiveSlices; i++)
+        memberStart[i+1] += memberStart[i];
+    memberSubsets.resize(2*effectiveSlices.size());
+    std::vector<int> position(memberStart.begin(), memberStart.end()-1);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++) {
+            int k = position[effectiveSlices[j*(j+1)/2+i]]++;
+            memberSubsets[2*k] = i;
+            memberSubsets[2*k+1] = j;
+        }
+}
+
+/**
+ * The thread block size of the kernel that computes the reciprocal space forces on the atoms of
+ * small subsets.  This must be a power of two.
+ */
+const int SmallSubsetBlockSize = 128;
+
+/**
+ * Assign the grid slots of the reciprocal space sums of the subsets.  The subsets with no more than
+ * threshold charged particles are small, which means that the transforms of their grids and the
+ * forces on their particles are computed directly from the particle positions, without spreading
+ * charges onto grids.  In particular, a subset whose particles have neither charges nor charge
+ * offsets is always small, since it contributes nothing to the reciprocal space sums.  The other
+ * subsets take the first slots, in increasing order, and are followed by the small ones.  If every
+ * subset is small, the one with the most charged particles keeps its grid.
+ *
+ * @param particleSubsets   the subset of each particle
+ * @param chargedParticles  whether each particle has a charge or a charge offset
+ * @param numSubsets        the number of subsets
+ * @param threshold         the maximum number of charged particles in a small subset
+ * @param subsetSlots       on exit, the slot of each subset
+ * @return the number of slots whose charges are spread onto grids
+ */
+inline int assignPmeGridSlots(const std::vector<int>& particleSubsets, const std::vector<char>& chargedParticles, int numSubsets, int threshold,
+                              std::vector<int>& subsetSlots) {
+    std::vector<int> counts(numSubsets, 0);
+    for (int i = 0; i < particleSubsets.size(); i++)
+        if (chargedParticles[i])
+            counts[particleSubsets[i]]++;
+    int largest = std::max_element(counts.begin(), counts.end())-counts.begin();
+    std::vector<bool> small(numSubsets);
+    for (int i = 0; i < numSubsets; i++)
+        small[i] = (i != largest && counts[i] <= threshold);
+    subsetSlots.resize(numSubsets);
+    int numGridSlots = 0;
+    for (int i = 0; i < numSubsets; i++)
+        if (!small[i])
+            subsetSlots[i] = numGridSlots++;
+    int slot = numGridSlots;
+    for (int i = 0; i < numSubsets; i++)
+        if (small[i])
+            subsetSlots[i] = slot++;
+    return numGridSlots;
+}
+
+/**
+ * Reorder a table of values indexed by slice, such as the effective slices, so that it is indexed by
+ * slices between grid slots instead of slices between subsets.
+ */
+inline std::vector<int> mapSlicesToSlots(const std::vector<int>& sliceValues, const std::vector<int>& subsetSlots) {
+    int numSubsets = subsetSlots.size();
+    std::vector<int> slotValues(sliceValues.size());
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++) {
+            int slot1 = std::min(subsetSlots[i], subsetSlots[j]);
+            int slot2 = std::max(subsetSlots[i], subsetSlots[j]);
+            slotValues[slot2*(slot2+1)/2+slot1] = sliceValues[j*(j+1)/2+i];
+        }
+    return slotValues;
+}
+
+/**
+ * Get the slice between the subsets of every ordered pair of grid slots, as a square table with one
+ * row per slot.
+ */
+inline std::vector<int> getSlotSlices(const std::vector<int>& subsetSlots) {
+    int numSubsets = subsetSlots.size();
+    std::vector<int> slotSlices(numSubsets*numSubsets);
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = 0; j < numSubsets; j++) {
+            int first = std::min(i, j), second = std::max(i, j);
+            slotSlices[subsetSlots[i]*numSubsets+subsetSlots[j]] = second*(second+1)/2+first;
+        }
+    return slotSlices;
+}
+
+/**
+ * Assign the LJPME dispersion grids of the subsets.  A subset whose particles have neither epsilons
+ * nor epsilon offsets contributes nothing to the dispersion sums, so it gets no grid.  The other
+ * subsets take the grids in increasing order.
+ *
+ * @param particleSubsets      the subset of each particle
+ * @param dispersiveParticles  whether each particle has an epsilon or an epsilon offset
+ * @param numSubsets           the number of subsets
+ * @param subsetGrids          on exit, the grid of each subset, or -1 if it has none
+ * @return the number of dispersion grids
+ */
+inline int assignDispersionGrids(const std::vector<int>& particleSubsets, const std::vector<char>& dispersiveParticles, int numSubsets,
+                                 std::vector<int>& subsetGrids) {
+    std::vector<bool> hasGrid(numSubsets, false);
+    for (int i = 0; i < particleSubsets.size(); i++)
+        if (dispersiveParticles[i])
+            hasGrid[particleSubsets[i]] = true;
+    subsetGrids.resize(numSubsets);
+    int numGrids = 0;
+    for (int i = 0; i < numSubsets; i++)
+        subsetGrids[i] = (hasGrid[i] ? numGrids++ : -1);
+    return numGrids;
+}
+
+/**
+ * Restrict a table of values indexed by slice, such as the effective slices, to the slices between
+ * subsets that have dispersion grids, indexed by slices between grids instead of slices between subsets.
+ */
+inline std::vector<int> mapSlicesToGrids(const std::vector<int>& sliceValues, const std::vector<int>& subsetGrids, int numGrids) {
+    int numSubsets = subsetGrids.size();
+    std::vector<int> gridValues(numGrids*(numGrids+1)/2);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            if (subsetGrids[i] >= 0 && subsetGrids[j] >= 0) {
+                int grid1 = std::min(subsetGrids[i], subsetGrids[j]);
+                int grid2 = std::max(subsetGrids[i], subsetGrids[j]);
+                gridValues[grid2*(grid2+1)/2+grid1] = sliceValues[j*(j+1)/2+i];
+            }
+    return gridValues;
+}
+
+/**
+ * Get the slice between the subsets of every ordered pair of dispersion grids, as a square table with
+ * one row per grid.
+ */
+inline std::vector<int> getGridSlices(const std::vector<int>& subsetGrids, int numGrids) {
+    int numSubsets = subsetGrids.size();
+    std::vector<int> gridSlices(numGrids*numGrids);
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = 0; j < numSubsets; j++)
+            if (subsetGrids[i] >= 0 && subsetGrids[j] >= 0) {
+                int first = std::min(i, j), second = std::max(i, j);
+                gridSlices[subsetGrids[i]*numGrids+subsetGrids[j]] = second*(second+1)/2+first;
+            }
+    return gridSlices;
+}
+
+/**
+ * List the charged particles of the small subsets, sorted by grid slot.  The particles are stored as
+ * pairs (smallAtoms[2*k], smallAtoms[2*k+1]) of particle index and slot, and those in slot
+ * numGridSlots+s are listed for k between slotStart[s] and slotStart[s+1]-1.  Particles without
+ * charges or charge offsets are left out, so that uncharged subsets cost nothing.
+ */
+inline void listSmallSubsetAtoms(const std::vector<int>& particleSubsets, const std::vector<char>& chargedParticles, const std::vector<int>& subsetSlots,
+                                 int numGridSlots, std::vector<int>& smallAtoms, std::vector<int>& slotStart) {
+    int numSmallSlots = subsetSlots.size()-numGridSlots;
+    slotStart.assign(numSmallSlots+1, 0);
+    for (int atom = 0; atom < particleSubsets.size(); atom++)
+        if (chargedParticles[atom] && subsetSlots[particleSubsets[atom]] >= numGridSlots)
+            slotStart[subsetSlots[particleSubsets[atom]]-numGridSlots+1]++;
+    for (int i = 0; i < numSmallSlots; i++)
+        slotStart[i+1] += slotStart[i];
+    smallAtoms.resize(2*slotStart[numSmallSlots]);
+    std::vector<int> position(slotStart.begin(), slotStart.end()-1);
+    for (int atom = 0; atom < particleSubsets.size(); atom++) {
+        int slot = subsetSlots[particleSubsets[atom]];
+        if (chargedParticles[atom] && slot >= numGridSlots) {
+            int k = position[slot-numGridSlots]++;
+            smallAtoms[2*k] = atom;
+            smallAtoms[2*k+1] = slot;
+        }
+    }
+}
+
+/**
+ * Select the number of wave vectors that the tiled reciprocal space energy kernels load into
+ * local memory at once, so that a tile fits in a typical amount of shared memory.
+ */
+inline int getSliceEnergyTileSize(int numSubsets, int realSize) {
+    const int maxLocalMemory = 16384;
+    int tileSize = maxLocalMemory/(numSubsets*2*realSize+realSize);
+    return std::max(1, std::min(SliceEnergyBlockSize, tileSize));
+}
+
+/**
+ * Select the number of wave vectors that the tiled Ewald force kernel loads into local memory at
+ * once.  Each of them takes a real4 and the combined sums of all subsets, which are real2 values.
+ */
+inline int getEwaldForceTileSize(int numSubsets, int realSize, int blockSize) {
+    const int maxLocalMemory = 16384;
+    int tileSize = maxLocalMemory/(numSubsets*2*realSize+4*realSize);
+    return std::max(1, std::min(blockSize, tileSize));
+}
+
+/**
+ * List the sizes that the PME autotuner considers for one axis of a grid.  The minimum size must
+ * already be a legal FFT size, that is, have no prime factors larger than 13.  Larger sizes with
+ * smaller prime factors are often transformed faster, so the list holds the smallest sizes whose
+ * factors do not exceed 13, 7, 5, 3 and 2, as long as they are no larger than maxRatio times the
+ * minimum.  The sizes are returned in increasing order.
+ */
+inline std::vector<int> findPmeGridSizeCandidates(int minimum, double maxRatio=1.25) {
+    std::vector<int> sizes;
+    for (int maxPrimeFactor : {13, 7, 5, 3, 2}) {
+        int size = minimum;
+        while (true) {
+            int unfactored = size;
+            for (int factor = 2; factor <= maxPrimeFactor; factor++)
+                while (unfactored > 1 && unfactored%factor == 0)
+                    unfactored /= factor;
+            if (unfactored == 1)
+                break;
+            size++;
+        }
+        if (size <= maxRatio*minimum && find(sizes.begin(), sizes.end(), size) == sizes.end())
+            sizes.push_back(size);
+    }
+    sort(sizes.begin(), sizes.end());
+    return sizes;
+}
+
+/**
+ * Choose the dimensions of a PME grid among the candidates of findPmeGridSizeCandidates().  The
+ * axes are optimized one at a time, starting from the smallest grid, so that only a few grids
+ * need to be timed.  The timing function receives the three dimensions and returns the time
+ * taken by the transforms of such a grid.
+ */
+inline void tunePmeGrid(int& xsize, int& ysize, int& zsize, const std::function<double(int, int, int)>& timeGrid) {
+    int grid[3] = {xsize, ysize, zsize};
+    std::vector<int> sizes[3];
+    int numCandidates = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        sizes[axis] = findPmeGridSizeCandidates(grid[axis]);
+        numCandidates += sizes[axis].size()-1;
+    }
+    if (numCandidates == 0)
+        return;
+    double bestTime = timeGrid(grid[0], grid[1], grid[2]);
+    for (int axis = 0; axis < 3; axis++) {
+        int bestSize = grid[axis];
+        for (int i = 1; i < sizes[axis].size(); i++) {
+            grid[axis] = sizes[axis][i];
+            double time = timeGrid(grid[0], grid[1], grid[2]);
+            if (time < bestTime) {
+                bestTime = time;
+                bestSize = grid[axis];
+            }
+        }
+        grid[axis] = bestSize;
+    }
+    xsize = grid[0];
+    ysize = grid[1];
+    zsize = grid[2];
+}
+
+/**
+ * Replace the dimensions of a PME grid by ones stored from a previous tuning, provided that none
+ * of them is smaller than the original, so that a stored configuration can never make the sums
+ * less accurate.  Returns false, leaving the grid unchanged, otherwise.
+ */
+inline bool applyTunedPmeGrid(const int tuned[3], int& xsize, int& ysize, int& zsize) {
+    if (tuned[0] < xsize || tuned[1] < ysize || tuned[2] < zsize)
+        return false;
+    xsize = tuned[0];
+    ysize = tuned[1];
+    zsize = tuned[2];
+    return true;
+}
+
+/**
+ * Add the size of a device array to a breakdown of memory usage, unless the array is uninitialized.
+ * The sizes of arrays with the same name are added together.
+ */
+inline void addMemoryUsage(std::map<std::string, long long>& usage, const OpenMM::ArrayInterface& array) {
+    if (array.isInitialized())
+        usage[array.getName()] += (long long) array.getSize()*array.getElementSize();
+}
+
+/**
+ * Get whether the time taken by each stage of the calculation should be measured.  This is requested
+ * either with SlicedNonbondedForce::setProfileStages() or by setting the NONBONDED_SLICING_PROFILE
+ * environment variable to a value other than 0.
+ */
+inline bool isStageProfilingRequested(const SlicedNonbondedForce& force) {
+    char* value = getenv("NONBONDED_SLICING_PROFILE");
+    return force.getProfileStages() || (value != NULL && std::string(value) != "" && std::string(value) != "0");
+}
+
+/**
+ * Get the directory in which FFT plans are cached when the platform does not define one.  This is
+ * the OPENMM_CACHE_DIR environment variable if it is set, or else the system temporary directory.
+ */
+inline std::string getDefaultCacheDirectory() {
+    for (const char* variable : {"OPENMM_CACHE_DIR", "TMPDIR", "TEMP"}) {
+        char* value = getenv(variable);
+        if (value != NULL)
+            return std::string(value);
+    }
+    return "/tmp";
+}
+
+/**
+ * Get the name of the file in which an FFT plan is cached.  The key must describe everything
+ * the plan depends on, such as the library version, the device, the precision, and the grid.
+ */
+inline std::string getPlanCacheFileName(const std::string& cacheDir, const std::string& key) {
+    std::stringstream name;
+    name << cacheDir << "/nonbondedslicing_vkfft_" << std::hex << std::hash<std::string>()(key) << ".bin";
+    return name.str();
+}
+
+/**
+ * Load a cached FFT plan.  The file starts with the key it was saved with, so that a hash
+ * collision or a truncated file is detected and the plan is generated again.
+ *
+ * @param cacheDir  the directory in which plans are cached
+ * @param key       a description of everything the plan depends on
+ * @param data      on exit, the contents of the plan
+ * @return whether a valid plan was found
+ */
+inline bool loadCachedPlan(const std::string& cacheDir, const std::string& key, std::vector<char>& data) {
+    std::ifstream file(getPlanCacheFileName(cacheDir, key), std::ios::binary);
+    if (!file.is_open())
+        return false;
+    std::string storedKey;
+    uint64_t size;
+    if (!std::getline(file, storedKey, '\0') || storedKey != key || !file.read((char*) &size, sizeof(size)))
+        return false;
+    data.resize(size);
+    return size > 0 && file.read(data.data(), size) && file.peek() == EOF;
+}
+
+/**
+ * Save an FFT plan to the cache.  The plan is written to a temporary file which is then renamed,
+ * so that processes creating contexts at the same time never see a partial file.  Failures are
+ * ignored, since the cache only affects the time taken to create a context.
+ *
+ * @param cacheDir  the directory in which plans are cached
+ * @param key       a description of everything the plan depends on
+ * @param data      the contents of the plan
+ * @param size      the size of the plan in bytes
+ */
+inline void saveCachedPlan(const std::string& cacheDir, const std::string& key, const void* data, uint64_t size) {
+    std::string fileName = getPlanCacheFileName(cacheDir, key);
+    std::string tempName = fileName+"."+std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+        std::ofstream file(tempName, std::ios::binary);
+        if (!file.is_open())
+            return;
+        file.write(key.c_str(), key.size()+1);
+        file.write((const char*) &size, sizeof(size));
+        file.write((const char*) data, size);
+        if (!file.good()) {
+            file.close();
+            remove(tempName.c_str());
+            return;
+        }
+    }
+    if (rename(tempName.c_str(), fileName.c_str()) != 0)
+        remove(tempName.c_str());
+}
 
 } // namespace NonbondedSlicing
 
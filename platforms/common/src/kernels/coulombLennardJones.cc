@@ -2,6 +2,14 @@
     int slice = SUBSET1>SUBSET2 ? SUBSET1*(SUBSET1+1)/2+SUBSET2 : SUBSET2*(SUBSET2+1)/2+SUBSET1;
     real clLambda = LAMBDA[slice].x;
     real ljLambda = LAMBDA[slice].y;
+#if USE_SLICE_FORCE_GROUPS
+    // Each force group has its own copy of this code, which only computes the slices in that group.
+    if (SLICE_IN_FORCE_GROUP) {
+#endif
+#if SKIP_DECOUPLED_SLICES
+    // Pairs in fully decoupled slices contribute nothing unless a derivative is requested.
+    if (clLambda != 0 || ljLambda != 0 || SLICE_HAS_DERIVATIVE) {
+#endif
 #if USE_EWALD
     unsigned int includeInteraction = (!isExcluded && r2 < CUTOFF_SQUARED);
     const real alphaR = EWALD_ALPHA*r;
@@ -119,6 +127,42 @@
     tempEnergy += clLambda*clEnergy;
 #endif
 #endif
+#ifdef INCLUDE_FORCES
 dEdR += includeInteraction ? tempForce*invR*invR : 0;
+#endif
+#if USE_SLICE_FORCES && defined(INCLUDE_FORCES)
+    // In diagonal tiles, each pair is visited once for each of its atoms, and only the first one is updated.
+    if (includeInteraction) {
+        real sliceForceScale = tempForce*invR*invR;
+        GLOBAL mm_ulong* buffer = SLICE_FORCES+3*slice*PADDED_NUM_ATOMS;
+        ATOMIC_ADD(&buffer[atom1], (mm_ulong) realToFixedPoint(-delta.x*sliceForceScale));
+        ATOMIC_ADD(&buffer[atom1+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(-delta.y*sliceForceScale));
+        ATOMIC_ADD(&buffer[atom1+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(-delta.z*sliceForceScale));
+        if (interactionScale == 1) {
+            ATOMIC_ADD(&buffer[atom2], (mm_ulong) realToFixedPoint(delta.x*sliceForceScale));
+            ATOMIC_ADD(&buffer[atom2+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(delta.y*sliceForceScale));
+            ATOMIC_ADD(&buffer[atom2+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(delta.z*sliceForceScale));
+        }
+    }
+#endif
+#if USE_SLICE_ENERGIES && defined(INCLUDE_ENERGY)
+    // The unscaled energies of the pair are stored with its first atom, and split between the two
+    // visits of each pair in diagonal tiles.
+    if (includeInteraction) {
+        GLOBAL mm_ulong* buffer = SLICE_ENERGIES+2*slice*PADDED_NUM_ATOMS;
+#if USE_EWALD || HAS_COULOMB
+        ATOMIC_ADD(&buffer[atom1], (mm_ulong) realToFixedPoint(interactionScale*clEnergy));
+#endif
+#if HAS_LENNARD_JONES
+        ATOMIC_ADD(&buffer[atom1+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(interactionScale*ljEnergy));
+#endif
+    }
+#endif
 COMPUTE_DERIVATIVES
+#if SKIP_DECOUPLED_SLICES
+    }
+#endif
+#if USE_SLICE_FORCE_GROUPS
+    }
+#endif
 }
@@ -0,0 +1,11 @@
+/**
+ * Add the reciprocal space forces computed on the host to the force buffers.
+ */
+KERNEL void addCpuPmeForces(GLOBAL const real4* RESTRICT cpuForces, GLOBAL mm_long* RESTRICT forceBuffers) {
+    for (int atom = GLOBAL_ID; atom < NUM_ATOMS; atom += GLOBAL_SIZE) {
+        real4 force = cpuForces[atom];
+        forceBuffers[atom] += realToFixedPoint(force.x);
+        forceBuffers[atom+PADDED_NUM_ATOMS] += realToFixedPoint(force.y);
+        forceBuffers[atom+2*PADDED_NUM_ATOMS] += realToFixedPoint(force.z);
+    }
+}
@@ -0,0 +1,16 @@
+/**
+ * The accumulators of the reciprocal space slice energies.  In single precision, each thread sums its
+ * terms in 64-bit fixed point, in the same way as the forces, so that the reciprocal space energies and
+ * their parameter derivatives do not lose accuracy as the number of wave vectors grows.  Otherwise, they
+ * are summed in the mixed precision type, which is already double.  The direct space and exception
+ * terms are summed by OpenMM's own kernels and are not affected.
+ */
+#ifdef USE_FIXED_POINT_ENERGY
+typedef mm_long energy_accum;
+#define TO_ENERGY_ACCUM(x) realToFixedPoint(x)
+#define FROM_ENERGY_ACCUM(x) ((mixed) (x)/(mixed) 0x100000000)
+#else
+typedef mixed energy_accum;
+#define TO_ENERGY_ACCUM(x) (x)
+#define FROM_ENERGY_ACCUM(x) (x)
+#endif
@@ -2,6 +2,92 @@ DEVICE real2 multofReal2(real2 a, real2 b) {
     return make_real2(a.x*b.x - a.y*b.y, a.x*b.y + a.y*b.x);
 }
 
+#ifdef USE_TILED_EWALD
+/**
+ * Precompute the cosine and sine sums which appear in each force term.  Each thread computes the sums
+ * of one wave vector, while the atoms are loaded into local memory in tiles of EWALD_BLOCK_SIZE, so
+ * that every thread block reads each atom only once for all of its wave vectors.
+ */
+
+KERNEL void calculateEwaldCosSinSums(GLOBAL mixed* RESTRICT energyBuffer, GLOBAL const real4* RESTRICT posq,
+                GLOBAL const int* RESTRICT subsets, GLOBAL real2* RESTRICT cosSinSum, real4 periodicBoxSize) {
+    LOCAL real4 tilePosq[EWALD_BLOCK_SIZE];
+    LOCAL int tileSubsets[EWALD_BLOCK_SIZE];
+    const unsigned int ksizex = 2*KMAX_X-1;
+    const unsigned int ksizey = 2*KMAX_Y-1;
+    const unsigned int ksizez = 2*KMAX_Z-1;
+    const int firstK = (KMAX_Y-1)*ksizez+KMAX_Z;
+    const int totalK = ksizex*ksizey*ksizez;
+    real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
+    real reciprocalCoefficient = ONE_4PI_EPS0*4*M_PI/(periodicBoxSize.x*periodicBoxSize.y*periodicBoxSize.z);
+#ifndef USE_TILED_ENERGY
+    const int effectiveSlice[NUM_SLICES] = {EFFECTIVE_SLICES};
+    energy_accum energy[NUM_EFFECTIVE_SLICES] = {0};
+#endif
+    for (int base = firstK+GROUP_ID*EWALD_BLOCK_SIZE; base < totalK; base += GLOBAL_SIZE) {
+        // Find the wave vector (kx, ky, kz) this thread works on.  All threads take part in loading
+        // the tiles, even those beyond the last wave vector.
+
+        int index = base+LOCAL_ID;
+        bool isValid = (index < totalK);
+        int rx = index/(ksizey*ksizez);
+        int remainder = index - rx*ksizey*ksizez;
+        int ry = remainder/ksizez;
+        int rz = remainder - ry*ksizez - KMAX_Z + 1;
+        ry += -KMAX_Y + 1;
+        real kx = rx*reciprocalBoxSize.x;
+        real ky = ry*reciprocalBoxSize.y;
+        real kz = rz*reciprocalBoxSize.z;
+
+        // Compute the sums for this wave vector.
+
+        real2 sum[NUM_SUBSETS] = {make_real2(0)};
+        for (int tileStart = 0; tileStart < NUM_ATOMS; tileStart += EWALD_BLOCK_SIZE) {
+            int atom = tileStart+LOCAL_ID;
+            if (atom < NUM_ATOMS) {
+                tilePosq[LOCAL_ID] = posq[atom];
+                tileSubsets[LOCAL_ID] = subsets[atom];
+            }
+            SYNC_THREADS;
+            if (isValid) {
+                int tileSize = min(EWALD_BLOCK_SIZE, NUM_ATOMS-tileStart);
+                for (int j = 0; j < tileSize; j++) {
+                    real4 apos = tilePosq[j];
+                    real phase = apos.x*kx + apos.y*ky + apos.z*kz;
+                    sum[tileSubsets[j]] += apos.w*make_real2(COS(phase), SIN(phase));
+                }
+            }
+            SYNC_THREADS;
+        }
+        if (!isValid)
+            continue;
+
+#ifdef USE_TILED_ENERGY
+        for (int j = 0; j < NUM_SUBSETS; j++)
+            cosSinSum[NUM_SUBSETS*index+j] = sum[j];
+#else
+        real k2 = kx*kx + ky*ky + kz*kz;
+        real ak = EXP(k2*EXP_COEFFICIENT) / k2;
+
+        for (int j = 0; j < NUM_SUBSETS; j++) {
+            real2 sum_j = sum[j];
+
+            cosSinSum[NUM_SUBSETS*index+j] = sum_j;
+
+            // Compute the contribution to the energy.
+
+            for (int i = 0; i < j; i++)
+                energy[effectiveSlice[j*(j+1)/2+i]] += TO_ENERGY_ACCUM(2*ak*(sum[i].x*sum_j.x + sum[i].y*sum_j.y));
+            energy[effectiveSlice[j*(j+3)/2]] += TO_ENERGY_ACCUM(ak*(sum_j.x*sum_j.x + sum_j.y*sum_j.y));
+        }
+#endif
+    }
+#ifndef USE_TILED_ENERGY
+    for (int slice = 0; slice < NUM_EFFECTIVE_SLICES; slice++)
+        energyBuffer[GLOBAL_ID*NUM_EFFECTIVE_SLICES+slice] = reciprocalCoefficient*FROM_ENERGY_ACCUM(energy[slice]);
+#endif
+}
+#else
 /**
  * Precompute the cosine and sine sums which appear in each force term.
  */
@@ -15,7 +101,10 @@ KERNEL void calculateEwaldCosSinSums(GLOBAL mixed* RESTRICT energyBuffer, GLOBAL
     real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
     real reciprocalCoefficient = ONE_4PI_EPS0*4*M_PI/(periodicBoxSize.x*periodicBoxSize.y*periodicBoxSize.z);
     unsigned int index = GLOBAL_ID;
-    mixed energy[NUM_SLICES] = {0};
+#ifndef USE_TILED_ENERGY
+    const int effectiveSlice[NUM_SLICES] = {EFFECTIVE_SLICES};
+    energy_accum energy[NUM_EFFECTIVE_SLICES] = {0};
+#endif
     while (index < (KMAX_Y-1)*ksizez+KMAX_Z)
         index += GLOBAL_SIZE;
     while (index < totalK) {
@@ -44,6 +133,10 @@ KERNEL void calculateEwaldCosSinSums(GLOBAL mixed* RESTRICT energyBuffer, GLOBAL
             sum[subsets[atom]] += apos.w*structureFactor;
         }
 
+#ifdef USE_TILED_ENERGY
+        for (int j = 0; j < NUM_SUBSETS; j++)
+            cosSinSum[NUM_SUBSETS*index+j] = sum[j];
+#else
         real k2 = kx*kx + ky*ky + kz*kz;
         real ak = EXP(k2*EXP_COEFFICIENT) / k2;
 
@@ -55,28 +148,196 @@ KERNEL void calculateEwaldCosSinSums(GLOBAL mixed* RESTRICT energyBuffer, GLOBAL
             // Compute the contribution to the energy.
 
             for (int i = 0; i < j; i++)
-                energy[j*(j+1)/2+i] += 2*ak*(sum[i].x*sum_j.x + sum[i].y*sum_j.y);
-            energy[j*(j+3)/2] += ak*(sum_j.x*sum_j.x + sum_j.y*sum_j.y);
+                energy[effectiveSlice[j*(j+1)/2+i]] += TO_ENERGY_ACCUM(2*ak*(sum[i].x*sum_j.x + sum[i].y*sum_j.y));
+            energy[effectiveSlice[j*(j+3)/2]] += TO_ENERGY_ACCUM(ak*(sum_j.x*sum_j.x + sum_j.y*sum_j.y));
         }
+#endif
         index += GLOBAL_SIZE;
     }
-    for (int slice = 0; slice < NUM_SLICES; slice++)
-        energyBuffer[GLOBAL_ID*NUM_SLICES+slice] = reciprocalCoefficient*energy[slice];
+#ifndef USE_TILED_ENERGY
+    for (int slice = 0; slice < NUM_EFFECTIVE_SLICES; slice++)
+        energyBuffer[GLOBAL_ID*NUM_EFFECTIVE_SLICES+slice] = reciprocalCoefficient*FROM_ENERGY_ACCUM(energy[slice]);
+#endif
+}
+#endif
+
+#ifdef USE_TILED_ENERGY
+/**
+ * Compute the reciprocal space energy of each effective slice from the precomputed sums, when there are
+ * too many slices for each thread to keep its own accumulators.  Each thread block loads a tile of
+ * ENERGY_TILE_SIZE wave vectors into local memory, and then every thread accumulates the energies of at
+ * most SLICES_PER_THREAD effective slices.  The energy buffer contains one entry per thread block and
+ * effective slice.
+ */
+
+KERNEL void calculateEwaldEnergy(GLOBAL mixed* RESTRICT energyBuffer, GLOBAL const real2* RESTRICT cosSinSum,
+                GLOBAL const int* RESTRICT memberStart, GLOBAL const int* RESTRICT memberSubsets, real4 periodicBoxSize) {
+    LOCAL real2 tileSums[ENERGY_TILE_SIZE*NUM_SUBSETS];
+    LOCAL real tileEterm[ENERGY_TILE_SIZE];
+    const unsigned int ksizex = 2*KMAX_X-1;
+    const unsigned int ksizey = 2*KMAX_Y-1;
+    const unsigned int ksizez = 2*KMAX_Z-1;
+    const int firstK = (KMAX_Y-1)*ksizez+KMAX_Z;
+    const int totalK = ksizex*ksizey*ksizez;
+    real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
+    real reciprocalCoefficient = ONE_4PI_EPS0*4*M_PI/(periodicBoxSize.x*periodicBoxSize.y*periodicBoxSize.z);
+    energy_accum energy[SLICES_PER_THREAD] = {0};
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int base = firstK+GROUP_ID*ENERGY_TILE_SIZE; base < totalK; base += numGroups*ENERGY_TILE_SIZE) {
+        const int tileSize = min(ENERGY_TILE_SIZE, totalK-base);
+
+        // Load the sums and energy terms of a tile of wave vectors.
+
+        for (int k = LOCAL_ID; k < tileSize; k += LOCAL_SIZE) {
+            int index = base+k;
+            int rx = index/(ksizey*ksizez);
+            int remainder = index - rx*ksizey*ksizez;
+            int ry = remainder/ksizez;
+            int rz = remainder - ry*ksizez - KMAX_Z + 1;
+            ry += -KMAX_Y + 1;
+            real kx = rx*reciprocalBoxSize.x;
+            real ky = ry*reciprocalBoxSize.y;
+            real kz = rz*reciprocalBoxSize.z;
+            real k2 = kx*kx + ky*ky + kz*kz;
+            tileEterm[k] = 2*reciprocalCoefficient*EXP(k2*EXP_COEFFICIENT)/k2;
+            for (int j = 0; j < NUM_SUBSETS; j++)
+                tileSums[k*NUM_SUBSETS+j] = cosSinSum[NUM_SUBSETS*index+j];
+        }
+        SYNC_THREADS;
+
+        // Accumulate the energies of the effective slices assigned to this thread.
+
+        for (int t = 0; t < SLICES_PER_THREAD; t++) {
+            int slice = LOCAL_ID+t*LOCAL_SIZE;
+            if (slice < NUM_EFFECTIVE_SLICES)
+                for (int member = memberStart[slice]; member < memberStart[slice+1]; member++) {
+                    int i = memberSubsets[2*member];
+                    int j = memberSubsets[2*member+1];
+                    real scale = (i == j ? 0.5f : 1.0f);
+                    for (int k = 0; k < tileSize; k++) {
+                        real2 si = tileSums[k*NUM_SUBSETS+i];
+                        real2 sj = tileSums[k*NUM_SUBSETS+j];
+                        energy[t] += TO_ENERGY_ACCUM(scale*tileEterm[k]*(si.x*sj.x + si.y*sj.y));
+                    }
+                }
+        }
+        SYNC_THREADS;
+    }
+    for (int t = 0; t < SLICES_PER_THREAD; t++) {
+        int slice = LOCAL_ID+t*LOCAL_SIZE;
+        if (slice < NUM_EFFECTIVE_SLICES)
+            energyBuffer[GROUP_ID*NUM_EFFECTIVE_SLICES+slice] = FROM_ENERGY_ACCUM(energy[t]);
+    }
 }
+#endif
 
+#ifdef USE_TILED_EWALD
 /**
  * Compute the reciprocal space part of the Ewald force, using the precomputed sums from the
- * previous routine.
+ * previous routine.  Each thread computes the force on one atom, while the wave vectors are loaded
+ * into local memory in tiles of EWALD_FORCE_TILE_SIZE.  For each wave vector of a tile, the sums of
+ * all subsets are combined in advance with the Coulomb scaling parameters of the slices they form
+ * with every subset, so that each atom only needs the combined sum of its own subset.
  */
 
 KERNEL void calculateEwaldForces(GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL const real4* RESTRICT posq, GLOBAL const real2* RESTRICT cosSinSum,
             GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas, real4 periodicBoxSize) {
+    LOCAL real4 tileWaveVectors[EWALD_FORCE_TILE_SIZE];
+    LOCAL real2 tileSums[EWALD_FORCE_TILE_SIZE*NUM_SUBSETS];
+    const unsigned int ksizey = 2*KMAX_Y-1;
+    const unsigned int ksizez = 2*KMAX_Z-1;
+    const int firstK = (KMAX_Y-1)*ksizez+KMAX_Z;
+    const int lastK = KMAX_X*ksizey*ksizez;
+    real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
+    real reciprocalCoefficient = ONE_4PI_EPS0*4*M_PI/(periodicBoxSize.x*periodicBoxSize.y*periodicBoxSize.z);
+    for (int base = GROUP_ID*EWALD_BLOCK_SIZE; base < NUM_ATOMS; base += GLOBAL_SIZE) {
+        int atom = base+LOCAL_ID;
+        bool isValid = (atom < NUM_ATOMS);
+        real4 apos = (isValid ? posq[atom] : make_real4(0));
+        int subset = (isValid ? subsets[atom] : 0);
+        real3 force = make_real3(0);
+        for (int tileStart = firstK; tileStart < lastK; tileStart += EWALD_FORCE_TILE_SIZE) {
+            int tileSize = min(EWALD_FORCE_TILE_SIZE, lastK-tileStart);
+
+            // Load the wave vectors of the tile, each one with its force coefficient in the w component.
+
+            for (int k = LOCAL_ID; k < tileSize; k += EWALD_BLOCK_SIZE) {
+                int index = tileStart+k;
+                int rx = index/(ksizey*ksizez);
+                int remainder = index - rx*ksizey*ksizez;
+                int ry = remainder/ksizez;
+                int rz = remainder - ry*ksizez - KMAX_Z + 1;
+                ry += -KMAX_Y + 1;
+                real kx = rx*reciprocalBoxSize.x;
+                real ky = ry*reciprocalBoxSize.y;
+                real kz = rz*reciprocalBoxSize.z;
+                real k2 = kx*kx + ky*ky + kz*kz;
+                tileWaveVectors[k] = make_real4(kx, ky, kz, 2*reciprocalCoefficient*EXP(k2*EXP_COEFFICIENT)/k2);
+            }
+
+            // Combine the sums of all subsets as seen by each subset.
+
+            for (int m = LOCAL_ID; m < tileSize*NUM_SUBSETS; m += EWALD_BLOCK_SIZE) {
+                int k = m/NUM_SUBSETS;
+                int i = m - k*NUM_SUBSETS;
+                real2 combined = make_real2(0);
+                for (int j = 0; j < NUM_SUBSETS; j++) {
+                    int slice = j > i ? j*(j+1)/2+i : i*(i+1)/2+j;
+                    combined += sliceLambdas[slice].x*cosSinSum[NUM_SUBSETS*(tileStart+k)+j];
+                }
+                tileSums[m] = combined;
+            }
+            SYNC_THREADS;
+
+            // Accumulate the force contributions of the tile.
+
+            if (isValid)
+                for (int k = 0; k < tileSize; k++) {
+                    real4 waveVector = tileWaveVectors[k];
+                    real phase = apos.x*waveVector.x + apos.y*waveVector.y + apos.z*waveVector.z;
+                    real2 structureFactor = make_real2(COS(phase), SIN(phase));
+                    real2 sum = tileSums[k*NUM_SUBSETS+subset];
+                    real dEdR = waveVector.w*apos.w*(sum.x*structureFactor.y - sum.y*structureFactor.x);
+                    force.x += dEdR*waveVector.x;
+                    force.y += dEdR*waveVector.y;
+                    force.z += dEdR*waveVector.z;
+                }
+            SYNC_THREADS;
+        }
+
+        // Record the force on the atom.
+
+        if (isValid) {
+            forceBuffers[atom] += realToFixedPoint(force.x);
+            forceBuffers[atom+PADDED_NUM_ATOMS] += realToFixedPoint(force.y);
+            forceBuffers[atom+2*PADDED_NUM_ATOMS] += realToFixedPoint(force.z);
+        }
+    }
+}
+#else
+/**
+ * Compute the reciprocal space part of the Ewald force, using the precomputed sums from the
+ * previous routine.  With USE_SLICE_FORCES, the contribution of each subset is also added to the
+ * force of the slice it forms with the subset of the atom.
+ */
+
+KERNEL void calculateEwaldForces(GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL const real4* RESTRICT posq, GLOBAL const real2* RESTRICT cosSinSum,
+            GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas, real4 periodicBoxSize
+#ifdef USE_SLICE_FORCES
+            , GLOBAL mm_long* RESTRICT sliceForces
+#endif
+            ) {
     unsigned int atom = GLOBAL_ID;
     real3 reciprocalBoxSize = make_real3(2*M_PI/periodicBoxSize.x, 2*M_PI/periodicBoxSize.y, 2*M_PI/periodicBoxSize.z);
     real reciprocalCoefficient = ONE_4PI_EPS0*4*M_PI/(periodicBoxSize.x*periodicBoxSize.y*periodicBoxSize.z);
     while (atom < NUM_ATOMS) {
         real3 force = make_real3(0);
         real4 apos = posq[atom];
+#ifdef USE_SLICE_FORCES
+        real3 sliceForce[NUM_SUBSETS];
+        for (int j = 0; j < NUM_SUBSETS; j++)
+            sliceForce[j] = make_real3(0);
+#endif
 
         // Loop over all wave vectors.
 
@@ -106,7 +367,11 @@ KERNEL void calculateEwaldForces(GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL c
                     for (int j = 0; j < NUM_SUBSETS; j++) {
                         real2 sum_j = cosSinSum[NUM_SUBSETS*index+j];
                         int slice = j > i ? j*(j+1)/2+i : i*(i+1)/2+j;
-                        sum += sliceLambdas[slice].x*(sum_j.x*structureFactor.y - sum_j.y*structureFactor.x);
+                        real term = sliceLambdas[slice].x*(sum_j.x*structureFactor.y - sum_j.y*structureFactor.x);
+                        sum += term;
+#ifdef USE_SLICE_FORCES
+                        sliceForce[j] += make_real3(kx, ky, kz)*(2*reciprocalCoefficient*ak*apos.w*term);
+#endif
                     }
                     real dEdR = 2*reciprocalCoefficient*ak*apos.w*sum;
 
@@ -124,6 +389,17 @@ KERNEL void calculateEwaldForces(GLOBAL mm_long* RESTRICT forceBuffers, GLOBAL c
         forceBuffers[atom] += realToFixedPoint(force.x);
         forceBuffers[atom+PADDED_NUM_ATOMS] += realToFixedPoint(force.y);
         forceBuffers[atom+2*PADDED_NUM_ATOMS] += realToFixedPoint(force.z);
+#ifdef USE_SLICE_FORCES
+        int i = subsets[atom];
+        for (int j = 0; j < NUM_SUBSETS; j++) {
+            int slice = j > i ? j*(j+1)/2+i : i*(i+1)/2+j;
+            GLOBAL mm_long* buffer = sliceForces+3*slice*PADDED_NUM_ATOMS;
+            buffer[atom] += realToFixedPoint(sliceForce[j].x);
+            buffer[atom+PADDED_NUM_ATOMS] += realToFixedPoint(sliceForce[j].y);
+            buffer[atom+2*PADDED_NUM_ATOMS] += realToFixedPoint(sliceForce[j].z);
+        }
+#endif
         atom += GLOBAL_SIZE;
     }
 }
+#endif
@@ -1,8 +1,20 @@
+#if BALANCE_LOADS
+if ((int) index < LOAD_RANGE[0].x || (int) index >= LOAD_RANGE[0].y)
+    continue;
+#endif
 float4 exceptionParams = PARAMS[index];
 float sliceAsFloat = exceptionParams.w;
 int slice = *((int*) &sliceAsFloat);
 real clLambda = LAMBDAS[slice].x;
 real ljLambda = LAMBDAS[slice].y;
+real3 force1 = make_real3(0, 0, 0);
+real3 force2 = make_real3(0, 0, 0);
+#if USE_SLICE_FORCE_GROUPS
+if (SLICE_IN_FORCE_GROUP) {
+#endif
+#if SKIP_DECOUPLED_SLICES
+if (clLambda != 0 || ljLambda != 0 || SLICE_HAS_DERIVATIVE) {
+#endif
 real3 delta = make_real3(pos2.x-pos1.x, pos2.y-pos1.y, pos2.z-pos1.z);
 #if APPLY_PERIODIC
 APPLY_PERIODIC_TO_DELTA(delta)
@@ -19,6 +31,26 @@ dEdR *= invR*invR;
 real clEnergy = exceptionParams.x*invR;
 energy += clLambda*clEnergy + ljLambda*ljEnergy;
 delta *= dEdR;
-real3 force1 = -delta;
-real3 force2 = delta;
-COMPUTE_DERIVATIVES
\ No newline at end of file
+force1 = -delta;
+force2 = delta;
+COMPUTE_DERIVATIVES
+#if USE_SLICE_ENERGIES
+GLOBAL mm_ulong* sliceEnergyBuffer = SLICE_ENERGIES+2*slice*PADDED_NUM_ATOMS;
+ATOMIC_ADD(&sliceEnergyBuffer[atom1], (mm_ulong) realToFixedPoint(clEnergy));
+ATOMIC_ADD(&sliceEnergyBuffer[atom1+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(ljEnergy));
+#endif
+#if SKIP_DECOUPLED_SLICES
+}
+#endif
+#if USE_SLICE_FORCE_GROUPS
+}
+#endif
+#if USE_SLICE_FORCES
+GLOBAL mm_ulong* sliceForceBuffer = SLICE_FORCES+3*slice*PADDED_NUM_ATOMS;
+ATOMIC_ADD(&sliceForceBuffer[atom1], (mm_ulong) realToFixedPoint(force1.x));
+ATOMIC_ADD(&sliceForceBuffer[atom1+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(force1.y));
+ATOMIC_ADD(&sliceForceBuffer[atom1+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(force1.z));
+ATOMIC_ADD(&sliceForceBuffer[atom2], (mm_ulong) realToFixedPoint(force2.x));
+ATOMIC_ADD(&sliceForceBuffer[atom2+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(force2.y));
+ATOMIC_ADD(&sliceForceBuffer[atom2+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(force2.z));
+#endif
@@ -1,10 +1,12 @@
 /**
- * Compute the nonbonded parameters for particles and exceptions.
+ * Compute the nonbonded parameters for particles and exceptions.  When there are parameter offsets,
+ * each thread also stores its contribution to the Coulomb and dispersion self energies of every
+ * subset, which reduceSelfEnergies() then sums up.
  */
-KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSelfEnergy, GLOBAL real* RESTRICT globalParams,
+KERNEL void computeParameters(GLOBAL mixed* RESTRICT selfEnergyBuffer, GLOBAL real* RESTRICT globalParams,
         int numAtoms, GLOBAL const float4* RESTRICT baseParticleParams, GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
         GLOBAL float2* RESTRICT sigmaEpsilon, GLOBAL float4* RESTRICT particleParamOffsets, GLOBAL int* RESTRICT particleOffsetIndices,
-        GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas
+        GLOBAL const int* RESTRICT subsets
 #ifdef HAS_EXCEPTIONS
         , int numExceptions, GLOBAL const int2* RESTRICT exceptionPairs, GLOBAL const float4* RESTRICT baseExceptionParams,
         GLOBAL int* RESTRICT exceptionSlices, GLOBAL float4* RESTRICT exceptionParams,
@@ -67,13 +69,35 @@ KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSe
         exceptionParams[i] = make_float4((float) (ONE_4PI_EPS0*params.x), (float) params.y, (float) (4*params.z), sliceAsFloat);
     }
 #endif
-    if (includeSelfEnergy) {
-        mixed energy = 0;
-        for (int j = 0; j < NUM_SUBSETS; j++) {
-            int slice = j*(j+3)/2;
-            energy += sliceLambdas[slice].x*clEnergy[j] + sliceLambdas[slice].y*ljEnergy[j];
+#ifdef HAS_OFFSETS
+    for (int j = 0; j < NUM_SUBSETS; j++) {
+        selfEnergyBuffer[2*(GLOBAL_ID*NUM_SUBSETS+j)] = clEnergy[j];
+        selfEnergyBuffer[2*(GLOBAL_ID*NUM_SUBSETS+j)+1] = ljEnergy[j];
+    }
+#endif
+}
+
+/**
+ * Sum the contributions of all threads to the self energies of each subset.  Each work group
+ * computes one of the 2*NUM_SUBSETS values, which are stored as (Coulomb, dispersion) pairs.
+ */
+KERNEL void reduceSelfEnergies(GLOBAL const mixed* RESTRICT selfEnergyBuffer, int numThreads, GLOBAL mixed* RESTRICT subsetSelfEnergies) {
+    LOCAL mixed temp[SELF_ENERGY_BLOCK_SIZE];
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int index = GROUP_ID; index < 2*NUM_SUBSETS; index += numGroups) {
+        mixed sum = 0;
+        for (int i = LOCAL_ID; i < numThreads; i += LOCAL_SIZE)
+            sum += selfEnergyBuffer[2*NUM_SUBSETS*i+index];
+        temp[LOCAL_ID] = sum;
+        SYNC_THREADS;
+        for (int step = SELF_ENERGY_BLOCK_SIZE/2; step > 0; step /= 2) {
+            if (LOCAL_ID < step)
+                temp[LOCAL_ID] += temp[LOCAL_ID+step];
+            SYNC_THREADS;
         }
-        energyBuffer[GLOBAL_ID] += energy;
+        if (LOCAL_ID == 0)
+            subsetSelfEnergies[index] = temp[0];
+        SYNC_THREADS;
     }
 }
 
@@ -17,10 +17,218 @@ KERNEL void findAtomGridIndex(GLOBAL const real4* RESTRICT posq, GLOBAL int2* RE
                                    ((int) t.y) % GRID_SIZE_Y,
                                    ((int) t.z) % GRID_SIZE_Z);
         int subset = subsets[atom];
+#ifdef USE_TILED_SPREADING
+        // Sort the atoms by the brick of the grid they belong to, rather than by grid point.
+
+        pmeAtomGridIndex[atom] = make_int2(atom, ((subset*NUM_BRICKS_X+gridIndex.x/BRICK_SIZE)*NUM_BRICKS_Y+gridIndex.y/BRICK_SIZE)*NUM_BRICKS_Z+gridIndex.z/BRICK_SIZE);
+#else
         pmeAtomGridIndex[atom] = make_int2(atom, ((subset*GRID_SIZE_X+gridIndex.x)*GRID_SIZE_Y+gridIndex.y)*GRID_SIZE_Z+gridIndex.z);
+#endif
     }
 }
 
+#ifdef USE_CACHED_BSPLINES
+/**
+ * Compute the B-spline coefficients, their derivatives, and the grid point of every atom, so that charge
+ * spreading and force interpolation do not need to compute them again.  They are stored in the order in
+ * which the atoms are sorted by pmeAtomGridIndex, with coefficient j of the atom in sorted position i at
+ * j*NUM_ATOMS+i, so that the consecutive threads of those kernels read consecutive elements.
+ */
+KERNEL void computeBSplines(GLOBAL const real4* RESTRICT posq, GLOBAL const int2* RESTRICT pmeAtomGridIndex,
+        GLOBAL real4* RESTRICT bsplineTheta, GLOBAL real4* RESTRICT bsplineDTheta, GLOBAL int4* RESTRICT bsplineGridPoint,
+        real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+    real3 data[PME_ORDER];
+    real3 ddata[PME_ORDER];
+    const real scale = RECIP((real) (PME_ORDER-1));
+    for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
+        int atom = pmeAtomGridIndex[i].x;
+        real4 pos = posq[atom];
+        APPLY_PERIODIC_TO_POS(pos)
+        real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
+                             pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
+                             pos.z*recipBoxVecZ.z);
+        t.x = (t.x-floor(t.x))*GRID_SIZE_X;
+        t.y = (t.y-floor(t.y))*GRID_SIZE_Y;
+        t.z = (t.z-floor(t.z))*GRID_SIZE_Z;
+        bsplineGridPoint[i] = make_int4(((int) t.x) % GRID_SIZE_X, ((int) t.y) % GRID_SIZE_Y, ((int) t.z) % GRID_SIZE_Z, 0);
+        real3 dr = make_real3(t.x-(int) t.x, t.y-(int) t.y, t.z-(int) t.z);
+        data[PME_ORDER-1] = make_real3(0);
+        data[1] = dr;
+        data[0] = make_real3(1)-dr;
+        for (int j = 3; j < PME_ORDER; j++) {
+            real div = RECIP((real) (j-1));
+            data[j-1] = div*dr*data[j-2];
+            for (int k = 1; k < (j-1); k++)
+                data[j-k-1] = div*((dr+make_real3(k))*data[j-k-2] + (make_real3(j-k)-dr)*data[j-k-1]);
+            data[0] = div*(make_real3(1)-dr)*data[0];
+        }
+        ddata[0] = -data[0];
+        for (int j = 1; j < PME_ORDER; j++)
+            ddata[j] = data[j-1]-data[j];
+        data[PME_ORDER-1] = scale*dr*data[PME_ORDER-2];
+        for (int j = 1; j < (PME_ORDER-1); j++)
+            data[PME_ORDER-j-1] = scale*((dr+make_real3(j))*data[PME_ORDER-j-2] + (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
+        data[0] = scale*(make_real3(1)-dr)*data[0];
+        for (int j = 0; j < PME_ORDER; j++) {
+            bsplineTheta[j*NUM_ATOMS+i] = make_real4(data[j].x, data[j].y, data[j].z, 0);
+            bsplineDTheta[j*NUM_ATOMS+i] = make_real4(ddata[j].x, ddata[j].y, ddata[j].z, 0);
+        }
+    }
+}
+#endif
+
+#ifdef USE_TILED_SPREADING
+#define BRICK_WIDTH (BRICK_SIZE+PME_ORDER-1)
+#define BRICK_VOLUME (BRICK_WIDTH*BRICK_WIDTH*BRICK_WIDTH)
+
+/**
+ * Find the position of the first sorted atom whose brick index is not less than a given one.
+ */
+DEVICE int findFirstAtomInBrick(GLOBAL const int2* RESTRICT pmeAtomGridIndex, int brick) {
+    int lower = 0, upper = NUM_ATOMS;
+    while (lower < upper) {
+        int middle = (lower+upper)/2;
+        if (pmeAtomGridIndex[middle].y < brick)
+            lower = middle+1;
+        else
+            upper = middle;
+    }
+    return lower;
+}
+
+KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
+#ifdef USE_FIXED_POINT_CHARGE_SPREADING
+        GLOBAL mm_ulong* RESTRICT pmeGrid,
+#else
+        GLOBAL real* RESTRICT pmeGrid,
+#endif
+        real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int2* RESTRICT pmeAtomGridIndex,
+#ifdef CHARGE_FROM_SIGEPS
+        GLOBAL const float2* RESTRICT sigmaEpsilon
+#else
+        GLOBAL const real* RESTRICT charges
+#endif
+        , GLOBAL const real4* RESTRICT bsplineTheta, GLOBAL const int4* RESTRICT bsplineGridPoint) {
+    // Each thread block takes one brick of BRICK_SIZE^3 grid points at a time.  Since the atoms
+    // are sorted by brick, and each brick belongs to a single subset, the atoms of a brick are
+    // contiguous.  Their charges are first accumulated in local memory, over the brick plus the
+    // PME_ORDER-1 points it overlaps with the next bricks, and then added to the global grid with
+    // one atomic operation per nonzero point.
+
+#ifdef USE_FIXED_POINT_CHARGE_SPREADING
+    LOCAL mm_ulong brick[BRICK_VOLUME];
+#else
+    LOCAL real brick[BRICK_VOLUME];
+#endif
+    LOCAL int zindexTable[GRID_SIZE_Z+PME_ORDER];
+    int blockSize = (int) ceil(GRID_SIZE_Z/(real) PME_ORDER);
+    for (int i = LOCAL_ID; i < GRID_SIZE_Z+PME_ORDER; i += LOCAL_SIZE) {
+        int zindex = i % GRID_SIZE_Z;
+        int block = zindex % PME_ORDER;
+        zindexTable[i] = zindex/PME_ORDER + block*GRID_SIZE_X*GRID_SIZE_Y*blockSize;
+    }
+    SYNC_THREADS;
+    real3 data[PME_ORDER];
+    const real scale = RECIP((real) (PME_ORDER-1));
+    const unsigned int extendedSize = GRID_SIZE_X*GRID_SIZE_Y*PME_ORDER*blockSize;
+    const int bricksPerGrid = NUM_BRICKS_X*NUM_BRICKS_Y*NUM_BRICKS_Z;
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int brickIndex = GROUP_ID; brickIndex < NUM_GRID_SUBSETS*bricksPerGrid; brickIndex += numGroups) {
+        int first = findFirstAtomInBrick(pmeAtomGridIndex, brickIndex);
+        int last = findFirstAtomInBrick(pmeAtomGridIndex, brickIndex+1);
+        if (first == last)
+            continue;
+        int subset = brickIndex/bricksPerGrid;
+        int brickInGrid = brickIndex-subset*bricksPerGrid;
+        int3 corner = make_int3(BRICK_SIZE*(brickInGrid/(NUM_BRICKS_Y*NUM_BRICKS_Z)),
+                                BRICK_SIZE*((brickInGrid/NUM_BRICKS_Z)%NUM_BRICKS_Y),
+                                BRICK_SIZE*(brickInGrid%NUM_BRICKS_Z));
+        for (int i = LOCAL_ID; i < BRICK_VOLUME; i += LOCAL_SIZE)
+            brick[i] = 0;
+        SYNC_THREADS;
+        for (int i = first+LOCAL_ID; i < last; i += LOCAL_SIZE) {
+            int atom = pmeAtomGridIndex[i].x;
+            real4 pos = posq[atom];
+#ifdef CHARGE_FROM_SIGEPS
+            const float2 sigEps = sigmaEpsilon[atom];
+            const real charge = 8*sigEps.x*sigEps.x*sigEps.x*sigEps.y;
+#else
+            const real charge = (CHARGE)*EPSILON_FACTOR;
+#endif
+            if (charge == 0)
+                continue;
+#ifdef USE_CACHED_BSPLINES
+            int4 gridPoint = bsplineGridPoint[i];
+            int3 gridIndex = make_int3(gridPoint.x, gridPoint.y, gridPoint.z);
+            for (int j = 0; j < PME_ORDER; j++) {
+                real4 theta = bsplineTheta[j*NUM_ATOMS+i];
+                data[j] = make_real3(theta.x, theta.y, theta.z);
+            }
+#else
+            APPLY_PERIODIC_TO_POS(pos)
+            real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
+                                 pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
+                                 pos.z*recipBoxVecZ.z);
+            t.x = (t.x-floor(t.x))*GRID_SIZE_X;
+            t.y = (t.y-floor(t.y))*GRID_SIZE_Y;
+            t.z = (t.z-floor(t.z))*GRID_SIZE_Z;
+            int3 gridIndex = make_int3(((int) t.x) % GRID_SIZE_X,
+                                       ((int) t.y) % GRID_SIZE_Y,
+                                       ((int) t.z) % GRID_SIZE_Z);
+            real3 dr = make_real3(t.x-(int) t.x, t.y-(int) t.y, t.z-(int) t.z);
+            data[PME_ORDER-1] = make_real3(0);
+            data[1] = dr;
+            data[0] = make_real3(1)-dr;
+            for (int j = 3; j < PME_ORDER; j++) {
+                real div = RECIP((real) (j-1));
+                data[j-1] = div*dr*data[j-2];
+                for (int k = 1; k < (j-1); k++)
+                    data[j-k-1] = div*((dr+make_real3(k))*data[j-k-2] + (make_real3(j-k)-dr)*data[j-k-1]);
+                data[0] = div*(make_real3(1)-dr)*data[0];
+            }
+            data[PME_ORDER-1] = scale*dr*data[PME_ORDER-2];
+            for (int j = 1; j < (PME_ORDER-1); j++)
+                data[PME_ORDER-j-1] = scale*((dr+make_real3(j))*data[PME_ORDER-j-2] + (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
+            data[0] = scale*(make_real3(1)-dr)*data[0];
+#endif
+
+            // Spread the charge from this atom onto the local copy of the brick.
+
+            int3 cell = make_int3(gridIndex.x-corner.x, gridIndex.y-corner.y, gridIndex.z-corner.z);
+            for (int ix = 0; ix < PME_ORDER; ix++) {
+                real dx = charge*data[ix].x;
+                for (int iy = 0; iy < PME_ORDER; iy++) {
+                    int base = ((cell.x+ix)*BRICK_WIDTH+cell.y+iy)*BRICK_WIDTH+cell.z;
+                    real dxdy = dx*data[iy].y;
+                    for (int iz = 0; iz < PME_ORDER; iz++) {
+#ifdef USE_FIXED_POINT_CHARGE_SPREADING
+                        ATOMIC_ADD(&brick[base+iz], (mm_ulong) realToFixedPoint(dxdy*data[iz].z));
+#else
+                        ATOMIC_ADD(&brick[base+iz], dxdy*data[iz].z);
+#endif
+                    }
+                }
+            }
+        }
+        SYNC_THREADS;
+
+        // Add the brick to the grid of its subset.
+
+        int offset = extendedSize*subset;
+        for (int i = LOCAL_ID; i < BRICK_VOLUME; i += LOCAL_SIZE) {
+            if (brick[i] == 0)
+                continue;
+            int xindex = (corner.x+i/(BRICK_WIDTH*BRICK_WIDTH)) % GRID_SIZE_X;
+            int yindex = (corner.y+(i/BRICK_WIDTH)%BRICK_WIDTH) % GRID_SIZE_Y;
+            int zindex = (corner.z+i%BRICK_WIDTH) % GRID_SIZE_Z;
+            ATOMIC_ADD(&pmeGrid[offset+(xindex*GRID_SIZE_Y+yindex)*blockSize+zindexTable[zindex]], brick[i]);
+        }
+        SYNC_THREADS;
+    }
+}
+#else
 #if defined(USE_HIP) && !defined(AMD_RDNA)
 LAUNCH_BOUNDS_EXACT(128, 1)
 #endif
@@ -37,7 +245,7 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
 #else
         GLOBAL const real* RESTRICT charges
 #endif
-        ) {
+        , GLOBAL const real4* RESTRICT bsplineTheta, GLOBAL const int4* RESTRICT bsplineGridPoint) {
 // HIP-TODO: Workaround for RDNA, remove it when the compiler issue is fixed
 #if defined(USE_HIP)
     (void)GLOBAL_ID;
@@ -65,7 +273,10 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
     const unsigned int extendedSize = GRID_SIZE_X*GRID_SIZE_Y*PME_ORDER*blockSize;
     for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
         int atom = pmeAtomGridIndex[i].x;
-        int offset = extendedSize*(pmeAtomGridIndex[i].y/gridSize);
+        int slot = pmeAtomGridIndex[i].y/gridSize;
+        if (slot >= NUM_GRID_SUBSETS)
+            continue;
+        int offset = extendedSize*slot;
         real4 pos = posq[atom];
 #ifdef CHARGE_FROM_SIGEPS
         const float2 sigEps = sigmaEpsilon[atom];
@@ -73,6 +284,16 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
 #else
         const real charge = (CHARGE)*EPSILON_FACTOR;
 #endif
+        if (charge == 0)
+            continue;
+#ifdef USE_CACHED_BSPLINES
+        int4 gridPoint = bsplineGridPoint[i];
+        int3 gridIndex = make_int3(gridPoint.x, gridPoint.y, gridPoint.z);
+        for (int j = 0; j < PME_ORDER; j++) {
+            real4 theta = bsplineTheta[j*NUM_ATOMS+i];
+            data[j] = make_real3(theta.x, theta.y, theta.z);
+        }
+#else
         APPLY_PERIODIC_TO_POS(pos)
         real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
                              pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
@@ -83,8 +304,6 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
         int3 gridIndex = make_int3(((int) t.x) % GRID_SIZE_X,
                                    ((int) t.y) % GRID_SIZE_Y,
                                    ((int) t.z) % GRID_SIZE_Z);
-        if (charge == 0)
-            continue;
 
         // Since we need the full set of thetas, it's faster to compute them here than load them
         // from global memory.
@@ -104,6 +323,7 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
         for (int j = 1; j < (PME_ORDER-1); j++)
             data[PME_ORDER-j-1] = scale*((dr+make_real3(j))*data[PME_ORDER-j-2] + (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
         data[0] = scale*(make_real3(1)-dr)*data[0];
+#endif
 
         // Spread the charge from this atom onto each grid point.
 
@@ -133,6 +353,7 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
         }
     }
 }
+#endif
 
 KERNEL void finishSpreadCharge(
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
@@ -159,7 +380,7 @@ KERNEL void finishSpreadCharge(
     SYNC_THREADS;
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
     const unsigned int extendedSize = GRID_SIZE_X*GRID_SIZE_Y*PME_ORDER*blockSize;
-    const unsigned int totalSize = NUM_SUBSETS*gridSize;
+    const unsigned int totalSize = NUM_GRID_SUBSETS*gridSize;
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
     real scale = 1/(real) 0x100000000;
 #endif
@@ -176,9 +397,108 @@ KERNEL void finishSpreadCharge(
     }
 }
 
+#ifdef USE_INFLUENCE_FUNCTION
+/**
+ * Compute the squared Fourier transform of a B-spline of order PME_ORDER at the scaled frequency x.
+ */
+DEVICE real bsplineWeight(real x) {
+    if (x == 0)
+        return 1;
+    real sinc = SIN(M_PI*x)/(M_PI*x);
+    real sinc2 = sinc*sinc;
+    real weight = sinc2;
+    for (int i = 1; i < PME_ORDER; i++)
+        weight *= sinc2;
+    return weight;
+}
+
+/**
+ * Compute the energy-optimal influence function of P3M at the frequency (mx, my, mz).  The Ewald kernel is
+ * averaged over the aliases of the frequency, weighted by the squared Fourier transforms of the B-splines,
+ * and the squared sum of these weights replaces the B-spline moduli.
+ */
+DEVICE real optimalInfluence(int mx, int my, int mz, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+#ifdef USE_LJPME
+    const real recipScaleFactor = -(2*M_PI/6)*SQRT(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+    real bfac = M_PI / EWALD_ALPHA;
+    real fac1 = 2*M_PI*M_PI*M_PI*SQRT(M_PI);
+    real fac2 = EWALD_ALPHA*EWALD_ALPHA*EWALD_ALPHA;
+    real fac3 = -2*EWALD_ALPHA*M_PI*M_PI;
+#else
+    const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+#endif
+    real weightX[2*INFLUENCE_ALIASES+1], weightY[2*INFLUENCE_ALIASES+1], weightZ[2*INFLUENCE_ALIASES+1];
+    real sumX = 0, sumY = 0, sumZ = 0;
+    for (int a = 0; a <= 2*INFLUENCE_ALIASES; a++) {
+        weightX[a] = bsplineWeight(mx/(real) GRID_SIZE_X+a-INFLUENCE_ALIASES);
+        weightY[a] = bsplineWeight(my/(real) GRID_SIZE_Y+a-INFLUENCE_ALIASES);
+        weightZ[a] = bsplineWeight(mz/(real) GRID_SIZE_Z+a-INFLUENCE_ALIASES);
+        sumX += weightX[a];
+        sumY += weightY[a];
+        sumZ += weightZ[a];
+    }
+    real sum = 0;
+    for (int a = 0; a <= 2*INFLUENCE_ALIASES; a++) {
+        int ax = mx+(a-INFLUENCE_ALIASES)*GRID_SIZE_X;
+        for (int b = 0; b <= 2*INFLUENCE_ALIASES; b++) {
+            int ay = my+(b-INFLUENCE_ALIASES)*GRID_SIZE_Y;
+            for (int c = 0; c <= 2*INFLUENCE_ALIASES; c++) {
+                int az = mz+(c-INFLUENCE_ALIASES)*GRID_SIZE_Z;
+                real mhx = ax*recipBoxVecX.x;
+                real mhy = ax*recipBoxVecY.x+ay*recipBoxVecY.y;
+                real mhz = ax*recipBoxVecZ.x+ay*recipBoxVecZ.y+az*recipBoxVecZ.z;
+                real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+#ifdef USE_LJPME
+                real m = SQRT(m2);
+                real bm = bfac*m;
+                real ewaldKernel = (fac1*ERFC(bm)*m*m2 + EXP(-bm*bm)*(fac2 + fac3*m2))*recipScaleFactor;
+#else
+                real ewaldKernel = recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/m2;
+#endif
+                sum += weightX[a]*weightY[b]*weightZ[c]*ewaldKernel;
+            }
+        }
+    }
+    real norm = sumX*sumY*sumZ;
+    return sum/(norm*norm);
+}
+
+/**
+ * Tabulate the optimal influence function on the half complex grid, which then replaces the smooth PME one in
+ * the convolution and energy kernels.  As in the Reference platform, Nyquist frequencies take the average over
+ * k and -k.
+ */
+KERNEL void computeInfluenceFunction(GLOBAL real* RESTRICT influenceFunction, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
+        int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+        int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+        int ky = remainder/(GRID_SIZE_Z/2+1);
+        int kz = remainder-ky*(GRID_SIZE_Z/2+1);
+#ifndef USE_LJPME
+        if (kx == 0 && ky == 0 && kz == 0) {
+            influenceFunction[index] = 0;
+            continue;
+        }
+#endif
+        int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
+        int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
+        int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
+        real eterm = optimalInfluence(mx, my, mz, recipBoxVecX, recipBoxVecY, recipBoxVecZ);
+        if (2*kx == GRID_SIZE_X || 2*ky == GRID_SIZE_Y || 2*kz == GRID_SIZE_Z) {
+            int nx = (2*kx == GRID_SIZE_X ? mx : -mx);
+            int ny = (2*ky == GRID_SIZE_Y ? my : -my);
+            int nz = (2*kz == GRID_SIZE_Z ? mz : -mz);
+            eterm = 0.5f*(eterm + optimalInfluence(nx, ny, nz, recipBoxVecX, recipBoxVecY, recipBoxVecZ));
+        }
+        influenceFunction[index] = eterm;
+    }
+}
+#endif
+
 KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const real* RESTRICT pmeBsplineModuliX,
         GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
-        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+        GLOBAL const real* RESTRICT influenceFunction, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
     // R2C stores into a half complex matrix where the last dimension is cut by half
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
 #ifdef USE_LJPME
@@ -207,7 +527,9 @@ KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const r
         real by = pmeBsplineModuliY[ky];
         real bz = pmeBsplineModuliZ[kz];
         real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
-#ifdef USE_LJPME
+#if defined(USE_INFLUENCE_FUNCTION)
+        real eterm = influenceFunction[index];
+#elif defined(USE_LJPME)
         real denom = recipScaleFactor/(bx*by*bz);
         real m = SQRT(m2);
         real m3 = m*m2;
@@ -225,9 +547,111 @@ KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const r
     }
 }
 
+#ifdef USE_TILED_ENERGY
+/**
+ * Evaluate the reciprocal space energy of each effective slice when there are too many of them for each
+ * thread to keep its own accumulators.  Each thread block loads a tile of ENERGY_TILE_SIZE wave vectors
+ * into local memory, and then every thread accumulates the energies of at most SLICES_PER_THREAD effective
+ * slices.  The energy buffer contains one entry per thread block and effective slice.
+ */
+KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
+                      GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
+                      GLOBAL const real* RESTRICT influenceFunction, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ,
+                      GLOBAL const int* RESTRICT memberStart, GLOBAL const int* RESTRICT memberSubsets) {
+    LOCAL real2 tileGrid[ENERGY_TILE_SIZE*NUM_SUBSETS];
+    LOCAL real tileEterm[ENERGY_TILE_SIZE];
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
+    const unsigned int odist = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+#ifdef USE_LJPME
+    const real recipScaleFactor = -(2*M_PI/6)*SQRT(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+    real bfac = M_PI / EWALD_ALPHA;
+    real fac1 = 2*M_PI*M_PI*M_PI*SQRT(M_PI);
+    real fac2 = EWALD_ALPHA*EWALD_ALPHA*EWALD_ALPHA;
+    real fac3 = -2*EWALD_ALPHA*M_PI*M_PI;
+#else
+    const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+#endif
+
+    energy_accum energy[SLICES_PER_THREAD] = { 0 };
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int base = GROUP_ID*ENERGY_TILE_SIZE; base < gridSize; base += numGroups*ENERGY_TILE_SIZE) {
+        const int tileSize = min(ENERGY_TILE_SIZE, (int) gridSize-base);
+
+        // Load the grid values and energy terms of a tile of wave vectors.
+
+        for (int k = LOCAL_ID; k < tileSize; k += LOCAL_SIZE) {
+            int index = base+k;
+            int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z));
+            int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z);
+            int ky = remainder/(GRID_SIZE_Z);
+            int kz = remainder-ky*(GRID_SIZE_Z);
+            int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
+            int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
+            int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
+            real mhx = mx*recipBoxVecX.x;
+            real mhy = mx*recipBoxVecY.x+my*recipBoxVecY.y;
+            real mhz = mx*recipBoxVecZ.x+my*recipBoxVecZ.y+mz*recipBoxVecZ.z;
+            real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+            real bx = pmeBsplineModuliX[kx];
+            real by = pmeBsplineModuliY[ky];
+            real bz = pmeBsplineModuliZ[kz];
+#ifndef USE_INFLUENCE_FUNCTION
+#ifdef USE_LJPME
+            real denom = recipScaleFactor/(bx*by*bz);
+            real m = SQRT(m2);
+            real m3 = m*m2;
+            real b = bfac*m;
+            real expfac = -b*b;
+            real expterm = EXP(expfac);
+            real erfcterm = ERFC(b);
+            tileEterm[k] = (fac1*erfcterm*m3 + expterm*(fac2 + fac3*m2)) * denom;
+#else
+            real denom = m2*bx*by*bz;
+            tileEterm[k] = (kx != 0 || ky != 0 || kz != 0) ? recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom : 0;
+#endif
+#endif
+            if (kz >= (GRID_SIZE_Z/2+1)) {
+                kx = ((kx == 0) ? kx : GRID_SIZE_X-kx);
+                ky = ((ky == 0) ? ky : GRID_SIZE_Y-ky);
+                kz = GRID_SIZE_Z-kz;
+            }
+            int indexInHalfComplexGrid = kz + ky*(GRID_SIZE_Z/2+1)+kx*(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+#ifdef USE_INFLUENCE_FUNCTION
+            tileEterm[k] = influenceFunction[indexInHalfComplexGrid];
+#endif
+            for (int j = 0; j < NUM_SUBSETS; j++)
+                tileGrid[k*NUM_SUBSETS+j] = pmeGrid[j*odist+indexInHalfComplexGrid];
+        }
+        SYNC_THREADS;
+
+        // Accumulate the energies of the effective slices assigned to this thread.
+
+        for (int t = 0; t < SLICES_PER_THREAD; t++) {
+            int slice = LOCAL_ID+t*LOCAL_SIZE;
+            if (slice < NUM_EFFECTIVE_SLICES)
+                for (int member = memberStart[slice]; member < memberStart[slice+1]; member++) {
+                    int i = memberSubsets[2*member];
+                    int j = memberSubsets[2*member+1];
+                    real scale = (i == j ? 0.5f : 1.0f);
+                    for (int k = 0; k < tileSize; k++) {
+                        real2 gi = tileGrid[k*NUM_SUBSETS+i];
+                        real2 gj = tileGrid[k*NUM_SUBSETS+j];
+                        energy[t] += TO_ENERGY_ACCUM(scale*tileEterm[k]*(gi.x*gj.x + gi.y*gj.y));
+                    }
+                }
+        }
+        SYNC_THREADS;
+    }
+    for (int t = 0; t < SLICES_PER_THREAD; t++) {
+        int slice = LOCAL_ID+t*LOCAL_SIZE;
+        if (slice < NUM_EFFECTIVE_SLICES)
+            energyBuffer[GROUP_ID*NUM_EFFECTIVE_SLICES+slice] = FROM_ENERGY_ACCUM(energy[t]);
+    }
+}
+#else
 KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
                       GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
-                      real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+                      GLOBAL const real* RESTRICT influenceFunction, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
     // R2C stores into a half complex matrix where the last dimension is cut by half
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
     const unsigned int odist = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
@@ -241,7 +665,8 @@ KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RES
     const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
 #endif
 
-    mixed energy[NUM_SLICES] = { 0 };
+    const int effectiveSlice[NUM_SLICES] = {EFFECTIVE_SLICES};
+    energy_accum energy[NUM_EFFECTIVE_SLICES] = { 0 };
     for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
         // real indices
         int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z));
@@ -258,6 +683,7 @@ KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RES
         real bx = pmeBsplineModuliX[kx];
         real by = pmeBsplineModuliY[ky];
         real bz = pmeBsplineModuliZ[kz];
+#ifndef USE_INFLUENCE_FUNCTION
 #ifdef USE_LJPME
         real denom = recipScaleFactor/(bx*by*bz);
         real m = SQRT(m2);
@@ -270,6 +696,7 @@ KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RES
 #else
         real denom = m2*bx*by*bz;
         real eterm = (kx != 0 || ky != 0 || kz != 0) ? recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom : 0;
+#endif
 #endif
         if (kz >= (GRID_SIZE_Z/2+1)) {
             kx = ((kx == 0) ? kx : GRID_SIZE_X-kx);
@@ -277,18 +704,186 @@ KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RES
             kz = GRID_SIZE_Z-kz;
         }
         int indexInHalfComplexGrid = kz + ky*(GRID_SIZE_Z/2+1)+kx*(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+#ifdef USE_INFLUENCE_FUNCTION
+        real eterm = influenceFunction[indexInHalfComplexGrid];
+#endif
         real2 grid[NUM_SUBSETS];
         for (int j = 0; j < NUM_SUBSETS; j++) {
             grid[j] = pmeGrid[j*odist+indexInHalfComplexGrid];
             int offset = (j+1)*j/2;
             for (int i = 0; i < j; i++)
-                energy[offset+i] += eterm*(grid[i].x*grid[j].x + grid[i].y*grid[j].y);
-            energy[offset+j] += 0.5*eterm*(grid[j].x*grid[j].x + grid[j].y*grid[j].y);
+                energy[effectiveSlice[offset+i]] += TO_ENERGY_ACCUM(eterm*(grid[i].x*grid[j].x + grid[i].y*grid[j].y));
+            energy[effectiveSlice[offset+j]] += TO_ENERGY_ACCUM(0.5*eterm*(grid[j].x*grid[j].x + grid[j].y*grid[j].y));
         }
     }
-    for (int slice = 0; slice < NUM_SLICES; slice++)
-        energyBuffer[GLOBAL_ID*NUM_SLICES+slice] = energy[slice];
+    for (int slice = 0; slice < NUM_EFFECTIVE_SLICES; slice++)
+        energyBuffer[GLOBAL_ID*NUM_EFFECTIVE_SLICES+slice] = FROM_ENERGY_ACCUM(energy[slice]);
 }
+#endif
+
+#ifdef USE_TILED_ENERGY
+/**
+ * Perform the reciprocal convolution and evaluate the energy of each effective slice in a single pass over
+ * the grid, using the tiled slice reduction of gridEvaluateEnergy.  The energies are computed from the values
+ * before convolution.  The loop runs over the half complex grid, so points whose mirror images are absent
+ * from it are counted twice.
+ */
+KERNEL void reciprocalConvolutionAndEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
+                      GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
+                      GLOBAL const real* RESTRICT influenceFunction, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ,
+                      GLOBAL const int* RESTRICT memberStart, GLOBAL const int* RESTRICT memberSubsets) {
+    LOCAL real2 tileGrid[ENERGY_TILE_SIZE*NUM_SUBSETS];
+    LOCAL real tileEterm[ENERGY_TILE_SIZE];
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+#ifdef USE_LJPME
+    const real recipScaleFactor = -(2*M_PI/6)*SQRT(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+    real bfac = M_PI / EWALD_ALPHA;
+    real fac1 = 2*M_PI*M_PI*M_PI*SQRT(M_PI);
+    real fac2 = EWALD_ALPHA*EWALD_ALPHA*EWALD_ALPHA;
+    real fac3 = -2*EWALD_ALPHA*M_PI*M_PI;
+#else
+    const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+#endif
+
+    energy_accum energy[SLICES_PER_THREAD] = { 0 };
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int base = GROUP_ID*ENERGY_TILE_SIZE; base < gridSize; base += numGroups*ENERGY_TILE_SIZE) {
+        const int tileSize = min(ENERGY_TILE_SIZE, (int) gridSize-base);
+
+        // Load a tile of grid values, saving the energy terms and convolving in place.
+
+        for (int k = LOCAL_ID; k < tileSize; k += LOCAL_SIZE) {
+            int index = base+k;
+            int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+            int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+            int ky = remainder/(GRID_SIZE_Z/2+1);
+            int kz = remainder-ky*(GRID_SIZE_Z/2+1);
+            int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
+            int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
+            int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
+            real mhx = mx*recipBoxVecX.x;
+            real mhy = mx*recipBoxVecY.x+my*recipBoxVecY.y;
+            real mhz = mx*recipBoxVecZ.x+my*recipBoxVecZ.y+mz*recipBoxVecZ.z;
+            real bx = pmeBsplineModuliX[kx];
+            real by = pmeBsplineModuliY[ky];
+            real bz = pmeBsplineModuliZ[kz];
+            real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+#if defined(USE_INFLUENCE_FUNCTION)
+            real eterm = influenceFunction[index];
+#elif defined(USE_LJPME)
+            real denom = recipScaleFactor/(bx*by*bz);
+            real m = SQRT(m2);
+            real m3 = m*m2;
+            real b = bfac*m;
+            real expfac = -b*b;
+            real expterm = EXP(expfac);
+            real erfcterm = ERFC(b);
+            real eterm = (fac1*erfcterm*m3 + expterm*(fac2 + fac3*m2)) * denom;
+#else
+            real denom = m2*bx*by*bz;
+            real eterm = (kx != 0 || ky != 0 || kz != 0) ? recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom : 0;
+#endif
+            tileEterm[k] = (kz == 0 || 2*kz == GRID_SIZE_Z ? eterm : 2*eterm);
+            for (int j = 0; j < NUM_SUBSETS; j++) {
+                real2 grid = pmeGrid[j*gridSize+index];
+                tileGrid[k*NUM_SUBSETS+j] = grid;
+                pmeGrid[j*gridSize+index] = make_real2(grid.x*eterm, grid.y*eterm);
+            }
+        }
+        SYNC_THREADS;
+
+        // Accumulate the energies of the effective slices assigned to this thread.
+
+        for (int t = 0; t < SLICES_PER_THREAD; t++) {
+            int slice = LOCAL_ID+t*LOCAL_SIZE;
+            if (slice < NUM_EFFECTIVE_SLICES)
+                for (int member = memberStart[slice]; member < memberStart[slice+1]; member++) {
+                    int i = memberSubsets[2*member];
+                    int j = memberSubsets[2*member+1];
+                    real scale = (i == j ? 0.5f : 1.0f);
+                    for (int k = 0; k < tileSize; k++) {
+                        real2 gi = tileGrid[k*NUM_SUBSETS+i];
+                        real2 gj = tileGrid[k*NUM_SUBSETS+j];
+                        energy[t] += TO_ENERGY_ACCUM(scale*tileEterm[k]*(gi.x*gj.x + gi.y*gj.y));
+                    }
+                }
+        }
+        SYNC_THREADS;
+    }
+    for (int t = 0; t < SLICES_PER_THREAD; t++) {
+        int slice = LOCAL_ID+t*LOCAL_SIZE;
+        if (slice < NUM_EFFECTIVE_SLICES)
+            energyBuffer[GROUP_ID*NUM_EFFECTIVE_SLICES+slice] = FROM_ENERGY_ACCUM(energy[t]);
+    }
+}
+#else
+/**
+ * Perform the reciprocal convolution and evaluate the energy of each effective slice in a single pass over
+ * the grid.  The energies are computed from the values before convolution.  The loop runs over the half
+ * complex grid, so points whose mirror images are absent from it are counted twice.
+ */
+KERNEL void reciprocalConvolutionAndEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
+                      GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
+                      GLOBAL const real* RESTRICT influenceFunction, real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+#ifdef USE_LJPME
+    const real recipScaleFactor = -(2*M_PI/6)*SQRT(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+    real bfac = M_PI / EWALD_ALPHA;
+    real fac1 = 2*M_PI*M_PI*M_PI*SQRT(M_PI);
+    real fac2 = EWALD_ALPHA*EWALD_ALPHA*EWALD_ALPHA;
+    real fac3 = -2*EWALD_ALPHA*M_PI*M_PI;
+#else
+    const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+#endif
+
+    const int effectiveSlice[NUM_SLICES] = {EFFECTIVE_SLICES};
+    energy_accum energy[NUM_EFFECTIVE_SLICES] = { 0 };
+    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
+        // real indices
+        int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+        int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+        int ky = remainder/(GRID_SIZE_Z/2+1);
+        int kz = remainder-ky*(GRID_SIZE_Z/2+1);
+        int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
+        int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
+        int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
+        real mhx = mx*recipBoxVecX.x;
+        real mhy = mx*recipBoxVecY.x+my*recipBoxVecY.y;
+        real mhz = mx*recipBoxVecZ.x+my*recipBoxVecZ.y+mz*recipBoxVecZ.z;
+        real bx = pmeBsplineModuliX[kx];
+        real by = pmeBsplineModuliY[ky];
+        real bz = pmeBsplineModuliZ[kz];
+        real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+#if defined(USE_INFLUENCE_FUNCTION)
+        real eterm = influenceFunction[index];
+#elif defined(USE_LJPME)
+        real denom = recipScaleFactor/(bx*by*bz);
+        real m = SQRT(m2);
+        real m3 = m*m2;
+        real b = bfac*m;
+        real expfac = -b*b;
+        real expterm = EXP(expfac);
+        real erfcterm = ERFC(b);
+        real eterm = (fac1*erfcterm*m3 + expterm*(fac2 + fac3*m2)) * denom;
+#else
+        real denom = m2*bx*by*bz;
+        real eterm = (kx != 0 || ky != 0 || kz != 0) ? recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom : 0;
+#endif
+        real weight = (kz == 0 || 2*kz == GRID_SIZE_Z ? eterm : 2*eterm);
+        real2 grid[NUM_SUBSETS];
+        for (int j = 0; j < NUM_SUBSETS; j++) {
+            grid[j] = pmeGrid[j*gridSize+index];
+            int offset = (j+1)*j/2;
+            for (int i = 0; i < j; i++)
+                energy[effectiveSlice[offset+i]] += TO_ENERGY_ACCUM(weight*(grid[i].x*grid[j].x + grid[i].y*grid[j].y));
+            energy[effectiveSlice[offset+j]] += TO_ENERGY_ACCUM(0.5*weight*(grid[j].x*grid[j].x + grid[j].y*grid[j].y));
+            pmeGrid[j*gridSize+index] = make_real2(grid[j].x*eterm, grid[j].y*eterm);
+        }
+    }
+    for (int slice = 0; slice < NUM_EFFECTIVE_SLICES; slice++)
+        energyBuffer[GLOBAL_ID*NUM_EFFECTIVE_SLICES+slice] = FROM_ENERGY_ACCUM(energy[slice]);
+}
+#endif
 
 #if defined(USE_HIP) && !defined(AMD_RDNA) && !defined(USE_DOUBLE_PRECISION)
 LAUNCH_BOUNDS_EXACT(128, 1)
@@ -301,11 +896,22 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
 #else
         GLOBAL const real* RESTRICT charges
 #endif
-        , GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas) {
+        , GLOBAL const int* RESTRICT subsets, GLOBAL const real2* RESTRICT sliceLambdas, GLOBAL const real4* RESTRICT bsplineTheta,
+        GLOBAL const real4* RESTRICT bsplineDTheta, GLOBAL const int4* RESTRICT bsplineGridPoint
+#ifdef USE_SLICE_FORCES
+        , GLOBAL mm_ulong* RESTRICT sliceForces
+#endif
+        ) {
     real3 data[PME_ORDER];
     real3 ddata[PME_ORDER];
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
     const real scale = RECIP((real) (PME_ORDER-1));
+#ifdef USE_GRID_SLICES
+    // Only the subsets with dispersion grids are included, so that the slice between two grids is
+    // looked up in a table.
+
+    const int gridSlice[NUM_SUBSETS*NUM_SUBSETS] = {GRID_SLICES};
+#endif
 
     // Process the atoms in spatially sorted order.  This improves cache performance when loading
     // the grid values.
@@ -315,6 +921,48 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
         real3 force = make_real3(0);
         real4 pos = posq[atom];
         int si = subsets[atom];
+#ifdef USE_SLICE_FORCES
+        // The contribution of each grid is kept apart, so that it can be added to the force of the slice
+        // it forms with the subset of this atom.
+
+        real3 sliceForce[NUM_SUBSETS];
+        for (int sj = 0; sj < NUM_SUBSETS; sj++)
+            sliceForce[sj] = make_real3(0);
+#endif
+#ifdef USE_SMALL_SUBSETS
+        // The forces on the atoms of small subsets are computed by smallSubsetInterpolateForce.
+
+        if (si >= NUM_GRID_SUBSETS)
+            continue;
+#elif defined(SKIP_DECOUPLED_SLICES)
+        // The reciprocal force vanishes if all slices involving this atom's subset are decoupled.
+
+        bool decoupled = true;
+        for (int sj = 0; sj < NUM_SUBSETS; sj++) {
+#ifdef USE_GRID_SLICES
+            int slice = gridSlice[si*NUM_SUBSETS+sj];
+#else
+            int slice = (si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si);
+#endif
+#ifdef USE_LJPME
+            decoupled = decoupled && (sliceLambdas[slice].y == 0);
+#else
+            decoupled = decoupled && (sliceLambdas[slice].x == 0);
+#endif
+        }
+        if (decoupled)
+            continue;
+#endif
+#ifdef USE_CACHED_BSPLINES
+        int4 gridPoint = bsplineGridPoint[i];
+        int3 gridIndex = make_int3(gridPoint.x, gridPoint.y, gridPoint.z);
+        for (int j = 0; j < PME_ORDER; j++) {
+            real4 theta = bsplineTheta[j*NUM_ATOMS+i];
+            real4 dtheta = bsplineDTheta[j*NUM_ATOMS+i];
+            data[j] = make_real3(theta.x, theta.y, theta.z);
+            ddata[j] = make_real3(dtheta.x, dtheta.y, dtheta.z);
+        }
+#else
         APPLY_PERIODIC_TO_POS(pos)
         real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
                              pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
@@ -347,6 +995,7 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
         for (int j = 1; j < (PME_ORDER-1); j++)
             data[PME_ORDER-j-1] = scale*((dr+make_real3(j))*data[PME_ORDER-j-2] + (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
         data[0] = scale*(make_real3(1)-dr)*data[0];
+#endif
 
         // Compute the force on this atom.
 
@@ -369,7 +1018,28 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
                     zindex -= (zindex >= GRID_SIZE_Z ? GRID_SIZE_Z : 0);
                     int index = ybase + zindex;
                     real gridvalue = 0.0;
+#if defined(USE_SLICE_FORCES)
+                    real3 weight = make_real3(ddx*dy*data[iz].z, dx*ddy*data[iz].z, dx*dy*ddata[iz].z);
+                    for (int sj = 0; sj < NUM_SUBSETS; sj++) {
+#ifdef USE_GRID_SLICES
+                        int slice = gridSlice[si*NUM_SUBSETS+sj];
+#else
+                        int slice = (si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si);
+#endif
 #ifdef USE_LJPME
+                        sliceForce[sj] += weight*(sliceLambdas[slice].y*pmeGrid[sj*gridSize+index]);
+#else
+                        sliceForce[sj] += weight*(sliceLambdas[slice].x*pmeGrid[sj*gridSize+index]);
+#endif
+                    }
+#elif defined(USE_SMALL_SUBSETS)
+                    // The grid of each subset already contains the combined potential it feels.
+
+                    gridvalue = pmeGrid[si*gridSize+index];
+#elif defined(USE_GRID_SLICES)
+                    for (int sj = 0; sj < NUM_SUBSETS; sj++)
+                        gridvalue += sliceLambdas[gridSlice[si*NUM_SUBSETS+sj]].y*pmeGrid[sj*gridSize+index];
+#elif defined(USE_LJPME)
                     for (int sj = 0; sj < si; sj++)
                         gridvalue += sliceLambdas[si*(si+1)/2+sj].y*pmeGrid[sj*gridSize+index];
                     for (int sj = si; sj < NUM_SUBSETS; sj++)
@@ -391,6 +1061,21 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
         real q = 8*sigEps.x*sigEps.x*sigEps.x*sigEps.y;
 #else
         real q = CHARGE*EPSILON_FACTOR;
+#endif
+#ifdef USE_SLICE_FORCES
+        for (int sj = 0; sj < NUM_SUBSETS; sj++) {
+            real3 f = sliceForce[sj];
+            force += f;
+#ifdef USE_GRID_SLICES
+            int slice = gridSlice[si*NUM_SUBSETS+sj];
+#else
+            int slice = (si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si);
+#endif
+            GLOBAL mm_ulong* buffer = sliceForces+3*slice*PADDED_NUM_ATOMS;
+            ATOMIC_ADD(&buffer[atom], (mm_ulong) realToFixedPoint(-q*(f.x*GRID_SIZE_X*recipBoxVecX.x)));
+            ATOMIC_ADD(&buffer[atom+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(-q*(f.x*GRID_SIZE_X*recipBoxVecY.x+f.y*GRID_SIZE_Y*recipBoxVecY.y)));
+            ATOMIC_ADD(&buffer[atom+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(-q*(f.x*GRID_SIZE_X*recipBoxVecZ.x+f.y*GRID_SIZE_Y*recipBoxVecZ.y+f.z*GRID_SIZE_Z*recipBoxVecZ.z)));
+        }
 #endif
         real forceX = -q*(force.x*GRID_SIZE_X*recipBoxVecX.x);
         real forceY = -q*(force.x*GRID_SIZE_X*recipBoxVecY.x+force.y*GRID_SIZE_Y*recipBoxVecY.y);
@@ -414,4 +1099,241 @@ KERNEL void addForces(GLOBAL const real4* RESTRICT forces, GLOBAL mm_long* RESTR
         forceBuffers[atom+PADDED_NUM_ATOMS] += realToFixedPoint(f.y);
         forceBuffers[atom+2*PADDED_NUM_ATOMS] += realToFixedPoint(f.z);
     }
-}
\ No newline at end of file
+}
+
+#ifdef USE_SMALL_SUBSETS
+/**
+ * The subsets with few atoms are not spread onto grids.  Instead, the transforms of their grids and the
+ * forces on their atoms are computed by direct sums over the wave vectors, which only need the one
+ * dimensional transforms of the B-spline coefficients of each atom.  These are stored for each atom as
+ * GRID_SIZE_X factors for the X axis, followed by GRID_SIZE_Y factors for the Y axis and GRID_SIZE_Z/2+1
+ * factors for the Z axis.  A factor holds the transform of the coefficients in its x and y components and
+ * that of their derivatives in its z and w components.  The charge of the atom is included in the factors
+ * of the X axis.
+ */
+#define SMALL_ATOM_FACTORS (GRID_SIZE_X+GRID_SIZE_Y+GRID_SIZE_Z/2+1)
+
+DEVICE real2 multiplyComplex(real2 a, real2 b) {
+    return make_real2(a.x*b.x-a.y*b.y, a.x*b.y+a.y*b.x);
+}
+
+KERNEL void computeSmallAtomFactors(GLOBAL const real4* RESTRICT posq, GLOBAL real4* RESTRICT factors,
+        real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int2* RESTRICT smallAtoms,
+        GLOBAL const int* RESTRICT smallSlotStart, GLOBAL const real* RESTRICT charges) {
+    const int numSmallAtoms = smallSlotStart[NUM_SUBSETS-NUM_GRID_SUBSETS];
+    const real scale = RECIP((real) (PME_ORDER-1));
+    real3 data[PME_ORDER];
+    real3 ddata[PME_ORDER];
+    real theta[PME_ORDER];
+    real dtheta[PME_ORDER];
+    for (int i = GLOBAL_ID; i < numSmallAtoms*SMALL_ATOM_FACTORS; i += GLOBAL_SIZE) {
+        int index = i/SMALL_ATOM_FACTORS;
+        int wave = i-index*SMALL_ATOM_FACTORS;
+        int atom = smallAtoms[index].x;
+        real4 pos = posq[atom];
+        APPLY_PERIODIC_TO_POS(pos)
+        real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
+                             pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
+                             pos.z*recipBoxVecZ.z);
+        t.x = (t.x-floor(t.x))*GRID_SIZE_X;
+        t.y = (t.y-floor(t.y))*GRID_SIZE_Y;
+        t.z = (t.z-floor(t.z))*GRID_SIZE_Z;
+        int3 gridIndex = make_int3(((int) t.x) % GRID_SIZE_X,
+                                   ((int) t.y) % GRID_SIZE_Y,
+                                   ((int) t.z) % GRID_SIZE_Z);
+
+        // Compute the B-spline coefficients exactly as gridSpreadCharge and gridInterpolateForce do.
+
+        real3 dr = make_real3(t.x-(int) t.x, t.y-(int) t.y, t.z-(int) t.z);
+        data[PME_ORDER-1] = make_real3(0);
+        data[1] = dr;
+        data[0] = make_real3(1)-dr;
+        for (int j = 3; j < PME_ORDER; j++) {
+            real div = RECIP((real) (j-1));
+            data[j-1] = div*dr*data[j-2];
+            for (int k = 1; k < (j-1); k++)
+                data[j-k-1] = div*((dr+make_real3(k))*data[j-k-2] + (make_real3(j-k)-dr)*data[j-k-1]);
+            data[0] = div*(make_real3(1)-dr)*data[0];
+        }
+        ddata[0] = -data[0];
+        for (int j = 1; j < PME_ORDER; j++)
+            ddata[j] = data[j-1]-data[j];
+        data[PME_ORDER-1] = scale*dr*data[PME_ORDER-2];
+        for (int j = 1; j < (PME_ORDER-1); j++)
+            data[PME_ORDER-j-1] = scale*((dr+make_real3(j))*data[PME_ORDER-j-2] + (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
+        data[0] = scale*(make_real3(1)-dr)*data[0];
+
+        // Select the axis of this factor.
+
+        int size, first;
+        real charge = 1;
+        if (wave < GRID_SIZE_X) {
+            size = GRID_SIZE_X;
+            first = gridIndex.x;
+            charge = CHARGE*EPSILON_FACTOR;
+            for (int j = 0; j < PME_ORDER; j++) {
+                theta[j] = data[j].x;
+                dtheta[j] = ddata[j].x;
+            }
+        }
+        else if (wave < GRID_SIZE_X+GRID_SIZE_Y) {
+            wave -= GRID_SIZE_X;
+            size = GRID_SIZE_Y;
+            first = gridIndex.y;
+            for (int j = 0; j < PME_ORDER; j++) {
+                theta[j] = data[j].y;
+                dtheta[j] = ddata[j].y;
+            }
+        }
+        else {
+            wave -= GRID_SIZE_X+GRID_SIZE_Y;
+            size = GRID_SIZE_Z;
+            first = gridIndex.z;
+            for (int j = 0; j < PME_ORDER; j++) {
+                theta[j] = data[j].z;
+                dtheta[j] = ddata[j].z;
+            }
+        }
+
+        // The phases are reduced modulo the grid size before the conversion to real, so that they are
+        // accurate in single precision.
+
+        real4 factor = make_real4(0, 0, 0, 0);
+        for (int j = 0; j < PME_ORDER; j++) {
+            int point = first+j;
+            point -= (point >= size ? size : 0);
+            real angle = (2*M_PI/size)*((wave*point) % size);
+            real c = COS(angle);
+            real s = SIN(angle);
+            factor.x += theta[j]*c;
+            factor.y += theta[j]*s;
+            factor.z += dtheta[j]*c;
+            factor.w += dtheta[j]*s;
+        }
+        factors[i] = make_real4(charge*factor.x, charge*factor.y, charge*factor.z, charge*factor.w);
+    }
+}
+
+/**
+ * Fill the transformed grids of the small subsets, as if their charges had been spread and transformed
+ * like those of the other subsets.
+ */
+KERNEL void smallSubsetStructureFactors(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const real4* RESTRICT factors,
+        GLOBAL const int* RESTRICT smallSlotStart) {
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
+        int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+        int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+        int ky = remainder/(GRID_SIZE_Z/2+1);
+        int kz = remainder-ky*(GRID_SIZE_Z/2+1);
+        for (int slot = NUM_GRID_SUBSETS; slot < NUM_SUBSETS; slot++) {
+            real2 sum = make_real2(0, 0);
+            for (int i = smallSlotStart[slot-NUM_GRID_SUBSETS]; i < smallSlotStart[slot-NUM_GRID_SUBSETS+1]; i++) {
+                real4 fx = factors[i*SMALL_ATOM_FACTORS+kx];
+                real4 fy = factors[i*SMALL_ATOM_FACTORS+GRID_SIZE_X+ky];
+                real4 fz = factors[i*SMALL_ATOM_FACTORS+GRID_SIZE_X+GRID_SIZE_Y+kz];
+                real2 term = multiplyComplex(multiplyComplex(make_real2(fx.x, fx.y), make_real2(fy.x, fy.y)), make_real2(fz.x, fz.y));
+
+                // The forward transform uses negative phases.
+
+                sum.x += term.x;
+                sum.y -= term.y;
+            }
+            pmeGrid[slot*gridSize+index] = sum;
+        }
+    }
+}
+
+/**
+ * Replace the convolved grid of each subset by the combined potential felt by its atoms, which is the
+ * sum of the convolved grids of all subsets weighted by the Coulomb lambdas of the corresponding slices.
+ */
+KERNEL void combineSubsetPotentials(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const real2* RESTRICT sliceLambdas) {
+    const int slotSlice[NUM_SUBSETS*NUM_SUBSETS] = {SLOT_SLICES};
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
+        real2 grid[NUM_SUBSETS];
+        for (int j = 0; j < NUM_SUBSETS; j++)
+            grid[j] = pmeGrid[j*gridSize+index];
+        for (int i = 0; i < NUM_SUBSETS; i++) {
+            real2 sum = make_real2(0, 0);
+            for (int j = 0; j < NUM_SUBSETS; j++) {
+                real lambda = sliceLambdas[slotSlice[i*NUM_SUBSETS+j]].x;
+                sum.x += lambda*grid[j].x;
+                sum.y += lambda*grid[j].y;
+            }
+            pmeGrid[i*gridSize+index] = sum;
+        }
+    }
+}
+
+/**
+ * Compute the forces on the atoms of the small subsets from the combined potentials of their subsets,
+ * before these are transformed back to real space.  Each thread block takes one atom at a time and sums
+ * over the wave vectors of the half complex grid, counting twice those whose mirror images are absent.
+ */
+KERNEL void smallSubsetInterpolateForce(GLOBAL mm_ulong* RESTRICT forceBuffers, GLOBAL const real2* RESTRICT pmeGrid,
+        GLOBAL const real4* RESTRICT factors, GLOBAL const int2* RESTRICT smallAtoms, GLOBAL const int* RESTRICT smallSlotStart,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+    LOCAL real bufferX[SMALL_SUBSET_BLOCK_SIZE];
+    LOCAL real bufferY[SMALL_SUBSET_BLOCK_SIZE];
+    LOCAL real bufferZ[SMALL_SUBSET_BLOCK_SIZE];
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    const int numSmallAtoms = smallSlotStart[NUM_SUBSETS-NUM_GRID_SUBSETS];
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int i = GROUP_ID; i < numSmallAtoms; i += numGroups) {
+        int atom = smallAtoms[i].x;
+        int slot = smallAtoms[i].y;
+        real3 force = make_real3(0);
+        for (int index = LOCAL_ID; index < gridSize; index += LOCAL_SIZE) {
+            int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+            int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+            int ky = remainder/(GRID_SIZE_Z/2+1);
+            int kz = remainder-ky*(GRID_SIZE_Z/2+1);
+            real4 fx = factors[i*SMALL_ATOM_FACTORS+kx];
+            real4 fy = factors[i*SMALL_ATOM_FACTORS+GRID_SIZE_X+ky];
+            real4 fz = factors[i*SMALL_ATOM_FACTORS+GRID_SIZE_X+GRID_SIZE_Y+kz];
+            real weight = (kz == 0 || 2*kz == GRID_SIZE_Z ? 1 : 2);
+            real2 potential = pmeGrid[slot*gridSize+index];
+            real2 yz = multiplyComplex(make_real2(fy.x, fy.y), make_real2(fz.x, fz.y));
+            real2 termX = multiplyComplex(multiplyComplex(potential, make_real2(fx.z, fx.w)), yz);
+            real2 termY = multiplyComplex(multiplyComplex(potential, make_real2(fx.x, fx.y)), multiplyComplex(make_real2(fy.z, fy.w), make_real2(fz.x, fz.y)));
+            real2 termZ = multiplyComplex(multiplyComplex(potential, make_real2(fx.x, fx.y)), multiplyComplex(make_real2(fy.x, fy.y), make_real2(fz.z, fz.w)));
+            force.x += weight*termX.x;
+            force.y += weight*termY.x;
+            force.z += weight*termZ.x;
+        }
+
+        // Sum the contributions of all threads in the block.
+
+        bufferX[LOCAL_ID] = force.x;
+        bufferY[LOCAL_ID] = force.y;
+        bufferZ[LOCAL_ID] = force.z;
+        SYNC_THREADS;
+        for (int step = SMALL_SUBSET_BLOCK_SIZE/2; step > 0; step /= 2) {
+            if (LOCAL_ID < step) {
+                bufferX[LOCAL_ID] += bufferX[LOCAL_ID+step];
+                bufferY[LOCAL_ID] += bufferY[LOCAL_ID+step];
+                bufferZ[LOCAL_ID] += bufferZ[LOCAL_ID+step];
+            }
+            SYNC_THREADS;
+        }
+        if (LOCAL_ID == 0) {
+            real forceX = -(bufferX[0]*GRID_SIZE_X*recipBoxVecX.x);
+            real forceY = -(bufferX[0]*GRID_SIZE_X*recipBoxVecY.x+bufferY[0]*GRID_SIZE_Y*recipBoxVecY.y);
+            real forceZ = -(bufferX[0]*GRID_SIZE_X*recipBoxVecZ.x+bufferY[0]*GRID_SIZE_Y*recipBoxVecZ.y+bufferZ[0]*GRID_SIZE_Z*recipBoxVecZ.z);
+#ifdef USE_PME_STREAM
+            ATOMIC_ADD(&forceBuffers[atom], (mm_ulong) realToFixedPoint(forceX));
+            ATOMIC_ADD(&forceBuffers[atom+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(forceY));
+            ATOMIC_ADD(&forceBuffers[atom+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(forceZ));
+#else
+            forceBuffers[atom] += (mm_ulong) realToFixedPoint(forceX);
+            forceBuffers[atom+PADDED_NUM_ATOMS] += (mm_ulong) realToFixedPoint(forceY);
+            forceBuffers[atom+2*PADDED_NUM_ATOMS] += (mm_ulong) realToFixedPoint(forceZ);
+#endif
+        }
+        SYNC_THREADS;
+    }
+}
+#endif
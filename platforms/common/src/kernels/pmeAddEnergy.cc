@@ -7,25 +7,72 @@ KERNEL void addEnergy(GLOBAL mixed* RESTRICT energyBuffer,
                       GLOBAL const mixed* RESTRICT ljpmeEnergyBuffer,
 #endif
                       GLOBAL const real2* RESTRICT sliceLambdas,
-                      int bufferSize) {
+                      int bufferSize
+#if USE_TILED_ENERGY
+                      , GLOBAL const int* RESTRICT representativeSlice
+#if HAS_DERIVATIVES
+                      , GLOBAL const int2* RESTRICT derivativeIndices
+#endif
+#endif
+#if USE_SLICE_FORCE_GROUPS
+                      , int groups
+#if USE_TILED_ENERGY
+                      , GLOBAL const int* RESTRICT sliceForceGroups
+#endif
+#endif
+                      ) {
 
+#if USE_TILED_ENERGY
+    // Each thread visits a strided subset of all (buffer, slice) entries,
+    // so no per-thread arrays of NUM_EFFECTIVE_SLICES elements are needed.
+
+    mixed energy = 0;
+    for (int k = GLOBAL_ID; k < bufferSize*NUM_EFFECTIVE_SLICES; k += GLOBAL_SIZE) {
+        int slice = k%NUM_EFFECTIVE_SLICES;
+        real2 lambda = sliceLambdas[representativeSlice[slice]];
+        mixed clEnergy = pmeEnergyBuffer[k];
+#if USE_LJPME
+        mixed ljEnergy = ljpmeEnergyBuffer[k];
+        energy += lambda.x*clEnergy + lambda.y*ljEnergy;
+#else
+        energy += lambda.x*clEnergy;
+#endif
+#if HAS_DERIVATIVES
+        int2 position = derivativeIndices[slice];
+#if USE_SLICE_FORCE_GROUPS
+        if (((groups>>sliceForceGroups[slice])&1) == 0)
+            position = make_int2(-1, -1);
+#endif
+        if (position.x != -1)
+            energyParamDerivs[GLOBAL_ID*NUM_DERIVATIVES+position.x] += clEnergy;
+#if USE_LJPME
+        if (position.y != -1)
+            energyParamDerivs[GLOBAL_ID*NUM_DERIVATIVES+position.y] += ljEnergy;
+#endif
+#endif
+    }
+    energyBuffer[GLOBAL_ID] += energy;
+#else
     const int index = GLOBAL_ID;
     mixed energy = 0;
-    mixed clEnergy[NUM_SLICES];
+    const int representativeSlice[NUM_EFFECTIVE_SLICES] = {REPRESENTATIVE_SLICES};
+    mixed clEnergy[NUM_EFFECTIVE_SLICES];
 #if USE_LJPME
-    mixed ljEnergy[NUM_SLICES];
+    mixed ljEnergy[NUM_EFFECTIVE_SLICES];
 #endif
-    for (int slice = 0; slice < NUM_SLICES; slice++) {
-        clEnergy[slice] = pmeEnergyBuffer[index*NUM_SLICES+slice];
+    for (int slice = 0; slice < NUM_EFFECTIVE_SLICES; slice++) {
+        real2 lambda = sliceLambdas[representativeSlice[slice]];
+        clEnergy[slice] = pmeEnergyBuffer[index*NUM_EFFECTIVE_SLICES+slice];
 #if USE_LJPME
-        ljEnergy[slice] = ljpmeEnergyBuffer[index*NUM_SLICES+slice];
-        energy += sliceLambdas[slice].x*clEnergy[slice] + sliceLambdas[slice].y*ljEnergy[slice];
+        ljEnergy[slice] = ljpmeEnergyBuffer[index*NUM_EFFECTIVE_SLICES+slice];
+        energy += lambda.x*clEnergy[slice] + lambda.y*ljEnergy[slice];
 #else
-        energy += sliceLambdas[slice].x*clEnergy[slice];
+        energy += lambda.x*clEnergy[slice];
 #endif
-        }
+    }
     energyBuffer[index] += energy;
 #if HAS_DERIVATIVES
     ADD_DERIVATIVES
 #endif
-}
\ No newline at end of file
+#endif
+}
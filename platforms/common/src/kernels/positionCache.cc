@@ -0,0 +1,26 @@
+/**
+ * Compare the positions with those stored in the cache, setting a flag if any of them has changed,
+ * and store the current positions for the next comparison.
+ */
+KERNEL void updatePositionCache(GLOBAL const real4* RESTRICT posq, GLOBAL real4* RESTRICT cachedPosq,
+#ifdef USE_MIXED_PRECISION
+        GLOBAL const real4* RESTRICT posqCorrection, GLOBAL real4* RESTRICT cachedPosqCorrection,
+#endif
+        GLOBAL int* RESTRICT changed) {
+    for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
+        real4 pos = posq[i];
+        real4 cached = cachedPosq[i];
+        if (pos.x != cached.x || pos.y != cached.y || pos.z != cached.z) {
+            cachedPosq[i] = pos;
+            *changed = 1;
+        }
+#ifdef USE_MIXED_PRECISION
+        real4 correction = posqCorrection[i];
+        real4 cachedCorrection = cachedPosqCorrection[i];
+        if (correction.x != cachedCorrection.x || correction.y != cachedCorrection.y || correction.z != cachedCorrection.z) {
+            cachedPosqCorrection[i] = correction;
+            *changed = 1;
+        }
+#endif
+    }
+}
@@ -0,0 +1,26 @@
+/**
+ * Compute the protocol work of one step of a scaling parameter schedule, which is the sum of the
+ * energy derivatives with respect to the scheduled parameters times their changes in that step.
+ * This is executed by a single thread block.
+ */
+KERNEL void computeStepWork(GLOBAL const mixed* RESTRICT energyParamDerivs, int numThreads, int numScheduled,
+        GLOBAL const int* RESTRICT scheduledDerivs, GLOBAL const mixed* RESTRICT parameterChanges, int step,
+        GLOBAL mixed* RESTRICT stepWork) {
+    LOCAL mixed temp[REPORT_BLOCK_SIZE];
+    mixed sum = 0;
+    for (int index = 0; index < numScheduled; index++) {
+        const int deriv = scheduledDerivs[index];
+        const mixed change = parameterChanges[numScheduled*step+index];
+        for (int i = LOCAL_ID; i < numThreads; i += LOCAL_SIZE)
+            sum += change*energyParamDerivs[NUM_DERIVATIVES*i+deriv];
+    }
+    temp[LOCAL_ID] = sum;
+    SYNC_THREADS;
+    for (int offset = REPORT_BLOCK_SIZE/2; offset > 0; offset /= 2) {
+        if (LOCAL_ID < offset)
+            temp[LOCAL_ID] += temp[LOCAL_ID+offset];
+        SYNC_THREADS;
+    }
+    if (LOCAL_ID == 0)
+        stepWork[step] = temp[0];
+}
@@ -0,0 +1,32 @@
+/**
+ * Sum up the Coulomb and Lennard-Jones energies of every slice, which are stored as (Coulomb, Lennard-Jones)
+ * pairs in fixed point.  Each work group computes one of the 2*NUM_SLICES values from the contributions
+ * accumulated for every atom and, if requested, from the reciprocal space energy buffers.
+ */
+KERNEL void sumSliceEnergies(GLOBAL const mm_long* RESTRICT sliceEnergies, GLOBAL const mixed* RESTRICT pmeEnergyBuffer,
+        GLOBAL const mixed* RESTRICT ljpmeEnergyBuffer, int bufferSize, int includeCoulombRecip, int includeLJRecip,
+        GLOBAL mm_long* RESTRICT sliceEnergySums) {
+    LOCAL mm_long temp[SLICE_ENERGY_SUM_BLOCK_SIZE];
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int index = GROUP_ID; index < 2*NUM_SLICES; index += numGroups) {
+        const int slice = index/2;
+        mm_long sum = 0;
+        for (int i = LOCAL_ID; i < PADDED_NUM_ATOMS; i += LOCAL_SIZE)
+            sum += sliceEnergies[index*PADDED_NUM_ATOMS+i];
+        if (index%2 == 0 ? includeCoulombRecip : includeLJRecip) {
+            GLOBAL const mixed* buffer = (index%2 == 0 ? pmeEnergyBuffer : ljpmeEnergyBuffer);
+            for (int i = LOCAL_ID; i < bufferSize; i += LOCAL_SIZE)
+                sum += (mm_long) (buffer[i*NUM_SLICES+slice]*(mixed) 0x100000000);
+        }
+        temp[LOCAL_ID] = sum;
+        SYNC_THREADS;
+        for (int step = SLICE_ENERGY_SUM_BLOCK_SIZE/2; step > 0; step /= 2) {
+            if (LOCAL_ID < step)
+                temp[LOCAL_ID] += temp[LOCAL_ID+step];
+            SYNC_THREADS;
+        }
+        if (LOCAL_ID == 0)
+            sliceEnergySums[index] = temp[0];
+        SYNC_THREADS;
+    }
+}
@@ -0,0 +1,25 @@
+/**
+ * Sum the per-thread contributions to the energy parameter derivatives that are reported, storing
+ * the results in one of the slots of the report buffer.
+ */
+KERNEL void reduceReportedDerivatives(GLOBAL const mixed* RESTRICT energyParamDerivs, int numThreads,
+        GLOBAL const int* RESTRICT reportedDerivs, GLOBAL mixed* RESTRICT reportBuffer, int slot) {
+    LOCAL mixed temp[REPORT_BLOCK_SIZE];
+    const int numGroups = GLOBAL_SIZE/LOCAL_SIZE;
+    for (int index = GROUP_ID; index < NUM_REPORTED; index += numGroups) {
+        const int deriv = reportedDerivs[index];
+        mixed sum = 0;
+        for (int i = LOCAL_ID; i < numThreads; i += LOCAL_SIZE)
+            sum += energyParamDerivs[NUM_DERIVATIVES*i+deriv];
+        temp[LOCAL_ID] = sum;
+        SYNC_THREADS;
+        for (int step = REPORT_BLOCK_SIZE/2; step > 0; step /= 2) {
+            if (LOCAL_ID < step)
+                temp[LOCAL_ID] += temp[LOCAL_ID+step];
+            SYNC_THREADS;
+        }
+        if (LOCAL_ID == 0)
+            reportBuffer[NUM_REPORTED*slot+index] = temp[0];
+        SYNC_THREADS;
+    }
+}
@@ -0,0 +1,24 @@
+/**
+ * Replace the positions of all atoms with those of a staged frame, which are stored as x, y, and z for
+ * each atom in its original order.  The charges stored in posq are kept.
+ */
+KERNEL void applyStagedPositions(GLOBAL const mixed* RESTRICT stagedPositions, GLOBAL real4* RESTRICT posq,
+#ifdef USE_MIXED_PRECISION
+        GLOBAL real4* RESTRICT posqCorrection,
+#endif
+        GLOBAL const int* RESTRICT atomIndex) {
+    for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
+        int atom = atomIndex[i];
+        mixed x = stagedPositions[3*atom];
+        mixed y = stagedPositions[3*atom+1];
+        mixed z = stagedPositions[3*atom+2];
+        real4 pos = posq[i];
+        pos.x = (real) x;
+        pos.y = (real) y;
+        pos.z = (real) z;
+        posq[i] = pos;
+#ifdef USE_MIXED_PRECISION
+        posqCorrection[i] = make_real4(x-pos.x, y-pos.y, z-pos.z, 0);
+#endif
+    }
+}
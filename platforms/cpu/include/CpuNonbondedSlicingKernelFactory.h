@@ -0,0 +1,29 @@
+#ifndef OPENMM_CPUNONBONDED_SLICINGKERNELFACTORY_H_
+#define OPENMM_CPUNONBONDED_SLICINGKERNELFACTORY_H_
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/KernelFactory.h"
+
+namespace NonbondedSlicing {
+
+/**
+ * This KernelFactory creates kernels for the CPU implementation of the NonbondedSlicing plugin.
+ */
+
+class CpuNonbondedSlicingKernelFactory : public OpenMM::KernelFactory {
+public:
+    OpenMM::KernelImpl* createKernelImpl(std::string name, const OpenMM::Platform& platform, OpenMM::ContextImpl& context) const;
+};
+
+} // namespace NonbondedSlicing
+
+#endif /*OPENMM_CPUNONBONDED_SLICINGKERNELFACTORY_H_*/
@@ -0,0 +1,53 @@
+#ifndef CPU_NONBONDED_SLICING_KERNELS_H_
+#define CPU_NONBONDED_SLICING_KERNELS_H_
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "ReferenceNonbondedSlicingKernels.h"
+#include "CpuPlatform.h"
+#include "CpuNeighborList.h"
+#include <vector>
+
+using namespace std;
+
+namespace NonbondedSlicing {
+
+/**
+ * This kernel is invoked by SlicedNonbondedForce to calculate the forces acting on the system and the energy of the system.
+ * It shares the bookkeeping of the reference implementation, but splits the pair interactions and the reciprocal space
+ * calculations among the threads of the CPU platform.
+ */
+class CpuCalcSlicedNonbondedForceKernel : public ReferenceCalcSlicedNonbondedForceKernel {
+public:
+    CpuCalcSlicedNonbondedForceKernel(string name, const Platform& platform, CpuPlatform::PlatformData& data) : ReferenceCalcSlicedNonbondedForceKernel(name, platform),
+            data(data), cpuNeighborList(NULL) {
+    }
+    ~CpuCalcSlicedNonbondedForceKernel();
+    /**
+     * Initialize the kernel.
+     *
+     * @param system     the System this kernel will be applied to
+     * @param force      the SlicedNonbondedForce this kernel will be used for
+     */
+    void initialize(const System& system, const SlicedNonbondedForce& force);
+protected:
+    void calculatePairIxn(ContextImpl& context, vector<Vec3>& posData, vector<Vec3>& forceData, vector<vector<double>>& sliceEnergies,
+                          bool includeForces, bool includeDirect, bool includeReciprocal);
+private:
+    CpuPlatform::PlatformData& data;
+    CpuNeighborList* cpuNeighborList;
+    AlignedArray<float> atomLocations;
+    vector<vector<Vec3>> threadForces;
+};
+
+} // namespace NonbondedSlicing
+
+#endif /*CPU_NONBONDED_SLICING_KERNELS_H_*/
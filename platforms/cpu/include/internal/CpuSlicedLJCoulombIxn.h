@@ -0,0 +1,119 @@
+#ifndef __CpuSlicedLJCoulombIxn_H__
+#define __CpuSlicedLJCoulombIxn_H__
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ReferenceSlicedLJCoulombIxn.h"
+#include "CpuNeighborList.h"
+#include "openmm/internal/ThreadPool.h"
+#include <atomic>
+
+using namespace std;
+using namespace OpenMM;
+
+namespace NonbondedSlicing {
+
+class CpuSlicedLJCoulombIxn : public ReferenceSlicedLJCoulombIxn {
+
+   private:
+
+      OpenMM::ThreadPool& threads;
+      vector<vector<OpenMM::Vec3>>& threadForces;
+      const OpenMM::CpuNeighborList* cpuNeighborList;
+
+   public:
+
+      // number of atoms in each block of the neighbor list
+
+      static const int BlockSize = 8;
+
+      /**---------------------------------------------------------------------------------------
+
+         Constructor
+
+         @param threads       the pool of threads among which the work is split
+         @param threadForces  buffers for the forces computed by each thread, which are
+                              reallocated if necessary and can be reused across calls
+
+         --------------------------------------------------------------------------------------- */
+
+       CpuSlicedLJCoulombIxn(OpenMM::ThreadPool& threads, vector<vector<OpenMM::Vec3>>& threadForces);
+
+      /**---------------------------------------------------------------------------------------
+
+         Set the force to use a cutoff.
+
+         @param distance            the cutoff distance
+         @param neighbors           the neighbor list to use, built with blocks of BlockSize atoms
+         @param solventDielectric   the dielectric constant of the bulk solvent
+
+         --------------------------------------------------------------------------------------- */
+
+      void setUseCutoff(double distance, const OpenMM::CpuNeighborList& neighbors, double solventDielectric);
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate LJ Coulomb pair ixn
+
+         @param numberOfAtoms    number of atoms
+         @param atomCoordinates  atom coordinates
+         @param atomSubsets      atom subsets
+         @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
+         @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+         @param exclusions       atom exclusion indices
+                                 exclusions[atomIndex] contains the list of exclusions for that atom
+         @param forces           force array (forces added)
+         @param sliceEnergies    the energy of each slice
+         @param includeDirect      true if direct space interactions should be included
+         @param includeReciprocal  true if reciprocal space interactions should be included
+         @param includeForces      true if forces should be computed.  If false, only energies are computed.
+
+         --------------------------------------------------------------------------------------- */
+
+      void calculatePairIxn(int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
+                           const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int> >& exclusions,
+                            vector<OpenMM::Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal, bool includeForces=true) const;
+
+   private:
+
+      typedef void (ReferenceSlicedLJCoulombIxn::*PairIxn)(int, int, const vector<OpenMM::Vec3>&, const vector<int>&,
+                                                           const double*, const double*, vector<OpenMM::Vec3>&, double*) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the direct space interactions assigned to a thread, with the specialization
+         of the pair ixn that matches the options of this object.
+
+         --------------------------------------------------------------------------------------- */
+
+      void calculateThreadIxn(int numberOfAtoms, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                              const double* atomParameters, const double* sliceLambdas, const vector<set<int> >& exclusions,
+                              vector<OpenMM::Vec3>& threadForce, double* threadEnergy, std::atomic<int>& atomicCounter) const;
+
+      template <PairIxn pairIxn>
+      void calculateThreadBlockIxn(int numberOfAtoms, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                   const double* atomParameters, const double* sliceLambdas, vector<OpenMM::Vec3>& threadForce,
+                                   double* threadEnergy, std::atomic<int>& atomicCounter) const;
+
+      template <PairIxn pairIxn>
+      void calculateThreadAllPairsIxn(int numberOfAtoms, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                      const double* atomParameters, const double* sliceLambdas, const vector<set<int> >& exclusions,
+                                      vector<OpenMM::Vec3>& threadForce, double* threadEnergy, std::atomic<int>& atomicCounter) const;
+
+      template <PairIxn pairIxn>
+      void calculateThreadExclusionIxn(int numberOfAtoms, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                       const double* atomParameters, const double* sliceLambdas, const vector<set<int> >& exclusions,
+                                       vector<OpenMM::Vec3>& threadForce, double* threadEnergy, std::atomic<int>& atomicCounter) const;
+};
+
+} // namespace NonbondedSlicing
+
+#endif // __CpuSlicedLJCoulombIxn_H__
@@ -0,0 +1,46 @@
+/* -------------------------------------------------------------------------- *
+ *                              OpenMMNonbondedSlicing                                   *
+ * -------------------------------------------------------------------------- */
+
+#include <exception>
+
+#include "CpuNonbondedSlicingKernelFactory.h"
+#include "CpuNonbondedSlicingKernels.h"
+#include "CpuPlatform.h"
+#include "openmm/internal/windowsExport.h"
+#include "openmm/internal/ContextImpl.h"
+#include "openmm/OpenMMException.h"
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerPlatforms() {
+}
+
+extern "C" OPENMM_EXPORT void registerKernelFactories() {
+    try {
+        Platform& platform = Platform::getPlatformByName("CPU");
+        CpuNonbondedSlicingKernelFactory* factory = new CpuNonbondedSlicingKernelFactory();
+        platform.registerKernelFactory(CalcSlicedNonbondedForceKernel::Name(), factory);
+    }
+    catch (std::exception ex) {
+        // Ignore
+    }
+}
+
+extern "C" OPENMM_EXPORT void registerNonbondedSlicingCpuKernelFactories() {
+    try {
+        Platform::getPlatformByName("CPU");
+    }
+    catch (...) {
+        Platform::registerPlatform(new CpuPlatform());
+    }
+    registerKernelFactories();
+}
+
+KernelImpl* CpuNonbondedSlicingKernelFactory::createKernelImpl(std::string name, const Platform& platform, ContextImpl& context) const {
+    CpuPlatform::PlatformData& data = CpuPlatform::getPlatformData(context);
+    if (name == CalcSlicedNonbondedForceKernel::Name())
+        return new CpuCalcSlicedNonbondedForceKernel(name, platform, data);
+    throw OpenMMException((std::string("Tried to create kernel with illegal kernel name '")+name+"'").c_str());
+}
@@ -0,0 +1,85 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuNonbondedSlicingKernels.h"
+#include "SlicedNonbondedForce.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/ContextImpl.h"
+#include "openmm/reference/ReferencePlatform.h"
+#include "internal/CpuSlicedLJCoulombIxn.h"
+#include "internal/ReferenceSlicedPME.h"
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+static Vec3* extractBoxVectors(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return (Vec3*) data->periodicBoxVectors;
+}
+
+CpuCalcSlicedNonbondedForceKernel::~CpuCalcSlicedNonbondedForceKernel() {
+    if (cpuNeighborList != NULL)
+        delete cpuNeighborList;
+}
+
+void CpuCalcSlicedNonbondedForceKernel::initialize(const System& system, const SlicedNonbondedForce& force) {
+    ReferenceCalcSlicedNonbondedForceKernel::initialize(system, force);
+    if (nonbondedMethod != NoCutoff) {
+        cpuNeighborList = new CpuNeighborList(CpuSlicedLJCoulombIxn::BlockSize);
+        atomLocations.resize(4*numParticles);
+    }
+    if (pmeData != NULL)
+        pme_set_threads(pmeData, &data.threads);
+    if (dispersionPmeData != NULL)
+        pme_set_threads(dispersionPmeData, &data.threads);
+}
+
+void CpuCalcSlicedNonbondedForceKernel::calculatePairIxn(ContextImpl& context, vector<Vec3>& posData, vector<Vec3>& forceData,
+            vector<vector<double>>& sliceEnergies, bool includeForces, bool includeDirect, bool includeReciprocal) {
+    if (treeCode != NULL) {
+        ReferenceCalcSlicedNonbondedForceKernel::calculatePairIxn(context, posData, forceData, sliceEnergies, includeForces, includeDirect, includeReciprocal);
+        return;
+    }
+    CpuSlicedLJCoulombIxn clj(data.threads, threadForces);
+    bool periodic = (nonbondedMethod == CutoffPeriodic);
+    bool ewald  = (nonbondedMethod == Ewald);
+    bool pme  = (nonbondedMethod == PME);
+    bool ljpme = (nonbondedMethod == LJPME);
+    if (nonbondedMethod != NoCutoff) {
+        if (includeDirect) {
+            for (int i = 0; i < numParticles; i++)
+                for (int k = 0; k < 3; k++)
+                    atomLocations[4*i+k] = (float) posData[i][k];
+            cpuNeighborList->computeNeighborList(numParticles, atomLocations, exclusions, extractBoxVectors(context),
+                                                 periodic || ewald || pme || ljpme, nonbondedCutoff, data.threads);
+        }
+        clj.setUseCutoff(nonbondedCutoff, *cpuNeighborList, rfDielectric);
+    }
+    if (periodic || ewald || pme || ljpme) {
+        Vec3* boxVectors = extractBoxVectors(context);
+        double minAllowedSize = 1.999999*nonbondedCutoff;
+        if (boxVectors[0][0] < minAllowedSize || boxVectors[1][1] < minAllowedSize || boxVectors[2][2] < minAllowedSize)
+            throw OpenMMException("The periodic box size has decreased to less than twice the nonbonded cutoff.");
+        clj.setPeriodic(boxVectors);
+        clj.setPeriodicExceptions(exceptionsArePeriodic);
+    }
+    if (ewald)
+        clj.setUseEwald(ewaldAlpha, kmax[0], kmax[1], kmax[2], &ewaldWorkspace);
+    if (pme)
+        clj.setUsePME(ewaldAlpha, gridSize, pmeData);
+    if (ljpme){
+        clj.setUsePME(ewaldAlpha, gridSize, pmeData);
+        clj.setUseLJPME(ewaldDispersionAlpha, dispersionGridSize, dispersionPmeData);
+    }
+    if (useSwitchingFunction)
+        clj.setUseSwitchingFunction(switchingDistance);
+    clj.calculatePairIxn(numParticles, posData, numSubsets, subsets, particleParamArray, sliceLambdas, exclusions, forceData, sliceEnergies, includeDirect, includeReciprocal, includeForces);
+}
@@ -0,0 +1,223 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include <algorithm>
+#include <atomic>
+
+#include "internal/CpuSlicedLJCoulombIxn.h"
+
+using namespace std;
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+
+/**---------------------------------------------------------------------------------------
+
+   CpuSlicedLJCoulombIxn constructor
+
+   --------------------------------------------------------------------------------------- */
+
+CpuSlicedLJCoulombIxn::CpuSlicedLJCoulombIxn(ThreadPool& threads, vector<vector<Vec3>>& threadForces) :
+            threads(threads), threadForces(threadForces), cpuNeighborList(NULL) {
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Set the force to use a cutoff.
+
+     @param distance            the cutoff distance
+     @param neighbors           the neighbor list to use
+     @param solventDielectric   the dielectric constant of the bulk solvent
+
+     --------------------------------------------------------------------------------------- */
+
+void CpuSlicedLJCoulombIxn::setUseCutoff(double distance, const CpuNeighborList& neighbors, double solventDielectric) {
+    cutoff = true;
+    cutoffDistance = distance;
+    cpuNeighborList = &neighbors;
+    krf = pow(cutoffDistance, -3.0)*(solventDielectric-1.0)/(2.0*solventDielectric+1.0);
+    crf = (1.0/cutoffDistance)*(3.0*solventDielectric)/(2.0*solventDielectric+1.0);
+}
+
+/**---------------------------------------------------------------------------------------
+
+   Calculate LJ Coulomb pair ixn
+
+   The reciprocal space part is delegated to the reference implementation, whose PME objects
+   are expected to share the same thread pool. In direct space, each thread takes blocks of
+   the neighbor list (or rows of the full pair matrix without a cutoff) on demand and
+   accumulates forces and slice energies into buffers of its own, which are then reduced.
+
+   @param numberOfAtoms    number of atoms
+   @param atomCoordinates  atom coordinates
+   @param atomSubsets      atom subsets
+   @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
+   @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+   @param exclusions       atom exclusion indices
+                           exclusions[atomIndex] contains the list of exclusions for that atom
+   @param forces           force array (forces added)
+   @param sliceEnergies    the energy of each slice
+   @param includeDirect      true if direct space interactions should be included
+   @param includeReciprocal  true if reciprocal space interactions should be included
+   @param includeForces      true if forces should be computed.  If false, only energies are computed.
+
+   --------------------------------------------------------------------------------------- */
+
+void CpuSlicedLJCoulombIxn::calculatePairIxn(int numberOfAtoms, vector<Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
+                const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int>>& exclusions,
+                vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal, bool includeForces) const {
+
+    bool useEwald = ewald || pme || ljpme;
+    if (useEwald && includeReciprocal)
+        calculateEwaldIxn(numberOfAtoms, atomCoordinates, numberOfSubsets, atomSubsets, atomParameters, sliceLambdas, exclusions, forces,
+                          sliceEnergies, false, true, includeForces);
+    if (!includeDirect)
+        return;
+
+    int numThreads = threads.getNumThreads();
+    int numSlices = sliceEnergies.size();
+    threadForces.resize(numThreads);
+    vector<vector<double>> threadEnergies(numThreads, vector<double>(NumTerms*numSlices, 0.0));
+    vector<double> flatParameters, flatLambdas;
+    flattenAtomParameters(atomParameters, flatParameters);
+    flattenSliceValues(sliceLambdas, flatLambdas);
+    atomic<int> atomicCounter(0);
+
+    threads.execute([&] (ThreadPool& threads, int threadIndex) {
+        vector<Vec3>& threadForce = threadForces[threadIndex];
+        threadForce.assign(numberOfAtoms, Vec3());
+        calculateThreadIxn(numberOfAtoms, atomCoordinates, atomSubsets, flatParameters.data(), flatLambdas.data(), exclusions,
+                           threadForce, threadEnergies[threadIndex].data(), atomicCounter);
+    });
+    threads.waitForThreads();
+
+    // Subtract off the exclusions, since they were implicitly included in the reciprocal space sum.
+
+    if (useEwald) {
+        atomicCounter = 0;
+        threads.execute([&] (ThreadPool& threads, int threadIndex) {
+            if (ljpme)
+                calculateThreadExclusionIxn<&CpuSlicedLJCoulombIxn::calculateOneEwaldExclusionIxn<true> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                        flatParameters.data(), flatLambdas.data(), exclusions, threadForces[threadIndex], threadEnergies[threadIndex].data(), atomicCounter);
+            else
+                calculateThreadExclusionIxn<&CpuSlicedLJCoulombIxn::calculateOneEwaldExclusionIxn<false> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                        flatParameters.data(), flatLambdas.data(), exclusions, threadForces[threadIndex], threadEnergies[threadIndex].data(), atomicCounter);
+        });
+        threads.waitForThreads();
+    }
+
+    // Reduce the forces and energies of all threads.
+
+    if (includeForces) {
+        threads.execute([&] (ThreadPool& threads, int threadIndex) {
+            int start = (threadIndex*numberOfAtoms)/numThreads;
+            int end = ((threadIndex+1)*numberOfAtoms)/numThreads;
+            for (auto& threadForce : threadForces)
+                for (int i = start; i < end; i++)
+                    forces[i] += threadForce[i];
+        });
+        threads.waitForThreads();
+    }
+    for (auto& threadEnergy : threadEnergies)
+        addSliceValues(threadEnergy, sliceEnergies);
+}
+
+void CpuSlicedLJCoulombIxn::calculateThreadIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                const double* atomParameters, const double* sliceLambdas, const vector<set<int>>& exclusions,
+                vector<Vec3>& threadForce, double* threadEnergy, atomic<int>& atomicCounter) const {
+
+    // Select the specialized pair loop once, rather than branching on the options for every pair.
+
+    if (ewald || pme || ljpme) {
+        if (ljpme)
+            calculateThreadBlockIxn<&CpuSlicedLJCoulombIxn::calculateOneEwaldIxn<true, false> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, threadForce, threadEnergy, atomicCounter);
+        else if (useSwitch)
+            calculateThreadBlockIxn<&CpuSlicedLJCoulombIxn::calculateOneEwaldIxn<false, true> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, threadForce, threadEnergy, atomicCounter);
+        else
+            calculateThreadBlockIxn<&CpuSlicedLJCoulombIxn::calculateOneEwaldIxn<false, false> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, threadForce, threadEnergy, atomicCounter);
+    }
+    else if (cutoff && periodic) {
+        if (useSwitch)
+            calculateThreadBlockIxn<&CpuSlicedLJCoulombIxn::calculateOneIxn<true, true, true> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, threadForce, threadEnergy, atomicCounter);
+        else
+            calculateThreadBlockIxn<&CpuSlicedLJCoulombIxn::calculateOneIxn<true, true, false> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, threadForce, threadEnergy, atomicCounter);
+    }
+    else if (cutoff) {
+        if (useSwitch)
+            calculateThreadBlockIxn<&CpuSlicedLJCoulombIxn::calculateOneIxn<true, false, true> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, threadForce, threadEnergy, atomicCounter);
+        else
+            calculateThreadBlockIxn<&CpuSlicedLJCoulombIxn::calculateOneIxn<true, false, false> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, threadForce, threadEnergy, atomicCounter);
+    }
+    else {
+        if (useSwitch)
+            calculateThreadAllPairsIxn<&CpuSlicedLJCoulombIxn::calculateOneIxn<false, false, true> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, exclusions, threadForce, threadEnergy, atomicCounter);
+        else
+            calculateThreadAllPairsIxn<&CpuSlicedLJCoulombIxn::calculateOneIxn<false, false, false> >(numberOfAtoms, atomCoordinates, atomSubsets,
+                    atomParameters, sliceLambdas, exclusions, threadForce, threadEnergy, atomicCounter);
+    }
+}
+
+template <CpuSlicedLJCoulombIxn::PairIxn pairIxn>
+void CpuSlicedLJCoulombIxn::calculateThreadBlockIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                const double* atomParameters, const double* sliceLambdas, vector<Vec3>& threadForce, double* threadEnergy,
+                atomic<int>& atomicCounter) const {
+    const vector<int>& sortedAtoms = cpuNeighborList->getSortedAtoms();
+    int numBlocks = cpuNeighborList->getNumBlocks();
+    while (true) {
+        int block = atomicCounter++;
+        if (block >= numBlocks)
+            break;
+        const int* blockAtom = &sortedAtoms[BlockSize*block];
+        int numBlockAtoms = min(BlockSize, numberOfAtoms-BlockSize*block);
+        const vector<int>& neighbors = cpuNeighborList->getBlockNeighbors(block);
+        const auto& blockExclusions = cpuNeighborList->getBlockExclusions(block);
+        for (int i = 0; i < (int) neighbors.size(); i++) {
+            int jj = neighbors[i];
+            for (int k = 0; k < numBlockAtoms; k++)
+                if ((blockExclusions[i] & (1<<k)) == 0)
+                    (this->*pairIxn)(blockAtom[k], jj, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, threadForce, threadEnergy);
+        }
+    }
+}
+
+template <CpuSlicedLJCoulombIxn::PairIxn pairIxn>
+void CpuSlicedLJCoulombIxn::calculateThreadAllPairsIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                const double* atomParameters, const double* sliceLambdas, const vector<set<int>>& exclusions,
+                vector<Vec3>& threadForce, double* threadEnergy, atomic<int>& atomicCounter) const {
+    while (true) {
+        int ii = atomicCounter++;
+        if (ii >= numberOfAtoms)
+            break;
+        for (int jj = ii+1; jj < numberOfAtoms; jj++)
+            if (exclusions[jj].find(ii) == exclusions[jj].end())
+                (this->*pairIxn)(ii, jj, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, threadForce, threadEnergy);
+    }
+}
+
+template <CpuSlicedLJCoulombIxn::PairIxn pairIxn>
+void CpuSlicedLJCoulombIxn::calculateThreadExclusionIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                const double* atomParameters, const double* sliceLambdas, const vector<set<int>>& exclusions,
+                vector<Vec3>& threadForce, double* threadEnergy, atomic<int>& atomicCounter) const {
+    while (true) {
+        int i = atomicCounter++;
+        if (i >= numberOfAtoms)
+            break;
+        for (int exclusion : exclusions[i])
+            if (exclusion > i)
+                (this->*pairIxn)(i, exclusion, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, threadForce, threadEnergy);
+    }
+}
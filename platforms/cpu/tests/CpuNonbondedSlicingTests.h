@@ -0,0 +1,25 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#ifdef WIN32
+  #define _USE_MATH_DEFINES // Needed to get M_PI
+#endif
+#include "CpuPlatform.h"
+
+extern "C" OPENMM_EXPORT void registerNonbondedSlicingCpuKernelFactories();
+
+OpenMM::CpuPlatform platform;
+
+void initializeTests(int argc, char* argv[]) {
+    registerNonbondedSlicingCpuKernelFactories();
+    platform = dynamic_cast<OpenMM::CpuPlatform&>(OpenMM::Platform::getPlatformByName("CPU"));
+    if (argc > 1)
+        platform.setPropertyDefaultValue("Threads", std::string(argv[1]));
+}
@@ -0,0 +1,71 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuNonbondedSlicingTests.h"
+#include "TestSlicedNonbondedForce.h"
+
+void testThreadCounts(NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 300;
+    const double boxSize = 3.0;
+    System system;
+    NonbondedForce nonbonded;
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        nonbonded.addParticle(i%2-0.5, 0.2+0.01*(i%7), 0.5+0.1*(i%3));
+    }
+    nonbonded.setNonbondedMethod(method);
+    nonbonded.setCutoffDistance(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt));
+    for (int i = 1; i < numParticles; i += 3)
+        nonbonded.addException(i-1, i, 0.0, 1.0, 0.0);
+
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(nonbonded, 3);
+    for (int i = 0; i < numParticles; i++)
+        force->setParticleSubset(i, i%3);
+    force->addGlobalParameter("lambdaCoul", 0.5);
+    force->addGlobalParameter("lambdaLJ", 0.7);
+    force->addScalingParameter("lambdaCoul", 0, 1, true, false);
+    force->addScalingParameter("lambdaLJ", 2, 2, false, true);
+    force->addScalingParameterDerivative("lambdaCoul");
+    system.addForce(force);
+
+    // Create two contexts, one with a single thread and one with several threads.
+
+    VerletIntegrator integrator1(0.001);
+    map<string, string> props;
+    props["Threads"] = "1";
+    Context context1(system, integrator1, platform, props);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy | State::ParameterDerivatives);
+    VerletIntegrator integrator2(0.001);
+    props["Threads"] = "4";
+    Context context2(system, integrator2, platform, props);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy | State::ParameterDerivatives);
+
+    // See if they agree.
+
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-6);
+    ASSERT_EQUAL_TOL(state1.getEnergyParameterDerivatives().at("lambdaCoul"), state2.getEnergyParameterDerivatives().at("lambdaCoul"), 1e-6);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-6);
+}
+
+void runPlatformTests() {
+    testThreadCounts(NonbondedForce::NoCutoff);
+    testThreadCounts(NonbondedForce::CutoffPeriodic);
+    testThreadCounts(NonbondedForce::PME);
+    testThreadCounts(NonbondedForce::LJPME);
+}
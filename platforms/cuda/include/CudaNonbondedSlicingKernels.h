@@ -12,13 +12,22 @@
  * -------------------------------------------------------------------------- */
 
 #include "NonbondedSlicingKernels.h"
+#include "internal/SlicedDispersionCorrection.h"
 #include "internal/CudaFFT3D.h"
 #include "internal/CudaCuFFT3D.h"
 #include "internal/CudaVkFFT3D.h"
+#include "internal/CudaPmeWorkspace.h"
+#include "internal/CudaStageTimer.h"
 #include "openmm/internal/ContextImpl.h"
+#include "openmm/internal/ThreadPool.h"
 #include "openmm/cuda/CudaContext.h"
 #include "openmm/cuda/CudaArray.h"
 #include "openmm/cuda/CudaSort.h"
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
 #include <vector>
 #include <algorithm>
 
@@ -34,7 +43,7 @@ class CudaCalcSlicedNonbondedForceKernel : public CalcSlicedNonbondedForceKernel
 public:
     CudaCalcSlicedNonbondedForceKernel(std::string name, const Platform& platform, CudaContext& cu, const System& system) :
             CalcSlicedNonbondedForceKernel(name, platform), cu(cu), hasInitializedFFT(false), sort(NULL),
-            dispersionFft(NULL), fft(NULL), usePmeStream(false) {};
+            dispersionFft(NULL), fft(NULL), pmeGrid1(NULL), pmeGrid2(NULL), pmeBsplineModuliX(NULL), pmeBsplineModuliY(NULL), pmeBsplineModuliZ(NULL), pmeAtomGridIndex(NULL), pmeAtomGridIndexSubsetsId(-1), usePmeStream(false), usePmeGraphs(false), vkfftRegisterBoost(1), pinnedLambdas(NULL), pinnedMaskedLambdas(NULL), stageTimer(NULL), reportSliceEnergies(NULL), useTiledEnergy(false), shareAtomGridIndex(false), pmeGridMemorySavings(0), useSliceForces(false), hasSliceForces(false), useSliceEnergies(false), hasSliceEnergies(false), sliceEnergiesIncludeReciprocal(false), dispersionCorrection(NULL), useEnergyCache(false), energyCacheValid(false), useSliceForceGroups(false), includedGroups(-1), reciprocalGroupsMask(0), maskedLambdasGroups(-1), reciprocalSliceLambdas(NULL), useSmallSubsets(false), pmeSubsets(NULL), protocolWork(NULL), addEnergy(NULL), numScheduledParams(0), numScheduleSteps(0), scheduleStartStep(0), lastWorkStep(-1), lambdaScheduleStale(false), cpuPme(NULL), dispersionSort(NULL), useDispersionStream(false), numDispersionGrids(0), useInfluenceFunction(false), useCachedBSplines(false), balanceLoads(false), evaluationTimed(false), lastEvaluationTime(-1.0), numHeldExceptions(0), numHeldExclusions(0), directShareStart(0.0), directShareEnd(1.0), directShareChanged(false), positionStager(NULL) {};
     ~CudaCalcSlicedNonbondedForceKernel();
     /**
      * Initialize the kernel.
@@ -61,6 +70,14 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Move some particles to other subsets without copying any other parameter.
+     *
+     * @param context    the context in which to move the particles
+     * @param force      the SlicedNonbondedForce, which already holds the new subsets
+     * @param particles  the indices of the moved particles
+     */
+    void reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles);
     /**
      * Get the parameters being used for PME.
      *
@@ -79,7 +96,203 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the configuration found by PME grid tuning and FFT library selection, in the format of
+     * SlicedNonbondedForceImpl::formatTunedConfiguration(), or an empty string if nothing was tuned.
+     */
+    std::string getTunedConfiguration() const;
+    /**
+     * Get the name of the FFT library used for the reciprocal space sums, or an empty string if
+     * no FFTs are performed.
+     */
+    std::string getFFTBackendName() const;
+    /**
+     * Get the total time taken by each stage of the calculation, in seconds, if stage profiling is enabled.
+     */
+    std::map<std::string, double> getStageTimings() const;
+    /**
+     * Get the number of bytes of device memory saved by storing the PME grids in compact form.
+     */
+    long long getPMEGridMemorySavings() const;
+    /**
+     * Get the number of bytes of device memory taken by each array allocated by this kernel.
+     */
+    std::map<std::string, long long> getMemoryUsage() const;
+    /**
+     * Get the forces that a slice contributed to the last evaluation that computed forces.
+     *
+     * @param slice   the index of the slice
+     * @param forces  on exit, the force on each particle due to the slice
+     * @return false if no evaluation has computed forces yet
+     */
+    bool getSliceForces(int slice, std::vector<Vec3>& forces);
+    /**
+     * Get the Coulomb and Lennard-Jones energies of every slice in the last evaluation.
+     *
+     * @param energies  on exit, the Coulomb and Lennard-Jones energies of each slice
+     * @param lambdas   on exit, the Coulomb and Lennard-Jones scaling factors applied to each slice
+     * @return false if the last evaluation did not compute the energy
+     */
+    bool getSliceEnergies(std::vector<double>& energies, std::vector<double>& lambdas);
+    /**
+     * Set the values that the scaling parameters take at each step of a nonequilibrium protocol.
+     *
+     * @param context     the context in which the protocol is run
+     * @param parameters  the names of the scheduled scaling parameters, or an empty vector to remove
+     *                    the schedule
+     * @param schedule    the values of the scheduled parameters at each step
+     */
+    void setScalingParameterSchedule(ContextImpl& context, const std::vector<std::string>& parameters, const std::vector<std::vector<double> >& schedule);
+    /**
+     * Get the work accumulated since the schedule was set.
+     */
+    double getProtocolWork();
+    /**
+     * Set the force groups included in the next evaluation.
+     *
+     * @param groups  a bit mask of the force groups to include
+     */
+    void setIncludedForceGroups(int groups);
+    /**
+     * Start copying the positions of a frame to the device on a separate stream.
+     *
+     * @param context    the context for which the positions are staged
+     * @param positions  the positions of all particles, stored as x, y, and z for each particle
+     */
+    void stagePositions(ContextImpl& context, const double* positions);
+    /**
+     * Make the positions staged by the last call to stagePositions() the positions of the context.
+     *
+     * @param context    the context whose positions are replaced
+     */
+    void applyStagedPositions(ContextImpl& context);
+    /**
+     * Get whether this kernel computes the Coulomb reciprocal space sum, which is done by only
+     * one of the devices of a multi-GPU context, either on the device itself or on the CPU.
+     */
+    bool getComputeCoulombRecip() const {
+        return computeCoulombRecip || cpuPme != NULL;
+    }
+    /**
+     * Get whether this kernel computes the LJPME dispersion reciprocal space sum.
+     */
+    bool getComputeDispersionRecip() const {
+        return computeDispersionRecip;
+    }
+    /**
+     * Get the time taken by the device to perform the last completed evaluation of forces and
+     * energies, in milliseconds, or a negative value if it is not known.  It is only measured when
+     * the loads are balanced among devices at run time.
+     */
+    double getLastEvaluationTime() const {
+        return lastEvaluationTime;
+    }
+    /**
+     * Set the share of the exceptions and exclusion corrections computed by this device, as the
+     * fractions of them that precede the first and follow the last pair of the share.  This has no
+     * effect unless the loads are balanced among devices at run time, in which case every device
+     * holds all of the pairs.
+     *
+     * @param start   the fraction of the pairs computed by the devices that come before this one
+     * @param end     the fraction of the pairs computed by this device and those that come before it
+     */
+    void setLoadShare(double start, double end);
+    /**
+     * Get the fraction of the direct space tiles that this device currently computes.
+     */
+    double getDirectSpaceShare() const;
+    /**
+     * Set the share of the direct space tiles computed by this device, as fractions of the tiles in
+     * the same way as setLoadShare().  The new range is passed to the nonbonded utilities at the start
+     * of the next evaluation, which rebuilds the neighbor list, so it should change only rarely.  This
+     * has no effect unless the loads are balanced among devices at run time.
+     *
+     * @param start   the fraction of the tiles computed by the devices that come before this one
+     * @param end     the fraction of the tiles computed by this device and those that come before it
+     */
+    void setDirectSpaceShare(double start, double end);
 private:
+    /**
+     * Measure the time taken by the forward and inverse transforms of the subset grids for a
+     * candidate PME grid size.
+     */
+    double timePmeTransforms(int xsize, int ysize, int zsize);
+    /**
+     * Launch the sequence of kernels that computes the PME reciprocal space sums.  If reuseAtomGridIndex
+     * is true, the atom grid indices are not computed again when another kernel sharing the workspace
+     * has already computed them for the same subsets in the current evaluation.
+     */
+    void executePmeKernels(bool includeForces, bool includeEnergy, void* recipBoxVectorPointer[3], bool reuseAtomGridIndex);
+    /**
+     * Update the position cache and get whether the reciprocal space slice energies of the previous
+     * evaluation can be reused, which requires that it computed them for the same positions, periodic
+     * box, and parameters other than the scaling parameters, and that forces are not requested.
+     */
+    bool reuseEnergyCache(bool includeForces, bool includeEnergy, bool paramsRecomputed);
+    /**
+     * Capture the PME kernel sequence into a CUDA graph for the current periodic box.
+     */
+    void capturePmeGraph(int variant, bool includeForces, bool includeEnergy, void* recipBoxVectorPointer[3]);
+    /**
+     * Record which particles have charges or charge offsets, and return whether any of them changed.
+     */
+    bool updateChargedParticles();
+    /**
+     * Recompute from scratch the self energies of the subsets flagged in affected, using the current
+     * parameters and subsets of all particles.
+     */
+    void recomputeSelfEnergies(const vector<bool>& affected);
+    /**
+     * Update the grid slot of each particle and the lists of particles in small subsets after the
+     * subsets have been set or changed.  This returns true if the array of B-spline factors had to
+     * be enlarged, in which case captured graphs are no longer valid.
+     */
+    bool updateSmallSubsets();
+    /**
+     * Upload the dispersion grid of each particle after the subsets have been set or changed.  This is
+     * only needed when some subsets have no dispersion grids.
+     */
+    void updateDispersionAtomGrids();
+    /**
+     * Update the data that depend on the subsets of the particles, which are already stored in
+     * subsetsVec: the total self energy, the small subsets, and the identifier of the subsets in the
+     * shared PME workspace.
+     */
+    void updateSubsetDependentData(bool subsetsChanged);
+    /**
+     * Upload the lambdas of every slice at every step of the schedule, which depend on the current
+     * values of the unscheduled scaling parameters.
+     */
+    void uploadLambdaSchedule();
+    /**
+     * Start compiling a module on a worker thread, so that the modules of initialize() are compiled
+     * concurrently.  The function is called with the compiled module by finishCompilation(), which
+     * must be invoked before any of its kernels is used.
+     */
+    void compileModule(const std::string& source, const std::map<std::string, std::string>& defines, std::function<void(CUmodule)> getKernels);
+    /**
+     * Wait for all modules being compiled and extract their kernels, in the order they were requested.
+     */
+    void finishCompilation();
+    /**
+     * Get the range of a list of exceptions or exclusion corrections held by this device, which is
+     * the whole list if the loads are balanced among devices at run time, or an equal share of it.
+     */
+    std::pair<int, int> getHeldRange(int size) const;
+    /**
+     * Start measuring a stage in the current stream, if stage profiling is enabled.
+     */
+    void startStage(const std::string& stage) {
+        if (stageTimer != NULL)
+            stageTimer->start(stage, cu.getCurrentStream());
+    }
+    /**
+     * Finish measuring a stage in the current stream, if stage profiling is enabled.
+     */
+    void stopStage(const std::string& stage) {
+        if (stageTimer != NULL)
+            stageTimer->stop(stage, cu.getCurrentStream());
+    }
     class SortTrait : public CudaSort::SortTrait {
         int getDataSize() const {return 8;}
         int getKeySize() const {return 4;}
@@ -96,6 +309,12 @@ private:
     class AddEnergyPostComputation;
     class SyncStreamPostComputation;
     class DispersionCorrectionPostComputation;
+    class ReportSliceEnergiesPostComputation;
+    class ProtocolWorkPostComputation;
+    class CpuPmePostComputation;
+    class EvaluationTimerPreComputation;
+    class EvaluationTimerPostComputation;
+    class PositionStager;
     CudaContext& cu;
     ForceInfo* info;
     bool hasInitializedFFT;
@@ -111,26 +330,57 @@ private:
     CudaArray particleOffsetIndices;
     CudaArray exceptionOffsetIndices;
     CudaArray globalParams;
+    CudaArray selfEnergyBuffer;
+    CudaArray subsetSelfEnergies;
     CudaArray cosSinSums;
-    CudaArray pmeGrid1;
-    CudaArray pmeGrid2;
-    CudaArray pmeBsplineModuliX;
-    CudaArray pmeBsplineModuliY;
-    CudaArray pmeBsplineModuliZ;
+    std::shared_ptr<CudaPmeWorkspace> pmeWorkspace;
+    CudaArray* pmeGrid1;
+    CudaArray* pmeGrid2;
+    CudaArray* pmeBsplineModuliX;
+    CudaArray* pmeBsplineModuliY;
+    CudaArray* pmeBsplineModuliZ;
     CudaArray pmeDispersionBsplineModuliX;
     CudaArray pmeDispersionBsplineModuliY;
     CudaArray pmeDispersionBsplineModuliZ;
-    CudaArray pmeAtomGridIndex;
+    CudaArray influenceFunction;
+    CudaArray dispersionInfluenceFunction;
+    CudaArray pmeBsplineTheta, pmeBsplineDTheta, pmeBsplineGridPoint;
+    CudaArray pmeDispersionBsplineTheta, pmeDispersionBsplineDTheta, pmeDispersionBsplineGridPoint;
+    CudaArray* pmeAtomGridIndex;
+    int pmeAtomGridIndexSubsetsId;
     CudaArray pmeEnergyBuffer;
     CudaArray ljpmeEnergyBuffer;
+    CudaArray sliceMemberStart;
+    CudaArray sliceMemberSubsets;
     CudaSort* sort;
     CUstream pmeStream;
     CUevent pmeSyncEvent, paramsSyncEvent;
     CudaFFT3D* fft;
     CudaFFT3D* dispersionFft;
-    CUfunction computeParamsKernel, computeExclusionParamsKernel;
+    CudaArray dispersionGrid1;
+    CudaArray dispersionGrid2;
+    CudaArray dispersionAtomGridIndex;
+    CudaSort* dispersionSort;
+    CUstream dispersionStream;
+    CUevent dispersionForkEvent, dispersionJoinEvent;
+    bool useDispersionStream;
+    int numDispersionGrids;
+    vector<int> dispersionSubsetGrids;
+    vector<char> hasEpsilonOffset, dispersiveParticles;
+    CudaArray dispersionAtomGrids;
+    CudaArray dispersionSliceMemberStart;
+    CudaArray dispersionSliceMemberSubsets;
+    std::vector<CUgraphExec> pmeGraphExec;
+    Vec3 pmeGraphBoxVectors[4][3];
+    CudaArray cachedPosq;
+    CudaArray cachedPosqCorrection;
+    CudaArray positionsChanged;
+    Vec3 cachedBoxVectors[3];
+    Vec3 influenceBoxVectors[3];
+    CUfunction computeParamsKernel, computeExclusionParamsKernel, reduceSelfEnergiesKernel;
     CUfunction ewaldSumsKernel;
     CUfunction ewaldForcesKernel;
+    CUfunction ewaldEnergyKernel;
     CUfunction pmeGridIndexKernel;
     CUfunction pmeDispersionGridIndexKernel;
     CUfunction pmeSpreadChargeKernel;
@@ -141,32 +391,109 @@ private:
     CUfunction pmeEvalDispersionEnergyKernel;
     CUfunction pmeConvolutionKernel;
     CUfunction pmeDispersionConvolutionKernel;
+    CUfunction pmeConvolutionEnergyKernel;
+    CUfunction pmeDispersionConvolutionEnergyKernel;
+    CUfunction pmeInfluenceFunctionKernel;
+    CUfunction pmeDispersionInfluenceFunctionKernel;
+    CUfunction pmeBSplinesKernel;
+    CUfunction pmeDispersionBSplinesKernel;
     CUfunction pmeInterpolateForceKernel;
     CUfunction pmeInterpolateDispersionForceKernel;
+    CUfunction smallAtomFactorsKernel;
+    CUfunction smallStructureFactorsKernel;
+    CUfunction combinePotentialsKernel;
+    CUfunction smallInterpolateForceKernel;
+    CUfunction updatePositionCacheKernel;
     AddEnergyPostComputation* addEnergy;
+    PositionStager* positionStager;
+    CudaStageTimer* stageTimer;
+    ReportSliceEnergiesPostComputation* reportSliceEnergies;
     std::vector<std::pair<int, int> > exceptionAtoms;
+    std::vector<int> sortedExceptions, nonExcludedExceptions, stagedExceptions;
     CudaArray exceptionPairs;
     CudaArray exceptionSlices;
     std::vector<std::string> paramNames;
+    std::string fftCacheDir, tunedConfiguration;
     std::vector<double> paramValues;
     double ewaldSelfEnergy, alpha, dispersionAlpha;
-    int interpolateForceThreads;
-    int gridSizeX, gridSizeY, gridSizeZ;
+    int interpolateForceThreads, vkfftRegisterBoost;
+    int gridSizeX, gridSizeY, gridSizeZ, pmeOrder;
     int dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ;
-    bool hasCoulomb, hasLJ, usePmeStream, useCudaFFT, doLJPME, usePosqCharges, recomputeParams, hasOffsets;
+    bool hasCoulomb, hasLJ, usePmeStream, useCudaFFT, doLJPME, usePosqCharges, recomputeParams, hasOffsets, hasSelfEnergyOffsets;
+    bool shareAtomGridIndex, computeCoulombRecip, computeDispersionRecip, usePmeGraphs, useInfluenceFunction, useCachedBSplines;
+    bool balanceLoads, evaluationTimed;
+    std::atomic<double> lastEvaluationTime;
+    CUevent evaluationStartEvent, evaluationEndEvent;
+    CudaArray exceptionRange, exclusionRange;
+    int numHeldExceptions, numHeldExclusions;
+    int2 exceptionRangeVec, exclusionRangeVec;
+    double directShareStart, directShareEnd;
+    bool directShareChanged;
     NonbondedMethod nonbondedMethod;
-    static const int PmeOrder = 5;
+    static const int MaxPmeOrder = 8;
+    static const int SpreadBrickSize = 8;
 
-    int numSubsets, numSlices;
-    bool hasDerivatives;
-    vector<int> subsetsVec;
+    int numSubsets, numSlices, numEffectiveSlices;
+    vector<int> effectiveSlices;
+    bool useTiledEnergy;
+    bool hasDerivatives, computeDerivatives, useDerivativesOnDemand;
+    long long pmeGridMemorySavings;
+    bool useSliceForces, hasSliceForces;
+    CudaArray sliceForces;
+    bool useSliceEnergies, hasSliceEnergies, sliceEnergiesIncludeReciprocal;
+    CudaArray sliceEnergies, sliceEnergySums;
+    CUfunction sumSliceEnergiesKernel;
+    std::vector<double> hostSliceEnergies, lastSliceLambdas;
+    SlicedDispersionCorrection* dispersionCorrection;
+    bool useEnergyCache, energyCacheValid;
+    bool useSliceForceGroups;
+    int includedGroups, reciprocalGroupsMask, maskedLambdasGroups;
+    vector<int> sliceDirectGroups, sliceReciprocalGroups;
+    ThreadPool threads;
+    vector<int> subsetsVec, stagedSubsetsVec, allExceptionAtoms;
+    vector<float4> baseParticleParamVec, baseExceptionParamsVec, stagedParticleParamVec, stagedExceptionParamsVec;
+    vector<double> allExceptionParams;
     vector<double> dispersionCoefficients;
     vector<double2> sliceLambdasVec, subsetSelfEnergy;
     vector<ScalingParameterInfo> sliceScalingParams;
+    vector<string> scalingParamNames;
+    vector<double> scalingParamValues;
+    vector<pair<int, int> > sliceParamIndices;
+    void* pinnedLambdas;
+    void* pinnedMaskedLambdas;
+    CUevent lambdasUploadEvent, maskedLambdasUploadEvent;
     CudaArray subsets;
     CudaArray sliceLambdas;
+    CudaArray maskedSliceLambdas;
+    CudaArray* reciprocalSliceLambdas;
+    bool useSmallSubsets;
+    int numGridSlots;
+    vector<int> subsetSlots, pmeSlotsVec;
+    vector<char> hasChargeOffset, chargedParticles;
+    CudaArray pmeSlots;
+    CudaArray* pmeSubsets;
+    CudaArray smallAtoms;
+    CudaArray smallSlotStart;
+    CudaArray smallAtomFactors;
+    ProtocolWorkPostComputation* protocolWork;
+    CudaArray lambdaSchedule;
+    vector<int> scheduleColumns;
+    vector<double> scheduleValues;
+    int numScheduledParams, numScheduleSteps;
+    long long scheduleStartStep, lastWorkStep;
+    bool lambdaScheduleStale;
+    CpuPmePostComputation* cpuPme;
+    vector<pair<future<CUmodule>, function<void(CUmodule)> > > pendingModules;
 
     string getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ);
+    /**
+     * Get the condition that selects the slices whose direct space interactions belong to a force group.
+     */
+    string getSliceGroupCondition(int group);
+    /**
+     * Get whether the reciprocal space part of a slice is included in the current evaluation.
+     */
+    bool isReciprocalSliceIncluded(int slice) const;
 
     vector<float2> double2Tofloat2(vector<double2> input) {
         vector<float2> output(input.size());
@@ -52,6 +52,14 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Move some particles to other subsets without copying any other parameter.
+     *
+     * @param context    the context in which to move the particles
+     * @param force      the SlicedNonbondedForce, which already holds the new subsets
+     * @param particles  the indices of the moved particles
+     */
+    void reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles);
     /**
      * Get the parameters being used for PME.
      *
@@ -70,10 +78,91 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the configurations found by PME grid tuning and FFT library selection on each device, one
+     * per line, or an empty string if nothing was tuned.
+     */
+    std::string getTunedConfiguration() const;
+    /**
+     * Get the name of the FFT library used for the reciprocal space sums, or an empty string if
+     * no FFTs are performed.
+     */
+    std::string getFFTBackendName() const;
+    /**
+     * Get the total time taken by each stage of the calculation, in seconds, if stage profiling is enabled.
+     */
+    std::map<std::string, double> getStageTimings() const;
+    /**
+     * Get the number of bytes of device memory saved by storing the PME grids in compact form.
+     */
+    long long getPMEGridMemorySavings() const;
+    /**
+     * Get the number of bytes of device memory taken by each array allocated by this kernel.
+     */
+    std::map<std::string, long long> getMemoryUsage() const;
+    /**
+     * Get the forces that a slice contributed to the last evaluation that computed forces, summed
+     * over all devices.
+     *
+     * @param slice   the index of the slice
+     * @param forces  on exit, the force on each particle due to the slice
+     * @return false if no evaluation has computed forces yet
+     */
+    bool getSliceForces(int slice, std::vector<Vec3>& forces);
+    /**
+     * Get the Coulomb and Lennard-Jones energies of every slice in the last evaluation, summed over all
+     * devices.
+     *
+     * @param energies  on exit, the Coulomb and Lennard-Jones energies of each slice
+     * @param lambdas   on exit, the Coulomb and Lennard-Jones scaling factors applied to each slice
+     * @return false if the last evaluation did not compute the energy
+     */
+    bool getSliceEnergies(std::vector<double>& energies, std::vector<double>& lambdas);
+    /**
+     * Set the values that the scaling parameters take at each step of a nonequilibrium protocol.
+     *
+     * @param context     the context in which the protocol is run
+     * @param parameters  the names of the scheduled scaling parameters, or an empty vector to remove
+     *                    the schedule
+     * @param schedule    the values of the scheduled parameters at each step
+     */
+    void setScalingParameterSchedule(ContextImpl& context, const std::vector<std::string>& parameters, const std::vector<std::vector<double> >& schedule);
+    /**
+     * Get the work accumulated since the schedule was set, summed over all devices.
+     */
+    double getProtocolWork();
+    /**
+     * Set the force groups included in the next evaluation.
+     *
+     * @param groups  a bit mask of the force groups to include
+     */
+    void setIncludedForceGroups(int groups);
+    /**
+     * Start copying the positions of a frame to every device.
+     *
+     * @param context    the context for which the positions are staged
+     * @param positions  the positions of all particles, stored as x, y, and z for each particle
+     */
+    void stagePositions(ContextImpl& context, const double* positions);
+    /**
+     * Make the positions staged by the last call to stagePositions() the positions of the context
+     * on every device.
+     *
+     * @param context    the context whose positions are replaced
+     */
+    void applyStagedPositions(ContextImpl& context);
 private:
+    /**
+     * Move a small part of the exceptions and exclusion corrections from the device whose last
+     * evaluation took longest to the one that took least, if they differ by more than a tolerance.
+     * Once OpenMM has stopped balancing the direct space tiles, a small part of them is moved as well.
+     */
+    void rebalanceLoads();
     class Task;
     CudaPlatform::PlatformData& data;
     std::vector<Kernel> kernels;
+    bool balanceLoads;
+    std::vector<double> loadShares, directShares;
 };
 
 } // namespace OpenMM
@@ -0,0 +1,92 @@
+#ifndef __OPENMM_CUDAPMEWORKSPACE_H__
+#define __OPENMM_CUDAPMEWORKSPACE_H__
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CudaFFT3D.h"
+#include "openmm/cuda/CudaArray.h"
+#include "openmm/cuda/CudaContext.h"
+#include "openmm/cuda/CudaSort.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+
+namespace NonbondedSlicing {
+
+/**
+ * This class holds the reciprocal space data structures of a SlicedNonbondedForce kernel: the
+ * grids, the b-spline moduli, the atom grid indices with their sort, the FFT plan, and the PME
+ * stream.  Kernels of the same context whose grids are identical share a single workspace, which
+ * saves device memory and FFT plan setup, and lets a kernel reuse the atom grid indices computed
+ * by another one in the same force evaluation.
+ *
+ * The arrays are left uninitialized when a workspace is created.  The first kernel to use it is
+ * responsible for initializing them, and can tell whether this is needed with isInitialized().
+ */
+
+class CudaPmeWorkspace {
+public:
+    CudaPmeWorkspace(CudaContext& context);
+    ~CudaPmeWorkspace();
+    /**
+     * Get the workspace shared by all kernels of a context with the same key, creating it if needed.
+     *
+     * @param context  the context in which the kernels are executed
+     * @param key      a string that identifies the grid sizes and every other setting on which the
+     *                 data structures depend
+     */
+    static std::shared_ptr<CudaPmeWorkspace> get(CudaContext& context, const std::string& key);
+    /**
+     * Get whether the data structures have already been initialized by some kernel.
+     */
+    bool isInitialized() const {
+        return grid1.isInitialized();
+    }
+    /**
+     * Get the index of the current force evaluation.  This changes every time the context starts
+     * computing forces or energies.
+     */
+    int getEvaluation() const {
+        return *evaluation;
+    }
+    /**
+     * Get an integer that identifies a vector of particle subsets.  Kernels whose particles are
+     * distributed among subsets in the same way get the same identifier.
+     */
+    int getSubsetsId(const std::vector<int>& subsets);
+    CudaArray grid1, grid2;
+    CudaArray bsplineModuliX, bsplineModuliY, bsplineModuliZ;
+    CudaArray atomGridIndex;
+    CudaSort* sort;
+    CudaFFT3D* fft;
+    CUstream stream;
+    bool ownsStream;
+    /**
+     * The evaluation in which the grids were last used.
+     */
+    int gridEvaluation;
+    /**
+     * The evaluation in which the atom grid indices were last computed, and the identifier of the
+     * subsets they were computed for.
+     */
+    int atomGridIndexEvaluation, atomGridIndexSubsetsId;
+private:
+    class CountEvaluationsPreComputation;
+    CudaContext& context;
+    std::shared_ptr<int> evaluation;
+    std::vector<std::vector<int> > knownSubsets;
+};
+
+} // namespace NonbondedSlicing
+
+#endif // __OPENMM_CUDAPMEWORKSPACE_H__
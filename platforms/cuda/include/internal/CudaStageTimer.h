@@ -0,0 +1,74 @@
+#ifndef __OPENMM_CUDASTAGETIMER_H__
+#define __OPENMM_CUDASTAGETIMER_H__
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/cuda/CudaContext.h"
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace OpenMM;
+
+namespace NonbondedSlicing {
+
+/**
+ * This class measures the GPU time taken by the stages of a calculation.  Each stage is bracketed
+ * by a pair of events recorded in the stream doing the work, so that the measurements do not
+ * synchronize the host with the device.  Completed measurements are accumulated lazily, and
+ * events are reused once they have been read.
+ */
+
+class CudaStageTimer {
+public:
+    CudaStageTimer(CudaContext& context);
+    ~CudaStageTimer();
+    /**
+     * Start measuring a stage.
+     *
+     * @param stage   the name of the stage
+     * @param stream  the CUDA stream in which the stage is executed
+     */
+    void start(const std::string& stage, CUstream stream);
+    /**
+     * Finish measuring a stage started with the same name in the same stream.
+     *
+     * @param stage   the name of the stage
+     * @param stream  the CUDA stream in which the stage is executed
+     */
+    void stop(const std::string& stage, CUstream stream);
+    /**
+     * Add the completed measurements to the accumulated times.
+     *
+     * @param wait  if true, wait for all pending measurements to complete
+     */
+    void update(bool wait);
+    /**
+     * Get the total time taken by each stage so far, in seconds.
+     */
+    std::map<std::string, double> getTimings();
+private:
+    struct Measurement {
+        std::string stage;
+        CUevent start, end;
+    };
+    CUevent getEvent();
+    CudaContext& context;
+    std::vector<CUevent> allEvents, freeEvents;
+    std::map<std::string, CUevent> started;
+    std::deque<Measurement> pending;
+    std::map<std::string, double> timings;
+};
+
+} // namespace NonbondedSlicing
+
+#endif // __OPENMM_CUDASTAGETIMER_H__
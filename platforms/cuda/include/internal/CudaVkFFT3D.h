@@ -15,6 +15,7 @@
 #include "openmm/cuda/CudaArray.h"
 #define VKFFT_BACKEND 1 // CUDA
 #include "vkFFT.h"
+#include <string>
 
 using namespace OpenMM;
 
@@ -51,8 +52,10 @@ public:
      * @param realToComplex  if true, a real-to-complex transform will be done.  Otherwise, it is complex-to-complex.
      * @param in      the data to transform, ordered such that in[x*ysize*zsize + y*zsize + z] contains element (x, y, z)
      * @param out     on exit, this contains the transformed data
+     * @param registerBoost  the factor by which VkFFT may extend shared memory with the register file
+     * @param cacheDir  the directory in which compiled plans are cached, or an empty string to disable caching
      */
-    CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out);
+    CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out, int registerBoost=1, const std::string& cacheDir="");
     ~CudaVkFFT3D();
     /**
      * Perform a Fourier transform.
@@ -11,15 +11,23 @@
 #include "CudaNonbondedSlicingKernels.h"
 #include "CudaNonbondedSlicingKernelSources.h"
 #include "CommonNonbondedSlicingKernelSources.h"
+#include "CommonNonbondedSlicingKernels.h"
 #include "SlicedNonbondedForce.h"
 #include "internal/SlicedNonbondedForceImpl.h"
+#include "internal/SliceEnergyWriter.h"
 #include "openmm/NonbondedForce.h"
 #include "openmm/cuda/CudaForceInfo.h"
+#include "openmm/cuda/CudaPlatform.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
 #include "openmm/common/ContextSelector.h"
+#include "internal/ReferenceSlicedPME.h"
 #include <cstring>
 #include <map>
+#include <set>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <iostream>
 
 #define CHECK_RESULT(result, prefix) \
@@ -74,10 +82,10 @@ private:
 
 class CudaCalcSlicedNonbondedForceKernel::SyncStreamPreComputation : public CudaContext::ForcePreComputation {
 public:
-    SyncStreamPreComputation(CudaContext& cu, CUstream stream, CUevent event, int forceGroup) : cu(cu), stream(stream), event(event), forceGroup(forceGroup) {
+    SyncStreamPreComputation(CudaContext& cu, CUstream stream, CUevent event, int forceGroups) : cu(cu), stream(stream), event(event), forceGroups(forceGroups) {
     }
     void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0) {
+        if ((groups&forceGroups) != 0) {
             cuEventRecord(event, cu.getCurrentStream());
             cuStreamWaitEvent(stream, event, 0);
         }
@@ -86,31 +94,42 @@ private:
     CudaContext& cu;
     CUstream stream;
     CUevent event;
-    int forceGroup;
+    int forceGroups;
 };
 
 class CudaCalcSlicedNonbondedForceKernel::SyncStreamPostComputation : public CudaContext::ForcePostComputation {
 public:
-    SyncStreamPostComputation(CudaContext& cu, CUevent event, int forceGroup) : cu(cu), event(event), forceGroup(forceGroup) {}
+    SyncStreamPostComputation(CudaContext& cu, CUevent event, int forceGroups) : cu(cu), event(event), forceGroups(forceGroups) {}
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0)
+        if ((groups&forceGroups) != 0)
             cuStreamWaitEvent(cu.getCurrentStream(), event, 0);
         return 0.0;
     }
 private:
     CudaContext& cu;
     CUevent event;
-    int forceGroup;
+    int forceGroups;
 };
 
 class CudaCalcSlicedNonbondedForceKernel::AddEnergyPostComputation : public CudaContext::ForcePostComputation {
 public:
-    AddEnergyPostComputation(CudaContext& cu, int forceGroup) : cu(cu), forceGroup(forceGroup), initialized(false) {
+    AddEnergyPostComputation(CudaContext& cu, int forceGroups, CudaStageTimer* stageTimer) : cu(cu), forceGroups(forceGroups), stageTimer(stageTimer), initialized(false), computeDerivatives(true) {
     }
-    void initialize(CudaArray& pmeEnergyBuffer, CudaArray& ljpmeEnergyBuffer, CudaArray& sliceLambdas, vector<ScalingParameterInfo> sliceScalingParams) {
-        int numSlices = sliceLambdas.getSize();
+    /**
+     * If the slices belong to different force groups, sliceForceGroups contains the reciprocal space
+     * force group of each slice, and the derivatives are only accumulated for the included slices.
+     * Otherwise, it is empty.
+     */
+    void initialize(CudaArray& pmeEnergyBuffer, CudaArray& ljpmeEnergyBuffer, CudaArray& sliceLambdas, vector<ScalingParameterInfo> sliceScalingParams, const vector<int>& effectiveSlices,
+                    const vector<int>& sliceForceGroups, bool useTiledEnergy) {
+        int numEffectiveSlices = *max_element(effectiveSlices.begin(), effectiveSlices.end())+1;
+        vector<int> representativeSlices(numEffectiveSlices, -1);
+        for (int slice = 0; slice < effectiveSlices.size(); slice++)
+            if (representativeSlices[effectiveSlices[slice]] == -1)
+                representativeSlices[effectiveSlices[slice]] = slice;
         bool doLJPME = ljpmeEnergyBuffer.isInitialized();
-        bufferSize = pmeEnergyBuffer.getSize()/numSlices;
+        bufferSize = pmeEnergyBuffer.getSize()/numEffectiveSlices;
+        workUnits = (useTiledEnergy ? bufferSize*numEffectiveSlices : bufferSize);
         set<string> requestedDerivs;
         for (ScalingParameterInfo info : sliceScalingParams) {
             if (info.hasDerivativeCoulomb)
@@ -119,27 +138,59 @@ public:
                 requestedDerivs.insert(info.nameLJ);
         }
         hasDerivatives = requestedDerivs.size() > 0;
+        bool useSliceForceGroups = (sliceForceGroups.size() > 0);
         stringstream code;
-        if (hasDerivatives) {
+        if (useTiledEnergy) {
+            // With many slices, look up the lambdas and derivative positions in tables instead.
+
+            representativeSliceArray.initialize<int>(cu, numEffectiveSlices, "representativeSlices");
+            representativeSliceArray.upload(representativeSlices);
+            if (hasDerivatives) {
+                const vector<string>& allDerivs = cu.getEnergyParamDerivNames();
+                vector<int2> indices(numEffectiveSlices, make_int2(-1, -1));
+                for (int slice = 0; slice < numEffectiveSlices; slice++) {
+                    ScalingParameterInfo info = sliceScalingParams[representativeSlices[slice]];
+                    if (requestedDerivs.find(info.nameCoulomb) != requestedDerivs.end())
+                        indices[slice].x = find(allDerivs.begin(), allDerivs.end(), info.nameCoulomb) - allDerivs.begin();
+                    if (doLJPME && requestedDerivs.find(info.nameLJ) != requestedDerivs.end())
+                        indices[slice].y = find(allDerivs.begin(), allDerivs.end(), info.nameLJ) - allDerivs.begin();
+                }
+                derivativeIndices.initialize<int2>(cu, numEffectiveSlices, "derivativeIndices");
+                derivativeIndices.upload(indices);
+            }
+            if (useSliceForceGroups) {
+                vector<int> groups(numEffectiveSlices);
+                for (int slice = 0; slice < numEffectiveSlices; slice++)
+                    groups[slice] = sliceForceGroups[representativeSlices[slice]];
+                effectiveSliceGroups.initialize<int>(cu, numEffectiveSlices, "effectiveSliceGroups");
+                effectiveSliceGroups.upload(groups);
+            }
+        }
+        else if (hasDerivatives) {
             const vector<string>& allDerivs = cu.getEnergyParamDerivNames();
             for (string param : requestedDerivs) {
                 int position = find(allDerivs.begin(), allDerivs.end(), param) - allDerivs.begin();
                 code<<"energyParamDerivs[index*"<<allDerivs.size()<<"+"<<position<<"] += ";
-                for (int slice = 0; slice < numSlices; slice++) {
-                    ScalingParameterInfo info = sliceScalingParams[slice];
+                for (int slice = 0; slice < numEffectiveSlices; slice++) {
+                    ScalingParameterInfo info = sliceScalingParams[representativeSlices[slice]];
+                    string included = (useSliceForceGroups ? "((groups>>"+cu.intToString(sliceForceGroups[representativeSlices[slice]])+")&1)*" : "");
                     if (info.nameCoulomb == param)
-                        code<<"+clEnergy["<<slice<<"]";
+                        code<<"+"<<included<<"clEnergy["<<slice<<"]";
                     if (doLJPME && info.nameLJ == param)
-                        code<<"+ljEnergy["<<slice<<"]";
+                        code<<"+"<<included<<"ljEnergy["<<slice<<"]";
                 }
                 code<<";"<<endl;
             }
         }
         map<string, string> replacements, defines;
-        replacements["NUM_SLICES"] = cu.intToString(numSlices);
+        replacements["NUM_EFFECTIVE_SLICES"] = cu.intToString(numEffectiveSlices);
+        replacements["REPRESENTATIVE_SLICES"] = toInitializerList(representativeSlices);
         replacements["USE_LJPME"] = doLJPME ? "1" : "0";
         replacements["HAS_DERIVATIVES"] = hasDerivatives ? "1" : "0";
         replacements["ADD_DERIVATIVES"] = code.str();
+        replacements["NUM_DERIVATIVES"] = cu.intToString(cu.getEnergyParamDerivNames().size());
+        replacements["USE_TILED_ENERGY"] = useTiledEnergy ? "1" : "0";
+        replacements["USE_SLICE_FORCE_GROUPS"] = useSliceForceGroups ? "1" : "0";
         string source = cu.replaceStrings(CommonNonbondedSlicingKernelSources::pmeAddEnergy, replacements);
         CUmodule module = cu.createModule(source, defines);
         addEnergyKernel = cu.getKernel(module, "addEnergy");
@@ -152,48 +203,323 @@ public:
             arguments.push_back(&ljpmeEnergyBuffer.getDevicePointer());
         arguments.push_back(&sliceLambdas.getDevicePointer());
         arguments.push_back(&bufferSize);
+        if (useTiledEnergy) {
+            arguments.push_back(&representativeSliceArray.getDevicePointer());
+            if (hasDerivatives)
+                arguments.push_back(&derivativeIndices.getDevicePointer());
+        }
+        if (useSliceForceGroups) {
+            arguments.push_back(&includedGroups);
+            if (useTiledEnergy)
+                arguments.push_back(&effectiveSliceGroups.getDevicePointer());
+        }
         initialized = true;
     }
     bool isInitialized() {
         return initialized;
     }
+    /**
+     * Set whether the derivatives must be accumulated in the current evaluation, even if the energy is not
+     * requested.  This is always the case unless the derivatives are computed on demand.
+     */
+    void setComputeDerivatives(bool compute) {
+        computeDerivatives = compute;
+    }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((includeEnergy || hasDerivatives) && (groups&(1<<forceGroup)) != 0)
-            cu.executeKernel(addEnergyKernel, &arguments[0], bufferSize);
+        if ((includeEnergy || (hasDerivatives && computeDerivatives)) && (groups&forceGroups) != 0) {
+            includedGroups = groups;
+            if (stageTimer != NULL)
+                stageTimer->start("addEnergy", cu.getCurrentStream());
+            cu.executeKernel(addEnergyKernel, &arguments[0], workUnits);
+            if (stageTimer != NULL)
+                stageTimer->stop("addEnergy", cu.getCurrentStream());
+        }
         return 0.0;
     }
 private:
     CudaContext& cu;
+    CudaStageTimer* stageTimer;
     CUfunction addEnergyKernel;
+    CudaArray representativeSliceArray;
+    CudaArray derivativeIndices;
+    CudaArray effectiveSliceGroups;
     vector<void*> arguments;
-    int forceGroup;
-    int bufferSize;
-    bool initialized;
+    int forceGroups, includedGroups;
+    int bufferSize, workUnits;
+    bool initialized, computeDerivatives;
     bool hasDerivatives;
 };
 
+class CudaCalcSlicedNonbondedForceKernel::ReportSliceEnergiesPostComputation : public CudaContext::ForcePostComputation {
+public:
+    ReportSliceEnergiesPostComputation(CudaContext& cu, const SlicedNonbondedForce& force, int forceGroup) :
+            cu(cu), forceGroup(forceGroup), interval(force.getSliceEnergyReportInterval()), pendingStep(-1), initialized(false), pinnedBuffer(NULL) {
+        names = SliceEnergyWriter::getReportedNames(force);
+        writer = new SliceEnergyWriter(names, force.getSliceEnergyReportFile(), force.getSliceEnergyCallback());
+    }
+    ~ReportSliceEnergiesPostComputation() {
+        // Deleting the writer delivers all pending reports, which may still need the events and the pinned memory.
+
+        delete writer;
+        ContextSelector selector(cu);
+        if (initialized) {
+            for (CUevent event : copiedEvents)
+                cuEventDestroy(event);
+            cuEventDestroy(reducedEvent);
+            cuStreamDestroy(reportStream);
+            cuMemFreeHost(pinnedBuffer);
+        }
+    }
+    void setStep(long long step) {
+        if (writer->isDue(step, interval))
+            pendingStep = step;
+    }
+    bool isPending() const {
+        return pendingStep >= 0;
+    }
+    void countMemoryUsage(map<string, long long>& usage) const {
+        addMemoryUsage(usage, reportedDerivs);
+        addMemoryUsage(usage, reportBuffer);
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if (pendingStep < 0 || (groups&(1<<forceGroup)) == 0)
+            return 0.0;
+        if (!initialized)
+            initialize();
+
+        // Contributions computed on the host are captured now, since the workspace is reset at every evaluation.
+
+        int numReported = names.size();
+        map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+        vector<double> hostValues(numReported, 0.0);
+        for (int i = 0; i < numReported; i++)
+            if (energyParamDerivs.find(names[i]) != energyParamDerivs.end())
+                hostValues[i] = energyParamDerivs[names[i]];
+
+        // Sum up the device contributions into a free slot and copy them to pinned memory on a separate stream.
+
+        writer->waitForCapacity();
+        int slot = writer->getNumSubmitted()%writer->getCapacity();
+        int numThreads = cu.getEnergyParamDerivBuffer().getSize()/cu.getEnergyParamDerivNames().size();
+        void* args[] = {&cu.getEnergyParamDerivBuffer().getDevicePointer(), &numThreads, &reportedDerivs.getDevicePointer(),
+                        &reportBuffer.getDevicePointer(), &slot};
+        cu.executeKernel(reduceKernel, args, numReported*ReportBlockSize, ReportBlockSize);
+        cuEventRecord(reducedEvent, cu.getCurrentStream());
+        cuStreamWaitEvent(reportStream, reducedEvent, 0);
+        int elementSize = reportBuffer.getElementSize();
+        char* pinned = (char*) pinnedBuffer+slot*numReported*elementSize;
+        cuMemcpyDtoHAsync(pinned, reportBuffer.getDevicePointer()+slot*numReported*elementSize, numReported*elementSize, reportStream);
+        cuEventRecord(copiedEvents[slot], reportStream);
+        CUevent event = copiedEvents[slot];
+        CudaContext& context = cu;
+        writer->submit(pendingStep, [&context, event, pinned, elementSize, hostValues] () {
+            ContextSelector selector(context);
+            cuEventSynchronize(event);
+            vector<double> values(hostValues);
+            for (int i = 0; i < values.size(); i++)
+                values[i] += (elementSize == sizeof(double) ? ((double*) pinned)[i] : ((float*) pinned)[i]);
+            return values;
+        });
+        pendingStep = -1;
+        return 0.0;
+    }
+private:
+    void initialize() {
+        // This is deferred to the first report, when all energy parameter derivatives have been registered.
+
+        const vector<string>& allDerivs = cu.getEnergyParamDerivNames();
+        vector<int> indices;
+        for (string name : names) {
+            int position = find(allDerivs.begin(), allDerivs.end(), name)-allDerivs.begin();
+            if (position == allDerivs.size())
+                throw OpenMMException("SlicedNonbondedForce: unknown energy parameter derivative "+name);
+            indices.push_back(position);
+        }
+        int numReported = names.size();
+        int capacity = writer->getCapacity();
+        int elementSize = cu.getEnergyParamDerivBuffer().getElementSize();
+        reportedDerivs.initialize<int>(cu, numReported, "reportedDerivs");
+        reportedDerivs.upload(indices);
+        reportBuffer.initialize(cu, capacity*numReported, elementSize, "reportBuffer");
+        map<string, string> defines;
+        defines["NUM_REPORTED"] = cu.intToString(numReported);
+        defines["NUM_DERIVATIVES"] = cu.intToString(allDerivs.size());
+        defines["REPORT_BLOCK_SIZE"] = cu.intToString(ReportBlockSize);
+        CUmodule module = cu.createModule(CommonNonbondedSlicingKernelSources::sliceEnergyReport, defines);
+        reduceKernel = cu.getKernel(module, "reduceReportedDerivatives");
+        CHECK_RESULT(cuMemHostAlloc(&pinnedBuffer, capacity*numReported*elementSize, CU_MEMHOSTALLOC_PORTABLE), "Error allocating pinned memory for SlicedNonbondedForce");
+        CHECK_RESULT(cuStreamCreate(&reportStream, CU_STREAM_NON_BLOCKING), "Error creating stream for SlicedNonbondedForce");
+        CHECK_RESULT(cuEventCreate(&reducedEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+        copiedEvents.resize(capacity);
+        for (CUevent& event : copiedEvents)
+            CHECK_RESULT(cuEventCreate(&event, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+        initialized = true;
+    }
+    CudaContext& cu;
+    SliceEnergyWriter* writer;
+    vector<string> names;
+    int forceGroup, interval;
+    long long pendingStep;
+    bool initialized;
+    CUfunction reduceKernel;
+    CudaArray reportedDerivs;
+    CudaArray reportBuffer;
+    void* pinnedBuffer;
+    CUstream reportStream;
+    CUevent reducedEvent;
+    vector<CUevent> copiedEvents;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::ProtocolWorkPostComputation : public CudaContext::ForcePostComputation {
+public:
+    ProtocolWorkPostComputation(CudaContext& cu, int forceGroup) : cu(cu), forceGroup(forceGroup), numScheduled(0), numSteps(0), pendingStep(-1), initialized(false) {
+    }
+    /**
+     * Start accumulating the work of a new schedule.  The changes of the scheduled parameters from
+     * each step to the next are stored in consecutive rows of parameterChanges.
+     */
+    void setSchedule(const vector<string>& names, const vector<double>& parameterChanges) {
+        numScheduled = names.size();
+        numSteps = (numScheduled == 0 ? 0 : parameterChanges.size()/numScheduled);
+        pendingStep = -1;
+        hostWork.assign(numSteps, 0.0);
+        if (numSteps == 0)
+            return;
+        if (!initialized)
+            initialize();
+        const vector<string>& allDerivs = cu.getEnergyParamDerivNames();
+        vector<int> indices;
+        for (string name : names) {
+            int position = find(allDerivs.begin(), allDerivs.end(), name)-allDerivs.begin();
+            if (position == allDerivs.size())
+                throw OpenMMException("SlicedNonbondedForce: unknown energy parameter derivative "+name);
+            indices.push_back(position);
+        }
+        resizeArray<int>(scheduledDerivs, numScheduled, "scheduledDerivs");
+        scheduledDerivs.upload(indices);
+        this->names = names;
+        hostChanges = parameterChanges;
+        int elementSize = cu.getEnergyParamDerivBuffer().getElementSize();
+        if (elementSize == sizeof(double)) {
+            resizeArray<double>(changes, parameterChanges.size(), "parameterChanges");
+            resizeArray<double>(stepWork, numSteps, "stepWork");
+            changes.upload(parameterChanges);
+        }
+        else {
+            resizeArray<float>(changes, parameterChanges.size(), "parameterChanges");
+            resizeArray<float>(stepWork, numSteps, "stepWork");
+            changes.upload(vector<float>(parameterChanges.begin(), parameterChanges.end()));
+        }
+        cu.clearBuffer(stepWork);
+    }
+    /**
+     * Request the work of a step to be computed at the end of the current evaluation.
+     */
+    void setStep(int step) {
+        pendingStep = step;
+    }
+    bool isPending() const {
+        return pendingStep >= 0;
+    }
+    void countMemoryUsage(map<string, long long>& usage) const {
+        addMemoryUsage(usage, scheduledDerivs);
+        addMemoryUsage(usage, changes);
+        addMemoryUsage(usage, stepWork);
+    }
+    /**
+     * Get the total work of all steps computed so far.  This waits for the device to finish.
+     */
+    double getWork() {
+        double work = 0.0;
+        for (double value : hostWork)
+            work += value;
+        if (numSteps == 0)
+            return work;
+        if (stepWork.getElementSize() == sizeof(double)) {
+            vector<double> values;
+            stepWork.download(values);
+            for (double value : values)
+                work += value;
+        }
+        else {
+            vector<float> values;
+            stepWork.download(values);
+            for (float value : values)
+                work += value;
+        }
+        return work;
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if (pendingStep < 0 || (groups&(1<<forceGroup)) == 0)
+            return 0.0;
+
+        // Contributions computed on the host are taken now, since the workspace is reset at every evaluation.
+
+        map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+        hostWork[pendingStep] = 0.0;
+        for (int i = 0; i < numScheduled; i++)
+            if (energyParamDerivs.find(names[i]) != energyParamDerivs.end())
+                hostWork[pendingStep] += energyParamDerivs[names[i]]*hostChanges[numScheduled*pendingStep+i];
+        int numThreads = cu.getEnergyParamDerivBuffer().getSize()/cu.getEnergyParamDerivNames().size();
+        void* args[] = {&cu.getEnergyParamDerivBuffer().getDevicePointer(), &numThreads, &numScheduled, &scheduledDerivs.getDevicePointer(),
+                        &changes.getDevicePointer(), &pendingStep, &stepWork.getDevicePointer()};
+        cu.executeKernel(stepWorkKernel, args, ReportBlockSize, ReportBlockSize);
+        pendingStep = -1;
+        return 0.0;
+    }
+private:
+    void initialize() {
+        map<string, string> defines;
+        defines["NUM_DERIVATIVES"] = cu.intToString(cu.getEnergyParamDerivNames().size());
+        defines["REPORT_BLOCK_SIZE"] = cu.intToString(ReportBlockSize);
+        CUmodule module = cu.createModule(CommonNonbondedSlicingKernelSources::protocolWork, defines);
+        stepWorkKernel = cu.getKernel(module, "computeStepWork");
+        initialized = true;
+    }
+    template <class T>
+    void resizeArray(CudaArray& array, int size, const string& name) {
+        if (!array.isInitialized())
+            array.initialize<T>(cu, size, name);
+        else if (array.getSize() != size)
+            array.resize(size);
+    }
+    CudaContext& cu;
+    vector<string> names;
+    vector<double> hostChanges, hostWork;
+    int forceGroup, numScheduled, numSteps, pendingStep;
+    bool initialized;
+    CUfunction stepWorkKernel;
+    CudaArray scheduledDerivs;
+    CudaArray changes;
+    CudaArray stepWork;
+};
+
 class CudaCalcSlicedNonbondedForceKernel::DispersionCorrectionPostComputation : public CudaContext::ForcePostComputation {
 public:
-    DispersionCorrectionPostComputation(CudaContext& cu, vector<double>& coefficients, vector<double2>& sliceLambdas, vector<ScalingParameterInfo>& sliceScalingParams, int forceGroup) :
-                                        cu(cu), coefficients(coefficients), sliceLambdas(sliceLambdas), sliceScalingParams(sliceScalingParams), forceGroup(forceGroup) {
+    DispersionCorrectionPostComputation(CudaContext& cu, vector<double>& coefficients, vector<double2>& sliceLambdas, vector<ScalingParameterInfo>& sliceScalingParams, const vector<int>& sliceForceGroups) :
+                                        cu(cu), coefficients(coefficients), sliceLambdas(sliceLambdas), sliceScalingParams(sliceScalingParams), sliceForceGroups(sliceForceGroups) {
         numSlices = coefficients.size();
         hasDerivatives = false;
         for (auto info : sliceScalingParams)
             hasDerivatives = hasDerivatives || info.hasDerivativeLJ;
+        forceGroups = 0;
+        for (int group : sliceForceGroups)
+            forceGroups |= 1<<group;
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
         double energy = 0.0;
-        if ((includeEnergy || hasDerivatives) && (groups&(1<<forceGroup)) != 0) {
+        if ((includeEnergy || hasDerivatives) && (groups&forceGroups) != 0) {
             double4 boxSize = cu.getPeriodicBoxSize();
             double volume = boxSize.x*boxSize.y*boxSize.z;
             if (includeEnergy)
                 for (int slice = 0; slice < numSlices; slice++)
-                    energy += sliceLambdas[slice].y*coefficients[slice]/volume;
+                    if ((groups&(1<<sliceForceGroups[slice])) != 0)
+                        energy += sliceLambdas[slice].y*coefficients[slice]/volume;
             if (hasDerivatives) {
                 map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
                 for (int slice = 0; slice < numSlices; slice++) {
                     ScalingParameterInfo info = sliceScalingParams[slice];
-                    if (info.hasDerivativeLJ)
+                    if (info.hasDerivativeLJ && (groups&(1<<sliceForceGroups[slice])) != 0)
                         energyParamDerivs[info.nameLJ] += coefficients[slice]/volume;
                 }
             }
@@ -205,26 +531,324 @@ private:
     vector<double>& coefficients;
     vector<double2>& sliceLambdas;
     vector<ScalingParameterInfo>& sliceScalingParams;
-    int forceGroup;
+    vector<int> sliceForceGroups;
+    int forceGroups;
     int numSlices;
     bool hasDerivatives;
 };
 
+class CudaCalcSlicedNonbondedForceKernel::EvaluationTimerPreComputation : public CudaContext::ForcePreComputation {
+public:
+    EvaluationTimerPreComputation(CudaCalcSlicedNonbondedForceKernel& owner) : owner(owner) {
+    }
+    void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        // Read the time of the previous evaluation if the device has already finished it, without waiting.
+
+        float time;
+        if (owner.evaluationTimed && cuEventQuery(owner.evaluationEndEvent) == CUDA_SUCCESS &&
+                cuEventElapsedTime(&time, owner.evaluationStartEvent, owner.evaluationEndEvent) == CUDA_SUCCESS)
+            owner.lastEvaluationTime = time;
+
+        // Apply a new share of the direct space tiles before the neighbor list is built.
+
+        if (owner.directShareChanged) {
+            owner.cu.getNonbondedUtilities().setAtomBlockRange(owner.directShareStart, owner.directShareEnd);
+            owner.directShareChanged = false;
+        }
+        cuEventRecord(owner.evaluationStartEvent, owner.cu.getCurrentStream());
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::EvaluationTimerPostComputation : public CudaContext::ForcePostComputation {
+public:
+    EvaluationTimerPostComputation(CudaCalcSlicedNonbondedForceKernel& owner) : owner(owner) {
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        cuEventRecord(owner.evaluationEndEvent, owner.cu.getCurrentStream());
+        owner.evaluationTimed = true;
+        return 0.0;
+    }
+private:
+    CudaCalcSlicedNonbondedForceKernel& owner;
+};
+
+/**
+ * This class computes the Coulomb reciprocal space sums on the host while the device works on other
+ * parts of the calculation.  The positions and charges are downloaded into pinned memory when the
+ * force is executed, a worker thread runs the threaded host PME as soon as they arrive, and the
+ * forces, energies, and derivatives are added to those of the device once all kernels are queued.
+ */
+class CudaCalcSlicedNonbondedForceKernel::CpuPmePostComputation : public CudaContext::ForcePostComputation {
+public:
+    CpuPmePostComputation(CudaContext& cu, ThreadPool& threads, CudaArray& charges, bool usePosqCharges, int numSubsets, double alpha, const int gridSize[3],
+                          int pmeOrder, bool optimalInfluence, vector<ScalingParameterInfo>& sliceScalingParams) : cu(cu), threads(threads), charges(charges), usePosqCharges(usePosqCharges),
+                          sliceScalingParams(sliceScalingParams), pinnedPositions(NULL), pinnedCharges(NULL), pinnedForces(NULL) {
+        numAtoms = cu.getNumAtoms();
+        numSlices = sliceScalingParams.size();
+        hasDerivatives = false;
+        for (auto info : sliceScalingParams)
+            hasDerivatives = hasDerivatives || info.hasDerivativeCoulomb;
+        pme_init(&pme, alpha, numAtoms, numSubsets, gridSize, pmeOrder, 1);
+        pme_set_threads(pme, &threads);
+        pme_set_optimal_influence(pme, optimalInfluence);
+        int elementSize = cu.getPosq().getElementSize();
+        CHECK_RESULT(cuMemHostAlloc(&pinnedPositions, numAtoms*elementSize, CU_MEMHOSTALLOC_PORTABLE), "Error allocating pinned memory for the CPU PME");
+        CHECK_RESULT(cuMemHostAlloc(&pinnedForces, numAtoms*elementSize, CU_MEMHOSTALLOC_PORTABLE), "Error allocating pinned memory for the CPU PME");
+        if (!usePosqCharges)
+            CHECK_RESULT(cuMemHostAlloc(&pinnedCharges, numAtoms*(cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float)), CU_MEMHOSTALLOC_PORTABLE), "Error allocating pinned memory for the CPU PME");
+        CHECK_RESULT(cuEventCreate(&downloadEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+        cpuForces.initialize(cu, numAtoms, elementSize, "cpuPmeForces");
+        map<string, string> defines;
+        defines["NUM_ATOMS"] = cu.intToString(numAtoms);
+        defines["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
+        string realToFixedPoint = Platform::getOpenMMVersion()[0] == '7' ? CudaNonbondedSlicingKernelSources::realToFixedPoint : "";
+        CUmodule module = cu.createModule(realToFixedPoint+CommonNonbondedSlicingKernelSources::cpuPme, defines);
+        addForcesKernel = cu.getKernel(module, "addCpuPmeForces");
+    }
+    ~CpuPmePostComputation() {
+        ContextSelector selector(cu);
+        if (task.valid())
+            task.wait();
+        pme_destroy(pme);
+        cuMemFreeHost(pinnedPositions);
+        cuMemFreeHost(pinnedForces);
+        if (pinnedCharges != NULL)
+            cuMemFreeHost(pinnedCharges);
+        cuEventDestroy(downloadEvent);
+    }
+    /**
+     * Queue the downloads and start the host calculation, which waits for them on its own thread.
+     * The slices of the lambdas that are not included in the current evaluation must be zero.
+     */
+    void beginComputation(const vector<int>& subsets, const vector<double2>& lambdas, const vector<bool>& included, bool includeForces) {
+        CudaArray& posq = cu.getPosq();
+        cuMemcpyDtoHAsync(pinnedPositions, posq.getDevicePointer(), numAtoms*posq.getElementSize(), cu.getCurrentStream());
+        if (!usePosqCharges)
+            cuMemcpyDtoHAsync(pinnedCharges, charges.getDevicePointer(), numAtoms*charges.getElementSize(), cu.getCurrentStream());
+        cuEventRecord(downloadEvent, cu.getCurrentStream());
+        sliceLambdas.resize(numSlices);
+        for (int slice = 0; slice < numSlices; slice++)
+            sliceLambdas[slice] = {lambdas[slice].x, lambdas[slice].y};
+        includedSlices = included;
+        atomSubsets = subsets;
+        Vec3 boxVectors[3];
+        cu.getPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
+        task = async(launch::async, [this, boxVectors, includeForces] () {
+            {
+                ContextSelector selector(cu);
+                cuEventSynchronize(downloadEvent);
+            }
+            if (cu.getUseDoublePrecision())
+                execute<double4, double>(boxVectors, includeForces);
+            else
+                execute<float4, float>(boxVectors, includeForces);
+        });
+        pendingForces = includeForces;
+    }
+    void countMemoryUsage(map<string, long long>& usage) const {
+        addMemoryUsage(usage, cpuForces);
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if (!task.valid())
+            return 0.0;
+        task.get();
+        if (pendingForces) {
+            cpuForces.upload(pinnedForces, false);
+            void* args[] = {&cpuForces.getDevicePointer(), &cu.getForce().getDevicePointer()};
+            cu.executeKernel(addForcesKernel, args, numAtoms);
+        }
+        double energy = 0.0;
+        if (includeEnergy)
+            for (int slice = 0; slice < numSlices; slice++)
+                energy += sliceLambdas[slice][0]*sliceEnergies[slice][0];
+        if (hasDerivatives) {
+            map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+            for (int slice = 0; slice < numSlices; slice++) {
+                ScalingParameterInfo info = sliceScalingParams[slice];
+                if (info.hasDerivativeCoulomb && includedSlices[slice])
+                    energyParamDerivs[info.nameCoulomb] += sliceEnergies[slice][0];
+            }
+        }
+        return energy;
+    }
+private:
+    template <class REAL4, class REAL>
+    void execute(const Vec3* boxVectors, bool includeForces) {
+        REAL4* posq = (REAL4*) pinnedPositions;
+        REAL* q = (REAL*) pinnedCharges;
+        positions.resize(numAtoms);
+        atomCharges.resize(numAtoms);
+        for (int i = 0; i < numAtoms; i++) {
+            positions[i] = Vec3(posq[i].x, posq[i].y, posq[i].z);
+            atomCharges[i] = (usePosqCharges ? posq[i].w : q[i]);
+        }
+        forces.assign(numAtoms, Vec3());
+        sliceEnergies.assign(numSlices, vector<double>(2, 0.0));
+        pme_exec(pme, positions, atomSubsets, sliceLambdas, forces, atomCharges, boxVectors, sliceEnergies, includeForces);
+        if (includeForces) {
+            REAL4* f = (REAL4*) pinnedForces;
+            for (int i = 0; i < numAtoms; i++) {
+                f[i].x = forces[i][0];
+                f[i].y = forces[i][1];
+                f[i].z = forces[i][2];
+                f[i].w = 0;
+            }
+        }
+    }
+    CudaContext& cu;
+    ThreadPool& threads;
+    CudaArray& charges;
+    bool usePosqCharges, hasDerivatives, pendingForces;
+    vector<ScalingParameterInfo>& sliceScalingParams;
+    int numAtoms, numSlices;
+    pme_t pme;
+    void* pinnedPositions;
+    void* pinnedCharges;
+    void* pinnedForces;
+    CUevent downloadEvent;
+    CudaArray cpuForces;
+    CUfunction addForcesKernel;
+    future<void> task;
+    vector<int> atomSubsets;
+    vector<bool> includedSlices;
+    vector<Vec3> positions, forces;
+    vector<double> atomCharges;
+    vector<vector<double> > sliceLambdas, sliceEnergies;
+};
+
+class CudaCalcSlicedNonbondedForceKernel::PositionStager {
+public:
+    PositionStager(CudaContext& cu) : cu(cu), numStaged(0) {
+        // Positions are staged in the precision of the integration, in the original order of the atoms.
+
+        int numAtoms = cu.getNumAtoms();
+        useDouble = (cu.getUseDoublePrecision() || cu.getUseMixedPrecision());
+        frameBytes = 3*numAtoms*(useDouble ? sizeof(double) : sizeof(float));
+        for (CudaArray& staged : stagedPositions)
+            staged.initialize(cu, 3*numAtoms, useDouble ? sizeof(double) : sizeof(float), "stagedPositions");
+        map<string, string> defines;
+        defines["NUM_ATOMS"] = cu.intToString(numAtoms);
+        if (cu.getUseMixedPrecision())
+            defines["USE_MIXED_PRECISION"] = "1";
+        CUmodule module = cu.createModule(CommonNonbondedSlicingKernelSources::stagedPositions, defines);
+        applyKernel = cu.getKernel(module, "applyStagedPositions");
+        CHECK_RESULT(cuMemHostAlloc(&pinnedBuffer, 2*frameBytes, CU_MEMHOSTALLOC_PORTABLE), "Error allocating pinned memory for SlicedNonbondedForce");
+        CHECK_RESULT(cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING), "Error creating stream for SlicedNonbondedForce");
+        for (int slot = 0; slot < 2; slot++) {
+            CHECK_RESULT(cuEventCreate(&uploadedEvents[slot], CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+            CHECK_RESULT(cuEventCreate(&appliedEvents[slot], CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+        }
+    }
+    ~PositionStager() {
+        cuStreamSynchronize(stream);
+        for (int slot = 0; slot < 2; slot++) {
+            cuEventDestroy(uploadedEvents[slot]);
+            cuEventDestroy(appliedEvents[slot]);
+        }
+        cuStreamDestroy(stream);
+        cuMemFreeHost(pinnedBuffer);
+    }
+    void countMemoryUsage(map<string, long long>& usage) const {
+        for (const CudaArray& staged : stagedPositions)
+            addMemoryUsage(usage, staged);
+    }
+    void stage(const double* positions) {
+        // The pinned memory of a slot can be overwritten once its last upload has finished, and the device
+        // array once the kernel that read it has, neither of which can still be running on the first use.
+
+        int slot = numStaged%2;
+        char* pinned = (char*) pinnedBuffer+slot*frameBytes;
+        cuEventSynchronize(uploadedEvents[slot]);
+        int numCoordinates = 3*cu.getNumAtoms();
+        if (useDouble)
+            memcpy(pinned, positions, frameBytes);
+        else
+            for (int i = 0; i < numCoordinates; i++)
+                ((float*) pinned)[i] = (float) positions[i];
+        cuStreamWaitEvent(stream, appliedEvents[slot], 0);
+        CHECK_RESULT(cuMemcpyHtoDAsync(stagedPositions[slot].getDevicePointer(), pinned, frameBytes, stream), "Error uploading staged positions");
+        cuEventRecord(uploadedEvents[slot], stream);
+        numStaged++;
+    }
+    void apply() {
+        if (numStaged == 0)
+            throw OpenMMException("SlicedNonbondedForce: No positions have been staged");
+        int slot = (numStaged-1)%2;
+        cuStreamWaitEvent(cu.getCurrentStream(), uploadedEvents[slot], 0);
+        vector<void*> args = {&stagedPositions[slot].getDevicePointer(), &cu.getPosq().getDevicePointer()};
+        if (cu.getUseMixedPrecision())
+            args.push_back(&cu.getPosqCorrection().getDevicePointer());
+        args.push_back(&cu.getAtomIndexArray().getDevicePointer());
+        cu.executeKernel(applyKernel, &args[0], cu.getNumAtoms());
+        cuEventRecord(appliedEvents[slot], cu.getCurrentStream());
+
+        // As in UpdateStateDataKernel::setPositions(), the new positions are not displaced by any periodic
+        // box vectors.
+
+        for (auto& offset : cu.getPosCellOffsets())
+            offset = {0, 0, 0, 0};
+    }
+private:
+    CudaContext& cu;
+    bool useDouble;
+    int numStaged;
+    size_t frameBytes;
+    CUfunction applyKernel;
+    CudaArray stagedPositions[2];
+    void* pinnedBuffer;
+    CUstream stream;
+    CUevent uploadedEvents[2], appliedEvents[2];
+};
+
 CudaCalcSlicedNonbondedForceKernel::~CudaCalcSlicedNonbondedForceKernel() {
     ContextSelector selector(cu);
-    if (sort != NULL)
-        delete sort;
-    if (fft != NULL)
-        delete fft;
+    if (positionStager != NULL)
+        delete positionStager;
+    if (balanceLoads) {
+        cuEventDestroy(evaluationStartEvent);
+        cuEventDestroy(evaluationEndEvent);
+    }
+    if (dispersionCorrection != NULL)
+        delete dispersionCorrection;
     if (dispersionFft != NULL)
         delete dispersionFft;
+    if (dispersionSort != NULL)
+        delete dispersionSort;
+    if (useDispersionStream) {
+        cuEventDestroy(dispersionForkEvent);
+        cuEventDestroy(dispersionJoinEvent);
+        cuStreamDestroy(dispersionStream);
+    }
+    if (pinnedLambdas != NULL) {
+        cuMemFreeHost(pinnedLambdas);
+        cuEventDestroy(lambdasUploadEvent);
+    }
+    if (pinnedMaskedLambdas != NULL) {
+        cuMemFreeHost(pinnedMaskedLambdas);
+        cuEventDestroy(maskedLambdasUploadEvent);
+    }
+    for (CUgraphExec exec : pmeGraphExec)
+        if (exec != NULL)
+            cuGraphExecDestroy(exec);
+    if (stageTimer != NULL)
+        delete stageTimer;
     if (hasInitializedFFT && usePmeStream) {
-        cuStreamDestroy(pmeStream);
         cuEventDestroy(pmeSyncEvent);
         cuEventDestroy(paramsSyncEvent);
     }
 }
 
+string CudaCalcSlicedNonbondedForceKernel::getSliceGroupCondition(int group) {
+    stringstream condition;
+    int count = 0;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceDirectGroups[slice] == group)
+            condition<<(count++ ? " || " : "")<<"slice=="<<slice;
+    return (count ? "("+condition.str()+")" : "false");
+}
+
 string CudaCalcSlicedNonbondedForceKernel::getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ) {
     stringstream exprCoulomb, exprLJ, exprBoth;
     int countCoulomb = 0, countLJ = 0, countBoth = 0;
@@ -257,24 +881,44 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     for (forceIndex = 0; forceIndex < system.getNumForces() && &system.getForce(forceIndex) != &force; ++forceIndex)
         ;
     string prefix = "slicedNonbonded"+cu.intToString(forceIndex)+"_";
+    if (force.getNonbondedMethod() == SlicedNonbondedForce::NoCutoff && force.getUseTreeCode())
+        throw OpenMMException("SlicedNonbondedForce: The CUDA platform does not implement the tree code");
+    if (isStageProfilingRequested(force))
+        stageTimer = new CudaStageTimer(cu);
 
     string realToFixedPoint = Platform::getOpenMMVersion()[0] == '7' ? CudaNonbondedSlicingKernelSources::realToFixedPoint : "";
 
     int numParticles = force.getNumParticles();
     numSubsets = force.getNumSubsets();
+    numGridSlots = numSubsets;
     numSlices = force.getNumSlices();
+    effectiveSlices = SlicedNonbondedForceImpl::calcEffectiveSlices(force);
+    numEffectiveSlices = *max_element(effectiveSlices.begin(), effectiveSlices.end())+1;
+    useTiledEnergy = (numEffectiveSlices > SlicedNonbondedForceImpl::MaxUntiledEffectiveSlices);
+    if (useTiledEnergy) {
+        vector<int> memberStart, memberSubsets;
+        groupSlicesByEffectiveSlice(effectiveSlices, numSubsets, memberStart, memberSubsets);
+        sliceMemberStart.initialize<int>(cu, memberStart.size(), "sliceMemberStart");
+        sliceMemberStart.upload(memberStart);
+        sliceMemberSubsets.initialize<int>(cu, memberSubsets.size(), "sliceMemberSubsets");
+        sliceMemberSubsets.upload(memberSubsets);
+    }
+    int energyTileSize = getSliceEnergyTileSize(numSubsets, cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    int slicesPerThread = (numEffectiveSlices+SliceEnergyBlockSize-1)/SliceEnergyBlockSize;
     sliceLambdasVec.resize(numSlices, make_double2(1, 1));
     subsetSelfEnergy.resize(numSlices, make_double2(0, 0));
     sliceScalingParams.resize(numSlices, ScalingParameterInfo());
 
     subsetsVec.resize(cu.getPaddedNumAtoms(), 0);
-    for (int i = 0; i < numParticles; i++)
-        subsetsVec[i] = force.getParticleSubset(i);
+    vector<int> particleSubsets = force.getParticleSubsets();
+    copy(particleSubsets.begin(), particleSubsets.end(), subsetsVec.begin());
     subsets.initialize<int>(cu, cu.getPaddedNumAtoms(), "subsets");
     subsets.upload(subsetsVec);
 
     int numDerivs = force.getNumScalingParameterDerivatives();
     hasDerivatives = numDerivs > 0;
+    computeDerivatives = hasDerivatives;
+    useDerivativesOnDemand = force.getUseDerivativesOnDemand();
     set<string> requestedDerivatives;
     for (int i = 0; i < numDerivs; i++)
         requestedDerivatives.insert(force.getScalingParameterDerivativeName(i));
@@ -288,66 +932,142 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         sliceScalingParams[sliceIndex(subset1, subset2)].addInfo(name, includeCoulomb, includeLJ, hasDerivative);
     }
 
+    // Resolve the scaling parameters of every slice into indices of a list of distinct names, so that
+    // each Context parameter is queried only once per step.
+
+    auto scalingParamIndex = [&](const string& name) {
+        auto position = find(scalingParamNames.begin(), scalingParamNames.end(), name);
+        if (position != scalingParamNames.end())
+            return (int) (position-scalingParamNames.begin());
+        scalingParamNames.push_back(name);
+        return (int) scalingParamNames.size()-1;
+    };
+    sliceParamIndices.resize(numSlices, make_pair(-1, -1));
+    for (int slice = 0; slice < numSlices; slice++) {
+        ScalingParameterInfo info = sliceScalingParams[slice];
+        if (info.includeCoulomb)
+            sliceParamIndices[slice].first = scalingParamIndex(info.nameCoulomb);
+        if (info.includeLJ)
+            sliceParamIndices[slice].second = scalingParamIndex(info.nameLJ);
+    }
+    scalingParamValues.resize(scalingParamNames.size(), 1.0);
+
+    // Find the force groups of the direct and reciprocal space parts of every slice.
+
+    useSliceForceGroups = SlicedNonbondedForceImpl::hasSliceForceGroups(force);
+    SlicedNonbondedForceImpl::getSliceForceGroups(force, sliceDirectGroups, sliceReciprocalGroups);
+    set<int> directGroups(sliceDirectGroups.begin(), sliceDirectGroups.end());
+    reciprocalGroupsMask = 0;
+    for (int group : sliceReciprocalGroups)
+        reciprocalGroupsMask |= 1<<group;
+
     size_t sizeOfReal = cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float);
     sliceLambdas.initialize(cu, numSlices, 2*sizeOfReal, "sliceLambdas");
     if (cu.getUseDoublePrecision())
         sliceLambdas.upload(sliceLambdasVec);
     else
         sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
+    CHECK_RESULT(cuMemHostAlloc(&pinnedLambdas, numSlices*2*sizeOfReal, CU_MEMHOSTALLOC_PORTABLE), "Error allocating pinned memory for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventCreate(&lambdasUploadEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+    CHECK_RESULT(cuEventRecord(lambdasUploadEvent, cu.getCurrentStream()), "Error recording event for SlicedNonbondedForce");
 
-    // Identify which exceptions are 1-4 interactions.
+    // If requested, the forces of every slice are accumulated in buffers of their own, which have the
+    // same fixed point layout as the force buffer of the context.
 
-    set<int> exceptionsWithOffsets;
-    for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
-        string param;
-        int exception;
-        double charge, sigma, epsilon;
-        force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
-        exceptionsWithOffsets.insert(exception);
+    useSliceForces = force.getUseSliceForces();
+    if (useSliceForces)
+        sliceForces.initialize<long long>(cu, numSlices*3*cu.getPaddedNumAtoms(), "sliceForces");
+
+    // If requested, the Coulomb and Lennard-Jones energies of every slice are accumulated for each atom
+    // in fixed point, and only summed up when they are retrieved.
+
+    useSliceEnergies = force.getUseSliceEnergies();
+    if (useSliceEnergies) {
+        sliceEnergies.initialize<long long>(cu, numSlices*2*cu.getPaddedNumAtoms(), "sliceEnergies");
+        sliceEnergySums.initialize<long long>(cu, 2*numSlices, "sliceEnergySums");
     }
-    vector<pair<int, int> > exclusions;
-    vector<int> exceptions;
-    map<int, int> exceptionIndex;
-    for (int i = 0; i < force.getNumExceptions(); i++) {
-        int particle1, particle2;
-        double chargeProd, sigma, epsilon;
-        force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
-        exclusions.push_back(pair<int, int>(particle1, particle2));
-        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end()) {
-            exceptionIndex[i] = exceptions.size();
-            exceptions.push_back(i);
-        }
+
+    // With slices in different force groups, the reciprocal space kernels use a copy of the lambdas in which
+    // those of the slices not included in the current evaluation are zero.
+
+    reciprocalSliceLambdas = &sliceLambdas;
+    if (useSliceForceGroups) {
+        maskedSliceLambdas.initialize(cu, numSlices, 2*sizeOfReal, "maskedSliceLambdas");
+        reciprocalSliceLambdas = &maskedSliceLambdas;
+        CHECK_RESULT(cuMemHostAlloc(&pinnedMaskedLambdas, numSlices*2*sizeOfReal, CU_MEMHOSTALLOC_PORTABLE), "Error allocating pinned memory for SlicedNonbondedForce");
+        CHECK_RESULT(cuEventCreate(&maskedLambdasUploadEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+        CHECK_RESULT(cuEventRecord(maskedLambdasUploadEvent, cu.getCurrentStream()), "Error recording event for SlicedNonbondedForce");
     }
 
+    // Identify which exceptions are 1-4 interactions.  The particles and parameters of all exceptions are
+    // read in parallel into flat arrays, from which the rest of the setup takes them.
+
+    readExceptions(force, threads, allExceptionAtoms, allExceptionParams, nonExcludedExceptions);
+    int numAllExceptions = force.getNumExceptions();
+    vector<int> exceptions(nonExcludedExceptions), exclusionOrder(numAllExceptions), pairSlices(numAllExceptions);
+    parallelFor(threads, numAllExceptions, [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
+            int subset1 = subsetsVec[allExceptionAtoms[2*i]];
+            int subset2 = subsetsVec[allExceptionAtoms[2*i+1]];
+            exclusionOrder[i] = i;
+            pairSlices[i] = sliceIndex(subset1, subset2);
+        }
+    });
+
+    // Exceptions and exclusion corrections are evaluated in order of slice, so that consecutive threads
+    // mostly load the same lambdas and skip decoupled slices together.
+
+    sortBySlice(exceptions, pairSlices);
+    sortBySlice(exclusionOrder, pairSlices);
+    vector<int> exceptionIndex(numAllExceptions, -1);
+    for (int i = 0; i < exceptions.size(); i++)
+        exceptionIndex[exceptions[i]] = i;
+    sortedExceptions = exceptions;
+
     // Initialize nonbonded interactions.
 
-    vector<float4> baseParticleParamVec(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
+    baseParticleParamVec.assign(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
     vector<vector<int> > exclusionList(numParticles);
-    hasCoulomb = false;
-    hasLJ = false;
-    for (int i = 0; i < numParticles; i++) {
-        double charge, sigma, epsilon;
-        force.getParticleParameters(i, charge, sigma, epsilon);
-        baseParticleParamVec[i] = make_float4(charge, sigma, epsilon, 0);
-        exclusionList[i].push_back(i);
-        if (charge != 0.0)
-            hasCoulomb = true;
-        if (epsilon != 0.0)
-            hasLJ = true;
-    }
+    atomic<bool> anyCharge(false), anyEpsilon(false);
+    parallelFor(threads, numParticles, [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
+            double charge, sigma, epsilon;
+            force.getParticleParameters(i, charge, sigma, epsilon);
+            baseParticleParamVec[i] = make_float4(charge, sigma, epsilon, 0);
+            exclusionList[i].push_back(i);
+            if (charge != 0.0)
+                anyCharge = true;
+            if (epsilon != 0.0)
+                anyEpsilon = true;
+        }
+    });
+    hasCoulomb = anyCharge;
+    hasLJ = anyEpsilon;
+    hasChargeOffset.assign(numParticles, 0);
+    hasEpsilonOffset.assign(numParticles, 0);
     for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
         string param;
         int particle;
         double charge, sigma, epsilon;
         force.getParticleParameterOffset(i, param, particle, charge, sigma, epsilon);
-        if (charge != 0.0)
+        if (charge != 0.0) {
             hasCoulomb = true;
-        if (epsilon != 0.0)
+            hasChargeOffset[particle] = 1;
+        }
+        if (epsilon != 0.0) {
             hasLJ = true;
+            hasEpsilonOffset[particle] = 1;
+        }
+    }
+    chargedParticles.resize(numParticles);
+    dispersiveParticles.resize(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        chargedParticles[i] = (baseParticleParamVec[i].x != 0 || hasChargeOffset[i]);
+        dispersiveParticles[i] = (baseParticleParamVec[i].z != 0 || hasEpsilonOffset[i]);
     }
-    for (auto exclusion : exclusions) {
-        exclusionList[exclusion.first].push_back(exclusion.second);
-        exclusionList[exclusion.second].push_back(exclusion.first);
+    for (int i = 0; i < numAllExceptions; i++) {
+        exclusionList[allExceptionAtoms[2*i]].push_back(allExceptionAtoms[2*i+1]);
+        exclusionList[allExceptionAtoms[2*i+1]].push_back(allExceptionAtoms[2*i]);
     }
     nonbondedMethod = CalcSlicedNonbondedForceKernel::NonbondedMethod(force.getNonbondedMethod());
     bool useCutoff = (nonbondedMethod != NoCutoff);
@@ -358,6 +1078,16 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     map<string, string> defines;
     defines["HAS_COULOMB"] = (hasCoulomb ? "1" : "0");
     defines["HAS_LENNARD_JONES"] = (hasLJ ? "1" : "0");
+    defines["SKIP_DECOUPLED_SLICES"] = (force.getSkipDecoupledSlices() && !useSliceEnergies ? "1" : "0");
+    stringstream derivativeSlices;
+    int numDerivativeSlices = 0;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceScalingParams[slice].hasDerivativeCoulomb || sliceScalingParams[slice].hasDerivativeLJ)
+            derivativeSlices<<(numDerivativeSlices++ ? " || " : "")<<"slice=="<<slice;
+    defines["SLICE_HAS_DERIVATIVE"] = (numDerivativeSlices ? "("+derivativeSlices.str()+")" : "false");
+    defines["USE_SLICE_FORCE_GROUPS"] = (useSliceForceGroups ? "1" : "0");
+    defines["USE_SLICE_FORCES"] = (useSliceForces ? "1" : "0");
+    defines["USE_SLICE_ENERGIES"] = (useSliceEnergies ? "1" : "0");
     defines["USE_LJ_SWITCH"] = (useCutoff && force.getUseSwitchingFunction() ? "1" : "0");
     if (useCutoff) {
         // Compute the reaction field constants.
@@ -376,10 +1106,26 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             defines["LJ_SWITCH_C5"] = cu.doubleToString(6/pow(force.getSwitchingDistance()-force.getCutoffDistance(), 5.0));
         }
     }
-    if (force.getUseDispersionCorrection() && cu.getContextIndex() == 0 && hasLJ && useCutoff && usePeriodic && !doLJPME)
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(system, force);
+    if (force.getUseDispersionCorrection() && cu.getContextIndex() == 0 && hasLJ && useCutoff && usePeriodic && !doLJPME) {
+        dispersionCorrection = new SlicedDispersionCorrection(system, force);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    }
     alpha = 0;
     ewaldSelfEnergy = 0.0;
+
+    // The reciprocal space sums are computed on the first device.
+
+    int numContexts = cu.getPlatformData().contexts.size();
+    balanceLoads = (force.getUseLoadBalancing() && numContexts > 1);
+    computeCoulombRecip = (cu.getContextIndex() == 0);
+
+    // If requested, the Coulomb reciprocal space sums are computed on the CPU instead of this device,
+    // which then only includes the self energy.  These sums are not split into slice forces or energies.
+
+    bool useCpuPme = (force.getUseCpuPme() && !useSliceForces && !useSliceEnergies && (nonbondedMethod == PME || nonbondedMethod == LJPME) && hasCoulomb && computeCoulombRecip);
+    if (useCpuPme)
+        computeCoulombRecip = false;
+    computeDispersionRecip = (doLJPME && cu.getContextIndex() == 0);
     map<string, string> paramsDefines;
     paramsDefines["NUM_SUBSETS"] = cu.intToString(numSubsets);
     paramsDefines["ONE_4PI_EPS0"] = cu.doubleToString(ONE_4PI_EPS0);
@@ -402,7 +1148,7 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         defines["EWALD_ALPHA"] = cu.doubleToString(alpha);
         defines["TWO_OVER_SQRT_PI"] = cu.doubleToString(2.0/sqrt(M_PI));
         defines["USE_EWALD"] = "1";
-        if (cu.getContextIndex() == 0) {
+        if (computeCoulombRecip) {
             paramsDefines["INCLUDE_EWALD"] = "1";
             paramsDefines["EWALD_SELF_ENERGY_SCALE"] = cu.doubleToString(ONE_4PI_EPS0*alpha/sqrt(M_PI));
             for (int i = 0; i < numParticles; i++)
@@ -416,6 +1162,10 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             replacements["NUM_ATOMS"] = cu.intToString(numParticles);
             replacements["NUM_SUBSETS"] = cu.intToString(numSubsets);
             replacements["NUM_SLICES"] = cu.intToString(numSlices);
+            replacements["NUM_EFFECTIVE_SLICES"] = cu.intToString(numEffectiveSlices);
+            replacements["EFFECTIVE_SLICES"] = toInitializerList(effectiveSlices);
+            if (!cu.getUseDoublePrecision() && !cu.getUseMixedPrecision())
+                replacements["USE_FIXED_POINT_ENERGY"] = "1";
             replacements["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
             replacements["KMAX_X"] = cu.intToString(kmaxx);
             replacements["KMAX_Y"] = cu.intToString(kmaxy);
@@ -423,21 +1173,37 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             replacements["EXP_COEFFICIENT"] = cu.doubleToString(-1.0/(4.0*alpha*alpha));
             replacements["ONE_4PI_EPS0"] = cu.doubleToString(ONE_4PI_EPS0);
             replacements["M_PI"] = cu.doubleToString(M_PI);
-            CUmodule module = cu.createModule(realToFixedPoint+CudaNonbondedSlicingKernelSources::vectorOps+CommonNonbondedSlicingKernelSources::ewald, replacements);
-            ewaldSumsKernel = cu.getKernel(module, "calculateEwaldCosSinSums");
-            ewaldForcesKernel = cu.getKernel(module, "calculateEwaldForces");
+            if (useTiledEnergy) {
+                replacements["USE_TILED_ENERGY"] = "1";
+                replacements["ENERGY_TILE_SIZE"] = cu.intToString(energyTileSize);
+                replacements["SLICES_PER_THREAD"] = cu.intToString(slicesPerThread);
+            }
+            if (useSliceForces)
+                replacements["USE_SLICE_FORCES"] = "1";
+            else
+                replacements["USE_TILED_EWALD"] = "1";
+            replacements["EWALD_BLOCK_SIZE"] = cu.intToString(CudaContext::ThreadBlockSize);
+            replacements["EWALD_FORCE_TILE_SIZE"] = cu.intToString(getEwaldForceTileSize(numSubsets, cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float), CudaContext::ThreadBlockSize));
+            compileModule(realToFixedPoint+CudaNonbondedSlicingKernelSources::vectorOps+CommonNonbondedSlicingKernelSources::energyAccumulation+CommonNonbondedSlicingKernelSources::ewald, replacements, [this] (CUmodule module) {
+                ewaldSumsKernel = cu.getKernel(module, "calculateEwaldCosSinSums");
+                ewaldForcesKernel = cu.getKernel(module, "calculateEwaldForces");
+                if (useTiledEnergy)
+                    ewaldEnergyKernel = cu.getKernel(module, "calculateEwaldEnergy");
+            });
             int elementSize = (cu.getUseDoublePrecision() ? sizeof(double2) : sizeof(float2));
             cosSinSums.initialize(cu, (2*kmaxx-1)*(2*kmaxy-1)*(2*kmaxz-1)*numSubsets, elementSize, "cosSinSums");
-            int bufferSize = cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cu, numSlices*bufferSize, elementSize, "pmeEnergyBuffer");
+            int bufferSize = cu.getNumThreadBlocks()*(useTiledEnergy ? 1 : CudaContext::ThreadBlockSize);
+            pmeEnergyBuffer.initialize(cu, numEffectiveSlices*bufferSize, elementSize, "pmeEnergyBuffer");
             cu.clearBuffer(pmeEnergyBuffer);
-            int recipForceGroup = force.getReciprocalSpaceForceGroup();
-            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, recipForceGroup >= 0 ? recipForceGroup : force.getForceGroup()));
+            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, reciprocalGroupsMask, stageTimer));
         }
     }
     else if (((nonbondedMethod == PME || nonbondedMethod == LJPME) && hasCoulomb) || doLJPME) {
         // Compute the PME parameters.
 
+        pmeOrder = force.getPMEInterpolationOrder();
+        if (pmeOrder > MaxPmeOrder)
+            throw OpenMMException("SlicedNonbondedForce: The CUDA platform supports PME interpolation orders up to "+cu.intToString(MaxPmeOrder));
         SlicedNonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSizeX, gridSizeY, gridSizeZ, false);
         gridSizeX = CudaFFT3D::findLegalDimension(gridSizeX);
         gridSizeY = CudaFFT3D::findLegalDimension(gridSizeY);
@@ -449,6 +1215,117 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             dispersionGridSizeY = CudaFFT3D::findLegalDimension(dispersionGridSizeY);
             dispersionGridSizeZ = CudaFFT3D::findLegalDimension(dispersionGridSizeZ);
         }
+
+        // The Coulomb sums of small subsets, including those without any charges, can be computed
+        // without grids, in which case the other subsets take the first grid slots.  Their forces are
+        // interpolated from combined potentials, so this is not done when slice forces are needed.
+
+        if (!doLJPME && hasCoulomb && computeCoulombRecip && !useSliceForces) {
+            numGridSlots = assignPmeGridSlots(particleSubsets, chargedParticles, numSubsets, force.getSmallSubsetThreshold(), subsetSlots);
+            useSmallSubsets = (numGridSlots < numSubsets);
+            numGridSlots = (useSmallSubsets ? numGridSlots : numSubsets);
+        }
+
+        // The subsets whose particles have neither epsilons nor epsilon offsets contribute nothing to
+        // the dispersion sums, so they get no dispersion grids.
+
+        numDispersionGrids = numSubsets;
+        if (doLJPME && hasLJ && computeDispersionRecip)
+            numDispersionGrids = assignDispersionGrids(particleSubsets, dispersiveParticles, numSubsets, dispersionSubsetGrids);
+        int cufftVersion;
+        cufftGetVersion(&cufftVersion);
+        useCudaFFT = force.getUseCudaFFT() && (cufftVersion >= 7050); // There was a critical bug in version 7.0
+        fftCacheDir = cu.getPlatformData().propertyValues[CudaPlatform::CudaTempDirectory()];
+
+        // A configuration tuned in a previous run on the same device and for the same system is reused
+        // instead of timing the transforms again.
+
+        SlicedNonbondedForceImpl::TunedConfiguration tuned;
+        bool hasTuned = false;
+        if (force.getAutotunePME() || force.getAutoselectFFT()) {
+            char name[100];
+            cuDeviceGetName(name, 100, cu.getDevice());
+            double tunedDispersionAlpha = (doLJPME ? dispersionAlpha : 0.0);
+            hasTuned = SlicedNonbondedForceImpl::findTunedConfiguration(force.getTunedConfiguration(), name, numParticles, numSubsets,
+                    alpha, tunedDispersionAlpha, tuned);
+            tuned.device = name;
+            tuned.numParticles = numParticles;
+            tuned.numSubsets = numSubsets;
+            tuned.alpha = alpha;
+            tuned.dispersionAlpha = tunedDispersionAlpha;
+        }
+
+        // If requested, replace the grids that were not set explicitly by the ones transformed fastest.
+
+        if (force.getAutotunePME()) {
+            double explicitAlpha;
+            int nx, ny, nz;
+            auto timeTransforms = [&] (int xsize, int ysize, int zsize) {return timePmeTransforms(xsize, ysize, zsize);};
+            force.getPMEParameters(explicitAlpha, nx, ny, nz);
+            if (hasCoulomb && computeCoulombRecip && explicitAlpha == 0.0) {
+                if (!hasTuned || !applyTunedPmeGrid(tuned.grid, gridSizeX, gridSizeY, gridSizeZ))
+                    tunePmeGrid(gridSizeX, gridSizeY, gridSizeZ, timeTransforms);
+                tuned.grid[0] = gridSizeX;
+                tuned.grid[1] = gridSizeY;
+                tuned.grid[2] = gridSizeZ;
+            }
+            force.getLJPMEParameters(explicitAlpha, nx, ny, nz);
+            if (computeDispersionRecip && explicitAlpha == 0.0) {
+                if (!hasTuned || !applyTunedPmeGrid(tuned.dispersionGrid, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ))
+                    tunePmeGrid(dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, timeTransforms);
+                tuned.dispersionGrid[0] = dispersionGridSizeX;
+                tuned.dispersionGrid[1] = dispersionGridSizeY;
+                tuned.dispersionGrid[2] = dispersionGridSizeZ;
+            }
+        }
+
+        // If requested, time the transforms with each FFT library and VkFFT configuration, and keep the
+        // fastest.  The decision is based on the Coulomb grid, unless only the dispersion one is used.
+
+        if (force.getAutoselectFFT() && (computeCoulombRecip || computeDispersionRecip)) {
+            if (hasTuned && tuned.registerBoost > 0 && (!tuned.useVendorFFT || cufftVersion >= 7050)) {
+                useCudaFFT = tuned.useVendorFFT;
+                vkfftRegisterBoost = tuned.registerBoost;
+            }
+            else {
+                bool useCoulombGrid = (hasCoulomb && computeCoulombRecip);
+                int xsize = (useCoulombGrid ? gridSizeX : dispersionGridSizeX);
+                int ysize = (useCoulombGrid ? gridSizeY : dispersionGridSizeY);
+                int zsize = (useCoulombGrid ? gridSizeZ : dispersionGridSizeZ);
+                vector<pair<bool, int> > choices = {{false, 1}, {false, 2}, {false, 4}};
+                if (cufftVersion >= 7050)
+                    choices.push_back({true, 1});
+                pair<bool, int> bestChoice = choices[0];
+                double bestTime = -1.0;
+                for (auto choice : choices) {
+                    useCudaFFT = choice.first;
+                    vkfftRegisterBoost = choice.second;
+                    double time;
+                    try {
+                        time = timePmeTransforms(xsize, ysize, zsize);
+                    }
+                    catch (const OpenMMException& e) {
+                        continue; // This configuration is not supported for the grid.
+                    }
+                    if (bestTime < 0.0 || time < bestTime) {
+                        bestTime = time;
+                        bestChoice = choice;
+                    }
+                }
+                useCudaFFT = bestChoice.first;
+                vkfftRegisterBoost = bestChoice.second;
+            }
+            tuned.useVendorFFT = useCudaFFT;
+            tuned.registerBoost = vkfftRegisterBoost;
+        }
+        if (force.getAutotunePME() || force.getAutoselectFFT())
+            tunedConfiguration = SlicedNonbondedForceImpl::formatTunedConfiguration(tuned);
+
+        // When both grids have the same dimensions and every subset has a dispersion grid, the atoms are
+        // sorted once for Coulomb and dispersion.
+
+        shareAtomGridIndex = (computeCoulombRecip && computeDispersionRecip && hasCoulomb && dispersionGridSizeX == gridSizeX &&
+                dispersionGridSizeY == gridSizeY && dispersionGridSizeZ == gridSizeZ && numDispersionGrids == numSubsets);
         defines["EWALD_ALPHA"] = cu.doubleToString(alpha);
         defines["TWO_OVER_SQRT_PI"] = cu.doubleToString(2.0/sqrt(M_PI));
         defines["USE_EWALD"] = "1";
@@ -463,12 +1340,14 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             defines["INVCUT6"] = cu.doubleToString(invRCut6);
             defines["MULTSHIFT6"] = cu.doubleToString(multShift6);
         }
-        if (cu.getContextIndex() == 0) {
-            paramsDefines["INCLUDE_EWALD"] = "1";
-            paramsDefines["EWALD_SELF_ENERGY_SCALE"] = cu.doubleToString(ONE_4PI_EPS0*alpha/sqrt(M_PI));
-            for (int i = 0; i < numParticles; i++)
-                subsetSelfEnergy[subsetsVec[i]].x -= baseParticleParamVec[i].x*baseParticleParamVec[i].x*ONE_4PI_EPS0*alpha/sqrt(M_PI);
-            if (doLJPME) {
+        if (computeCoulombRecip || computeDispersionRecip || useCpuPme) {
+            if (computeCoulombRecip || useCpuPme) {
+                paramsDefines["INCLUDE_EWALD"] = "1";
+                paramsDefines["EWALD_SELF_ENERGY_SCALE"] = cu.doubleToString(ONE_4PI_EPS0*alpha/sqrt(M_PI));
+                for (int i = 0; i < numParticles; i++)
+                    subsetSelfEnergy[subsetsVec[i]].x -= baseParticleParamVec[i].x*baseParticleParamVec[i].x*ONE_4PI_EPS0*alpha/sqrt(M_PI);
+            }
+            if (computeDispersionRecip) {
                 paramsDefines["INCLUDE_LJPME"] = "1";
                 paramsDefines["LJPME_SELF_ENERGY_SCALE"] = cu.doubleToString(pow(dispersionAlpha, 6)/3.0);
                 for (int i = 0; i < numParticles; i++)
@@ -478,132 +1357,338 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                 int slice = sliceIndex(i, i);
                 ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
             }
+        }
+        if (useCpuPme) {
+            int gridSize[3] = {gridSizeX, gridSizeY, gridSizeZ};
+            cu.addPostComputation(cpuPme = new CpuPmePostComputation(cu, threads, charges, usePosqCharges, numSubsets, alpha, gridSize, pmeOrder, force.getUseOptimalInfluenceFunction(), sliceScalingParams));
+        }
+        if (computeCoulombRecip || computeDispersionRecip) {
             char deviceName[100];
             cuDeviceGetName(deviceName, 100, cu.getDevice());
             usePmeStream = (!cu.getPlatformData().disablePmeStream && string(deviceName) != "GeForce GTX 980"); // Using a separate stream is slower on GTX 980
+
+            // LJPME can run on a stream of its own, concurrently with the Coulomb pipeline, in which case it
+            // needs separate grids and atom grid indices.  Stage timing would serialize the two pipelines.
+
+            useDispersionStream = (force.getUseConcurrentLJPME() && usePmeStream && hasCoulomb && hasLJ && computeCoulombRecip &&
+                    computeDispersionRecip && stageTimer == NULL);
+            if (useDispersionStream)
+                shareAtomGridIndex = false;
+            useInfluenceFunction = force.getUseOptimalInfluenceFunction();
+            useCachedBSplines = force.getUseCachedBSplines();
+
             map<string, string> pmeDefines;
-            pmeDefines["PME_ORDER"] = cu.intToString(PmeOrder);
+            pmeDefines["PME_ORDER"] = cu.intToString(pmeOrder);
             pmeDefines["NUM_ATOMS"] = cu.intToString(numParticles);
             pmeDefines["NUM_SUBSETS"] = cu.intToString(numSubsets);
+            pmeDefines["NUM_GRID_SUBSETS"] = cu.intToString(numGridSlots);
             pmeDefines["NUM_SLICES"] = cu.intToString(numSlices);
+            pmeDefines["NUM_EFFECTIVE_SLICES"] = cu.intToString(numEffectiveSlices);
+            pmeDefines["EFFECTIVE_SLICES"] = toInitializerList(effectiveSlices);
+            if (!cu.getUseDoublePrecision() && !cu.getUseMixedPrecision())
+                pmeDefines["USE_FIXED_POINT_ENERGY"] = "1";
+            if (useSmallSubsets) {
+                // The grids are indexed by slot, so the tables of slices are reordered accordingly.
+
+                vector<int> slotEffectiveSlices = mapSlicesToSlots(effectiveSlices, subsetSlots);
+                pmeDefines["EFFECTIVE_SLICES"] = toInitializerList(slotEffectiveSlices);
+                pmeDefines["USE_SMALL_SUBSETS"] = "1";
+                pmeDefines["SLOT_SLICES"] = toInitializerList(getSlotSlices(subsetSlots));
+                pmeDefines["SMALL_SUBSET_BLOCK_SIZE"] = cu.intToString(SmallSubsetBlockSize);
+                if (useTiledEnergy) {
+                    vector<int> memberStart, memberSubsets;
+                    groupSlicesByEffectiveSlice(slotEffectiveSlices, numSubsets, memberStart, memberSubsets);
+                    sliceMemberSubsets.upload(memberSubsets);
+                }
+            }
             pmeDefines["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
+            if (useSliceForces)
+                pmeDefines["USE_SLICE_FORCES"] = "1";
             pmeDefines["RECIP_EXP_FACTOR"] = cu.doubleToString(M_PI*M_PI/(alpha*alpha));
             pmeDefines["GRID_SIZE_X"] = cu.intToString(gridSizeX);
             pmeDefines["GRID_SIZE_Y"] = cu.intToString(gridSizeY);
             pmeDefines["GRID_SIZE_Z"] = cu.intToString(gridSizeZ);
+            pmeDefines["USE_TILED_SPREADING"] = "1";
+            pmeDefines["BRICK_SIZE"] = cu.intToString(SpreadBrickSize);
+            pmeDefines["NUM_BRICKS_X"] = cu.intToString((gridSizeX+SpreadBrickSize-1)/SpreadBrickSize);
+            pmeDefines["NUM_BRICKS_Y"] = cu.intToString((gridSizeY+SpreadBrickSize-1)/SpreadBrickSize);
+            pmeDefines["NUM_BRICKS_Z"] = cu.intToString((gridSizeZ+SpreadBrickSize-1)/SpreadBrickSize);
             pmeDefines["EPSILON_FACTOR"] = cu.doubleToString(sqrt(ONE_4PI_EPS0));
             pmeDefines["M_PI"] = cu.doubleToString(M_PI);
+            if (force.getSkipDecoupledSlices() && !useSliceEnergies)
+                pmeDefines["SKIP_DECOUPLED_SLICES"] = "1";
             if (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces)
                 pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
             if (usePmeStream)
                 pmeDefines["USE_PME_STREAM"] = "1";
+            if (useTiledEnergy) {
+                pmeDefines["USE_TILED_ENERGY"] = "1";
+                pmeDefines["ENERGY_TILE_SIZE"] = cu.intToString(energyTileSize);
+                pmeDefines["SLICES_PER_THREAD"] = cu.intToString(slicesPerThread);
+            }
+            if (useInfluenceFunction) {
+                pmeDefines["USE_INFLUENCE_FUNCTION"] = "1";
+                pmeDefines["INFLUENCE_ALIASES"] = cu.intToString(SlicedNonbondedForceImpl::InfluenceFunctionAliases);
+            }
+            if (useCachedBSplines)
+                pmeDefines["USE_CACHED_BSPLINES"] = "1";
             map<string, string> replacements;
             replacements["CHARGE"] = (usePosqCharges ? "pos.w" : "charges[atom]");
-            CUmodule module = cu.createModule(realToFixedPoint+CudaNonbondedSlicingKernelSources::vectorOps+cu.replaceStrings(CommonNonbondedSlicingKernelSources::pme, replacements), pmeDefines);
-            pmeGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
-            pmeSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
-            pmeConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
-            pmeInterpolateForceKernel = cu.getKernel(module, "gridInterpolateForce");
-            pmeEvalEnergyKernel = cu.getKernel(module, "gridEvaluateEnergy");
-            pmeFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
-            cuFuncSetCacheConfig(pmeSpreadChargeKernel, CU_FUNC_CACHE_PREFER_SHARED);
-            cuFuncSetCacheConfig(pmeInterpolateForceKernel, CU_FUNC_CACHE_PREFER_L1);
+            compileModule(realToFixedPoint+CudaNonbondedSlicingKernelSources::vectorOps+CommonNonbondedSlicingKernelSources::energyAccumulation+cu.replaceStrings(CommonNonbondedSlicingKernelSources::pme, replacements), pmeDefines, [this] (CUmodule module) {
+                pmeGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
+                pmeSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
+                pmeConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
+                pmeInterpolateForceKernel = cu.getKernel(module, "gridInterpolateForce");
+                pmeEvalEnergyKernel = cu.getKernel(module, "gridEvaluateEnergy");
+                pmeConvolutionEnergyKernel = cu.getKernel(module, "reciprocalConvolutionAndEnergy");
+                pmeFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
+                if (useInfluenceFunction)
+                    pmeInfluenceFunctionKernel = cu.getKernel(module, "computeInfluenceFunction");
+                if (useCachedBSplines)
+                    pmeBSplinesKernel = cu.getKernel(module, "computeBSplines");
+                if (useSmallSubsets) {
+                    smallAtomFactorsKernel = cu.getKernel(module, "computeSmallAtomFactors");
+                    smallStructureFactorsKernel = cu.getKernel(module, "smallSubsetStructureFactors");
+                    combinePotentialsKernel = cu.getKernel(module, "combineSubsetPotentials");
+                    smallInterpolateForceKernel = cu.getKernel(module, "smallSubsetInterpolateForce");
+                }
+                cuFuncSetCacheConfig(pmeSpreadChargeKernel, CU_FUNC_CACHE_PREFER_SHARED);
+                cuFuncSetCacheConfig(pmeInterpolateForceKernel, CU_FUNC_CACHE_PREFER_L1);
+            });
             if (doLJPME) {
                 pmeDefines["EWALD_ALPHA"] = cu.doubleToString(dispersionAlpha);
                 pmeDefines["GRID_SIZE_X"] = cu.intToString(dispersionGridSizeX);
                 pmeDefines["GRID_SIZE_Y"] = cu.intToString(dispersionGridSizeY);
                 pmeDefines["GRID_SIZE_Z"] = cu.intToString(dispersionGridSizeZ);
+                pmeDefines["NUM_BRICKS_X"] = cu.intToString((dispersionGridSizeX+SpreadBrickSize-1)/SpreadBrickSize);
+                pmeDefines["NUM_BRICKS_Y"] = cu.intToString((dispersionGridSizeY+SpreadBrickSize-1)/SpreadBrickSize);
+                pmeDefines["NUM_BRICKS_Z"] = cu.intToString((dispersionGridSizeZ+SpreadBrickSize-1)/SpreadBrickSize);
                 pmeDefines["RECIP_EXP_FACTOR"] = cu.doubleToString(M_PI*M_PI/(dispersionAlpha*dispersionAlpha));
                 pmeDefines["USE_LJPME"] = "1";
                 pmeDefines["CHARGE_FROM_SIGEPS"] = "1";
                 if (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces)
                     pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
-                module = cu.createModule(realToFixedPoint+CudaNonbondedSlicingKernelSources::vectorOps+CommonNonbondedSlicingKernelSources::pme, pmeDefines);
-                pmeDispersionFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
-                pmeDispersionGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
-                pmeDispersionSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
-                pmeDispersionConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
-                pmeEvalDispersionEnergyKernel = cu.getKernel(module, "gridEvaluateEnergy");
-                pmeInterpolateDispersionForceKernel = cu.getKernel(module, "gridInterpolateForce");
-                cuFuncSetCacheConfig(pmeDispersionSpreadChargeKernel, CU_FUNC_CACHE_PREFER_L1);
+                if (numDispersionGrids < numSubsets) {
+                    // The grids are indexed by dispersion grid, so the tables of slices only include the
+                    // subsets that have them.
+
+                    vector<int> gridEffectiveSlices = mapSlicesToGrids(effectiveSlices, dispersionSubsetGrids, numDispersionGrids);
+                    pmeDefines["NUM_SUBSETS"] = cu.intToString(numDispersionGrids);
+                    pmeDefines["NUM_GRID_SUBSETS"] = cu.intToString(numDispersionGrids);
+                    pmeDefines["NUM_SLICES"] = cu.intToString(gridEffectiveSlices.size());
+                    pmeDefines["EFFECTIVE_SLICES"] = toInitializerList(gridEffectiveSlices);
+                    pmeDefines["USE_GRID_SLICES"] = "1";
+                    pmeDefines["GRID_SLICES"] = toInitializerList(getGridSlices(dispersionSubsetGrids, numDispersionGrids));
+                    if (useTiledEnergy) {
+                        vector<int> memberStart, memberSubsets;
+                        groupSlicesByEffectiveSlice(gridEffectiveSlices, numDispersionGrids, memberStart, memberSubsets);
+                        memberStart.resize(numEffectiveSlices+1, memberStart.back());
+                        dispersionSliceMemberStart.initialize<int>(cu, memberStart.size(), "dispersionSliceMemberStart");
+                        dispersionSliceMemberStart.upload(memberStart);
+                        dispersionSliceMemberSubsets.initialize<int>(cu, memberSubsets.size(), "dispersionSliceMemberSubsets");
+                        dispersionSliceMemberSubsets.upload(memberSubsets);
+                    }
+                }
+                compileModule(realToFixedPoint+CudaNonbondedSlicingKernelSources::vectorOps+CommonNonbondedSlicingKernelSources::energyAccumulation+CommonNonbondedSlicingKernelSources::pme, pmeDefines, [this] (CUmodule module) {
+                    pmeDispersionFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
+                    pmeDispersionGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
+                    pmeDispersionSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
+                    pmeDispersionConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
+                    pmeEvalDispersionEnergyKernel = cu.getKernel(module, "gridEvaluateEnergy");
+                    pmeDispersionConvolutionEnergyKernel = cu.getKernel(module, "reciprocalConvolutionAndEnergy");
+                    pmeInterpolateDispersionForceKernel = cu.getKernel(module, "gridInterpolateForce");
+                    if (useInfluenceFunction)
+                        pmeDispersionInfluenceFunctionKernel = cu.getKernel(module, "computeInfluenceFunction");
+                    if (useCachedBSplines)
+                        pmeDispersionBSplinesKernel = cu.getKernel(module, "computeBSplines");
+                    cuFuncSetCacheConfig(pmeDispersionSpreadChargeKernel, CU_FUNC_CACHE_PREFER_SHARED);
+                });
             }
 
-            // Create required data structures.
+            // Create required data structures.  Unless LJPME is used, they are shared by all forces of the
+            // context with the same grids, so that the memory, the FFT plan, and the atom grid indices
+            // computed in an evaluation can be reused.
 
             int elementSize = (cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
-            int roundedZSize = PmeOrder*(int) ceil(gridSizeZ/(double) PmeOrder);
-            int gridElements = gridSizeX*gridSizeY*roundedZSize*numSubsets;
-            if (doLJPME) {
-                roundedZSize = PmeOrder*(int) ceil(dispersionGridSizeZ/(double) PmeOrder);
-                gridElements = max(gridElements, dispersionGridSizeX*dispersionGridSizeY*roundedZSize*numSubsets);
+            int spreadSize = (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces ? sizeof(long long) : elementSize);
+            long long gridBytes[2], fullGridBytes[2], dispersionGridBytes[2], fullDispersionGridBytes[2];
+            for (int compact = 0; compact < 2; compact++) {
+                long long* bytes = (compact ? gridBytes : fullGridBytes);
+                long long* dispersionBytes = (compact ? dispersionGridBytes : fullDispersionGridBytes);
+                SlicedNonbondedForceImpl::computePmeGridBytes(gridSizeX, gridSizeY, gridSizeZ, pmeOrder, numSubsets, elementSize, spreadSize, compact && force.getUseCompactPMEGrids(), bytes[0], bytes[1]);
+                dispersionBytes[0] = dispersionBytes[1] = 0;
+                if (doLJPME)
+                    SlicedNonbondedForceImpl::computePmeGridBytes(dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, pmeOrder, numDispersionGrids, elementSize, spreadSize, compact && force.getUseCompactPMEGrids(), dispersionBytes[0], dispersionBytes[1]);
+                if (!useDispersionStream) {
+                    bytes[0] = max(bytes[0], dispersionBytes[0]);
+                    bytes[1] = max(bytes[1], dispersionBytes[1]);
+                    dispersionBytes[0] = dispersionBytes[1] = 0;
+                }
+            }
+            pmeGridMemorySavings = fullGridBytes[0]+fullGridBytes[1]-gridBytes[0]-gridBytes[1];
+            pmeGridMemorySavings += fullDispersionGridBytes[0]+fullDispersionGridBytes[1]-dispersionGridBytes[0]-dispersionGridBytes[1];
+            if (doLJPME)
+                pmeWorkspace = make_shared<CudaPmeWorkspace>(cu);
+            else {
+                stringstream key;
+                key<<gridSizeX<<" "<<gridSizeY<<" "<<gridSizeZ<<" "<<pmeOrder<<" "<<numSubsets<<" "<<numGridSlots<<" "<<gridBytes[0]<<" "<<gridBytes[1]<<" "<<usePmeStream<<" "
+                   <<computeCoulombRecip<<" "<<useCudaFFT<<" "<<vkfftRegisterBoost;
+                pmeWorkspace = CudaPmeWorkspace::get(cu, key.str());
+            }
+            bool createWorkspace = !pmeWorkspace->isInitialized();
+            if (createWorkspace) {
+                pmeWorkspace->grid1.initialize(cu, (gridBytes[0]+2*elementSize-1)/(2*elementSize), 2*elementSize, "pmeGrid1");
+                pmeWorkspace->grid2.initialize(cu, (gridBytes[1]+2*elementSize-1)/(2*elementSize), 2*elementSize, "pmeGrid2");
+                cu.addAutoclearBuffer(pmeWorkspace->grid2);
+                pmeWorkspace->bsplineModuliX.initialize(cu, gridSizeX, elementSize, "pmeBsplineModuliX");
+                pmeWorkspace->bsplineModuliY.initialize(cu, gridSizeY, elementSize, "pmeBsplineModuliY");
+                pmeWorkspace->bsplineModuliZ.initialize(cu, gridSizeZ, elementSize, "pmeBsplineModuliZ");
+                pmeWorkspace->atomGridIndex.initialize<int2>(cu, numParticles, "pmeAtomGridIndex");
+                pmeWorkspace->sort = new CudaSort(cu, new SortTrait(), cu.getNumAtoms());
             }
-            pmeGrid1.initialize(cu, gridElements, 2*elementSize, "pmeGrid1");
-            pmeGrid2.initialize(cu, gridElements, 2*elementSize, "pmeGrid2");
-            cu.addAutoclearBuffer(pmeGrid2);
-            pmeBsplineModuliX.initialize(cu, gridSizeX, elementSize, "pmeBsplineModuliX");
-            pmeBsplineModuliY.initialize(cu, gridSizeY, elementSize, "pmeBsplineModuliY");
-            pmeBsplineModuliZ.initialize(cu, gridSizeZ, elementSize, "pmeBsplineModuliZ");
+            pmeGrid1 = &pmeWorkspace->grid1;
+            pmeGrid2 = &pmeWorkspace->grid2;
+            pmeBsplineModuliX = &pmeWorkspace->bsplineModuliX;
+            pmeBsplineModuliY = &pmeWorkspace->bsplineModuliY;
+            pmeBsplineModuliZ = &pmeWorkspace->bsplineModuliZ;
+            pmeAtomGridIndex = &pmeWorkspace->atomGridIndex;
+            pmeSubsets = &subsets;
+            if (useSmallSubsets) {
+                pmeSlots.initialize<int>(cu, cu.getPaddedNumAtoms(), "pmeSlots");
+                smallAtoms.initialize<int2>(cu, numParticles, "smallAtoms");
+                smallSlotStart.initialize<int>(cu, numSubsets-numGridSlots+1, "smallSlotStart");
+                updateSmallSubsets();
+                pmeSubsets = &pmeSlots;
+            }
+            pmeAtomGridIndexSubsetsId = pmeWorkspace->getSubsetsId(useSmallSubsets ? pmeSlotsVec : subsetsVec);
+            sort = pmeWorkspace->sort;
             if (doLJPME) {
                 pmeDispersionBsplineModuliX.initialize(cu, dispersionGridSizeX, elementSize, "pmeDispersionBsplineModuliX");
                 pmeDispersionBsplineModuliY.initialize(cu, dispersionGridSizeY, elementSize, "pmeDispersionBsplineModuliY");
                 pmeDispersionBsplineModuliZ.initialize(cu, dispersionGridSizeZ, elementSize, "pmeDispersionBsplineModuliZ");
+                if (numDispersionGrids < numSubsets) {
+                    dispersionAtomGrids.initialize<int>(cu, cu.getPaddedNumAtoms(), "dispersionAtomGrids");
+                    updateDispersionAtomGrids();
+                }
+            }
+            if (useInfluenceFunction) {
+                if (hasCoulomb && computeCoulombRecip)
+                    influenceFunction.initialize(cu, gridSizeX*gridSizeY*(gridSizeZ/2+1), elementSize, "influenceFunction");
+                if (hasLJ && computeDispersionRecip)
+                    dispersionInfluenceFunction.initialize(cu, dispersionGridSizeX*dispersionGridSizeY*(dispersionGridSizeZ/2+1), elementSize, "dispersionInfluenceFunction");
+            }
+            if (useCachedBSplines) {
+                // When the atoms are sorted once for both grids, the dispersion sums also use the B-spline
+                // coefficients computed for the Coulomb sums.
+
+                if (hasCoulomb && computeCoulombRecip) {
+                    pmeBsplineTheta.initialize(cu, pmeOrder*numParticles, 4*elementSize, "pmeBsplineTheta");
+                    pmeBsplineDTheta.initialize(cu, pmeOrder*numParticles, 4*elementSize, "pmeBsplineDTheta");
+                    pmeBsplineGridPoint.initialize<int4>(cu, numParticles, "pmeBsplineGridPoint");
+                }
+                if (hasLJ && computeDispersionRecip && !shareAtomGridIndex) {
+                    pmeDispersionBsplineTheta.initialize(cu, pmeOrder*numParticles, 4*elementSize, "pmeDispersionBsplineTheta");
+                    pmeDispersionBsplineDTheta.initialize(cu, pmeOrder*numParticles, 4*elementSize, "pmeDispersionBsplineDTheta");
+                    pmeDispersionBsplineGridPoint.initialize<int4>(cu, numParticles, "pmeDispersionBsplineGridPoint");
+                }
+            }
+            if (useDispersionStream) {
+                dispersionGrid1.initialize(cu, (dispersionGridBytes[0]+2*elementSize-1)/(2*elementSize), 2*elementSize, "dispersionGrid1");
+                dispersionGrid2.initialize(cu, (dispersionGridBytes[1]+2*elementSize-1)/(2*elementSize), 2*elementSize, "dispersionGrid2");
+                dispersionAtomGridIndex.initialize<int2>(cu, numParticles, "dispersionAtomGridIndex");
+                dispersionSort = new CudaSort(cu, new SortTrait(), cu.getNumAtoms());
             }
-            pmeAtomGridIndex.initialize<int2>(cu, numParticles, "pmeAtomGridIndex");
             int energyElementSize = (cu.getUseDoublePrecision() || cu.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
-            int bufferSize = cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cu, numSlices*bufferSize, energyElementSize, "pmeEnergyBuffer");
+            int bufferSize = cu.getNumThreadBlocks()*(useTiledEnergy ? 1 : CudaContext::ThreadBlockSize);
+            pmeEnergyBuffer.initialize(cu, numEffectiveSlices*bufferSize, energyElementSize, "pmeEnergyBuffer");
             cu.clearBuffer(pmeEnergyBuffer);
-            sort = new CudaSort(cu, new SortTrait(), cu.getNumAtoms());
 
             // Prepare for doing PME on its own stream.
 
-            int recipForceGroup = force.getReciprocalSpaceForceGroup();
-            if (recipForceGroup < 0)
-                recipForceGroup = force.getForceGroup();
             if (usePmeStream) {
                 pmeDefines["USE_PME_STREAM"] = "1";
-                cuStreamCreate(&pmeStream, CU_STREAM_NON_BLOCKING);
+                if (createWorkspace) {
+                    cuStreamCreate(&pmeWorkspace->stream, CU_STREAM_NON_BLOCKING);
+                    pmeWorkspace->ownsStream = true;
+                }
+                pmeStream = pmeWorkspace->stream;
                 // CHECK_RESULT(cuEventCreate(&pmeSyncEvent, cu.getEventFlags()), "Error creating event for SlicedNonbondedForce");  // OpenMM 8.0
                 // CHECK_RESULT(cuEventCreate(&paramsSyncEvent, cu.getEventFlags()), "Error creating event for SlicedNonbondedForce");  // OpenMM 8.0
                 CHECK_RESULT(cuEventCreate(&pmeSyncEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
                 CHECK_RESULT(cuEventCreate(&paramsSyncEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
-                cu.addPreComputation(new SyncStreamPreComputation(cu, pmeStream, pmeSyncEvent, recipForceGroup));
-                cu.addPostComputation(new SyncStreamPostComputation(cu, pmeSyncEvent, recipForceGroup));
+                cu.addPreComputation(new SyncStreamPreComputation(cu, pmeStream, pmeSyncEvent, reciprocalGroupsMask));
+                cu.addPostComputation(new SyncStreamPostComputation(cu, pmeSyncEvent, reciprocalGroupsMask));
+                if (useDispersionStream) {
+                    cuStreamCreate(&dispersionStream, CU_STREAM_NON_BLOCKING);
+                    CHECK_RESULT(cuEventCreate(&dispersionForkEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+                    CHECK_RESULT(cuEventCreate(&dispersionJoinEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for SlicedNonbondedForce");
+                }
             }
             else
                 pmeStream = cu.getCurrentStream();
 
-            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, recipForceGroup));
+            cu.addPostComputation(addEnergy = new AddEnergyPostComputation(cu, reciprocalGroupsMask, stageTimer));
 
-            int cufftVersion;
-            cufftGetVersion(&cufftVersion);
-            useCudaFFT = force.getUseCudaFFT() && (cufftVersion >= 7050); // There was a critical bug in version 7.0
-            if (useCudaFFT)
-                fft = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
-            else
-                fft = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
-            if (doLJPME) {
-                ljpmeEnergyBuffer.initialize(cu, numSlices*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
+            if (computeCoulombRecip) {
+                if (createWorkspace) {
+                    if (useCudaFFT)
+                        pmeWorkspace->fft = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numGridSlots, true, *pmeGrid1, *pmeGrid2);
+                    else
+                        pmeWorkspace->fft = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numGridSlots, true, *pmeGrid1, *pmeGrid2, vkfftRegisterBoost, fftCacheDir);
+                }
+                fft = pmeWorkspace->fft;
+            }
+            if (computeDispersionRecip) {
+                ljpmeEnergyBuffer.initialize(cu, numEffectiveSlices*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
                 cu.clearBuffer(ljpmeEnergyBuffer);
+                CudaArray* dispersionGrids[] = {(useDispersionStream ? &dispersionGrid1 : pmeGrid1), (useDispersionStream ? &dispersionGrid2 : pmeGrid2)};
                 if (useCudaFFT)
-                    dispersionFft = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+                    dispersionFft = (CudaFFT3D*) new CudaCuFFT3D(cu, useDispersionStream ? dispersionStream : pmeStream, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numDispersionGrids, true, *dispersionGrids[0], *dispersionGrids[1]);
                 else
-                    dispersionFft = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+                    dispersionFft = (CudaFFT3D*) new CudaVkFFT3D(cu, useDispersionStream ? dispersionStream : pmeStream, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numDispersionGrids, true, *dispersionGrids[0], *dispersionGrids[1], vkfftRegisterBoost, fftCacheDir);
             }
             hasInitializedFFT = true;
 
-            // Initialize the b-spline moduli.
+            // The reciprocal space kernels can be replayed as CUDA graphs, which must be captured on their own stream.
+
+            usePmeGraphs = (force.getUseCudaGraphs() && usePmeStream && stageTimer == NULL); // Events cannot be recorded inside a graph
+            if (usePmeGraphs)
+                pmeGraphExec.resize(4, NULL);
+
+            // Prepare for reusing the slice energies when only the scaling parameters change.  This is
+            // not done when the slices belong to different force groups.
+
+            useEnergyCache = force.getUseEnergyCache() && !useSliceForceGroups;
+            if (useEnergyCache) {
+                map<string, string> cacheDefines;
+                cacheDefines["NUM_ATOMS"] = cu.intToString(cu.getNumAtoms());
+                cachedPosq.initialize(cu, cu.getPaddedNumAtoms(), cu.getPosq().getElementSize(), "cachedPosq");
+                cu.clearBuffer(cachedPosq);
+                if (cu.getUseMixedPrecision()) {
+                    cacheDefines["USE_MIXED_PRECISION"] = "1";
+                    cachedPosqCorrection.initialize(cu, cu.getPaddedNumAtoms(), cu.getPosqCorrection().getElementSize(), "cachedPosqCorrection");
+                    cu.clearBuffer(cachedPosqCorrection);
+                }
+                positionsChanged.initialize<int>(cu, 1, "positionsChanged");
+                compileModule(CommonNonbondedSlicingKernelSources::positionCache, cacheDefines, [this] (CUmodule module) {
+                    updatePositionCacheKernel = cu.getKernel(module, "updatePositionCache");
+                });
+            }
+
+            // Initialize the b-spline moduli.  Those of a shared workspace have been initialized by its creator.
 
             for (int grid = 0; grid < 2; grid++) {
                 int xsize, ysize, zsize;
                 CudaArray *xmoduli, *ymoduli, *zmoduli;
                 if (grid == 0) {
+                    if (!createWorkspace)
+                        continue;
                     xsize = gridSizeX;
                     ysize = gridSizeY;
                     zsize = gridSizeZ;
-                    xmoduli = &pmeBsplineModuliX;
-                    ymoduli = &pmeBsplineModuliY;
-                    zmoduli = &pmeBsplineModuliZ;
+                    xmoduli = pmeBsplineModuliX;
+                    ymoduli = pmeBsplineModuliY;
+                    zmoduli = pmeBsplineModuliZ;
                 }
                 else {
                     if (!doLJPME)
@@ -616,13 +1701,13 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                     zmoduli = &pmeDispersionBsplineModuliZ;
                 }
                 int maxSize = max(max(xsize, ysize), zsize);
-                vector<double> data(PmeOrder);
-                vector<double> ddata(PmeOrder);
+                vector<double> data(pmeOrder);
+                vector<double> ddata(pmeOrder);
                 vector<double> bsplines_data(maxSize);
-                data[PmeOrder-1] = 0.0;
+                data[pmeOrder-1] = 0.0;
                 data[1] = 0.0;
                 data[0] = 1.0;
-                for (int i = 3; i < PmeOrder; i++) {
+                for (int i = 3; i < pmeOrder; i++) {
                     double div = 1.0/(i-1.0);
                     data[i-1] = 0.0;
                     for (int j = 1; j < (i-1); j++)
@@ -633,16 +1718,16 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
                 // Differentiate.
 
                 ddata[0] = -data[0];
-                for (int i = 1; i < PmeOrder; i++)
+                for (int i = 1; i < pmeOrder; i++)
                     ddata[i] = data[i-1]-data[i];
-                double div = 1.0/(PmeOrder-1);
-                data[PmeOrder-1] = 0.0;
-                for (int i = 1; i < (PmeOrder-1); i++)
-                    data[PmeOrder-i-1] = div*(i*data[PmeOrder-i-2]+(PmeOrder-i)*data[PmeOrder-i-1]);
+                double div = 1.0/(pmeOrder-1);
+                data[pmeOrder-1] = 0.0;
+                for (int i = 1; i < (pmeOrder-1); i++)
+                    data[pmeOrder-i-1] = div*(i*data[pmeOrder-i-2]+(pmeOrder-i)*data[pmeOrder-i-1]);
                 data[0] = div*data[0];
                 for (int i = 0; i < maxSize; i++)
                     bsplines_data[i] = 0.0;
-                for (int i = 1; i <= PmeOrder; i++)
+                for (int i = 1; i <= pmeOrder; i++)
                     bsplines_data[i] = data[i-1];
 
                 // Evaluate the actual bspline moduli for X/Y/Z.
@@ -677,10 +1762,10 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     // Add code to subtract off the reciprocal part of excluded interactions.
 
     if (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) {
-        int numContexts = cu.getPlatformData().contexts.size();
-        int startIndex = cu.getContextIndex()*force.getNumExceptions()/numContexts;
-        int endIndex = (cu.getContextIndex()+1)*force.getNumExceptions()/numContexts;
+        int startIndex = getHeldRange(force.getNumExceptions()).first;
+        int endIndex = getHeldRange(force.getNumExceptions()).second;
         int numExclusions = endIndex-startIndex;
+        numHeldExclusions = numExclusions;
         if (numExclusions > 0) {
             paramsDefines["HAS_EXCLUSIONS"] = "1";
             vector<vector<int> > atoms(numExclusions, vector<int>(2));
@@ -688,14 +1773,21 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             exclusionParams.initialize<float4>(cu, numExclusions, "exclusionParams");
             vector<int2> exclusionAtomsVec(numExclusions);
             for (int i = 0; i < numExclusions; i++) {
-                int j = i+startIndex;
-                exclusionAtomsVec[i] = make_int2(exclusions[j].first, exclusions[j].second);
-                atoms[i][0] = exclusions[j].first;
-                atoms[i][1] = exclusions[j].second;
+                int j = exclusionOrder[i+startIndex];
+                exclusionAtomsVec[i] = make_int2(allExceptionAtoms[2*j], allExceptionAtoms[2*j+1]);
+                atoms[i][0] = allExceptionAtoms[2*j];
+                atoms[i][1] = allExceptionAtoms[2*j+1];
             }
             exclusionAtoms.upload(exclusionAtomsVec);
             map<string, string> replacements;
             replacements["PARAMS"] = cu.getBondedUtilities().addArgument(exclusionParams.getDevicePointer(), "float4");
+            replacements["BALANCE_LOADS"] = (balanceLoads ? "1" : "0");
+            if (balanceLoads) {
+                exclusionRange.initialize<int2>(cu, 1, "exclusionRange");
+                exclusionRangeVec = make_int2(0, numExclusions);
+                exclusionRange.upload(&exclusionRangeVec);
+                replacements["LOAD_RANGE"] = cu.getBondedUtilities().addArgument(exclusionRange.getDevicePointer(), "int2");
+            }
             replacements["EWALD_ALPHA"] = cu.doubleToString(alpha);
             replacements["TWO_OVER_SQRT_PI"] = cu.doubleToString(2.0/sqrt(M_PI));
             replacements["DO_LJPME"] = doLJPME ? "1" : "0";
@@ -703,6 +1795,15 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             if (doLJPME)
                 replacements["EWALD_DISPERSION_ALPHA"] = cu.doubleToString(dispersionAlpha);
             replacements["LAMBDAS"] = cu.getBondedUtilities().addArgument(sliceLambdas.getDevicePointer(), "real2");
+            replacements["SKIP_DECOUPLED_SLICES"] = defines["SKIP_DECOUPLED_SLICES"];
+            replacements["SLICE_HAS_DERIVATIVE"] = defines["SLICE_HAS_DERIVATIVE"];
+            replacements["USE_SLICE_FORCE_GROUPS"] = defines["USE_SLICE_FORCE_GROUPS"];
+            replacements["USE_SLICE_FORCES"] = defines["USE_SLICE_FORCES"];
+            if (useSliceForces)
+                replacements["SLICE_FORCES"] = cu.getBondedUtilities().addArgument(sliceForces.getDevicePointer(), "mm_ulong");
+            replacements["USE_SLICE_ENERGIES"] = defines["USE_SLICE_ENERGIES"];
+            if (useSliceEnergies)
+                replacements["SLICE_ENERGIES"] = cu.getBondedUtilities().addArgument(sliceEnergies.getDevicePointer(), "mm_ulong");
             stringstream code;
             for (string param : requestedDerivatives) {
                 string variableName = cu.getBondedUtilities().addEnergyParameterDerivative(param);
@@ -712,7 +1813,10 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
             }
             replacements["COMPUTE_DERIVATIVES"] = code.str();
             if (force.getIncludeDirectSpace())
-                cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonNonbondedSlicingKernelSources::pmeExclusions, replacements), force.getForceGroup());
+                for (int group : directGroups) {
+                    replacements["SLICE_IN_FORCE_GROUP"] = getSliceGroupCondition(group);
+                    cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonNonbondedSlicingKernelSources::pmeExclusions, replacements), group);
+                }
         }
     }
 
@@ -745,6 +1849,14 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(int), subsets.getDevicePointer()));
     replacements["LAMBDA"] = prefix+"lambda";
     cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"lambda", "real", 2, 2*sizeOfReal, sliceLambdas.getDevicePointer()));
+    if (useSliceForces) {
+        replacements["SLICE_FORCES"] = prefix+"sliceForces";
+        cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"sliceForces", "mm_ulong", 1, sizeof(long long), sliceForces.getDevicePointer(), false));
+    }
+    if (useSliceEnergies) {
+        replacements["SLICE_ENERGIES"] = prefix+"sliceEnergies";
+        cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"sliceEnergies", "mm_ulong", 1, sizeof(long long), sliceEnergies.getDevicePointer(), false));
+    }
     stringstream code;
     for (string param : requestedDerivatives) {
         string variableName = cu.getNonbondedUtilities().addEnergyParameterDerivative(param);
@@ -755,14 +1867,18 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     replacements["COMPUTE_DERIVATIVES"] = code.str();
     source = cu.replaceStrings(source, replacements);
     if (force.getIncludeDirectSpace())
-        cu.getNonbondedUtilities().addInteraction(useCutoff, usePeriodic, true, force.getCutoffDistance(), exclusionList, source, force.getForceGroup(), true);
+        for (int group : directGroups) {
+            map<string, string> groupReplacements;
+            groupReplacements["SLICE_IN_FORCE_GROUP"] = getSliceGroupCondition(group);
+            cu.getNonbondedUtilities().addInteraction(useCutoff, usePeriodic, true, force.getCutoffDistance(), exclusionList, cu.replaceStrings(source, groupReplacements), group, true);
+        }
 
     // Initialize the exceptions.
 
-    int numContexts = cu.getPlatformData().contexts.size();
-    int startIndex = cu.getContextIndex()*exceptions.size()/numContexts;
-    int endIndex = (cu.getContextIndex()+1)*exceptions.size()/numContexts;
+    int startIndex = getHeldRange(exceptions.size()).first;
+    int endIndex = getHeldRange(exceptions.size()).second;
     int numExceptions = endIndex-startIndex;
+    numHeldExceptions = numExceptions;
     if (numExceptions > 0) {
         paramsDefines["HAS_EXCEPTIONS"] = "1";
         exceptionAtoms.resize(numExceptions);
@@ -771,24 +1887,43 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         baseExceptionParams.initialize<float4>(cu, numExceptions, "baseExceptionParams");
         exceptionPairs.initialize<int2>(cu, numExceptions, "exceptionPairs");
         exceptionSlices.initialize<int>(cu, numExceptions, "exceptionSlices");
-        vector<float4> baseExceptionParamsVec(numExceptions);
+        baseExceptionParamsVec.resize(numExceptions);
         vector<int> exceptionSlicesVec(numExceptions);
-        for (int i = 0; i < numExceptions; i++) {
-            double chargeProd, sigma, epsilon;
-            force.getExceptionParameters(exceptions[startIndex+i], atoms[i][0], atoms[i][1], chargeProd, sigma, epsilon);
-            baseExceptionParamsVec[i] = make_float4(chargeProd, sigma, epsilon, 0);
-            exceptionAtoms[i] = make_pair(atoms[i][0], atoms[i][1]);
-            int subset1 = force.getParticleSubset(atoms[i][0]);
-            int subset2 = force.getParticleSubset(atoms[i][1]);
-            exceptionSlicesVec[i] = sliceIndex(subset1, subset2);
-        }
+        parallelFor(threads, numExceptions, [&] (int start, int end) {
+            for (int i = start; i < end; i++) {
+                int j = exceptions[startIndex+i];
+                atoms[i][0] = allExceptionAtoms[2*j];
+                atoms[i][1] = allExceptionAtoms[2*j+1];
+                baseExceptionParamsVec[i] = make_float4(allExceptionParams[3*j], allExceptionParams[3*j+1], allExceptionParams[3*j+2], 0);
+                exceptionAtoms[i] = make_pair(atoms[i][0], atoms[i][1]);
+                int subset1 = subsetsVec[atoms[i][0]];
+                int subset2 = subsetsVec[atoms[i][1]];
+                exceptionSlicesVec[i] = sliceIndex(subset1, subset2);
+            }
+        });
         baseExceptionParams.upload(baseExceptionParamsVec);
         exceptionPairs.upload(exceptionAtoms);
         exceptionSlices.upload(exceptionSlicesVec);
         map<string, string> replacements;
         replacements["APPLY_PERIODIC"] = (usePeriodic && force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0");
         replacements["PARAMS"] = cu.getBondedUtilities().addArgument(exceptionParams.getDevicePointer(), "float4");
+        replacements["BALANCE_LOADS"] = (balanceLoads ? "1" : "0");
+        if (balanceLoads) {
+            exceptionRange.initialize<int2>(cu, 1, "exceptionRange");
+            exceptionRangeVec = make_int2(0, numExceptions);
+            exceptionRange.upload(&exceptionRangeVec);
+            replacements["LOAD_RANGE"] = cu.getBondedUtilities().addArgument(exceptionRange.getDevicePointer(), "int2");
+        }
         replacements["LAMBDAS"] = cu.getBondedUtilities().addArgument(sliceLambdas.getDevicePointer(), "real2");
+        replacements["SKIP_DECOUPLED_SLICES"] = defines["SKIP_DECOUPLED_SLICES"];
+        replacements["SLICE_HAS_DERIVATIVE"] = defines["SLICE_HAS_DERIVATIVE"];
+        replacements["USE_SLICE_FORCE_GROUPS"] = defines["USE_SLICE_FORCE_GROUPS"];
+        replacements["USE_SLICE_FORCES"] = defines["USE_SLICE_FORCES"];
+        if (useSliceForces)
+            replacements["SLICE_FORCES"] = cu.getBondedUtilities().addArgument(sliceForces.getDevicePointer(), "mm_ulong");
+        replacements["USE_SLICE_ENERGIES"] = defines["USE_SLICE_ENERGIES"];
+        if (useSliceEnergies)
+            replacements["SLICE_ENERGIES"] = cu.getBondedUtilities().addArgument(sliceEnergies.getDevicePointer(), "mm_ulong");
         stringstream code;
         for (string param : requestedDerivatives) {
             string variableName = cu.getBondedUtilities().addEnergyParameterDerivative(param);
@@ -798,7 +1933,10 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
         }
         replacements["COMPUTE_DERIVATIVES"] = code.str();
         if (force.getIncludeDirectSpace())
-            cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonNonbondedSlicingKernelSources::nonbondedExceptions, replacements), force.getForceGroup());
+            for (int group : directGroups) {
+                replacements["SLICE_IN_FORCE_GROUP"] = getSliceGroupCondition(group);
+                cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonNonbondedSlicingKernelSources::nonbondedExceptions, replacements), group);
+            }
     }
 
     // Initialize parameter offsets.
@@ -874,50 +2012,155 @@ void CudaCalcSlicedNonbondedForceKernel::initialize(const System& system, const
     // Add post-computation for dispersion correction.
 
     if (dispersionCoefficients.size() > 0 && force.getIncludeDirectSpace())
-        cu.addPostComputation(new DispersionCorrectionPostComputation(cu, dispersionCoefficients, sliceLambdasVec, sliceScalingParams, force.getForceGroup()));
+        cu.addPostComputation(new DispersionCorrectionPostComputation(cu, dispersionCoefficients, sliceLambdasVec, sliceScalingParams, sliceDirectGroups));
+
+    // Initialize the kernel for updating parameters.  If the self energy depends on parameter offsets,
+    // it is computed on the device, but only when the parameters change, and then kept on the host.
+
+    hasSelfEnergyOffsets = (hasOffsets && (paramsDefines.find("INCLUDE_EWALD") != paramsDefines.end() || paramsDefines.find("INCLUDE_LJPME") != paramsDefines.end()));
+    int energyElementSize = (cu.getUseDoublePrecision() || cu.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+    int numParamsThreads = cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize;
+    selfEnergyBuffer.initialize(cu, hasSelfEnergyOffsets ? 2*numSubsets*numParamsThreads : 1, energyElementSize, "selfEnergyBuffer");
+    subsetSelfEnergies.initialize(cu, 2*numSubsets, energyElementSize, "subsetSelfEnergies");
+    cu.clearBuffer(selfEnergyBuffer);
+    paramsDefines["SELF_ENERGY_BLOCK_SIZE"] = cu.intToString(SelfEnergyBlockSize);
+    compileModule(CommonNonbondedSlicingKernelSources::nonbondedParameters, paramsDefines, [this] (CUmodule module) {
+        computeParamsKernel = cu.getKernel(module, "computeParameters");
+        computeExclusionParamsKernel = cu.getKernel(module, "computeExclusionParameters");
+        reduceSelfEnergiesKernel = cu.getKernel(module, "reduceSelfEnergies");
+    });
+    if (useSliceEnergies) {
+        map<string, string> sliceEnergyDefines;
+        sliceEnergyDefines["NUM_SLICES"] = cu.intToString(numSlices);
+        sliceEnergyDefines["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
+        sliceEnergyDefines["SLICE_ENERGY_SUM_BLOCK_SIZE"] = cu.intToString(SliceEnergySumBlockSize);
+        compileModule(CommonNonbondedSlicingKernelSources::sliceEnergies, sliceEnergyDefines, [this] (CUmodule module) {
+            sumSliceEnergiesKernel = cu.getKernel(module, "sumSliceEnergies");
+        });
+    }
+    finishCompilation();
+
+    // Add post-computation for reporting the slice energies.  It must come after all other post-computations,
+    // so that their contributions to the energy parameter derivatives are included.
 
-    // Initialize the kernel for updating parameters.
+    if (SliceEnergyWriter::isRequested(force))
+        cu.addPostComputation(reportSliceEnergies = new ReportSliceEnergiesPostComputation(cu, force, force.getForceGroup()));
+    if (force.getNumScalingParameterDerivatives() > 0)
+        cu.addPostComputation(protocolWork = new ProtocolWorkPostComputation(cu, force.getForceGroup()));
 
-    CUmodule module = cu.createModule(CommonNonbondedSlicingKernelSources::nonbondedParameters, paramsDefines);
-    computeParamsKernel = cu.getKernel(module, "computeParameters");
-    computeExclusionParamsKernel = cu.getKernel(module, "computeExclusionParameters");
+    // When the loads are balanced among devices, measure the time each evaluation takes on this one.
+
+    if (balanceLoads) {
+        CHECK_RESULT(cuEventCreate(&evaluationStartEvent, CU_EVENT_DEFAULT), "Error creating event for SlicedNonbondedForce");
+        CHECK_RESULT(cuEventCreate(&evaluationEndEvent, CU_EVENT_DEFAULT), "Error creating event for SlicedNonbondedForce");
+        cu.addPreComputation(new EvaluationTimerPreComputation(*this));
+        cu.addPostComputation(new EvaluationTimerPostComputation(*this));
+    }
     info = new ForceInfo(force);
     cu.addForce(info);
 }
 
 double CudaCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
     ContextSelector selector(cu);
+    if (reportSliceEnergies != NULL)
+        reportSliceEnergies->setStep(context.getStepCount());
 
-    // Update scaling parameters if needed.
+    // Update scaling parameters if needed.  Those with a schedule take their values at the current
+    // step instead of those of the context.
 
+    int scheduleStep = -1;
+    if (numScheduleSteps > 0)
+        scheduleStep = (int) max(0LL, min((long long) numScheduleSteps-1, context.getStepCount()-scheduleStartStep));
     bool scalingParamChanged = false;
-    for (int slice = 0; slice < numSlices; slice++) {
-        ScalingParameterInfo info = sliceScalingParams[slice];
-        if (info.includeCoulomb) {
-            double value = context.getParameter(info.nameCoulomb);
-            if (value != sliceLambdasVec[slice].x) {
-                sliceLambdasVec[slice].x = value;
-                scalingParamChanged = true;
-            }
+    for (int i = 0; i < scalingParamNames.size(); i++) {
+        double value;
+        if (scheduleStep != -1 && scheduleColumns[i] != -1)
+            value = scheduleValues[scheduleStep*numScheduledParams+scheduleColumns[i]];
+        else {
+            value = context.getParameter(scalingParamNames[i]);
+            lambdaScheduleStale = lambdaScheduleStale || (value != scalingParamValues[i]);
         }
-        if (info.includeLJ) {
-            double value = context.getParameter(info.nameLJ);
-            if (value != sliceLambdasVec[slice].y) {
-                sliceLambdasVec[slice].y = value;
-                scalingParamChanged = true;
-            }
+        if (value != scalingParamValues[i]) {
+            scalingParamValues[i] = value;
+            scalingParamChanged = true;
         }
     }
     if (scalingParamChanged) {
+        for (int slice = 0; slice < numSlices; slice++) {
+            int first = sliceParamIndices[slice].first, second = sliceParamIndices[slice].second;
+            sliceLambdasVec[slice].x = (first == -1 ? 1.0 : scalingParamValues[first]);
+            sliceLambdasVec[slice].y = (second == -1 ? 1.0 : scalingParamValues[second]);
+        }
         ewaldSelfEnergy = 0.0;
         for (int i = 0; i < numSubsets; i++) {
             int slice = sliceIndex(i, i);
             ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
         }
+
+        // With a schedule, the lambdas of every step are already on the device and only have to be
+        // copied from the row of the current step.  Otherwise, upload the new values asynchronously.
+        // The pinned buffer can only be overwritten after the previous transfer has completed.
+
+        if (scheduleStep != -1) {
+            if (lambdaScheduleStale)
+                uploadLambdaSchedule();
+            int rowSize = numSlices*sliceLambdas.getElementSize();
+            cuMemcpyDtoDAsync(sliceLambdas.getDevicePointer(), lambdaSchedule.getDevicePointer()+(size_t) scheduleStep*rowSize, rowSize, cu.getCurrentStream());
+        }
+        else {
+            cuEventSynchronize(lambdasUploadEvent);
+            if (cu.getUseDoublePrecision())
+                memcpy(pinnedLambdas, sliceLambdasVec.data(), numSlices*sizeof(double2));
+            else {
+                vector<float2> lambdas = double2Tofloat2(sliceLambdasVec);
+                memcpy(pinnedLambdas, lambdas.data(), numSlices*sizeof(float2));
+            }
+            sliceLambdas.upload(pinnedLambdas, false);
+        }
+        cuEventRecord(lambdasUploadEvent, cu.getCurrentStream());
+        if (usePmeStream)
+            cuStreamWaitEvent(pmeStream, lambdasUploadEvent, 0);
+    }
+
+    // The work of each step of a schedule is computed in its first evaluation, once all contributions
+    // to the energy derivatives are known.
+
+    long long step = context.getStepCount();
+    if (scheduleStep != -1 && step != lastWorkStep && step >= scheduleStartStep && scheduleStep < numScheduleSteps-1) {
+        lastWorkStep = step;
+        protocolWork->setStep(scheduleStep);
+    }
+
+    // With on-demand derivatives, the reciprocal space slice energies are only evaluated for the derivatives
+    // when these can be read: in evaluations that request the energy or neither forces nor energy, which is
+    // how getState() asks for parameter derivatives alone, and in those whose slice energies are reported
+    // or whose protocol work is accumulated.
+
+    computeDerivatives = hasDerivatives && (!useDerivativesOnDemand || includeEnergy || !includeForces ||
+            (reportSliceEnergies != NULL && reportSliceEnergies->isPending()) || (protocolWork != NULL && protocolWork->isPending()));
+    if (addEnergy != NULL)
+        addEnergy->setComputeDerivatives(computeDerivatives);
+
+    // The lambdas of the reciprocal space kernels only need to be uploaded again when the
+    // scaling parameters or the set of included slices change.
+
+    if (useSliceForceGroups && includeReciprocal && (scalingParamChanged || (includedGroups&reciprocalGroupsMask) != maskedLambdasGroups)) {
+        maskedLambdasGroups = includedGroups&reciprocalGroupsMask;
+        vector<double2> maskedLambdas(numSlices, make_double2(0, 0));
+        for (int slice = 0; slice < numSlices; slice++)
+            if (isReciprocalSliceIncluded(slice))
+                maskedLambdas[slice] = sliceLambdasVec[slice];
+        cuEventSynchronize(maskedLambdasUploadEvent);
         if (cu.getUseDoublePrecision())
-            sliceLambdas.upload(sliceLambdasVec);
-        else
-            sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
+            memcpy(pinnedMaskedLambdas, maskedLambdas.data(), numSlices*sizeof(double2));
+        else {
+            vector<float2> lambdas = double2Tofloat2(maskedLambdas);
+            memcpy(pinnedMaskedLambdas, lambdas.data(), numSlices*sizeof(float2));
+        }
+        maskedSliceLambdas.upload(pinnedMaskedLambdas, false);
+        cuEventRecord(maskedLambdasUploadEvent, cu.getCurrentStream());
+        if (usePmeStream)
+            cuStreamWaitEvent(pmeStream, maskedLambdasUploadEvent, 0);
     }
 
     // Update particle and exception parameters.
@@ -934,13 +2177,15 @@ double CudaCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool in
         recomputeParams = true;
         globalParams.upload(paramValues, true);
     }
-    double energy = (includeReciprocal ? ewaldSelfEnergy : 0.0);
-    if (recomputeParams || hasOffsets) {
-        int computeSelfEnergy = (includeEnergy && includeReciprocal);
+    bool paramsRecomputed = recomputeParams;
+    if (recomputeParams && dispersionCorrection != NULL && dispersionCorrection->update(context))
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    if (recomputeParams) {
+        startStage("parameters");
         int numAtoms = cu.getPaddedNumAtoms();
-        vector<void*> paramsArgs = {&cu.getEnergyBuffer().getDevicePointer(), &computeSelfEnergy, &globalParams.getDevicePointer(), &numAtoms,
+        vector<void*> paramsArgs = {&selfEnergyBuffer.getDevicePointer(), &globalParams.getDevicePointer(), &numAtoms,
                 &baseParticleParams.getDevicePointer(), &cu.getPosq().getDevicePointer(), &charges.getDevicePointer(), &sigmaEpsilon.getDevicePointer(),
-                &particleParamOffsets.getDevicePointer(), &particleOffsetIndices.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
+                &particleParamOffsets.getDevicePointer(), &particleOffsetIndices.getDevicePointer(), &subsets.getDevicePointer()};
         int numExceptions;
         if (exceptionParams.isInitialized()) {
             numExceptions = exceptionParams.getSize();
@@ -963,26 +2208,116 @@ double CudaCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool in
             cuEventRecord(paramsSyncEvent, cu.getCurrentStream());
             cuStreamWaitEvent(pmeStream, paramsSyncEvent, 0);
         }
-        if (hasOffsets)
-            energy = 0.0; // The Ewald self energy was computed in the kernel.
+        if (hasSelfEnergyOffsets) {
+            int numThreads = selfEnergyBuffer.getSize()/(2*numSubsets);
+            void* reduceArgs[] = {&selfEnergyBuffer.getDevicePointer(), &numThreads, &subsetSelfEnergies.getDevicePointer()};
+            cu.executeKernel(reduceSelfEnergiesKernel, reduceArgs, 2*numSubsets*SelfEnergyBlockSize, SelfEnergyBlockSize);
+            if (subsetSelfEnergies.getElementSize() == sizeof(double))
+                subsetSelfEnergies.download(subsetSelfEnergy.data());
+            else {
+                vector<float> values;
+                subsetSelfEnergies.download(values);
+                for (int i = 0; i < numSubsets; i++)
+                    subsetSelfEnergy[i] = make_double2(values[2*i], values[2*i+1]);
+            }
+            ewaldSelfEnergy = 0.0;
+            for (int i = 0; i < numSubsets; i++) {
+                int slice = sliceIndex(i, i);
+                ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+            }
+        }
+        stopStage("parameters");
         recomputeParams = false;
     }
+    // The slice forces are cleared before any kernel of this evaluation adds to them, including those
+    // on the PME stream.
+
+    if (useSliceForces && includeForces) {
+        cu.clearBuffer(sliceForces);
+        if (usePmeStream) {
+            cuEventRecord(paramsSyncEvent, cu.getCurrentStream());
+            cuStreamWaitEvent(pmeStream, paramsSyncEvent, 0);
+        }
+        hasSliceForces = true;
+    }
+
+    // The slice energies are cleared in the same way.  Only the direct space kernels add to them, while the
+    // reciprocal space energies are taken from their own buffers, and the self energies and dispersion
+    // correction are computed on the host.
+
+    hasSliceEnergies = (useSliceEnergies && includeEnergy);
+    if (hasSliceEnergies) {
+        cu.clearBuffer(sliceEnergies);
+        sliceEnergiesIncludeReciprocal = includeReciprocal;
+        hostSliceEnergies.assign(2*numSlices, 0.0);
+        lastSliceLambdas.resize(2*numSlices);
+        for (int slice = 0; slice < numSlices; slice++) {
+            lastSliceLambdas[2*slice] = sliceLambdasVec[slice].x;
+            lastSliceLambdas[2*slice+1] = sliceLambdasVec[slice].y;
+        }
+        if (includeReciprocal)
+            for (int i = 0; i < numSubsets; i++) {
+                int slice = sliceIndex(i, i);
+                hostSliceEnergies[2*slice] += subsetSelfEnergy[i].x;
+                hostSliceEnergies[2*slice+1] += subsetSelfEnergy[i].y;
+            }
+        if (includeDirect && dispersionCoefficients.size() > 0) {
+            double4 boxSize = cu.getPeriodicBoxSize();
+            double volume = boxSize.x*boxSize.y*boxSize.z;
+            for (int slice = 0; slice < numSlices; slice++)
+                hostSliceEnergies[2*slice+1] += dispersionCoefficients[slice]/volume;
+        }
+    }
+    double energy = 0.0;
+    if (includeReciprocal && !useSliceForceGroups)
+        energy = ewaldSelfEnergy;
+    else if (includeReciprocal)
+        for (int i = 0; i < numSubsets; i++) {
+            int slice = sliceIndex(i, i);
+            if (isReciprocalSliceIncluded(slice))
+                energy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+        }
+
+    // Start the reciprocal space calculations that are done on the CPU.
+
+    if (cpuPme != NULL && includeReciprocal) {
+        vector<double2> maskedLambdas(numSlices, make_double2(0, 0));
+        vector<bool> included(numSlices);
+        for (int slice = 0; slice < numSlices; slice++) {
+            included[slice] = isReciprocalSliceIncluded(slice);
+            if (included[slice])
+                maskedLambdas[slice] = sliceLambdasVec[slice];
+        }
+        cpuPme->beginComputation(subsetsVec, maskedLambdas, included, includeForces);
+    }
 
     // Do reciprocal space calculations.
 
     if (cosSinSums.isInitialized() && includeReciprocal) {
         if (!addEnergy->isInitialized())
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, *reciprocalSliceLambdas, sliceScalingParams, effectiveSlices,
+                    useSliceForceGroups ? sliceReciprocalGroups : vector<int>(), useTiledEnergy);
+        startStage("ewald");
         void* sumsArgs[] = {&pmeEnergyBuffer.getDevicePointer(), &cu.getPosq().getDevicePointer(),
                 &subsets.getDevicePointer(), &cosSinSums.getDevicePointer(), cu.getPeriodicBoxSizePointer()};
-        cu.executeKernel(ewaldSumsKernel, sumsArgs, cosSinSums.getSize()/numSubsets);
-        void* forcesArgs[] = {&cu.getForce().getDevicePointer(), &cu.getPosq().getDevicePointer(), &cosSinSums.getDevicePointer(),
-                &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer(), cu.getPeriodicBoxSizePointer()};
-        cu.executeKernel(ewaldForcesKernel, forcesArgs, cu.getNumAtoms());
+        cu.executeKernel(ewaldSumsKernel, sumsArgs, cosSinSums.getSize()/numSubsets, CudaContext::ThreadBlockSize);
+        if (useTiledEnergy && (includeEnergy || computeDerivatives)) {
+            void* energyArgs[] = {&pmeEnergyBuffer.getDevicePointer(), &cosSinSums.getDevicePointer(), &sliceMemberStart.getDevicePointer(),
+                    &sliceMemberSubsets.getDevicePointer(), cu.getPeriodicBoxSizePointer()};
+            cu.executeKernel(ewaldEnergyKernel, energyArgs, cu.getNumThreadBlocks()*SliceEnergyBlockSize, SliceEnergyBlockSize);
+        }
+        if (includeForces) {
+            void* forcesArgs[] = {&cu.getForce().getDevicePointer(), &cu.getPosq().getDevicePointer(), &cosSinSums.getDevicePointer(),
+                    &subsets.getDevicePointer(), &reciprocalSliceLambdas->getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                    &sliceForces.getDevicePointer()};
+            cu.executeKernel(ewaldForcesKernel, forcesArgs, cu.getNumAtoms(), CudaContext::ThreadBlockSize);
+        }
+        stopStage("ewald");
     }
-    if (pmeGrid1.isInitialized() && includeReciprocal) {
+    if (pmeGrid1 != NULL && includeReciprocal && !(useEnergyCache && reuseEnergyCache(includeForces, includeEnergy, paramsRecomputed))) {
         if (!addEnergy->isInitialized())
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, *reciprocalSliceLambdas, sliceScalingParams, effectiveSlices,
+                    useSliceForceGroups ? sliceReciprocalGroups : vector<int>(), useTiledEnergy);
 
         if (usePmeStream)
             cu.setCurrentStream(pmeStream);
@@ -1013,195 +2348,639 @@ double CudaCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool in
             recipBoxVectorPointer[2] = &recipBoxVectorsFloat[2];
         }
 
-        // Execute the reciprocal space kernels.
+        // The optimal influence function depends on the shape of the box, so it is tabulated again whenever
+        // the box changes.  This happens on the PME stream, ahead of any kernel that reads it.
+
+        if (useInfluenceFunction && (boxVectors[0] != influenceBoxVectors[0] || boxVectors[1] != influenceBoxVectors[1] || boxVectors[2] != influenceBoxVectors[2])) {
+            if (hasCoulomb && computeCoulombRecip) {
+                void* influenceArgs[] = {&influenceFunction.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                cu.executeKernel(pmeInfluenceFunctionKernel, influenceArgs, gridSizeX*gridSizeY*(gridSizeZ/2+1));
+            }
+            if (hasLJ && computeDispersionRecip) {
+                void* influenceArgs[] = {&dispersionInfluenceFunction.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                cu.executeKernel(pmeDispersionInfluenceFunctionKernel, influenceArgs, dispersionGridSizeX*dispersionGridSizeY*(dispersionGridSizeZ/2+1));
+            }
+            for (int i = 0; i < 3; i++)
+                influenceBoxVectors[i] = boxVectors[i];
+        }
 
-        if (hasCoulomb) {
-            void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+        // The grids are cleared automatically only once per evaluation, so they must be cleared again if another
+        // force sharing them has already used them.
+
+        int evaluation = pmeWorkspace->getEvaluation();
+        if (pmeWorkspace->gridEvaluation == evaluation)
+            cu.clearBuffer(*pmeGrid2);
+        pmeWorkspace->gridEvaluation = evaluation;
+
+        // Execute the reciprocal space kernels, replaying a previously captured graph if possible.
+
+        if (usePmeGraphs) {
+            int variant = (includeForces ? 1 : 0) + (includeEnergy || computeDerivatives ? 2 : 0);
+            bool boxChanged = (pmeGraphExec[variant] == NULL);
+            for (int i = 0; i < 3; i++)
+                boxChanged |= (boxVectors[i] != pmeGraphBoxVectors[variant][i]);
+            if (boxChanged) {
+                capturePmeGraph(variant, includeForces, includeEnergy, recipBoxVectorPointer);
+                for (int i = 0; i < 3; i++)
+                    pmeGraphBoxVectors[variant][i] = boxVectors[i];
+            }
+            CHECK_RESULT(cuGraphLaunch(pmeGraphExec[variant], pmeStream), "Error launching reciprocal space graph for SlicedNonbondedForce");
+            if (hasCoulomb && computeCoulombRecip) {
+                pmeWorkspace->atomGridIndexEvaluation = evaluation;
+                pmeWorkspace->atomGridIndexSubsetsId = pmeAtomGridIndexSubsetsId;
+            }
+        }
+        else
+            executePmeKernels(includeForces, includeEnergy, recipBoxVectorPointer, true);
+        if (usePmeStream) {
+            cuEventRecord(pmeSyncEvent, pmeStream);
+            cu.restoreDefaultStream();
+        }
+    }
+    if (includeReciprocal) {
+        map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+        for (int i = 0; i < numSubsets; i++) {
+            if (!isReciprocalSliceIncluded(sliceIndex(i, i)))
+                continue;
+            ScalingParameterInfo info = sliceScalingParams[sliceIndex(i, i)];
+            if (info.hasDerivativeCoulomb)
+                energyParamDerivs[info.nameCoulomb] += subsetSelfEnergy[i].x;
+            if (doLJPME && info.hasDerivativeLJ)
+                energyParamDerivs[info.nameLJ] += subsetSelfEnergy[i].y;
+        }
+    }
+    return energy;
+}
+
+bool CudaCalcSlicedNonbondedForceKernel::reuseEnergyCache(bool includeForces, bool includeEnergy, bool paramsRecomputed) {
+    // The positions are compared and stored at every evaluation, so that the energies computed
+    // along with forces can be reused as well.
+
+    Vec3 boxVectors[3];
+    cu.getPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
+    bool boxChanged = false;
+    for (int i = 0; i < 3; i++) {
+        boxChanged |= (boxVectors[i] != cachedBoxVectors[i]);
+        cachedBoxVectors[i] = boxVectors[i];
+    }
+    cu.clearBuffer(positionsChanged);
+    vector<void*> cacheArgs = {&cu.getPosq().getDevicePointer(), &cachedPosq.getDevicePointer()};
+    if (cachedPosqCorrection.isInitialized()) {
+        cacheArgs.push_back(&cu.getPosqCorrection().getDevicePointer());
+        cacheArgs.push_back(&cachedPosqCorrection.getDevicePointer());
+    }
+    cacheArgs.push_back(&positionsChanged.getDevicePointer());
+    cu.executeKernel(updatePositionCacheKernel, &cacheArgs[0], cu.getNumAtoms());
+
+    // The energy buffers hold the slice energies of the last evaluation that computed them, which
+    // the post-computation combines with the current scaling parameters.
+
+    bool computeEnergies = (includeEnergy || computeDerivatives);
+    if (energyCacheValid && computeEnergies && !includeForces && !paramsRecomputed && !boxChanged) {
+        int changed;
+        positionsChanged.download(&changed);
+        if (changed == 0)
+            return true;
+    }
+    energyCacheValid = computeEnergies;
+    return false;
+}
+
+double CudaCalcSlicedNonbondedForceKernel::timePmeTransforms(int xsize, int ysize, int zsize) {
+    // Time a few forward and inverse transforms of all grids, after an untimed pair that absorbs
+    // any lazy initialization.
+
+    const int numRepetitions = 5;
+    int elementSize = (cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    int roundedZSize = pmeOrder*(int) ceil(zsize/(double) pmeOrder);
+    int gridElements = xsize*ysize*roundedZSize*numGridSlots;
+    CudaArray grid1(cu, gridElements, 2*elementSize, "tuningGrid1");
+    CudaArray grid2(cu, gridElements, 2*elementSize, "tuningGrid2");
+    cu.clearBuffer(grid1);
+    cu.clearBuffer(grid2);
+    CUstream stream = cu.getCurrentStream();
+    CudaFFT3D* transform;
+    if (useCudaFFT)
+        transform = (CudaFFT3D*) new CudaCuFFT3D(cu, stream, xsize, ysize, zsize, numGridSlots, true, grid1, grid2);
+    else
+        transform = (CudaFFT3D*) new CudaVkFFT3D(cu, stream, xsize, ysize, zsize, numGridSlots, true, grid1, grid2, vkfftRegisterBoost, fftCacheDir);
+    transform->execFFT(true);
+    transform->execFFT(false);
+    cuStreamSynchronize(stream);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < numRepetitions; i++) {
+        transform->execFFT(true);
+        transform->execFFT(false);
+    }
+    cuStreamSynchronize(stream);
+    double time = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    delete transform;
+    return time;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::executePmeKernels(bool includeForces, bool includeEnergy, void* recipBoxVectorPointer[3], bool reuseAtomGridIndex) {
+    // The dispersion stream forks from the PME stream here and joins it at the end, which also works when
+    // the kernels are being captured into a graph.
+
+    if (useDispersionStream) {
+        cuEventRecord(dispersionForkEvent, pmeStream);
+        cuStreamWaitEvent(dispersionStream, dispersionForkEvent, 0);
+    }
+    if (hasCoulomb && computeCoulombRecip) {
+        int evaluation = pmeWorkspace->getEvaluation();
+        if (!reuseAtomGridIndex || pmeWorkspace->atomGridIndexEvaluation != evaluation || pmeWorkspace->atomGridIndexSubsetsId != pmeAtomGridIndexSubsetsId) {
+            startStage("pme.gridIndex");
+            void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex->getDevicePointer(), cu.getPeriodicBoxSizePointer(),
                     cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &subsets.getDevicePointer()};
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeSubsets->getDevicePointer()};
             cu.executeKernel(pmeGridIndexKernel, gridIndexArgs, cu.getNumAtoms());
 
-            sort->sort(pmeAtomGridIndex);
+            sort->sort(*pmeAtomGridIndex);
+            stopStage("pme.gridIndex");
+            pmeWorkspace->atomGridIndexEvaluation = evaluation;
+            pmeWorkspace->atomGridIndexSubsetsId = pmeAtomGridIndexSubsetsId;
+        }
+        if (useCachedBSplines) {
+            startStage("pme.bsplines");
+            void* bsplinesArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex->getDevicePointer(), &pmeBsplineTheta.getDevicePointer(),
+                    &pmeBsplineDTheta.getDevicePointer(), &pmeBsplineGridPoint.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+            cu.executeKernel(pmeBSplinesKernel, bsplinesArgs, cu.getNumAtoms());
+            stopStage("pme.bsplines");
+        }
 
-            void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+        startStage("pme.spread");
+        void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2->getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex->getDevicePointer(),
+                &charges.getDevicePointer(), &pmeBsplineTheta.getDevicePointer(), &pmeBsplineGridPoint.getDevicePointer()};
+        cu.executeKernel(pmeSpreadChargeKernel, spreadArgs, cu.getNumThreadBlocks()*128, 128);
+
+        void* finishSpreadArgs[] = {&pmeGrid2->getDevicePointer(), &pmeGrid1->getDevicePointer()};
+        cu.executeKernel(pmeFinishSpreadChargeKernel, finishSpreadArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+        if (useSmallSubsets) {
+            void* factorsArgs[] = {&cu.getPosq().getDevicePointer(), &smallAtomFactors.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
                     cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &charges.getDevicePointer()};
-            cu.executeKernel(pmeSpreadChargeKernel, spreadArgs, cu.getNumAtoms(), 128);
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &smallAtoms.getDevicePointer(),
+                    &smallSlotStart.getDevicePointer(), &charges.getDevicePointer()};
+            cu.executeKernel(smallAtomFactorsKernel, factorsArgs, smallAtomFactors.getSize());
+        }
+        stopStage("pme.spread");
 
-            void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
-            cu.executeKernel(pmeFinishSpreadChargeKernel, finishSpreadArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+        startStage("pme.fft");
+        fft->execFFT(true);
+        stopStage("pme.fft");
 
-            fft->execFFT(true);
+        if (useSmallSubsets) {
+            // The transformed grids of the small subsets are computed directly, after those of the other
+            // subsets, which the forward transform overwrites.
 
-            if (includeEnergy || hasDerivatives) {
-                void* computeEnergyArgs[] = {&pmeGrid2.getDevicePointer(), &pmeEnergyBuffer.getDevicePointer(),
-                        &pmeBsplineModuliX.getDevicePointer(), &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
-                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-                cu.executeKernel(pmeEvalEnergyKernel, computeEnergyArgs, gridSizeX*gridSizeY*gridSizeZ);
+            startStage("pme.spread");
+            void* structureFactorsArgs[] = {&pmeGrid2->getDevicePointer(), &smallAtomFactors.getDevicePointer(), &smallSlotStart.getDevicePointer()};
+            cu.executeKernel(smallStructureFactorsKernel, structureFactorsArgs, gridSizeX*gridSizeY*(gridSizeZ/2+1));
+            stopStage("pme.spread");
+        }
+
+        if (includeEnergy || computeDerivatives) {
+            // When forces are also needed, a single pass evaluates the energies and convolves the grid.
+
+            startStage("pme.energy");
+            CUfunction kernel = (includeForces ? pmeConvolutionEnergyKernel : pmeEvalEnergyKernel);
+            void* computeEnergyArgs[] = {&pmeGrid2->getDevicePointer(), &pmeEnergyBuffer.getDevicePointer(),
+                    &pmeBsplineModuliX->getDevicePointer(), &pmeBsplineModuliY->getDevicePointer(), &pmeBsplineModuliZ->getDevicePointer(),
+                    &influenceFunction.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2],
+                    &sliceMemberStart.getDevicePointer(), &sliceMemberSubsets.getDevicePointer()};
+            if (useTiledEnergy)
+                cu.executeKernel(kernel, computeEnergyArgs, cu.getNumThreadBlocks()*SliceEnergyBlockSize, SliceEnergyBlockSize);
+            else
+                cu.executeKernel(kernel, computeEnergyArgs, gridSizeX*gridSizeY*gridSizeZ);
+            stopStage("pme.energy");
+        }
+
+        if (includeForces) {
+            if (!includeEnergy && !computeDerivatives) {
+                startStage("pme.convolution");
+                void* convolutionArgs[] = {&pmeGrid2->getDevicePointer(), &pmeBsplineModuliX->getDevicePointer(),
+                        &pmeBsplineModuliY->getDevicePointer(), &pmeBsplineModuliZ->getDevicePointer(),
+                        &influenceFunction.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                cu.executeKernel(pmeConvolutionKernel, convolutionArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+                stopStage("pme.convolution");
             }
 
-            void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeBsplineModuliX.getDevicePointer(),
-                    &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-            cu.executeKernel(pmeConvolutionKernel, convolutionArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+            if (useSmallSubsets) {
+                // Combine the potentials in reciprocal space and compute the forces on particles of small
+                // subsets before the inverse transform, which may overwrite its input.
+
+                startStage("pme.interpolation");
+                void* combineArgs[] = {&pmeGrid2->getDevicePointer(), &reciprocalSliceLambdas->getDevicePointer()};
+                cu.executeKernel(combinePotentialsKernel, combineArgs, gridSizeX*gridSizeY*(gridSizeZ/2+1));
+                void* smallInterpolateArgs[] = {&cu.getForce().getDevicePointer(), &pmeGrid2->getDevicePointer(), &smallAtomFactors.getDevicePointer(),
+                        &smallAtoms.getDevicePointer(), &smallSlotStart.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1],
+                        recipBoxVectorPointer[2]};
+                int numBlocks = min(cu.getNumThreadBlocks(), (int) smallAtoms.getSize());
+                cu.executeKernel(smallInterpolateForceKernel, smallInterpolateArgs, numBlocks*SmallSubsetBlockSize, SmallSubsetBlockSize);
+                stopStage("pme.interpolation");
+            }
 
+            startStage("pme.fft");
             fft->execFFT(false);
+            stopStage("pme.fft");
 
-            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+            startStage("pme.interpolation");
+            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1->getDevicePointer(), cu.getPeriodicBoxSizePointer(),
                     cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &charges.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex->getDevicePointer(),
+                    &charges.getDevicePointer(), &pmeSubsets->getDevicePointer(), &reciprocalSliceLambdas->getDevicePointer(),
+                    &pmeBsplineTheta.getDevicePointer(), &pmeBsplineDTheta.getDevicePointer(), &pmeBsplineGridPoint.getDevicePointer(),
+                    &sliceForces.getDevicePointer()};
             cu.executeKernel(pmeInterpolateForceKernel, interpolateArgs, cu.getNumAtoms(), 128);
+            stopStage("pme.interpolation");
         }
+    }
 
-        if (doLJPME && hasLJ) {
-            void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &pmeAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+    if (hasLJ && computeDispersionRecip) {
+        CudaArray& grid1 = (useDispersionStream ? dispersionGrid1 : *pmeGrid1);
+        CudaArray& grid2 = (useDispersionStream ? dispersionGrid2 : *pmeGrid2);
+        CudaArray& atomGridIndex = (useDispersionStream ? dispersionAtomGridIndex : *pmeAtomGridIndex);
+        CudaArray& theta = (shareAtomGridIndex ? pmeBsplineTheta : pmeDispersionBsplineTheta);
+        CudaArray& dtheta = (shareAtomGridIndex ? pmeBsplineDTheta : pmeDispersionBsplineDTheta);
+        CudaArray& gridPoint = (shareAtomGridIndex ? pmeBsplineGridPoint : pmeDispersionBsplineGridPoint);
+        bool compactGrids = (numDispersionGrids < numSubsets);
+        CudaArray& atomGrids = (compactGrids ? dispersionAtomGrids : subsets);
+        CudaArray& memberStart = (compactGrids && useTiledEnergy ? dispersionSliceMemberStart : sliceMemberStart);
+        CudaArray& memberSubsets = (compactGrids && useTiledEnergy ? dispersionSliceMemberSubsets : sliceMemberSubsets);
+        if (useDispersionStream)
+            cu.setCurrentStream(dispersionStream);
+        if (!shareAtomGridIndex) {
+            startStage("ljpme.gridIndex");
+            void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &atomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
                     cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &subsets.getDevicePointer()};
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &atomGrids.getDevicePointer()};
             cu.executeKernel(pmeDispersionGridIndexKernel, gridIndexArgs, cu.getNumAtoms());
-            sort->sort(pmeAtomGridIndex);
-            cu.clearBuffer(pmeGrid2);
-            void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &sigmaEpsilon.getDevicePointer()};
-            cu.executeKernel(pmeDispersionSpreadChargeKernel, spreadArgs, cu.getNumAtoms(), 128);
-
-            void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
-            cu.executeKernel(pmeDispersionFinishSpreadChargeKernel, finishSpreadArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
-
-            dispersionFft->execFFT(true);
-
-            if (includeEnergy || hasDerivatives) {
-                void* computeEnergyArgs[] = {&pmeGrid2.getDevicePointer(), &ljpmeEnergyBuffer.getDevicePointer(),
-                        &pmeDispersionBsplineModuliX.getDevicePointer(), &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
+            (useDispersionStream ? dispersionSort : sort)->sort(atomGridIndex);
+            stopStage("ljpme.gridIndex");
+            if (!useDispersionStream)
+                pmeWorkspace->atomGridIndexEvaluation = -1;
+            if (useCachedBSplines) {
+                startStage("ljpme.bsplines");
+                void* bsplinesArgs[] = {&cu.getPosq().getDevicePointer(), &atomGridIndex.getDevicePointer(), &theta.getDevicePointer(),
+                        &dtheta.getDevicePointer(), &gridPoint.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                        cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
                         recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-                cu.executeKernel(pmeEvalDispersionEnergyKernel, computeEnergyArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ);
+                cu.executeKernel(pmeDispersionBSplinesKernel, bsplinesArgs, cu.getNumAtoms());
+                stopStage("ljpme.bsplines");
             }
+        }
+        startStage("ljpme.spread");
+        cu.clearBuffer(grid2);
+        void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &grid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &atomGridIndex.getDevicePointer(),
+                &sigmaEpsilon.getDevicePointer(), &theta.getDevicePointer(), &gridPoint.getDevicePointer()};
+        cu.executeKernel(pmeDispersionSpreadChargeKernel, spreadArgs, cu.getNumThreadBlocks()*128, 128);
+
+        void* finishSpreadArgs[] = {&grid2.getDevicePointer(), &grid1.getDevicePointer()};
+        cu.executeKernel(pmeDispersionFinishSpreadChargeKernel, finishSpreadArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
+        stopStage("ljpme.spread");
+
+        startStage("ljpme.fft");
+        dispersionFft->execFFT(true);
+        stopStage("ljpme.fft");
+
+        if (includeEnergy || computeDerivatives) {
+            startStage("ljpme.energy");
+            CUfunction kernel = (includeForces ? pmeDispersionConvolutionEnergyKernel : pmeEvalDispersionEnergyKernel);
+            void* computeEnergyArgs[] = {&grid2.getDevicePointer(), &ljpmeEnergyBuffer.getDevicePointer(),
+                    &pmeDispersionBsplineModuliX.getDevicePointer(), &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
+                    &dispersionInfluenceFunction.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2],
+                    &memberStart.getDevicePointer(), &memberSubsets.getDevicePointer()};
+            if (useTiledEnergy)
+                cu.executeKernel(kernel, computeEnergyArgs, cu.getNumThreadBlocks()*SliceEnergyBlockSize, SliceEnergyBlockSize);
+            else
+                cu.executeKernel(kernel, computeEnergyArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ);
+            stopStage("ljpme.energy");
+        }
 
-            void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeDispersionBsplineModuliX.getDevicePointer(),
-                    &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-            cu.executeKernel(pmeDispersionConvolutionKernel, convolutionArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
+        if (includeForces) {
+            if (!includeEnergy && !computeDerivatives) {
+                startStage("ljpme.convolution");
+                void* convolutionArgs[] = {&grid2.getDevicePointer(), &pmeDispersionBsplineModuliX.getDevicePointer(),
+                        &pmeDispersionBsplineModuliY.getDevicePointer(), &pmeDispersionBsplineModuliZ.getDevicePointer(),
+                        &dispersionInfluenceFunction.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                cu.executeKernel(pmeDispersionConvolutionKernel, convolutionArgs, dispersionGridSizeX*dispersionGridSizeY*dispersionGridSizeZ, 256);
+                stopStage("ljpme.convolution");
+            }
 
+            startStage("ljpme.fft");
             dispersionFft->execFFT(false);
+            stopStage("ljpme.fft");
 
-            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+            startStage("ljpme.interpolation");
+            void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &grid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
                     cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                    &sigmaEpsilon.getDevicePointer(), &subsets.getDevicePointer(), &sliceLambdas.getDevicePointer()};
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &atomGridIndex.getDevicePointer(),
+                    &sigmaEpsilon.getDevicePointer(), &atomGrids.getDevicePointer(), &reciprocalSliceLambdas->getDevicePointer(),
+                    &theta.getDevicePointer(), &dtheta.getDevicePointer(), &gridPoint.getDevicePointer(), &sliceForces.getDevicePointer()};
             cu.executeKernel(pmeInterpolateDispersionForceKernel, interpolateArgs, cu.getNumAtoms(), 128);
+            stopStage("ljpme.interpolation");
         }
-        if (usePmeStream) {
-            cuEventRecord(pmeSyncEvent, pmeStream);
-            cu.restoreDefaultStream();
+    }
+    if (useDispersionStream) {
+        cuEventRecord(dispersionJoinEvent, dispersionStream);
+        cuStreamWaitEvent(pmeStream, dispersionJoinEvent, 0);
+        cu.setCurrentStream(pmeStream);
+    }
+}
+
+void CudaCalcSlicedNonbondedForceKernel::capturePmeGraph(int variant, bool includeForces, bool includeEnergy, void* recipBoxVectorPointer[3]) {
+    // Record the kernel sequence without executing it.  An existing executable graph is updated in place
+    // when possible, since this is much cheaper than instantiating a new one.
+
+    CUgraph graph;
+    CHECK_RESULT(cuStreamBeginCapture(pmeStream, CU_STREAM_CAPTURE_MODE_THREAD_LOCAL), "Error capturing reciprocal space graph for SlicedNonbondedForce");
+    executePmeKernels(includeForces, includeEnergy, recipBoxVectorPointer, false);
+    CHECK_RESULT(cuStreamEndCapture(pmeStream, &graph), "Error capturing reciprocal space graph for SlicedNonbondedForce");
+    CUgraphExec& exec = pmeGraphExec[variant];
+    if (exec != NULL) {
+#if CUDA_VERSION >= 12000
+        CUgraphExecUpdateResultInfo updateInfo;
+        CUresult result = cuGraphExecUpdate(exec, graph, &updateInfo);
+#else
+        CUgraphNode errorNode;
+        CUgraphExecUpdateResult updateResult;
+        CUresult result = cuGraphExecUpdate(exec, graph, &errorNode, &updateResult);
+#endif
+        if (result != CUDA_SUCCESS) {
+            cuGraphExecDestroy(exec);
+            exec = NULL;
         }
     }
-    if (!hasOffsets && includeReciprocal) {
-        map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
-        for (int i = 0; i < numSubsets; i++) {
-            ScalingParameterInfo info = sliceScalingParams[sliceIndex(i, i)];
-            if (info.hasDerivativeCoulomb)
-                energyParamDerivs[info.nameCoulomb] += subsetSelfEnergy[i].x;
-            if (doLJPME && info.hasDerivativeLJ)
-                energyParamDerivs[info.nameLJ] += subsetSelfEnergy[i].y;
+    if (exec == NULL) {
+#if CUDA_VERSION >= 12000
+        CUresult result = cuGraphInstantiate(&exec, graph, 0);
+#else
+        CUresult result = cuGraphInstantiate(&exec, graph, NULL, NULL, 0);
+#endif
+        cuGraphDestroy(graph);
+        CHECK_RESULT(result, "Error instantiating reciprocal space graph for SlicedNonbondedForce");
+    }
+    else
+        cuGraphDestroy(graph);
+}
+
+bool CudaCalcSlicedNonbondedForceKernel::updateChargedParticles() {
+    bool changed = false;
+    for (int i = 0; i < chargedParticles.size(); i++) {
+        char charged = (baseParticleParamVec[i].x != 0 || hasChargeOffset[i]);
+        if (charged != chargedParticles[i]) {
+            chargedParticles[i] = charged;
+            changed = true;
         }
     }
-    return energy;
+    return changed;
+}
+
+bool CudaCalcSlicedNonbondedForceKernel::updateSmallSubsets() {
+    // The slot of each subset does not change, even if the number of particles in a small subset
+    // grows beyond the threshold.
+
+    pmeSlotsVec.resize(subsetsVec.size());
+    for (int i = 0; i < subsetsVec.size(); i++)
+        pmeSlotsVec[i] = subsetSlots[subsetsVec[i]];
+    pmeSlots.upload(pmeSlotsVec);
+    vector<int> atoms, slotStart;
+    vector<int> particleSubsets(subsetsVec.begin(), subsetsVec.begin()+cu.getNumAtoms());
+    listSmallSubsetAtoms(particleSubsets, chargedParticles, subsetSlots, numGridSlots, atoms, slotStart);
+    vector<int2> smallAtomsVec(smallAtoms.getSize(), make_int2(0, 0));
+    for (int i = 0; i < atoms.size()/2; i++)
+        smallAtomsVec[i] = make_int2(atoms[2*i], atoms[2*i+1]);
+    smallAtoms.upload(smallAtomsVec);
+    smallSlotStart.upload(slotStart);
+    int numFactors = max(1, slotStart.back())*(gridSizeX+gridSizeY+gridSizeZ/2+1);
+    if (smallAtomFactors.isInitialized() && smallAtomFactors.getSize() >= numFactors)
+        return false;
+    int elementSize = (cu.getUseDoublePrecision() ? sizeof(double4) : sizeof(float4));
+    if (smallAtomFactors.isInitialized())
+        smallAtomFactors.resize(numFactors);
+    else
+        smallAtomFactors.initialize(cu, numFactors, elementSize, "smallAtomFactors");
+    return true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::updateDispersionAtomGrids() {
+    // The particles of subsets without grids have no epsilons, so any grid can hold their zero C6.
+
+    vector<int> atomGrids(cu.getPaddedNumAtoms(), 0);
+    for (int i = 0; i < cu.getNumAtoms(); i++)
+        atomGrids[i] = max(dispersionSubsetGrids[subsetsVec[i]], 0);
+    dispersionAtomGrids.upload(atomGrids);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::recomputeSelfEnergies(const vector<bool>& affected) {
+    bool includeSelfEnergy = ((nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) && (computeCoulombRecip || cpuPme != NULL));
+    if (!includeSelfEnergy && !computeDispersionRecip)
+        return;
+    for (int i = 0; i < numSubsets; i++)
+        if (affected[i])
+            subsetSelfEnergy[i] = make_double2(0, 0);
+    for (int i = 0; i < cu.getNumAtoms(); i++) {
+        if (!affected[subsetsVec[i]])
+            continue;
+        const float4& params = baseParticleParamVec[i];
+        double2& energy = subsetSelfEnergy[subsetsVec[i]];
+        if (includeSelfEnergy)
+            energy.x -= params.x*params.x*ONE_4PI_EPS0*alpha/sqrt(M_PI);
+        if (computeDispersionRecip)
+            energy.y += params.z*pow(params.y*dispersionAlpha, 6)/3.0;
+    }
 }
 
 void CudaCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force) {
-    // Make sure the new parameters are acceptable.
+    // Make sure the new parameters are acceptable.  They are read in parallel into staging arrays that
+    // are kept between calls, so that repeated updates do not reallocate them.
 
     ContextSelector selector(cu);
     if (force.getNumParticles() != cu.getNumAtoms())
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
-    if (!hasCoulomb || !hasLJ) {
-        for (int i = 0; i < force.getNumParticles(); i++) {
+    stagedParticleParamVec.assign(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
+    atomic<bool> invalidCharge(false), invalidEpsilon(false);
+    parallelFor(threads, force.getNumParticles(), [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
             double charge, sigma, epsilon;
             force.getParticleParameters(i, charge, sigma, epsilon);
+            stagedParticleParamVec[i] = make_float4(charge, sigma, epsilon, 0);
             if (!hasCoulomb && charge != 0.0)
-                throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Coulomb interactions, because all charges were originally 0");
+                invalidCharge = true;
             if (!hasLJ && epsilon != 0.0)
-                throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Lennard-Jones interactions, because all epsilons were originally 0");
+                invalidEpsilon = true;
         }
-    }
-    for (int i = 0; i < force.getNumParticles(); i++)
-        subsetsVec[i] = force.getParticleSubset(i);
-    subsets.upload(subsetsVec);
-    set<int> exceptionsWithOffsets;
-    for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
-        string param;
-        int exception;
-        double charge, sigma, epsilon;
-        force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
-        exceptionsWithOffsets.insert(exception);
-    }
-    vector<int> exceptions;
-    for (int i = 0; i < force.getNumExceptions(); i++) {
-        int particle1, particle2;
-        double chargeProd, sigma, epsilon;
-        force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
-        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end())
-            exceptions.push_back(i);
-    }
+    });
+    if (invalidCharge)
+        throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Coulomb interactions, because all charges were originally 0");
+    if (invalidEpsilon)
+        throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Lennard-Jones interactions, because all epsilons were originally 0");
+    readExceptions(force, threads, allExceptionAtoms, allExceptionParams, stagedExceptions);
+    if (stagedExceptions != nonExcludedExceptions)
+        throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
     int numContexts = cu.getPlatformData().contexts.size();
-    int startIndex = cu.getContextIndex()*exceptions.size()/numContexts;
-    int endIndex = (cu.getContextIndex()+1)*exceptions.size()/numContexts;
+    int startIndex = getHeldRange(sortedExceptions.size()).first;
+    int endIndex = getHeldRange(sortedExceptions.size()).second;
     int numExceptions = endIndex-startIndex;
     if (numExceptions != exceptionAtoms.size())
         throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
 
-    // Record the per-particle parameters.
+    // Record the subsets.
 
-    vector<float4> baseParticleParamVec(cu.getPaddedNumAtoms(), make_float4(0, 0, 0, 0));
-    const vector<int>& order = cu.getAtomIndex();
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        double charge, sigma, epsilon;
-        force.getParticleParameters(i, charge, sigma, epsilon);
-        baseParticleParamVec[i] = make_float4(charge, sigma, epsilon, 0);
-    }
-    baseParticleParams.upload(baseParticleParamVec);
+    stagedSubsetsVec.assign(cu.getPaddedNumAtoms(), 0);
+    vector<int> particleSubsets = force.getParticleSubsets();
+    copy(particleSubsets.begin(), particleSubsets.end(), stagedSubsetsVec.begin());
+    if (numDispersionGrids < numSubsets)
+        for (int i = 0; i < force.getNumParticles(); i++)
+            if ((stagedParticleParamVec[i].z != 0 || hasEpsilonOffset[i]) && dispersionSubsetGrids[stagedSubsetsVec[i]] < 0)
+                throw OpenMMException("updateParametersInContext: The LJPME grids do not include the subsets whose epsilons were all originally 0");
 
     // Record the exceptions.
 
-    if (numExceptions > 0) {
-        vector<float4> baseExceptionParamsVec(numExceptions);
-        for (int i = 0; i < numExceptions; i++) {
-            int particle1, particle2;
-            double chargeProd, sigma, epsilon;
-            force.getExceptionParameters(exceptions[startIndex+i], particle1, particle2, chargeProd, sigma, epsilon);
-            if (make_pair(particle1, particle2) != exceptionAtoms[i])
-                throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
-            baseExceptionParamsVec[i] = make_float4(chargeProd, sigma, epsilon, 0);
+    stagedExceptionParamsVec.resize(numExceptions);
+    atomic<bool> pairsChanged(false);
+    parallelFor(threads, numExceptions, [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
+            int j = sortedExceptions[startIndex+i];
+            if (make_pair(allExceptionAtoms[2*j], allExceptionAtoms[2*j+1]) != exceptionAtoms[i])
+                pairsChanged = true;
+            stagedExceptionParamsVec[i] = make_float4(allExceptionParams[3*j], allExceptionParams[3*j+1], allExceptionParams[3*j+2], 0);
         }
-        baseExceptionParams.upload(baseExceptionParamsVec);
+    });
+    if (pairsChanged)
+        throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
+
+    // Upload only the ranges that have actually changed.
+
+    vector<pair<int, int> > changedParticles = findChangedRanges(baseParticleParamVec, stagedParticleParamVec);
+    vector<pair<int, int> > changedSubsets = findChangedRanges(subsetsVec, stagedSubsetsVec);
+    vector<pair<int, int> > changedExceptions = findChangedRanges(baseExceptionParamsVec, stagedExceptionParamsVec);
+    if (changedParticles.size() == 0 && changedSubsets.size() == 0 && changedExceptions.size() == 0)
+        return;
+    for (auto& range : changedParticles)
+        baseParticleParams.uploadSubArray(&stagedParticleParamVec[range.first], range.first, range.second-range.first);
+    for (auto& range : changedSubsets)
+        subsets.uploadSubArray(&stagedSubsetsVec[range.first], range.first, range.second-range.first);
+    for (auto& range : changedExceptions)
+        baseExceptionParams.uploadSubArray(&stagedExceptionParamsVec[range.first], range.first, range.second-range.first);
+
+    // Find the subsets that contain modified particles, before or after the update.  Their self
+    // energies are recomputed from scratch, so that repeated updates do not accumulate rounding error.
+
+    bool ljChanged = (changedSubsets.size() > 0);
+    vector<bool> affected(numSubsets, false);
+    for (int i = 0; i < force.getNumParticles(); i++) {
+        float4& oldParams = baseParticleParamVec[i];
+        float4& newParams = stagedParticleParamVec[i];
+        if (oldParams.x == newParams.x && oldParams.y == newParams.y && oldParams.z == newParams.z && subsetsVec[i] == stagedSubsetsVec[i])
+            continue;
+        if (oldParams.y != newParams.y || oldParams.z != newParams.z)
+            ljChanged = true;
+        affected[subsetsVec[i]] = true;
+        affected[stagedSubsetsVec[i]] = true;
     }
+    baseParticleParamVec.swap(stagedParticleParamVec);
+    subsetsVec.swap(stagedSubsetsVec);
+    baseExceptionParamsVec.swap(stagedExceptionParamsVec);
+    recomputeSelfEnergies(affected);
+
+    // A particle that gains or loses its charge is added to or removed from the small subsets.
+
+    bool chargesChanged = updateChargedParticles();
+    updateSubsetDependentData(changedSubsets.size() > 0 || chargesChanged);
 
     // Compute other values.
 
-    ewaldSelfEnergy = 0.0;
-    subsetSelfEnergy.assign(numSubsets, make_double2(0, 0));
-    if (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) {
-        if (cu.getContextIndex() == 0) {
-            for (int i = 0; i < force.getNumParticles(); i++) {
-                subsetSelfEnergy[subsetsVec[i]].x -= baseParticleParamVec[i].x*baseParticleParamVec[i].x*ONE_4PI_EPS0*alpha/sqrt(M_PI);
-                if (doLJPME)
-                    subsetSelfEnergy[subsetsVec[i]].y += baseParticleParamVec[i].z*pow(baseParticleParamVec[i].y*dispersionAlpha, 6)/3.0;
-            }
-            for (int i = 0; i < force.getNumSubsets(); i++) {
-                int slice = sliceIndex(i, i);
-                ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
-            }
-        }
+    if (ljChanged && force.getUseDispersionCorrection() && cu.getContextIndex() == 0 && (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME)) {
+        if (dispersionCorrection != NULL)
+            delete dispersionCorrection;
+        dispersionCorrection = new SlicedDispersionCorrection(context.getSystem(), force);
+        dispersionCorrection->update(context);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    }
+    cu.invalidateMolecules(info);
+    recomputeParams = true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles) {
+    ContextSelector selector(cu);
+    if (numDispersionGrids < numSubsets)
+        for (int particle : particles)
+            if ((baseParticleParamVec[particle].z != 0 || hasEpsilonOffset[particle]) && dispersionSubsetGrids[force.getParticleSubset(particle)] < 0)
+                throw OpenMMException("reassignSubsetsInContext: The LJPME grids do not include the subsets whose epsilons were all originally 0");
+    vector<int> moved, oldSubsets;
+    for (int particle : particles) {
+        int subset = force.getParticleSubset(particle);
+        if (subset == subsetsVec[particle])
+            continue;
+        moved.push_back(particle);
+        oldSubsets.push_back(subsetsVec[particle]);
+        subsetsVec[particle] = subset;
+    }
+    if (moved.size() == 0)
+        return;
+
+    // Recompute the self energies of the subsets the particles left and joined.
+
+    vector<bool> affected(numSubsets, false);
+    for (int k = 0; k < moved.size(); k++) {
+        affected[oldSubsets[k]] = true;
+        affected[subsetsVec[moved[k]]] = true;
+    }
+    recomputeSelfEnergies(affected);
+
+    // Upload the subsets of the moved particles, grouped into runs of consecutive indices.
+
+    vector<int> sortedMoved(moved);
+    std::sort(sortedMoved.begin(), sortedMoved.end());
+    int start = 0;
+    while (start < sortedMoved.size()) {
+        int end = start+1;
+        while (end < sortedMoved.size() && sortedMoved[end] == sortedMoved[end-1]+1)
+            end++;
+        subsets.uploadSubArray(&subsetsVec[sortedMoved[start]], sortedMoved[start], end-start);
+        start = end;
+    }
+    updateSubsetDependentData(true);
+    if (dispersionCorrection != NULL) {
+        dispersionCorrection->moveParticles(force, moved, oldSubsets);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
     }
-    if (force.getUseDispersionCorrection() && cu.getContextIndex() == 0 && (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME))
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(context.getSystem(), force);
-    cu.invalidateMolecules();
+
+    // The slices of the exceptions and the self energies of charge offsets are recomputed by the
+    // parameters kernel.  Particles in different subsets are not interchangeable.
+
+    cu.invalidateMolecules(info);
     recomputeParams = true;
 }
 
+void CudaCalcSlicedNonbondedForceKernel::updateSubsetDependentData(bool subsetsChanged) {
+    bool includeSelfEnergy = ((nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) && (computeCoulombRecip || cpuPme != NULL));
+    if (includeSelfEnergy || computeDispersionRecip) {
+        ewaldSelfEnergy = 0.0;
+        for (int i = 0; i < numSubsets; i++) {
+            int slice = sliceIndex(i, i);
+            ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+        }
+    }
+    if (subsetsChanged && dispersionAtomGrids.isInitialized())
+        updateDispersionAtomGrids();
+    if (useSmallSubsets && subsetsChanged && updateSmallSubsets()) {
+        for (CUgraphExec& exec : pmeGraphExec)
+            if (exec != NULL) {
+                cuGraphExecDestroy(exec);
+                exec = NULL;
+            }
+    }
+    if (pmeWorkspace)
+        pmeAtomGridIndexSubsetsId = pmeWorkspace->getSubsetsId(useSmallSubsets ? pmeSlotsVec : subsetsVec);
+}
+
 void CudaCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (nonbondedMethod != PME)
         throw OpenMMException("getPMEParametersInContext: This Context is not using PME");
@@ -1211,6 +2990,252 @@ void CudaCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx
     nz = gridSizeZ;
 }
 
+map<string, double> CudaCalcSlicedNonbondedForceKernel::getStageTimings() const {
+    if (stageTimer == NULL)
+        return map<string, double>();
+    return stageTimer->getTimings();
+}
+
+long long CudaCalcSlicedNonbondedForceKernel::getPMEGridMemorySavings() const {
+    return pmeGridMemorySavings;
+}
+
+map<string, long long> CudaCalcSlicedNonbondedForceKernel::getMemoryUsage() const {
+    map<string, long long> usage;
+    for (const CudaArray* array : {&charges, &sigmaEpsilon, &exceptionParams, &exclusionAtoms, &exclusionParams, &baseParticleParams,
+                                   &baseExceptionParams, &particleParamOffsets, &exceptionParamOffsets, &particleOffsetIndices,
+                                   &exceptionOffsetIndices, &globalParams, &selfEnergyBuffer, &subsetSelfEnergies, &cosSinSums,
+                                   &pmeDispersionBsplineModuliX, &pmeDispersionBsplineModuliY, &pmeDispersionBsplineModuliZ,
+                                   &pmeEnergyBuffer, &ljpmeEnergyBuffer, &sliceMemberStart, &sliceMemberSubsets, &cachedPosq,
+                                   &cachedPosqCorrection, &positionsChanged, &exceptionPairs, &exceptionSlices, &subsets, &sliceLambdas,
+                                   &maskedSliceLambdas, &pmeSlots, &smallAtoms, &smallSlotStart, &smallAtomFactors, &lambdaSchedule, &dispersionGrid1,
+                                   &dispersionGrid2, &dispersionAtomGridIndex, &influenceFunction, &dispersionInfluenceFunction,
+                                   &pmeBsplineTheta, &pmeBsplineDTheta, &pmeBsplineGridPoint, &pmeDispersionBsplineTheta, &pmeDispersionBsplineDTheta,
+                                   &pmeDispersionBsplineGridPoint, &sliceForces, &sliceEnergies, &sliceEnergySums})
+        addMemoryUsage(usage, *array);
+
+    // The reciprocal space workspace may be shared with other forces of the context, in which case its
+    // arrays are counted by each of them.
+
+    for (const CudaArray* array : {pmeGrid1, pmeGrid2, pmeBsplineModuliX, pmeBsplineModuliY, pmeBsplineModuliZ, pmeAtomGridIndex})
+        if (array != NULL)
+            addMemoryUsage(usage, *array);
+    if (reportSliceEnergies != NULL)
+        reportSliceEnergies->countMemoryUsage(usage);
+    if (protocolWork != NULL)
+        protocolWork->countMemoryUsage(usage);
+    if (cpuPme != NULL)
+        cpuPme->countMemoryUsage(usage);
+    if (positionStager != NULL)
+        positionStager->countMemoryUsage(usage);
+    return usage;
+}
+
+bool CudaCalcSlicedNonbondedForceKernel::getSliceForces(int slice, vector<Vec3>& forces) {
+    if (!hasSliceForces)
+        return false;
+    ContextSelector selector(cu);
+    int paddedNumAtoms = cu.getPaddedNumAtoms();
+    vector<long long> values(3*paddedNumAtoms);
+    size_t offset = (size_t) 3*slice*paddedNumAtoms*sizeof(long long);
+    CHECK_RESULT(cuMemcpyDtoHAsync(values.data(), sliceForces.getDevicePointer()+offset, values.size()*sizeof(long long), cu.getCurrentStream()),
+            "Error downloading slice forces for SlicedNonbondedForce");
+    CHECK_RESULT(cuStreamSynchronize(cu.getCurrentStream()), "Error downloading slice forces for SlicedNonbondedForce");
+    const vector<int>& order = cu.getAtomIndex();
+    double scale = 1.0/(double) 0x100000000LL;
+    forces.resize(cu.getNumAtoms());
+    for (int i = 0; i < cu.getNumAtoms(); i++)
+        forces[order[i]] = Vec3(values[i], values[i+paddedNumAtoms], values[i+2*paddedNumAtoms])*scale;
+    return true;
+}
+
+bool CudaCalcSlicedNonbondedForceKernel::getSliceEnergies(vector<double>& energies, vector<double>& lambdas) {
+    if (!hasSliceEnergies)
+        return false;
+    ContextSelector selector(cu);
+
+    // The reciprocal space energies of the last evaluation remain in their buffers, which are indexed by
+    // slice, since no slices are merged when slice energies are used.
+
+    int includeCoulombRecip = (sliceEnergiesIncludeReciprocal && pmeEnergyBuffer.isInitialized());
+    int includeLJRecip = (sliceEnergiesIncludeReciprocal && ljpmeEnergyBuffer.isInitialized());
+    CUdeviceptr pmeBuffer = (pmeEnergyBuffer.isInitialized() ? pmeEnergyBuffer.getDevicePointer() : 0);
+    CUdeviceptr ljpmeBuffer = (ljpmeEnergyBuffer.isInitialized() ? ljpmeEnergyBuffer.getDevicePointer() : 0);
+    int bufferSize = (pmeEnergyBuffer.isInitialized() ? pmeEnergyBuffer.getSize()/numSlices : 0);
+    void* args[] = {&sliceEnergies.getDevicePointer(), &pmeBuffer, &ljpmeBuffer, &bufferSize, &includeCoulombRecip, &includeLJRecip,
+                    &sliceEnergySums.getDevicePointer()};
+    cu.executeKernel(sumSliceEnergiesKernel, args, 2*numSlices*SliceEnergySumBlockSize, SliceEnergySumBlockSize);
+    vector<long long> values;
+    sliceEnergySums.download(values);
+    double scale = 1.0/(double) 0x100000000LL;
+    energies.resize(2*numSlices);
+    for (int i = 0; i < 2*numSlices; i++)
+        energies[i] = values[i]*scale + hostSliceEnergies[i];
+    lambdas = lastSliceLambdas;
+    return true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double> >& schedule) {
+    ContextSelector selector(cu);
+    numScheduledParams = parameters.size();
+    numScheduleSteps = schedule.size();
+    scheduleColumns.assign(scalingParamNames.size(), -1);
+    for (int i = 0; i < numScheduledParams; i++) {
+        auto position = find(scalingParamNames.begin(), scalingParamNames.end(), parameters[i]);
+        if (position == scalingParamNames.end())
+            throw OpenMMException("setScalingParameterScheduleInContext: There is no scaling parameter called '"+parameters[i]+"'");
+        scheduleColumns[position-scalingParamNames.begin()] = i;
+    }
+    scheduleValues.clear();
+    vector<double> parameterChanges;
+    for (int step = 0; step < numScheduleSteps; step++)
+        for (int i = 0; i < numScheduledParams; i++) {
+            scheduleValues.push_back(schedule[step][i]);
+            if (step > 0)
+                parameterChanges.push_back(schedule[step][i]-schedule[step-1][i]);
+        }
+    scheduleStartStep = context.getStepCount();
+    lastWorkStep = scheduleStartStep-1;
+    lambdaScheduleStale = true;
+    if (protocolWork != NULL)
+        protocolWork->setSchedule(parameters, parameterChanges);
+}
+
+double CudaCalcSlicedNonbondedForceKernel::getProtocolWork() {
+    ContextSelector selector(cu);
+    return (protocolWork == NULL ? 0.0 : protocolWork->getWork());
+}
+
+void CudaCalcSlicedNonbondedForceKernel::uploadLambdaSchedule() {
+    vector<double> values(scalingParamValues);
+    vector<double2> table((size_t) numScheduleSteps*numSlices, make_double2(0, 0));
+    for (int step = 0; step < numScheduleSteps; step++) {
+        for (int i = 0; i < scalingParamNames.size(); i++)
+            if (scheduleColumns[i] != -1)
+                values[i] = scheduleValues[step*numScheduledParams+scheduleColumns[i]];
+        for (int slice = 0; slice < numSlices; slice++) {
+            int first = sliceParamIndices[slice].first, second = sliceParamIndices[slice].second;
+            table[step*numSlices+slice] = make_double2(first == -1 ? 1.0 : values[first], second == -1 ? 1.0 : values[second]);
+        }
+    }
+    if (!lambdaSchedule.isInitialized())
+        lambdaSchedule.initialize(cu, table.size(), sliceLambdas.getElementSize(), "lambdaSchedule");
+    else if (lambdaSchedule.getSize() != table.size())
+        lambdaSchedule.resize(table.size());
+    if (cu.getUseDoublePrecision())
+        lambdaSchedule.upload(table);
+    else
+        lambdaSchedule.upload(double2Tofloat2(table));
+    lambdaScheduleStale = false;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::compileModule(const string& source, const map<string, string>& defines, function<void(CUmodule)> getKernels) {
+    CudaContext& context = cu;
+    future<CUmodule> module = async(launch::async, [&context, source, defines] () {
+        ContextSelector selector(context);
+        return context.createModule(source, defines);
+    });
+    pendingModules.push_back(make_pair(move(module), getKernels));
+}
+
+void CudaCalcSlicedNonbondedForceKernel::finishCompilation() {
+    // Every compilation is waited for before an error is reported, since they refer to this kernel.
+
+    vector<CUmodule> modules;
+    exception_ptr error;
+    for (auto& pending : pendingModules) {
+        try {
+            modules.push_back(pending.first.get());
+        }
+        catch (...) {
+            if (!error)
+                error = current_exception();
+        }
+    }
+    if (error) {
+        pendingModules.clear();
+        rethrow_exception(error);
+    }
+    for (int i = 0; i < modules.size(); i++)
+        pendingModules[i].second(modules[i]);
+    pendingModules.clear();
+}
+
+pair<int, int> CudaCalcSlicedNonbondedForceKernel::getHeldRange(int size) const {
+    if (balanceLoads)
+        return make_pair(0, size);
+    int numContexts = cu.getPlatformData().contexts.size();
+    return make_pair(cu.getContextIndex()*size/numContexts, (cu.getContextIndex()+1)*size/numContexts);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setLoadShare(double start, double end) {
+    // Only upload the ranges that have changed.  The last device always ends at the last pair.
+
+    if (!balanceLoads)
+        return;
+    ContextSelector selector(cu);
+    int2 newExceptionRange = make_int2((int) (start*numHeldExceptions), end < 1.0 ? (int) (end*numHeldExceptions) : numHeldExceptions);
+    int2 newExclusionRange = make_int2((int) (start*numHeldExclusions), end < 1.0 ? (int) (end*numHeldExclusions) : numHeldExclusions);
+    if (exceptionRange.isInitialized() && (newExceptionRange.x != exceptionRangeVec.x || newExceptionRange.y != exceptionRangeVec.y)) {
+        exceptionRangeVec = newExceptionRange;
+        exceptionRange.upload(&exceptionRangeVec);
+    }
+    if (exclusionRange.isInitialized() && (newExclusionRange.x != exclusionRangeVec.x || newExclusionRange.y != exclusionRangeVec.y)) {
+        exclusionRangeVec = newExclusionRange;
+        exclusionRange.upload(&exclusionRangeVec);
+    }
+}
+
+double CudaCalcSlicedNonbondedForceKernel::getDirectSpaceShare() const {
+    CudaNonbondedUtilities& nb = cu.getNonbondedUtilities();
+    long long totalTiles = (long long) cu.getNumAtomBlocks()*(cu.getNumAtomBlocks()+1)/2;
+    return nb.getNumTiles()/(double) totalTiles;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setDirectSpaceShare(double start, double end) {
+    if (!balanceLoads || (start == directShareStart && end == directShareEnd))
+        return;
+    directShareStart = start;
+    directShareEnd = end;
+    directShareChanged = true;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::setIncludedForceGroups(int groups) {
+    includedGroups = groups;
+}
+
+void CudaCalcSlicedNonbondedForceKernel::stagePositions(ContextImpl& context, const double* positions) {
+    ContextSelector selector(cu);
+    if (positionStager == NULL)
+        positionStager = new PositionStager(cu);
+    positionStager->stage(positions);
+}
+
+void CudaCalcSlicedNonbondedForceKernel::applyStagedPositions(ContextImpl& context) {
+    if (positionStager == NULL)
+        throw OpenMMException("SlicedNonbondedForce: No positions have been staged");
+    ContextSelector selector(cu);
+    positionStager->apply();
+}
+
+bool CudaCalcSlicedNonbondedForceKernel::isReciprocalSliceIncluded(int slice) const {
+    return !useSliceForceGroups || (includedGroups&(1<<sliceReciprocalGroups[slice])) != 0;
+}
+
+string CudaCalcSlicedNonbondedForceKernel::getTunedConfiguration() const {
+    return tunedConfiguration;
+}
+
+string CudaCalcSlicedNonbondedForceKernel::getFFTBackendName() const {
+    if (fft == NULL && dispersionFft == NULL)
+        return "";
+    if (useCudaFFT)
+        return "cuFFT";
+    if (vkfftRegisterBoost != 1)
+        return "VkFFT (registerBoost="+to_string(vkfftRegisterBoost)+")";
+    return "VkFFT";
+}
+
 void CudaCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (!doLJPME)
         throw OpenMMException("getPMEParametersInContext: This Context is not using PME");
@@ -10,7 +10,11 @@
 
 #include "CudaParallelNonbondedSlicingKernels.h"
 #include "CudaNonbondedSlicingKernelSources.h"
+#include "internal/SliceEnergyWriter.h"
+#include "internal/SlicedNonbondedForceImpl.h"
+#include "openmm/OpenMMException.h"
 #include "openmm/common/ContextSelector.h"
+#include <algorithm>
 
 using namespace NonbondedSlicing;
 using namespace OpenMM;
@@ -19,10 +23,15 @@ using namespace std;
 class CudaParallelCalcSlicedNonbondedForceKernel::Task : public CudaContext::WorkTask {
 public:
     Task(ContextImpl& context, CudaCalcSlicedNonbondedForceKernel& kernel, bool includeForce,
-            bool includeEnergy, bool includeDirect, bool includeReciprocal, double& energy) : context(context), kernel(kernel),
-            includeForce(includeForce), includeEnergy(includeEnergy), includeDirect(includeDirect), includeReciprocal(includeReciprocal), energy(energy) {
+            bool includeEnergy, bool includeDirect, bool includeReciprocal, double& energy, double shareStart, double shareEnd,
+            double directStart, double directEnd) : context(context), kernel(kernel),
+            includeForce(includeForce), includeEnergy(includeEnergy), includeDirect(includeDirect), includeReciprocal(includeReciprocal), energy(energy),
+            shareStart(shareStart), shareEnd(shareEnd), directStart(directStart), directEnd(directEnd) {
     }
     void execute() {
+        kernel.setLoadShare(shareStart, shareEnd);
+        if (directStart >= 0.0)
+            kernel.setDirectSpaceShare(directStart, directEnd);
         energy += kernel.execute(context, includeForce, includeEnergy, includeDirect, includeReciprocal);
     }
 private:
@@ -30,37 +39,233 @@ private:
     CudaCalcSlicedNonbondedForceKernel& kernel;
     bool includeForce, includeEnergy, includeDirect, includeReciprocal;
     double& energy;
+    double shareStart, shareEnd, directStart, directEnd;
 };
 
+/**
+ * OpenMM balances the direct space tiles among devices during this many evaluations, after which the
+ * tiles are left to this kernel.
+ */
+static const int OpenMMBalancingEvaluations = 200;
+
 CudaParallelCalcSlicedNonbondedForceKernel::CudaParallelCalcSlicedNonbondedForceKernel(std::string name, const Platform& platform, CudaPlatform::PlatformData& data, const System& system) :
-        CalcSlicedNonbondedForceKernel(name, platform), data(data) {
+        CalcSlicedNonbondedForceKernel(name, platform), data(data), balanceLoads(false) {
     for (int i = 0; i < (int) data.contexts.size(); i++)
         kernels.push_back(Kernel(new CudaCalcSlicedNonbondedForceKernel(name, platform, *data.contexts[i], system)));
 }
 
 void CudaParallelCalcSlicedNonbondedForceKernel::initialize(const System& system, const SlicedNonbondedForce& force) {
+    if (kernels.size() > 1 && SliceEnergyWriter::isRequested(force))
+        throw OpenMMException("SlicedNonbondedForce: slice energy reports are not supported with multiple devices");
     for (int i = 0; i < (int) kernels.size(); i++)
         getKernel(i).initialize(system, force);
+
+    // The devices that compute reciprocal space sums start with half as many exceptions and exclusion
+    // corrections as the others.
+
+    balanceLoads = (kernels.size() > 1 && force.getUseLoadBalancing());
+    loadShares.resize(kernels.size());
+    double total = 0.0;
+    for (int i = 0; i < (int) kernels.size(); i++) {
+        bool ownsReciprocal = (getKernel(i).getComputeCoulombRecip() || getKernel(i).getComputeDispersionRecip());
+        loadShares[i] = (balanceLoads && ownsReciprocal ? 0.5 : 1.0);
+        total += loadShares[i];
+    }
+    for (double& share : loadShares)
+        share /= total;
 }
 
 double CudaParallelCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+    if (balanceLoads)
+        rebalanceLoads();
+    double shareStart = 0.0, directStart = (directShares.size() > 0 ? 0.0 : -1.0);
     for (int i = 0; i < (int) data.contexts.size(); i++) {
         CudaContext& cu = *data.contexts[i];
         ComputeContext::WorkThread& thread = cu.getWorkThread();
-        thread.addTask(new Task(context, getKernel(i), includeForces, includeEnergy, includeDirect, includeReciprocal, data.contextEnergy[i]));
+        bool last = (i == (int) data.contexts.size()-1);
+        double shareEnd = (last ? 1.0 : shareStart+loadShares[i]);
+        double directEnd = (directShares.size() > 0 ? (last ? 1.0 : directStart+directShares[i]) : -1.0);
+        thread.addTask(new Task(context, getKernel(i), includeForces, includeEnergy, includeDirect, includeReciprocal, data.contextEnergy[i], shareStart, shareEnd, directStart, directEnd));
+        shareStart = shareEnd;
+        directStart = directEnd;
     }
     return 0.0;
 }
 
+void CudaParallelCalcSlicedNonbondedForceKernel::rebalanceLoads() {
+    // The times are those of the last evaluation each device has finished, which are read without
+    // waiting for the current ones.  One percent of the pairs is moved at a time, and only if the
+    // slowest device takes more than two percent longer than the fastest.
+
+    int slowest = 0, fastest = 0;
+    vector<double> times(kernels.size());
+    for (int i = 0; i < (int) kernels.size(); i++) {
+        times[i] = getKernel(i).getLastEvaluationTime();
+        if (times[i] < 0.0)
+            return;
+        if (times[i] > times[slowest])
+            slowest = i;
+        if (times[i] < times[fastest])
+            fastest = i;
+    }
+    if (times[slowest] <= 1.02*times[fastest])
+        return;
+    double transfer = min(0.01, loadShares[slowest]);
+    loadShares[slowest] -= transfer;
+    loadShares[fastest] += transfer;
+
+    // OpenMM only balances the direct space tiles during the first evaluations.  After that, they
+    // are moved here, starting from the shares OpenMM left.
+
+    if (data.contexts[0]->getComputeForceCount() <= OpenMMBalancingEvaluations)
+        return;
+    if (directShares.size() == 0) {
+        directShares.resize(kernels.size());
+        for (int i = 0; i < (int) kernels.size(); i++)
+            directShares[i] = getKernel(i).getDirectSpaceShare();
+    }
+    transfer = min(0.01, directShares[slowest]);
+    directShares[slowest] -= transfer;
+    directShares[fastest] += transfer;
+}
+
 void CudaParallelCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force) {
     for (int i = 0; i < (int) kernels.size(); i++)
         getKernel(i).copyParametersToContext(context, force);
 }
 
+void CudaParallelCalcSlicedNonbondedForceKernel::reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles) {
+    for (int i = 0; i < (int) kernels.size(); i++)
+        getKernel(i).reassignSubsets(context, force, particles);
+}
+
 void CudaParallelCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
-    dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getPMEParameters(alpha, nx, ny, nz);
+    // Report the grid of the device that actually uses it, which may have been tuned.
+
+    for (const Kernel& kernel : kernels) {
+        const CudaCalcSlicedNonbondedForceKernel& impl = dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl());
+        if (impl.getComputeCoulombRecip()) {
+            impl.getPMEParameters(alpha, nx, ny, nz);
+            return;
+        }
+    }
+}
+
+map<string, double> CudaParallelCalcSlicedNonbondedForceKernel::getStageTimings() const {
+    // With more than one device, each stage name is prefixed with the index of its device.
+
+    map<string, double> timings;
+    for (int i = 0; i < kernels.size(); i++) {
+        const CudaCalcSlicedNonbondedForceKernel& kernel = dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl());
+        for (auto& stage : kernel.getStageTimings())
+            timings[kernels.size() == 1 ? stage.first : "device"+to_string(i)+"."+stage.first] = stage.second;
+    }
+    return timings;
+}
+
+long long CudaParallelCalcSlicedNonbondedForceKernel::getPMEGridMemorySavings() const {
+    long long savings = 0;
+    for (const Kernel& kernel : kernels)
+        savings += dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).getPMEGridMemorySavings();
+    return savings;
+}
+
+map<string, long long> CudaParallelCalcSlicedNonbondedForceKernel::getMemoryUsage() const {
+    map<string, long long> usage;
+    for (int i = 0; i < kernels.size(); i++) {
+        const CudaCalcSlicedNonbondedForceKernel& kernel = dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl());
+        for (auto& array : kernel.getMemoryUsage())
+            usage[kernels.size() == 1 ? array.first : "device"+to_string(i)+"."+array.first] = array.second;
+    }
+    return usage;
+}
+
+bool CudaParallelCalcSlicedNonbondedForceKernel::getSliceForces(int slice, vector<Vec3>& forces) {
+    // Each device accumulates the forces due to its own share of the interactions.
+
+    vector<Vec3> deviceForces;
+    for (int i = 0; i < kernels.size(); i++) {
+        if (!dynamic_cast<CudaCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl()).getSliceForces(slice, deviceForces))
+            return false;
+        if (i == 0)
+            forces = deviceForces;
+        else
+            for (int j = 0; j < forces.size(); j++)
+                forces[j] += deviceForces[j];
+    }
+    return true;
+}
+
+bool CudaParallelCalcSlicedNonbondedForceKernel::getSliceEnergies(vector<double>& energies, vector<double>& lambdas) {
+    // Each device accumulates the energies of its own share of the interactions, all with the same lambdas.
+
+    vector<double> deviceEnergies;
+    for (int i = 0; i < kernels.size(); i++) {
+        if (!dynamic_cast<CudaCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl()).getSliceEnergies(deviceEnergies, lambdas))
+            return false;
+        if (i == 0)
+            energies = deviceEnergies;
+        else
+            for (int j = 0; j < energies.size(); j++)
+                energies[j] += deviceEnergies[j];
+    }
+    return true;
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double> >& schedule) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).setScalingParameterSchedule(context, parameters, schedule);
+}
+
+double CudaParallelCalcSlicedNonbondedForceKernel::getProtocolWork() {
+    // Each device accumulates the work due to its own share of the interactions.
+
+    double work = 0.0;
+    for (Kernel& kernel : kernels)
+        work += dynamic_cast<CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).getProtocolWork();
+    return work;
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::setIncludedForceGroups(int groups) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).setIncludedForceGroups(groups);
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::stagePositions(ContextImpl& context, const double* positions) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).stagePositions(context, positions);
+}
+
+void CudaParallelCalcSlicedNonbondedForceKernel::applyStagedPositions(ContextImpl& context) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).applyStagedPositions(context);
+}
+
+string CudaParallelCalcSlicedNonbondedForceKernel::getTunedConfiguration() const {
+    string configurations;
+    for (const Kernel& kernel : kernels) {
+        string configuration = dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).getTunedConfiguration();
+        configurations = SlicedNonbondedForceImpl::mergeTunedConfigurations(configurations, configuration);
+    }
+    return configurations;
+}
+
+string CudaParallelCalcSlicedNonbondedForceKernel::getFFTBackendName() const {
+    for (const Kernel& kernel : kernels) {
+        string name = dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).getFFTBackendName();
+        if (name != "")
+            return name;
+    }
+    return "";
 }
 
 void CudaParallelCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
+    for (const Kernel& kernel : kernels) {
+        const CudaCalcSlicedNonbondedForceKernel& impl = dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernel.getImpl());
+        if (impl.getComputeDispersionRecip()) {
+            impl.getLJPMEParameters(alpha, nx, ny, nz);
+            return;
+        }
+    }
     dynamic_cast<const CudaCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getLJPMEParameters(alpha, nx, ny, nz);
 }
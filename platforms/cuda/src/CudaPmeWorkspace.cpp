@@ -0,0 +1,78 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CudaPmeWorkspace.h"
+#include "openmm/common/ContextSelector.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+class CudaPmeWorkspace::CountEvaluationsPreComputation : public CudaContext::ForcePreComputation {
+public:
+    CountEvaluationsPreComputation(shared_ptr<int> evaluation) : evaluation(evaluation) {
+    }
+    void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        (*evaluation)++;
+    }
+private:
+    shared_ptr<int> evaluation;
+};
+
+namespace {
+
+mutex registryMutex;
+map<pair<CudaContext*, string>, weak_ptr<CudaPmeWorkspace> > registry;
+
+}
+
+CudaPmeWorkspace::CudaPmeWorkspace(CudaContext& context) : sort(NULL), fft(NULL), stream(0), ownsStream(false), gridEvaluation(-1),
+        atomGridIndexEvaluation(-1), atomGridIndexSubsetsId(-1), context(context), evaluation(make_shared<int>(0)) {
+    // The counter is shared with the pre-computation, which the context keeps until it is destroyed.
+
+    context.addPreComputation(new CountEvaluationsPreComputation(evaluation));
+}
+
+CudaPmeWorkspace::~CudaPmeWorkspace() {
+    ContextSelector selector(context);
+    if (sort != NULL)
+        delete sort;
+    if (fft != NULL)
+        delete fft;
+    if (ownsStream)
+        cuStreamDestroy(stream);
+}
+
+shared_ptr<CudaPmeWorkspace> CudaPmeWorkspace::get(CudaContext& context, const string& key) {
+    lock_guard<mutex> lock(registryMutex);
+    for (auto iter = registry.begin(); iter != registry.end(); )
+        if (iter->second.expired())
+            iter = registry.erase(iter);
+        else
+            ++iter;
+    weak_ptr<CudaPmeWorkspace>& entry = registry[make_pair(&context, key)];
+    shared_ptr<CudaPmeWorkspace> workspace = entry.lock();
+    if (!workspace) {
+        workspace = make_shared<CudaPmeWorkspace>(context);
+        entry = workspace;
+    }
+    return workspace;
+}
+
+int CudaPmeWorkspace::getSubsetsId(const vector<int>& subsets) {
+    auto position = find(knownSubsets.begin(), knownSubsets.end(), subsets);
+    if (position != knownSubsets.end())
+        return position-knownSubsets.begin();
+    knownSubsets.push_back(subsets);
+    return knownSubsets.size()-1;
+}
@@ -0,0 +1,81 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CudaStageTimer.h"
+#include "openmm/common/ContextSelector.h"
+#include "openmm/OpenMMException.h"
+
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+using namespace std;
+
+CudaStageTimer::CudaStageTimer(CudaContext& context) : context(context) {
+}
+
+CudaStageTimer::~CudaStageTimer() {
+    ContextSelector selector(context);
+    for (CUevent event : allEvents)
+        cuEventDestroy(event);
+}
+
+CUevent CudaStageTimer::getEvent() {
+    if (freeEvents.empty()) {
+        CUevent event;
+        if (cuEventCreate(&event, CU_EVENT_DEFAULT) != CUDA_SUCCESS)
+            throw OpenMMException("Error creating event for timing SlicedNonbondedForce stages");
+        allEvents.push_back(event);
+        return event;
+    }
+    CUevent event = freeEvents.back();
+    freeEvents.pop_back();
+    return event;
+}
+
+void CudaStageTimer::start(const string& stage, CUstream stream) {
+    // Measurements are read at the start of each stage, so that the number of pending events
+    // stays bounded without ever blocking.
+
+    update(false);
+    CUevent event = getEvent();
+    cuEventRecord(event, stream);
+    started[stage] = event;
+}
+
+void CudaStageTimer::stop(const string& stage, CUstream stream) {
+    auto begin = started.find(stage);
+    if (begin == started.end())
+        return;
+    CUevent event = getEvent();
+    cuEventRecord(event, stream);
+    pending.push_back({stage, begin->second, event});
+    started.erase(begin);
+}
+
+void CudaStageTimer::update(bool wait) {
+    while (!pending.empty()) {
+        Measurement& measurement = pending.front();
+        if (wait)
+            cuEventSynchronize(measurement.end);
+        else if (cuEventQuery(measurement.end) != CUDA_SUCCESS)
+            break;
+        float milliseconds;
+        if (cuEventElapsedTime(&milliseconds, measurement.start, measurement.end) == CUDA_SUCCESS)
+            timings[measurement.stage] += 1e-3*milliseconds;
+        freeEvents.push_back(measurement.start);
+        freeEvents.push_back(measurement.end);
+        pending.pop_front();
+    }
+}
+
+map<string, double> CudaStageTimer::getTimings() {
+    ContextSelector selector(context);
+    update(true);
+    return timings;
+}
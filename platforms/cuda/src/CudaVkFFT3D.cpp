@@ -9,14 +9,17 @@
  * -------------------------------------------------------------------------- */
 
 #include "internal/CudaVkFFT3D.h"
+#include "CommonNonbondedSlicingKernels.h"
 #include "openmm/cuda/CudaContext.h"
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace NonbondedSlicing;
 using namespace OpenMM;
 using namespace std;
 
-CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out) :
+CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out, int registerBoost, const string& cacheDir) :
         CudaFFT3D(context, stream, xsize, ysize, zsize, batch, realToComplex, in, out) {
     int outputZSize = realToComplex ? (zsize/2+1) : zsize;
     size_t realTypeSize = doublePrecision ? sizeof(double) : sizeof(float);
@@ -31,6 +34,7 @@ CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int
     config.num_streams = 1;
     config.stream = &stream;
     config.doublePrecision = doublePrecision;
+    config.registerBoost = registerBoost;
 
     config.FFTdim = 3;
     config.size[0] = zsize;
@@ -52,10 +56,44 @@ CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int
     config.bufferStride[1] = outputZSize*ysize;
     config.bufferStride[2] = outputZSize*ysize*xsize;
 
+    // Generating and compiling the kernels takes a significant part of the time needed to create
+    // a context, so reuse a plan compiled earlier for the same device and grid if there is one.
+
+    string key;
+    vector<char> cachedPlan;
+    if (cacheDir != "") {
+        char deviceName[256];
+        int driverVersion;
+        cuDeviceGetName(deviceName, sizeof(deviceName), context.getDevice());
+        cuDriverGetVersion(&driverVersion);
+        stringstream description;
+        description << "VkFFT " << VkFFTGetVersion() << " CUDA " << driverVersion << " " << deviceName << " ";
+        description << context.getComputeCapability() << " " << sizeof(void*) << " " << doublePrecision << " ";
+        description << xsize << " " << ysize << " " << zsize << " " << batch << " " << realToComplex << " " << registerBoost;
+        key = description.str();
+        if (loadCachedPlan(cacheDir, key, cachedPlan)) {
+            config.loadApplicationFromString = 1;
+            config.loadApplicationString = cachedPlan.data();
+        }
+        else
+            config.saveApplicationToString = 1;
+    }
     app = new VkFFTApplication();
     VkFFTResult result = initializeVkFFT(app, config);
+    if (result != VKFFT_SUCCESS && config.loadApplicationFromString) {
+        // The cached plan could not be used, so generate a new one and replace it.
+
+        delete app;
+        config.loadApplicationFromString = 0;
+        config.loadApplicationString = NULL;
+        config.saveApplicationToString = 1;
+        app = new VkFFTApplication();
+        result = initializeVkFFT(app, config);
+    }
     if (result != VKFFT_SUCCESS)
         throw OpenMMException("Error initializing VkFFT: "+to_string(result));
+    if (config.saveApplicationToString)
+        saveCachedPlan(cacheDir, key, app->saveApplicationString, app->applicationStringSize);
 }
 
 CudaVkFFT3D::~CudaVkFFT3D() {
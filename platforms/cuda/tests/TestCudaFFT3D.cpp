@@ -34,6 +34,17 @@ using namespace std;
 
 static CudaPlatform platform;
 
+/**
+ * A VkFFT transform whose compiled plan is cached, so that running a test a second time checks
+ * the transform loaded from the cache.
+ */
+class CachedCudaVkFFT3D : public CudaVkFFT3D {
+public:
+    CachedCudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out) :
+            CudaVkFFT3D(context, stream, xsize, ysize, zsize, batch, realToComplex, in, out, 1, platform.getPropertyDefaultValue(CudaPlatform::CudaTempDirectory())) {
+    }
+};
+
 template <class FFT3D, typename Real, class Real2>
 void testTransform(bool realToComplex, int xsize, int ysize, int zsize, int batch) {
     System system;
@@ -164,6 +175,8 @@ int main(int argc, char* argv[]) {
             executeTests<CudaVkFFT3D, double, double2>(1);
             executeTests<CudaVkFFT3D, double, double2>(2);
             executeTests<CudaVkFFT3D, double, double2>(3);
+            executeTests<CachedCudaVkFFT3D, double, double2>(2);
+            executeTests<CachedCudaVkFFT3D, double, double2>(2);
         }
         else {
             executeTests<CudaCuFFT3D, float, float2>(1);
@@ -172,6 +185,8 @@ int main(int argc, char* argv[]) {
             executeTests<CudaVkFFT3D, float, float2>(1);
             executeTests<CudaVkFFT3D, float, float2>(2);
             executeTests<CudaVkFFT3D, float, float2>(3);
+            executeTests<CachedCudaVkFFT3D, float, float2>(2);
+            executeTests<CachedCudaVkFFT3D, float, float2>(2);
         }
     }
     catch(const exception& e) {
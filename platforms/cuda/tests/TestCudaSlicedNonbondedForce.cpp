@@ -14,7 +14,7 @@
 // #include <cuda.h>
 #include <string>
 
-void testParallelComputation(SlicedNonbondedForce::NonbondedMethod method) {
+void testParallelComputation(SlicedNonbondedForce::NonbondedMethod method, bool useLoadBalancing=false) {
     System system;
     const int numParticles = 200;
     for (int i = 0; i < numParticles; i++)
@@ -23,6 +23,7 @@ void testParallelComputation(SlicedNonbondedForce::NonbondedMethod method) {
     for (int i = 0; i < numParticles; i++)
         force->addParticle(i%2-0.5, 0.5, 1.0);
     force->setNonbondedMethod(method);
+    force->setUseLoadBalancing(useLoadBalancing);
     system.addForce(force);
     system.setDefaultPeriodicBoxVectors(Vec3(5,0,0), Vec3(0,5,0), Vec3(0,0,5));
     OpenMM_SFMT::SFMT sfmt;
@@ -77,6 +78,20 @@ void testParallelComputation(SlicedNonbondedForce::NonbondedMethod method) {
     ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-4);
     for (int i = 0; i < numParticles; i++)
         ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+
+    // With load balancing, the shares of the devices change from one evaluation to the next, which
+    // must not change the results.  The direct space tiles only start moving once OpenMM has stopped
+    // balancing them after 200 evaluations.
+
+    if (useLoadBalancing) {
+        for (int step = 0; step < 250; step++) {
+            state1 = context1.getState(State::Forces | State::Energy);
+            state2 = context2.getState(State::Forces | State::Energy);
+            ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-4);
+            for (int i = 0; i < numParticles; i++)
+                ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+        }
+    }
 }
 
 void testReordering() {
@@ -223,14 +238,106 @@ void testUseCuFFT() {
     assertForces(state1, state2, tol);
 }
 
+void testUseCudaGraphs(SlicedNonbondedForce::NonbondedMethod method) {
+    const int numParticles = 200;
+    const double L = 5.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-5 : 1e-4;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        force->addParticle(i%2-0.5, 0.3, 1.0);
+        force->setParticleSubset(i, i%3 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameterDerivative("lambda");
+    system.addForce(force);
+
+    VerletIntegrator integrator1(0.01);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    force->setUseCudaGraphs(true);
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+
+    // Evaluate each kind of request twice so that captured graphs are replayed, then change the box.
+
+    for (int step = 0; step < 2; step++) {
+        for (int repeat = 0; repeat < 2; repeat++) {
+            State state1 = context1.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+            State state2 = context2.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+            assertEnergy(state1, state2, tol);
+            assertForces(state1, state2, tol);
+            ASSERT_EQUAL_TOL(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), tol);
+            state1 = context1.getState(State::Forces);
+            state2 = context2.getState(State::Forces);
+            assertForces(state1, state2, tol);
+        }
+        context1.setPeriodicBoxVectors(Vec3(1.05*L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, 0.95*L));
+        context2.setPeriodicBoxVectors(Vec3(1.05*L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, 0.95*L));
+    }
+}
+
+void testAutoselectFFT() {
+    const int numParticles = 200;
+    const double L = 5.0;
+    double tol = platform.getPropertyDefaultValue("Precision") == "double" ? 1e-5 : 1e-4;
+    System system;
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(SlicedNonbondedForce::PME);
+    force->setCutoffDistance(1.0);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        force->addParticle(i%2-0.5, 0.3, 1.0);
+        force->setParticleSubset(i, i%3 == 0 ? 1 : 0);
+        positions[i] = Vec3(L*genrand_real2(sfmt), L*genrand_real2(sfmt), L*genrand_real2(sfmt));
+    }
+    system.addForce(force);
+
+    VerletIntegrator integrator1(0.01);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    ASSERT_EQUAL("VkFFT", force->getFFTBackendInContext(context1));
+    force->setAutoselectFFT(true);
+    VerletIntegrator integrator2(0.01);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    ASSERT(force->getFFTBackendInContext(context2) != "");
+
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+}
+
 void runPlatformTests() {
     testParallelComputation(SlicedNonbondedForce::NoCutoff);
     testParallelComputation(SlicedNonbondedForce::Ewald);
     testParallelComputation(SlicedNonbondedForce::PME);
     testParallelComputation(SlicedNonbondedForce::LJPME);
+    testParallelComputation(SlicedNonbondedForce::PME, true);
+    testParallelComputation(SlicedNonbondedForce::LJPME, true);
     testReordering();
     testDeterministicForces();
     testUseCuFFT();
+    testUseCudaGraphs(SlicedNonbondedForce::PME);
+    testUseCudaGraphs(SlicedNonbondedForce::LJPME);
+    testAutoselectFFT();
     // if (canRunHugeTest())
     //     testHugeSystem();
 }
@@ -12,11 +12,15 @@
  * -------------------------------------------------------------------------- */
 
 #include "NonbondedSlicingKernels.h"
+#include "internal/SlicedDispersionCorrection.h"
 #include "internal/OpenCLVkFFT3D.h"
+#include "internal/OpenCLStageTimer.h"
 #include "openmm/internal/ContextImpl.h"
+#include "openmm/internal/ThreadPool.h"
 #include "openmm/opencl/OpenCLContext.h"
 #include "openmm/opencl/OpenCLArray.h"
 #include "openmm/opencl/OpenCLSort.h"
+#include <map>
 #include <vector>
 #include <algorithm>
 
@@ -29,7 +33,7 @@ class OpenCLCalcSlicedNonbondedForceKernel : public CalcSlicedNonbondedForceKern
 public:
     OpenCLCalcSlicedNonbondedForceKernel(std::string name, const Platform& platform, OpenCLContext& cl, const System& system) :
             CalcSlicedNonbondedForceKernel(name, platform), hasInitializedKernel(false), cl(cl), sort(NULL),
-            fft(NULL), dispersionFft(NULL), usePmeQueue(false) {};
+            fft(NULL), dispersionFft(NULL), stageTimer(NULL), reportSliceEnergies(NULL), usePmeQueue(false), hasLambdasUploadEvent(false), useTiledEnergy(false), useTiledEwald(false), shareAtomGridIndex(false), pmeGridMemorySavings(0), useSliceForces(false), hasSliceForces(false), useSliceEnergies(false), hasSliceEnergies(false), sliceEnergiesIncludeReciprocal(false), dispersionCorrection(NULL), useEnergyCache(false), energyCacheValid(false), useSliceForceGroups(false), includedGroups(-1), reciprocalGroupsMask(0), maskedLambdasGroups(-1), hasMaskedLambdasUploadEvent(false), reciprocalSliceLambdas(NULL), useSmallSubsets(false), numDispersionGrids(0), pmeSubsets(NULL), protocolWork(NULL), addEnergy(NULL), numScheduledParams(0), numScheduleSteps(0), scheduleStartStep(0), lastWorkStep(-1), lambdaScheduleStale(false), useInfluenceFunction(false), useCachedBSplines(false), positionStager(NULL) {};
     ~OpenCLCalcSlicedNonbondedForceKernel();
     /**
      * Initialize the kernel.
@@ -56,6 +60,14 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Move some particles to other subsets without copying any other parameter.
+     *
+     * @param context    the context in which to move the particles
+     * @param force      the SlicedNonbondedForce, which already holds the new subsets
+     * @param particles  the indices of the moved particles
+     */
+    void reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles);
     /**
      * Get the parameters being used for PME.
      *
@@ -74,7 +86,126 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the configuration found by PME grid tuning, in the format of
+     * SlicedNonbondedForceImpl::formatTunedConfiguration(), or an empty string if nothing was tuned.
+     */
+    std::string getTunedConfiguration() const;
+    /**
+     * Get the name of the FFT library used for the reciprocal space sums, or an empty string if
+     * no FFTs are performed.
+     */
+    std::string getFFTBackendName() const;
+    /**
+     * Get the total time taken by each stage of the calculation, in seconds, if stage profiling is enabled.
+     */
+    std::map<std::string, double> getStageTimings() const;
+    /**
+     * Get the number of bytes of device memory saved by storing the PME grids in compact form.
+     */
+    long long getPMEGridMemorySavings() const;
+    /**
+     * Get the number of bytes of device memory taken by each array allocated by this kernel.
+     */
+    std::map<std::string, long long> getMemoryUsage() const;
+    /**
+     * Get the forces that a slice contributed to the last evaluation that computed forces.
+     *
+     * @param slice   the index of the slice
+     * @param forces  on exit, the force on each particle due to the slice
+     * @return false if no evaluation has computed forces yet
+     */
+    bool getSliceForces(int slice, std::vector<Vec3>& forces);
+    /**
+     * Get the Coulomb and Lennard-Jones energies of every slice in the last evaluation.
+     *
+     * @param energies  on exit, the Coulomb and Lennard-Jones energies of each slice
+     * @param lambdas   on exit, the Coulomb and Lennard-Jones scaling factors applied to each slice
+     * @return false if the last evaluation did not compute the energy
+     */
+    bool getSliceEnergies(std::vector<double>& energies, std::vector<double>& lambdas);
+    /**
+     * Set the values that the scaling parameters take at each step of a nonequilibrium protocol.
+     *
+     * @param context     the context in which the protocol is run
+     * @param parameters  the names of the scheduled scaling parameters, or an empty vector to remove
+     *                    the schedule
+     * @param schedule    the values of the scheduled parameters at each step
+     */
+    void setScalingParameterSchedule(ContextImpl& context, const std::vector<std::string>& parameters, const std::vector<std::vector<double> >& schedule);
+    /**
+     * Get the work accumulated since the schedule was set.
+     */
+    double getProtocolWork();
+    /**
+     * Set the force groups included in the next evaluation.
+     *
+     * @param groups  a bit mask of the force groups to include
+     */
+    void setIncludedForceGroups(int groups);
+    /**
+     * Start copying the positions of a frame to the device on a separate queue.
+     *
+     * @param context    the context for which the positions are staged
+     * @param positions  the positions of all particles, stored as x, y, and z for each particle
+     */
+    void stagePositions(ContextImpl& context, const double* positions);
+    /**
+     * Make the positions staged by the last call to stagePositions() the positions of the context.
+     *
+     * @param context    the context whose positions are replaced
+     */
+    void applyStagedPositions(ContextImpl& context);
 private:
+    /**
+     * Measure the time taken by the forward and inverse transforms of the subset grids for a
+     * candidate PME grid size.
+     */
+    double timePmeTransforms(int xsize, int ysize, int zsize);
+    /**
+     * Record which particles have charges or charge offsets, and return whether any of them changed.
+     */
+    bool updateChargedParticles();
+    /**
+     * Recompute from scratch the self energies of the subsets flagged in affected, using the current
+     * parameters and subsets of all particles, and update the total self energy.
+     */
+    void recomputeSelfEnergies(const vector<bool>& affected);
+    /**
+     * Update the grid slot of each particle and the lists of particles in small subsets after the
+     * subsets have been set or changed.
+     */
+    void updateSmallSubsets();
+    /**
+     * Upload the dispersion grid of each particle after the subsets have been set or changed.  This is
+     * only needed when some subsets have no dispersion grids.
+     */
+    void updateDispersionAtomGrids();
+    /**
+     * Upload the lambdas of every slice at every step of the schedule, which depend on the current
+     * values of the unscheduled scaling parameters.
+     */
+    void uploadLambdaSchedule();
+    /**
+     * Update the position cache and get whether the reciprocal space slice energies of the previous
+     * evaluation can be reused, which requires that it computed them for the same positions, periodic
+     * box, and parameters other than the scaling parameters, and that forces are not requested.
+     */
+    bool reuseEnergyCache(bool includeForces, bool includeEnergy, bool paramsRecomputed);
+    /**
+     * Start measuring a stage in the current queue, if stage profiling is enabled.
+     */
+    void startStage(const std::string& stage) {
+        if (stageTimer != NULL)
+            stageTimer->start(stage, cl.getQueue());
+    }
+    /**
+     * Finish measuring a stage in the current queue, if stage profiling is enabled.
+     */
+    void stopStage(const std::string& stage) {
+        if (stageTimer != NULL)
+            stageTimer->stop(stage, cl.getQueue());
+    }
     class SortTrait : public OpenCLSort::SortTrait {
         int getDataSize() const {return 8;}
         int getKeySize() const {return 4;}
@@ -91,6 +222,9 @@ private:
     class SyncQueuePostComputation;
     class AddEnergyPostComputation;
     class DispersionCorrectionPostComputation;
+    class ReportSliceEnergiesPostComputation;
+    class ProtocolWorkPostComputation;
+    class PositionStager;
     OpenCLContext& cl;
     ForceInfo* info;
     bool hasInitializedKernel;
@@ -106,6 +240,8 @@ private:
     OpenCLArray particleOffsetIndices;
     OpenCLArray exceptionOffsetIndices;
     OpenCLArray globalParams;
+    OpenCLArray selfEnergyBuffer;
+    OpenCLArray subsetSelfEnergies;
     OpenCLArray cosSinSums;
     OpenCLArray pmeGrid1;
     OpenCLArray pmeGrid2;
@@ -115,20 +251,35 @@ private:
     OpenCLArray pmeDispersionBsplineModuliX;
     OpenCLArray pmeDispersionBsplineModuliY;
     OpenCLArray pmeDispersionBsplineModuliZ;
+    OpenCLArray influenceFunction;
+    OpenCLArray dispersionInfluenceFunction;
     OpenCLArray pmeBsplineTheta;
+    OpenCLArray pmeBsplineDTheta;
+    OpenCLArray pmeBsplineGridPoint;
     OpenCLArray pmeAtomRange;
     OpenCLArray pmeAtomGridIndex;
     OpenCLArray pmeEnergyBuffer;
     OpenCLArray ljpmeEnergyBuffer;
+    OpenCLArray sliceMemberStart;
+    OpenCLArray sliceMemberSubsets;
+    OpenCLArray cachedPosq;
+    OpenCLArray cachedPosqCorrection;
+    OpenCLArray positionsChanged;
+    Vec3 cachedBoxVectors[3];
+    Vec3 influenceBoxVectors[3];
     OpenCLSort* sort;
     cl::CommandQueue pmeQueue;
     cl::Event pmeSyncEvent;
     OpenCLVkFFT3D* fft;
     OpenCLVkFFT3D* dispersionFft;
     AddEnergyPostComputation* addEnergy;
-    cl::Kernel computeParamsKernel, computeExclusionParamsKernel;
+    PositionStager* positionStager;
+    OpenCLStageTimer* stageTimer;
+    ReportSliceEnergiesPostComputation* reportSliceEnergies;
+    cl::Kernel computeParamsKernel, computeExclusionParamsKernel, reduceSelfEnergiesKernel;
     cl::Kernel ewaldSumsKernel;
     cl::Kernel ewaldForcesKernel;
+    cl::Kernel ewaldEnergyKernel;
     cl::Kernel pmeAtomRangeKernel;
     cl::Kernel pmeDispersionAtomRangeKernel;
     cl::Kernel pmeZIndexKernel;
@@ -141,34 +292,104 @@ private:
     cl::Kernel pmeDispersionFinishSpreadChargeKernel;
     cl::Kernel pmeConvolutionKernel;
     cl::Kernel pmeDispersionConvolutionKernel;
+    cl::Kernel pmeConvolutionEnergyKernel;
+    cl::Kernel pmeDispersionConvolutionEnergyKernel;
+    cl::Kernel pmeInfluenceFunctionKernel;
+    cl::Kernel pmeDispersionInfluenceFunctionKernel;
+    cl::Kernel pmeBSplinesKernel;
+    cl::Kernel pmeDispersionBSplinesKernel;
     cl::Kernel pmeEvalEnergyKernel;
     cl::Kernel pmeDispersionEvalEnergyKernel;
     cl::Kernel pmeInterpolateForceKernel;
     cl::Kernel pmeDispersionInterpolateForceKernel;
+    cl::Kernel smallAtomFactorsKernel;
+    cl::Kernel smallStructureFactorsKernel;
+    cl::Kernel combinePotentialsKernel;
+    cl::Kernel smallInterpolateForceKernel;
+    cl::Kernel updatePositionCacheKernel;
     std::string realToFixedPoint;
     std::map<std::string, std::string> pmeDefines;
     std::vector<std::pair<int, int> > exceptionAtoms;
+    std::vector<int> sortedExceptions, nonExcludedExceptions, stagedExceptions;
     OpenCLArray exceptionPairs;
     OpenCLArray exceptionSlices;
     std::vector<std::string> paramNames;
+    std::string fftCacheDir, tunedConfiguration;
     std::vector<double> paramValues;
     double ewaldSelfEnergy, alpha, dispersionAlpha;
-    int gridSizeX, gridSizeY, gridSizeZ;
+    int gridSizeX, gridSizeY, gridSizeZ, pmeOrder;
     int dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ;
-    bool hasCoulomb, hasLJ, usePmeQueue, doLJPME, usePosqCharges, recomputeParams, hasOffsets;
+    bool hasCoulomb, hasLJ, usePmeQueue, doLJPME, usePosqCharges, recomputeParams, hasOffsets, hasSelfEnergyOffsets;
+    bool shareAtomGridIndex, useInfluenceFunction, useCachedBSplines;
     NonbondedMethod nonbondedMethod;
-    static const int PmeOrder = 5;
+    static const int MaxPmeOrder = 8;
 
-    int numSubsets, numSlices;
-    bool hasDerivatives;
-    vector<int> subsetsVec;
+    int numSubsets, numSlices, numEffectiveSlices;
+    vector<int> effectiveSlices;
+    bool useTiledEnergy;
+    bool useTiledEwald;
+    bool hasDerivatives, computeDerivatives, useDerivativesOnDemand;
+    long long pmeGridMemorySavings;
+    bool useSliceForces, hasSliceForces;
+    OpenCLArray sliceForces;
+    bool useSliceEnergies, hasSliceEnergies, sliceEnergiesIncludeReciprocal;
+    OpenCLArray sliceEnergies, sliceEnergySums;
+    cl::Kernel sumSliceEnergiesKernel;
+    std::vector<double> hostSliceEnergies, lastSliceLambdas;
+    SlicedDispersionCorrection* dispersionCorrection;
+    bool useEnergyCache, energyCacheValid;
+    bool useSliceForceGroups;
+    int includedGroups, reciprocalGroupsMask, maskedLambdasGroups;
+    vector<int> sliceDirectGroups, sliceReciprocalGroups;
+    ThreadPool threads;
+    vector<int> subsetsVec, stagedSubsetsVec, allExceptionAtoms;
+    vector<mm_float4> baseParticleParamVec, baseExceptionParamsVec, stagedParticleParamVec, stagedExceptionParamsVec;
+    vector<double> allExceptionParams;
     vector<double> dispersionCoefficients;
     vector<mm_double2> sliceLambdasVec, subsetSelfEnergy;
     vector<ScalingParameterInfo> sliceScalingParams;
+    vector<string> scalingParamNames;
+    vector<double> scalingParamValues;
+    vector<pair<int, int> > sliceParamIndices;
+    vector<char> lambdasStaging, maskedLambdasStaging;
+    cl::Event lambdasUploadEvent, maskedLambdasUploadEvent;
+    bool hasLambdasUploadEvent, hasMaskedLambdasUploadEvent;
     OpenCLArray subsets;
     OpenCLArray sliceLambdas;
+    OpenCLArray maskedSliceLambdas;
+    OpenCLArray* reciprocalSliceLambdas;
+    bool useSmallSubsets;
+    int numGridSlots;
+    vector<int> subsetSlots, pmeSlotsVec;
+    vector<char> hasChargeOffset, chargedParticles;
+    OpenCLArray pmeSlots;
+    OpenCLArray* pmeSubsets;
+    OpenCLArray smallAtoms;
+    OpenCLArray smallSlotStart;
+    OpenCLArray smallAtomFactors;
+    int numDispersionGrids;
+    vector<int> dispersionSubsetGrids;
+    vector<char> hasEpsilonOffset, dispersiveParticles;
+    OpenCLArray dispersionAtomGrids;
+    OpenCLArray dispersionSliceMemberStart;
+    OpenCLArray dispersionSliceMemberSubsets;
+    ProtocolWorkPostComputation* protocolWork;
+    OpenCLArray lambdaSchedule;
+    vector<int> scheduleColumns;
+    vector<double> scheduleValues;
+    int numScheduledParams, numScheduleSteps;
+    long long scheduleStartStep, lastWorkStep;
+    bool lambdaScheduleStale;
 
     string getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ);
+    /**
+     * Get the condition that selects the slices whose direct space interactions belong to a force group.
+     */
+    string getSliceGroupCondition(int group);
+    /**
+     * Get whether the reciprocal space part of a slice is included in the current evaluation.
+     */
+    bool isReciprocalSliceIncluded(int slice) const;
 
     vector<mm_float2> double2Tofloat2(vector<mm_double2> input) {
         vector<mm_float2> output(input.size());
@@ -0,0 +1,68 @@
+#ifndef __OPENMM_OPENCLSTAGETIMER_H__
+#define __OPENMM_OPENCLSTAGETIMER_H__
+
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/opencl/OpenCLContext.h"
+#include <chrono>
+#include <map>
+#include <string>
+
+using namespace OpenMM;
+
+namespace NonbondedSlicing {
+
+/**
+ * This class measures the time taken by the stages of a calculation.  The command queues created
+ * by OpenMM do not support profiling, so each stage is timed on the host between two calls to
+ * finish().  This makes every step slower, but gives an accurate breakdown of its cost.
+ */
+
+class OpenCLStageTimer {
+public:
+    /**
+     * Start measuring a stage.
+     *
+     * @param stage  the name of the stage
+     * @param queue  the command queue in which the stage is executed
+     */
+    void start(const std::string& stage, cl::CommandQueue& queue) {
+        queue.finish();
+        started[stage] = std::chrono::steady_clock::now();
+    }
+    /**
+     * Finish measuring a stage started with the same name.
+     *
+     * @param stage  the name of the stage
+     * @param queue  the command queue in which the stage is executed
+     */
+    void stop(const std::string& stage, cl::CommandQueue& queue) {
+        auto begin = started.find(stage);
+        if (begin == started.end())
+            return;
+        queue.finish();
+        timings[stage] += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin->second).count();
+        started.erase(begin);
+    }
+    /**
+     * Get the total time taken by each stage so far, in seconds.
+     */
+    std::map<std::string, double> getTimings() const {
+        return timings;
+    }
+private:
+    std::map<std::string, std::chrono::steady_clock::time_point> started;
+    std::map<std::string, double> timings;
+};
+
+} // namespace NonbondedSlicing
+
+#endif // __OPENMM_OPENCLSTAGETIMER_H__
@@ -14,6 +14,7 @@
 #include "openmm/opencl/OpenCLArray.h"
 #define VKFFT_BACKEND 3 // OpenCL
 #include "vkFFT.h"
+#include <string>
 
 using namespace OpenMM;
 
@@ -49,8 +50,9 @@ public:
      * @param realToComplex  if true, a real-to-complex transform will be done.  Otherwise, it is complex-to-complex.
      * @param in      the data to transform, ordered such that in[x*ysize*zsize + y*zsize + z] contains element (x, y, z)
      * @param out     on exit, this contains the transformed data
+     * @param cacheDir  the directory in which compiled plans are cached, or an empty string to disable caching
      */
-    OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out);
+    OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out, const std::string& cacheDir="");
     ~OpenCLVkFFT3D();
     /**
      * Perform a Fourier transform.
@@ -11,14 +11,19 @@
 #include "OpenCLNonbondedSlicingKernels.h"
 #include "OpenCLNonbondedSlicingKernelSources.h"
 #include "CommonNonbondedSlicingKernelSources.h"
+#include "CommonNonbondedSlicingKernels.h"
 #include "SlicedNonbondedForce.h"
 #include "internal/SlicedNonbondedForceImpl.h"
+#include "internal/SliceEnergyWriter.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/opencl/OpenCLForceInfo.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
 #include <cstring>
 #include <map>
+#include <set>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 
 using namespace NonbondedSlicing;
@@ -91,10 +96,10 @@ private:
 
 class OpenCLCalcSlicedNonbondedForceKernel::SyncQueuePreComputation : public OpenCLContext::ForcePreComputation {
 public:
-    SyncQueuePreComputation(OpenCLContext& cl, cl::CommandQueue queue, int forceGroup) : cl(cl), queue(queue), forceGroup(forceGroup) {
+    SyncQueuePreComputation(OpenCLContext& cl, cl::CommandQueue queue, int forceGroups) : cl(cl), queue(queue), forceGroups(forceGroups) {
     }
     void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0) {
+        if ((groups&forceGroups) != 0) {
             vector<cl::Event> events(1);
             cl.getQueue().enqueueMarkerWithWaitList(NULL, &events[0]);
             queue.enqueueBarrierWithWaitList(&events);
@@ -103,14 +108,17 @@ public:
 private:
     OpenCLContext& cl;
     cl::CommandQueue queue;
-    int forceGroup;
+    int forceGroups;
 };
 
 class OpenCLCalcSlicedNonbondedForceKernel::SyncQueuePostComputation : public OpenCLContext::ForcePostComputation {
 public:
-    SyncQueuePostComputation(OpenCLContext& cl, cl::Event& event, int forceGroup) : cl(cl), event(event), forceGroup(forceGroup) {}
+    SyncQueuePostComputation(OpenCLContext& cl, cl::Event& event, int forceGroups) : cl(cl), event(event), forceGroups(forceGroups) {}
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0) {
+        // The event is only set when the reciprocal space work was actually enqueued.  Waiting for a
+        // null event is an error on some OpenCL implementations.
+
+        if ((groups&forceGroups) != 0 && event() != NULL) {
             vector<cl::Event> events(1);
             events[0] = event;
             event = cl::Event();
@@ -121,17 +129,28 @@ public:
 private:
     OpenCLContext& cl;
     cl::Event& event;
-    int forceGroup;
+    int forceGroups;
 };
 
 class OpenCLCalcSlicedNonbondedForceKernel::AddEnergyPostComputation : public OpenCLContext::ForcePostComputation {
 public:
-    AddEnergyPostComputation(OpenCLContext& cl, int forceGroup) : cl(cl), forceGroup(forceGroup), initialized(false) {
+    AddEnergyPostComputation(OpenCLContext& cl, int forceGroups, OpenCLStageTimer* stageTimer) : cl(cl), forceGroups(forceGroups), stageTimer(stageTimer), initialized(false), computeDerivatives(true) {
     }
-    void initialize(OpenCLArray& pmeEnergyBuffer, OpenCLArray& ljpmeEnergyBuffer, OpenCLArray& sliceLambdas, vector<ScalingParameterInfo> sliceScalingParams) {
-        int numSlices = sliceLambdas.getSize();
+    /**
+     * If the slices belong to different force groups, sliceForceGroups contains the reciprocal space
+     * force group of each slice, and the derivatives are only accumulated for the included slices.
+     * Otherwise, it is empty.
+     */
+    void initialize(OpenCLArray& pmeEnergyBuffer, OpenCLArray& ljpmeEnergyBuffer, OpenCLArray& sliceLambdas, vector<ScalingParameterInfo> sliceScalingParams, const vector<int>& effectiveSlices,
+                    const vector<int>& sliceForceGroups, bool useTiledEnergy) {
+        int numEffectiveSlices = *max_element(effectiveSlices.begin(), effectiveSlices.end())+1;
+        vector<int> representativeSlices(numEffectiveSlices, -1);
+        for (int slice = 0; slice < effectiveSlices.size(); slice++)
+            if (representativeSlices[effectiveSlices[slice]] == -1)
+                representativeSlices[effectiveSlices[slice]] = slice;
         bool doLJPME = ljpmeEnergyBuffer.isInitialized();
-        bufferSize = pmeEnergyBuffer.getSize()/numSlices;
+        bufferSize = pmeEnergyBuffer.getSize()/numEffectiveSlices;
+        workUnits = (useTiledEnergy ? bufferSize*numEffectiveSlices : bufferSize);
         set<string> requestedDerivs;
         for (ScalingParameterInfo info : sliceScalingParams) {
             if (info.hasDerivativeCoulomb)
@@ -140,27 +159,59 @@ public:
                 requestedDerivs.insert(info.nameLJ);
         }
         hasDerivatives = requestedDerivs.size() > 0;
+        useSliceForceGroups = (sliceForceGroups.size() > 0);
         stringstream code;
-        if (hasDerivatives) {
+        if (useTiledEnergy) {
+            // With many slices, look up the lambdas and derivative positions in tables instead.
+
+            representativeSliceArray.initialize<cl_int>(cl, numEffectiveSlices, "representativeSlices");
+            representativeSliceArray.upload(representativeSlices);
+            if (hasDerivatives) {
+                const vector<string>& allDerivs = cl.getEnergyParamDerivNames();
+                vector<mm_int2> indices(numEffectiveSlices, mm_int2(-1, -1));
+                for (int slice = 0; slice < numEffectiveSlices; slice++) {
+                    ScalingParameterInfo info = sliceScalingParams[representativeSlices[slice]];
+                    if (requestedDerivs.find(info.nameCoulomb) != requestedDerivs.end())
+                        indices[slice].x = find(allDerivs.begin(), allDerivs.end(), info.nameCoulomb) - allDerivs.begin();
+                    if (doLJPME && requestedDerivs.find(info.nameLJ) != requestedDerivs.end())
+                        indices[slice].y = find(allDerivs.begin(), allDerivs.end(), info.nameLJ) - allDerivs.begin();
+                }
+                derivativeIndices.initialize<mm_int2>(cl, numEffectiveSlices, "derivativeIndices");
+                derivativeIndices.upload(indices);
+            }
+            if (useSliceForceGroups) {
+                vector<cl_int> groups(numEffectiveSlices);
+                for (int slice = 0; slice < numEffectiveSlices; slice++)
+                    groups[slice] = sliceForceGroups[representativeSlices[slice]];
+                effectiveSliceGroups.initialize<cl_int>(cl, numEffectiveSlices, "effectiveSliceGroups");
+                effectiveSliceGroups.upload(groups);
+            }
+        }
+        else if (hasDerivatives) {
             const vector<string>& allDerivs = cl.getEnergyParamDerivNames();
             for (string param : requestedDerivs) {
                 int position = find(allDerivs.begin(), allDerivs.end(), param) - allDerivs.begin();
                 code<<"energyParamDerivs[index*"<<allDerivs.size()<<"+"<<position<<"] += ";
-                for (int slice = 0; slice < numSlices; slice++) {
-                    ScalingParameterInfo info = sliceScalingParams[slice];
+                for (int slice = 0; slice < numEffectiveSlices; slice++) {
+                    ScalingParameterInfo info = sliceScalingParams[representativeSlices[slice]];
+                    string included = (useSliceForceGroups ? "((groups>>"+cl.intToString(sliceForceGroups[representativeSlices[slice]])+")&1)*" : "");
                     if (info.nameCoulomb == param)
-                        code<<"+clEnergy["<<slice<<"]";
+                        code<<"+"<<included<<"clEnergy["<<slice<<"]";
                     if (doLJPME && info.nameLJ == param)
-                        code<<"+ljEnergy["<<slice<<"]";
+                        code<<"+"<<included<<"ljEnergy["<<slice<<"]";
                 }
                 code<<";"<<endl;
             }
         }
         map<string, string> replacements, defines;
-        replacements["NUM_SLICES"] = cl.intToString(numSlices);
+        replacements["NUM_EFFECTIVE_SLICES"] = cl.intToString(numEffectiveSlices);
+        replacements["REPRESENTATIVE_SLICES"] = toInitializerList(representativeSlices);
         replacements["USE_LJPME"] = doLJPME ? "1" : "0";
         replacements["HAS_DERIVATIVES"] = hasDerivatives ? "1" : "0";
         replacements["ADD_DERIVATIVES"] = code.str();
+        replacements["NUM_DERIVATIVES"] = cl.intToString(cl.getEnergyParamDerivNames().size());
+        replacements["USE_TILED_ENERGY"] = useTiledEnergy ? "1" : "0";
+        replacements["USE_SLICE_FORCE_GROUPS"] = useSliceForceGroups ? "1" : "0";
         string source = cl.replaceStrings(CommonNonbondedSlicingKernelSources::pmeAddEnergy, replacements);
         cl::Program program = cl.createProgram(source, defines);
         addEnergyKernel = cl::Kernel(program, "addEnergy");
@@ -172,48 +223,310 @@ public:
         if (doLJPME)
             addEnergyKernel.setArg<cl::Buffer>(arg++, ljpmeEnergyBuffer.getDeviceBuffer());
         addEnergyKernel.setArg<cl::Buffer>(arg++, sliceLambdas.getDeviceBuffer());
-        addEnergyKernel.setArg<cl_int>(arg, bufferSize);
+        addEnergyKernel.setArg<cl_int>(arg++, bufferSize);
+        if (useTiledEnergy) {
+            addEnergyKernel.setArg<cl::Buffer>(arg++, representativeSliceArray.getDeviceBuffer());
+            if (hasDerivatives)
+                addEnergyKernel.setArg<cl::Buffer>(arg++, derivativeIndices.getDeviceBuffer());
+        }
+        if (useSliceForceGroups) {
+            groupsArg = arg++;
+            if (useTiledEnergy)
+                addEnergyKernel.setArg<cl::Buffer>(arg++, effectiveSliceGroups.getDeviceBuffer());
+        }
         initialized = true;
     }
     bool isInitialized() {
         return initialized;
     }
+    /**
+     * Set whether the derivatives must be accumulated in the current evaluation, even if the energy is not
+     * requested.  This is always the case unless the derivatives are computed on demand.
+     */
+    void setComputeDerivatives(bool compute) {
+        computeDerivatives = compute;
+    }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((includeEnergy || hasDerivatives) && (groups&(1<<forceGroup)) != 0)
-            cl.executeKernel(addEnergyKernel, bufferSize);
+        if ((includeEnergy || (hasDerivatives && computeDerivatives)) && (groups&forceGroups) != 0) {
+            if (useSliceForceGroups)
+                addEnergyKernel.setArg<cl_int>(groupsArg, groups);
+            if (stageTimer != NULL)
+                stageTimer->start("addEnergy", cl.getQueue());
+            cl.executeKernel(addEnergyKernel, workUnits);
+            if (stageTimer != NULL)
+                stageTimer->stop("addEnergy", cl.getQueue());
+        }
         return 0.0;
     }
 private:
     OpenCLContext& cl;
+    OpenCLStageTimer* stageTimer;
     cl::Kernel addEnergyKernel;
-    int forceGroup;
-    int bufferSize;
+    OpenCLArray representativeSliceArray;
+    OpenCLArray derivativeIndices;
+    OpenCLArray effectiveSliceGroups;
+    int forceGroups, groupsArg;
+    int bufferSize, workUnits;
+    bool initialized, computeDerivatives;
+    bool hasDerivatives, useSliceForceGroups;
+};
+
+class OpenCLCalcSlicedNonbondedForceKernel::ReportSliceEnergiesPostComputation : public OpenCLContext::ForcePostComputation {
+public:
+    ReportSliceEnergiesPostComputation(OpenCLContext& cl, const SlicedNonbondedForce& force, int forceGroup) :
+            cl(cl), forceGroup(forceGroup), interval(force.getSliceEnergyReportInterval()), pendingStep(-1), initialized(false) {
+        names = SliceEnergyWriter::getReportedNames(force);
+        writer = new SliceEnergyWriter(names, force.getSliceEnergyReportFile(), force.getSliceEnergyCallback());
+    }
+    ~ReportSliceEnergiesPostComputation() {
+        // Deleting the writer delivers all pending reports, which may still be reading the host buffer.
+
+        delete writer;
+    }
+    void setStep(long long step) {
+        if (writer->isDue(step, interval))
+            pendingStep = step;
+    }
+    bool isPending() const {
+        return pendingStep >= 0;
+    }
+    void countMemoryUsage(map<string, long long>& usage) const {
+        addMemoryUsage(usage, reportedDerivs);
+        addMemoryUsage(usage, reportBuffer);
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if (pendingStep < 0 || (groups&(1<<forceGroup)) == 0)
+            return 0.0;
+        if (!initialized)
+            initialize();
+
+        // Contributions computed on the host are captured now, since the workspace is reset at every evaluation.
+
+        int numReported = names.size();
+        map<string, double>& energyParamDerivs = cl.getEnergyParamDerivWorkspace();
+        vector<double> hostValues(numReported, 0.0);
+        for (int i = 0; i < numReported; i++)
+            if (energyParamDerivs.find(names[i]) != energyParamDerivs.end())
+                hostValues[i] = energyParamDerivs[names[i]];
+
+        // Sum up the device contributions into a free slot and start a non-blocking download.
+
+        writer->waitForCapacity();
+        int slot = writer->getNumSubmitted()%writer->getCapacity();
+        reduceKernel.setArg<cl::Buffer>(0, cl.getEnergyParamDerivBuffer().getDeviceBuffer());
+        reduceKernel.setArg<cl_int>(1, cl.getEnergyParamDerivBuffer().getSize()/cl.getEnergyParamDerivNames().size());
+        reduceKernel.setArg<cl::Buffer>(2, reportedDerivs.getDeviceBuffer());
+        reduceKernel.setArg<cl::Buffer>(3, reportBuffer.getDeviceBuffer());
+        reduceKernel.setArg<cl_int>(4, slot);
+        cl.executeKernel(reduceKernel, numReported*ReportBlockSize, ReportBlockSize);
+        int elementSize = reportBuffer.getElementSize();
+        char* staging = &hostBuffer[slot*numReported*elementSize];
+        cl::Event event;
+        cl.getQueue().enqueueReadBuffer(reportBuffer.getDeviceBuffer(), CL_FALSE, slot*numReported*elementSize, numReported*elementSize, staging, NULL, &event);
+        cl.getQueue().flush();
+        writer->submit(pendingStep, [event, staging, elementSize, hostValues] () {
+            event.wait();
+            vector<double> values(hostValues);
+            for (int i = 0; i < values.size(); i++)
+                values[i] += (elementSize == sizeof(double) ? ((double*) staging)[i] : ((float*) staging)[i]);
+            return values;
+        });
+        pendingStep = -1;
+        return 0.0;
+    }
+private:
+    void initialize() {
+        // This is deferred to the first report, when all energy parameter derivatives have been registered.
+
+        const vector<string>& allDerivs = cl.getEnergyParamDerivNames();
+        vector<int> indices;
+        for (string name : names) {
+            int position = find(allDerivs.begin(), allDerivs.end(), name)-allDerivs.begin();
+            if (position == allDerivs.size())
+                throw OpenMMException("SlicedNonbondedForce: unknown energy parameter derivative "+name);
+            indices.push_back(position);
+        }
+        int numReported = names.size();
+        int capacity = writer->getCapacity();
+        int elementSize = cl.getEnergyParamDerivBuffer().getElementSize();
+        reportedDerivs.initialize<int>(cl, numReported, "reportedDerivs");
+        reportedDerivs.upload(indices);
+        reportBuffer.initialize(cl, capacity*numReported, elementSize, "reportBuffer");
+        hostBuffer.resize(capacity*numReported*elementSize);
+        map<string, string> defines;
+        defines["NUM_REPORTED"] = cl.intToString(numReported);
+        defines["NUM_DERIVATIVES"] = cl.intToString(allDerivs.size());
+        defines["REPORT_BLOCK_SIZE"] = cl.intToString(ReportBlockSize);
+        cl::Program program = cl.createProgram(CommonNonbondedSlicingKernelSources::sliceEnergyReport, defines);
+        reduceKernel = cl::Kernel(program, "reduceReportedDerivatives");
+        initialized = true;
+    }
+    OpenCLContext& cl;
+    SliceEnergyWriter* writer;
+    vector<string> names;
+    int forceGroup, interval;
+    long long pendingStep;
     bool initialized;
-    bool hasDerivatives;
+    cl::Kernel reduceKernel;
+    OpenCLArray reportedDerivs;
+    OpenCLArray reportBuffer;
+    vector<char> hostBuffer;
+};
+
+class OpenCLCalcSlicedNonbondedForceKernel::ProtocolWorkPostComputation : public OpenCLContext::ForcePostComputation {
+public:
+    ProtocolWorkPostComputation(OpenCLContext& cl, int forceGroup) : cl(cl), forceGroup(forceGroup), numScheduled(0), numSteps(0), pendingStep(-1), initialized(false) {
+    }
+    /**
+     * Start accumulating the work of a new schedule.  The changes of the scheduled parameters from
+     * each step to the next are stored in consecutive rows of parameterChanges.
+     */
+    void setSchedule(const vector<string>& names, const vector<double>& parameterChanges) {
+        numScheduled = names.size();
+        numSteps = (numScheduled == 0 ? 0 : parameterChanges.size()/numScheduled);
+        pendingStep = -1;
+        hostWork.assign(numSteps, 0.0);
+        if (numSteps == 0)
+            return;
+        if (!initialized)
+            initialize();
+        const vector<string>& allDerivs = cl.getEnergyParamDerivNames();
+        vector<int> indices;
+        for (string name : names) {
+            int position = find(allDerivs.begin(), allDerivs.end(), name)-allDerivs.begin();
+            if (position == allDerivs.size())
+                throw OpenMMException("SlicedNonbondedForce: unknown energy parameter derivative "+name);
+            indices.push_back(position);
+        }
+        resizeArray<int>(scheduledDerivs, numScheduled, "scheduledDerivs");
+        scheduledDerivs.upload(indices);
+        this->names = names;
+        hostChanges = parameterChanges;
+        int elementSize = cl.getEnergyParamDerivBuffer().getElementSize();
+        if (elementSize == sizeof(double)) {
+            resizeArray<double>(changes, parameterChanges.size(), "parameterChanges");
+            resizeArray<double>(stepWork, numSteps, "stepWork");
+            changes.upload(parameterChanges);
+        }
+        else {
+            resizeArray<float>(changes, parameterChanges.size(), "parameterChanges");
+            resizeArray<float>(stepWork, numSteps, "stepWork");
+            changes.upload(vector<float>(parameterChanges.begin(), parameterChanges.end()));
+        }
+        cl.clearBuffer(stepWork);
+    }
+    /**
+     * Request the work of a step to be computed at the end of the current evaluation.
+     */
+    void setStep(int step) {
+        pendingStep = step;
+    }
+    bool isPending() const {
+        return pendingStep >= 0;
+    }
+    void countMemoryUsage(map<string, long long>& usage) const {
+        addMemoryUsage(usage, scheduledDerivs);
+        addMemoryUsage(usage, changes);
+        addMemoryUsage(usage, stepWork);
+    }
+    /**
+     * Get the total work of all steps computed so far.  This waits for the device to finish.
+     */
+    double getWork() {
+        double work = 0.0;
+        for (double value : hostWork)
+            work += value;
+        if (numSteps == 0)
+            return work;
+        if (stepWork.getElementSize() == sizeof(double)) {
+            vector<double> values;
+            stepWork.download(values);
+            for (double value : values)
+                work += value;
+        }
+        else {
+            vector<float> values;
+            stepWork.download(values);
+            for (float value : values)
+                work += value;
+        }
+        return work;
+    }
+    double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
+        if (pendingStep < 0 || (groups&(1<<forceGroup)) == 0)
+            return 0.0;
+
+        // Contributions computed on the host are taken now, since the workspace is reset at every evaluation.
+
+        map<string, double>& energyParamDerivs = cl.getEnergyParamDerivWorkspace();
+        hostWork[pendingStep] = 0.0;
+        for (int i = 0; i < numScheduled; i++)
+            if (energyParamDerivs.find(names[i]) != energyParamDerivs.end())
+                hostWork[pendingStep] += energyParamDerivs[names[i]]*hostChanges[numScheduled*pendingStep+i];
+        stepWorkKernel.setArg<cl::Buffer>(0, cl.getEnergyParamDerivBuffer().getDeviceBuffer());
+        stepWorkKernel.setArg<cl_int>(1, cl.getEnergyParamDerivBuffer().getSize()/cl.getEnergyParamDerivNames().size());
+        stepWorkKernel.setArg<cl_int>(2, numScheduled);
+        stepWorkKernel.setArg<cl::Buffer>(3, scheduledDerivs.getDeviceBuffer());
+        stepWorkKernel.setArg<cl::Buffer>(4, changes.getDeviceBuffer());
+        stepWorkKernel.setArg<cl_int>(5, pendingStep);
+        stepWorkKernel.setArg<cl::Buffer>(6, stepWork.getDeviceBuffer());
+        cl.executeKernel(stepWorkKernel, ReportBlockSize, ReportBlockSize);
+        pendingStep = -1;
+        return 0.0;
+    }
+private:
+    void initialize() {
+        map<string, string> defines;
+        defines["NUM_DERIVATIVES"] = cl.intToString(cl.getEnergyParamDerivNames().size());
+        defines["REPORT_BLOCK_SIZE"] = cl.intToString(ReportBlockSize);
+        cl::Program program = cl.createProgram(CommonNonbondedSlicingKernelSources::protocolWork, defines);
+        stepWorkKernel = cl::Kernel(program, "computeStepWork");
+        initialized = true;
+    }
+    template <class T>
+    void resizeArray(OpenCLArray& array, int size, const string& name) {
+        if (!array.isInitialized())
+            array.initialize<T>(cl, size, name);
+        else if (array.getSize() != size)
+            array.resize(size);
+    }
+    OpenCLContext& cl;
+    vector<string> names;
+    vector<double> hostChanges, hostWork;
+    int forceGroup, numScheduled, numSteps, pendingStep;
+    bool initialized;
+    cl::Kernel stepWorkKernel;
+    OpenCLArray scheduledDerivs;
+    OpenCLArray changes;
+    OpenCLArray stepWork;
 };
 
 class OpenCLCalcSlicedNonbondedForceKernel::DispersionCorrectionPostComputation : public OpenCLContext::ForcePostComputation {
 public:
-    DispersionCorrectionPostComputation(OpenCLContext& cl, vector<double>& coefficients, vector<mm_double2>& sliceLambdas, vector<ScalingParameterInfo>& sliceScalingParams, int forceGroup) :
-                                        cl(cl), coefficients(coefficients), sliceLambdas(sliceLambdas), sliceScalingParams(sliceScalingParams), forceGroup(forceGroup) {
+    DispersionCorrectionPostComputation(OpenCLContext& cl, vector<double>& coefficients, vector<mm_double2>& sliceLambdas, vector<ScalingParameterInfo>& sliceScalingParams, const vector<int>& sliceForceGroups) :
+                                        cl(cl), coefficients(coefficients), sliceLambdas(sliceLambdas), sliceScalingParams(sliceScalingParams), sliceForceGroups(sliceForceGroups) {
         numSlices = coefficients.size();
         hasDerivatives = false;
         for (auto info : sliceScalingParams)
             hasDerivatives = hasDerivatives || info.hasDerivativeLJ;
+        forceGroups = 0;
+        for (int group : sliceForceGroups)
+            forceGroups |= 1<<group;
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
         double energy = 0.0;
-        if ((includeEnergy || hasDerivatives) && (groups&(1<<forceGroup)) != 0) {
+        if ((includeEnergy || hasDerivatives) && (groups&forceGroups) != 0) {
             mm_double4 boxSize = cl.getPeriodicBoxSizeDouble();
             double volume = boxSize.x*boxSize.y*boxSize.z;
             if (includeEnergy)
                 for (int slice = 0; slice < numSlices; slice++)
-                    energy += sliceLambdas[slice].y*coefficients[slice]/volume;
+                    if ((groups&(1<<sliceForceGroups[slice])) != 0)
+                        energy += sliceLambdas[slice].y*coefficients[slice]/volume;
             if (hasDerivatives) {
                 map<string, double>& energyParamDerivs = cl.getEnergyParamDerivWorkspace();
                 for (int slice = 0; slice < numSlices; slice++) {
                     ScalingParameterInfo info = sliceScalingParams[slice];
-                    if (info.hasDerivativeLJ)
+                    if (info.hasDerivativeLJ && (groups&(1<<sliceForceGroups[slice])) != 0)
                         energyParamDerivs[info.nameLJ] += coefficients[slice]/volume;
                 }
             }
@@ -225,18 +538,119 @@ private:
     vector<double>& coefficients;
     vector<mm_double2>& sliceLambdas;
     vector<ScalingParameterInfo>& sliceScalingParams;
-    int forceGroup;
+    vector<int> sliceForceGroups;
+    int forceGroups;
     int numSlices;
     bool hasDerivatives;
 };
 
+class OpenCLCalcSlicedNonbondedForceKernel::PositionStager {
+public:
+    PositionStager(OpenCLContext& cl) : cl(cl), numStaged(0) {
+        // Positions are staged in the precision of the integration, in the original order of the atoms.
+
+        int numAtoms = cl.getNumAtoms();
+        useDouble = (cl.getUseDoublePrecision() || cl.getUseMixedPrecision());
+        frameBytes = 3*numAtoms*(useDouble ? sizeof(double) : sizeof(float));
+        for (int slot = 0; slot < 2; slot++) {
+            stagedPositions[slot].initialize(cl, 3*numAtoms, useDouble ? sizeof(double) : sizeof(float), "stagedPositions");
+            hostBuffers[slot].resize(frameBytes);
+            uploaded[slot] = applied[slot] = false;
+        }
+        map<string, string> defines;
+        defines["NUM_ATOMS"] = cl.intToString(numAtoms);
+        if (cl.getUseMixedPrecision())
+            defines["USE_MIXED_PRECISION"] = "1";
+        cl::Program program = cl.createProgram(CommonNonbondedSlicingKernelSources::stagedPositions, defines);
+        applyKernel = cl::Kernel(program, "applyStagedPositions");
+        queue = cl::CommandQueue(cl.getContext(), cl.getDevice());
+    }
+    ~PositionStager() {
+        queue.finish();
+    }
+    void countMemoryUsage(map<string, long long>& usage) const {
+        for (const OpenCLArray& staged : stagedPositions)
+            addMemoryUsage(usage, staged);
+    }
+    void stage(const double* positions) {
+        // The host buffer of a slot can be overwritten once its last upload has finished, and the device
+        // array once the kernel that read it has.
+
+        int slot = numStaged%2;
+        if (uploaded[slot])
+            uploadedEvents[slot].wait();
+        char* staging = hostBuffers[slot].data();
+        int numCoordinates = 3*cl.getNumAtoms();
+        if (useDouble)
+            memcpy(staging, positions, frameBytes);
+        else
+            for (int i = 0; i < numCoordinates; i++)
+                ((float*) staging)[i] = (float) positions[i];
+        vector<cl::Event> events;
+        if (applied[slot])
+            events.push_back(appliedEvents[slot]);
+        queue.enqueueWriteBuffer(stagedPositions[slot].getDeviceBuffer(), CL_FALSE, 0, frameBytes, staging, events.size() > 0 ? &events : NULL, &uploadedEvents[slot]);
+        queue.flush();
+        uploaded[slot] = true;
+        numStaged++;
+    }
+    void apply() {
+        if (numStaged == 0)
+            throw OpenMMException("SlicedNonbondedForce: No positions have been staged");
+        int slot = (numStaged-1)%2;
+        vector<cl::Event> events(1, uploadedEvents[slot]);
+        cl.getQueue().enqueueBarrierWithWaitList(&events);
+        int index = 0;
+        applyKernel.setArg<cl::Buffer>(index++, stagedPositions[slot].getDeviceBuffer());
+        applyKernel.setArg<cl::Buffer>(index++, cl.getPosq().getDeviceBuffer());
+        if (cl.getUseMixedPrecision())
+            applyKernel.setArg<cl::Buffer>(index++, cl.getPosqCorrection().getDeviceBuffer());
+        applyKernel.setArg<cl::Buffer>(index++, cl.getAtomIndexArray().getDeviceBuffer());
+        cl.executeKernel(applyKernel, cl.getNumAtoms());
+        cl.getQueue().enqueueMarkerWithWaitList(NULL, &appliedEvents[slot]);
+        applied[slot] = true;
+
+        // As in UpdateStateDataKernel::setPositions(), the new positions are not displaced by any periodic
+        // box vectors.
+
+        for (auto& offset : cl.getPosCellOffsets())
+            offset = {0, 0, 0, 0};
+    }
+private:
+    OpenCLContext& cl;
+    bool useDouble;
+    int numStaged;
+    size_t frameBytes;
+    cl::Kernel applyKernel;
+    cl::CommandQueue queue;
+    OpenCLArray stagedPositions[2];
+    vector<char> hostBuffers[2];
+    cl::Event uploadedEvents[2], appliedEvents[2];
+    bool uploaded[2], applied[2];
+};
+
 OpenCLCalcSlicedNonbondedForceKernel::~OpenCLCalcSlicedNonbondedForceKernel() {
+    if (positionStager != NULL)
+        delete positionStager;
+    if (dispersionCorrection != NULL)
+        delete dispersionCorrection;
     if (sort != NULL)
         delete sort;
     if (fft != NULL)
         delete fft;
     if (dispersionFft != NULL)
         delete dispersionFft;
+    if (stageTimer != NULL)
+        delete stageTimer;
+}
+
+string OpenCLCalcSlicedNonbondedForceKernel::getSliceGroupCondition(int group) {
+    stringstream condition;
+    int count = 0;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceDirectGroups[slice] == group)
+            condition<<(count++ ? " || " : "")<<"slice=="<<slice;
+    return (count ? "("+condition.str()+")" : "false");
 }
 
 string OpenCLCalcSlicedNonbondedForceKernel::getDerivativeExpression(string param, bool conditionCoulomb, bool conditionLJ) {
@@ -270,24 +684,44 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     for (forceIndex = 0; forceIndex < system.getNumForces() && &system.getForce(forceIndex) != &force; ++forceIndex)
         ;
     string prefix = "slicedNonbonded"+cl.intToString(forceIndex)+"_";
+    if (force.getNonbondedMethod() == SlicedNonbondedForce::NoCutoff && force.getUseTreeCode())
+        throw OpenMMException("SlicedNonbondedForce: The OpenCL platform does not implement the tree code");
+    if (isStageProfilingRequested(force))
+        stageTimer = new OpenCLStageTimer();
 
     realToFixedPoint = Platform::getOpenMMVersion()[0] == '7' ? OpenCLNonbondedSlicingKernelSources::realToFixedPoint : "";
 
     int numParticles = force.getNumParticles();
     numSubsets = force.getNumSubsets();
+    numGridSlots = numSubsets;
     numSlices = force.getNumSlices();
+    effectiveSlices = SlicedNonbondedForceImpl::calcEffectiveSlices(force);
+    numEffectiveSlices = *max_element(effectiveSlices.begin(), effectiveSlices.end())+1;
+    useTiledEnergy = (numEffectiveSlices > SlicedNonbondedForceImpl::MaxUntiledEffectiveSlices);
+    if (useTiledEnergy) {
+        vector<int> memberStart, memberSubsets;
+        groupSlicesByEffectiveSlice(effectiveSlices, numSubsets, memberStart, memberSubsets);
+        sliceMemberStart.initialize<cl_int>(cl, memberStart.size(), "sliceMemberStart");
+        sliceMemberStart.upload(memberStart);
+        sliceMemberSubsets.initialize<cl_int>(cl, memberSubsets.size(), "sliceMemberSubsets");
+        sliceMemberSubsets.upload(memberSubsets);
+    }
+    int energyTileSize = getSliceEnergyTileSize(numSubsets, cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    int slicesPerThread = (numEffectiveSlices+SliceEnergyBlockSize-1)/SliceEnergyBlockSize;
     sliceLambdasVec.resize(numSlices, mm_double2(1, 1));
     subsetSelfEnergy.resize(numSlices, mm_double2(0, 0));
     sliceScalingParams.resize(numSlices, ScalingParameterInfo());
 
     subsetsVec.resize(cl.getPaddedNumAtoms(), 0);
-    for (int i = 0; i < numParticles; i++)
-        subsetsVec[i] = force.getParticleSubset(i);
+    vector<int> particleSubsets = force.getParticleSubsets();
+    copy(particleSubsets.begin(), particleSubsets.end(), subsetsVec.begin());
     subsets.initialize<int>(cl, cl.getPaddedNumAtoms(), "subsets");
     subsets.upload(subsetsVec);
 
     int numDerivs = force.getNumScalingParameterDerivatives();
     hasDerivatives = numDerivs > 0;
+    computeDerivatives = hasDerivatives;
+    useDerivativesOnDemand = force.getUseDerivativesOnDemand();
     set<string> requestedDerivatives;
     for (int i = 0; i < numDerivs; i++)
         requestedDerivatives.insert(force.getScalingParameterDerivativeName(i));
@@ -301,66 +735,138 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         sliceScalingParams[sliceIndex(subset1, subset2)].addInfo(name, includeCoulomb, includeLJ, hasDerivative);
     }
 
+    // Resolve the scaling parameters of every slice into indices of a list of distinct names, so that
+    // each Context parameter is queried only once per step.
+
+    auto scalingParamIndex = [&](const string& name) {
+        auto position = find(scalingParamNames.begin(), scalingParamNames.end(), name);
+        if (position != scalingParamNames.end())
+            return (int) (position-scalingParamNames.begin());
+        scalingParamNames.push_back(name);
+        return (int) scalingParamNames.size()-1;
+    };
+    sliceParamIndices.resize(numSlices, make_pair(-1, -1));
+    for (int slice = 0; slice < numSlices; slice++) {
+        ScalingParameterInfo info = sliceScalingParams[slice];
+        if (info.includeCoulomb)
+            sliceParamIndices[slice].first = scalingParamIndex(info.nameCoulomb);
+        if (info.includeLJ)
+            sliceParamIndices[slice].second = scalingParamIndex(info.nameLJ);
+    }
+    scalingParamValues.resize(scalingParamNames.size(), 1.0);
+
+    // Find the force groups of the direct and reciprocal space parts of every slice.
+
+    useSliceForceGroups = SlicedNonbondedForceImpl::hasSliceForceGroups(force);
+    SlicedNonbondedForceImpl::getSliceForceGroups(force, sliceDirectGroups, sliceReciprocalGroups);
+    set<int> directGroups(sliceDirectGroups.begin(), sliceDirectGroups.end());
+    reciprocalGroupsMask = 0;
+    for (int group : sliceReciprocalGroups)
+        reciprocalGroupsMask |= 1<<group;
+
     size_t sizeOfReal = cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float);
     sliceLambdas.initialize(cl, numSlices, 2*sizeOfReal, "sliceLambdas");
     if (cl.getUseDoublePrecision())
         sliceLambdas.upload(sliceLambdasVec);
     else
         sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
+    lambdasStaging.resize(numSlices*2*sizeOfReal);
 
-    // Identify which exceptions are 1-4 interactions.
+    // If requested, the forces of every slice are accumulated in buffers of their own, which have the
+    // same fixed point layout as the force buffer of the context.
 
-    set<int> exceptionsWithOffsets;
-    for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
-        string param;
-        int exception;
-        double charge, sigma, epsilon;
-        force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
-        exceptionsWithOffsets.insert(exception);
+    useSliceForces = force.getUseSliceForces();
+    if (useSliceForces)
+        sliceForces.initialize<cl_long>(cl, numSlices*3*cl.getPaddedNumAtoms(), "sliceForces");
+
+    // If requested, the Coulomb and Lennard-Jones energies of every slice are accumulated for each atom
+    // in fixed point, and only summed up when they are retrieved.
+
+    useSliceEnergies = force.getUseSliceEnergies();
+    if (useSliceEnergies) {
+        sliceEnergies.initialize<cl_long>(cl, numSlices*2*cl.getPaddedNumAtoms(), "sliceEnergies");
+        sliceEnergySums.initialize<cl_long>(cl, 2*numSlices, "sliceEnergySums");
     }
-    vector<pair<int, int> > exclusions;
-    vector<int> exceptions;
-    map<int, int> exceptionIndex;
-    for (int i = 0; i < force.getNumExceptions(); i++) {
-        int particle1, particle2;
-        double chargeProd, sigma, epsilon;
-        force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
-        exclusions.push_back(pair<int, int>(particle1, particle2));
-        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end()) {
-            exceptionIndex[i] = exceptions.size();
-            exceptions.push_back(i);
-        }
+
+    // With slices in different force groups, the reciprocal space kernels use a copy of the lambdas in which
+    // those of the slices not included in the current evaluation are zero.
+
+    reciprocalSliceLambdas = &sliceLambdas;
+    if (useSliceForceGroups) {
+        maskedSliceLambdas.initialize(cl, numSlices, 2*sizeOfReal, "maskedSliceLambdas");
+        reciprocalSliceLambdas = &maskedSliceLambdas;
+        maskedLambdasStaging.resize(numSlices*2*sizeOfReal);
     }
 
+    // Identify which exceptions are 1-4 interactions.  The particles and parameters of all exceptions are
+    // read in parallel into flat arrays, from which the rest of the setup takes them.
+
+    readExceptions(force, threads, allExceptionAtoms, allExceptionParams, nonExcludedExceptions);
+    int numAllExceptions = force.getNumExceptions();
+    vector<int> exceptions(nonExcludedExceptions), exclusionOrder(numAllExceptions), pairSlices(numAllExceptions);
+    parallelFor(threads, numAllExceptions, [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
+            int subset1 = subsetsVec[allExceptionAtoms[2*i]];
+            int subset2 = subsetsVec[allExceptionAtoms[2*i+1]];
+            exclusionOrder[i] = i;
+            pairSlices[i] = sliceIndex(subset1, subset2);
+        }
+    });
+
+    // Exceptions and exclusion corrections are evaluated in order of slice, so that consecutive threads
+    // mostly load the same lambdas and skip decoupled slices together.
+
+    sortBySlice(exceptions, pairSlices);
+    sortBySlice(exclusionOrder, pairSlices);
+    vector<int> exceptionIndex(numAllExceptions, -1);
+    for (int i = 0; i < exceptions.size(); i++)
+        exceptionIndex[exceptions[i]] = i;
+    sortedExceptions = exceptions;
+
     // Initialize nonbonded interactions.
 
-    vector<mm_float4> baseParticleParamVec(cl.getPaddedNumAtoms(), mm_float4(0, 0, 0, 0));
+    baseParticleParamVec.assign(cl.getPaddedNumAtoms(), mm_float4(0, 0, 0, 0));
     vector<vector<int> > exclusionList(numParticles);
-    hasCoulomb = false;
-    hasLJ = false;
-    for (int i = 0; i < numParticles; i++) {
-        double charge, sigma, epsilon;
-        force.getParticleParameters(i, charge, sigma, epsilon);
-        baseParticleParamVec[i] = mm_float4(charge, sigma, epsilon, 0);
-        exclusionList[i].push_back(i);
-        if (charge != 0.0)
-            hasCoulomb = true;
-        if (epsilon != 0.0)
-            hasLJ = true;
-    }
+    atomic<bool> anyCharge(false), anyEpsilon(false);
+    parallelFor(threads, numParticles, [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
+            double charge, sigma, epsilon;
+            force.getParticleParameters(i, charge, sigma, epsilon);
+            baseParticleParamVec[i] = mm_float4(charge, sigma, epsilon, 0);
+            exclusionList[i].push_back(i);
+            if (charge != 0.0)
+                anyCharge = true;
+            if (epsilon != 0.0)
+                anyEpsilon = true;
+        }
+    });
+    hasCoulomb = anyCharge;
+    hasLJ = anyEpsilon;
+    hasChargeOffset.assign(numParticles, 0);
+    hasEpsilonOffset.assign(numParticles, 0);
     for (int i = 0; i < force.getNumParticleParameterOffsets(); i++) {
         string param;
         int particle;
         double charge, sigma, epsilon;
         force.getParticleParameterOffset(i, param, particle, charge, sigma, epsilon);
-        if (charge != 0.0)
+        if (charge != 0.0) {
             hasCoulomb = true;
-        if (epsilon != 0.0)
+            hasChargeOffset[particle] = 1;
+        }
+        if (epsilon != 0.0) {
             hasLJ = true;
+            hasEpsilonOffset[particle] = 1;
+        }
+    }
+    chargedParticles.resize(numParticles);
+    dispersiveParticles.resize(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        chargedParticles[i] = (baseParticleParamVec[i].x != 0 || hasChargeOffset[i]);
+        dispersiveParticles[i] = (baseParticleParamVec[i].z != 0 || hasEpsilonOffset[i]);
     }
-    for (auto exclusion : exclusions) {
-        exclusionList[exclusion.first].push_back(exclusion.second);
-        exclusionList[exclusion.second].push_back(exclusion.first);
+    for (int i = 0; i < numAllExceptions; i++) {
+        exclusionList[allExceptionAtoms[2*i]].push_back(allExceptionAtoms[2*i+1]);
+        exclusionList[allExceptionAtoms[2*i+1]].push_back(allExceptionAtoms[2*i]);
     }
     nonbondedMethod = CalcSlicedNonbondedForceKernel::NonbondedMethod(force.getNonbondedMethod());
     bool useCutoff = (nonbondedMethod != NoCutoff);
@@ -371,6 +877,16 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     map<string, string> defines;
     defines["HAS_COULOMB"] = (hasCoulomb ? "1" : "0");
     defines["HAS_LENNARD_JONES"] = (hasLJ ? "1" : "0");
+    defines["SKIP_DECOUPLED_SLICES"] = (force.getSkipDecoupledSlices() && !useSliceEnergies ? "1" : "0");
+    stringstream derivativeSlices;
+    int numDerivativeSlices = 0;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceScalingParams[slice].hasDerivativeCoulomb || sliceScalingParams[slice].hasDerivativeLJ)
+            derivativeSlices<<(numDerivativeSlices++ ? " || " : "")<<"slice=="<<slice;
+    defines["SLICE_HAS_DERIVATIVE"] = (numDerivativeSlices ? "("+derivativeSlices.str()+")" : "false");
+    defines["USE_SLICE_FORCE_GROUPS"] = (useSliceForceGroups ? "1" : "0");
+    defines["USE_SLICE_FORCES"] = (useSliceForces ? "1" : "0");
+    defines["USE_SLICE_ENERGIES"] = (useSliceEnergies ? "1" : "0");
     defines["USE_LJ_SWITCH"] = (useCutoff && force.getUseSwitchingFunction() ? "1" : "0");
     if (useCutoff) {
         // Compute the reaction field constants.
@@ -389,8 +905,10 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             defines["LJ_SWITCH_C5"] = cl.doubleToString(6/pow(force.getSwitchingDistance()-force.getCutoffDistance(), 5.0));
         }
     }
-    if (force.getUseDispersionCorrection() && cl.getContextIndex() == 0 && hasLJ && useCutoff && usePeriodic && !doLJPME)
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(system, force);
+    if (force.getUseDispersionCorrection() && cl.getContextIndex() == 0 && hasLJ && useCutoff && usePeriodic && !doLJPME) {
+        dispersionCorrection = new SlicedDispersionCorrection(system, force);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    }
     alpha = 0;
     ewaldSelfEnergy = 0.0;
     map<string, string> paramsDefines;
@@ -429,6 +947,10 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             replacements["NUM_ATOMS"] = cl.intToString(numParticles);
             replacements["NUM_SUBSETS"] = cl.intToString(numSubsets);
             replacements["NUM_SLICES"] = cl.intToString(numSlices);
+            replacements["NUM_EFFECTIVE_SLICES"] = cl.intToString(numEffectiveSlices);
+            replacements["EFFECTIVE_SLICES"] = toInitializerList(effectiveSlices);
+            if (!cl.getUseDoublePrecision() && !cl.getUseMixedPrecision())
+                replacements["USE_FIXED_POINT_ENERGY"] = "1";
             replacements["PADDED_NUM_ATOMS"] = cl.intToString(cl.getPaddedNumAtoms());
             replacements["KMAX_X"] = cl.intToString(kmaxx);
             replacements["KMAX_Y"] = cl.intToString(kmaxy);
@@ -436,21 +958,42 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             replacements["EXP_COEFFICIENT"] = cl.doubleToString(-1.0/(4.0*alpha*alpha));
             replacements["ONE_4PI_EPS0"] = cl.doubleToString(ONE_4PI_EPS0);
             replacements["M_PI"] = cl.doubleToString(M_PI);
-            cl::Program program = cl.createProgram(realToFixedPoint+CommonNonbondedSlicingKernelSources::ewald, replacements);
+            if (useTiledEnergy) {
+                replacements["USE_TILED_ENERGY"] = "1";
+                replacements["ENERGY_TILE_SIZE"] = cl.intToString(energyTileSize);
+                replacements["SLICES_PER_THREAD"] = cl.intToString(slicesPerThread);
+            }
+
+            // On a CPU device, staging the atoms and wave vectors in local memory brings no benefit.  The
+            // untiled kernel is also the one that splits the forces into slice forces.
+
+            useTiledEwald = (cl.getDevice().getInfo<CL_DEVICE_TYPE>() != CL_DEVICE_TYPE_CPU && !useSliceForces);
+            if (useSliceForces)
+                replacements["USE_SLICE_FORCES"] = "1";
+            if (useTiledEwald) {
+                replacements["USE_TILED_EWALD"] = "1";
+                replacements["EWALD_BLOCK_SIZE"] = cl.intToString(OpenCLContext::ThreadBlockSize);
+                replacements["EWALD_FORCE_TILE_SIZE"] = cl.intToString(getEwaldForceTileSize(numSubsets, cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float), OpenCLContext::ThreadBlockSize));
+            }
+            cl::Program program = cl.createProgram(realToFixedPoint+CommonNonbondedSlicingKernelSources::energyAccumulation+CommonNonbondedSlicingKernelSources::ewald, replacements);
             ewaldSumsKernel = cl::Kernel(program, "calculateEwaldCosSinSums");
             ewaldForcesKernel = cl::Kernel(program, "calculateEwaldForces");
+            if (useTiledEnergy)
+                ewaldEnergyKernel = cl::Kernel(program, "calculateEwaldEnergy");
             int elementSize = (cl.getUseDoublePrecision() ? sizeof(mm_double2) : sizeof(mm_float2));
             cosSinSums.initialize(cl, (2*kmaxx-1)*(2*kmaxy-1)*(2*kmaxz-1)*numSubsets, elementSize, "cosSinSums");
-            int bufferSize = cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cl, numSlices*bufferSize, elementSize, "pmeEnergyBuffer");
+            int bufferSize = cl.getNumThreadBlocks()*(useTiledEnergy ? 1 : OpenCLContext::ThreadBlockSize);
+            pmeEnergyBuffer.initialize(cl, numEffectiveSlices*bufferSize, elementSize, "pmeEnergyBuffer");
             cl.clearBuffer(pmeEnergyBuffer);
-            int recipForceGroup = force.getReciprocalSpaceForceGroup();
-            cl.addPostComputation(addEnergy = new AddEnergyPostComputation(cl, recipForceGroup >= 0 ? recipForceGroup : force.getForceGroup()));
+            cl.addPostComputation(addEnergy = new AddEnergyPostComputation(cl, reciprocalGroupsMask, stageTimer));
         }
     }
     else if (((nonbondedMethod == PME || nonbondedMethod == LJPME) && hasCoulomb) || doLJPME) {
         // Compute the PME parameters.
 
+        pmeOrder = force.getPMEInterpolationOrder();
+        if (pmeOrder > MaxPmeOrder)
+            throw OpenMMException("SlicedNonbondedForce: The OpenCL platform supports PME interpolation orders up to "+cl.intToString(MaxPmeOrder));
         SlicedNonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSizeX, gridSizeY, gridSizeZ, false);
         gridSizeX = OpenCLVkFFT3D::findLegalDimension(gridSizeX);
         gridSizeY = OpenCLVkFFT3D::findLegalDimension(gridSizeY);
@@ -462,6 +1005,68 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             dispersionGridSizeY = OpenCLVkFFT3D::findLegalDimension(dispersionGridSizeY);
             dispersionGridSizeZ = OpenCLVkFFT3D::findLegalDimension(dispersionGridSizeZ);
         }
+
+        // The Coulomb sums of small subsets, including those without any charges, can be computed
+        // without grids, in which case the other subsets take the first grid slots.  Their forces are
+        // interpolated from combined potentials, so this is not done when slice forces are needed.
+
+        if (!doLJPME && hasCoulomb && !useSliceForces) {
+            numGridSlots = assignPmeGridSlots(particleSubsets, chargedParticles, numSubsets, force.getSmallSubsetThreshold(), subsetSlots);
+            useSmallSubsets = (numGridSlots < numSubsets);
+            numGridSlots = (useSmallSubsets ? numGridSlots : numSubsets);
+        }
+
+        // The subsets whose particles have neither epsilons nor epsilon offsets contribute nothing to
+        // the dispersion sums, so they get no dispersion grids.
+
+        numDispersionGrids = numSubsets;
+        if (doLJPME && cl.getContextIndex() == 0)
+            numDispersionGrids = assignDispersionGrids(particleSubsets, dispersiveParticles, numSubsets, dispersionSubsetGrids);
+        fftCacheDir = getDefaultCacheDirectory();
+
+        // If requested, replace the grids that were not set explicitly by the ones transformed fastest.
+
+        if (force.getAutotunePME() && cl.getContextIndex() == 0) {
+            // A configuration tuned in a previous run on the same device and for the same system is
+            // reused instead of timing the transforms again.
+
+            SlicedNonbondedForceImpl::TunedConfiguration tuned;
+            string name = cl.getDevice().getInfo<CL_DEVICE_NAME>();
+            double tunedDispersionAlpha = (doLJPME ? dispersionAlpha : 0.0);
+            bool hasTuned = SlicedNonbondedForceImpl::findTunedConfiguration(force.getTunedConfiguration(), name, numParticles, numSubsets,
+                    alpha, tunedDispersionAlpha, tuned);
+            tuned.device = name;
+            tuned.numParticles = numParticles;
+            tuned.numSubsets = numSubsets;
+            tuned.alpha = alpha;
+            tuned.dispersionAlpha = tunedDispersionAlpha;
+            double explicitAlpha;
+            int nx, ny, nz;
+            auto timeTransforms = [&] (int xsize, int ysize, int zsize) {return timePmeTransforms(xsize, ysize, zsize);};
+            force.getPMEParameters(explicitAlpha, nx, ny, nz);
+            if (hasCoulomb && explicitAlpha == 0.0) {
+                if (!hasTuned || !applyTunedPmeGrid(tuned.grid, gridSizeX, gridSizeY, gridSizeZ))
+                    tunePmeGrid(gridSizeX, gridSizeY, gridSizeZ, timeTransforms);
+                tuned.grid[0] = gridSizeX;
+                tuned.grid[1] = gridSizeY;
+                tuned.grid[2] = gridSizeZ;
+            }
+            force.getLJPMEParameters(explicitAlpha, nx, ny, nz);
+            if (doLJPME && explicitAlpha == 0.0) {
+                if (!hasTuned || !applyTunedPmeGrid(tuned.dispersionGrid, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ))
+                    tunePmeGrid(dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, timeTransforms);
+                tuned.dispersionGrid[0] = dispersionGridSizeX;
+                tuned.dispersionGrid[1] = dispersionGridSizeY;
+                tuned.dispersionGrid[2] = dispersionGridSizeZ;
+            }
+            tunedConfiguration = SlicedNonbondedForceImpl::formatTunedConfiguration(tuned);
+        }
+
+        // When both grids have the same dimensions and every subset has a dispersion grid, the atoms are
+        // sorted once for Coulomb and dispersion.
+
+        shareAtomGridIndex = (doLJPME && hasCoulomb && dispersionGridSizeX == gridSizeX &&
+                dispersionGridSizeY == gridSizeY && dispersionGridSizeZ == gridSizeZ && numDispersionGrids == numSubsets);
         defines["EWALD_ALPHA"] = cl.doubleToString(alpha);
         defines["TWO_OVER_SQRT_PI"] = cl.doubleToString(2.0/sqrt(M_PI));
         defines["USE_EWALD"] = "1";
@@ -491,33 +1096,76 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                 int slice = sliceIndex(i, i);
                 ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
             }
-            pmeDefines["PME_ORDER"] = cl.intToString(PmeOrder);
+            pmeDefines["PME_ORDER"] = cl.intToString(pmeOrder);
             pmeDefines["NUM_ATOMS"] = cl.intToString(numParticles);
             pmeDefines["NUM_SUBSETS"] = cl.intToString(numSubsets);
+            pmeDefines["NUM_GRID_SUBSETS"] = cl.intToString(numGridSlots);
             pmeDefines["NUM_SLICES"] = cl.intToString(numSlices);
+            pmeDefines["NUM_EFFECTIVE_SLICES"] = cl.intToString(numEffectiveSlices);
+            pmeDefines["EFFECTIVE_SLICES"] = toInitializerList(effectiveSlices);
+            if (!cl.getUseDoublePrecision() && !cl.getUseMixedPrecision())
+                pmeDefines["USE_FIXED_POINT_ENERGY"] = "1";
+            if (useSmallSubsets) {
+                // The grids are indexed by slot, so the tables of slices are reordered accordingly.
+
+                vector<int> slotEffectiveSlices = mapSlicesToSlots(effectiveSlices, subsetSlots);
+                pmeDefines["EFFECTIVE_SLICES"] = toInitializerList(slotEffectiveSlices);
+                pmeDefines["USE_SMALL_SUBSETS"] = "1";
+                pmeDefines["SLOT_SLICES"] = toInitializerList(getSlotSlices(subsetSlots));
+                pmeDefines["SMALL_SUBSET_BLOCK_SIZE"] = cl.intToString(SmallSubsetBlockSize);
+                if (useTiledEnergy) {
+                    vector<int> memberStart, memberSubsets;
+                    groupSlicesByEffectiveSlice(slotEffectiveSlices, numSubsets, memberStart, memberSubsets);
+                    sliceMemberSubsets.upload(memberSubsets);
+                }
+            }
             pmeDefines["PADDED_NUM_ATOMS"] = cl.intToString(cl.getPaddedNumAtoms());
+            if (useSliceForces)
+                pmeDefines["USE_SLICE_FORCES"] = "1";
             pmeDefines["RECIP_EXP_FACTOR"] = cl.doubleToString(M_PI*M_PI/(alpha*alpha));
             pmeDefines["GRID_SIZE_X"] = cl.intToString(gridSizeX);
             pmeDefines["GRID_SIZE_Y"] = cl.intToString(gridSizeY);
             pmeDefines["GRID_SIZE_Z"] = cl.intToString(gridSizeZ);
             pmeDefines["EPSILON_FACTOR"] = cl.doubleToString(sqrt(ONE_4PI_EPS0));
             pmeDefines["M_PI"] = cl.doubleToString(M_PI);
+            if (force.getSkipDecoupledSlices() && !useSliceEnergies)
+                pmeDefines["SKIP_DECOUPLED_SLICES"] = "1";
             pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
             bool deviceIsCpu = (cl.getDevice().getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
             if (deviceIsCpu)
                 pmeDefines["DEVICE_IS_CPU"] = "1";
+            if (useTiledEnergy) {
+                pmeDefines["USE_TILED_ENERGY"] = "1";
+                pmeDefines["ENERGY_TILE_SIZE"] = cl.intToString(energyTileSize);
+                pmeDefines["SLICES_PER_THREAD"] = cl.intToString(slicesPerThread);
+            }
+            useInfluenceFunction = force.getUseOptimalInfluenceFunction();
+            if (useInfluenceFunction) {
+                pmeDefines["USE_INFLUENCE_FUNCTION"] = "1";
+                pmeDefines["INFLUENCE_ALIASES"] = cl.intToString(SlicedNonbondedForceImpl::InfluenceFunctionAliases);
+            }
+            useCachedBSplines = force.getUseCachedBSplines();
+            if (useCachedBSplines)
+                pmeDefines["USE_CACHED_BSPLINES"] = "1";
 
             // Create required data structures.
 
             int elementSize = (cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
-            int roundedZSize = PmeOrder*(int) ceil(gridSizeZ/(double) PmeOrder);
-            int gridElements = gridSizeX*gridSizeY*roundedZSize*numSubsets;
-            if (doLJPME) {
-                roundedZSize = PmeOrder*(int) ceil(dispersionGridSizeZ/(double) PmeOrder);
-                gridElements = max(gridElements, dispersionGridSizeX*dispersionGridSizeY*roundedZSize*numSubsets);
+            int spreadSize = sizeof(cl_long); // Charges are always spread in fixed point.
+            long long gridBytes[2], fullGridBytes[2];
+            for (int compact = 0; compact < 2; compact++) {
+                long long* bytes = (compact ? gridBytes : fullGridBytes);
+                SlicedNonbondedForceImpl::computePmeGridBytes(gridSizeX, gridSizeY, gridSizeZ, pmeOrder, numSubsets, elementSize, spreadSize, compact && force.getUseCompactPMEGrids(), bytes[0], bytes[1]);
+                if (doLJPME) {
+                    long long dispersionBytes[2];
+                    SlicedNonbondedForceImpl::computePmeGridBytes(dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, pmeOrder, numDispersionGrids, elementSize, spreadSize, compact && force.getUseCompactPMEGrids(), dispersionBytes[0], dispersionBytes[1]);
+                    bytes[0] = max(bytes[0], dispersionBytes[0]);
+                    bytes[1] = max(bytes[1], dispersionBytes[1]);
+                }
             }
-            pmeGrid1.initialize(cl, gridElements, 2*elementSize, "pmeGrid1");
-            pmeGrid2.initialize(cl, gridElements, 2*elementSize, "pmeGrid2");
+            pmeGridMemorySavings = fullGridBytes[0]+fullGridBytes[1]-gridBytes[0]-gridBytes[1];
+            pmeGrid1.initialize(cl, (gridBytes[0]+2*elementSize-1)/(2*elementSize), 2*elementSize, "pmeGrid1");
+            pmeGrid2.initialize(cl, (gridBytes[1]+2*elementSize-1)/(2*elementSize), 2*elementSize, "pmeGrid2");
             cl.addAutoclearBuffer(pmeGrid2);
             pmeBsplineModuliX.initialize(cl, gridSizeX, elementSize, "pmeBsplineModuliX");
             pmeBsplineModuliY.initialize(cl, gridSizeY, elementSize, "pmeBsplineModuliY");
@@ -526,35 +1174,81 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                 pmeDispersionBsplineModuliX.initialize(cl, dispersionGridSizeX, elementSize, "pmeDispersionBsplineModuliX");
                 pmeDispersionBsplineModuliY.initialize(cl, dispersionGridSizeY, elementSize, "pmeDispersionBsplineModuliY");
                 pmeDispersionBsplineModuliZ.initialize(cl, dispersionGridSizeZ, elementSize, "pmeDispersionBsplineModuliZ");
+                if (numDispersionGrids < numSubsets) {
+                    dispersionAtomGrids.initialize<cl_int>(cl, cl.getPaddedNumAtoms(), "dispersionAtomGrids");
+                    updateDispersionAtomGrids();
+                }
+            }
+            if (useInfluenceFunction) {
+                influenceFunction.initialize(cl, gridSizeX*gridSizeY*(gridSizeZ/2+1), elementSize, "influenceFunction");
+                if (doLJPME)
+                    dispersionInfluenceFunction.initialize(cl, dispersionGridSizeX*dispersionGridSizeY*(dispersionGridSizeZ/2+1), elementSize, "dispersionInfluenceFunction");
+            }
+            pmeBsplineTheta.initialize(cl, pmeOrder*numParticles, 4*elementSize, "pmeBsplineTheta");
+            if (useCachedBSplines) {
+                pmeBsplineDTheta.initialize(cl, pmeOrder*numParticles, 4*elementSize, "pmeBsplineDTheta");
+                pmeBsplineGridPoint.initialize<mm_int4>(cl, numParticles, "pmeBsplineGridPoint");
             }
-            pmeBsplineTheta.initialize(cl, PmeOrder*numParticles, 4*elementSize, "pmeBsplineTheta");
             pmeAtomRange.initialize<cl_int>(cl, gridSizeX*gridSizeY*gridSizeZ+1, "pmeAtomRange");
             pmeAtomGridIndex.initialize<mm_int2>(cl, numParticles, "pmeAtomGridIndex");
+            pmeSubsets = &subsets;
+            if (useSmallSubsets) {
+                pmeSlots.initialize<cl_int>(cl, cl.getPaddedNumAtoms(), "pmeSlots");
+                smallAtoms.initialize<mm_int2>(cl, numParticles, "smallAtoms");
+                smallSlotStart.initialize<cl_int>(cl, numSubsets-numGridSlots+1, "smallSlotStart");
+                updateSmallSubsets();
+                pmeSubsets = &pmeSlots;
+            }
             int energyElementSize = (cl.getUseDoublePrecision() || cl.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
-            int bufferSize = cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize;
-            pmeEnergyBuffer.initialize(cl, numSlices*bufferSize, energyElementSize, "pmeEnergyBuffer");
+            int bufferSize = cl.getNumThreadBlocks()*(useTiledEnergy ? 1 : OpenCLContext::ThreadBlockSize);
+            pmeEnergyBuffer.initialize(cl, numEffectiveSlices*bufferSize, energyElementSize, "pmeEnergyBuffer");
             cl.clearBuffer(pmeEnergyBuffer);
             sort = new OpenCLSort(cl, new SortTrait(), cl.getNumAtoms());
-            fft = new OpenCLVkFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+            fft = new OpenCLVkFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, numGridSlots, true, pmeGrid1, pmeGrid2, fftCacheDir);
             if (doLJPME) {
-                ljpmeEnergyBuffer.initialize(cl, numSlices*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
+                ljpmeEnergyBuffer.initialize(cl, numEffectiveSlices*bufferSize, energyElementSize, "ljpmeEnergyBuffer");
                 cl.clearBuffer(ljpmeEnergyBuffer);
-                dispersionFft = new OpenCLVkFFT3D(cl, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+                dispersionFft = new OpenCLVkFFT3D(cl, dispersionGridSizeX, dispersionGridSizeY, dispersionGridSizeZ, numDispersionGrids, true, pmeGrid1, pmeGrid2, fftCacheDir);
             }
 
-            string vendor = cl.getDevice().getInfo<CL_DEVICE_VENDOR>();
-            bool isNvidia = (vendor.size() >= 6 && vendor.substr(0, 6) == "NVIDIA");
-            usePmeQueue = (!cl.getPlatformData().disablePmeStream && isNvidia);
-            int recipForceGroup = force.getReciprocalSpaceForceGroup();
-            if (recipForceGroup < 0)
-                recipForceGroup = force.getForceGroup();
+            // The reciprocal space work overlaps the direct space one on any GPU, but a CPU device has
+            // no idle resources to fill with it.
+
+            usePmeQueue = (!cl.getPlatformData().disablePmeStream && !deviceIsCpu);
             if (usePmeQueue) {
                 pmeDefines["USE_PME_STREAM"] = "1";
                 pmeQueue = cl::CommandQueue(cl.getContext(), cl.getDevice());
-                cl.addPreComputation(new SyncQueuePreComputation(cl, pmeQueue, recipForceGroup));
-                cl.addPostComputation(new SyncQueuePostComputation(cl, pmeSyncEvent, recipForceGroup));
+                cl.addPreComputation(new SyncQueuePreComputation(cl, pmeQueue, reciprocalGroupsMask));
+                cl.addPostComputation(new SyncQueuePostComputation(cl, pmeSyncEvent, reciprocalGroupsMask));
+            }
+            cl.addPostComputation(addEnergy = new AddEnergyPostComputation(cl, reciprocalGroupsMask, stageTimer));
+
+            // Prepare for reusing the slice energies when only the scaling parameters change.  This is
+            // not done when the slices belong to different force groups.
+
+            useEnergyCache = force.getUseEnergyCache() && !useSliceForceGroups;
+            if (useEnergyCache) {
+                map<string, string> cacheDefines;
+                cacheDefines["NUM_ATOMS"] = cl.intToString(cl.getNumAtoms());
+                cachedPosq.initialize(cl, cl.getPaddedNumAtoms(), cl.getPosq().getElementSize(), "cachedPosq");
+                cl.clearBuffer(cachedPosq);
+                if (cl.getUseMixedPrecision()) {
+                    cacheDefines["USE_MIXED_PRECISION"] = "1";
+                    cachedPosqCorrection.initialize(cl, cl.getPaddedNumAtoms(), cl.getPosqCorrection().getElementSize(), "cachedPosqCorrection");
+                    cl.clearBuffer(cachedPosqCorrection);
+                }
+                positionsChanged.initialize<cl_int>(cl, 1, "positionsChanged");
+                cl::Program program = cl.createProgram(CommonNonbondedSlicingKernelSources::positionCache, cacheDefines);
+                updatePositionCacheKernel = cl::Kernel(program, "updatePositionCache");
+                int index = 0;
+                updatePositionCacheKernel.setArg<cl::Buffer>(index++, cl.getPosq().getDeviceBuffer());
+                updatePositionCacheKernel.setArg<cl::Buffer>(index++, cachedPosq.getDeviceBuffer());
+                if (cachedPosqCorrection.isInitialized()) {
+                    updatePositionCacheKernel.setArg<cl::Buffer>(index++, cl.getPosqCorrection().getDeviceBuffer());
+                    updatePositionCacheKernel.setArg<cl::Buffer>(index++, cachedPosqCorrection.getDeviceBuffer());
+                }
+                updatePositionCacheKernel.setArg<cl::Buffer>(index++, positionsChanged.getDeviceBuffer());
             }
-            cl.addPostComputation(addEnergy = new AddEnergyPostComputation(cl, recipForceGroup));
 
             // Initialize the b-spline moduli.
 
@@ -580,13 +1274,13 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                     zmoduli = &pmeDispersionBsplineModuliZ;
                 }
                 int maxSize = max(max(xsize, ysize), zsize);
-                vector<double> data(PmeOrder);
-                vector<double> ddata(PmeOrder);
+                vector<double> data(pmeOrder);
+                vector<double> ddata(pmeOrder);
                 vector<double> bsplines_data(maxSize);
-                data[PmeOrder-1] = 0.0;
+                data[pmeOrder-1] = 0.0;
                 data[1] = 0.0;
                 data[0] = 1.0;
-                for (int i = 3; i < PmeOrder; i++) {
+                for (int i = 3; i < pmeOrder; i++) {
                     double div = 1.0/(i-1.0);
                     data[i-1] = 0.0;
                     for (int j = 1; j < (i-1); j++)
@@ -597,16 +1291,16 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
                 // Differentiate.
 
                 ddata[0] = -data[0];
-                for (int i = 1; i < PmeOrder; i++)
+                for (int i = 1; i < pmeOrder; i++)
                     ddata[i] = data[i-1]-data[i];
-                double div = 1.0/(PmeOrder-1);
-                data[PmeOrder-1] = 0.0;
-                for (int i = 1; i < (PmeOrder-1); i++)
-                    data[PmeOrder-i-1] = div*(i*data[PmeOrder-i-2]+(PmeOrder-i)*data[PmeOrder-i-1]);
+                double div = 1.0/(pmeOrder-1);
+                data[pmeOrder-1] = 0.0;
+                for (int i = 1; i < (pmeOrder-1); i++)
+                    data[pmeOrder-i-1] = div*(i*data[pmeOrder-i-2]+(pmeOrder-i)*data[pmeOrder-i-1]);
                 data[0] = div*data[0];
                 for (int i = 0; i < maxSize; i++)
                     bsplines_data[i] = 0.0;
-                for (int i = 1; i <= PmeOrder; i++)
+                for (int i = 1; i <= pmeOrder; i++)
                     bsplines_data[i] = data[i-1];
 
                 // Evaluate the actual bspline moduli for X/Y/Z.
@@ -652,14 +1346,15 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             exclusionParams.initialize<mm_float4>(cl, numExclusions, "exclusionParams");
             vector<mm_int2> exclusionAtomsVec(numExclusions);
             for (int i = 0; i < numExclusions; i++) {
-                int j = i+startIndex;
-                exclusionAtomsVec[i] = mm_int2(exclusions[j].first, exclusions[j].second);
-                atoms[i][0] = exclusions[j].first;
-                atoms[i][1] = exclusions[j].second;
+                int j = exclusionOrder[i+startIndex];
+                exclusionAtomsVec[i] = mm_int2(allExceptionAtoms[2*j], allExceptionAtoms[2*j+1]);
+                atoms[i][0] = allExceptionAtoms[2*j];
+                atoms[i][1] = allExceptionAtoms[2*j+1];
             }
             exclusionAtoms.upload(exclusionAtomsVec);
             map<string, string> replacements;
             replacements["PARAMS"] = cl.getBondedUtilities().addArgument(exclusionParams.getDeviceBuffer(), "float4");
+            replacements["BALANCE_LOADS"] = "0";
             replacements["EWALD_ALPHA"] = cl.doubleToString(alpha);
             replacements["TWO_OVER_SQRT_PI"] = cl.doubleToString(2.0/sqrt(M_PI));
             replacements["DO_LJPME"] = doLJPME ? "1" : "0";
@@ -667,6 +1362,15 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             if (doLJPME)
                 replacements["EWALD_DISPERSION_ALPHA"] = cl.doubleToString(dispersionAlpha);
             replacements["LAMBDAS"] = cl.getBondedUtilities().addArgument(sliceLambdas.getDeviceBuffer(), "real2");
+            replacements["SKIP_DECOUPLED_SLICES"] = defines["SKIP_DECOUPLED_SLICES"];
+            replacements["SLICE_HAS_DERIVATIVE"] = defines["SLICE_HAS_DERIVATIVE"];
+            replacements["USE_SLICE_FORCE_GROUPS"] = defines["USE_SLICE_FORCE_GROUPS"];
+            replacements["USE_SLICE_FORCES"] = defines["USE_SLICE_FORCES"];
+            if (useSliceForces)
+                replacements["SLICE_FORCES"] = cl.getBondedUtilities().addArgument(sliceForces.getDeviceBuffer(), "mm_ulong");
+            replacements["USE_SLICE_ENERGIES"] = defines["USE_SLICE_ENERGIES"];
+            if (useSliceEnergies)
+                replacements["SLICE_ENERGIES"] = cl.getBondedUtilities().addArgument(sliceEnergies.getDeviceBuffer(), "mm_ulong");
             stringstream code;
             for (string param : requestedDerivatives) {
                 string variableName = cl.getBondedUtilities().addEnergyParameterDerivative(param);
@@ -676,7 +1380,10 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
             }
             replacements["COMPUTE_DERIVATIVES"] = code.str();
             if (force.getIncludeDirectSpace())
-                cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonNonbondedSlicingKernelSources::pmeExclusions, replacements), force.getForceGroup());
+                for (int group : directGroups) {
+                    replacements["SLICE_IN_FORCE_GROUP"] = getSliceGroupCondition(group);
+                    cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonNonbondedSlicingKernelSources::pmeExclusions, replacements), group);
+                }
         }
     }
 
@@ -709,6 +1416,14 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     cl.getNonbondedUtilities().addParameter(OpenCLNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(int), subsets.getDeviceBuffer()));
     replacements["LAMBDA"] = prefix+"lambda";
     cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"lambda", "real", 2, 2*sizeOfReal, sliceLambdas.getDeviceBuffer()));
+    if (useSliceForces) {
+        replacements["SLICE_FORCES"] = prefix+"sliceForces";
+        cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"sliceForces", "mm_ulong", 1, sizeof(cl_long), sliceForces.getDeviceBuffer(), false));
+    }
+    if (useSliceEnergies) {
+        replacements["SLICE_ENERGIES"] = prefix+"sliceEnergies";
+        cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"sliceEnergies", "mm_ulong", 1, sizeof(cl_long), sliceEnergies.getDeviceBuffer(), false));
+    }
     stringstream code;
     for (string param : requestedDerivatives) {
         string variableName = cl.getNonbondedUtilities().addEnergyParameterDerivative(param);
@@ -719,7 +1434,11 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     replacements["COMPUTE_DERIVATIVES"] = code.str();
     source = cl.replaceStrings(source, replacements);
     if (force.getIncludeDirectSpace())
-        cl.getNonbondedUtilities().addInteraction(useCutoff, usePeriodic, true, force.getCutoffDistance(), exclusionList, source, force.getForceGroup());
+        for (int group : directGroups) {
+            map<string, string> groupReplacements;
+            groupReplacements["SLICE_IN_FORCE_GROUP"] = getSliceGroupCondition(group);
+            cl.getNonbondedUtilities().addInteraction(useCutoff, usePeriodic, true, force.getCutoffDistance(), exclusionList, cl.replaceStrings(source, groupReplacements), group);
+        }
 
     // Initialize the exceptions.
 
@@ -735,24 +1454,37 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         baseExceptionParams.initialize<mm_float4>(cl, numExceptions, "baseExceptionParams");
         exceptionPairs.initialize<mm_int2>(cl, numExceptions, "exceptionPairs");
         exceptionSlices.initialize<int>(cl, numExceptions, "exceptionSlices");
-        vector<mm_float4> baseExceptionParamsVec(numExceptions);
+        baseExceptionParamsVec.resize(numExceptions);
         vector<int> exceptionSlicesVec(numExceptions);
-        for (int i = 0; i < numExceptions; i++) {
-            double chargeProd, sigma, epsilon;
-            force.getExceptionParameters(exceptions[startIndex+i], atoms[i][0], atoms[i][1], chargeProd, sigma, epsilon);
-            baseExceptionParamsVec[i] = mm_float4(chargeProd, sigma, epsilon, 0);
-            exceptionAtoms[i] = make_pair(atoms[i][0], atoms[i][1]);
-            int subset1 = force.getParticleSubset(atoms[i][0]);
-            int subset2 = force.getParticleSubset(atoms[i][1]);
-            exceptionSlicesVec[i] = sliceIndex(subset1, subset2);
-        }
+        parallelFor(threads, numExceptions, [&] (int start, int end) {
+            for (int i = start; i < end; i++) {
+                int j = exceptions[startIndex+i];
+                atoms[i][0] = allExceptionAtoms[2*j];
+                atoms[i][1] = allExceptionAtoms[2*j+1];
+                baseExceptionParamsVec[i] = mm_float4(allExceptionParams[3*j], allExceptionParams[3*j+1], allExceptionParams[3*j+2], 0);
+                exceptionAtoms[i] = make_pair(atoms[i][0], atoms[i][1]);
+                int subset1 = subsetsVec[atoms[i][0]];
+                int subset2 = subsetsVec[atoms[i][1]];
+                exceptionSlicesVec[i] = sliceIndex(subset1, subset2);
+            }
+        });
         baseExceptionParams.upload(baseExceptionParamsVec);
         exceptionPairs.upload(exceptionAtoms);
         exceptionSlices.upload(exceptionSlicesVec);
         map<string, string> replacements;
         replacements["APPLY_PERIODIC"] = (usePeriodic && force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0");
         replacements["PARAMS"] = cl.getBondedUtilities().addArgument(exceptionParams.getDeviceBuffer(), "float4");
+        replacements["BALANCE_LOADS"] = "0";
         replacements["LAMBDAS"] = cl.getBondedUtilities().addArgument(sliceLambdas.getDeviceBuffer(), "real2");
+        replacements["SKIP_DECOUPLED_SLICES"] = defines["SKIP_DECOUPLED_SLICES"];
+        replacements["SLICE_HAS_DERIVATIVE"] = defines["SLICE_HAS_DERIVATIVE"];
+        replacements["USE_SLICE_FORCE_GROUPS"] = defines["USE_SLICE_FORCE_GROUPS"];
+        replacements["USE_SLICE_FORCES"] = defines["USE_SLICE_FORCES"];
+        if (useSliceForces)
+            replacements["SLICE_FORCES"] = cl.getBondedUtilities().addArgument(sliceForces.getDeviceBuffer(), "mm_ulong");
+        replacements["USE_SLICE_ENERGIES"] = defines["USE_SLICE_ENERGIES"];
+        if (useSliceEnergies)
+            replacements["SLICE_ENERGIES"] = cl.getBondedUtilities().addArgument(sliceEnergies.getDeviceBuffer(), "mm_ulong");
         stringstream code;
         for (string param : requestedDerivatives) {
             string variableName = cl.getBondedUtilities().addEnergyParameterDerivative(param);
@@ -762,7 +1494,10 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
         }
         replacements["COMPUTE_DERIVATIVES"] = code.str();
         if (force.getIncludeDirectSpace())
-            cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonNonbondedSlicingKernelSources::nonbondedExceptions, replacements), force.getForceGroup());
+            for (int group : directGroups) {
+                replacements["SLICE_IN_FORCE_GROUP"] = getSliceGroupCondition(group);
+                cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonNonbondedSlicingKernelSources::nonbondedExceptions, replacements), group);
+            }
     }
 
     // Initialize parameter offsets.
@@ -838,24 +1573,104 @@ void OpenCLCalcSlicedNonbondedForceKernel::initialize(const System& system, cons
     // Add post-computation for dispersion correction.
 
     if (dispersionCoefficients.size() > 0 && force.getIncludeDirectSpace())
-        cl.addPostComputation(new DispersionCorrectionPostComputation(cl, dispersionCoefficients, sliceLambdasVec, sliceScalingParams, force.getForceGroup()));
-
-    // Initialize the kernel for updating parameters.
-
+        cl.addPostComputation(new DispersionCorrectionPostComputation(cl, dispersionCoefficients, sliceLambdasVec, sliceScalingParams, sliceDirectGroups));
+
+    // Initialize the kernel for updating parameters.  If the self energy depends on parameter offsets,
+    // it is computed on the device, but only when the parameters change, and then kept on the host.
+
+    hasSelfEnergyOffsets = (hasOffsets && (paramsDefines.find("INCLUDE_EWALD") != paramsDefines.end() || paramsDefines.find("INCLUDE_LJPME") != paramsDefines.end()));
+    int energyElementSize = (cl.getUseDoublePrecision() || cl.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+    int numParamsThreads = cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize;
+    selfEnergyBuffer.initialize(cl, hasSelfEnergyOffsets ? 2*numSubsets*numParamsThreads : 1, energyElementSize, "selfEnergyBuffer");
+    subsetSelfEnergies.initialize(cl, 2*numSubsets, energyElementSize, "subsetSelfEnergies");
+    cl.clearBuffer(selfEnergyBuffer);
+    paramsDefines["SELF_ENERGY_BLOCK_SIZE"] = cl.intToString(SelfEnergyBlockSize);
     cl::Program program = cl.createProgram(CommonNonbondedSlicingKernelSources::nonbondedParameters, paramsDefines);
     computeParamsKernel = cl::Kernel(program, "computeParameters");
     computeExclusionParamsKernel = cl::Kernel(program, "computeExclusionParameters");
+    reduceSelfEnergiesKernel = cl::Kernel(program, "reduceSelfEnergies");
+    if (useSliceEnergies) {
+        map<string, string> sliceEnergyDefines;
+        sliceEnergyDefines["NUM_SLICES"] = cl.intToString(numSlices);
+        sliceEnergyDefines["PADDED_NUM_ATOMS"] = cl.intToString(cl.getPaddedNumAtoms());
+        sliceEnergyDefines["SLICE_ENERGY_SUM_BLOCK_SIZE"] = cl.intToString(SliceEnergySumBlockSize);
+        cl::Program sliceEnergyProgram = cl.createProgram(CommonNonbondedSlicingKernelSources::sliceEnergies, sliceEnergyDefines);
+        sumSliceEnergiesKernel = cl::Kernel(sliceEnergyProgram, "sumSliceEnergies");
+    }
+
+    // Add post-computation for reporting the slice energies.  It must come after all other post-computations,
+    // so that their contributions to the energy parameter derivatives are included.
+
+    if (SliceEnergyWriter::isRequested(force))
+        cl.addPostComputation(reportSliceEnergies = new ReportSliceEnergiesPostComputation(cl, force, force.getForceGroup()));
+    if (force.getNumScalingParameterDerivatives() > 0)
+        cl.addPostComputation(protocolWork = new ProtocolWorkPostComputation(cl, force.getForceGroup()));
     info = new ForceInfo(0, force);
     cl.addForce(info);
 }
 
+bool OpenCLCalcSlicedNonbondedForceKernel::reuseEnergyCache(bool includeForces, bool includeEnergy, bool paramsRecomputed) {
+    // The positions are compared and stored at every evaluation, so that the energies computed
+    // along with forces can be reused as well.
+
+    Vec3 boxVectors[3];
+    cl.getPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
+    bool boxChanged = false;
+    for (int i = 0; i < 3; i++) {
+        boxChanged |= (boxVectors[i] != cachedBoxVectors[i]);
+        cachedBoxVectors[i] = boxVectors[i];
+    }
+    cl.clearBuffer(positionsChanged);
+    cl.executeKernel(updatePositionCacheKernel, cl.getNumAtoms());
+
+    // The energy buffers hold the slice energies of the last evaluation that computed them, which
+    // the post-computation combines with the current scaling parameters.
+
+    bool computeEnergies = (includeEnergy || computeDerivatives);
+    if (energyCacheValid && computeEnergies && !includeForces && !paramsRecomputed && !boxChanged) {
+        int changed;
+        positionsChanged.download(&changed);
+        if (changed == 0)
+            return true;
+    }
+    energyCacheValid = computeEnergies;
+    return false;
+}
+
+double OpenCLCalcSlicedNonbondedForceKernel::timePmeTransforms(int xsize, int ysize, int zsize) {
+    // Time a few forward and inverse transforms of all grids, after an untimed pair that absorbs
+    // any lazy initialization.
+
+    const int numRepetitions = 5;
+    int elementSize = (cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    int roundedZSize = pmeOrder*(int) ceil(zsize/(double) pmeOrder);
+    int gridElements = xsize*ysize*roundedZSize*numGridSlots;
+    OpenCLArray grid1(cl, gridElements, 2*elementSize, "tuningGrid1");
+    OpenCLArray grid2(cl, gridElements, 2*elementSize, "tuningGrid2");
+    cl.clearBuffer(grid1);
+    cl.clearBuffer(grid2);
+    OpenCLVkFFT3D transform(cl, xsize, ysize, zsize, numGridSlots, true, grid1, grid2, fftCacheDir);
+    cl::CommandQueue queue = cl.getQueue();
+    transform.execFFT(true, queue);
+    transform.execFFT(false, queue);
+    queue.finish();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < numRepetitions; i++) {
+        transform.execFFT(true, queue);
+        transform.execFFT(false, queue);
+    }
+    queue.finish();
+    return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+}
+
 double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+    if (reportSliceEnergies != NULL)
+        reportSliceEnergies->setStep(context.getStepCount());
     bool deviceIsCpu = (cl.getDevice().getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
     if (!hasInitializedKernel) {
         hasInitializedKernel = true;
         int index = 0;
-        computeParamsKernel.setArg<cl::Buffer>(index++, cl.getEnergyBuffer().getDeviceBuffer());
-        index++;
+        computeParamsKernel.setArg<cl::Buffer>(index++, selfEnergyBuffer.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, globalParams.getDeviceBuffer());
         computeParamsKernel.setArg<cl_int>(index++, cl.getPaddedNumAtoms());
         computeParamsKernel.setArg<cl::Buffer>(index++, baseParticleParams.getDeviceBuffer());
@@ -865,7 +1680,6 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
         computeParamsKernel.setArg<cl::Buffer>(index++, particleParamOffsets.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, particleOffsetIndices.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, subsets.getDeviceBuffer());
-        computeParamsKernel.setArg<cl::Buffer>(index++, sliceLambdas.getDeviceBuffer());
         if (exceptionParams.isInitialized()) {
             computeParamsKernel.setArg<cl_int>(index++, exceptionParams.getSize());
             computeParamsKernel.setArg<cl::Buffer>(index++, exceptionPairs.getDeviceBuffer());
@@ -875,6 +1689,9 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             computeParamsKernel.setArg<cl::Buffer>(index++, exceptionParamOffsets.getDeviceBuffer());
             computeParamsKernel.setArg<cl::Buffer>(index++, exceptionOffsetIndices.getDeviceBuffer());
         }
+        reduceSelfEnergiesKernel.setArg<cl::Buffer>(0, selfEnergyBuffer.getDeviceBuffer());
+        reduceSelfEnergiesKernel.setArg<cl_int>(1, selfEnergyBuffer.getSize()/(2*numSubsets));
+        reduceSelfEnergiesKernel.setArg<cl::Buffer>(2, subsetSelfEnergies.getDeviceBuffer());
         if (exclusionParams.isInitialized()) {
             computeExclusionParamsKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
             computeExclusionParamsKernel.setArg<cl::Buffer>(1, charges.getDeviceBuffer());
@@ -893,48 +1710,117 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             ewaldForcesKernel.setArg<cl::Buffer>(1, cl.getPosq().getDeviceBuffer());
             ewaldForcesKernel.setArg<cl::Buffer>(2, cosSinSums.getDeviceBuffer());
             ewaldForcesKernel.setArg<cl::Buffer>(3, subsets.getDeviceBuffer());
-            ewaldForcesKernel.setArg<cl::Buffer>(4, sliceLambdas.getDeviceBuffer());
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
+            ewaldForcesKernel.setArg<cl::Buffer>(4, reciprocalSliceLambdas->getDeviceBuffer());
+            if (useSliceForces)
+                ewaldForcesKernel.setArg<cl::Buffer>(6, sliceForces.getDeviceBuffer());
+            if (useTiledEnergy) {
+                ewaldEnergyKernel.setArg<cl::Buffer>(0, pmeEnergyBuffer.getDeviceBuffer());
+                ewaldEnergyKernel.setArg<cl::Buffer>(1, cosSinSums.getDeviceBuffer());
+                ewaldEnergyKernel.setArg<cl::Buffer>(2, sliceMemberStart.getDeviceBuffer());
+                ewaldEnergyKernel.setArg<cl::Buffer>(3, sliceMemberSubsets.getDeviceBuffer());
+            }
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, *reciprocalSliceLambdas, sliceScalingParams, effectiveSlices,
+                    useSliceForceGroups ? sliceReciprocalGroups : vector<int>(), useTiledEnergy);
         }
         if (pmeGrid1.isInitialized()) {
             // Create kernels for Coulomb PME.
 
             map<string, string> replacements;
             replacements["CHARGE"] = (usePosqCharges ? "pos.w" : "charges[atom]");
-            cl::Program program = cl.createProgram(realToFixedPoint+cl.replaceStrings(CommonNonbondedSlicingKernelSources::pme, replacements), pmeDefines);
+            cl::Program program = cl.createProgram(realToFixedPoint+CommonNonbondedSlicingKernelSources::energyAccumulation+cl.replaceStrings(CommonNonbondedSlicingKernelSources::pme, replacements), pmeDefines);
             pmeGridIndexKernel = cl::Kernel(program, "findAtomGridIndex");
             pmeSpreadChargeKernel = cl::Kernel(program, "gridSpreadCharge");
             pmeConvolutionKernel = cl::Kernel(program, "reciprocalConvolution");
             pmeEvalEnergyKernel = cl::Kernel(program, "gridEvaluateEnergy");
+            pmeConvolutionEnergyKernel = cl::Kernel(program, "reciprocalConvolutionAndEnergy");
             pmeInterpolateForceKernel = cl::Kernel(program, "gridInterpolateForce");
+            if (useInfluenceFunction) {
+                pmeInfluenceFunctionKernel = cl::Kernel(program, "computeInfluenceFunction");
+                pmeInfluenceFunctionKernel.setArg<cl::Buffer>(0, influenceFunction.getDeviceBuffer());
+            }
             int elementSize = (cl.getUseDoublePrecision() ? sizeof(mm_double4) : sizeof(mm_float4));
             pmeGridIndexKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
             pmeGridIndexKernel.setArg<cl::Buffer>(1, pmeAtomGridIndex.getDeviceBuffer());
-            pmeGridIndexKernel.setArg<cl::Buffer>(10, subsets.getDeviceBuffer());
+            pmeGridIndexKernel.setArg<cl::Buffer>(10, pmeSubsets->getDeviceBuffer());
             pmeSpreadChargeKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
             pmeSpreadChargeKernel.setArg<cl::Buffer>(1, pmeGrid2.getDeviceBuffer());
             pmeSpreadChargeKernel.setArg<cl::Buffer>(10, pmeAtomGridIndex.getDeviceBuffer());
             pmeSpreadChargeKernel.setArg<cl::Buffer>(11, charges.getDeviceBuffer());
+            if (useCachedBSplines) {
+                pmeBSplinesKernel = cl::Kernel(program, "computeBSplines");
+                pmeBSplinesKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
+                pmeBSplinesKernel.setArg<cl::Buffer>(1, pmeAtomGridIndex.getDeviceBuffer());
+                pmeBSplinesKernel.setArg<cl::Buffer>(2, pmeBsplineTheta.getDeviceBuffer());
+                pmeBSplinesKernel.setArg<cl::Buffer>(3, pmeBsplineDTheta.getDeviceBuffer());
+                pmeBSplinesKernel.setArg<cl::Buffer>(4, pmeBsplineGridPoint.getDeviceBuffer());
+            }
+            // Without cached B-splines, the arguments that hold them are unused, and any valid buffer can be passed.
+            cl::Buffer& bsplineDThetaBuffer = (useCachedBSplines ? pmeBsplineDTheta : pmeBsplineTheta).getDeviceBuffer();
+            cl::Buffer& bsplineGridPointBuffer = (useCachedBSplines ? pmeBsplineGridPoint : pmeBsplineTheta).getDeviceBuffer();
+            pmeSpreadChargeKernel.setArg<cl::Buffer>(12, pmeBsplineTheta.getDeviceBuffer());
+            pmeSpreadChargeKernel.setArg<cl::Buffer>(13, bsplineGridPointBuffer);
+            // Without the optimal influence function its argument is unused, and any valid buffer can be passed.
+            cl::Buffer& influenceBuffer = (useInfluenceFunction ? influenceFunction : pmeBsplineModuliX).getDeviceBuffer();
             pmeConvolutionKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
             pmeConvolutionKernel.setArg<cl::Buffer>(1, pmeBsplineModuliX.getDeviceBuffer());
             pmeConvolutionKernel.setArg<cl::Buffer>(2, pmeBsplineModuliY.getDeviceBuffer());
             pmeConvolutionKernel.setArg<cl::Buffer>(3, pmeBsplineModuliZ.getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(4, influenceBuffer);
             pmeEvalEnergyKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
             pmeEvalEnergyKernel.setArg<cl::Buffer>(1, pmeEnergyBuffer.getDeviceBuffer());
             pmeEvalEnergyKernel.setArg<cl::Buffer>(2, pmeBsplineModuliX.getDeviceBuffer());
             pmeEvalEnergyKernel.setArg<cl::Buffer>(3, pmeBsplineModuliY.getDeviceBuffer());
             pmeEvalEnergyKernel.setArg<cl::Buffer>(4, pmeBsplineModuliZ.getDeviceBuffer());
+            pmeEvalEnergyKernel.setArg<cl::Buffer>(5, influenceBuffer);
+            pmeConvolutionEnergyKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
+            pmeConvolutionEnergyKernel.setArg<cl::Buffer>(1, pmeEnergyBuffer.getDeviceBuffer());
+            pmeConvolutionEnergyKernel.setArg<cl::Buffer>(2, pmeBsplineModuliX.getDeviceBuffer());
+            pmeConvolutionEnergyKernel.setArg<cl::Buffer>(3, pmeBsplineModuliY.getDeviceBuffer());
+            pmeConvolutionEnergyKernel.setArg<cl::Buffer>(4, pmeBsplineModuliZ.getDeviceBuffer());
+            pmeConvolutionEnergyKernel.setArg<cl::Buffer>(5, influenceBuffer);
+            if (useTiledEnergy) {
+                pmeEvalEnergyKernel.setArg<cl::Buffer>(9, sliceMemberStart.getDeviceBuffer());
+                pmeEvalEnergyKernel.setArg<cl::Buffer>(10, sliceMemberSubsets.getDeviceBuffer());
+                pmeConvolutionEnergyKernel.setArg<cl::Buffer>(9, sliceMemberStart.getDeviceBuffer());
+                pmeConvolutionEnergyKernel.setArg<cl::Buffer>(10, sliceMemberSubsets.getDeviceBuffer());
+            }
             pmeInterpolateForceKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(1, cl.getLongForceBuffer().getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(2, pmeGrid1.getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(11, pmeAtomGridIndex.getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(12, charges.getDeviceBuffer());
-            pmeInterpolateForceKernel.setArg<cl::Buffer>(13, subsets.getDeviceBuffer());
-            pmeInterpolateForceKernel.setArg<cl::Buffer>(14, sliceLambdas.getDeviceBuffer());
+            pmeInterpolateForceKernel.setArg<cl::Buffer>(13, pmeSubsets->getDeviceBuffer());
+            pmeInterpolateForceKernel.setArg<cl::Buffer>(14, reciprocalSliceLambdas->getDeviceBuffer());
+            pmeInterpolateForceKernel.setArg<cl::Buffer>(15, pmeBsplineTheta.getDeviceBuffer());
+            pmeInterpolateForceKernel.setArg<cl::Buffer>(16, bsplineDThetaBuffer);
+            pmeInterpolateForceKernel.setArg<cl::Buffer>(17, bsplineGridPointBuffer);
+            if (useSliceForces)
+                pmeInterpolateForceKernel.setArg<cl::Buffer>(18, sliceForces.getDeviceBuffer());
+            if (useSmallSubsets) {
+                // The B-spline factors are set at every evaluation, since their array may be enlarged.
+
+                smallAtomFactorsKernel = cl::Kernel(program, "computeSmallAtomFactors");
+                smallAtomFactorsKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
+                smallAtomFactorsKernel.setArg<cl::Buffer>(10, smallAtoms.getDeviceBuffer());
+                smallAtomFactorsKernel.setArg<cl::Buffer>(11, smallSlotStart.getDeviceBuffer());
+                smallAtomFactorsKernel.setArg<cl::Buffer>(12, charges.getDeviceBuffer());
+                smallStructureFactorsKernel = cl::Kernel(program, "smallSubsetStructureFactors");
+                smallStructureFactorsKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
+                smallStructureFactorsKernel.setArg<cl::Buffer>(2, smallSlotStart.getDeviceBuffer());
+                combinePotentialsKernel = cl::Kernel(program, "combineSubsetPotentials");
+                combinePotentialsKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
+                combinePotentialsKernel.setArg<cl::Buffer>(1, reciprocalSliceLambdas->getDeviceBuffer());
+                smallInterpolateForceKernel = cl::Kernel(program, "smallSubsetInterpolateForce");
+                smallInterpolateForceKernel.setArg<cl::Buffer>(0, cl.getLongForceBuffer().getDeviceBuffer());
+                smallInterpolateForceKernel.setArg<cl::Buffer>(1, pmeGrid2.getDeviceBuffer());
+                smallInterpolateForceKernel.setArg<cl::Buffer>(3, smallAtoms.getDeviceBuffer());
+                smallInterpolateForceKernel.setArg<cl::Buffer>(4, smallSlotStart.getDeviceBuffer());
+            }
             pmeFinishSpreadChargeKernel = cl::Kernel(program, "finishSpreadCharge");
             pmeFinishSpreadChargeKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
             pmeFinishSpreadChargeKernel.setArg<cl::Buffer>(1, pmeGrid1.getDeviceBuffer());
-            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, sliceLambdas, sliceScalingParams);
+            addEnergy->initialize(pmeEnergyBuffer, ljpmeEnergyBuffer, *reciprocalSliceLambdas, sliceScalingParams, effectiveSlices,
+                    useSliceForceGroups ? sliceReciprocalGroups : vector<int>(), useTiledEnergy);
 
             if (doLJPME) {
                 // Create kernels for LJ PME.
@@ -947,35 +1833,98 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
                 pmeDefines["RECIP_EXP_FACTOR"] = cl.doubleToString(M_PI*M_PI/(dispersionAlpha*dispersionAlpha));
                 pmeDefines["USE_LJPME"] = "1";
                 pmeDefines["CHARGE_FROM_SIGEPS"] = "1";
-                program = cl.createProgram(realToFixedPoint+CommonNonbondedSlicingKernelSources::pme, pmeDefines);
+                bool compactGrids = (numDispersionGrids < numSubsets);
+                if (compactGrids) {
+                    // The grids are indexed by dispersion grid, so the tables of slices only include the
+                    // subsets that have them.
+
+                    vector<int> gridEffectiveSlices = mapSlicesToGrids(effectiveSlices, dispersionSubsetGrids, numDispersionGrids);
+                    pmeDefines["NUM_SUBSETS"] = cl.intToString(numDispersionGrids);
+                    pmeDefines["NUM_GRID_SUBSETS"] = cl.intToString(numDispersionGrids);
+                    pmeDefines["NUM_SLICES"] = cl.intToString(gridEffectiveSlices.size());
+                    pmeDefines["EFFECTIVE_SLICES"] = toInitializerList(gridEffectiveSlices);
+                    pmeDefines["USE_GRID_SLICES"] = "1";
+                    pmeDefines["GRID_SLICES"] = toInitializerList(getGridSlices(dispersionSubsetGrids, numDispersionGrids));
+                    if (useTiledEnergy) {
+                        vector<int> memberStart, memberSubsets;
+                        groupSlicesByEffectiveSlice(gridEffectiveSlices, numDispersionGrids, memberStart, memberSubsets);
+                        memberStart.resize(numEffectiveSlices+1, memberStart.back());
+                        dispersionSliceMemberStart.initialize<cl_int>(cl, memberStart.size(), "dispersionSliceMemberStart");
+                        dispersionSliceMemberStart.upload(memberStart);
+                        dispersionSliceMemberSubsets.initialize<cl_int>(cl, memberSubsets.size(), "dispersionSliceMemberSubsets");
+                        dispersionSliceMemberSubsets.upload(memberSubsets);
+                    }
+                }
+                OpenCLArray& atomGrids = (compactGrids ? dispersionAtomGrids : subsets);
+                OpenCLArray& memberStart = (compactGrids && useTiledEnergy ? dispersionSliceMemberStart : sliceMemberStart);
+                OpenCLArray& memberSubsets = (compactGrids && useTiledEnergy ? dispersionSliceMemberSubsets : sliceMemberSubsets);
+                program = cl.createProgram(realToFixedPoint+CommonNonbondedSlicingKernelSources::energyAccumulation+CommonNonbondedSlicingKernelSources::pme, pmeDefines);
                 pmeDispersionGridIndexKernel = cl::Kernel(program, "findAtomGridIndex");
                 pmeDispersionSpreadChargeKernel = cl::Kernel(program, "gridSpreadCharge");
                 pmeDispersionConvolutionKernel = cl::Kernel(program, "reciprocalConvolution");
                 pmeDispersionEvalEnergyKernel = cl::Kernel(program, "gridEvaluateEnergy");
+                pmeDispersionConvolutionEnergyKernel = cl::Kernel(program, "reciprocalConvolutionAndEnergy");
                 pmeDispersionInterpolateForceKernel = cl::Kernel(program, "gridInterpolateForce");
+                if (useInfluenceFunction) {
+                    pmeDispersionInfluenceFunctionKernel = cl::Kernel(program, "computeInfluenceFunction");
+                    pmeDispersionInfluenceFunctionKernel.setArg<cl::Buffer>(0, dispersionInfluenceFunction.getDeviceBuffer());
+                }
                 pmeDispersionGridIndexKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
                 pmeDispersionGridIndexKernel.setArg<cl::Buffer>(1, pmeAtomGridIndex.getDeviceBuffer());
-                pmeDispersionGridIndexKernel.setArg<cl::Buffer>(10, subsets.getDeviceBuffer());
+                pmeDispersionGridIndexKernel.setArg<cl::Buffer>(10, atomGrids.getDeviceBuffer());
                 pmeDispersionSpreadChargeKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
                 pmeDispersionSpreadChargeKernel.setArg<cl::Buffer>(1, pmeGrid2.getDeviceBuffer());
                 pmeDispersionSpreadChargeKernel.setArg<cl::Buffer>(10, pmeAtomGridIndex.getDeviceBuffer());
                 pmeDispersionSpreadChargeKernel.setArg<cl::Buffer>(11, sigmaEpsilon.getDeviceBuffer());
+                pmeDispersionSpreadChargeKernel.setArg<cl::Buffer>(12, pmeBsplineTheta.getDeviceBuffer());
+                pmeDispersionSpreadChargeKernel.setArg<cl::Buffer>(13, bsplineGridPointBuffer);
+                if (useCachedBSplines && !shareAtomGridIndex) {
+                    // The atoms are sorted again for the dispersion grid, so the B-spline coefficients must
+                    // be computed again too.
+
+                    pmeDispersionBSplinesKernel = cl::Kernel(program, "computeBSplines");
+                    pmeDispersionBSplinesKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
+                    pmeDispersionBSplinesKernel.setArg<cl::Buffer>(1, pmeAtomGridIndex.getDeviceBuffer());
+                    pmeDispersionBSplinesKernel.setArg<cl::Buffer>(2, pmeBsplineTheta.getDeviceBuffer());
+                    pmeDispersionBSplinesKernel.setArg<cl::Buffer>(3, pmeBsplineDTheta.getDeviceBuffer());
+                    pmeDispersionBSplinesKernel.setArg<cl::Buffer>(4, pmeBsplineGridPoint.getDeviceBuffer());
+                }
+                cl::Buffer& dispersionInfluenceBuffer = (useInfluenceFunction ? dispersionInfluenceFunction : pmeDispersionBsplineModuliX).getDeviceBuffer();
                 pmeDispersionConvolutionKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
                 pmeDispersionConvolutionKernel.setArg<cl::Buffer>(1, pmeDispersionBsplineModuliX.getDeviceBuffer());
                 pmeDispersionConvolutionKernel.setArg<cl::Buffer>(2, pmeDispersionBsplineModuliY.getDeviceBuffer());
                 pmeDispersionConvolutionKernel.setArg<cl::Buffer>(3, pmeDispersionBsplineModuliZ.getDeviceBuffer());
+                pmeDispersionConvolutionKernel.setArg<cl::Buffer>(4, dispersionInfluenceBuffer);
                 pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
                 pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(1, ljpmeEnergyBuffer.getDeviceBuffer());
                 pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(2, pmeDispersionBsplineModuliX.getDeviceBuffer());
                 pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(3, pmeDispersionBsplineModuliY.getDeviceBuffer());
                 pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(4, pmeDispersionBsplineModuliZ.getDeviceBuffer());
+                pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(5, dispersionInfluenceBuffer);
+                pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
+                pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(1, ljpmeEnergyBuffer.getDeviceBuffer());
+                pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(2, pmeDispersionBsplineModuliX.getDeviceBuffer());
+                pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(3, pmeDispersionBsplineModuliY.getDeviceBuffer());
+                pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(4, pmeDispersionBsplineModuliZ.getDeviceBuffer());
+                pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(5, dispersionInfluenceBuffer);
+                if (useTiledEnergy) {
+                    pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(9, memberStart.getDeviceBuffer());
+                    pmeDispersionEvalEnergyKernel.setArg<cl::Buffer>(10, memberSubsets.getDeviceBuffer());
+                    pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(9, memberStart.getDeviceBuffer());
+                    pmeDispersionConvolutionEnergyKernel.setArg<cl::Buffer>(10, memberSubsets.getDeviceBuffer());
+                }
                 pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
                 pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(1, cl.getLongForceBuffer().getDeviceBuffer());
                 pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(2, pmeGrid1.getDeviceBuffer());
                 pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(11, pmeAtomGridIndex.getDeviceBuffer());
                 pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(12, sigmaEpsilon.getDeviceBuffer());
-                pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(13, subsets.getDeviceBuffer());
-                pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(14, sliceLambdas.getDeviceBuffer());
+                pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(13, atomGrids.getDeviceBuffer());
+                pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(14, reciprocalSliceLambdas->getDeviceBuffer());
+                pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(15, pmeBsplineTheta.getDeviceBuffer());
+                pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(16, bsplineDThetaBuffer);
+                pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(17, bsplineGridPointBuffer);
+                if (useSliceForces)
+                    pmeDispersionInterpolateForceKernel.setArg<cl::Buffer>(18, sliceForces.getDeviceBuffer());
                 pmeDispersionFinishSpreadChargeKernel = cl::Kernel(program, "finishSpreadCharge");
                 pmeDispersionFinishSpreadChargeKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
                 pmeDispersionFinishSpreadChargeKernel.setArg<cl::Buffer>(1, pmeGrid1.getDeviceBuffer());
@@ -983,36 +1932,108 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
        }
     }
 
-    // Update scaling parameters if needed.
+    // Update scaling parameters if needed.  Those with a schedule take their values at the current
+    // step instead of those of the context.
 
+    int scheduleStep = -1;
+    if (numScheduleSteps > 0)
+        scheduleStep = (int) max(0LL, min((long long) numScheduleSteps-1, context.getStepCount()-scheduleStartStep));
     bool scalingParamChanged = false;
-    for (int slice = 0; slice < numSlices; slice++) {
-        ScalingParameterInfo info = sliceScalingParams[slice];
-        if (info.includeCoulomb) {
-            double value = context.getParameter(info.nameCoulomb);
-            if (value != sliceLambdasVec[slice].x) {
-                sliceLambdasVec[slice].x = value;
-                scalingParamChanged = true;
-            }
+    for (int i = 0; i < scalingParamNames.size(); i++) {
+        double value;
+        if (scheduleStep != -1 && scheduleColumns[i] != -1)
+            value = scheduleValues[scheduleStep*numScheduledParams+scheduleColumns[i]];
+        else {
+            value = context.getParameter(scalingParamNames[i]);
+            lambdaScheduleStale = lambdaScheduleStale || (value != scalingParamValues[i]);
         }
-        if (info.includeLJ) {
-            double value = context.getParameter(info.nameLJ);
-            if (value != sliceLambdasVec[slice].y) {
-                sliceLambdasVec[slice].y = value;
-                scalingParamChanged = true;
-            }
+        if (value != scalingParamValues[i]) {
+            scalingParamValues[i] = value;
+            scalingParamChanged = true;
         }
     }
     if (scalingParamChanged) {
+        for (int slice = 0; slice < numSlices; slice++) {
+            int first = sliceParamIndices[slice].first, second = sliceParamIndices[slice].second;
+            sliceLambdasVec[slice].x = (first == -1 ? 1.0 : scalingParamValues[first]);
+            sliceLambdasVec[slice].y = (second == -1 ? 1.0 : scalingParamValues[second]);
+        }
         ewaldSelfEnergy = 0.0;
         for (int i = 0; i < numSubsets; i++) {
             int slice = sliceIndex(i, i);
             ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
         }
+
+        // With a schedule, the lambdas of every step are already on the device and only have to be
+        // copied from the row of the current step.  Otherwise, upload the new values asynchronously.
+        // The staging buffer can only be overwritten after the previous transfer has completed.
+
+        if (scheduleStep != -1) {
+            if (lambdaScheduleStale)
+                uploadLambdaSchedule();
+            int rowSize = numSlices*sliceLambdas.getElementSize();
+            cl.getQueue().enqueueCopyBuffer(lambdaSchedule.getDeviceBuffer(), sliceLambdas.getDeviceBuffer(), (size_t) scheduleStep*rowSize, 0, rowSize, NULL, &lambdasUploadEvent);
+        }
+        else {
+            if (hasLambdasUploadEvent)
+                lambdasUploadEvent.wait();
+            if (cl.getUseDoublePrecision())
+                memcpy(lambdasStaging.data(), sliceLambdasVec.data(), numSlices*sizeof(mm_double2));
+            else {
+                vector<mm_float2> lambdas = double2Tofloat2(sliceLambdasVec);
+                memcpy(lambdasStaging.data(), lambdas.data(), numSlices*sizeof(mm_float2));
+            }
+            cl.getQueue().enqueueWriteBuffer(sliceLambdas.getDeviceBuffer(), CL_FALSE, 0, lambdasStaging.size(), lambdasStaging.data(), NULL, &lambdasUploadEvent);
+        }
+        hasLambdasUploadEvent = true;
+        if (usePmeQueue) {
+            vector<cl::Event> events(1, lambdasUploadEvent);
+            pmeQueue.enqueueBarrierWithWaitList(&events);
+        }
+    }
+
+    // The work of each step of a schedule is computed in its first evaluation, once all contributions
+    // to the energy derivatives are known.
+
+    long long step = context.getStepCount();
+    if (scheduleStep != -1 && step != lastWorkStep && step >= scheduleStartStep && scheduleStep < numScheduleSteps-1) {
+        lastWorkStep = step;
+        protocolWork->setStep(scheduleStep);
+    }
+
+    // With on-demand derivatives, the reciprocal space slice energies are only evaluated for the derivatives
+    // when these can be read: in evaluations that request the energy or neither forces nor energy, which is
+    // how getState() asks for parameter derivatives alone, and in those whose slice energies are reported
+    // or whose protocol work is accumulated.
+
+    computeDerivatives = hasDerivatives && (!useDerivativesOnDemand || includeEnergy || !includeForces ||
+            (reportSliceEnergies != NULL && reportSliceEnergies->isPending()) || (protocolWork != NULL && protocolWork->isPending()));
+    if (addEnergy != NULL)
+        addEnergy->setComputeDerivatives(computeDerivatives);
+
+    // The lambdas of the reciprocal space kernels only need to be uploaded again when the
+    // scaling parameters or the set of included slices change.
+
+    if (useSliceForceGroups && includeReciprocal && (scalingParamChanged || (includedGroups&reciprocalGroupsMask) != maskedLambdasGroups)) {
+        maskedLambdasGroups = includedGroups&reciprocalGroupsMask;
+        vector<mm_double2> maskedLambdas(numSlices, mm_double2(0, 0));
+        for (int slice = 0; slice < numSlices; slice++)
+            if (isReciprocalSliceIncluded(slice))
+                maskedLambdas[slice] = sliceLambdasVec[slice];
+        if (hasMaskedLambdasUploadEvent)
+            maskedLambdasUploadEvent.wait();
         if (cl.getUseDoublePrecision())
-            sliceLambdas.upload(sliceLambdasVec);
-        else
-            sliceLambdas.upload(double2Tofloat2(sliceLambdasVec));
+            memcpy(maskedLambdasStaging.data(), maskedLambdas.data(), numSlices*sizeof(mm_double2));
+        else {
+            vector<mm_float2> lambdas = double2Tofloat2(maskedLambdas);
+            memcpy(maskedLambdasStaging.data(), lambdas.data(), numSlices*sizeof(mm_float2));
+        }
+        cl.getQueue().enqueueWriteBuffer(maskedSliceLambdas.getDeviceBuffer(), CL_FALSE, 0, maskedLambdasStaging.size(), maskedLambdasStaging.data(), NULL, &maskedLambdasUploadEvent);
+        hasMaskedLambdasUploadEvent = true;
+        if (usePmeQueue) {
+            vector<cl::Event> events(1, maskedLambdasUploadEvent);
+            pmeQueue.enqueueBarrierWithWaitList(&events);
+        }
     }
 
     // Update particle and exception parameters.
@@ -1029,9 +2050,11 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
         recomputeParams = true;
         globalParams.upload(paramValues, true);
     }
-    double energy = (includeReciprocal ? ewaldSelfEnergy : 0.0);
-    if (recomputeParams || hasOffsets) {
-        computeParamsKernel.setArg<cl_int>(1, includeEnergy && includeReciprocal);
+    bool paramsRecomputed = recomputeParams;
+    if (recomputeParams && dispersionCorrection != NULL && dispersionCorrection->update(context))
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    if (recomputeParams) {
+        startStage("parameters");
         cl.executeKernel(computeParamsKernel, cl.getPaddedNumAtoms());
         if (exclusionParams.isInitialized())
             cl.executeKernel(computeExclusionParamsKernel, exclusionParams.getSize());
@@ -1040,10 +2063,76 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             cl.getQueue().enqueueMarkerWithWaitList(NULL, &events[0]);
             pmeQueue.enqueueBarrierWithWaitList(&events);
         }
-        if (hasOffsets)
-            energy = 0.0; // The Ewald self energy was computed in the kernel.
+        if (hasSelfEnergyOffsets) {
+            cl.executeKernel(reduceSelfEnergiesKernel, 2*numSubsets*SelfEnergyBlockSize, SelfEnergyBlockSize);
+            vector<double> values(2*numSubsets);
+            if (subsetSelfEnergies.getElementSize() == sizeof(double))
+                subsetSelfEnergies.download(values);
+            else {
+                vector<float> floatValues;
+                subsetSelfEnergies.download(floatValues);
+                for (int i = 0; i < 2*numSubsets; i++)
+                    values[i] = floatValues[i];
+            }
+            ewaldSelfEnergy = 0.0;
+            for (int i = 0; i < numSubsets; i++) {
+                int slice = sliceIndex(i, i);
+                subsetSelfEnergy[i] = mm_double2(values[2*i], values[2*i+1]);
+                ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+            }
+        }
+        stopStage("parameters");
         recomputeParams = false;
     }
+    // The slice forces are cleared before any kernel of this evaluation adds to them, including those
+    // on the PME queue.
+
+    if (useSliceForces && includeForces) {
+        cl.clearBuffer(sliceForces);
+        if (usePmeQueue) {
+            vector<cl::Event> events(1);
+            cl.getQueue().enqueueMarkerWithWaitList(NULL, &events[0]);
+            pmeQueue.enqueueBarrierWithWaitList(&events);
+        }
+        hasSliceForces = true;
+    }
+
+    // The slice energies are cleared in the same way.  Only the direct space kernels add to them, while the
+    // reciprocal space energies are taken from their own buffers, and the self energies and dispersion
+    // correction are computed on the host.
+
+    hasSliceEnergies = (useSliceEnergies && includeEnergy);
+    if (hasSliceEnergies) {
+        cl.clearBuffer(sliceEnergies);
+        sliceEnergiesIncludeReciprocal = includeReciprocal;
+        hostSliceEnergies.assign(2*numSlices, 0.0);
+        lastSliceLambdas.resize(2*numSlices);
+        for (int slice = 0; slice < numSlices; slice++) {
+            lastSliceLambdas[2*slice] = sliceLambdasVec[slice].x;
+            lastSliceLambdas[2*slice+1] = sliceLambdasVec[slice].y;
+        }
+        if (includeReciprocal)
+            for (int i = 0; i < numSubsets; i++) {
+                int slice = sliceIndex(i, i);
+                hostSliceEnergies[2*slice] += subsetSelfEnergy[i].x;
+                hostSliceEnergies[2*slice+1] += subsetSelfEnergy[i].y;
+            }
+        if (includeDirect && dispersionCoefficients.size() > 0) {
+            mm_double4 boxSize = cl.getPeriodicBoxSizeDouble();
+            double volume = boxSize.x*boxSize.y*boxSize.z;
+            for (int slice = 0; slice < numSlices; slice++)
+                hostSliceEnergies[2*slice+1] += dispersionCoefficients[slice]/volume;
+        }
+    }
+    double energy = 0.0;
+    if (includeReciprocal && !useSliceForceGroups)
+        energy = ewaldSelfEnergy;
+    else if (includeReciprocal)
+        for (int i = 0; i < numSubsets; i++) {
+            int slice = sliceIndex(i, i);
+            if (isReciprocalSliceIncluded(slice))
+                energy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+        }
 
     // Do reciprocal space calculations.
 
@@ -1052,15 +2141,24 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
         if (cl.getUseDoublePrecision()) {
             ewaldSumsKernel.setArg<mm_double4>(4, boxSize);
             ewaldForcesKernel.setArg<mm_double4>(5, boxSize);
+            if (useTiledEnergy)
+                ewaldEnergyKernel.setArg<mm_double4>(4, boxSize);
         }
         else {
             ewaldSumsKernel.setArg<mm_float4>(4, mm_float4((float) boxSize.x, (float) boxSize.y, (float) boxSize.z, 0));
             ewaldForcesKernel.setArg<mm_float4>(5, mm_float4((float) boxSize.x, (float) boxSize.y, (float) boxSize.z, 0));
+            if (useTiledEnergy)
+                ewaldEnergyKernel.setArg<mm_float4>(4, mm_float4((float) boxSize.x, (float) boxSize.y, (float) boxSize.z, 0));
         }
-        cl.executeKernel(ewaldSumsKernel, cosSinSums.getSize());
-        cl.executeKernel(ewaldForcesKernel, cl.getNumAtoms());
+        startStage("ewald");
+        cl.executeKernel(ewaldSumsKernel, cosSinSums.getSize(), useTiledEwald ? OpenCLContext::ThreadBlockSize : -1);
+        if (useTiledEnergy && (includeEnergy || computeDerivatives))
+            cl.executeKernel(ewaldEnergyKernel, cl.getNumThreadBlocks()*SliceEnergyBlockSize, SliceEnergyBlockSize);
+        if (includeForces)
+            cl.executeKernel(ewaldForcesKernel, cl.getNumAtoms(), useTiledEwald ? OpenCLContext::ThreadBlockSize : -1);
+        stopStage("ewald");
     }
-    if (pmeGrid1.isInitialized() && includeReciprocal) {
+    if (pmeGrid1.isInitialized() && includeReciprocal && !(useEnergyCache && reuseEnergyCache(includeForces, includeEnergy, paramsRecomputed))) {
         if (usePmeQueue && !includeEnergy)
             cl.setQueue(pmeQueue);
 
@@ -1078,9 +2176,32 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
         for (int i = 0; i < 3; i++)
             recipBoxVectorsFloat[i] = mm_float4((float) recipBoxVectors[i].x, (float) recipBoxVectors[i].y, (float) recipBoxVectors[i].z, 0);
 
+        // The optimal influence function depends on the shape of the box, so it is tabulated again whenever
+        // the box changes.
+
+        if (useInfluenceFunction && (boxVectors[0] != influenceBoxVectors[0] || boxVectors[1] != influenceBoxVectors[1] || boxVectors[2] != influenceBoxVectors[2])) {
+            vector<pair<cl::Kernel*, int> > influenceKernels;
+            if (hasCoulomb)
+                influenceKernels.push_back(make_pair(&pmeInfluenceFunctionKernel, gridSizeX*gridSizeY*(gridSizeZ/2+1)));
+            if (doLJPME && hasLJ)
+                influenceKernels.push_back(make_pair(&pmeDispersionInfluenceFunctionKernel, dispersionGridSizeX*dispersionGridSizeY*(dispersionGridSizeZ/2+1)));
+            for (auto& entry : influenceKernels) {
+                for (int i = 0; i < 3; i++) {
+                    if (cl.getUseDoublePrecision())
+                        entry.first->setArg<mm_double4>(i+1, recipBoxVectors[i]);
+                    else
+                        entry.first->setArg<mm_float4>(i+1, recipBoxVectorsFloat[i]);
+                }
+                cl.executeKernel(*entry.first, entry.second);
+            }
+            for (int i = 0; i < 3; i++)
+                influenceBoxVectors[i] = boxVectors[i];
+        }
+
         // Execute the reciprocal space kernels.
 
         if (hasCoulomb) {
+            startStage("pme.gridIndex");
             setPeriodicBoxArgs(cl, pmeGridIndexKernel, 2);
             if (cl.getUseDoublePrecision()) {
                 pmeGridIndexKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
@@ -1094,6 +2215,24 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             }
             cl.executeKernel(pmeGridIndexKernel, cl.getNumAtoms());
             sort->sort(pmeAtomGridIndex);
+            stopStage("pme.gridIndex");
+            if (useCachedBSplines) {
+                startStage("pme.bsplines");
+                setPeriodicBoxArgs(cl, pmeBSplinesKernel, 5);
+                if (cl.getUseDoublePrecision()) {
+                    pmeBSplinesKernel.setArg<mm_double4>(10, recipBoxVectors[0]);
+                    pmeBSplinesKernel.setArg<mm_double4>(11, recipBoxVectors[1]);
+                    pmeBSplinesKernel.setArg<mm_double4>(12, recipBoxVectors[2]);
+                }
+                else {
+                    pmeBSplinesKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[0]);
+                    pmeBSplinesKernel.setArg<mm_float4>(11, recipBoxVectorsFloat[1]);
+                    pmeBSplinesKernel.setArg<mm_float4>(12, recipBoxVectorsFloat[2]);
+                }
+                cl.executeKernel(pmeBSplinesKernel, cl.getNumAtoms());
+                stopStage("pme.bsplines");
+            }
+            startStage("pme.spread");
             setPeriodicBoxArgs(cl, pmeSpreadChargeKernel, 2);
             if (cl.getUseDoublePrecision()) {
                 pmeSpreadChargeKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
@@ -1107,59 +2246,153 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             }
             cl.executeKernel(pmeSpreadChargeKernel, cl.getNumAtoms());
             cl.executeKernel(pmeFinishSpreadChargeKernel, gridSizeX*gridSizeY*gridSizeZ);
+            if (useSmallSubsets) {
+                smallAtomFactorsKernel.setArg<cl::Buffer>(1, smallAtomFactors.getDeviceBuffer());
+                setPeriodicBoxArgs(cl, smallAtomFactorsKernel, 2);
+                if (cl.getUseDoublePrecision()) {
+                    smallAtomFactorsKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
+                    smallAtomFactorsKernel.setArg<mm_double4>(8, recipBoxVectors[1]);
+                    smallAtomFactorsKernel.setArg<mm_double4>(9, recipBoxVectors[2]);
+                }
+                else {
+                    smallAtomFactorsKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[0]);
+                    smallAtomFactorsKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
+                    smallAtomFactorsKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
+                }
+                cl.executeKernel(smallAtomFactorsKernel, smallAtomFactors.getSize());
+            }
+            stopStage("pme.spread");
+            startStage("pme.fft");
             fft->execFFT(true, cl.getQueue());
+            stopStage("pme.fft");
+            if (useSmallSubsets) {
+                // The transformed grids of the small subsets are computed directly, after those of the other
+                // subsets, which the forward transform overwrites.
+
+                startStage("pme.spread");
+                smallStructureFactorsKernel.setArg<cl::Buffer>(1, smallAtomFactors.getDeviceBuffer());
+                cl.executeKernel(smallStructureFactorsKernel, gridSizeX*gridSizeY*(gridSizeZ/2+1));
+                stopStage("pme.spread");
+            }
             mm_double4 boxSize = cl.getPeriodicBoxSizeDouble();
             if (cl.getUseDoublePrecision()) {
-                pmeConvolutionKernel.setArg<mm_double4>(4, recipBoxVectors[0]);
-                pmeConvolutionKernel.setArg<mm_double4>(5, recipBoxVectors[1]);
-                pmeConvolutionKernel.setArg<mm_double4>(6, recipBoxVectors[2]);
-                pmeEvalEnergyKernel.setArg<mm_double4>(5, recipBoxVectors[0]);
-                pmeEvalEnergyKernel.setArg<mm_double4>(6, recipBoxVectors[1]);
-                pmeEvalEnergyKernel.setArg<mm_double4>(7, recipBoxVectors[2]);
+                pmeConvolutionKernel.setArg<mm_double4>(5, recipBoxVectors[0]);
+                pmeConvolutionKernel.setArg<mm_double4>(6, recipBoxVectors[1]);
+                pmeConvolutionKernel.setArg<mm_double4>(7, recipBoxVectors[2]);
+                pmeEvalEnergyKernel.setArg<mm_double4>(6, recipBoxVectors[0]);
+                pmeEvalEnergyKernel.setArg<mm_double4>(7, recipBoxVectors[1]);
+                pmeEvalEnergyKernel.setArg<mm_double4>(8, recipBoxVectors[2]);
+                pmeConvolutionEnergyKernel.setArg<mm_double4>(6, recipBoxVectors[0]);
+                pmeConvolutionEnergyKernel.setArg<mm_double4>(7, recipBoxVectors[1]);
+                pmeConvolutionEnergyKernel.setArg<mm_double4>(8, recipBoxVectors[2]);
             }
             else {
-                pmeConvolutionKernel.setArg<mm_float4>(4, recipBoxVectorsFloat[0]);
-                pmeConvolutionKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[1]);
-                pmeConvolutionKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[2]);
-                pmeEvalEnergyKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[0]);
-                pmeEvalEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[1]);
-                pmeEvalEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
+                pmeConvolutionKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[0]);
+                pmeConvolutionKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[1]);
+                pmeConvolutionKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
+                pmeEvalEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[0]);
+                pmeEvalEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[1]);
+                pmeEvalEnergyKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[2]);
+                pmeConvolutionEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[0]);
+                pmeConvolutionEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[1]);
+                pmeConvolutionEnergyKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[2]);
             }
-            if (includeEnergy || hasDerivatives)
-                cl.executeKernel(pmeEvalEnergyKernel, gridSizeX*gridSizeY*gridSizeZ);
-            cl.executeKernel(pmeConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
-            fft->execFFT(false, cl.getQueue());
-            setPeriodicBoxArgs(cl, pmeInterpolateForceKernel, 3);
-            if (cl.getUseDoublePrecision()) {
-                pmeInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
-                pmeInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
-                pmeInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+            if (includeEnergy || computeDerivatives) {
+                // When forces are also needed, a single pass evaluates the energies and convolves the grid.
+
+                startStage("pme.energy");
+                cl::Kernel& kernel = (includeForces ? pmeConvolutionEnergyKernel : pmeEvalEnergyKernel);
+                if (useTiledEnergy)
+                    cl.executeKernel(kernel, cl.getNumThreadBlocks()*SliceEnergyBlockSize, SliceEnergyBlockSize);
+                else
+                    cl.executeKernel(kernel, gridSizeX*gridSizeY*gridSizeZ);
+                stopStage("pme.energy");
             }
-            else {
-                pmeInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
-                pmeInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
-                pmeInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+            if (includeForces) {
+                if (!includeEnergy && !computeDerivatives) {
+                    startStage("pme.convolution");
+                    cl.executeKernel(pmeConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
+                    stopStage("pme.convolution");
+                }
+                if (useSmallSubsets) {
+                    // Combine the potentials in reciprocal space and compute the forces on particles of small
+                    // subsets before the inverse transform, which may overwrite its input.
+
+                    startStage("pme.interpolation");
+                    cl.executeKernel(combinePotentialsKernel, gridSizeX*gridSizeY*(gridSizeZ/2+1));
+                    smallInterpolateForceKernel.setArg<cl::Buffer>(2, smallAtomFactors.getDeviceBuffer());
+                    if (cl.getUseDoublePrecision()) {
+                        smallInterpolateForceKernel.setArg<mm_double4>(5, recipBoxVectors[0]);
+                        smallInterpolateForceKernel.setArg<mm_double4>(6, recipBoxVectors[1]);
+                        smallInterpolateForceKernel.setArg<mm_double4>(7, recipBoxVectors[2]);
+                    }
+                    else {
+                        smallInterpolateForceKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[0]);
+                        smallInterpolateForceKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[1]);
+                        smallInterpolateForceKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
+                    }
+                    int numBlocks = min(cl.getNumThreadBlocks(), (int) smallAtoms.getSize());
+                    cl.executeKernel(smallInterpolateForceKernel, numBlocks*SmallSubsetBlockSize, SmallSubsetBlockSize);
+                    stopStage("pme.interpolation");
+                }
+                startStage("pme.fft");
+                fft->execFFT(false, cl.getQueue());
+                stopStage("pme.fft");
+                startStage("pme.interpolation");
+                setPeriodicBoxArgs(cl, pmeInterpolateForceKernel, 3);
+                if (cl.getUseDoublePrecision()) {
+                    pmeInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
+                    pmeInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
+                    pmeInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+                }
+                else {
+                    pmeInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
+                    pmeInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
+                    pmeInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+                }
+                if (deviceIsCpu)
+                    cl.executeKernel(pmeInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
+                else
+                    cl.executeKernel(pmeInterpolateForceKernel, cl.getNumAtoms());
+                stopStage("pme.interpolation");
             }
-            if (deviceIsCpu)
-                cl.executeKernel(pmeInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
-            else
-                cl.executeKernel(pmeInterpolateForceKernel, cl.getNumAtoms());
         }
 
         if (doLJPME && hasLJ) {
-            setPeriodicBoxArgs(cl, pmeDispersionGridIndexKernel, 2);
-            if (cl.getUseDoublePrecision()) {
-                pmeDispersionGridIndexKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
-                pmeDispersionGridIndexKernel.setArg<mm_double4>(8, recipBoxVectors[1]);
-                pmeDispersionGridIndexKernel.setArg<mm_double4>(9, recipBoxVectors[2]);
-            }
-            else {
-                pmeDispersionGridIndexKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[0]);
-                pmeDispersionGridIndexKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
-                pmeDispersionGridIndexKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
+            if (!shareAtomGridIndex) {
+                startStage("ljpme.gridIndex");
+                setPeriodicBoxArgs(cl, pmeDispersionGridIndexKernel, 2);
+                if (cl.getUseDoublePrecision()) {
+                    pmeDispersionGridIndexKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
+                    pmeDispersionGridIndexKernel.setArg<mm_double4>(8, recipBoxVectors[1]);
+                    pmeDispersionGridIndexKernel.setArg<mm_double4>(9, recipBoxVectors[2]);
+                }
+                else {
+                    pmeDispersionGridIndexKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[0]);
+                    pmeDispersionGridIndexKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
+                    pmeDispersionGridIndexKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
+                }
+                cl.executeKernel(pmeDispersionGridIndexKernel, cl.getNumAtoms());
+                sort->sort(pmeAtomGridIndex);
+                stopStage("ljpme.gridIndex");
+                if (useCachedBSplines) {
+                    startStage("ljpme.bsplines");
+                    setPeriodicBoxArgs(cl, pmeDispersionBSplinesKernel, 5);
+                    if (cl.getUseDoublePrecision()) {
+                        pmeDispersionBSplinesKernel.setArg<mm_double4>(10, recipBoxVectors[0]);
+                        pmeDispersionBSplinesKernel.setArg<mm_double4>(11, recipBoxVectors[1]);
+                        pmeDispersionBSplinesKernel.setArg<mm_double4>(12, recipBoxVectors[2]);
+                    }
+                    else {
+                        pmeDispersionBSplinesKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[0]);
+                        pmeDispersionBSplinesKernel.setArg<mm_float4>(11, recipBoxVectorsFloat[1]);
+                        pmeDispersionBSplinesKernel.setArg<mm_float4>(12, recipBoxVectorsFloat[2]);
+                    }
+                    cl.executeKernel(pmeDispersionBSplinesKernel, cl.getNumAtoms());
+                    stopStage("ljpme.bsplines");
+                }
             }
-            cl.executeKernel(pmeDispersionGridIndexKernel, cl.getNumAtoms());
-            sort->sort(pmeAtomGridIndex);
+            startStage("ljpme.spread");
             cl.clearBuffer(pmeGrid2);
             setPeriodicBoxArgs(cl, pmeDispersionSpreadChargeKernel, 2);
             if (cl.getUseDoublePrecision()) {
@@ -1174,52 +2407,80 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
             }
             cl.executeKernel(pmeDispersionSpreadChargeKernel, cl.getNumAtoms());
             cl.executeKernel(pmeDispersionFinishSpreadChargeKernel, gridSizeX*gridSizeY*gridSizeZ);
+            stopStage("ljpme.spread");
+            startStage("ljpme.fft");
             dispersionFft->execFFT(true, cl.getQueue());
+            stopStage("ljpme.fft");
             if (cl.getUseDoublePrecision()) {
-                pmeDispersionConvolutionKernel.setArg<mm_double4>(4, recipBoxVectors[0]);
-                pmeDispersionConvolutionKernel.setArg<mm_double4>(5, recipBoxVectors[1]);
-                pmeDispersionConvolutionKernel.setArg<mm_double4>(6, recipBoxVectors[2]);
-                pmeDispersionEvalEnergyKernel.setArg<mm_double4>(5, recipBoxVectors[0]);
-                pmeDispersionEvalEnergyKernel.setArg<mm_double4>(6, recipBoxVectors[1]);
-                pmeDispersionEvalEnergyKernel.setArg<mm_double4>(7, recipBoxVectors[2]);
+                pmeDispersionConvolutionKernel.setArg<mm_double4>(5, recipBoxVectors[0]);
+                pmeDispersionConvolutionKernel.setArg<mm_double4>(6, recipBoxVectors[1]);
+                pmeDispersionConvolutionKernel.setArg<mm_double4>(7, recipBoxVectors[2]);
+                pmeDispersionEvalEnergyKernel.setArg<mm_double4>(6, recipBoxVectors[0]);
+                pmeDispersionEvalEnergyKernel.setArg<mm_double4>(7, recipBoxVectors[1]);
+                pmeDispersionEvalEnergyKernel.setArg<mm_double4>(8, recipBoxVectors[2]);
+                pmeDispersionConvolutionEnergyKernel.setArg<mm_double4>(6, recipBoxVectors[0]);
+                pmeDispersionConvolutionEnergyKernel.setArg<mm_double4>(7, recipBoxVectors[1]);
+                pmeDispersionConvolutionEnergyKernel.setArg<mm_double4>(8, recipBoxVectors[2]);
             }
             else {
-                pmeDispersionConvolutionKernel.setArg<mm_float4>(4, recipBoxVectorsFloat[0]);
-                pmeDispersionConvolutionKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[1]);
-                pmeDispersionConvolutionKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[2]);
-                pmeDispersionEvalEnergyKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[0]);
-                pmeDispersionEvalEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[1]);
-                pmeDispersionEvalEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
+                pmeDispersionConvolutionKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[0]);
+                pmeDispersionConvolutionKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[1]);
+                pmeDispersionConvolutionKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
+                pmeDispersionEvalEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[0]);
+                pmeDispersionEvalEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[1]);
+                pmeDispersionEvalEnergyKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[2]);
+                pmeDispersionConvolutionEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[0]);
+                pmeDispersionConvolutionEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[1]);
+                pmeDispersionConvolutionEnergyKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[2]);
             }
             // if (!hasCoulomb) cl.clearBuffer(ljpmeEnergyBuffer);  // Is this necessary?
-            if (includeEnergy || hasDerivatives)
-                cl.executeKernel(pmeDispersionEvalEnergyKernel, gridSizeX*gridSizeY*gridSizeZ);
-            cl.executeKernel(pmeDispersionConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
-            dispersionFft->execFFT(false, cl.getQueue());
-            setPeriodicBoxArgs(cl, pmeDispersionInterpolateForceKernel, 3);
-            if (cl.getUseDoublePrecision()) {
-                pmeDispersionInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+            if (includeEnergy || computeDerivatives) {
+                startStage("ljpme.energy");
+                cl::Kernel& kernel = (includeForces ? pmeDispersionConvolutionEnergyKernel : pmeDispersionEvalEnergyKernel);
+                if (useTiledEnergy)
+                    cl.executeKernel(kernel, cl.getNumThreadBlocks()*SliceEnergyBlockSize, SliceEnergyBlockSize);
+                else
+                    cl.executeKernel(kernel, gridSizeX*gridSizeY*gridSizeZ);
+                stopStage("ljpme.energy");
             }
-            else {
-                pmeDispersionInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
-                pmeDispersionInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+            if (includeForces) {
+                if (!includeEnergy && !computeDerivatives) {
+                    startStage("ljpme.convolution");
+                    cl.executeKernel(pmeDispersionConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
+                    stopStage("ljpme.convolution");
+                }
+                startStage("ljpme.fft");
+                dispersionFft->execFFT(false, cl.getQueue());
+                stopStage("ljpme.fft");
+                startStage("ljpme.interpolation");
+                setPeriodicBoxArgs(cl, pmeDispersionInterpolateForceKernel, 3);
+                if (cl.getUseDoublePrecision()) {
+                    pmeDispersionInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+                }
+                else {
+                    pmeDispersionInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
+                    pmeDispersionInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+                }
+                if (deviceIsCpu)
+                    cl.executeKernel(pmeDispersionInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
+                else
+                    cl.executeKernel(pmeDispersionInterpolateForceKernel, cl.getNumAtoms());
+                stopStage("ljpme.interpolation");
             }
-            if (deviceIsCpu)
-                cl.executeKernel(pmeDispersionInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
-            else
-                cl.executeKernel(pmeDispersionInterpolateForceKernel, cl.getNumAtoms());
         }
         if (usePmeQueue) {
             pmeQueue.enqueueMarkerWithWaitList(NULL, &pmeSyncEvent);
             cl.restoreDefaultQueue();
         }
     }
-    if (!hasOffsets && includeReciprocal) {
+    if (includeReciprocal) {
         map<string, double>& energyParamDerivs = cl.getEnergyParamDerivWorkspace();
         for (int i = 0; i < numSubsets; i++) {
+            if (!isReciprocalSliceIncluded(sliceIndex(i, i)))
+                continue;
             ScalingParameterInfo info = sliceScalingParams[sliceIndex(i, i)];
             if (info.hasDerivativeCoulomb)
                 energyParamDerivs[info.nameCoulomb] += subsetSelfEnergy[i].x;
@@ -1230,91 +2491,236 @@ double OpenCLCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool
     return energy;
 }
 
+bool OpenCLCalcSlicedNonbondedForceKernel::updateChargedParticles() {
+    bool changed = false;
+    for (int i = 0; i < chargedParticles.size(); i++) {
+        char charged = (baseParticleParamVec[i].x != 0 || hasChargeOffset[i]);
+        if (charged != chargedParticles[i]) {
+            chargedParticles[i] = charged;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::updateSmallSubsets() {
+    // The slot of each subset does not change, even if the number of particles in a small subset
+    // grows beyond the threshold.
+
+    pmeSlotsVec.resize(subsetsVec.size());
+    for (int i = 0; i < subsetsVec.size(); i++)
+        pmeSlotsVec[i] = subsetSlots[subsetsVec[i]];
+    pmeSlots.upload(pmeSlotsVec);
+    vector<int> atoms, slotStart;
+    vector<int> particleSubsets(subsetsVec.begin(), subsetsVec.begin()+cl.getNumAtoms());
+    listSmallSubsetAtoms(particleSubsets, chargedParticles, subsetSlots, numGridSlots, atoms, slotStart);
+    vector<mm_int2> smallAtomsVec(smallAtoms.getSize(), mm_int2(0, 0));
+    for (int i = 0; i < atoms.size()/2; i++)
+        smallAtomsVec[i] = mm_int2(atoms[2*i], atoms[2*i+1]);
+    smallAtoms.upload(smallAtomsVec);
+    smallSlotStart.upload(slotStart);
+    int numFactors = max(1, slotStart.back())*(gridSizeX+gridSizeY+gridSizeZ/2+1);
+    if (smallAtomFactors.isInitialized() && smallAtomFactors.getSize() >= numFactors)
+        return;
+    int elementSize = (cl.getUseDoublePrecision() ? sizeof(mm_double4) : sizeof(mm_float4));
+    if (smallAtomFactors.isInitialized())
+        smallAtomFactors.resize(numFactors);
+    else
+        smallAtomFactors.initialize(cl, numFactors, elementSize, "smallAtomFactors");
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::updateDispersionAtomGrids() {
+    // The particles of subsets without grids have no epsilons, so any grid can hold their zero C6.
+
+    vector<cl_int> atomGrids(cl.getPaddedNumAtoms(), 0);
+    for (int i = 0; i < cl.getNumAtoms(); i++)
+        atomGrids[i] = max(dispersionSubsetGrids[subsetsVec[i]], 0);
+    dispersionAtomGrids.upload(atomGrids);
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::recomputeSelfEnergies(const vector<bool>& affected) {
+    bool includeSelfEnergy = ((nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) && cl.getContextIndex() == 0);
+    if (!includeSelfEnergy)
+        return;
+    for (int i = 0; i < numSubsets; i++)
+        if (affected[i])
+            subsetSelfEnergy[i] = mm_double2(0, 0);
+    for (int i = 0; i < cl.getNumAtoms(); i++) {
+        if (!affected[subsetsVec[i]])
+            continue;
+        const mm_float4& params = baseParticleParamVec[i];
+        mm_double2& energy = subsetSelfEnergy[subsetsVec[i]];
+        energy.x -= params.x*params.x*ONE_4PI_EPS0*alpha/sqrt(M_PI);
+        if (doLJPME)
+            energy.y += params.z*pow(params.y*dispersionAlpha, 6)/3.0;
+    }
+    ewaldSelfEnergy = 0.0;
+    for (int i = 0; i < numSubsets; i++) {
+        int slice = sliceIndex(i, i);
+        ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
+    }
+}
+
 void OpenCLCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force) {
-    // Make sure the new parameters are acceptable.
+    // Make sure the new parameters are acceptable.  They are read in parallel into staging arrays that
+    // are kept between calls, so that repeated updates do not reallocate them.
 
     if (force.getNumParticles() != cl.getNumAtoms())
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
-    if (!hasCoulomb || !hasLJ) {
-        for (int i = 0; i < force.getNumParticles(); i++) {
+    stagedParticleParamVec.assign(cl.getPaddedNumAtoms(), mm_float4(0, 0, 0, 0));
+    atomic<bool> invalidCharge(false), invalidEpsilon(false);
+    parallelFor(threads, force.getNumParticles(), [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
             double charge, sigma, epsilon;
             force.getParticleParameters(i, charge, sigma, epsilon);
+            stagedParticleParamVec[i] = mm_float4(charge, sigma, epsilon, 0);
             if (!hasCoulomb && charge != 0.0)
-                throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Coulomb interactions, because all charges were originally 0");
+                invalidCharge = true;
             if (!hasLJ && epsilon != 0.0)
-                throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Lennard-Jones interactions, because all epsilons were originally 0");
+                invalidEpsilon = true;
         }
-    }
-    for (int i = 0; i < force.getNumParticles(); i++)
-        subsetsVec[i] = force.getParticleSubset(i);
-    subsets.upload(subsetsVec);
-    set<int> exceptionsWithOffsets;
-    for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
-        string param;
-        int exception;
-        double charge, sigma, epsilon;
-        force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
-        exceptionsWithOffsets.insert(exception);
-    }
-    vector<int> exceptions;
-    for (int i = 0; i < force.getNumExceptions(); i++) {
-        int particle1, particle2;
-        double chargeProd, sigma, epsilon;
-        force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
-        if (chargeProd != 0.0 || epsilon != 0.0 || exceptionsWithOffsets.find(i) != exceptionsWithOffsets.end())
-            exceptions.push_back(i);
-    }
+    });
+    if (invalidCharge)
+        throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Coulomb interactions, because all charges were originally 0");
+    if (invalidEpsilon)
+        throw OpenMMException("updateParametersInContext: The nonbonded force kernel does not include Lennard-Jones interactions, because all epsilons were originally 0");
+    readExceptions(force, threads, allExceptionAtoms, allExceptionParams, stagedExceptions);
+    if (stagedExceptions != nonExcludedExceptions)
+        throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
     int numContexts = cl.getPlatformData().contexts.size();
-    int startIndex = cl.getContextIndex()*exceptions.size()/numContexts;
-    int endIndex = (cl.getContextIndex()+1)*exceptions.size()/numContexts;
+    int startIndex = cl.getContextIndex()*sortedExceptions.size()/numContexts;
+    int endIndex = (cl.getContextIndex()+1)*sortedExceptions.size()/numContexts;
     int numExceptions = endIndex-startIndex;
     if (numExceptions != exceptionAtoms.size())
         throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
 
-    // Record the per-particle parameters.
+    // Record the subsets.
 
-    vector<mm_float4> baseParticleParamVec(cl.getPaddedNumAtoms(), mm_float4(0, 0, 0, 0));
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        double charge, sigma, epsilon;
-        force.getParticleParameters(i, charge, sigma, epsilon);
-        baseParticleParamVec[i] = mm_float4(charge, sigma, epsilon, 0);
-    }
-    baseParticleParams.upload(baseParticleParamVec);
+    stagedSubsetsVec.assign(cl.getPaddedNumAtoms(), 0);
+    vector<int> particleSubsets = force.getParticleSubsets();
+    copy(particleSubsets.begin(), particleSubsets.end(), stagedSubsetsVec.begin());
+    if (numDispersionGrids < numSubsets)
+        for (int i = 0; i < force.getNumParticles(); i++)
+            if ((stagedParticleParamVec[i].z != 0 || hasEpsilonOffset[i]) && dispersionSubsetGrids[stagedSubsetsVec[i]] < 0)
+                throw OpenMMException("updateParametersInContext: The LJPME grids do not include the subsets whose epsilons were all originally 0");
 
     // Record the exceptions.
 
-    if (numExceptions > 0) {
-        vector<mm_float4> baseExceptionParamsVec(numExceptions);
-        for (int i = 0; i < numExceptions; i++) {
-            int particle1, particle2;
-            double chargeProd, sigma, epsilon;
-            force.getExceptionParameters(exceptions[startIndex+i], particle1, particle2, chargeProd, sigma, epsilon);
-            if (make_pair(particle1, particle2) != exceptionAtoms[i])
-                throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
-            baseExceptionParamsVec[i] = mm_float4(chargeProd, sigma, epsilon, 0);
+    stagedExceptionParamsVec.resize(numExceptions);
+    atomic<bool> pairsChanged(false);
+    parallelFor(threads, numExceptions, [&] (int start, int end) {
+        for (int i = start; i < end; i++) {
+            int j = sortedExceptions[startIndex+i];
+            if (make_pair(allExceptionAtoms[2*j], allExceptionAtoms[2*j+1]) != exceptionAtoms[i])
+                pairsChanged = true;
+            stagedExceptionParamsVec[i] = mm_float4(allExceptionParams[3*j], allExceptionParams[3*j+1], allExceptionParams[3*j+2], 0);
         }
-        baseExceptionParams.upload(baseExceptionParamsVec);
+    });
+    if (pairsChanged)
+        throw OpenMMException("updateParametersInContext: The set of non-excluded exceptions has changed");
+
+    // Upload only the ranges that have actually changed.
+
+    vector<pair<int, int> > changedParticles = findChangedRanges(baseParticleParamVec, stagedParticleParamVec);
+    vector<pair<int, int> > changedSubsets = findChangedRanges(subsetsVec, stagedSubsetsVec);
+    vector<pair<int, int> > changedExceptions = findChangedRanges(baseExceptionParamsVec, stagedExceptionParamsVec);
+    if (changedParticles.size() == 0 && changedSubsets.size() == 0 && changedExceptions.size() == 0)
+        return;
+    for (auto& range : changedParticles)
+        baseParticleParams.uploadSubArray(&stagedParticleParamVec[range.first], range.first, range.second-range.first);
+    for (auto& range : changedSubsets)
+        subsets.uploadSubArray(&stagedSubsetsVec[range.first], range.first, range.second-range.first);
+    for (auto& range : changedExceptions)
+        baseExceptionParams.uploadSubArray(&stagedExceptionParamsVec[range.first], range.first, range.second-range.first);
+
+    // Find the subsets that contain modified particles, before or after the update.  Their self
+    // energies are recomputed from scratch, so that repeated updates do not accumulate rounding error.
+
+    bool ljChanged = (changedSubsets.size() > 0);
+    vector<bool> affected(numSubsets, false);
+    for (int i = 0; i < force.getNumParticles(); i++) {
+        mm_float4& oldParams = baseParticleParamVec[i];
+        mm_float4& newParams = stagedParticleParamVec[i];
+        if (oldParams.x == newParams.x && oldParams.y == newParams.y && oldParams.z == newParams.z && subsetsVec[i] == stagedSubsetsVec[i])
+            continue;
+        if (oldParams.y != newParams.y || oldParams.z != newParams.z)
+            ljChanged = true;
+        affected[subsetsVec[i]] = true;
+        affected[stagedSubsetsVec[i]] = true;
     }
+    baseParticleParamVec.swap(stagedParticleParamVec);
+    subsetsVec.swap(stagedSubsetsVec);
+    baseExceptionParamsVec.swap(stagedExceptionParamsVec);
+    recomputeSelfEnergies(affected);
+    bool chargesChanged = updateChargedParticles();
+    if (useSmallSubsets && (changedSubsets.size() > 0 || chargesChanged))
+        updateSmallSubsets();
+    if (changedSubsets.size() > 0 && dispersionAtomGrids.isInitialized())
+        updateDispersionAtomGrids();
 
     // Compute other values.
 
-    ewaldSelfEnergy = 0.0;
-    subsetSelfEnergy.assign(numSubsets, mm_double2(0, 0));
-    if (nonbondedMethod == Ewald || nonbondedMethod == PME || nonbondedMethod == LJPME) {
-        if (cl.getContextIndex() == 0) {
-            for (int i = 0; i < force.getNumParticles(); i++) {
-                subsetSelfEnergy[subsetsVec[i]].x -= baseParticleParamVec[i].x*baseParticleParamVec[i].x*ONE_4PI_EPS0*alpha/sqrt(M_PI);
-                if (doLJPME)
-                    subsetSelfEnergy[subsetsVec[i]].y += baseParticleParamVec[i].z*pow(baseParticleParamVec[i].y*dispersionAlpha, 6)/3.0;
-            }
-            for (int i = 0; i < force.getNumSubsets(); i++) {
-                int slice = sliceIndex(i, i);
-                ewaldSelfEnergy += sliceLambdasVec[slice].x*subsetSelfEnergy[i].x + sliceLambdasVec[slice].y*subsetSelfEnergy[i].y;
-            }
-        }
+    if (ljChanged && force.getUseDispersionCorrection() && cl.getContextIndex() == 0 && (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME)) {
+        if (dispersionCorrection != NULL)
+            delete dispersionCorrection;
+        dispersionCorrection = new SlicedDispersionCorrection(context.getSystem(), force);
+        dispersionCorrection->update(context);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
     }
-    if (force.getUseDispersionCorrection() && cl.getContextIndex() == 0 && (nonbondedMethod == CutoffPeriodic || nonbondedMethod == Ewald || nonbondedMethod == PME))
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(context.getSystem(), force);
+    cl.invalidateMolecules(info);
+    recomputeParams = true;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles) {
+    if (numDispersionGrids < numSubsets)
+        for (int particle : particles)
+            if ((baseParticleParamVec[particle].z != 0 || hasEpsilonOffset[particle]) && dispersionSubsetGrids[force.getParticleSubset(particle)] < 0)
+                throw OpenMMException("reassignSubsetsInContext: The LJPME grids do not include the subsets whose epsilons were all originally 0");
+    vector<int> moved, oldSubsets;
+    for (int particle : particles) {
+        int subset = force.getParticleSubset(particle);
+        if (subset == subsetsVec[particle])
+            continue;
+        moved.push_back(particle);
+        oldSubsets.push_back(subsetsVec[particle]);
+        subsetsVec[particle] = subset;
+    }
+    if (moved.size() == 0)
+        return;
+
+    // Recompute the self energies of the subsets the particles left and joined.
+
+    vector<bool> affected(numSubsets, false);
+    for (int k = 0; k < moved.size(); k++) {
+        affected[oldSubsets[k]] = true;
+        affected[subsetsVec[moved[k]]] = true;
+    }
+    recomputeSelfEnergies(affected);
+
+    // Upload the subsets of the moved particles, grouped into runs of consecutive indices.
+
+    vector<int> sortedMoved(moved);
+    std::sort(sortedMoved.begin(), sortedMoved.end());
+    int start = 0;
+    while (start < sortedMoved.size()) {
+        int end = start+1;
+        while (end < sortedMoved.size() && sortedMoved[end] == sortedMoved[end-1]+1)
+            end++;
+        subsets.uploadSubArray(&subsetsVec[sortedMoved[start]], sortedMoved[start], end-start);
+        start = end;
+    }
+    if (useSmallSubsets)
+        updateSmallSubsets();
+    if (dispersionAtomGrids.isInitialized())
+        updateDispersionAtomGrids();
+    if (dispersionCorrection != NULL) {
+        dispersionCorrection->moveParticles(force, moved, oldSubsets);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    }
+
+    // The slices of the exceptions and the self energies of charge offsets are recomputed by the
+    // parameters kernel.  Particles in different subsets are not interchangeable.
+
     cl.invalidateMolecules(info);
     recomputeParams = true;
 }
@@ -1328,6 +2734,161 @@ void OpenCLCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int&
     nz = gridSizeZ;
 }
 
+map<string, double> OpenCLCalcSlicedNonbondedForceKernel::getStageTimings() const {
+    if (stageTimer == NULL)
+        return map<string, double>();
+    return stageTimer->getTimings();
+}
+
+long long OpenCLCalcSlicedNonbondedForceKernel::getPMEGridMemorySavings() const {
+    return pmeGridMemorySavings;
+}
+
+map<string, long long> OpenCLCalcSlicedNonbondedForceKernel::getMemoryUsage() const {
+    map<string, long long> usage;
+    for (const OpenCLArray* array : {&charges, &sigmaEpsilon, &exceptionParams, &exclusionAtoms, &exclusionParams, &baseParticleParams,
+                                     &baseExceptionParams, &particleParamOffsets, &exceptionParamOffsets, &particleOffsetIndices,
+                                     &exceptionOffsetIndices, &globalParams, &selfEnergyBuffer, &subsetSelfEnergies, &cosSinSums,
+                                     &pmeGrid1, &pmeGrid2, &pmeBsplineModuliX, &pmeBsplineModuliY, &pmeBsplineModuliZ, &pmeAtomGridIndex,
+                                     &pmeDispersionBsplineModuliX, &pmeDispersionBsplineModuliY, &pmeDispersionBsplineModuliZ,
+                                     &pmeBsplineTheta, &pmeBsplineDTheta, &pmeBsplineGridPoint, &pmeAtomRange, &pmeEnergyBuffer,
+                                     &ljpmeEnergyBuffer, &sliceMemberStart, &sliceMemberSubsets, &cachedPosq, &cachedPosqCorrection, &positionsChanged,
+                                     &exceptionPairs, &exceptionSlices, &subsets, &sliceLambdas, &maskedSliceLambdas, &pmeSlots, &smallAtoms,
+                                     &smallSlotStart, &smallAtomFactors, &lambdaSchedule, &influenceFunction, &dispersionInfluenceFunction,
+                                     &sliceForces, &sliceEnergies, &sliceEnergySums})
+        addMemoryUsage(usage, *array);
+    if (reportSliceEnergies != NULL)
+        reportSliceEnergies->countMemoryUsage(usage);
+    if (protocolWork != NULL)
+        protocolWork->countMemoryUsage(usage);
+    if (positionStager != NULL)
+        positionStager->countMemoryUsage(usage);
+    return usage;
+}
+
+bool OpenCLCalcSlicedNonbondedForceKernel::getSliceForces(int slice, vector<Vec3>& forces) {
+    if (!hasSliceForces)
+        return false;
+    int paddedNumAtoms = cl.getPaddedNumAtoms();
+    vector<cl_long> values(3*paddedNumAtoms);
+    size_t offset = (size_t) 3*slice*paddedNumAtoms*sizeof(cl_long);
+    cl.getQueue().enqueueReadBuffer(sliceForces.getDeviceBuffer(), CL_TRUE, offset, values.size()*sizeof(cl_long), values.data());
+    const vector<int>& order = cl.getAtomIndex();
+    double scale = 1.0/(double) 0x100000000LL;
+    forces.resize(cl.getNumAtoms());
+    for (int i = 0; i < cl.getNumAtoms(); i++)
+        forces[order[i]] = Vec3(values[i], values[i+paddedNumAtoms], values[i+2*paddedNumAtoms])*scale;
+    return true;
+}
+
+bool OpenCLCalcSlicedNonbondedForceKernel::getSliceEnergies(vector<double>& energies, vector<double>& lambdas) {
+    if (!hasSliceEnergies)
+        return false;
+
+    // The reciprocal space energies of the last evaluation remain in their buffers, which are indexed by
+    // slice, since no slices are merged when slice energies are used.  Absent buffers are replaced by
+    // another one, which is not read.
+
+    bool includeCoulombRecip = (sliceEnergiesIncludeReciprocal && pmeEnergyBuffer.isInitialized());
+    bool includeLJRecip = (sliceEnergiesIncludeReciprocal && ljpmeEnergyBuffer.isInitialized());
+    sumSliceEnergiesKernel.setArg<cl::Buffer>(0, sliceEnergies.getDeviceBuffer());
+    sumSliceEnergiesKernel.setArg<cl::Buffer>(1, pmeEnergyBuffer.isInitialized() ? pmeEnergyBuffer.getDeviceBuffer() : sliceEnergies.getDeviceBuffer());
+    sumSliceEnergiesKernel.setArg<cl::Buffer>(2, ljpmeEnergyBuffer.isInitialized() ? ljpmeEnergyBuffer.getDeviceBuffer() : sliceEnergies.getDeviceBuffer());
+    sumSliceEnergiesKernel.setArg<cl_int>(3, pmeEnergyBuffer.isInitialized() ? pmeEnergyBuffer.getSize()/numSlices : 0);
+    sumSliceEnergiesKernel.setArg<cl_int>(4, includeCoulombRecip ? 1 : 0);
+    sumSliceEnergiesKernel.setArg<cl_int>(5, includeLJRecip ? 1 : 0);
+    sumSliceEnergiesKernel.setArg<cl::Buffer>(6, sliceEnergySums.getDeviceBuffer());
+    cl.executeKernel(sumSliceEnergiesKernel, 2*numSlices*SliceEnergySumBlockSize, SliceEnergySumBlockSize);
+    vector<cl_long> values;
+    sliceEnergySums.download(values);
+    double scale = 1.0/(double) 0x100000000LL;
+    energies.resize(2*numSlices);
+    for (int i = 0; i < 2*numSlices; i++)
+        energies[i] = values[i]*scale + hostSliceEnergies[i];
+    lambdas = lastSliceLambdas;
+    return true;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double> >& schedule) {
+    numScheduledParams = parameters.size();
+    numScheduleSteps = schedule.size();
+    scheduleColumns.assign(scalingParamNames.size(), -1);
+    for (int i = 0; i < numScheduledParams; i++) {
+        auto position = find(scalingParamNames.begin(), scalingParamNames.end(), parameters[i]);
+        if (position == scalingParamNames.end())
+            throw OpenMMException("setScalingParameterScheduleInContext: There is no scaling parameter called '"+parameters[i]+"'");
+        scheduleColumns[position-scalingParamNames.begin()] = i;
+    }
+    scheduleValues.clear();
+    vector<double> parameterChanges;
+    for (int step = 0; step < numScheduleSteps; step++)
+        for (int i = 0; i < numScheduledParams; i++) {
+            scheduleValues.push_back(schedule[step][i]);
+            if (step > 0)
+                parameterChanges.push_back(schedule[step][i]-schedule[step-1][i]);
+        }
+    scheduleStartStep = context.getStepCount();
+    lastWorkStep = scheduleStartStep-1;
+    lambdaScheduleStale = true;
+    if (protocolWork != NULL)
+        protocolWork->setSchedule(parameters, parameterChanges);
+}
+
+double OpenCLCalcSlicedNonbondedForceKernel::getProtocolWork() {
+    return (protocolWork == NULL ? 0.0 : protocolWork->getWork());
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::uploadLambdaSchedule() {
+    vector<double> values(scalingParamValues);
+    vector<mm_double2> table((size_t) numScheduleSteps*numSlices, mm_double2(0, 0));
+    for (int step = 0; step < numScheduleSteps; step++) {
+        for (int i = 0; i < scalingParamNames.size(); i++)
+            if (scheduleColumns[i] != -1)
+                values[i] = scheduleValues[step*numScheduledParams+scheduleColumns[i]];
+        for (int slice = 0; slice < numSlices; slice++) {
+            int first = sliceParamIndices[slice].first, second = sliceParamIndices[slice].second;
+            table[step*numSlices+slice] = mm_double2(first == -1 ? 1.0 : values[first], second == -1 ? 1.0 : values[second]);
+        }
+    }
+    if (!lambdaSchedule.isInitialized())
+        lambdaSchedule.initialize(cl, table.size(), sliceLambdas.getElementSize(), "lambdaSchedule");
+    else if (lambdaSchedule.getSize() != table.size())
+        lambdaSchedule.resize(table.size());
+    if (cl.getUseDoublePrecision())
+        lambdaSchedule.upload(table);
+    else
+        lambdaSchedule.upload(double2Tofloat2(table));
+    lambdaScheduleStale = false;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::setIncludedForceGroups(int groups) {
+    includedGroups = groups;
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::stagePositions(ContextImpl& context, const double* positions) {
+    if (positionStager == NULL)
+        positionStager = new PositionStager(cl);
+    positionStager->stage(positions);
+}
+
+void OpenCLCalcSlicedNonbondedForceKernel::applyStagedPositions(ContextImpl& context) {
+    if (positionStager == NULL)
+        throw OpenMMException("SlicedNonbondedForce: No positions have been staged");
+    positionStager->apply();
+}
+
+bool OpenCLCalcSlicedNonbondedForceKernel::isReciprocalSliceIncluded(int slice) const {
+    return !useSliceForceGroups || (includedGroups&(1<<sliceReciprocalGroups[slice])) != 0;
+}
+
+string OpenCLCalcSlicedNonbondedForceKernel::getTunedConfiguration() const {
+    return tunedConfiguration;
+}
+
+string OpenCLCalcSlicedNonbondedForceKernel::getFFTBackendName() const {
+    return (fft == NULL && dispersionFft == NULL ? "" : "VkFFT");
+}
+
 void OpenCLCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (nonbondedMethod != LJPME)
         throw OpenMMException("getPMEParametersInContext: This Context is not using PME");
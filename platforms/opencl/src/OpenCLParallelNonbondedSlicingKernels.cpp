@@ -9,6 +9,9 @@
  * -------------------------------------------------------------------------- */
 
 #include "OpenCLParallelNonbondedSlicingKernels.h"
+#include "internal/SliceEnergyWriter.h"
+#include "internal/SlicedNonbondedForceImpl.h"
+#include "openmm/OpenMMException.h"
 
 using namespace NonbondedSlicing;
 using namespace OpenMM;
@@ -37,6 +40,8 @@ OpenCLParallelCalcSlicedNonbondedForceKernel::OpenCLParallelCalcSlicedNonbondedF
 }
 
 void OpenCLParallelCalcSlicedNonbondedForceKernel::initialize(const System& system, const SlicedNonbondedForce& force) {
+    if (kernels.size() > 1 && SliceEnergyWriter::isRequested(force))
+        throw OpenMMException("SlicedNonbondedForce: slice energy reports are not supported with multiple devices");
     for (int i = 0; i < (int) kernels.size(); i++)
         getKernel(i).initialize(system, force);
 }
@@ -55,10 +60,118 @@ void OpenCLParallelCalcSlicedNonbondedForceKernel::copyParametersToContext(Conte
         getKernel(i).copyParametersToContext(context, force);
 }
 
+void OpenCLParallelCalcSlicedNonbondedForceKernel::reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles) {
+    for (int i = 0; i < (int) kernels.size(); i++)
+        getKernel(i).reassignSubsets(context, force, particles);
+}
+
 void OpenCLParallelCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getPMEParameters(alpha, nx, ny, nz);
 }
 
+map<string, double> OpenCLParallelCalcSlicedNonbondedForceKernel::getStageTimings() const {
+    // With more than one device, each stage name is prefixed with the index of its device.
+
+    map<string, double> timings;
+    for (int i = 0; i < kernels.size(); i++) {
+        const OpenCLCalcSlicedNonbondedForceKernel& kernel = dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl());
+        for (auto& stage : kernel.getStageTimings())
+            timings[kernels.size() == 1 ? stage.first : "device"+to_string(i)+"."+stage.first] = stage.second;
+    }
+    return timings;
+}
+
+long long OpenCLParallelCalcSlicedNonbondedForceKernel::getPMEGridMemorySavings() const {
+    long long savings = 0;
+    for (const Kernel& kernel : kernels)
+        savings += dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).getPMEGridMemorySavings();
+    return savings;
+}
+
+map<string, long long> OpenCLParallelCalcSlicedNonbondedForceKernel::getMemoryUsage() const {
+    map<string, long long> usage;
+    for (int i = 0; i < kernels.size(); i++) {
+        const OpenCLCalcSlicedNonbondedForceKernel& kernel = dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl());
+        for (auto& array : kernel.getMemoryUsage())
+            usage[kernels.size() == 1 ? array.first : "device"+to_string(i)+"."+array.first] = array.second;
+    }
+    return usage;
+}
+
+bool OpenCLParallelCalcSlicedNonbondedForceKernel::getSliceForces(int slice, vector<Vec3>& forces) {
+    // Each device accumulates the forces due to its own share of the interactions.
+
+    vector<Vec3> deviceForces;
+    for (int i = 0; i < kernels.size(); i++) {
+        if (!dynamic_cast<OpenCLCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl()).getSliceForces(slice, deviceForces))
+            return false;
+        if (i == 0)
+            forces = deviceForces;
+        else
+            for (int j = 0; j < forces.size(); j++)
+                forces[j] += deviceForces[j];
+    }
+    return true;
+}
+
+bool OpenCLParallelCalcSlicedNonbondedForceKernel::getSliceEnergies(vector<double>& energies, vector<double>& lambdas) {
+    // Each device accumulates the energies of its own share of the interactions, all with the same lambdas.
+
+    vector<double> deviceEnergies;
+    for (int i = 0; i < kernels.size(); i++) {
+        if (!dynamic_cast<OpenCLCalcSlicedNonbondedForceKernel&>(kernels[i].getImpl()).getSliceEnergies(deviceEnergies, lambdas))
+            return false;
+        if (i == 0)
+            energies = deviceEnergies;
+        else
+            for (int j = 0; j < energies.size(); j++)
+                energies[j] += deviceEnergies[j];
+    }
+    return true;
+}
+
+void OpenCLParallelCalcSlicedNonbondedForceKernel::setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double> >& schedule) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<OpenCLCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).setScalingParameterSchedule(context, parameters, schedule);
+}
+
+double OpenCLParallelCalcSlicedNonbondedForceKernel::getProtocolWork() {
+    // Each device accumulates the work due to its own share of the interactions.
+
+    double work = 0.0;
+    for (Kernel& kernel : kernels)
+        work += dynamic_cast<OpenCLCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).getProtocolWork();
+    return work;
+}
+
+void OpenCLParallelCalcSlicedNonbondedForceKernel::setIncludedForceGroups(int groups) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<OpenCLCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).setIncludedForceGroups(groups);
+}
+
+void OpenCLParallelCalcSlicedNonbondedForceKernel::stagePositions(ContextImpl& context, const double* positions) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<OpenCLCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).stagePositions(context, positions);
+}
+
+void OpenCLParallelCalcSlicedNonbondedForceKernel::applyStagedPositions(ContextImpl& context) {
+    for (Kernel& kernel : kernels)
+        dynamic_cast<OpenCLCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).applyStagedPositions(context);
+}
+
+string OpenCLParallelCalcSlicedNonbondedForceKernel::getTunedConfiguration() const {
+    string configurations;
+    for (const Kernel& kernel : kernels) {
+        string configuration = dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernel.getImpl()).getTunedConfiguration();
+        configurations = SlicedNonbondedForceImpl::mergeTunedConfigurations(configurations, configuration);
+    }
+    return configurations;
+}
+
+string OpenCLParallelCalcSlicedNonbondedForceKernel::getFFTBackendName() const {
+    return dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getFFTBackendName();
+}
+
 void OpenCLParallelCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const OpenCLCalcSlicedNonbondedForceKernel&>(kernels[0].getImpl()).getLJPMEParameters(alpha, nx, ny, nz);
 }
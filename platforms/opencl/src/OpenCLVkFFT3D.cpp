@@ -9,14 +9,17 @@
  * -------------------------------------------------------------------------- */
 
 #include "internal/OpenCLVkFFT3D.h"
+#include "CommonNonbondedSlicingKernels.h"
 #include "openmm/opencl/OpenCLContext.h"
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace NonbondedSlicing;
 using namespace OpenMM;
 using namespace std;
 
-OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out) {
+OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out, const string& cacheDir) {
     device = context.getDevice().get();
     cl = context.getContext().get();
     inputBuffer = in.getDeviceBuffer().get();
@@ -55,9 +58,39 @@ OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int z
     config.bufferStride[1] = outputZSize*ysize;
     config.bufferStride[2] = outputZSize*ysize*xsize;
 
+    // Generating and compiling the kernels takes a significant part of the time needed to create
+    // a context, so reuse a plan compiled earlier for the same device and grid if there is one.
+
+    string key;
+    vector<char> cachedPlan;
+    if (cacheDir != "") {
+        const cl::Device& clDevice = context.getDevice();
+        stringstream description;
+        description << "VkFFT " << VkFFTGetVersion() << " OpenCL " << clDevice.getInfo<CL_DRIVER_VERSION>() << " ";
+        description << clDevice.getInfo<CL_DEVICE_NAME>() << " " << sizeof(void*) << " " << doublePrecision << " ";
+        description << xsize << " " << ysize << " " << zsize << " " << batch << " " << realToComplex;
+        key = description.str();
+        if (loadCachedPlan(cacheDir, key, cachedPlan)) {
+            config.loadApplicationFromString = 1;
+            config.loadApplicationString = cachedPlan.data();
+        }
+        else
+            config.saveApplicationToString = 1;
+    }
     VkFFTResult result = initializeVkFFT(&app, config);
+    if (result != VKFFT_SUCCESS && config.loadApplicationFromString) {
+        // The cached plan could not be used, so generate a new one and replace it.
+
+        app = {};
+        config.loadApplicationFromString = 0;
+        config.loadApplicationString = NULL;
+        config.saveApplicationToString = 1;
+        result = initializeVkFFT(&app, config);
+    }
     if (result != VKFFT_SUCCESS)
         throw OpenMMException("Error initializing VkFFT: "+to_string(result));
+    if (config.saveApplicationToString)
+        saveCachedPlan(cacheDir, key, app.saveApplicationString, app.applicationStringSize);
 }
 
 OpenCLVkFFT3D::~OpenCLVkFFT3D() {
@@ -13,6 +13,7 @@
  */
 
 #include "internal/OpenCLVkFFT3D.h"
+#include "CommonNonbondedSlicingKernels.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/opencl/OpenCLArray.h"
 #include "openmm/opencl/OpenCLContext.h"
@@ -33,6 +34,17 @@ using namespace std;
 
 static OpenCLPlatform platform;
 
+/**
+ * A VkFFT transform whose compiled plan is cached, so that running a test a second time checks
+ * the transform loaded from the cache.
+ */
+class CachedOpenCLVkFFT3D : public OpenCLVkFFT3D {
+public:
+    CachedOpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out) :
+            OpenCLVkFFT3D(context, xsize, ysize, zsize, batch, realToComplex, in, out, getDefaultCacheDirectory()) {
+    }
+};
+
 template <class FFT3D, typename Real, class Real2>
 void testTransform(bool realToComplex, int xsize, int ysize, int zsize, int batch) {
     System system;
@@ -135,11 +147,15 @@ int main(int argc, char* argv[]) {
             executeTests<OpenCLVkFFT3D, double, mm_double2>(1);
             executeTests<OpenCLVkFFT3D, double, mm_double2>(2);
             executeTests<OpenCLVkFFT3D, double, mm_double2>(3);
+            executeTests<CachedOpenCLVkFFT3D, double, mm_double2>(2);
+            executeTests<CachedOpenCLVkFFT3D, double, mm_double2>(2);
         }
         else {
             executeTests<OpenCLVkFFT3D, float, mm_float2>(1);
             executeTests<OpenCLVkFFT3D, float, mm_float2>(2);
             executeTests<OpenCLVkFFT3D, float, mm_float2>(3);
+            executeTests<CachedOpenCLVkFFT3D, float, mm_float2>(2);
+            executeTests<CachedOpenCLVkFFT3D, float, mm_float2>(2);
         }
     }
     catch(const exception& e) {
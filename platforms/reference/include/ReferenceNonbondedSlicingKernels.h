@@ -14,6 +14,11 @@
 #include "NonbondedSlicingKernels.h"
 #include "openmm/Platform.h"
 #include "openmm/reference/ReferenceNeighborList.h"
+#include "internal/ReferenceSlicedPME.h"
+#include "internal/ReferenceSlicedLJCoulombIxn.h"
+#include "internal/ReferenceSlicedTreeCode.h"
+#include "internal/SliceEnergyWriter.h"
+#include "internal/SlicedDispersionCorrection.h"
 #include <vector>
 #include <array>
 #include <map>
@@ -27,9 +32,20 @@ namespace NonbondedSlicing {
  */
 class ReferenceCalcSlicedNonbondedForceKernel : public CalcSlicedNonbondedForceKernel {
 public:
-    ReferenceCalcSlicedNonbondedForceKernel(string name, const Platform& platform) : CalcSlicedNonbondedForceKernel(name, platform) {
+    ReferenceCalcSlicedNonbondedForceKernel(string name, const Platform& platform) : CalcSlicedNonbondedForceKernel(name, platform),
+            dispersionCorrection(NULL), treeCode(NULL), neighborList(NULL), neighborListSkin(0.0), pmeData(NULL), dispersionPmeData(NULL), sliceEnergyWriter(NULL),
+            useEnergyCache(false), energyCacheValid(false), useSliceForceGroups(false), includedGroups(-1), useSliceForces(false), hasSliceForces(false), useSliceEnergies(false), hasSliceEnergies(false), scheduleStartStep(0), lastWorkStep(-1), protocolWork(0.0) {
     }
     ~ReferenceCalcSlicedNonbondedForceKernel();
+    /**
+     * This is the name of the platform property that specifies the width of the buffer added to the
+     * nonbonded cutoff when building neighbor lists.  A list is reused until some particle moves
+     * more than half this distance.
+     */
+    static const std::string& NeighborListSkin() {
+        static const std::string key = "NonbondedSlicingNeighborListSkin";
+        return key;
+    }
     /**
      * Initialize the kernel.
      *
@@ -54,6 +70,14 @@ public:
      * @param force      the SlicedNonbondedForce to copy the parameters from
      */
     void copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force);
+    /**
+     * Move some particles to other subsets without copying any other parameter.
+     *
+     * @param context    the context in which to move the particles
+     * @param force      the SlicedNonbondedForce, which already holds the new subsets
+     * @param particles  the indices of the moved particles
+     */
+    void reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles);
     /**
      * Get the parameters being used for PME.
      *
@@ -72,37 +96,170 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
-private:
+    /**
+     * Get the configuration found by PME grid tuning and FFT library selection.  Nothing is tuned
+     * on this platform, so this always returns an empty string.
+     */
+    std::string getTunedConfiguration() const;
+    /**
+     * Get the name of the FFT library used for the reciprocal space sums, or an empty string if
+     * no FFTs are performed.
+     */
+    std::string getFFTBackendName() const;
+    /**
+     * Get the total time taken by each stage of the calculation, in seconds, if stage profiling is enabled.
+     */
+    std::map<std::string, double> getStageTimings() const;
+    /**
+     * Get the number of bytes of device memory saved by storing the PME grids in compact form.
+     */
+    long long getPMEGridMemorySavings() const;
+    /**
+     * Get the number of bytes of device memory taken by each array allocated by this kernel.
+     */
+    std::map<std::string, long long> getMemoryUsage() const;
+    /**
+     * Get the forces that a slice contributed to the last evaluation that computed forces.
+     *
+     * @param slice   the index of the slice
+     * @param forces  on exit, the force on each particle due to the slice
+     * @return false if no evaluation has computed forces yet
+     */
+    bool getSliceForces(int slice, vector<Vec3>& forces);
+    /**
+     * Get the Coulomb and Lennard-Jones energies of every slice in the last evaluation.
+     *
+     * @param energies  on exit, the Coulomb and Lennard-Jones energies of each slice
+     * @param lambdas   on exit, the Coulomb and Lennard-Jones scaling factors applied to each slice
+     * @return false if the last evaluation did not compute the energy
+     */
+    bool getSliceEnergies(vector<double>& energies, vector<double>& lambdas);
+    /**
+     * Set the values that the scaling parameters take at each step of a nonequilibrium protocol.
+     *
+     * @param context     the context in which the protocol is run
+     * @param parameters  the names of the scheduled scaling parameters, or an empty vector to remove
+     *                    the schedule
+     * @param schedule    the values of the scheduled parameters at each step
+     */
+    void setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double>>& schedule);
+    /**
+     * Get the work accumulated since the schedule was set.
+     */
+    double getProtocolWork();
+    /**
+     * Set the force groups included in the next evaluation.
+     *
+     * @param groups  a bit mask of the force groups to include
+     */
+    void setIncludedForceGroups(int groups);
+    /**
+     * Store the positions of a frame until applyStagedPositions() is called.  Since all data is kept in
+     * host memory, nothing is copied in advance.
+     *
+     * @param context    the context for which the positions are staged
+     * @param positions  the positions of all particles, stored as x, y, and z for each particle
+     */
+    void stagePositions(ContextImpl& context, const double* positions);
+    /**
+     * Make the positions staged by the last call to stagePositions() the positions of the context.
+     *
+     * @param context    the context whose positions are replaced
+     */
+    void applyStagedPositions(ContextImpl& context);
+protected:
+    /**
+     * Calculate the nonbonded interactions between particle pairs, which excludes the 1-4 interactions
+     * and the dispersion correction.
+     *
+     * @param context        the context in which to execute this kernel
+     * @param posData        the particle positions
+     * @param forceData      the particle forces (forces added)
+     * @param sliceEnergies  the Coulomb and vdW energies of each slice (energies added)
+     * @param includeForces  true if forces should be calculated
+     * @param includeDirect  true if direct space interactions should be included
+     * @param includeReciprocal  true if reciprocal space interactions should be included
+     */
+    virtual void calculatePairIxn(ContextImpl& context, vector<Vec3>& posData, vector<Vec3>& forceData, vector<vector<double>>& sliceEnergies,
+                                  bool includeForces, bool includeDirect, bool includeReciprocal);
+    /**
+     * Calculate the Coulomb and vdW energies of each slice, including the 1-4 interactions and the
+     * dispersion correction in direct space, and add the forces if requested.
+     */
+    void computeSliceEnergies(ContextImpl& context, vector<Vec3>& posData, vector<Vec3>& forceData, vector<vector<double>>& sliceEnergies,
+                              bool includeForces, bool includeDirect, bool includeReciprocal);
     static const int Coul = 0;
     static const int vdW = 1;
     class ScalingParameterInfo;
+    int getParamIndex(const string& name);
     void computeParameters(ContextImpl& context);
+    bool neighborListIsValid(const vector<Vec3>& posData, const Vec3* boxVectors) const;
+    /**
+     * Get whether the slice energies of the previous evaluation can be reused, which requires that
+     * the positions, the periodic box, and the values of all offset parameters are unchanged.
+     */
+    bool energyCacheIsValid(ContextImpl& context, const vector<Vec3>& posData, bool includeDirect, bool includeReciprocal) const;
+    /**
+     * Store the slice energies of an evaluation, together with the state they were computed for.
+     */
+    void storeEnergyCache(ContextImpl& context, const vector<Vec3>& posData, bool includeDirect, bool includeReciprocal,
+                          const vector<vector<double>>& sliceEnergies);
     int numParticles, num14;
     vector<vector<int>>bonded14IndexArray;
     vector<vector<double>> particleParamArray, bonded14ParamArray;
     vector<int> bonded14SliceArray;
     vector<array<double, 3>> baseParticleParams, baseExceptionParams;
-    map<pair<string, int>, array<double, 3>> particleParamOffsets, exceptionParamOffsets;
+    map<pair<int, int>, array<double, 3>> particleParamOffsets, exceptionParamOffsets;
+    vector<string> paramNames;
     double nonbondedCutoff, switchingDistance, rfDielectric, ewaldAlpha, ewaldDispersionAlpha;
+    SlicedDispersionCorrection* dispersionCorrection;
     vector<double> dispersionCoefficients;
     int kmax[3], gridSize[3], dispersionGridSize[3];
     bool useSwitchingFunction, exceptionsArePeriodic;
     vector<set<int>> exclusions;
     NonbondedMethod nonbondedMethod;
     NeighborList* neighborList;
+    ReferenceSlicedTreeCode* treeCode;
+    double neighborListSkin, currentSkin;
+    vector<Vec3> neighborListPositions;
+    Vec3 neighborListBox[3];
+    pme_t pmeData, dispersionPmeData;
+    EwaldWorkspace ewaldWorkspace;
 
     int numSubsets, numSlices;
     vector<int> subsets;
     vector<vector<double>> sliceLambdas;
     vector<vector<ScalingParameterInfo>> sliceScalingParams;
+    SliceEnergyWriter* sliceEnergyWriter;
+    vector<string> reportedNames;
+    int sliceEnergyReportInterval;
+    bool useEnergyCache, energyCacheValid, cachedIncludeDirect, cachedIncludeReciprocal;
+    vector<int> offsetParamIndices;
+    vector<double> cachedOffsetParamValues;
+    vector<Vec3> cachedPositions;
+    Vec3 cachedBoxVectors[3];
+    vector<vector<double>> cachedSliceEnergies;
+    bool useSliceForceGroups;
+    int includedGroups;
+    vector<int> sliceDirectGroups, sliceReciprocalGroups;
+    bool useSliceForces, hasSliceForces;
+    vector<vector<Vec3>> sliceForces;
+    bool useSliceEnergies, hasSliceEnergies;
+    vector<double> lastSliceEnergies, lastSliceLambdas;
+    vector<int> scheduleColumns;
+    vector<vector<double>> schedule;
+    long long scheduleStartStep, lastWorkStep;
+    double protocolWork;
+    vector<Vec3> stagedPositions;
 };
 
 class ReferenceCalcSlicedNonbondedForceKernel::ScalingParameterInfo {
 public:
     string name;
+    int paramIndex;
     bool hasDerivative;
-    ScalingParameterInfo() : name(""), hasDerivative(false) {}
-    ScalingParameterInfo(string name, bool hasDerivative) : name(name), hasDerivative(hasDerivative) {}
+    ScalingParameterInfo() : name(""), paramIndex(-1), hasDerivative(false) {}
+    ScalingParameterInfo(string name, int paramIndex, bool hasDerivative) : name(name), paramIndex(paramIndex), hasDerivative(hasDerivative) {}
 };
 
 } // namespace NonbondedSlicing
@@ -13,15 +13,28 @@
 
 #include "openmm/reference/ReferencePairIxn.h"
 #include "openmm/reference/ReferenceNeighborList.h"
+#include "internal/ReferenceSlicedPME.h"
+#include <complex>
 
 using namespace std;
 using namespace OpenMM;
 
 namespace NonbondedSlicing {
 
+/**
+ * Buffers used by the reference Ewald summation.  A caller that evaluates the same system repeatedly
+ * can keep one of these so that the buffers are allocated only once.
+ */
+struct EwaldWorkspace {
+    vector<complex<double>> eir;            // per-atom phase factors, numberOfAtoms x kmax x 3
+    vector<complex<double>> tab_xy;         // per-atom phase factors of the current (kx, ky) pair
+    vector<complex<double>> tab_qxyz;       // per-atom charge-weighted phase factors of the current k-vector
+    vector<complex<double>> structureFactor; // per-subset structure factors of the current k-vector
+};
+
 class ReferenceSlicedLJCoulombIxn {
 
-   private:
+   protected:
 
       bool cutoff;
       bool useSwitch;
@@ -35,6 +48,8 @@ class ReferenceSlicedLJCoulombIxn {
       double alphaEwald, alphaDispersionEwald;
       int numRx, numRy, numRz;
       int meshDim[3], dispersionMeshDim[3];
+      pme_t pmeData, dispersionPmeData;
+      EwaldWorkspace* ewaldWorkspace;
 
       // parameter indices
 
@@ -45,25 +60,97 @@ class ReferenceSlicedLJCoulombIxn {
       static const int   Coul = 0;
       static const int   vdW = 1;
 
+      // strides of the flat arrays of atom parameters and slice values
+
+      static const int NumAtomParams = 3;
+      static const int NumTerms = 2;
+
       /**---------------------------------------------------------------------------------------
 
-         Calculate LJ Coulomb pair ixn between two atoms
+         Calculate LJ Coulomb pair ixn between two atoms.  The template arguments state whether a
+         cutoff, periodic boundary conditions, and a switching function are used.
 
          @param atom1            the index of the first atom
          @param atom2            the index of the second atom
          @param atomCoordinates  atom coordinates
          @param atomSubsets      atom subsets
-         @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
-         @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+         @param atomParameters   atom parameters (sigma, epsilon, charge), NumAtomParams per atom
+         @param sliceLambdas     Coulomb and LJ scaling parameters, NumTerms per slice
          @param forces           force array (forces added)
-         @param sliceEnergies    the energy of each slice
+         @param sliceEnergies    Coulomb and LJ energies, NumTerms per slice (energies added)
+
+         --------------------------------------------------------------------------------------- */
+
+      template <bool USE_CUTOFF, bool USE_PERIODIC, bool USE_SWITCH>
+      void calculateOneIxn(int atom1, int atom2, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                           const double* atomParameters, const double* sliceLambdas, vector<OpenMM::Vec3>& forces,
+                           double* sliceEnergies) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Calculate the direct space part of the Ewald ixn between two atoms.  The template
+         arguments state whether LJPME and a switching function are used.
+
+         @param atom1            the index of the first atom
+         @param atom2            the index of the second atom
+         @param atomCoordinates  atom coordinates
+         @param atomSubsets      atom subsets
+         @param atomParameters   atom parameters (sigma, epsilon, charge), NumAtomParams per atom
+         @param sliceLambdas     Coulomb and LJ scaling parameters, NumTerms per slice
+         @param forces           force array (forces added)
+         @param sliceEnergies    Coulomb and LJ energies, NumTerms per slice (energies added)
 
          --------------------------------------------------------------------------------------- */
 
-      void calculateOneIxn(int atom1, int atom2, vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
-                           const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, vector<OpenMM::Vec3>& forces,
-                           vector<vector<double>>& sliceEnergies) const;
+      template <bool USE_LJPME, bool USE_SWITCH>
+      void calculateOneEwaldIxn(int atom1, int atom2, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                           const double* atomParameters, const double* sliceLambdas, vector<OpenMM::Vec3>& forces,
+                           double* sliceEnergies) const;
 
+      /**---------------------------------------------------------------------------------------
+
+         Subtract the reciprocal space contribution of an excluded pair of atoms.  The template
+         argument states whether LJPME is used.
+
+         @param atom1            the index of the first atom
+         @param atom2            the index of the second atom
+         @param atomCoordinates  atom coordinates
+         @param atomSubsets      atom subsets
+         @param atomParameters   atom parameters (sigma, epsilon, charge), NumAtomParams per atom
+         @param sliceLambdas     Coulomb and LJ scaling parameters, NumTerms per slice
+         @param forces           force array (forces added)
+         @param sliceEnergies    Coulomb and LJ energies, NumTerms per slice (energies added)
+
+         --------------------------------------------------------------------------------------- */
+
+      template <bool USE_LJPME>
+      void calculateOneEwaldExclusionIxn(int atom1, int atom2, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                           const double* atomParameters, const double* sliceLambdas, vector<OpenMM::Vec3>& forces,
+                           double* sliceEnergies) const;
+
+      /**---------------------------------------------------------------------------------------
+
+         Copy the atom parameters into a flat array with NumAtomParams entries per atom.
+
+         --------------------------------------------------------------------------------------- */
+
+      static void flattenAtomParameters(const vector<vector<double>>& atomParameters, vector<double>& flatParameters);
+
+      /**---------------------------------------------------------------------------------------
+
+         Copy Coulomb and LJ values of all slices into a flat array with NumTerms entries per slice.
+
+         --------------------------------------------------------------------------------------- */
+
+      static void flattenSliceValues(const vector<vector<double>>& sliceValues, vector<double>& flatValues);
+
+      /**---------------------------------------------------------------------------------------
+
+         Add a flat array of Coulomb and LJ values to those of all slices.
+
+         --------------------------------------------------------------------------------------- */
+
+      static void addSliceValues(const vector<double>& flatValues, vector<vector<double>>& sliceValues);
 
    public:
 
@@ -125,10 +212,12 @@ class ReferenceSlicedLJCoulombIxn {
          @param kmaxx  the largest wave vector in the x direction
          @param kmaxy  the largest wave vector in the y direction
          @param kmaxz  the largest wave vector in the z direction
+         @param workspace  persistent buffers for the Ewald summation (optional). If it is NULL,
+                           temporary ones are created in each calculation
 
          --------------------------------------------------------------------------------------- */
 
-      void setUseEwald(double alpha, int kmaxx, int kmaxy, int kmaxz);
+      void setUseEwald(double alpha, int kmaxx, int kmaxy, int kmaxz, EwaldWorkspace* workspace=NULL);
 
 
       /**---------------------------------------------------------------------------------------
@@ -137,10 +226,12 @@ class ReferenceSlicedLJCoulombIxn {
 
          @param alpha    the Ewald separation parameter
          @param gridSize the dimensions of the mesh
+         @param pmeData  a persistent PME object matching alpha and gridSize (optional). If it is
+                         NULL, a temporary one is created in each calculation
 
          --------------------------------------------------------------------------------------- */
 
-      void setUsePME(double alpha, int meshSize[3]);
+      void setUsePME(double alpha, int meshSize[3], pme_t pmeData=NULL);
 
       /**---------------------------------------------------------------------------------------
 
@@ -148,10 +239,12 @@ class ReferenceSlicedLJCoulombIxn {
 
          @param dalpha    the dispersion Ewald separation parameter
          @param dgridSize the dimensions of the dispersion mesh
+         @param dpmeData  a persistent PME object matching dalpha and dgridSize (optional). If it
+                          is NULL, a temporary one is created in each calculation
 
          --------------------------------------------------------------------------------------- */
 
-      void setUseLJPME(double dalpha, int dmeshSize[3]);
+      void setUseLJPME(double dalpha, int dmeshSize[3], pme_t dpmeData=NULL);
 
       /**---------------------------------------------------------------------------------------
 
@@ -176,14 +269,15 @@ class ReferenceSlicedLJCoulombIxn {
          @param sliceEnergies    the energy of each slice
          @param includeDirect      true if direct space interactions should be included
          @param includeReciprocal  true if reciprocal space interactions should be included
+         @param includeForces      true if forces should be computed.  If false, only energies are computed.
 
          --------------------------------------------------------------------------------------- */
 
       void calculatePairIxn(int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
                            const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int> >& exclusions,
-                            vector<OpenMM::Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const;
+                            vector<OpenMM::Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal, bool includeForces=true) const;
 
-private:
+protected:
       /**---------------------------------------------------------------------------------------
 
          Calculate Ewald ixn
@@ -199,12 +293,24 @@ private:
          @param sliceEnergies    the energy of each slice
          @param includeDirect      true if direct space interactions should be included
          @param includeReciprocal  true if reciprocal space interactions should be included
+         @param includeForces      true if forces should be computed.  If false, only energies are computed.
 
          --------------------------------------------------------------------------------------- */
 
       void calculateEwaldIxn(int numberOfAtoms, vector<OpenMM::Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
                            const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int> >& exclusions,
-                           vector<OpenMM::Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const;
+                           vector<OpenMM::Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal, bool includeForces=true) const;
+
+private:
+      template <bool USE_CUTOFF, bool USE_PERIODIC, bool USE_SWITCH>
+      void calculateDirectIxn(int numberOfAtoms, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                              const double* atomParameters, const double* sliceLambdas, const vector<set<int> >& exclusions,
+                              vector<OpenMM::Vec3>& forces, double* sliceEnergies) const;
+
+      template <bool USE_LJPME, bool USE_SWITCH>
+      void calculateEwaldDirectIxn(int numberOfAtoms, const vector<OpenMM::Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                   const double* atomParameters, const double* sliceLambdas, const vector<set<int> >& exclusions,
+                                   vector<OpenMM::Vec3>& forces, double* sliceEnergies) const;
 };
 
 } // namespace OpenMM
@@ -12,6 +12,7 @@
  * -------------------------------------------------------------------------- */
 
 #include "openmm/Vec3.h"
+#include "openmm/internal/ThreadPool.h"
 #include "internal/windowsExportNonbondedSlicing.h"
 #include <vector>
 
@@ -48,6 +49,31 @@ pme_init(pme_t* ppme,
          int pme_order,
          double epsilon_r);
 
+/*
+ * Share the work of subsequent calculations among the threads of a pool.
+ *
+ * Args:
+ *
+ * pme         Opaque pme_t object, must have been initialized with pme_init()
+ * threads     Pool of threads to use, or NULL for serial execution (the default)
+ */
+void OPENMM_EXPORT_NONBONDED_SLICING
+pme_set_threads(pme_t pme,
+                OpenMM::ThreadPool* threads);
+
+/*
+ * Choose between the smooth PME influence function (the default) and the energy-optimal influence
+ * function of P3M, which is tabulated whenever the box changes.
+ *
+ * Args:
+ *
+ * pme         Opaque pme_t object, must have been initialized with pme_init()
+ * use         Whether to use the optimal influence function
+ */
+void OPENMM_EXPORT_NONBONDED_SLICING
+pme_set_optimal_influence(pme_t pme,
+                          bool use);
+
 /*
  * Evaluate reciprocal space PME energy and forces.
  *
@@ -59,6 +85,7 @@ pme_init(pme_t* ppme,
  * charge      Array of charges (units of e)
  * box         Simulation cell dimensions (nm)
  * energy      Total energy (will be written in units of kJ/mol)
+ * includeForces  If false, only energies are computed and the inverse FFT and force interpolation are skipped
  */
 int OPENMM_EXPORT_NONBONDED_SLICING
 pme_exec(pme_t pme,
@@ -68,7 +95,8 @@ pme_exec(pme_t pme,
          vector<OpenMM::Vec3>& forces,
          const vector<double>& charges,
          const OpenMM::Vec3 periodicBoxVectors[3],
-         vector<vector<double>>& sliceEnergies);
+         vector<vector<double>>& sliceEnergies,
+         bool includeForces=true);
 
 
 /**
@@ -82,6 +110,7 @@ pme_exec(pme_t pme,
  * c6s         Array of c6 coefficients (units of sqrt(kJ/mol).nm^3 )
  * box         Simulation cell dimensions (nm)
  * energy      Total energy (will be written in units of kJ/mol)
+ * includeForces  If false, only energies are computed and the inverse FFT and force interpolation are skipped
  */
 int OPENMM_EXPORT_NONBONDED_SLICING
 pme_exec_dpme(pme_t pme,
@@ -91,7 +120,8 @@ pme_exec_dpme(pme_t pme,
          vector<OpenMM::Vec3>& forces,
          const vector<double>& c6s,
          const OpenMM::Vec3 periodicBoxVectors[3],
-         vector<vector<double>>& sliceEnergies);
+         vector<vector<double>>& sliceEnergies,
+         bool includeForces=true);
 
 
 
@@ -0,0 +1,151 @@
+#ifndef __ReferenceSlicedTreeCode_H__
+#define __ReferenceSlicedTreeCode_H__
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/Vec3.h"
+#include "internal/windowsExportNonbondedSlicing.h"
+#include <set>
+#include <vector>
+
+using namespace std;
+using namespace OpenMM;
+
+namespace NonbondedSlicing {
+
+/**
+ * This class computes the nonbonded interactions without a cutoff by means of a Barnes-Hut tree
+ * code.  The particles are sorted into an octree, and every node keeps one multipole expansion per
+ * subset about its center: charge, dipole, and traceless quadrupole for Coulomb, and the moments
+ * sum(e*sigma^m), m = 0 to 12, whose monopole reproduces the combined Lennard-Jones parameters.
+ * The interactions of a particle with a node that is small enough when seen from it are computed
+ * from these expansions, and those with the particles of the other nodes are computed directly.
+ * Keeping one expansion per subset gives the energy of every slice and the forces scaled by its
+ * Coulomb and LJ parameters at a cost that grows as N log N.
+ */
+class OPENMM_EXPORT_NONBONDED_SLICING ReferenceSlicedTreeCode {
+
+public:
+
+    /**---------------------------------------------------------------------------------------
+
+       Constructor
+
+       @param openingAngle  the largest ratio between the size of a node and its distance to a
+                            particle for which the multipole expansions of the node are used
+
+       --------------------------------------------------------------------------------------- */
+
+     ReferenceSlicedTreeCode(double openingAngle);
+
+    /**---------------------------------------------------------------------------------------
+
+       Destructor
+
+       --------------------------------------------------------------------------------------- */
+
+     ~ReferenceSlicedTreeCode();
+
+    /**---------------------------------------------------------------------------------------
+
+       Calculate LJ Coulomb pair ixn
+
+       @param numberOfAtoms    number of atoms
+       @param atomCoordinates  atom coordinates
+       @param numberOfSubsets  number of subsets
+       @param atomSubsets      atom subsets
+       @param atomParameters   atom parameters (sigma, epsilon, charge)  atomParameters[atomIndex][paramterIndex]
+       @param sliceLambdas     Coulomb and LJ scaling parameters for each slice
+       @param exclusions       atom exclusion indices
+                               exclusions[atomIndex] contains the list of exclusions for that atom
+       @param forces           force array (forces added)
+       @param sliceEnergies    the energy of each slice (energies added)
+       @param includeForces    true if forces should be computed.  If false, only energies are computed.
+
+       --------------------------------------------------------------------------------------- */
+
+    void calculateIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
+                      const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int>>& exclusions,
+                      vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeForces=true);
+
+private:
+
+    struct Node {
+        int first, last;          // range of the node particles in the sorted order
+        int firstChild, numChildren;
+        Vec3 center;
+        double size;              // the largest side of the bounding box
+    };
+
+    // parameter indices
+
+    static const int SigIndex = 0;
+    static const int EpsIndex = 1;
+    static const int   QIndex = 2;
+
+    static const int   Coul = 0;
+    static const int   vdW = 1;
+
+    // layout of the expansion of a subset: charge, dipole, quadrupole (xx, xy, xz, yy, yz, zz),
+    // and the Lennard-Jones moments
+
+    static const int DipoleIndex = 1;
+    static const int QuadrupoleIndex = 4;
+    static const int LJIndex = 10;
+    static const int NumMoments = 23;
+
+    static const int MaxLeafSize = 16;
+
+    /**---------------------------------------------------------------------------------------
+
+       Sort the particles of a node into octants, create its children, and compute the
+       multipole expansions of all of them recursively.
+
+       @param index            the index of the node
+       @param atomCoordinates  atom coordinates
+       @param atomSubsets      atom subsets
+       @param atomParameters   atom parameters (sigma, epsilon, charge)
+
+       --------------------------------------------------------------------------------------- */
+
+    void buildNode(int index, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                   const vector<vector<double>>& atomParameters);
+
+    /**---------------------------------------------------------------------------------------
+
+       Add the exact interaction of a pair of atoms to the first of them, with half of its
+       energy assigned to their slice.  A negative sign subtracts it.
+
+       --------------------------------------------------------------------------------------- */
+
+    void addPairIxn(int atom1, int atom2, double sign, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                    const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas,
+                    Vec3& force, vector<vector<double>>& sliceEnergies) const;
+
+    /**---------------------------------------------------------------------------------------
+
+       Add the interaction of an atom with the multipole expansions of a node.
+
+       --------------------------------------------------------------------------------------- */
+
+    void addNodeIxn(int atom, int node, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                    const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas,
+                    Vec3& force, vector<vector<double>>& sliceEnergies) const;
+
+    double openingAngle;
+    int numSubsets;
+    vector<Node> nodes;
+    vector<int> order, position;
+    vector<double> moments;   // NumMoments*numSubsets values per node
+};
+
+} // namespace NonbondedSlicing
+
+#endif // __ReferenceSlicedTreeCode_H__
@@ -7,19 +7,38 @@
 #include "openmm/reference/ReferencePlatform.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/OpenMMException.h"
+#include <algorithm>
 
 using namespace NonbondedSlicing;
 using namespace OpenMM;
 
+/**
+ * Platforms do not provide a public way of declaring new properties, so this gives access to the
+ * protected list of property names in order to make the plugin-specific ones configurable.
+ */
+class PlatformPropertyRegistrar : public Platform {
+public:
+    static void addProperty(Platform& platform, const std::string& name, const std::string& defaultValue) {
+        std::vector<std::string>& names = platform.*(&PlatformPropertyRegistrar::platformProperties);
+        if (std::find(names.begin(), names.end(), name) == names.end()) {
+            names.push_back(name);
+            platform.setPropertyDefaultValue(name, defaultValue);
+        }
+    }
+};
+
 extern "C" OPENMM_EXPORT void registerPlatforms() {
 }
 
 extern "C" OPENMM_EXPORT void registerKernelFactories() {
     for (int i = 0; i < Platform::getNumPlatforms(); i++) {
         Platform& platform = Platform::getPlatform(i);
-        if (dynamic_cast<ReferencePlatform*>(&platform) != NULL) {
+        // Platforms derived from ReferencePlatform fall back to these kernels unless they provide their own.
+        bool hasOwnKernel = (platform.getName() != "Reference" && platform.supportsKernels({CalcSlicedNonbondedForceKernel::Name()}));
+        if (dynamic_cast<ReferencePlatform*>(&platform) != NULL && !hasOwnKernel) {
             ReferenceNonbondedSlicingKernelFactory* factory = new ReferenceNonbondedSlicingKernelFactory();
             platform.registerKernelFactory(CalcSlicedNonbondedForceKernel::Name(), factory);
+            PlatformPropertyRegistrar::addProperty(platform, ReferenceCalcSlicedNonbondedForceKernel::NeighborListSkin(), "0.1");
         }
     }
 }
@@ -23,9 +23,11 @@
 #include <vector>
 #include <algorithm>
 #include <iostream>
+#include <set>
 
 #include "internal/ReferenceSlicedLJCoulombIxn.h"
 #include "internal/ReferenceSlicedLJCoulomb14.h"
+#include "internal/ReferenceSlicedTreeCode.h"
 
 using namespace NonbondedSlicing;
 using namespace OpenMM;
@@ -54,6 +56,16 @@ static map<string, double>& extractEnergyParameterDerivatives(ContextImpl& conte
 ReferenceCalcSlicedNonbondedForceKernel::~ReferenceCalcSlicedNonbondedForceKernel() {
     if (neighborList != NULL)
         delete neighborList;
+    if (pmeData != NULL)
+        pme_destroy(pmeData);
+    if (dispersionPmeData != NULL)
+        pme_destroy(dispersionPmeData);
+    if (dispersionCorrection != NULL)
+        delete dispersionCorrection;
+    if (treeCode != NULL)
+        delete treeCode;
+    if (sliceEnergyWriter != NULL)
+        delete sliceEnergyWriter;
 }
 
 void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, const SlicedNonbondedForce& force) {
@@ -63,9 +75,7 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
     sliceLambdas.resize(numSlices, vector<double>(2));
     sliceScalingParams.resize(numSlices, vector<ScalingParameterInfo>(2));
 
-    subsets.resize(numParticles);
-    for (int i = 0; i < numParticles; i++)
-        subsets[i] = force.getParticleSubset(i);
+    subsets = force.getParticleSubsets();
 
     set<string> requestedDerivatives;
     for (int i = 0; i < force.getNumScalingParameterDerivatives(); i++)
@@ -78,7 +88,7 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
         force.getScalingParameter(index, name, i, j, includeCoulomb, includeLJ);
         int slice = sliceIndex(i, j);
         bool hasDerivative = requestedDerivatives.find(name) != requestedDerivatives.end();
-        ScalingParameterInfo info = ScalingParameterInfo(name, hasDerivative);
+        ScalingParameterInfo info = ScalingParameterInfo(name, getParamIndex(name), hasDerivative);
         if (includeCoulomb)
             sliceScalingParams[slice][Coul] = info;
         if (includeLJ)
@@ -135,25 +145,45 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
         int particle;
         double charge, sigma, epsilon;
         force.getParticleParameterOffset(i, param, particle, charge, sigma, epsilon);
-        particleParamOffsets[make_pair(param, particle)] = {charge, sigma, epsilon};
+        particleParamOffsets[make_pair(getParamIndex(param), particle)] = {charge, sigma, epsilon};
     }
     for (int i = 0; i < force.getNumExceptionParameterOffsets(); i++) {
         string param;
         int exception;
         double charge, sigma, epsilon;
         force.getExceptionParameterOffset(i, param, exception, charge, sigma, epsilon);
-        exceptionParamOffsets[make_pair(param, nb14Index[exception])] = {charge, sigma, epsilon};
+        exceptionParamOffsets[make_pair(getParamIndex(param), nb14Index[exception])] = {charge, sigma, epsilon};
     }
+    set<int> offsetParams;
+    for (auto& offset : particleParamOffsets)
+        offsetParams.insert(offset.first.first);
+    for (auto& offset : exceptionParamOffsets)
+        offsetParams.insert(offset.first.first);
+    offsetParamIndices = vector<int>(offsetParams.begin(), offsetParams.end());
+    useEnergyCache = force.getUseEnergyCache();
+    useSliceForceGroups = SlicedNonbondedForceImpl::hasSliceForceGroups(force);
+    useSliceForces = force.getUseSliceForces();
+    if (useSliceForces)
+        sliceForces.resize(numSlices);
+    useSliceEnergies = force.getUseSliceEnergies();
+    SlicedNonbondedForceImpl::getSliceForceGroups(force, sliceDirectGroups, sliceReciprocalGroups);
     nonbondedMethod = CalcSlicedNonbondedForceKernel::NonbondedMethod(force.getNonbondedMethod());
     nonbondedCutoff = force.getCutoffDistance();
     if (nonbondedMethod == NoCutoff) {
         neighborList = NULL;
         useSwitchingFunction = false;
+        if (force.getUseTreeCode())
+            treeCode = new ReferenceSlicedTreeCode(force.getTreeCodeOpeningAngle());
     }
     else {
         neighborList = new NeighborList();
         useSwitchingFunction = force.getUseSwitchingFunction();
         switchingDistance = force.getSwitchingDistance();
+        const vector<string>& propertyNames = getPlatform().getPropertyNames();
+        if (find(propertyNames.begin(), propertyNames.end(), NeighborListSkin()) != propertyNames.end())
+            neighborListSkin = stod(getPlatform().getPropertyDefaultValue(NeighborListSkin()));
+        if (neighborListSkin < 0.0)
+            throw OpenMMException("SlicedNonbondedForce: The neighbor list skin cannot be negative");
     }
     if (nonbondedMethod == Ewald) {
         double alpha;
@@ -164,6 +194,8 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
         double alpha;
         SlicedNonbondedForceImpl::calcPMEParameters(system, force, alpha, gridSize[0], gridSize[1], gridSize[2], false);
         ewaldAlpha = alpha;
+        pme_init(&pmeData, ewaldAlpha, numParticles, numSubsets, gridSize, force.getPMEInterpolationOrder(), 1);
+        pme_set_optimal_influence(pmeData, force.getUseOptimalInfluenceFunction());
     }
     else if (nonbondedMethod == LJPME) {
         double alpha;
@@ -172,29 +204,194 @@ void ReferenceCalcSlicedNonbondedForceKernel::initialize(const System& system, c
         SlicedNonbondedForceImpl::calcPMEParameters(system, force, alpha, dispersionGridSize[0], dispersionGridSize[1], dispersionGridSize[2], true);
         ewaldDispersionAlpha = alpha;
         useSwitchingFunction = false;
+        pme_init(&pmeData, ewaldAlpha, numParticles, numSubsets, gridSize, force.getPMEInterpolationOrder(), 1);
+        pme_init(&dispersionPmeData, ewaldDispersionAlpha, numParticles, numSubsets, dispersionGridSize, force.getPMEInterpolationOrder(), 1);
+        pme_set_optimal_influence(pmeData, force.getUseOptimalInfluenceFunction());
+        pme_set_optimal_influence(dispersionPmeData, force.getUseOptimalInfluenceFunction());
     }
     if (nonbondedMethod == NoCutoff || nonbondedMethod == CutoffNonPeriodic)
         exceptionsArePeriodic = false;
     else
         exceptionsArePeriodic = force.getExceptionsUsePeriodicBoundaryConditions();
     rfDielectric = force.getReactionFieldDielectric();
-    if (force.getUseDispersionCorrection())
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(system, force);
+    if (force.getUseDispersionCorrection()) {
+        dispersionCorrection = new SlicedDispersionCorrection(system, force);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    }
     else
         dispersionCoefficients.resize(numSlices, 0.0);
+    if (SliceEnergyWriter::isRequested(force)) {
+        reportedNames = SliceEnergyWriter::getReportedNames(force);
+        sliceEnergyReportInterval = force.getSliceEnergyReportInterval();
+        sliceEnergyWriter = new SliceEnergyWriter(reportedNames, force.getSliceEnergyReportFile(), force.getSliceEnergyCallback());
+    }
 }
 
 double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
     computeParameters(context);
     vector<Vec3>& posData = extractPositions(context);
     vector<Vec3>& forceData = extractForces(context);
+
+    // The slice energies do not depend on the scaling parameters, so those of the previous
+    // evaluation can be reused if nothing else has changed.  The cache is not used when the slices
+    // belong to different force groups.
+
+    vector<vector<double>> sliceEnergies;
+    if (useSliceForceGroups) {
+        // Direct and reciprocal space are evaluated in separate passes.  In each of them, the slices
+        // whose force groups are not included are decoupled and their energies are discarded.
+
+        sliceEnergies.resize(numSlices, (vector<double>){0.0, 0.0});
+        vector<vector<double>> lambdas = sliceLambdas;
+        for (int pass = 0; pass < 2; pass++) {
+            bool direct = (pass == 0);
+            if (!(direct ? includeDirect : includeReciprocal))
+                continue;
+            const vector<int>& groups = (direct ? sliceDirectGroups : sliceReciprocalGroups);
+            for (int slice = 0; slice < numSlices; slice++)
+                if ((includedGroups&(1<<groups[slice])) == 0)
+                    sliceLambdas[slice] = (vector<double>){0.0, 0.0};
+            vector<vector<double>> passEnergies(numSlices, (vector<double>){0.0, 0.0});
+            computeSliceEnergies(context, posData, forceData, passEnergies, includeForces, direct, !direct);
+            for (int slice = 0; slice < numSlices; slice++)
+                if ((includedGroups&(1<<groups[slice])) != 0)
+                    for (int term = 0; term < 2; term++)
+                        sliceEnergies[slice][term] += passEnergies[slice][term];
+            sliceLambdas = lambdas;
+        }
+    }
+    else if (useEnergyCache && !includeForces && energyCacheIsValid(context, posData, includeDirect, includeReciprocal))
+        sliceEnergies = cachedSliceEnergies;
+    else {
+        sliceEnergies.resize(numSlices, (vector<double>){0.0, 0.0});
+        computeSliceEnergies(context, posData, forceData, sliceEnergies, includeForces, includeDirect, includeReciprocal);
+        if (useEnergyCache)
+            storeEnergyCache(context, posData, includeDirect, includeReciprocal, sliceEnergies);
+    }
+
+    // The forces of each slice are computed by another pass in which all other slices are decoupled,
+    // which favors simplicity over speed.  The lambdas are restored before anything else uses them.
+
+    if (useSliceForces && includeForces) {
+        vector<vector<double>> lambdas = sliceLambdas;
+        for (int slice = 0; slice < numSlices; slice++) {
+            sliceForces[slice].assign(numParticles, Vec3());
+            bool direct = includeDirect && (!useSliceForceGroups || (includedGroups&(1<<sliceDirectGroups[slice])) != 0);
+            bool reciprocal = includeReciprocal && (!useSliceForceGroups || (includedGroups&(1<<sliceReciprocalGroups[slice])) != 0);
+            if (!direct && !reciprocal)
+                continue;
+            for (int other = 0; other < numSlices; other++)
+                sliceLambdas[other] = (other == slice ? lambdas[other] : (vector<double>){0.0, 0.0});
+            vector<vector<double>> passEnergies(numSlices, (vector<double>){0.0, 0.0});
+            computeSliceEnergies(context, posData, sliceForces[slice], passEnergies, true, direct, reciprocal);
+        }
+        sliceLambdas = lambdas;
+        hasSliceForces = true;
+    }
+
+    double energy = 0;
+    if (includeEnergy)
+        for (int slice = 0; slice < numSlices; slice++)
+            for (int term = 0; term < 2; term++)
+                energy += sliceLambdas[slice][term]*sliceEnergies[slice][term];
+
+    hasSliceEnergies = (useSliceEnergies && includeEnergy);
+    if (hasSliceEnergies) {
+        lastSliceEnergies.clear();
+        lastSliceLambdas.clear();
+        for (int slice = 0; slice < numSlices; slice++)
+            for (int term = 0; term < 2; term++) {
+                lastSliceEnergies.push_back(sliceEnergies[slice][term]);
+                lastSliceLambdas.push_back(sliceLambdas[slice][term]);
+            }
+    }
+
+    map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
+    for (int slice = 0; slice < numSlices; slice++)
+        for (int term = 0; term < 2; term++) {
+            ScalingParameterInfo info = sliceScalingParams[slice][term];
+            if (info.hasDerivative)
+                energyParamDerivs[info.name] += sliceEnergies[slice][term];
+        }
+
+    // The work of each step of a schedule is accumulated in its first evaluation.
+
+    long long step = context.getStepCount()-scheduleStartStep;
+    if (schedule.size() > 0 && context.getStepCount() != lastWorkStep && step >= 0 && step < (long long) schedule.size()-1) {
+        lastWorkStep = context.getStepCount();
+        for (int slice = 0; slice < numSlices; slice++)
+            for (int term = 0; term < 2; term++) {
+                int paramIndex = sliceScalingParams[slice][term].paramIndex;
+                if (paramIndex != -1 && scheduleColumns[paramIndex] != -1) {
+                    int column = scheduleColumns[paramIndex];
+                    protocolWork += sliceEnergies[slice][term]*(schedule[step+1][column]-schedule[step][column]);
+                }
+            }
+    }
+
+    // The values are already on the host, so the writer only has to deliver them.
+
+    if (sliceEnergyWriter != NULL && sliceEnergyWriter->isDue(context.getStepCount(), sliceEnergyReportInterval)) {
+        vector<double> values;
+        for (string name : reportedNames)
+            values.push_back(energyParamDerivs[name]);
+        sliceEnergyWriter->submit(context.getStepCount(), [values] () {return values;});
+    }
+    return energy;
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::computeSliceEnergies(ContextImpl& context, vector<Vec3>& posData, vector<Vec3>& forceData,
+            vector<vector<double>>& sliceEnergies, bool includeForces, bool includeDirect, bool includeReciprocal) {
+    bool periodic = (nonbondedMethod == CutoffPeriodic);
+    bool ewald  = (nonbondedMethod == Ewald);
+    bool pme  = (nonbondedMethod == PME);
+    calculatePairIxn(context, posData, forceData, sliceEnergies, includeForces, includeDirect, includeReciprocal);
+    if (includeDirect) {
+        ReferenceSlicedLJCoulomb14 nonbonded14;
+        if (exceptionsArePeriodic) {
+            Vec3* boxVectors = extractBoxVectors(context);
+            nonbonded14.setPeriodic(boxVectors);
+        }
+        for (int k = 0; k < num14; k++) {
+            int slice = bonded14SliceArray[k];
+            nonbonded14.calculateBondIxn(bonded14IndexArray[k], posData, bonded14ParamArray[k],
+                                         forceData, sliceLambdas[slice], sliceEnergies[slice]);
+        }
+        if (periodic || ewald || pme) {
+            Vec3* boxVectors = extractBoxVectors(context);
+            double volume = boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2];
+            for (int slice = 0; slice < numSlices; slice++)
+                sliceEnergies[slice][vdW] += dispersionCoefficients[slice]/volume;
+        }
+    }
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::calculatePairIxn(ContextImpl& context, vector<Vec3>& posData, vector<Vec3>& forceData,
+            vector<vector<double>>& sliceEnergies, bool includeForces, bool includeDirect, bool includeReciprocal) {
+    if (treeCode != NULL) {
+        if (includeDirect)
+            treeCode->calculateIxn(numParticles, posData, numSubsets, subsets, particleParamArray, sliceLambdas, exclusions, forceData, sliceEnergies, includeForces);
+        return;
+    }
     ReferenceSlicedLJCoulombIxn clj;
     bool periodic = (nonbondedMethod == CutoffPeriodic);
     bool ewald  = (nonbondedMethod == Ewald);
     bool pme  = (nonbondedMethod == PME);
     bool ljpme = (nonbondedMethod == LJPME);
     if (nonbondedMethod != NoCutoff) {
-        computeNeighborListVoxelHash(*neighborList, numParticles, posData, exclusions, extractBoxVectors(context), periodic || ewald || pme || ljpme, nonbondedCutoff, 0.0);
+        Vec3* boxVectors = extractBoxVectors(context);
+        bool usePeriodic = (periodic || ewald || pme || ljpme);
+        if (!neighborListIsValid(posData, boxVectors)) {
+            currentSkin = neighborListSkin;
+            if (usePeriodic) {
+                double maxDistance = 0.5*min(boxVectors[0][0], min(boxVectors[1][1], boxVectors[2][2]));
+                currentSkin = max(0.0, min(currentSkin, maxDistance-nonbondedCutoff));
+            }
+            computeNeighborListVoxelHash(*neighborList, numParticles, posData, exclusions, boxVectors, usePeriodic, nonbondedCutoff+currentSkin, 0.0);
+            neighborListPositions = posData;
+            for (int i = 0; i < 3; i++)
+                neighborListBox[i] = boxVectors[i];
+        }
         clj.setUseCutoff(nonbondedCutoff, *neighborList, rfDielectric);
     }
     if (periodic || ewald || pme || ljpme) {
@@ -206,62 +403,69 @@ double ReferenceCalcSlicedNonbondedForceKernel::execute(ContextImpl& context, bo
         clj.setPeriodicExceptions(exceptionsArePeriodic);
     }
     if (ewald)
-        clj.setUseEwald(ewaldAlpha, kmax[0], kmax[1], kmax[2]);
+        clj.setUseEwald(ewaldAlpha, kmax[0], kmax[1], kmax[2], &ewaldWorkspace);
     if (pme)
-        clj.setUsePME(ewaldAlpha, gridSize);
+        clj.setUsePME(ewaldAlpha, gridSize, pmeData);
     if (ljpme){
-        clj.setUsePME(ewaldAlpha, gridSize);
-        clj.setUseLJPME(ewaldDispersionAlpha, dispersionGridSize);
+        clj.setUsePME(ewaldAlpha, gridSize, pmeData);
+        clj.setUseLJPME(ewaldDispersionAlpha, dispersionGridSize, dispersionPmeData);
     }
-    vector<vector<double>> sliceEnergies(numSlices, (vector<double>){0.0, 0.0});
     if (useSwitchingFunction)
         clj.setUseSwitchingFunction(switchingDistance);
-    clj.calculatePairIxn(numParticles, posData, numSubsets, subsets, particleParamArray, sliceLambdas, exclusions, forceData, sliceEnergies, includeDirect, includeReciprocal);
+    clj.calculatePairIxn(numParticles, posData, numSubsets, subsets, particleParamArray, sliceLambdas, exclusions, forceData, sliceEnergies, includeDirect, includeReciprocal, includeForces);
+}
 
-    if (includeDirect) {
-        ReferenceSlicedLJCoulomb14 nonbonded14;
-        if (exceptionsArePeriodic) {
-            Vec3* boxVectors = extractBoxVectors(context);
-            nonbonded14.setPeriodic(boxVectors);
-        }
-        for (int k = 0; k < num14; k++) {
-            int slice = bonded14SliceArray[k];
-            nonbonded14.calculateBondIxn(bonded14IndexArray[k], posData, bonded14ParamArray[k],
-                                         forceData, sliceLambdas[slice], sliceEnergies[slice]);
-        }
-        if (periodic || ewald || pme) {
-            Vec3* boxVectors = extractBoxVectors(context);
-            double volume = boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2];
-            for (int slice = 0; slice < numSlices; slice++)
-                sliceEnergies[slice][vdW] += dispersionCoefficients[slice]/volume;
-        }
+bool ReferenceCalcSlicedNonbondedForceKernel::neighborListIsValid(const vector<Vec3>& posData, const Vec3* boxVectors) const {
+    if ((int) neighborListPositions.size() != numParticles)
+        return false;
+    for (int i = 0; i < 3; i++)
+        if (boxVectors[i] != neighborListBox[i])
+            return false;
+    double maxDisplacement2 = 0.25*currentSkin*currentSkin;
+    for (int i = 0; i < numParticles; i++) {
+        Vec3 delta = posData[i]-neighborListPositions[i];
+        if (delta.dot(delta) > maxDisplacement2)
+            return false;
     }
+    return true;
+}
 
-    double energy = 0;
-    if (includeEnergy)
-        for (int slice = 0; slice < numSlices; slice++)
-            for (int term = 0; term < 2; term++)
-                energy += sliceLambdas[slice][term]*sliceEnergies[slice][term];
-
-    map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
-    for (int slice = 0; slice < numSlices; slice++)
-        for (int term = 0; term < 2; term++) {
-            ScalingParameterInfo info = sliceScalingParams[slice][term];
-            if (info.hasDerivative)
-                energyParamDerivs[info.name] += sliceEnergies[slice][term];
-        }
+bool ReferenceCalcSlicedNonbondedForceKernel::energyCacheIsValid(ContextImpl& context, const vector<Vec3>& posData, bool includeDirect, bool includeReciprocal) const {
+    if (!energyCacheValid || includeDirect != cachedIncludeDirect || includeReciprocal != cachedIncludeReciprocal)
+        return false;
+    Vec3* boxVectors = extractBoxVectors(context);
+    for (int i = 0; i < 3; i++)
+        if (boxVectors[i] != cachedBoxVectors[i])
+            return false;
+    for (int i = 0; i < offsetParamIndices.size(); i++)
+        if (context.getParameter(paramNames[offsetParamIndices[i]]) != cachedOffsetParamValues[i])
+            return false;
+    return posData == cachedPositions;
+}
 
-    return energy;
+void ReferenceCalcSlicedNonbondedForceKernel::storeEnergyCache(ContextImpl& context, const vector<Vec3>& posData, bool includeDirect, bool includeReciprocal,
+                                                               const vector<vector<double>>& sliceEnergies) {
+    Vec3* boxVectors = extractBoxVectors(context);
+    for (int i = 0; i < 3; i++)
+        cachedBoxVectors[i] = boxVectors[i];
+    cachedOffsetParamValues.resize(offsetParamIndices.size());
+    for (int i = 0; i < offsetParamIndices.size(); i++)
+        cachedOffsetParamValues[i] = context.getParameter(paramNames[offsetParamIndices[i]]);
+    cachedPositions = posData;
+    cachedSliceEnergies = sliceEnergies;
+    cachedIncludeDirect = includeDirect;
+    cachedIncludeReciprocal = includeReciprocal;
+    energyCacheValid = true;
 }
 
 void ReferenceCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImpl& context, const SlicedNonbondedForce& force) {
     if (force.getNumParticles() != numParticles)
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
+    energyCacheValid = false;
 
     // Get particle subsets.
 
-    for (int i = 0; i < numParticles; i++)
-        subsets[i] = force.getParticleSubset(i);
+    subsets = force.getParticleSubsets();
 
     // Identify which exceptions are 1-4 interactions.
 
@@ -301,8 +505,28 @@ void ReferenceCalcSlicedNonbondedForceKernel::copyParametersToContext(ContextImp
     // Recompute the coefficient for the dispersion correction.
 
     SlicedNonbondedForce::NonbondedMethod method = force.getNonbondedMethod();
-    if (force.getUseDispersionCorrection() && (method == SlicedNonbondedForce::CutoffPeriodic || method == SlicedNonbondedForce::Ewald || method == SlicedNonbondedForce::PME))
-        dispersionCoefficients = SlicedNonbondedForceImpl::calcDispersionCorrections(context.getSystem(), force);
+    if (force.getUseDispersionCorrection() && (method == SlicedNonbondedForce::CutoffPeriodic || method == SlicedNonbondedForce::Ewald || method == SlicedNonbondedForce::PME)) {
+        if (dispersionCorrection != NULL)
+            delete dispersionCorrection;
+        dispersionCorrection = new SlicedDispersionCorrection(context.getSystem(), force);
+        dispersionCorrection->update(context);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    }
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::reassignSubsets(ContextImpl& context, const SlicedNonbondedForce& force, const vector<int>& particles) {
+    vector<int> oldSubsets;
+    for (int particle : particles) {
+        oldSubsets.push_back(subsets[particle]);
+        subsets[particle] = force.getParticleSubset(particle);
+    }
+    energyCacheValid = false;
+    for (int i = 0; i < num14; ++i)
+        bonded14SliceArray[i] = sliceIndex(subsets[bonded14IndexArray[i][0]], subsets[bonded14IndexArray[i][1]]);
+    if (dispersionCorrection != NULL) {
+        dispersionCorrection->moveParticles(force, particles, oldSubsets);
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+    }
 }
 
 void ReferenceCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
@@ -314,6 +538,75 @@ void ReferenceCalcSlicedNonbondedForceKernel::getPMEParameters(double& alpha, in
     nz = gridSize[2];
 }
 
+map<string, double> ReferenceCalcSlicedNonbondedForceKernel::getStageTimings() const {
+    return map<string, double>(); // Stage profiling is only implemented on GPU platforms.
+}
+
+long long ReferenceCalcSlicedNonbondedForceKernel::getPMEGridMemorySavings() const {
+    return 0; // Compact grids are only implemented on GPU platforms.
+}
+
+map<string, long long> ReferenceCalcSlicedNonbondedForceKernel::getMemoryUsage() const {
+    return map<string, long long>(); // All data is kept in host memory.
+}
+
+bool ReferenceCalcSlicedNonbondedForceKernel::getSliceForces(int slice, vector<Vec3>& forces) {
+    if (!hasSliceForces)
+        return false;
+    forces = sliceForces[slice];
+    return true;
+}
+
+bool ReferenceCalcSlicedNonbondedForceKernel::getSliceEnergies(vector<double>& energies, vector<double>& lambdas) {
+    if (!hasSliceEnergies)
+        return false;
+    energies = lastSliceEnergies;
+    lambdas = lastSliceLambdas;
+    return true;
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::setScalingParameterSchedule(ContextImpl& context, const vector<string>& parameters, const vector<vector<double>>& schedule) {
+    scheduleColumns.assign(paramNames.size(), -1);
+    for (int i = 0; i < parameters.size(); i++) {
+        auto position = find(paramNames.begin(), paramNames.end(), parameters[i]);
+        if (position == paramNames.end())
+            throw OpenMMException("setScalingParameterScheduleInContext: There is no scaling parameter called '"+parameters[i]+"'");
+        scheduleColumns[position-paramNames.begin()] = i;
+    }
+    this->schedule = schedule;
+    scheduleStartStep = context.getStepCount();
+    lastWorkStep = scheduleStartStep-1;
+    protocolWork = 0.0;
+}
+
+double ReferenceCalcSlicedNonbondedForceKernel::getProtocolWork() {
+    return protocolWork;
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::setIncludedForceGroups(int groups) {
+    includedGroups = groups;
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::stagePositions(ContextImpl& context, const double* positions) {
+    stagedPositions.resize(context.getSystem().getNumParticles());
+    for (int i = 0; i < stagedPositions.size(); i++)
+        stagedPositions[i] = Vec3(positions[3*i], positions[3*i+1], positions[3*i+2]);
+}
+
+void ReferenceCalcSlicedNonbondedForceKernel::applyStagedPositions(ContextImpl& context) {
+    if (stagedPositions.size() == 0)
+        throw OpenMMException("SlicedNonbondedForce: No positions have been staged");
+    context.setPositions(stagedPositions);
+}
+
+string ReferenceCalcSlicedNonbondedForceKernel::getTunedConfiguration() const {
+    return "";
+}
+
+string ReferenceCalcSlicedNonbondedForceKernel::getFFTBackendName() const {
+    return (pmeData == NULL && dispersionPmeData == NULL ? "" : "pocketfft");
+}
+
 void ReferenceCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (nonbondedMethod != LJPME)
         throw OpenMMException("getPMEParametersInContext: This Context is not using LJPME");
@@ -323,16 +616,43 @@ void ReferenceCalcSlicedNonbondedForceKernel::getLJPMEParameters(double& alpha,
     nz = dispersionGridSize[2];
 }
 
+int ReferenceCalcSlicedNonbondedForceKernel::getParamIndex(const string& name) {
+    auto position = find(paramNames.begin(), paramNames.end(), name);
+    if (position != paramNames.end())
+        return position-paramNames.begin();
+    paramNames.push_back(name);
+    return paramNames.size()-1;
+}
+
 void ReferenceCalcSlicedNonbondedForceKernel::computeParameters(ContextImpl& context) {
 
-    // Compute scaling parameter values.
+    // Query the value of each Context parameter only once.
+
+    vector<double> paramValues(paramNames.size());
+    for (int i = 0; i < paramNames.size(); i++)
+        paramValues[i] = context.getParameter(paramNames[i]);
 
+    // Compute scaling parameter values.  Those with a schedule take their values at the current step,
+    // but the offsets always depend on the values of the context.
+
+    vector<double> scalingValues(paramValues);
+    if (schedule.size() > 0) {
+        int step = (int) max(0LL, min((long long) schedule.size()-1, context.getStepCount()-scheduleStartStep));
+        for (int i = 0; i < paramNames.size(); i++)
+            if (scheduleColumns[i] != -1)
+                scalingValues[i] = schedule[step][scheduleColumns[i]];
+    }
     for (int slice = 0; slice < numSlices; slice++)
         for (int term = 0; term < 2; term++) {
             ScalingParameterInfo info = sliceScalingParams[slice][term];
-            sliceLambdas[slice][term] = info.name == "" ? 1.0 : context.getParameter(info.name);
+            sliceLambdas[slice][term] = info.paramIndex == -1 ? 1.0 : scalingValues[info.paramIndex];
         }
 
+    // Update the dispersion correction if its parameters have changed.
+
+    if (dispersionCorrection != NULL && dispersionCorrection->update(context))
+        dispersionCoefficients = dispersionCorrection->getCoefficients();
+
     // Compute particle parameters.
 
     vector<double> charges(numParticles), sigmas(numParticles), epsilons(numParticles);
@@ -342,7 +662,7 @@ void ReferenceCalcSlicedNonbondedForceKernel::computeParameters(ContextImpl& con
         epsilons[i] = baseParticleParams[i][2];
     }
     for (auto& offset : particleParamOffsets) {
-        double value = context.getParameter(offset.first.first);
+        double value = paramValues[offset.first.first];
         int index = offset.first.second;
         charges[index] += value*offset.second[0];
         sigmas[index] += value*offset.second[1];
@@ -365,7 +685,7 @@ void ReferenceCalcSlicedNonbondedForceKernel::computeParameters(ContextImpl& con
         epsilons[i] = baseExceptionParams[i][2];
     }
     for (auto& offset : exceptionParamOffsets) {
-        double value = context.getParameter(offset.first.first);
+        double value = paramValues[offset.first.first];
         int index = offset.first.second;
         charges[index] += value*offset.second[0];
         sigmas[index] += value*offset.second[1];
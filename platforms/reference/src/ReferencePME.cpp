@@ -12,9 +12,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <complex>
+#include <functional>
 
 #include "internal/ReferenceSlicedPME.h"
+#include "internal/SlicedNonbondedForceImpl.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
+#include "openmm/internal/ThreadPool.h"
 
 #ifdef _MSC_VER
   #define POCKETFFT_NO_VECTORS
@@ -39,11 +42,14 @@ struct pme
     int          nslices;
     double       ewaldcoeff;
 
-    complex<double>* grid;             /* Memory for the grid we spread charges on.
-                                        * Element (i,j,k) is accessed as:
-                                        * grid[i*ngrid[1]*ngrid[2] + j*ngrid[2] + k]
+    double*      realgrid;             /* Memory for the grid we spread charges on.
+                                        * Element (i,j,k) of subset s is accessed as:
+                                        * realgrid[((s*ngrid[0] + i)*ngrid[1] + j)*ngrid[2] + k]
                                         */
-    int          ngrid[3];             /* Total grid dimensions (all data is complex!) */
+    complex<double>* grid;             /* Half complex transform of realgrid, with ngrid[2]/2+1
+                                        * elements along the last dimension
+                                        */
+    int          ngrid[3];             /* Total grid dimensions */
 
     int          order;                /* PME interpolation order. Almost always 4 */
 
@@ -77,12 +83,46 @@ struct pme
      */
 
     double       epsilon_r;             /* Dielectric coefficient to use, typically 1.0 */
+
+    double*      influence;             /* Optimal influence function tabulated on the half complex grid, or NULL if
+                                         * the B-spline moduli are used
+                                         */
+    Vec3         influence_box[3];      /* Box vectors for which the influence function was tabulated */
+
+    ThreadPool*  threads;               /* Optional pool of threads to share the work with, NULL for serial execution */
 };
 
 
 /* Internal setup routines */
 
 
+/* Number of threads among which the work is split */
+static int
+pme_num_threads(pme_t pme)
+{
+    return pme->threads == NULL ? 1 : pme->threads->getNumThreads();
+}
+
+
+/* Split the range [0, n) into contiguous chunks and execute task(thread, start, end) for each of them,
+ * either serially or by the threads of the pool
+ */
+static void
+pme_parallel_for(pme_t pme, int n, const function<void(int, int, int)>& task)
+{
+    if (pme->threads == NULL)
+    {
+        task(0, 0, n);
+        return;
+    }
+    int numThreads = pme->threads->getNumThreads();
+    pme->threads->execute([&] (ThreadPool& threads, int thread) {
+        task(thread, (thread*n)/numThreads, ((thread+1)*n)/numThreads);
+    });
+    pme->threads->waitForThreads();
+}
+
+
 
 /* Only called once from init_pme(), performance does not matter! */
 static void
@@ -199,12 +239,12 @@ pme_update_grid_index_and_fraction(pme_t    pme,
                                    const Vec3 periodicBoxVectors[3],
                                    const Vec3 recipBoxVectors[3])
 {
-    int    i;
+    pme_parallel_for(pme, pme->natoms, [&] (int thread, int start, int end) {
     int    d;
     double t;
     int    ti;
 
-    for (i=0;i<pme->natoms;i++)
+    for (int i=start;i<end;i++)
     {
         /* Index calculation (Look mom, no conditionals!):
          *
@@ -253,6 +293,7 @@ pme_update_grid_index_and_fraction(pme_t    pme,
             pme->particleindex[i][d]    = ti % pme->ngrid[d];
         }
     }
+    });
 }
 
 
@@ -264,7 +305,8 @@ pme_update_grid_index_and_fraction(pme_t    pme,
 static void
 pme_update_bsplines(pme_t    pme)
 {
-    int       i,j,k,l;
+    pme_parallel_for(pme, pme->natoms, [&] (int thread, int start, int end) {
+    int       j,k,l;
     int       order;
     double    dr,div;
     double *  data;
@@ -272,7 +314,7 @@ pme_update_bsplines(pme_t    pme)
 
     order = pme->order;
 
-    for (i=0; (i<pme->natoms); i++)
+    for (int i=start; (i<end); i++)
     {
         for (j=0; j<3; j++)
         {
@@ -314,12 +356,15 @@ pme_update_bsplines(pme_t    pme)
             data[0] = div*(1-dr)*data[0];
         }
     }
+    });
 }
 
 
+/* Each thread spreads the atoms of a distinct range of subsets, so that no two threads write on the same grid */
 static void
 pme_grid_spread_charge(pme_t pme, const vector<double>& charges, const vector<int>& subsets)
 {
+    pme_parallel_for(pme, pme->nsubsets, [&] (int thread, int firstSubset, int lastSubset) {
     int       order;
     int       i;
     int       ix,iy,iz;
@@ -330,19 +375,22 @@ pme_grid_spread_charge(pme_t pme, const vector<double>& charges, const vector<in
     double *  thetax;
     double *  thetay;
     double *  thetaz;
+    int       gridsize = pme->ngrid[0]*pme->ngrid[1]*pme->ngrid[2];
 
     order = pme->order;
 
-    /* Reset the grid */
-    for (i=0;i<pme->ngrid[0]*pme->ngrid[1]*pme->ngrid[2]*pme->nsubsets;i++)
+    /* Reset the grids */
+    for (i=firstSubset*gridsize;i<lastSubset*gridsize;i++)
     {
-        pme->grid[i] = complex<double>(0, 0);
+        pme->realgrid[i] = 0;
     }
 
     for (i=0;i<pme->natoms;i++)
     {
-        q = charges[i];
         int subset = subsets[i];
+        if (subset < firstSubset || subset >= lastSubset)
+            continue;
+        q = charges[i];
 
         /* Grid index for the actual atom position */
         x0index = pme->particleindex[i][0];
@@ -388,210 +436,286 @@ pme_grid_spread_charge(pme_t pme, const vector<double>& charges, const vector<in
                     /* Calculate index in the charge grid */
                     index = ((subset*pme->ngrid[0] + xindex)*pme->ngrid[1] + yindex)*pme->ngrid[2] + zindex;
                     /* Add the charge times the bspline spread/interpolation factors to this grid position */
-                    pme->grid[index] += q*thetax[ix]*thetay[iy]*thetaz[iz];
+                    pme->realgrid[index] += q*thetax[ix]*thetay[iy]*thetaz[iz];
                 }
             }
         }
     }
+    });
 }
 
 
 
+/* Real-to-complex (forward) or complex-to-real (backward) transform of the grids of all subsets */
 static void
-pme_reciprocal_convolution(pme_t     pme,
-                           const Vec3 periodicBoxVectors[3],
-                           const Vec3 recipBoxVectors[3],
-                           vector<vector<double>>& sliceEnergies)
+pme_fft(pme_t pme, bool forward)
 {
-    int kx,ky,kz;
-    int nx,ny,nz;
-    double mx,my,mz;
-    double mhx,mhy,mhz,m2;
-    double one_4pi_eps;
-    double bx,by,bz;
-    double d1,d2;
-    double eterm,vfactor;
-    double factor;
-    double denom;
-    double boxfactor;
-    double maxkx,maxky,maxkz;
-
-    complex<double> *ptr;
-
-    nx = pme->ngrid[0];
-    ny = pme->ngrid[1];
-    nz = pme->ngrid[2];
-
-    one_4pi_eps = ONE_4PI_EPS0/pme->epsilon_r;
-    factor = M_PI*M_PI/(pme->ewaldcoeff*pme->ewaldcoeff);
-    boxfactor = M_PI*periodicBoxVectors[0][0]*periodicBoxVectors[1][1]*periodicBoxVectors[2][2];
-
-    maxkx = (nx+1)/2;
-    maxky = (ny+1)/2;
-    maxkz = (nz+1)/2;
-
-    for (kx=0;kx<nx;kx++)
-    {
-        /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
-        mx  = (kx<maxkx) ? kx : (kx-nx);
-        mhx = mx*recipBoxVectors[0][0];
-        bx  = boxfactor*pme->bsplines_moduli[0][kx];
-
-        for (ky=0;ky<ny;ky++)
-        {
-            /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
-            my  = (ky<maxky) ? ky : (ky-ny);
-            mhy = mx*recipBoxVectors[1][0]+my*recipBoxVectors[1][1];
-            by  = pme->bsplines_moduli[1][ky];
+    size_t nx = pme->ngrid[0];
+    size_t ny = pme->ngrid[1];
+    size_t nz = pme->ngrid[2];
+    size_t nzc = nz/2+1;
+    pocketfft::shape_t shape = {(size_t) pme->nsubsets, nx, ny, nz};
+    pocketfft::shape_t axes = {1, 2, 3};
+    pocketfft::stride_t realStride = {(ptrdiff_t) (nx*ny*nz*sizeof(double)),
+                                      (ptrdiff_t) (ny*nz*sizeof(double)),
+                                      (ptrdiff_t) (nz*sizeof(double)),
+                                      (ptrdiff_t) sizeof(double)};
+    pocketfft::stride_t complexStride = {(ptrdiff_t) (nx*ny*nzc*sizeof(complex<double>)),
+                                         (ptrdiff_t) (ny*nzc*sizeof(complex<double>)),
+                                         (ptrdiff_t) (nzc*sizeof(complex<double>)),
+                                         (ptrdiff_t) sizeof(complex<double>)};
+    if (forward)
+        pocketfft::r2c(shape, realStride, complexStride, axes, true, pme->realgrid, pme->grid, 1.0, 0);
+    else
+        pocketfft::c2r(shape, complexStride, realStride, axes, false, pme->grid, pme->realgrid, 1.0, 0);
+}
 
-            for (kz=0;kz<nz;kz++)
-            {
-                /* If the net charge of the system is 0.0, there will not be any DC (direct current, zero frequency) component. However,
-                 * we can still handle charged systems through a charge correction, in which case the DC
-                 * component should be excluded from recprocal space. We will anyway run into problems below when dividing with the
-                 * frequency if it is zero...
-                 *
-                 * In cuda you could probably work around this by setting something to 0.0 instead, but the short story is that we
-                 * should skip the zero frequency case!
-                 */
-                if (kx==0 && ky==0 && kz==0)
-                {
-                    continue;
-                }
 
-                /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
-                mz        = (kz<maxkz) ? kz : (kz-nz);
-                mhz       = mx*recipBoxVectors[2][0]+my*recipBoxVectors[2][1]+mz*recipBoxVectors[2][2];
+/* Squared norm of the reciprocal vector with integer components (mx,my,mz) */
+static double
+pme_frequency_norm2(const Vec3 recipBoxVectors[3], double mx, double my, double mz)
+{
+    double mhx = mx*recipBoxVectors[0][0];
+    double mhy = mx*recipBoxVectors[1][0]+my*recipBoxVectors[1][1];
+    double mhz = mx*recipBoxVectors[2][0]+my*recipBoxVectors[2][1]+mz*recipBoxVectors[2][2];
+    return mhx*mhx+mhy*mhy+mhz*mhz;
+}
 
-                /* Calculate the convolution - see the Essman/Darden paper for the equation! */
-                m2        = mhx*mhx+mhy*mhy+mhz*mhz;
-                bz        = pme->bsplines_moduli[2][kz];
-                denom     = m2*bx*by*bz;
 
-                eterm     = one_4pi_eps*exp(-factor*m2)/denom;
+/* Coulomb Ewald kernel for a nonzero reciprocal vector whose squared norm is m2 */
+static double
+pme_coulomb_kernel(pme_t pme, double m2, double factor, double boxfactor)
+{
+    return ONE_4PI_EPS0/pme->epsilon_r*exp(-factor*m2)/(m2*boxfactor);
+}
 
-                for (int j = 0; j < pme->nsubsets; j++) {
 
-                    /* Pointer to the grid cell in question */
-                    ptr = pme->grid + ((j*nx + kx)*ny + ky)*nz + kz;
+/* Dispersion Ewald kernel for a reciprocal vector whose squared norm is m2 */
+static double
+pme_dispersion_kernel(pme_t pme, double m2, double boxfactor)
+{
+    double bfac = M_PI / pme->ewaldcoeff;
+    double fac1 = 2.0*M_PI*M_PI*M_PI*sqrt(M_PI);
+    double fac2 = pme->ewaldcoeff*pme->ewaldcoeff*pme->ewaldcoeff;
+    double fac3 = -2.0*pme->ewaldcoeff*M_PI*M_PI;
+    double m     = sqrt(m2);
+    double m3    = m*m2;
+    double b     = bfac*m;
+    return (fac1*erfc(b)*m3 + exp(-b*b)*(fac2 + fac3*m2)) * boxfactor;
+}
 
-                    /* Get grid data for this frequency */
-                    d1 = ptr->real();
-                    d2 = ptr->imag();
 
-                    /* write back convolution data to grid */
-                    ptr->real(d1*eterm);
-                    ptr->imag(d2*eterm);
+/* Coulomb influence function for grid frequency (kx,ky,kz). The zero frequency is excluded. */
+static double
+pme_coulomb_eterm(pme_t pme, const Vec3 recipBoxVectors[3], int kx, int ky, int kz, double factor, double boxfactor)
+{
+    int nx = pme->ngrid[0];
+    int ny = pme->ngrid[1];
+    int nz = pme->ngrid[2];
 
-                    /* Long-range PME contribution to the energy for this frequency */
-                    sliceEnergies[j*(j+3)/2][Coul] += 0.5*eterm*(d1*d1 + d2*d2);
-                    for (int i = 0; i < j; i++) {
-                        ptr = pme->grid + ((i*nx + kx)*ny + ky)*nz + kz;
-                        sliceEnergies[j*(j+1)/2+i][Coul] += d1*ptr->real() + d2*ptr->imag();
-                    }
-                }
-            }
-        }
+    if (kx==0 && ky==0 && kz==0)
+    {
+        return 0;
     }
+
+    /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
+    double mx  = (kx<(nx+1)/2) ? kx : (kx-nx);
+    double my  = (ky<(ny+1)/2) ? ky : (ky-ny);
+    double mz  = (kz<(nz+1)/2) ? kz : (kz-nz);
+
+    /* Calculate the convolution - see the Essman/Darden paper for the equation! */
+    double m2    = pme_frequency_norm2(recipBoxVectors, mx, my, mz);
+    double moduli = pme->bsplines_moduli[0][kx]*pme->bsplines_moduli[1][ky]*pme->bsplines_moduli[2][kz];
+    return pme_coulomb_kernel(pme, m2, factor, boxfactor)/moduli;
 }
 
 
-static void
-dpme_reciprocal_convolution(pme_t pme,
-                           const Vec3 periodicBoxVectors[3],
-                           const Vec3 recipBoxVectors[3],
-                           vector<vector<double>>& sliceEnergies)
+/* Dispersion influence function for grid frequency (kx,ky,kz). Unlike the Coulombic case, there's an m=0 term. */
+static double
+pme_dispersion_eterm(pme_t pme, const Vec3 recipBoxVectors[3], int kx, int ky, int kz, double boxfactor)
 {
-    int kx,ky,kz;
-    int nx,ny,nz;
-    double mx,my,mz;
-    double mhx,mhy,mhz,m2;
-    double bx,by,bz;
-    double d1,d2;
-    double eterm;
-    double denom;
-    double boxfactor;
-    double maxkx,maxky,maxkz;
+    int nx = pme->ngrid[0];
+    int ny = pme->ngrid[1];
+    int nz = pme->ngrid[2];
 
-    complex<double> *ptr;
+    /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
+    double mx  = (kx<(nx+1)/2) ? kx : (kx-nx);
+    double my  = (ky<(ny+1)/2) ? ky : (ky-ny);
+    double mz  = (kz<(nz+1)/2) ? kz : (kz-nz);
 
-    nx = pme->ngrid[0];
-    ny = pme->ngrid[1];
-    nz = pme->ngrid[2];
+    /* Calculate the convolution - see the Essman/Darden paper for the equation! */
+    double m2    = pme_frequency_norm2(recipBoxVectors, mx, my, mz);
+    double moduli = pme->bsplines_moduli[0][kx]*pme->bsplines_moduli[1][ky]*pme->bsplines_moduli[2][kz];
+    return pme_dispersion_kernel(pme, m2, boxfactor)/moduli;
+}
 
-    boxfactor = -2*M_PI*sqrt(M_PI) / (6.0*periodicBoxVectors[0][0]*periodicBoxVectors[1][1]*periodicBoxVectors[2][2]);
 
-    maxkx = (nx+1)/2;
-    maxky = (ny+1)/2;
-    maxkz = (nz+1)/2;
+/* Energy-optimal influence function of P3M for grid frequency (kx,ky,kz), see Ballenegger, Cerda, and Holm,
+ * J. Chem. Theory Comput. 8, 936 (2012). The Ewald kernel is averaged over the aliases of the frequency,
+ * weighted by the squared Fourier transform of the B-splines, and the squared sum of these weights replaces
+ * the B-spline moduli. It reduces to the smooth PME influence function when aliasing is negligible.
+ */
+static double
+pme_optimal_eterm(pme_t pme, const Vec3 recipBoxVectors[3], int kx, int ky, int kz, double factor, double boxfactor, int term)
+{
+    const int naliases = SlicedNonbondedForceImpl::InfluenceFunctionAliases;
+    if (term == Coul && kx==0 && ky==0 && kz==0)
+    {
+        return 0;
+    }
 
-    double bfac = M_PI / pme->ewaldcoeff;
-    double fac1 = 2.0*M_PI*M_PI*M_PI*sqrt(M_PI);
-    double fac2 = pme->ewaldcoeff*pme->ewaldcoeff*pme->ewaldcoeff;
-    double fac3 = -2.0*pme->ewaldcoeff*M_PI*M_PI;
-    double b, m, m3, expfac, expterm, erfcterm;
+    int k[3] = {kx, ky, kz};
+    int m[3];
+    double weight[3][2*naliases+1];
+    double weightsum[3];
 
-    for (kx=0;kx<nx;kx++)
+    for (int d=0;d<3;d++)
     {
-        /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
-        mx  = ((kx<maxkx) ? kx : (kx-nx));
-        mhx = mx*recipBoxVectors[0][0];
-        bx  = pme->bsplines_moduli[0][kx];
-
-        for (ky=0;ky<ny;ky++)
+        int n = pme->ngrid[d];
+        m[d] = (k[d]<(n+1)/2) ? k[d] : (k[d]-n);
+        weightsum[d] = 0;
+        for (int a=-naliases;a<=naliases;a++)
         {
-            /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
-            my  = ((ky<maxky) ? ky : (ky-ny));
-            mhy = mx*recipBoxVectors[1][0]+my*recipBoxVectors[1][1];
-            by  = pme->bsplines_moduli[1][ky];
+            double x = M_PI*(m[d]/(double) n + a);
+            weight[d][a+naliases] = (x == 0 ? 1.0 : pow(sin(x)/x, 2*pme->order));
+            weightsum[d] += weight[d][a+naliases];
+        }
+    }
+
+    double sum = 0;
+    for (int a=-naliases;a<=naliases;a++)
+        for (int b=-naliases;b<=naliases;b++)
+            for (int c=-naliases;c<=naliases;c++)
+            {
+                double mx = m[0]+a*pme->ngrid[0];
+                double my = m[1]+b*pme->ngrid[1];
+                double mz = m[2]+c*pme->ngrid[2];
+                double w = weight[0][a+naliases]*weight[1][b+naliases]*weight[2][c+naliases];
+                double m2 = pme_frequency_norm2(recipBoxVectors, mx, my, mz);
+                if (term == Coul)
+                    sum += w*pme_coulomb_kernel(pme, m2, factor, boxfactor);
+                else
+                    sum += w*pme_dispersion_kernel(pme, m2, boxfactor);
+            }
 
-            for (kz=0;kz<nz;kz++)
+    double norm = weightsum[0]*weightsum[1]*weightsum[2];
+    return sum/(norm*norm);
+}
+
+
+/* Tabulate the optimal influence function on the half complex grid, unless it is up to date for the current box.
+ * As for the smooth PME influence function, Nyquist frequencies take the average over k and -k.
+ */
+static void
+pme_update_influence_function(pme_t pme, const Vec3 periodicBoxVectors[3], const Vec3 recipBoxVectors[3], double factor, double boxfactor, int term)
+{
+    if (periodicBoxVectors[0] == pme->influence_box[0] && periodicBoxVectors[1] == pme->influence_box[1] && periodicBoxVectors[2] == pme->influence_box[2])
+        return;
+    int nx = pme->ngrid[0];
+    int ny = pme->ngrid[1];
+    int nz = pme->ngrid[2];
+    int nzc = nz/2+1;
+    pme_parallel_for(pme, nx, [&] (int thread, int start, int end) {
+    for (int kx=start;kx<end;kx++)
+        for (int ky=0;ky<ny;ky++)
+            for (int kz=0;kz<nzc;kz++)
             {
-                /*
-                 * Unlike the Coulombic case, there's an m=0 term so all terms are considered here.
-                 */
+                double eterm = pme_optimal_eterm(pme, recipBoxVectors, kx, ky, kz, factor, boxfactor, term);
+                if (2*kx==nx || 2*ky==ny || 2*kz==nz)
+                    eterm = 0.5*(eterm + pme_optimal_eterm(pme, recipBoxVectors, (nx-kx)%nx, (ny-ky)%ny, (nz-kz)%nz, factor, boxfactor, term));
+                pme->influence[(kx*ny + ky)*nzc + kz] = eterm;
+            }
+    });
+    for (int d=0;d<3;d++)
+        pme->influence_box[d] = periodicBoxVectors[d];
+}
 
-                /* Calculate frequency. Grid indices in the upper half correspond to negative frequencies! */
-                mz        = ((kz<maxkz) ? kz : (kz-nz));
-                mhz       = mx*recipBoxVectors[2][0]+my*recipBoxVectors[2][1]+mz*recipBoxVectors[2][2];
 
-                /* Calculate the convolution - see the Essman/Darden paper for the equation! */
-                m2        = mhx*mhx+mhy*mhy+mhz*mhz;
-                bz        = pme->bsplines_moduli[2][kz];
-                denom     = boxfactor / (bx*by*bz);
+/* Convolve the half complex grids of all subsets with the influence function and accumulate the slice energies.
+ *
+ * Each stored frequency k also stands for its mirror image -k, which is absent from the half complex grid unless
+ * kz is 0 or nz/2. On even grids, the Nyquist frequency is its own mirror image, so the influence function is not
+ * symmetric in triclinic boxes. It is then replaced by the average over k and -k, which reproduces the full
+ * complex transform exactly.
+ */
+static void
+pme_reciprocal_convolution(pme_t     pme,
+                           const Vec3 periodicBoxVectors[3],
+                           const Vec3 recipBoxVectors[3],
+                           vector<vector<double>>& sliceEnergies,
+                           int term)
+{
+    int nx = pme->ngrid[0];
+    int ny = pme->ngrid[1];
+    int nz = pme->ngrid[2];
+    int nzc = nz/2+1;
+    double volume = periodicBoxVectors[0][0]*periodicBoxVectors[1][1]*periodicBoxVectors[2][2];
+    double factor = M_PI*M_PI/(pme->ewaldcoeff*pme->ewaldcoeff);
+    double boxfactor = (term == Coul ? M_PI*volume : -2*M_PI*sqrt(M_PI)/(6.0*volume));
+
+    /* Each thread accumulates the energies of its own range of kx planes */
+    vector<vector<double>> threadEnergies(pme_num_threads(pme), vector<double>(pme->nslices, 0.0));
 
-                m = sqrt(m2);
-                m3 = m*m2;
-                b = bfac*m;
-                expfac = -b*b;
-                erfcterm = erfc(b);
-                expterm = exp(expfac);
+    if (pme->influence != NULL)
+        pme_update_influence_function(pme, periodicBoxVectors, recipBoxVectors, factor, boxfactor, term);
 
-                eterm     = (fac1*erfcterm*m3 + expterm*(fac2 + fac3*m2)) * denom;
+    pme_parallel_for(pme, nx, [&] (int thread, int start, int end) {
+    vector<double>& energies = threadEnergies[thread];
+    for (int kx=start;kx<end;kx++)
+    {
+        for (int ky=0;ky<ny;ky++)
+        {
+            for (int kz=0;kz<nzc;kz++)
+            {
+                double eterm;
+                if (pme->influence != NULL)
+                    eterm = pme->influence[(kx*ny + ky)*nzc + kz];
+                else if (term == Coul)
+                {
+                    eterm = pme_coulomb_eterm(pme, recipBoxVectors, kx, ky, kz, factor, boxfactor);
+                    if (2*kx==nx || 2*ky==ny || 2*kz==nz)
+                        eterm = 0.5*(eterm + pme_coulomb_eterm(pme, recipBoxVectors, (nx-kx)%nx, (ny-ky)%ny, (nz-kz)%nz, factor, boxfactor));
+                }
+                else
+                {
+                    eterm = pme_dispersion_eterm(pme, recipBoxVectors, kx, ky, kz, boxfactor);
+                    if (2*kx==nx || 2*ky==ny || 2*kz==nz)
+                        eterm = 0.5*(eterm + pme_dispersion_eterm(pme, recipBoxVectors, (nx-kx)%nx, (ny-ky)%ny, (nz-kz)%nz, boxfactor));
+                }
+
+                /* Frequencies whose mirror images are not stored in the half complex grid count twice */
+                double weight = (kz==0 || 2*kz==nz) ? 1 : 2;
 
                 for (int j = 0; j < pme->nsubsets; j++) {
 
                     /* Pointer to the grid cell in question */
-                    ptr = pme->grid + ((j*nx + kx)*ny + ky)*nz + kz;
+                    complex<double>* ptr = pme->grid + ((j*nx + kx)*ny + ky)*nzc + kz;
 
                     /* Get grid data for this frequency */
-                    d1 = ptr->real();
-                    d2 = ptr->imag();
+                    double d1 = ptr->real();
+                    double d2 = ptr->imag();
 
                     /* write back convolution data to grid */
                     ptr->real(d1*eterm);
                     ptr->imag(d2*eterm);
 
-                    /* Long-range PME contribution to the energy for this frequency */
-                    sliceEnergies[j*(j+3)/2][vdW] += 0.5*eterm*(d1*d1 + d2*d2);
+                    /* Long-range PME contribution to the energy for this frequency. Grids of lower subsets have
+                     * already been convolved, so their values include the factor eterm.
+                     */
+                    energies[j*(j+3)/2] += 0.5*weight*eterm*(d1*d1 + d2*d2);
                     for (int i = 0; i < j; i++) {
-                        ptr = pme->grid + ((i*nx + kx)*ny + ky)*nz + kz;
-                        sliceEnergies[j*(j+1)/2+i][vdW] += d1*ptr->real() + d2*ptr->imag();
+                        ptr = pme->grid + ((i*nx + kx)*ny + ky)*nzc + kz;
+                        energies[j*(j+1)/2+i] += weight*(d1*ptr->real() + d2*ptr->imag());
                     }
                 }
             }
         }
     }
+    });
+
+    for (auto& energies : threadEnergies)
+        for (int slice = 0; slice < pme->nslices; slice++)
+            sliceEnergies[slice][term] += energies[slice];
 }
 
 
@@ -604,12 +728,22 @@ pme_grid_interpolate_force(pme_t pme,
                            vector<Vec3>& forces,
                            int term)
 {
-    int       i;
+    int       order;
+    int       nx,ny,nz;
+
+    nx    = pme->ngrid[0];
+    ny    = pme->ngrid[1];
+    nz    = pme->ngrid[2];
+
+    order = pme->order;
+
+    /* This is almost identical to the charge spreading routine! */
+
+    pme_parallel_for(pme, pme->natoms, [&] (int thread, int start, int end) {
     int       ix,iy,iz;
     int       x0index,y0index,z0index;
     int       xindex,yindex,zindex;
     int       index;
-    int       order;
     double    q;
     double *  thetax;
     double *  thetay;
@@ -621,17 +755,8 @@ pme_grid_interpolate_force(pme_t pme,
     double    dtx,dty,dtz;
     double    fx,fy,fz;
     double    gridvalue;
-    int       nx,ny,nz;
 
-    nx    = pme->ngrid[0];
-    ny    = pme->ngrid[1];
-    nz    = pme->ngrid[2];
-
-    order = pme->order;
-
-    /* This is almost identical to the charge spreading routine! */
-
-    for (i=0;i<pme->natoms;i++)
+    for (int i=start;i<end;i++)
     {
         fx = fy = fz = 0;
 
@@ -679,12 +804,11 @@ pme_grid_interpolate_force(pme_t pme,
                     dtz                  = dthetaz[iz];
 
                     for (int sj = 0; sj < pme->nsubsets; sj++) {
-                        index = ((sj*pme->ngrid[2] + xindex)*pme->ngrid[1] + yindex)*pme->ngrid[2] + zindex;
+                        index = ((sj*pme->ngrid[0] + xindex)*pme->ngrid[1] + yindex)*pme->ngrid[2] + zindex;
                         int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
 
-                        /* Get the fft+convoluted+ifft:d data from the grid, which must be real by definition */
-                        /* Checking that the imaginary part is indeed zero might be a good check :-) */
-                        gridvalue = sliceLambdas[slice][term]*pme->grid[index].real();
+                        /* Get the fft+convoluted+ifft:d data from the grid, which is real by construction */
+                        gridvalue = sliceLambdas[slice][term]*pme->realgrid[index];
 
                         /* The d component of the force is calculated by taking the derived bspline in dimension d, normal bsplines in the other two */
                         fx += dtx*ty*tz*gridvalue;
@@ -699,6 +823,7 @@ pme_grid_interpolate_force(pme_t pme,
         forces[i][1] -= q*(fx*nx*recipBoxVectors[1][0]+fy*ny*recipBoxVectors[1][1]);
         forces[i][2] -= q*(fx*nx*recipBoxVectors[2][0]+fy*ny*recipBoxVectors[2][1]+fz*nz*recipBoxVectors[2][2]);
     }
+    });
 }
 
 
@@ -725,6 +850,8 @@ pme_init(pme_t *       ppme,
     pme->natoms      = natoms;
     pme->nsubsets = nsubsets;
     pme->nslices = nsubsets*(nsubsets+1)/2;
+    pme->threads     = NULL;
+    pme->influence   = NULL;
 
     for (d=0;d<3;d++)
     {
@@ -737,7 +864,8 @@ pme_init(pme_t *       ppme,
     pme->particleindex    = (ivec *)malloc(sizeof(ivec)*natoms);
 
     /* Allocate charge grid storage */
-    pme->grid        = (complex<double> *)malloc(sizeof(complex<double>)*ngrid[0]*ngrid[1]*ngrid[2]*nsubsets);
+    pme->realgrid    = (double *)malloc(sizeof(double)*ngrid[0]*ngrid[1]*ngrid[2]*nsubsets);
+    pme->grid        = (complex<double> *)malloc(sizeof(complex<double>)*ngrid[0]*ngrid[1]*(ngrid[2]/2+1)*nsubsets);
 
     /* Setup bspline moduli (see Essman paper) */
     pme_calculate_bsplines_moduli(pme);
@@ -751,6 +879,27 @@ pme_init(pme_t *       ppme,
 
 
 
+void
+pme_set_threads(pme_t pme, ThreadPool* threads)
+{
+    pme->threads = threads;
+}
+
+
+void
+pme_set_optimal_influence(pme_t pme, bool use)
+{
+    free(pme->influence);
+    pme->influence = NULL;
+    if (use)
+    {
+        pme->influence = (double *)malloc(sizeof(double)*pme->ngrid[0]*pme->ngrid[1]*(pme->ngrid[2]/2+1));
+        for (int d=0;d<3;d++)
+            pme->influence_box[d] = Vec3();
+    }
+}
+
+
 int pme_exec(pme_t       pme,
              const vector<Vec3>& atomCoordinates,
              const vector<int>& atomSubsets,
@@ -758,7 +907,8 @@ int pme_exec(pme_t       pme,
              vector<Vec3>& forces,
              const vector<double>& charges,
              const Vec3 periodicBoxVectors[3],
-             vector<vector<double>>& sliceEnergies)
+             vector<vector<double>>& sliceEnergies,
+             bool includeForces)
 {
     /* Routine is called with coordinates in x, a box, and charges in q */
 
@@ -781,28 +931,18 @@ int pme_exec(pme_t       pme,
     /* Spread the charges on grid (using newly calculated bsplines in the pme structure) */
     pme_grid_spread_charge(pme, charges, atomSubsets);
 
-    /* do 3d-fft */
-    int nx = pme->ngrid[0];
-    int ny = pme->ngrid[1];
-    int nz = pme->ngrid[2];
-    vector<size_t> shape = {(size_t) nx, (size_t) ny, (size_t) nz};
-    vector<size_t> axes = {0, 1, 2};
-    vector<ptrdiff_t> stride = {(ptrdiff_t) (ny*nz*sizeof(complex<double>)),
-                                (ptrdiff_t) (nz*sizeof(complex<double>)),
-                                (ptrdiff_t) sizeof(complex<double>)};
-    for (int i = 0; i < pme->nsubsets; i++) {
-        int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, true, pme->grid+offset, pme->grid+offset, 1.0, 0);
-    }
+    /* do 3d-fft of all subset grids at once */
+    pme_fft(pme, true);
 
     /* solve in k-space */
-    pme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,sliceEnergies);
+    pme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,sliceEnergies,Coul);
 
-    /* do 3d-invfft */
-    for (int i = 0; i < pme->nsubsets; i++) {
-        int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, false, pme->grid+offset, pme->grid+offset, 1.0, 0);
-    }
+    /* The energies are complete, so there is nothing left to do if forces are not needed */
+    if (!includeForces)
+        return 0;
+
+    /* do 3d-invfft of all subset grids at once */
+    pme_fft(pme, false);
 
     /* Get the particle forces from the grid and bsplines in the pme structure */
     pme_grid_interpolate_force(pme,recipBoxVectors,atomSubsets,sliceLambdas,charges,forces,Coul);
@@ -818,7 +958,8 @@ int pme_exec_dpme(pme_t       pme,
              vector<Vec3>& forces,
              const vector<double>& c6s,
              const Vec3 periodicBoxVectors[3],
-             vector<vector<double>>& sliceEnergies)
+             vector<vector<double>>& sliceEnergies,
+             bool includeForces)
 {
     /* Routine is called with coordinates in x, a box, and charges in q */
 
@@ -841,28 +982,18 @@ int pme_exec_dpme(pme_t       pme,
     /* Spread the charges on grid (using newly calculated bsplines in the pme structure) */
     pme_grid_spread_charge(pme, c6s, atomSubsets);
 
-    /* do 3d-fft */
-    int nx = pme->ngrid[0];
-    int ny = pme->ngrid[1];
-    int nz = pme->ngrid[2];
-    vector<size_t> shape = {(size_t) nx, (size_t) ny, (size_t) nz};
-    vector<size_t> axes = {0, 1, 2};
-    vector<ptrdiff_t> stride = {(ptrdiff_t) (ny*nz*sizeof(complex<double>)),
-                                (ptrdiff_t) (nz*sizeof(complex<double>)),
-                                (ptrdiff_t) sizeof(complex<double>)};
-    for (int i = 0; i < pme->nsubsets; i++) {
-        int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, true, pme->grid+offset, pme->grid+offset, 1.0, 0);
-    }
+    /* do 3d-fft of all subset grids at once */
+    pme_fft(pme, true);
 
     /* solve in k-space */
-    dpme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,sliceEnergies);
+    pme_reciprocal_convolution(pme,periodicBoxVectors,recipBoxVectors,sliceEnergies,vdW);
 
-    /* do 3d-invfft */
-    for (int i = 0; i < pme->nsubsets; i++) {
-        int offset = i*nx*ny*nz;
-        pocketfft::c2c(shape, stride, stride, axes, false, pme->grid+offset, pme->grid+offset, 1.0, 0);
-    }
+    /* The energies are complete, so there is nothing left to do if forces are not needed */
+    if (!includeForces)
+        return 0;
+
+    /* do 3d-invfft of all subset grids at once */
+    pme_fft(pme, false);
 
     /* Get the particle forces from the grid and bsplines in the pme structure */
     pme_grid_interpolate_force(pme,recipBoxVectors,atomSubsets,sliceLambdas,c6s,forces,vdW);
@@ -876,7 +1007,9 @@ pme_destroy(pme_t    pme)
 {
     int d;
 
+    free(pme->realgrid);
     free(pme->grid);
+    free(pme->influence);
 
     for (d=0;d<3;d++)
     {
@@ -35,7 +35,8 @@ using namespace OpenMM;
    --------------------------------------------------------------------------------------- */
 
 ReferenceSlicedLJCoulombIxn::ReferenceSlicedLJCoulombIxn() : cutoff(false), useSwitch(false),
-            periodic(false), periodicExceptions(false), ewald(false), pme(false), ljpme(false) {
+            periodic(false), periodicExceptions(false), ewald(false), pme(false), ljpme(false),
+            pmeData(NULL), dispersionPmeData(NULL), ewaldWorkspace(NULL) {
 }
 
 /**---------------------------------------------------------------------------------------
@@ -110,11 +111,12 @@ void ReferenceSlicedLJCoulombIxn::setPeriodic(OpenMM::Vec3* vectors) {
 
      --------------------------------------------------------------------------------------- */
 
-void ReferenceSlicedLJCoulombIxn::setUseEwald(double alpha, int kmaxx, int kmaxy, int kmaxz) {
+void ReferenceSlicedLJCoulombIxn::setUseEwald(double alpha, int kmaxx, int kmaxy, int kmaxz, EwaldWorkspace* workspace) {
     alphaEwald = alpha;
     numRx = kmaxx;
     numRy = kmaxy;
     numRz = kmaxz;
+    ewaldWorkspace = workspace;
     ewald = true;
 }
 
@@ -124,14 +126,16 @@ void ReferenceSlicedLJCoulombIxn::setUseEwald(double alpha, int kmaxx, int kmaxy
 
      @param alpha  the Ewald separation parameter
      @param gridSize the dimensions of the mesh
+     @param pmeData  a persistent PME object matching alpha and gridSize (optional)
 
      --------------------------------------------------------------------------------------- */
 
-void ReferenceSlicedLJCoulombIxn::setUsePME(double alpha, int meshSize[3]) {
+void ReferenceSlicedLJCoulombIxn::setUsePME(double alpha, int meshSize[3], pme_t pmeData) {
     alphaEwald = alpha;
     meshDim[0] = meshSize[0];
     meshDim[1] = meshSize[1];
     meshDim[2] = meshSize[2];
+    this->pmeData = pmeData;
     pme = true;
 }
 
@@ -141,14 +145,16 @@ void ReferenceSlicedLJCoulombIxn::setUsePME(double alpha, int meshSize[3]) {
 
      @param alpha  the dispersion Ewald separation parameter
      @param gridSize the dimensions of the dispersion mesh
+     @param pmeData  a persistent PME object matching alpha and gridSize (optional)
 
      --------------------------------------------------------------------------------------- */
 
-void ReferenceSlicedLJCoulombIxn::setUseLJPME(double alpha, int meshSize[3]) {
+void ReferenceSlicedLJCoulombIxn::setUseLJPME(double alpha, int meshSize[3], pme_t pmeData) {
     alphaDispersionEwald = alpha;
     dispersionMeshDim[0] = meshSize[0];
     dispersionMeshDim[1] = meshSize[1];
     dispersionMeshDim[2] = meshSize[2];
+    dispersionPmeData = pmeData;
     ljpme = true;
 }
 
@@ -171,12 +177,13 @@ void ReferenceSlicedLJCoulombIxn::setPeriodicExceptions(bool periodic) {
    @param sliceEnergies    the energy of each slice
    @param includeDirect      true if direct space interactions should be included
    @param includeReciprocal  true if reciprocal space interactions should be included
+   @param includeForces      true if forces should be computed.  If false, only energies are computed.
 
    --------------------------------------------------------------------------------------- */
 
 void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
                                             const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int>>& exclusions,
-                                            vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const {
+                                            vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal, bool includeForces) const {
     typedef complex<double> d_complex;
 
     int kmax = ewald ? max(numRx, max(numRy, numRz)) : 0;
@@ -211,28 +218,34 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
     // PME
 
     if (pme && includeReciprocal) {
-        pme_t pmedata; /* abstract handle for PME data */
+        pme_t pmedata = pmeData; /* abstract handle for PME data */
 
-        pme_init(&pmedata, alphaEwald, numberOfAtoms, numberOfSubsets, meshDim, 5, 1);
+        if (pmeData == NULL)
+            pme_init(&pmedata, alphaEwald, numberOfAtoms, numberOfSubsets, meshDim, 5, 1);
 
         vector<double> charges(numberOfAtoms);
         for (int i = 0; i < numberOfAtoms; i++)
             charges[i] = atomParameters[i][QIndex];
-        pme_exec(pmedata, atomCoordinates, atomSubsets, sliceLambdas, forces, charges, periodicBoxVectors, sliceEnergies);
+        pme_exec(pmedata, atomCoordinates, atomSubsets, sliceLambdas, forces, charges, periodicBoxVectors, sliceEnergies, includeForces);
 
-        pme_destroy(pmedata);
+        if (pmeData == NULL)
+            pme_destroy(pmedata);
 
         if (ljpme) {
             // Dispersion reciprocal space terms
-            pme_init(&pmedata, alphaDispersionEwald, numberOfAtoms, numberOfSubsets, dispersionMeshDim, 5, 1);
+            pmedata = dispersionPmeData;
+            if (dispersionPmeData == NULL)
+                pme_init(&pmedata, alphaDispersionEwald, numberOfAtoms, numberOfSubsets, dispersionMeshDim, 5, 1);
 
-            vector<Vec3> dpmeforces(numberOfAtoms);
+            vector<Vec3> dpmeforces(includeForces ? numberOfAtoms : 0);
             for (int i = 0; i < numberOfAtoms; i++)
                 charges[i] = 8.0*pow(atomParameters[i][SigIndex], 3.0)*atomParameters[i][EpsIndex];
-            pme_exec_dpme(pmedata, atomCoordinates, atomSubsets, sliceLambdas, dpmeforces, charges, periodicBoxVectors, sliceEnergies);
-            for (int i = 0; i < numberOfAtoms; i++)
-                forces[i] += dpmeforces[i];
-            pme_destroy(pmedata);
+            pme_exec_dpme(pmedata, atomCoordinates, atomSubsets, sliceLambdas, dpmeforces, charges, periodicBoxVectors, sliceEnergies, includeForces);
+            if (includeForces)
+                for (int i = 0; i < numberOfAtoms; i++)
+                    forces[i] += dpmeforces[i];
+            if (dispersionPmeData == NULL)
+                pme_destroy(pmedata);
         }
     }
     // Ewald method
@@ -243,28 +256,36 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
 
         double recipBoxSize[3] = { TWO_PI/periodicBoxVectors[0][0], TWO_PI/periodicBoxVectors[1][1], TWO_PI/periodicBoxVectors[2][2]};
 
-        // setup K-vectors
-
-        #define EIR(subset, x, y, z) eir[(((subset)*kmax+(x))*numberOfAtoms+(y))*3+z]
-        vector<d_complex> eir(numberOfSubsets*kmax*numberOfAtoms*3);
-        vector<d_complex> tab_xy(numberOfAtoms);
-        vector<d_complex> tab_qxyz(numberOfAtoms);
+        // setup K-vectors.  Each atom belongs to a single subset, so its phase factors are stored
+        // only once and the subsets are distinguished when the structure factors are accumulated.
 
         if (kmax < 1)
             throw OpenMMException("kmax for Ewald summation < 1");
 
+        EwaldWorkspace temporaryWorkspace;
+        EwaldWorkspace& workspace = (ewaldWorkspace == NULL ? temporaryWorkspace : *ewaldWorkspace);
+        vector<d_complex>& eir = workspace.eir;
+        vector<d_complex>& tab_xy = workspace.tab_xy;
+        vector<d_complex>& tab_qxyz = workspace.tab_qxyz;
+        vector<d_complex>& structureFactor = workspace.structureFactor;
+        eir.resize(numberOfAtoms*kmax*3);
+        tab_xy.resize(numberOfAtoms);
+        tab_qxyz.resize(numberOfAtoms);
+        structureFactor.resize(numberOfSubsets);
+
+        #define EIR(x, y, z) eir[((y)*kmax+(x))*3+z]
+
         for (int i = 0; (i < numberOfAtoms); i++) {
-            int subset = atomSubsets[i];
             for (int m = 0; (m < 3); m++)
-                EIR(subset, 0, i, m) = d_complex(1,0);
+                EIR(0, i, m) = d_complex(1,0);
 
             for (int m=0; (m<3); m++)
-                EIR(subset, 1, i, m) = d_complex(cos(atomCoordinates[i][m]*recipBoxSize[m]),
+                EIR(1, i, m) = d_complex(cos(atomCoordinates[i][m]*recipBoxSize[m]),
                                          sin(atomCoordinates[i][m]*recipBoxSize[m]));
 
             for (int j=2; (j<kmax); j++)
                 for (int m=0; (m<3); m++)
-                    EIR(subset, j, i, m) = EIR(subset, j-1, i, m)*EIR(subset, 1, i, m);
+                    EIR(j, i, m) = EIR(j-1, i, m)*EIR(1, i, m);
         }
 
         // calculate reciprocal space energy and forces
@@ -281,47 +302,34 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
                 double ky = ry*recipBoxSize[1];
 
                 if (ry >= 0)
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        int subset = atomSubsets[n];
-                        tab_xy[n] = EIR(subset, rx, n, 0)*EIR(subset, ry, n, 1);
-                    }
+                    for (int n = 0; n < numberOfAtoms; n++)
+                        tab_xy[n] = EIR(rx, n, 0)*EIR(ry, n, 1);
                 else
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        int subset = atomSubsets[n];
-                        tab_xy[n]= EIR(subset, rx, n, 0)*conj(EIR(subset, -ry, n, 1));
-                    }
+                    for (int n = 0; n < numberOfAtoms; n++)
+                        tab_xy[n]= EIR(rx, n, 0)*conj(EIR(-ry, n, 1));
 
                 for (int rz = lowrz; rz < numRz; rz++) {
 
                     if (rz >= 0)
-                        for (int n = 0; n < numberOfAtoms; n++) {
-                            int subset = atomSubsets[n];
-                            tab_qxyz[n] = atomParameters[n][QIndex]*(tab_xy[n]*EIR(subset, rz, n, 2));
-                        }
+                        for (int n = 0; n < numberOfAtoms; n++)
+                            tab_qxyz[n] = atomParameters[n][QIndex]*(tab_xy[n]*EIR(rz, n, 2));
                     else
-                        for (int n = 0; n < numberOfAtoms; n++) {
-                            int subset = atomSubsets[n];
-                            tab_qxyz[n] = atomParameters[n][QIndex]*(tab_xy[n]*conj(EIR(subset, -rz, n, 2)));
-                        }
+                        for (int n = 0; n < numberOfAtoms; n++)
+                            tab_qxyz[n] = atomParameters[n][QIndex]*(tab_xy[n]*conj(EIR(-rz, n, 2)));
 
-                    vector<double> cs(numberOfSubsets, 0);
-                    vector<double> ss(numberOfSubsets, 0);
-
-                    for (int n = 0; n < numberOfAtoms; n++) {
-                        int subset = atomSubsets[n];
-                        cs[subset] += tab_qxyz[n].real();
-                        ss[subset] += tab_qxyz[n].imag();
-                    }
+                    fill(structureFactor.begin(), structureFactor.end(), d_complex(0, 0));
+                    for (int n = 0; n < numberOfAtoms; n++)
+                        structureFactor[atomSubsets[n]] += tab_qxyz[n];
 
                     double kz = rz*recipBoxSize[2];
                     double k2 = kx*kx + ky*ky + kz*kz;
                     double ak = exp(k2*factorEwald)/k2;
 
-                    for (int n = 0; n < numberOfAtoms; n++) {
+                    for (int n = 0; n < numberOfAtoms && includeForces; n++) {
                         int i = atomSubsets[n];
                         for (int j = 0; j < numberOfSubsets; j++) {
                             int slice = i > j ? i*(i+1)/2+j : j*(j+1)/2+i;
-                            double force = 2*recipCoeff*sliceLambdas[slice][Coul]*ak*(cs[j]*tab_qxyz[n].imag() - ss[j]*tab_qxyz[n].real());
+                            double force = 2*recipCoeff*sliceLambdas[slice][Coul]*ak*(structureFactor[j].real()*tab_qxyz[n].imag() - structureFactor[j].imag()*tab_qxyz[n].real());
                             forces[n][0] += force*kx;
                             forces[n][1] += force*ky;
                             forces[n][2] += force*kz;
@@ -330,8 +338,8 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
 
                     for (int j = 0; j < numberOfSubsets; j++) {
                         for (int i = 0; i < j; i++)
-                            sliceEnergies[j*(j+1)/2+i][Coul] += 2*recipCoeff*ak*(cs[i]*cs[j] + ss[i]*ss[j]);
-                        sliceEnergies[j*(j+3)/2][Coul] += recipCoeff*ak*(cs[j]*cs[j] + ss[j]*ss[j]);
+                            sliceEnergies[j*(j+1)/2+i][Coul] += 2*recipCoeff*ak*(structureFactor[i]*conj(structureFactor[j])).real();
+                        sliceEnergies[j*(j+3)/2][Coul] += recipCoeff*ak*norm(structureFactor[j]);
                     }
 
                     lowrz = 1 - numRz;
@@ -339,6 +347,7 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
                 lowry = 1 - numRy;
             }
         }
+        #undef EIR
     }
 
     // **************************************************************************************
@@ -348,146 +357,209 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
     if (!includeDirect)
         return;
 
-    for (auto& pair : *neighborList) {
-        int ii = pair.first;
-        int jj = pair.second;
+    vector<double> flatParameters, flatLambdas, flatEnergies(NumTerms*sliceEnergies.size(), 0.0);
+    flattenAtomParameters(atomParameters, flatParameters);
+    flattenSliceValues(sliceLambdas, flatLambdas);
+    if (ljpme)
+        calculateEwaldDirectIxn<true, false>(numberOfAtoms, atomCoordinates, atomSubsets, flatParameters.data(), flatLambdas.data(), exclusions, forces, flatEnergies.data());
+    else if (useSwitch)
+        calculateEwaldDirectIxn<false, true>(numberOfAtoms, atomCoordinates, atomSubsets, flatParameters.data(), flatLambdas.data(), exclusions, forces, flatEnergies.data());
+    else
+        calculateEwaldDirectIxn<false, false>(numberOfAtoms, atomCoordinates, atomSubsets, flatParameters.data(), flatLambdas.data(), exclusions, forces, flatEnergies.data());
+    addSliceValues(flatEnergies, sliceEnergies);
+}
 
-        int si = atomSubsets[ii];
-        int sj = atomSubsets[jj];
-        int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
+template <bool USE_LJPME, bool USE_SWITCH>
+void ReferenceSlicedLJCoulombIxn::calculateEwaldDirectIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                            const double* atomParameters, const double* sliceLambdas, const vector<set<int>>& exclusions,
+                                            vector<Vec3>& forces, double* sliceEnergies) const {
+    for (auto& pair : *neighborList)
+        calculateOneEwaldIxn<USE_LJPME, USE_SWITCH>(pair.first, pair.second, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
 
-        double deltaR[2][ReferenceForce::LastDeltaRIndex];
-        ReferenceForce::getDeltaRPeriodic(atomCoordinates[jj], atomCoordinates[ii], periodicBoxVectors, deltaR[0]);
-        double r         = deltaR[0][ReferenceForce::RIndex];
-        double inverseR  = 1.0/(deltaR[0][ReferenceForce::RIndex]);
-        double switchValue = 1, switchDeriv = 0;
-        if (useSwitch && r > switchingDistance) {
-            double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
-            switchValue = 1+t*t*t*(-10+t*(15-t*6));
-            switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
-        }
-        double alphaR = alphaEwald*r;
+    // Now subtract off the exclusions, since they were implicitly included in the reciprocal space sum.
 
-        double dEdRCoul = ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*inverseR*inverseR;
-        dEdRCoul *= erfc(alphaR) + 2*alphaR*exp(-alphaR*alphaR)/SQRT_PI;
+    for (int i = 0; i < numberOfAtoms; i++)
+        for (int exclusion : exclusions[i])
+            if (exclusion > i)
+                calculateOneEwaldExclusionIxn<USE_LJPME>(i, exclusion, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
+}
 
-        double sig = atomParameters[ii][SigIndex] +  atomParameters[jj][SigIndex];
-        double sig2 = inverseR*sig;
-        sig2 *= sig2;
-        double sig6 = sig2*sig2*sig2;
-        double eps = atomParameters[ii][EpsIndex]*atomParameters[jj][EpsIndex];
-        double dEdRvdW = switchValue*eps*(12.0*sig6 - 6.0)*sig6*inverseR*inverseR;
-        double vdwEnergy = eps*(sig6-1.0)*sig6;
+/**---------------------------------------------------------------------------------------
 
-        if (ljpme) {
-            double dalphaR   = alphaDispersionEwald*r;
-            double dar2 = dalphaR*dalphaR;
-            double dar4 = dar2*dar2;
-            double dar6 = dar4*dar2;
-            double inverseR2 = inverseR*inverseR;
-            double c6i = 8.0*pow(atomParameters[ii][SigIndex], 3.0)*atomParameters[ii][EpsIndex];
-            double c6j = 8.0*pow(atomParameters[jj][SigIndex], 3.0)*atomParameters[jj][EpsIndex];
-            // For the energies and forces, we first add the regular Lorentz−Berthelot terms.  The C12 term is treated as usual
-            // but we then subtract out (remembering that the C6 term is negative) the multiplicative C6 term that has been
-            // computed in real space.  Finally, we add a potential shift term to account for the difference between the LB
-            // and multiplicative functional forms at the cutoff.
-            double emult = c6i*c6j*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
-            dEdRvdW += 6.0*c6i*c6j*inverseR2*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4 + dar6/6.0));
-
-            double inverseCut2 = 1.0/(cutoffDistance*cutoffDistance);
-            double inverseCut6 = inverseCut2*inverseCut2*inverseCut2;
-            sig2 = atomParameters[ii][SigIndex] +  atomParameters[jj][SigIndex];
-            sig2 *= sig2;
-            sig6 = sig2*sig2*sig2;
-            // The additive part of the potential shift
-            double potentialshift = eps*(1.0-sig6*inverseCut6)*sig6*inverseCut6;
-            dalphaR   = alphaDispersionEwald*cutoffDistance;
-            dar2 = dalphaR*dalphaR;
-            dar4 = dar2*dar2;
-            // The multiplicative part of the potential shift
-            potentialshift -= c6i*c6j*inverseCut6*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
-            vdwEnergy += emult + potentialshift;
-        }
+     Calculate the direct space part of the Ewald ixn between two atoms
 
-        if (useSwitch) {
-            dEdRvdW -= vdwEnergy*switchDeriv*inverseR;
-            vdwEnergy *= switchValue;
-        }
+     @param ii               the index of the first atom
+     @param jj               the index of the second atom
+     @param atomCoordinates  atom coordinates
+     @param atomSubsets      atom subsets
+     @param atomParameters   atom parameters (sigma, epsilon, charge), NumAtomParams per atom
+     @param sliceLambdas     Coulomb and LJ scaling parameters, NumTerms per slice
+     @param forces           force array (forces added)
+     @param sliceEnergies    Coulomb and LJ energies, NumTerms per slice (energies added)
 
-        // accumulate forces
+     --------------------------------------------------------------------------------------- */
 
-        double factor = sliceLambdas[slice][vdW]*dEdRvdW+sliceLambdas[slice][Coul]*dEdRCoul;
-        for (int kk = 0; kk < 3; kk++) {
-            double force = factor*deltaR[0][kk];
-            forces[ii][kk] += force;
-            forces[jj][kk] -= force;
-        }
+template <bool USE_LJPME, bool USE_SWITCH>
+void ReferenceSlicedLJCoulombIxn::calculateOneEwaldIxn(int ii, int jj, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                            const double* atomParameters, const double* sliceLambdas, vector<Vec3>& forces,
+                                            double* sliceEnergies) const {
+    double SQRT_PI = sqrt(PI_M);
+    int si = atomSubsets[ii];
+    int sj = atomSubsets[jj];
+    int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
+    const double* params1 = &atomParameters[NumAtomParams*ii];
+    const double* params2 = &atomParameters[NumAtomParams*jj];
+    const double* lambdas = &sliceLambdas[NumTerms*slice];
+    double* energies = &sliceEnergies[NumTerms*slice];
 
-        // accumulate energies
-        sliceEnergies[slice][vdW] += vdwEnergy;
-        sliceEnergies[slice][Coul] += ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*erfc(alphaR);
+    double deltaR[2][ReferenceForce::LastDeltaRIndex];
+    ReferenceForce::getDeltaRPeriodic(atomCoordinates[jj], atomCoordinates[ii], periodicBoxVectors, deltaR[0]);
+    double r         = deltaR[0][ReferenceForce::RIndex];
+    if (r > cutoffDistance)
+        return;
+    double inverseR  = 1.0/(deltaR[0][ReferenceForce::RIndex]);
+    double switchValue = 1, switchDeriv = 0;
+    if (USE_SWITCH && r > switchingDistance) {
+        double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
+        switchValue = 1+t*t*t*(-10+t*(15-t*6));
+        switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
     }
+    double alphaR = alphaEwald*r;
 
-    // Now subtract off the exclusions, since they were implicitly included in the reciprocal space sum.
+    double dEdRCoul = ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*inverseR*inverseR*inverseR;
+    dEdRCoul *= erfc(alphaR) + 2*alphaR*exp(-alphaR*alphaR)/SQRT_PI;
 
+    double sig = params1[SigIndex] +  params2[SigIndex];
+    double sig2 = inverseR*sig;
+    sig2 *= sig2;
+    double sig6 = sig2*sig2*sig2;
+    double eps = params1[EpsIndex]*params2[EpsIndex];
+    double dEdRvdW = switchValue*eps*(12.0*sig6 - 6.0)*sig6*inverseR*inverseR;
+    double vdwEnergy = eps*(sig6-1.0)*sig6;
+
+    if (USE_LJPME) {
+        double dalphaR   = alphaDispersionEwald*r;
+        double dar2 = dalphaR*dalphaR;
+        double dar4 = dar2*dar2;
+        double dar6 = dar4*dar2;
+        double inverseR2 = inverseR*inverseR;
+        double c6i = 8.0*pow(params1[SigIndex], 3.0)*params1[EpsIndex];
+        double c6j = 8.0*pow(params2[SigIndex], 3.0)*params2[EpsIndex];
+        // For the energies and forces, we first add the regular Lorentz−Berthelot terms.  The C12 term is treated as usual
+        // but we then subtract out (remembering that the C6 term is negative) the multiplicative C6 term that has been
+        // computed in real space.  Finally, we add a potential shift term to account for the difference between the LB
+        // and multiplicative functional forms at the cutoff.
+        double emult = c6i*c6j*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
+        dEdRvdW += 6.0*c6i*c6j*inverseR2*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4 + dar6/6.0));
+
+        double inverseCut2 = 1.0/(cutoffDistance*cutoffDistance);
+        double inverseCut6 = inverseCut2*inverseCut2*inverseCut2;
+        sig2 = params1[SigIndex] +  params2[SigIndex];
+        sig2 *= sig2;
+        sig6 = sig2*sig2*sig2;
+        // The additive part of the potential shift
+        double potentialshift = eps*(1.0-sig6*inverseCut6)*sig6*inverseCut6;
+        dalphaR   = alphaDispersionEwald*cutoffDistance;
+        dar2 = dalphaR*dalphaR;
+        dar4 = dar2*dar2;
+        // The multiplicative part of the potential shift
+        potentialshift -= c6i*c6j*inverseCut6*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
+        vdwEnergy += emult + potentialshift;
+    }
+
+    if (USE_SWITCH) {
+        dEdRvdW -= vdwEnergy*switchDeriv*inverseR;
+        vdwEnergy *= switchValue;
+    }
+
+    // accumulate forces
+
+    double factor = lambdas[vdW]*dEdRvdW+lambdas[Coul]*dEdRCoul;
+    for (int kk = 0; kk < 3; kk++) {
+        double force = factor*deltaR[0][kk];
+        forces[ii][kk] += force;
+        forces[jj][kk] -= force;
+    }
+
+    // accumulate energies
+    energies[vdW] += vdwEnergy;
+    energies[Coul] += ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*inverseR*erfc(alphaR);
+}
+
+/**---------------------------------------------------------------------------------------
+
+     Subtract the reciprocal space contribution of an excluded pair of atoms
+
+     @param ii               the index of the first atom
+     @param jj               the index of the second atom
+     @param atomCoordinates  atom coordinates
+     @param atomSubsets      atom subsets
+     @param atomParameters   atom parameters (sigma, epsilon, charge), NumAtomParams per atom
+     @param sliceLambdas     Coulomb and LJ scaling parameters, NumTerms per slice
+     @param forces           force array (forces added)
+     @param sliceEnergies    Coulomb and LJ energies, NumTerms per slice (energies added)
+
+     --------------------------------------------------------------------------------------- */
+
+template <bool USE_LJPME>
+void ReferenceSlicedLJCoulombIxn::calculateOneEwaldExclusionIxn(int ii, int jj, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                            const double* atomParameters, const double* sliceLambdas, vector<Vec3>& forces,
+                                            double* sliceEnergies) const {
+    double SQRT_PI = sqrt(PI_M);
     const double TWO_OVER_SQRT_PI = 2/sqrt(PI_M);
-    for (int i = 0; i < numberOfAtoms; i++)
-        for (int exclusion : exclusions[i]) {
-            if (exclusion > i) {
-                int ii = i;
-                int jj = exclusion;
-
-                int si = atomSubsets[ii];
-                int sj = atomSubsets[jj];
-                int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
-
-                double deltaR[2][ReferenceForce::LastDeltaRIndex];
-                if (periodicExceptions)
-                    ReferenceForce::getDeltaRPeriodic(atomCoordinates[jj], atomCoordinates[ii], periodicBoxVectors, deltaR[0]);
-                else
-                    ReferenceForce::getDeltaR(atomCoordinates[jj], atomCoordinates[ii], deltaR[0]);
-                double r        = deltaR[0][ReferenceForce::RIndex];
-                double inverseR = 1.0/(deltaR[0][ReferenceForce::RIndex]);
-                double alphaR   = alphaEwald*r;
-                if (erf(alphaR) > 1e-6) {
-                    double dEdR = ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*inverseR*inverseR;
-                    dEdR = dEdR*(erf(alphaR) - 2*alphaR*exp(-alphaR*alphaR)/SQRT_PI);
-
-                    // accumulate forces
-                    double factor = sliceLambdas[slice][Coul]*dEdR;
-                    for (int kk = 0; kk < 3; kk++) {
-                        double force = factor*deltaR[0][kk];
-                        forces[ii][kk] -= force;
-                        forces[jj][kk] += force;
-                    }
+    int si = atomSubsets[ii];
+    int sj = atomSubsets[jj];
+    int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
+    const double* params1 = &atomParameters[NumAtomParams*ii];
+    const double* params2 = &atomParameters[NumAtomParams*jj];
+    const double* lambdas = &sliceLambdas[NumTerms*slice];
+    double* energies = &sliceEnergies[NumTerms*slice];
 
-                    // accumulate energies
+    double deltaR[2][ReferenceForce::LastDeltaRIndex];
+    if (periodicExceptions)
+        ReferenceForce::getDeltaRPeriodic(atomCoordinates[jj], atomCoordinates[ii], periodicBoxVectors, deltaR[0]);
+    else
+        ReferenceForce::getDeltaR(atomCoordinates[jj], atomCoordinates[ii], deltaR[0]);
+    double r        = deltaR[0][ReferenceForce::RIndex];
+    double inverseR = 1.0/(deltaR[0][ReferenceForce::RIndex]);
+    double alphaR   = alphaEwald*r;
+    if (erf(alphaR) > 1e-6) {
+        double dEdR = ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*inverseR*inverseR*inverseR;
+        dEdR = dEdR*(erf(alphaR) - 2*alphaR*exp(-alphaR*alphaR)/SQRT_PI);
 
-                    sliceEnergies[slice][Coul] -= ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR*erf(alphaR);
-                }
-                else
-                    sliceEnergies[slice][Coul] -= alphaEwald*TWO_OVER_SQRT_PI*ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex];
-
-                if (ljpme) {
-                    // Dispersion terms.  Here we just back out the reciprocal space terms, and don't add any extra real space terms.
-                    double dalphaR   = alphaDispersionEwald*r;
-                    double inverseR2 = inverseR*inverseR;
-                    double dar2 = dalphaR*dalphaR;
-                    double dar4 = dar2*dar2;
-                    double dar6 = dar4*dar2;
-                    double c6i = 8.0*pow(atomParameters[ii][SigIndex], 3.0)*atomParameters[ii][EpsIndex];
-                    double c6j = 8.0*pow(atomParameters[jj][SigIndex], 3.0)*atomParameters[jj][EpsIndex];
-                    sliceEnergies[slice][vdW] += c6i*c6j*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
-                    double dEdR = -6.0*c6i*c6j*inverseR2*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4 + dar6/6.0));
-                    double factor = sliceLambdas[slice][vdW]*dEdR;
-                    for (int kk = 0; kk < 3; kk++) {
-                        double force = factor*deltaR[0][kk];
-                        forces[ii][kk] -= force;
-                        forces[jj][kk] += force;
-                    }
-                }
-            }
+        // accumulate forces
+        double factor = lambdas[Coul]*dEdR;
+        for (int kk = 0; kk < 3; kk++) {
+            double force = factor*deltaR[0][kk];
+            forces[ii][kk] -= force;
+            forces[jj][kk] += force;
         }
+
+        // accumulate energies
+
+        energies[Coul] -= ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*inverseR*erf(alphaR);
+    }
+    else
+        energies[Coul] -= alphaEwald*TWO_OVER_SQRT_PI*ONE_4PI_EPS0*params1[QIndex]*params2[QIndex];
+
+    if (USE_LJPME) {
+        // Dispersion terms.  Here we just back out the reciprocal space terms, and don't add any extra real space terms.
+        double dalphaR   = alphaDispersionEwald*r;
+        double inverseR2 = inverseR*inverseR;
+        double dar2 = dalphaR*dalphaR;
+        double dar4 = dar2*dar2;
+        double dar6 = dar4*dar2;
+        double c6i = 8.0*pow(params1[SigIndex], 3.0)*params1[EpsIndex];
+        double c6j = 8.0*pow(params2[SigIndex], 3.0)*params2[EpsIndex];
+        energies[vdW] += c6i*c6j*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4));
+        double dEdR = -6.0*c6i*c6j*inverseR2*inverseR2*inverseR2*inverseR2*(1.0 - EXP(-dar2)*(1.0 + dar2 + 0.5*dar4 + dar6/6.0));
+        double factor = lambdas[vdW]*dEdR;
+        for (int kk = 0; kk < 3; kk++) {
+            double force = factor*deltaR[0][kk];
+            forces[ii][kk] -= force;
+            forces[jj][kk] += force;
+        }
+    }
 }
 
 
@@ -506,23 +578,58 @@ void ReferenceSlicedLJCoulombIxn::calculateEwaldIxn(int numberOfAtoms, vector<Ve
    @param sliceEnergies    the energy of each slice
    @param includeDirect      true if direct space interactions should be included
    @param includeReciprocal  true if reciprocal space interactions should be included
+   @param includeForces      true if forces should be computed.  If false, only energies are computed.
 
    --------------------------------------------------------------------------------------- */
 
 void ReferenceSlicedLJCoulombIxn::calculatePairIxn(int numberOfAtoms, vector<Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
                 const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int>>& exclusions,
-                vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal) const {
+                vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeDirect, bool includeReciprocal, bool includeForces) const {
 
     if (ewald || pme || ljpme) {
         calculateEwaldIxn(numberOfAtoms, atomCoordinates, numberOfSubsets, atomSubsets, atomParameters, sliceLambdas, exclusions, forces,
-                          sliceEnergies, includeDirect, includeReciprocal);
+                          sliceEnergies, includeDirect, includeReciprocal, includeForces);
         return;
     }
     if (!includeDirect)
         return;
-    if (cutoff) {
+
+    // Select the specialized pair loop once, rather than branching on the options for every pair.
+
+    vector<double> flatParameters, flatLambdas, flatEnergies(NumTerms*sliceEnergies.size(), 0.0);
+    flattenAtomParameters(atomParameters, flatParameters);
+    flattenSliceValues(sliceLambdas, flatLambdas);
+    const double* params = flatParameters.data();
+    const double* lambdas = flatLambdas.data();
+    double* energies = flatEnergies.data();
+    if (cutoff && periodic) {
+        if (useSwitch)
+            calculateDirectIxn<true, true, true>(numberOfAtoms, atomCoordinates, atomSubsets, params, lambdas, exclusions, forces, energies);
+        else
+            calculateDirectIxn<true, true, false>(numberOfAtoms, atomCoordinates, atomSubsets, params, lambdas, exclusions, forces, energies);
+    }
+    else if (cutoff) {
+        if (useSwitch)
+            calculateDirectIxn<true, false, true>(numberOfAtoms, atomCoordinates, atomSubsets, params, lambdas, exclusions, forces, energies);
+        else
+            calculateDirectIxn<true, false, false>(numberOfAtoms, atomCoordinates, atomSubsets, params, lambdas, exclusions, forces, energies);
+    }
+    else {
+        if (useSwitch)
+            calculateDirectIxn<false, false, true>(numberOfAtoms, atomCoordinates, atomSubsets, params, lambdas, exclusions, forces, energies);
+        else
+            calculateDirectIxn<false, false, false>(numberOfAtoms, atomCoordinates, atomSubsets, params, lambdas, exclusions, forces, energies);
+    }
+    addSliceValues(flatEnergies, sliceEnergies);
+}
+
+template <bool USE_CUTOFF, bool USE_PERIODIC, bool USE_SWITCH>
+void ReferenceSlicedLJCoulombIxn::calculateDirectIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                            const double* atomParameters, const double* sliceLambdas, const vector<set<int>>& exclusions,
+                                            vector<Vec3>& forces, double* sliceEnergies) const {
+    if (USE_CUTOFF) {
         for (auto& pair : *neighborList)
-            calculateOneIxn(pair.first, pair.second, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
+            calculateOneIxn<USE_CUTOFF, USE_PERIODIC, USE_SWITCH>(pair.first, pair.second, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
     }
     else {
         for (int ii = 0; ii < numberOfAtoms; ii++) {
@@ -530,7 +637,7 @@ void ReferenceSlicedLJCoulombIxn::calculatePairIxn(int numberOfAtoms, vector<Vec
 
             for (int jj = ii+1; jj < numberOfAtoms; jj++)
                 if (exclusions[jj].find(ii) == exclusions[jj].end())
-                    calculateOneIxn(ii, jj, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
+                    calculateOneIxn<USE_CUTOFF, USE_PERIODIC, USE_SWITCH>(ii, jj, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, forces, sliceEnergies);
         }
     }
 }
@@ -543,33 +650,40 @@ void ReferenceSlicedLJCoulombIxn::calculatePairIxn(int numberOfAtoms, vector<Vec
      @param jj               the index of the second atom
      @param atomCoordinates  atom coordinates
      @param atomSubsets      atom subsets
-     @param atomParameters   atom parameters (charges, c6, c12, ...)     atomParameters[atomIndex][paramterIndex]
-     @param sliceLambda      Coulomb and LJ scaling parameters for each slice
+     @param atomParameters   atom parameters (sigma, epsilon, charge), NumAtomParams per atom
+     @param sliceLambdas     Coulomb and LJ scaling parameters, NumTerms per slice
      @param forces           force array (forces added)
-     @param sliceEnergies    the energy of each slice
+     @param sliceEnergies    Coulomb and LJ energies, NumTerms per slice (energies added)
 
      --------------------------------------------------------------------------------------- */
 
-void ReferenceSlicedLJCoulombIxn::calculateOneIxn(int ii, int jj, vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
-                                            const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, vector<Vec3>& forces,
-                                            vector<vector<double>>& sliceEnergies) const {
+template <bool USE_CUTOFF, bool USE_PERIODIC, bool USE_SWITCH>
+void ReferenceSlicedLJCoulombIxn::calculateOneIxn(int ii, int jj, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                                            const double* atomParameters, const double* sliceLambdas, vector<Vec3>& forces,
+                                            double* sliceEnergies) const {
     double deltaR[2][ReferenceForce::LastDeltaRIndex];
 
     int si = atomSubsets[ii];
     int sj = atomSubsets[jj];
     int slice = si > sj ? si*(si+1)/2+sj : sj*(sj+1)/2+si;
+    const double* params1 = &atomParameters[NumAtomParams*ii];
+    const double* params2 = &atomParameters[NumAtomParams*jj];
+    const double* lambdas = &sliceLambdas[NumTerms*slice];
+    double* energies = &sliceEnergies[NumTerms*slice];
 
     // get deltaR, R2, and R between 2 atoms
 
-    if (periodic)
+    if (USE_PERIODIC)
         ReferenceForce::getDeltaRPeriodic(atomCoordinates[jj], atomCoordinates[ii], periodicBoxVectors, deltaR[0]);
     else
         ReferenceForce::getDeltaR(atomCoordinates[jj], atomCoordinates[ii], deltaR[0]);
 
     double r2        = deltaR[0][ReferenceForce::R2Index];
+    if (USE_CUTOFF && r2 > cutoffDistance*cutoffDistance)
+        return;
     double inverseR  = 1.0/(deltaR[0][ReferenceForce::RIndex]);
     double switchValue = 1, switchDeriv = 0;
-    if (useSwitch) {
+    if (USE_SWITCH) {
         double r = deltaR[0][ReferenceForce::RIndex];
         if (r > switchingDistance) {
             double t = (r-switchingDistance)/(cutoffDistance-switchingDistance);
@@ -577,35 +691,79 @@ void ReferenceSlicedLJCoulombIxn::calculateOneIxn(int ii, int jj, vector<Vec3>&
             switchDeriv = t*t*(-30+t*(60-t*30))/(cutoffDistance-switchingDistance);
         }
     }
-    double sig = atomParameters[ii][SigIndex] +  atomParameters[jj][SigIndex];
+    double sig = params1[SigIndex] +  params2[SigIndex];
     double sig2 = inverseR*sig;
     sig2 *= sig2;
     double sig6 = sig2*sig2*sig2;
 
-    double eps = atomParameters[ii][EpsIndex]*atomParameters[jj][EpsIndex];
+    double eps = params1[EpsIndex]*params2[EpsIndex];
     double dEdRvdW = switchValue*eps*(12.0*sig6 - 6.0)*sig6*inverseR*inverseR;
     double dEdRCoul = inverseR*inverseR;
-    if (cutoff)
-        dEdRCoul *= ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*(inverseR-2.0f*krf*r2);
+    if (USE_CUTOFF)
+        dEdRCoul *= ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*(inverseR-2.0f*krf*r2);
     else
-        dEdRCoul *= ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR;
+        dEdRCoul *= ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*inverseR;
     double energy = eps*(sig6-1.0)*sig6;
-    if (useSwitch) {
+    if (USE_SWITCH) {
         dEdRvdW -= energy*switchDeriv*inverseR;
         energy *= switchValue;
     }
-    sliceEnergies[slice][vdW] += energy;
-    if (cutoff)
-        sliceEnergies[slice][Coul] += ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*(inverseR+krf*r2-crf);
+    energies[vdW] += energy;
+    if (USE_CUTOFF)
+        energies[Coul] += ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*(inverseR+krf*r2-crf);
     else
-        sliceEnergies[slice][Coul] += ONE_4PI_EPS0*atomParameters[ii][QIndex]*atomParameters[jj][QIndex]*inverseR;
+        energies[Coul] += ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*inverseR;
 
 
     // accumulate forces
-    double factor = sliceLambdas[slice][vdW]*dEdRvdW+sliceLambdas[slice][Coul]*dEdRCoul;
+    double factor = lambdas[vdW]*dEdRvdW+lambdas[Coul]*dEdRCoul;
     for (int kk = 0; kk < 3; kk++) {
         double force  = factor*deltaR[0][kk];
         forces[ii][kk] += force;
         forces[jj][kk] -= force;
     }
 }
+
+void ReferenceSlicedLJCoulombIxn::flattenAtomParameters(const vector<vector<double>>& atomParameters, vector<double>& flatParameters) {
+    flatParameters.resize(NumAtomParams*atomParameters.size());
+    for (int i = 0; i < atomParameters.size(); i++)
+        for (int j = 0; j < NumAtomParams; j++)
+            flatParameters[NumAtomParams*i+j] = atomParameters[i][j];
+}
+
+void ReferenceSlicedLJCoulombIxn::flattenSliceValues(const vector<vector<double>>& sliceValues, vector<double>& flatValues) {
+    flatValues.resize(NumTerms*sliceValues.size());
+    for (int slice = 0; slice < sliceValues.size(); slice++)
+        for (int term = 0; term < NumTerms; term++)
+            flatValues[NumTerms*slice+term] = sliceValues[slice][term];
+}
+
+void ReferenceSlicedLJCoulombIxn::addSliceValues(const vector<double>& flatValues, vector<vector<double>>& sliceValues) {
+    for (int slice = 0; slice < sliceValues.size(); slice++)
+        for (int term = 0; term < NumTerms; term++)
+            sliceValues[slice][term] += flatValues[NumTerms*slice+term];
+}
+
+// The specializations used by subclasses, which select them in their own pair loops.
+
+#define INSTANTIATE_ONE_IXN(CUTOFF, PERIODIC, SWITCH) \
+    template void ReferenceSlicedLJCoulombIxn::calculateOneIxn<CUTOFF, PERIODIC, SWITCH>(int, int, const vector<Vec3>&, const vector<int>&, \
+            const double*, const double*, vector<Vec3>&, double*) const;
+#define INSTANTIATE_ONE_EWALD_IXN(LJPME, SWITCH) \
+    template void ReferenceSlicedLJCoulombIxn::calculateOneEwaldIxn<LJPME, SWITCH>(int, int, const vector<Vec3>&, const vector<int>&, \
+            const double*, const double*, vector<Vec3>&, double*) const;
+#define INSTANTIATE_ONE_EWALD_EXCLUSION_IXN(LJPME) \
+    template void ReferenceSlicedLJCoulombIxn::calculateOneEwaldExclusionIxn<LJPME>(int, int, const vector<Vec3>&, const vector<int>&, \
+            const double*, const double*, vector<Vec3>&, double*) const;
+
+INSTANTIATE_ONE_IXN(false, false, false)
+INSTANTIATE_ONE_IXN(false, false, true)
+INSTANTIATE_ONE_IXN(true, false, false)
+INSTANTIATE_ONE_IXN(true, false, true)
+INSTANTIATE_ONE_IXN(true, true, false)
+INSTANTIATE_ONE_IXN(true, true, true)
+INSTANTIATE_ONE_EWALD_IXN(false, false)
+INSTANTIATE_ONE_EWALD_IXN(false, true)
+INSTANTIATE_ONE_EWALD_IXN(true, false)
+INSTANTIATE_ONE_EWALD_EXCLUSION_IXN(false)
+INSTANTIATE_ONE_EWALD_EXCLUSION_IXN(true)
@@ -0,0 +1,257 @@
+/* -------------------------------------------------------------------------- *
+ *                          OpenMM Nonbonded Slicing                          *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for slicing nonbonded potential energy calculations.      *
+ *                                                                            *
+ * Copyright (c) 2022 Charlles Abreu                                          *
+ * https://github.com/craabreu/openmm-nonbonded-slicing                       *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/ReferenceSlicedTreeCode.h"
+#include "openmm/reference/SimTKOpenMMRealType.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+using namespace std;
+using namespace NonbondedSlicing;
+using namespace OpenMM;
+
+// Binomial coefficients of (sigma1+sigma2)^6 and (sigma1+sigma2)^12.
+
+static const double binomial6[7] = {1, 6, 15, 20, 15, 6, 1};
+static const double binomial12[13] = {1, 12, 66, 220, 495, 792, 924, 792, 495, 220, 66, 12, 1};
+
+/**---------------------------------------------------------------------------------------
+
+   ReferenceSlicedTreeCode constructor
+
+   --------------------------------------------------------------------------------------- */
+
+ReferenceSlicedTreeCode::ReferenceSlicedTreeCode(double openingAngle) : openingAngle(openingAngle), numSubsets(0) {
+}
+
+/**---------------------------------------------------------------------------------------
+
+   ReferenceSlicedTreeCode destructor
+
+   --------------------------------------------------------------------------------------- */
+
+ReferenceSlicedTreeCode::~ReferenceSlicedTreeCode() {
+}
+
+void ReferenceSlicedTreeCode::calculateIxn(int numberOfAtoms, const vector<Vec3>& atomCoordinates, int numberOfSubsets, const vector<int>& atomSubsets,
+                const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas, const vector<set<int>>& exclusions,
+                vector<Vec3>& forces, vector<vector<double>>& sliceEnergies, bool includeForces) {
+    if (numberOfAtoms == 0)
+        return;
+
+    // Build the tree, starting from a root node that contains all atoms.
+
+    numSubsets = numberOfSubsets;
+    order.resize(numberOfAtoms);
+    iota(order.begin(), order.end(), 0);
+    nodes.assign(1, Node());
+    nodes[0].first = 0;
+    nodes[0].last = numberOfAtoms;
+    moments.assign(NumMoments*numSubsets, 0.0);
+    buildNode(0, atomCoordinates, atomSubsets, atomParameters);
+    position.resize(numberOfAtoms);
+    for (int i = 0; i < numberOfAtoms; i++)
+        position[order[i]] = i;
+
+    // Traverse the tree for each atom.  A node is accepted if it does not contain the atom and is
+    // seen from it at an angle smaller than the opening angle.  The excluded partners that belong
+    // to an accepted node are then subtracted exactly.
+
+    vector<int> stack;
+    for (int atom = 0; atom < numberOfAtoms; atom++) {
+        Vec3 force;
+        const set<int>& excluded = exclusions[atom];
+        stack.push_back(0);
+        while (!stack.empty()) {
+            int index = stack.back();
+            stack.pop_back();
+            const Node& node = nodes[index];
+            Vec3 delta = atomCoordinates[atom]-node.center;
+            bool containsAtom = (position[atom] >= node.first && position[atom] < node.last);
+            if (!containsAtom && node.size < openingAngle*sqrt(delta.dot(delta))) {
+                addNodeIxn(atom, index, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, force, sliceEnergies);
+                for (int other : excluded)
+                    if (position[other] >= node.first && position[other] < node.last)
+                        addPairIxn(atom, other, -1.0, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, force, sliceEnergies);
+            }
+            else if (node.numChildren == 0) {
+                for (int i = node.first; i < node.last; i++) {
+                    int other = order[i];
+                    if (other != atom && excluded.find(other) == excluded.end())
+                        addPairIxn(atom, other, 1.0, atomCoordinates, atomSubsets, atomParameters, sliceLambdas, force, sliceEnergies);
+                }
+            }
+            else
+                for (int child = 0; child < node.numChildren; child++)
+                    stack.push_back(node.firstChild+child);
+        }
+        if (includeForces)
+            forces[atom] += force;
+    }
+}
+
+void ReferenceSlicedTreeCode::buildNode(int index, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                const vector<vector<double>>& atomParameters) {
+    int first = nodes[index].first;
+    int last = nodes[index].last;
+
+    // Find the bounding box of the atoms.
+
+    Vec3 lower = atomCoordinates[order[first]], upper = lower;
+    for (int i = first+1; i < last; i++) {
+        const Vec3& pos = atomCoordinates[order[i]];
+        for (int k = 0; k < 3; k++) {
+            lower[k] = min(lower[k], pos[k]);
+            upper[k] = max(upper[k], pos[k]);
+        }
+    }
+    Vec3 center = (lower+upper)*0.5;
+    double size = max(upper[0]-lower[0], max(upper[1]-lower[1], upper[2]-lower[2]));
+    nodes[index].center = center;
+    nodes[index].size = size;
+    nodes[index].firstChild = -1;
+    nodes[index].numChildren = 0;
+
+    // Compute the multipole expansions of each subset about the center.
+
+    double* nodeMoments = &moments[NumMoments*numSubsets*index];
+    for (int i = first; i < last; i++) {
+        int atom = order[i];
+        const vector<double>& params = atomParameters[atom];
+        double* m = &nodeMoments[NumMoments*atomSubsets[atom]];
+        Vec3 d = atomCoordinates[atom]-center;
+        double q = params[QIndex];
+        double d2 = d.dot(d);
+        m[0] += q;
+        for (int k = 0; k < 3; k++)
+            m[DipoleIndex+k] += q*d[k];
+        m[QuadrupoleIndex] += q*(3*d[0]*d[0]-d2);
+        m[QuadrupoleIndex+1] += q*3*d[0]*d[1];
+        m[QuadrupoleIndex+2] += q*3*d[0]*d[2];
+        m[QuadrupoleIndex+3] += q*(3*d[1]*d[1]-d2);
+        m[QuadrupoleIndex+4] += q*3*d[1]*d[2];
+        m[QuadrupoleIndex+5] += q*(3*d[2]*d[2]-d2);
+        double power = params[EpsIndex];
+        for (int k = 0; k <= 12; k++) {
+            m[LJIndex+k] += power;
+            power *= params[SigIndex];
+        }
+    }
+    if (last-first <= MaxLeafSize || size == 0.0)
+        return;
+
+    // Sort the atoms into octants and create one child for each octant that is not empty.
+
+    int counts[8] = {0};
+    vector<int> octants(last-first);
+    for (int i = first; i < last; i++) {
+        const Vec3& pos = atomCoordinates[order[i]];
+        int octant = (pos[0] > center[0] ? 1 : 0) + (pos[1] > center[1] ? 2 : 0) + (pos[2] > center[2] ? 4 : 0);
+        octants[i-first] = octant;
+        counts[octant]++;
+    }
+    int starts[8];
+    starts[0] = 0;
+    for (int octant = 1; octant < 8; octant++)
+        starts[octant] = starts[octant-1]+counts[octant-1];
+    vector<int> sorted(last-first);
+    int next[8];
+    copy(starts, starts+8, next);
+    for (int i = first; i < last; i++)
+        sorted[next[octants[i-first]]++] = order[i];
+    copy(sorted.begin(), sorted.end(), order.begin()+first);
+    int firstChild = nodes.size();
+    for (int octant = 0; octant < 8; octant++)
+        if (counts[octant] > 0) {
+            Node child;
+            child.first = first+starts[octant];
+            child.last = child.first+counts[octant];
+            nodes.push_back(child);
+        }
+    int numChildren = nodes.size()-firstChild;
+    nodes[index].firstChild = firstChild;
+    nodes[index].numChildren = numChildren;
+    moments.resize(NumMoments*numSubsets*nodes.size(), 0.0);
+    for (int child = firstChild; child < firstChild+numChildren; child++)
+        buildNode(child, atomCoordinates, atomSubsets, atomParameters);
+}
+
+void ReferenceSlicedTreeCode::addPairIxn(int atom1, int atom2, double sign, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas,
+                Vec3& force, vector<vector<double>>& sliceEnergies) const {
+    int s1 = atomSubsets[atom1];
+    int s2 = atomSubsets[atom2];
+    int slice = s1 > s2 ? s1*(s1+1)/2+s2 : s2*(s2+1)/2+s1;
+    const vector<double>& params1 = atomParameters[atom1];
+    const vector<double>& params2 = atomParameters[atom2];
+    Vec3 delta = atomCoordinates[atom1]-atomCoordinates[atom2];
+    double inverseR2 = 1.0/delta.dot(delta);
+    double inverseR = sqrt(inverseR2);
+    double sig = params1[SigIndex]+params2[SigIndex];
+    double sig2 = sig*sig*inverseR2;
+    double sig6 = sig2*sig2*sig2;
+    double eps = params1[EpsIndex]*params2[EpsIndex];
+    double coulomb = ONE_4PI_EPS0*params1[QIndex]*params2[QIndex]*inverseR;
+    sliceEnergies[slice][Coul] += 0.5*sign*coulomb;
+    sliceEnergies[slice][vdW] += 0.5*sign*eps*(sig6-1.0)*sig6;
+    const vector<double>& lambdas = sliceLambdas[slice];
+    double dEdR = (lambdas[vdW]*eps*(12.0*sig6-6.0)*sig6+lambdas[Coul]*coulomb)*inverseR2;
+    force += delta*(sign*dEdR);
+}
+
+void ReferenceSlicedTreeCode::addNodeIxn(int atom, int node, const vector<Vec3>& atomCoordinates, const vector<int>& atomSubsets,
+                const vector<vector<double>>& atomParameters, const vector<vector<double>>& sliceLambdas,
+                Vec3& force, vector<vector<double>>& sliceEnergies) const {
+    int si = atomSubsets[atom];
+    const vector<double>& params = atomParameters[atom];
+    double q = ONE_4PI_EPS0*params[QIndex];
+    double eps = params[EpsIndex];
+    double sigmaPowers[13];
+    sigmaPowers[0] = 1.0;
+    for (int k = 1; k <= 12; k++)
+        sigmaPowers[k] = sigmaPowers[k-1]*params[SigIndex];
+    Vec3 r = atomCoordinates[atom]-nodes[node].center;
+    double inverseR2 = 1.0/r.dot(r);
+    double inverseR = sqrt(inverseR2);
+    double inverseR3 = inverseR*inverseR2;
+    double inverseR5 = inverseR3*inverseR2;
+    double inverseR6 = inverseR2*inverseR2*inverseR2;
+    const double* nodeMoments = &moments[NumMoments*numSubsets*node];
+    for (int s = 0; s < numSubsets; s++) {
+        const double* m = &nodeMoments[NumMoments*s];
+        int slice = si > s ? si*(si+1)/2+s : s*(s+1)/2+si;
+
+        // Coulomb potential and field of the charge, dipole, and quadrupole.
+
+        Vec3 dipole(m[DipoleIndex], m[DipoleIndex+1], m[DipoleIndex+2]);
+        const double* Q = &m[QuadrupoleIndex];
+        Vec3 Qr(Q[0]*r[0]+Q[1]*r[1]+Q[2]*r[2], Q[1]*r[0]+Q[3]*r[1]+Q[4]*r[2], Q[2]*r[0]+Q[4]*r[1]+Q[5]*r[2]);
+        double pr = dipole.dot(r);
+        double rQr = Qr.dot(r);
+        double potential = m[0]*inverseR+pr*inverseR3+0.5*rQr*inverseR5;
+        Vec3 field = r*(m[0]*inverseR3+3*pr*inverseR5+2.5*rQr*inverseR5*inverseR2)-dipole*inverseR3-Qr*inverseR5;
+
+        // Lennard-Jones sums of (sigma_i+sigma_j)^6 and (sigma_i+sigma_j)^12 over the node atoms.
+
+        double sum6 = 0.0, sum12 = 0.0;
+        for (int k = 0; k <= 6; k++)
+            sum6 += binomial6[k]*sigmaPowers[6-k]*m[LJIndex+k];
+        for (int k = 0; k <= 12; k++)
+            sum12 += binomial12[k]*sigmaPowers[12-k]*m[LJIndex+k];
+        double ljEnergy = eps*(sum12*inverseR6-sum6)*inverseR6;
+        double dEdR = eps*(12.0*sum12*inverseR6-6.0*sum6)*inverseR6*inverseR2;
+
+        sliceEnergies[slice][Coul] += 0.5*q*potential;
+        sliceEnergies[slice][vdW] += 0.5*ljEnergy;
+        const vector<double>& lambdas = sliceLambdas[slice];
+        force += field*(lambdas[Coul]*q)+r*(lambdas[vdW]*dEdR);
+    }
+}
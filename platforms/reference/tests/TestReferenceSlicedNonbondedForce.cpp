@@ -10,6 +10,62 @@
 
 #include "ReferenceNonbondedSlicingTests.h"
 #include "TestSlicedNonbondedForce.h"
+#include "ReferenceNonbondedSlicingKernels.h"
+
+void testNeighborListSkin(NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 300;
+    const double boxSize = 3.0;
+    System system;
+    NonbondedForce nonbonded;
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        nonbonded.addParticle(i%2-0.5, 0.2+0.01*(i%7), 0.5+0.1*(i%3));
+    }
+    nonbonded.setNonbondedMethod(method);
+    nonbonded.setCutoffDistance(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt), boxSize*genrand_real2(sfmt));
+    for (int i = 1; i < numParticles; i += 3)
+        nonbonded.addException(i-1, i, 0.0, 1.0, 0.0);
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(nonbonded, 2);
+    for (int i = 0; i < numParticles; i++)
+        force->setParticleSubset(i, i%2);
+    system.addForce(force);
+
+    // Create one context that rebuilds the neighbor list at every step and one that reuses it.
+
+    const string& skin = ReferenceCalcSlicedNonbondedForceKernel::NeighborListSkin();
+    string defaultSkin = platform.getPropertyDefaultValue(skin);
+    VerletIntegrator integrator1(0.001);
+    platform.setPropertyDefaultValue(skin, "0");
+    Context context1(system, integrator1, platform);
+    VerletIntegrator integrator2(0.001);
+    platform.setPropertyDefaultValue(skin, "0.2");
+    Context context2(system, integrator2, platform);
+    platform.setPropertyDefaultValue(skin, defaultSkin);
+
+    // Move the particles by small and large amounts and see if the contexts agree.
+
+    for (int step = 0; step < 10; step++) {
+        double displacement = (step%4 == 3 ? 0.2 : 0.02);
+        for (int i = 0; i < numParticles; i++)
+            positions[i] += Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5)*displacement;
+        context1.setPositions(positions);
+        context2.setPositions(positions);
+        State state1 = context1.getState(State::Forces | State::Energy);
+        State state2 = context2.getState(State::Forces | State::Energy);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-8);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-8);
+    }
+}
 
 void runPlatformTests() {
+    testNeighborListSkin(NonbondedForce::CutoffNonPeriodic);
+    testNeighborListSkin(NonbondedForce::CutoffPeriodic);
+    testNeighborListSkin(NonbondedForce::PME);
 }
@@ -3,16 +3,52 @@
 %import(module="openmm") "swig/OpenMMSwigHeaders.i"
 %include "swig/typemaps.i"
 %include <std_string.i>
+%include <std_vector.i>
+%include <std_map.i>
+
+namespace std {
+    %template(MemoryUsageMap) map<string, long long>;
+}
 
 %{
 #include "SlicedNonbondedForce.h"
+#include "SliceEnergyAnalyzer.h"
+#include "SlicedNonbondedReplicaBatch.h"
 #include "OpenMM.h"
 #include "OpenMMAmoeba.h"
 #include "OpenMMDrude.h"
 #include "openmm/RPMDIntegrator.h"
 #include "openmm/RPMDMonteCarloBarostat.h"
+#include <algorithm>
 
 #define SWIG_PYTHON_CAST_MODE
+
+/*
+ * Access to the memory of a contiguous array (such as a NumPy array) through the buffer protocol, so that
+ * bulk accessors can read and write arrays without creating a Python object per element.
+ */
+class ContiguousBuffer {
+public:
+    ContiguousBuffer(PyObject* object, Py_ssize_t itemSize, Py_ssize_t numItems, bool writable) {
+        if (PyObject_GetBuffer(object, &view, PyBUF_C_CONTIGUOUS | (writable ? PyBUF_WRITABLE : 0)) != 0) {
+            PyErr_Clear();
+            throw OpenMM::OpenMMException("Expected a contiguous array");
+        }
+        if (view.itemsize != itemSize || view.len != itemSize*numItems) {
+            PyBuffer_Release(&view);
+            throw OpenMM::OpenMMException("The array does not have the expected type or size");
+        }
+    }
+    ~ContiguousBuffer() {
+        PyBuffer_Release(&view);
+    }
+    template <class T>
+    T* data() {
+        return reinterpret_cast<T*>(view.buf);
+    }
+private:
+    Py_buffer view;
+};
 %}
 
 %pythoncode %{
@@ -35,6 +71,21 @@ __version__ = "@CMAKE_PROJECT_VERSION@"
     val[0] = unit.Quantity(val[0], 1/unit.nanometers)
 %}
 
+%pythonappend NonbondedSlicing::SlicedNonbondedForce::getSliceForcesInContext(
+        OpenMM::Context& context, int slice) %{
+    val = unit.Quantity(val, unit.kilojoules_per_mole/unit.nanometers)
+%}
+
+%pythonappend NonbondedSlicing::SlicedNonbondedForce::getSliceEnergiesInContext(
+        OpenMM::Context& context) %{
+    val = unit.Quantity(val, unit.kilojoules_per_mole)
+%}
+
+%pythonappend NonbondedSlicing::SlicedNonbondedForce::getProtocolWorkInContext(
+        OpenMM::Context& context) %{
+    val = unit.Quantity(val, unit.kilojoules_per_mole)
+%}
+
 /*
  * Convert C++ exceptions to Python exceptions.
 */
@@ -170,8 +221,10 @@ public:
      *         the NonbondedForce object from which to instantiate this SlicedNonbondedForce
      *     numSubsets : int
      *         the number of particle subsets
+     *     subsets : list(int), optional
+     *         the subset of every particle.  If empty (the default), all particles are placed in subset 0
      */
-    SlicedNonbondedForce(const OpenMM::NonbondedForce& force, int numSubsets);
+    SlicedNonbondedForce(const OpenMM::NonbondedForce& force, int numSubsets, const std::vector<int>& subsets = std::vector<int>());
     /**
      * Get the parameters being used for PME in a particular Context.  Because some platforms have restrictions
      * on the allowed grid sizes, the values that are actually used may be slightly different from those
@@ -218,6 +271,85 @@ public:
      *         the number of grid points along the Z axis
      */
     void getLJPMEParametersInContext(const OpenMM::Context& context, double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the name of the FFT library used by a Context for the reciprocal space sums. An empty
+     * string is returned if the Context performs no FFTs for this force.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context for which to get the FFT library
+     */
+    std::string getFFTBackendInContext(const OpenMM::Context& context) const;
+    /**
+     * Get the configurations found by PME grid tuning (see :func:`setAutotunePME`) and FFT library
+     * selection (see :func:`setAutoselectFFT`), one per line, merged with those already stored in this
+     * force. Storing the result with :func:`setTunedConfiguration` and serializing the force lets
+     * contexts created later, even in other processes, skip the timing of the transforms. It is an
+     * empty string if nothing was stored or tuned.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context for which to get the tuned configurations
+     */
+    std::string getTunedConfigurationInContext(const OpenMM::Context& context) const;
+    /**
+     * Get the accumulated time, in seconds, spent by a Context in each stage of the calculation of
+     * this force. Stages are only timed if :func:`setProfileStages` was enabled before the Context
+     * was created, otherwise an empty dictionary is returned. The Reference and CPU platforms do
+     * not time any stages.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context for which to get the stage timings
+     */
+    std::map<std::string, double> getStageTimingsInContext(const OpenMM::Context& context) const;
+    /**
+     * Get the number of bytes of device memory that a Context saves by storing the PME grids in
+     * compact form (see :func:`setUseCompactPMEGrids`). It is zero if compact grids are not in
+     * use, as well as on the Reference and CPU platforms.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context for which to get the memory savings
+     */
+    long long getPMEGridMemorySavingsInContext(const OpenMM::Context& context) const;
+    /**
+     * Get the number of bytes of device memory taken by each array that a Context allocated for this
+     * force, indexed by array name. Arrays shared with other forces of the same Context, such as the
+     * PME grids, are included in the usage of each one of them, while the memory allocated internally
+     * by FFT libraries is not included. When the Context runs on several devices, the array names are
+     * prefixed with "device0.", "device1.", and so on. An empty dictionary is returned on the
+     * Reference and CPU platforms, as well as when the force has no scaling parameters.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context for which to get the memory usage
+     */
+    std::map<std::string, long long> getMemoryUsageInContext(const OpenMM::Context& context) const;
+    /**
+     * Estimate the number of bytes of device memory that a Context would allocate for this force on
+     * a GPU platform, without creating it. The estimate covers the largest arrays reported by
+     * :func:`getMemoryUsageInContext`, with PME grid sizes computed from the cutoff distance and the
+     * Ewald error tolerance. Since PME autotuning may select larger grids, it is only exact when
+     * :func:`setAutotunePME` is disabled. An empty dictionary is returned if the force has no scaling
+     * parameters.
+     *
+     * Parameters
+     * ----------
+     *     system : System
+     *         the System to which this force belongs
+     *     precision : str
+     *         the precision mode of the platform, which is "single", "mixed", or "double"
+     *     numThreadBlocks : int
+     *         the number of thread blocks launched by the platform's kernels, which depends on the
+     *         number of compute units of the device and affects the size of the energy buffers
+     */
+    std::map<std::string, long long> estimateMemoryUsage(const OpenMM::System& system, const std::string& precision="single", int numThreadBlocks=1024) const;
     /**
      * Update the particle and exception parameters in a Context to match those stored in this Force object.  This method
      * provides an efficient method to update certain parameters in an existing Context without needing to reinitialize it.
@@ -236,6 +368,129 @@ public:
      *         the Context in which to update the parameters
      */
     void updateParametersInContext(OpenMM::Context& context);
+    /**
+     * Move some particles to other subsets in a Context, and also in this Force object.  This is much
+     * cheaper than calling :func:`setParticleSubset` followed by :func:`updateParametersInContext`,
+     * because only the data that depend on the subsets of the moved particles are updated.  The other
+     * parameters of these particles must not have been modified since the last update.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to move the particles
+     *     particles : list[int]
+     *         the indices of the particles to be moved
+     *     subsets : list[int]
+     *         the new subset of each particle
+     */
+    void reassignSubsetsInContext(OpenMM::Context& context, const std::vector<int>& particles, const std::vector<int>& subsets);
+    /**
+     * Compute the potential energy of this force at several states, each one defined by a set of values for
+     * some scaling parameters, using a single evaluation in the Context.  The energy of every slice is
+     * computed in that evaluation (see :func:`getSliceEnergiesInContext`), and its energy at each state is
+     * the sum of the slice energies multiplied by the scaling parameters of that state.  The parameters that
+     * are not given keep the values in effect in the evaluation, which are those of a schedule if one is
+     * set (see :func:`setScalingParameterScheduleInContext`). Slice energies must be enabled with
+     * :func:`setUseSliceEnergies` before the Context is created.
+     *
+     * The returned energies do not include the contributions of any other forces.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to evaluate the energies
+     *     parameters : list(str)
+     *         the names of the scaling parameters whose values define the states
+     *     states : list(list(float))
+     *         the values of the given scaling parameters at each state, in the same order as their names
+     *
+     * Returns
+     * -------
+     *     energies : list(float)
+     *         the potential energy of this force at each state (in kJ/mol)
+     */
+    std::vector<double> computeStateEnergiesInContext(OpenMM::Context& context, const std::vector<std::string>& parameters,
+                                                      const std::vector<std::vector<double>>& states);
+    /**
+     * Evaluate the energy of this force in the Context and get the Coulomb and Lennard-Jones energies
+     * of every slice, which are not multiplied by the scaling parameters. Here, the self energies and the
+     * dispersion correction of a slice are included in its energies. Slice energies must be enabled with
+     * :func:`setUseSliceEnergies` before the Context is created.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to evaluate the energies
+     *
+     * Returns
+     * -------
+     *     energies : list(float)
+     *         the Coulomb and Lennard-Jones energies of each slice, stored in this order for every slice
+     *         (see :func:`getNumSlices`) (in kJ/mol)
+     */
+    std::vector<double> getSliceEnergiesInContext(OpenMM::Context& context);
+    /**
+     * Get the forces that a single slice contributed to the last evaluation of this force that
+     * computed forces in the Context.  They include the scaling parameters applied to the slice, and the
+     * sum over all slices recovers the total force due to this force alone.  A force evaluation is only
+     * performed if none has been done since the Context was created. Slice forces must be enabled with
+     * :func:`setUseSliceForces` before the Context is created.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to evaluate the forces
+     *     slice : int
+     *         the index of the slice (see :func:`getNumSlices`)
+     *
+     * Returns
+     * -------
+     *     forces : list(Vec3)
+     *         the force on each particle due to the slice (in kJ/mol/nm)
+     */
+    std::vector<OpenMM::Vec3> getSliceForcesInContext(OpenMM::Context& context, int slice);
+    /**
+     * Set the values that some scaling parameters take at each step of a nonequilibrium switching
+     * protocol.  The schedule starts at the current step of the Context: at step n after that, the
+     * force uses the n-th row of the schedule in place of the Context values of the scheduled
+     * parameters, and the last row is kept once the schedule is exhausted.  On GPU platforms, the
+     * lambdas of every step are uploaded only once, so that no transfer from the host is needed as
+     * the protocol advances.  Only the scaling of slices is affected: a scheduled parameter that also
+     * has parameter offsets still takes its Context value in them.
+     *
+     * The protocol work of each step, which is the sum of the derivatives of the energy with respect
+     * to the scheduled parameters times their changes from that step to the next, is accumulated in
+     * the first force evaluation at that step (see :func:`getProtocolWorkInContext`).  A derivative
+     * must therefore be requested for every scheduled parameter, and these parameters should not be
+     * used by any other force in the System.  Setting a schedule resets the accumulated work.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which to run the protocol
+     *     parameters : list(str)
+     *         the names of the scheduled scaling parameters, or an empty list to remove the schedule
+     *     schedule : list(list(float))
+     *         the values of the scheduled parameters at each step, with one row per step and one
+     *         column per parameter
+     */
+    void setScalingParameterScheduleInContext(OpenMM::Context& context, const std::vector<std::string>& parameters, const std::vector<std::vector<double>>& schedule);
+    /**
+     * Get the protocol work accumulated since the scaling parameter schedule was set (see
+     * :func:`setScalingParameterScheduleInContext`).  On GPU platforms, the work of each step is
+     * computed on the device and only read back by this method.
+     *
+     * Parameters
+     * ----------
+     *     context : Context
+     *         the Context in which the protocol is run
+     *
+     * Returns
+     * -------
+     *     work : float
+     *         the protocol work (in kJ/mol)
+     */
+    double getProtocolWorkInContext(OpenMM::Context& context);
     /**
      * Get the name of the method used for handling long range nonbonded interactions.
      */
@@ -268,6 +523,25 @@ public:
      *         the subset to which this particle belongs
      */
     void setParticleSubset(int index, int subset);
+    /**
+     * Get the subsets of all particles at once.
+     *
+     * Returns
+     * -------
+     *     subsets : list(int)
+     *         the subset of every particle, in the order they were added
+     */
+    std::vector<int> getParticleSubsets() const;
+    /**
+     * Set the subsets of all particles at once.  This is much faster than calling :func:`setParticleSubset`
+     * for every particle in large systems.
+     *
+     * Parameters
+     * ----------
+     *     subsets : list(int)
+     *         the subset of every particle.  Its length must be equal to the number of particles
+     */
+    void setParticleSubsets(const std::vector<int>& subsets);
   	/**
      * Add a scaling parameter to multiply a particular Coulomb slice. Its value will scale the
      * Coulomb interactions between particles of a subset 1 with those of another (or the same)
@@ -351,6 +625,11 @@ public:
      * can be used to obtain the sum of particular energy slices. The parameter must have already
      * been added with :func:`addGlobalParameter` and :func:`addScalingParameter`.
      *
+     * In single precision on the CUDA and OpenCL platforms, the reciprocal space part of a
+     * derivative is summed in 64-bit fixed point, but the direct space and exception parts are
+     * summed by OpenMM's nonbonded and bonded kernels in single precision. Use mixed or double
+     * precision when derivatives must be accurate over very many pairs.
+     *
      * Parameters
      * ----------
      *     parameter : str
@@ -389,6 +668,59 @@ public:
      *         the name of the parameter
      */
     void setScalingParameterDerivative(int index, const std::string& parameter);
+    /**
+     * Get the force group in which the direct space interactions of a slice are evaluated. The
+     * default value -1 means the force group of the force itself.
+     *
+     * Parameters
+     * ----------
+     *     slice : int
+     *         the index of the slice, between 0 and the result of :func:`getNumSlices`
+     */
+    int getSliceForceGroup(int slice) const;
+    /**
+     * Set the force group in which the direct space interactions of a slice are evaluated. Along
+     * with :func:`setSliceReciprocalSpaceForceGroup`, this allows a multiple time step integrator
+     * to evaluate the slices at different frequencies, for instance to integrate the interactions
+     * between a solute and its environment with a longer time step than those within the solute.
+     * The exceptions and the dispersion correction of a slice are included in its direct space
+     * part. This must be set before the force is added to a context.
+     *
+     * Parameters
+     * ----------
+     *     slice : int
+     *         the index of the slice, between 0 and the result of :func:`getNumSlices`
+     *     group : int
+     *         the force group, between 0 and 31, or -1 to use the force group of the force
+     */
+    void setSliceForceGroup(int slice, int group);
+    /**
+     * Get the force group in which the reciprocal space interactions of a slice are evaluated. The
+     * default value -1 means the reciprocal space force group of the force itself.
+     *
+     * Parameters
+     * ----------
+     *     slice : int
+     *         the index of the slice, between 0 and the result of :func:`getNumSlices`
+     */
+    int getSliceReciprocalSpaceForceGroup(int slice) const;
+    /**
+     * Set the force group in which the reciprocal space interactions of a slice are evaluated.
+     * This includes the self energies of the subsets, which belong to the slices formed by a
+     * subset with itself. Every evaluation whose force groups include the reciprocal space of at
+     * least one slice still computes the reciprocal space sums of all particles, so this saves
+     * less time than separating the direct space parts. This must be set before the force is
+     * added to a context.
+     *
+     * Parameters
+     * ----------
+     *     slice : int
+     *         the index of the slice, between 0 and the result of :func:`getNumSlices`
+     *     group : int
+     *         the force group, between 0 and 31, or -1 to use the reciprocal space force group
+     *         of the force
+     */
+    void setSliceReciprocalSpaceForceGroup(int slice, int group);
 	/**
      * Get whether to use CUDA Toolkit's cuFFT library when executing in the CUDA platform.
      * The default value is `False`.
@@ -405,6 +737,638 @@ public:
      *         whether to use the cuFFT library
      */
     void setUseCuFFT(bool use);
+    /**
+     * Get whether the CUDA and OpenCL platforms skip the interactions of slices whose Coulomb and
+     * Lennard-Jones scaling parameters are both zero. The default value is `False`.
+     */
+    bool getSkipDecoupledSlices() const;
+    /**
+     * Set whether the CUDA and OpenCL platforms skip the interactions of slices whose Coulomb and
+     * Lennard-Jones scaling parameters are both zero. Slices whose scaling parameters have
+     * requested derivatives are always computed. This choice has no effect on the results, only
+     * on performance. It pays off when whole groups of interactions belong to decoupled slices,
+     * such as in the endpoint states of alchemical transformations.
+     *
+     * Parameters
+     * ----------
+     *     skip : bool
+     *         whether to skip decoupled slices
+     */
+    void setSkipDecoupledSlices(bool skip);
+    /**
+     * Get whether the CUDA platform replays the PME reciprocal space kernels as CUDA graphs.
+     * The default value is `False`.
+     */
+    bool getUseCudaGraphs() const;
+    /**
+     * Set whether the CUDA platform replays the PME reciprocal space kernels as CUDA graphs.
+     * This reduces the kernel launch overhead, which matters mostly for small systems. A graph is
+     * captured again whenever the periodic box changes. This choice has no effect on the results,
+     * and it has no effect at all on other platforms or when the PME stream is disabled.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to use CUDA graphs
+     */
+    void setUseCudaGraphs(bool use);
+    /**
+     * Get whether the CUDA and OpenCL platforms tune the PME grid dimensions when a context is
+     * created. The default value is `False`.
+     */
+    bool getAutotunePME() const;
+    /**
+     * Set whether the CUDA and OpenCL platforms tune the PME grid dimensions when a context is
+     * created. Since the cost of the reciprocal space sum grows with the number of subsets, the
+     * speed of the FFTs matters more than it does for a standard NonbondedForce. When this option
+     * is enabled, a few grids whose dimensions are somewhat larger than the automatically chosen
+     * ones, but whose prime factors are smaller, are timed, and the fastest one is kept. Larger
+     * grids only increase the accuracy, so the Ewald error tolerance is still met. Grids set by
+     * :func:`setPMEParameters` or :func:`setLJPMEParameters` are never modified. The grids in use
+     * can be queried with :func:`getPMEParametersInContext` and :func:`getLJPMEParametersInContext`.
+     *
+     * Parameters
+     * ----------
+     *     autotune : bool
+     *         whether to tune the PME grid dimensions
+     */
+    void setAutotunePME(bool autotune);
+    /**
+     * Get whether the CUDA platform selects the fastest FFT library for the PME grids when a
+     * context is created. The default value is `False`.
+     */
+    bool getAutoselectFFT() const;
+    /**
+     * Set whether the CUDA platform selects the fastest FFT library for the PME grids when a
+     * context is created. When this option is enabled, the transforms are timed with VkFFT in a
+     * few register configurations and, if available, with cuFFT, and the fastest choice overrides
+     * :func:`setUseCuFFT`. The choice can be queried with :func:`getFFTBackendInContext`. This
+     * option has no effect on other platforms.
+     *
+     * Parameters
+     * ----------
+     *     autoselect : bool
+     *         whether to select the FFT library automatically
+     */
+    void setAutoselectFFT(bool autoselect);
+    /**
+     * Get whether the stages of the calculation are timed in contexts created for this force.
+     * The default value is `False`.
+     */
+    bool getProfileStages() const;
+    /**
+     * Set whether the stages of the calculation are timed in contexts created for this force.
+     * Profiling can also be enabled by setting the environment variable NONBONDED_SLICING_PROFILE.
+     * The accumulated timings can be queried with :func:`getStageTimingsInContext`. Profiling
+     * adds synchronization points and therefore slows down the simulation.
+     *
+     * Parameters
+     * ----------
+     *     profile : bool
+     *         whether to time the stages of the calculation
+     */
+    void setProfileStages(bool profile);
+    /**
+     * Get whether the CUDA and OpenCL platforms store the PME grids in compact form. The default
+     * value is `False`.
+     */
+    bool getUseCompactPMEGrids() const;
+    /**
+     * Set whether the CUDA and OpenCL platforms store the PME grids in compact form. The two grids
+     * used for the reciprocal space sums hold the grids of all subsets, so their size grows with the
+     * number of subsets. By default, each of them is large enough to hold a complex grid with the
+     * padding needed for charge spreading, as in a standard NonbondedForce. With compact grids,
+     * each one only takes the space actually needed by the steps that use it, which roughly halves
+     * the memory they take. The results are unaffected. The savings can be queried with
+     * :func:`getPMEGridMemorySavingsInContext`. This option must be set before the context is
+     * created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to store the PME grids in compact form
+     */
+    void setUseCompactPMEGrids(bool use);
+    /**
+     * Get whether an evaluation can reuse the slice energies of the previous one. The default
+     * value is `False`.
+     */
+    bool getUseEnergyCache() const;
+    /**
+     * Set whether an evaluation can reuse the slice energies of the previous one. The energy is
+     * linear in the scaling parameters, so an evaluation that does not request forces can combine
+     * the slice energies of the previous evaluation with the current scaling parameter values,
+     * provided that the positions, the periodic box, and all other parameters are unchanged. This
+     * is common in Hamiltonian replica exchange, where each configuration is evaluated at the
+     * scaling parameter values of other replicas.
+     *
+     * With this option, the Reference and CPU platforms skip the whole calculation in such cases,
+     * while the CUDA and OpenCL platforms skip the PME and LJPME reciprocal space sums (the
+     * direct space interactions are computed together with other forces). Checking whether the
+     * positions have changed costs a pass over them and, in the GPU platforms, a synchronization
+     * with the device. The results are unaffected. This option must be set before the context is
+     * created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to reuse the slice energies when possible
+     */
+    void setUseEnergyCache(bool use);
+    /**
+     * Get whether the CUDA and OpenCL platforms compute the reciprocal space contributions to
+     * the energy parameter derivatives only in the evaluations that can report them. The default value
+     * is `False`.
+     */
+    bool getUseDerivativesOnDemand() const;
+    /**
+     * Set whether the CUDA and OpenCL platforms compute the reciprocal space contributions to
+     * the energy parameter derivatives only in the evaluations that can report them. When a scaling
+     * parameter derivative is requested, the slice energies of the Ewald, PME, and LJPME reciprocal
+     * space sums are normally evaluated at every integration step, even if the derivatives are rarely
+     * read. With this option, they are only evaluated when the energy is requested, when neither
+     * forces nor energy are requested, as in a call to `getState` asking for nothing but parameter
+     * derivatives, and in the steps whose slice energies are reported (see
+     * :func:`setSliceEnergyReportInterval`) or whose protocol work is accumulated (see
+     * :func:`setScalingParameterScheduleInContext`). To get complete derivatives, request them in
+     * `getState` alone or together with the energy, but not together with forces only. The
+     * derivatives obtained in the other evaluations, such as those of integration steps, lack their
+     * reciprocal space parts. The Reference and CPU platforms always compute them. This option must
+     * be set before the context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to compute the reciprocal space derivatives only on demand
+     */
+    void setUseDerivativesOnDemand(bool use);
+    /**
+     * Get whether the CUDA platform computes the Coulomb reciprocal space sums on the CPU. The
+     * default value is `False`.
+     */
+    bool getUseCpuPme() const;
+    /**
+     * Set whether the CUDA platform computes the Coulomb reciprocal space sums on the CPU. This is
+     * the sliced analogue of the `UseCpuPme` property of the CUDA platform. With the PME and LJPME
+     * methods, the positions and charges are downloaded to the host as soon as they are ready, and
+     * the sums of all slices are computed there by a pool of threads while the device works on the
+     * direct space interactions. The forces are then added to those of the device. This can pay off
+     * when the computer has many CPU cores and the device is busy with other forces, or when the
+     * grids of many subsets would not fit in device memory. The LJPME dispersion sums and the
+     * corrections for excluded pairs are still computed on the device. The option is ignored by
+     * the other platforms and nonbonded methods. It must be set before the context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to compute the Coulomb reciprocal space sums on the CPU
+     */
+    void setUseCpuPme(bool use);
+    /**
+     * Get whether the Coulomb and dispersion reciprocal space sums of LJPME run concurrently in the
+     * CUDA platform. The default value is `False`.
+     */
+    bool getUseConcurrentLJPME() const;
+    /**
+     * Set whether the Coulomb and dispersion reciprocal space sums of LJPME run concurrently in the
+     * CUDA platform. By default, both sums share the same grids and atom grid indices, so
+     * the spreading, transforms, convolution, and interpolation of the dispersion sums only start
+     * after those of the Coulomb sums are finished. With this option, the dispersion sums get grids
+     * of their own and a second stream, which lets both chains of kernels fill the device together.
+     * This pays off for mid-size systems on large devices, at the cost of the memory taken by extra
+     * grids. It has no effect if the reciprocal space sums run on the default stream or if stage
+     * profiling is enabled. It must be set before the context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to run the Coulomb and dispersion reciprocal space sums concurrently
+     */
+    void setUseConcurrentLJPME(bool use);
+    /**
+     * Get whether the reciprocal space sums use the optimal influence function of P3M instead of
+     * the smooth PME one. The default value is `False`.
+     */
+    bool getUseOptimalInfluenceFunction() const;
+    /**
+     * Set whether the reciprocal space sums use the optimal influence function of P3M instead of
+     * the smooth PME one. This function, tabulated again whenever the box changes, compensates for
+     * the aliasing errors of charge spreading and interpolation, which makes the energies of coarse
+     * grids much more accurate. The gain for forces is modest. Automatically chosen grid dimensions
+     * are the smallest whose estimated reciprocal space force error with this function does not exceed
+     * that of NonbondedForce's grid with the smooth one, which makes them at most a point or so smaller
+     * along each axis. It applies to all platforms and to both the
+     * Coulomb and the dispersion sums of LJPME. It must be set before the context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to use the optimal influence function
+     */
+    void setUseOptimalInfluenceFunction(bool use);
+    /**
+     * Get whether the CUDA platform rebalances the exceptions, exclusion corrections, and direct
+     * space interactions among devices according to their measured evaluation times. The default
+     * value is `False`.
+     */
+    bool getUseLoadBalancing() const;
+    /**
+     * Set whether the CUDA platform rebalances the exceptions, exclusion corrections, and direct
+     * space interactions among devices according to their measured evaluation times. With more than
+     * one device, the exceptions and exclusion corrections are normally split into equal contiguous
+     * shares, while the reciprocal space sums run entirely on one device, so that the slowest device
+     * sets the pace. With this option, every device holds all of these pairs and computes a share of
+     * them that changes at run time: the device that owns the reciprocal space work starts with a
+     * smaller share, and after each evaluation a small part of the pairs moves from the device that
+     * took longest to the one that finished first. OpenMM itself balances the direct space
+     * interactions only during the first 200 evaluations. After that, this option keeps moving them in
+     * the same way, which rebuilds the neighbor list whenever the shares change. The option has no
+     * effect with a single device and is ignored by the other platforms. It must be set before the
+     * context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to rebalance the exceptions, exclusion corrections, and direct space
+     *         interactions among devices
+     */
+    void setUseLoadBalancing(bool use);
+    /**
+     * Get whether the B-spline coefficients of the particles are computed once per evaluation and shared
+     * by charge spreading and force interpolation. The default value is `False`.
+     */
+    bool getUseCachedBSplines() const;
+    /**
+     * Set whether the B-spline coefficients of the particles are computed once per evaluation and shared
+     * by charge spreading and force interpolation. Normally, each of these kernels recomputes the
+     * coefficients of every particle, and LJPME does it again for the dispersion grid. With this option,
+     * a separate kernel stores the coefficients and their derivatives in the sorted order of the
+     * particles, and they are also reused by the dispersion sums when both grids have the same
+     * dimensions. The cache takes about 32*order bytes per particle in single precision and twice as
+     * much in double precision. It applies to the CUDA and OpenCL platforms and must be set before the
+     * context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to compute the B-spline coefficients once per evaluation
+     */
+    void setUseCachedBSplines(bool use);
+    /**
+     * Get whether the forces of every slice are accumulated separately during force evaluations, so
+     * that :func:`getSliceForcesInContext` can return them. The default value is `False`.
+     */
+    bool getUseSliceForces() const;
+    /**
+     * Set whether the forces of every slice are accumulated separately during force evaluations, so
+     * that :func:`getSliceForcesInContext` can return them. On the CUDA and OpenCL platforms, this takes
+     * 24 bytes per slice and particle on each device, and it disables the special treatment of small
+     * subsets and the computation of PME on the CPU. The Reference and CPU platforms compute each
+     * slice in an additional pass. It must be set before the context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to accumulate the force of every slice separately
+     */
+    void setUseSliceForces(bool use);
+    /**
+     * Get whether the Coulomb and Lennard-Jones energies of every slice are accumulated separately
+     * during energy evaluations, so that :func:`getSliceEnergiesInContext` and
+     * :func:`computeStateEnergiesInContext` can use them. The default value is `False`.
+     */
+    bool getUseSliceEnergies() const;
+    /**
+     * Set whether the Coulomb and Lennard-Jones energies of every slice are accumulated separately
+     * during energy evaluations, so that :func:`getSliceEnergiesInContext` and
+     * :func:`computeStateEnergiesInContext` can use them. On the CUDA and OpenCL platforms, this takes
+     * 16 bytes per slice and particle on each device, and it disables the computation of PME on the
+     * CPU. On all platforms, slices are neither merged nor skipped when their scaling parameters are
+     * zero (see :func:`setSkipDecoupledSlices`). It must be set before the context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to accumulate the energies of every slice separately
+     */
+    void setUseSliceEnergies(bool use);
+    /**
+     * Get whether the interactions are computed with a tree code when the nonbonded method is
+     * `NoCutoff`. The default value is `False`.
+     */
+    bool getUseTreeCode() const;
+    /**
+     * Set whether the interactions are computed with a tree code when the nonbonded method is
+     * `NoCutoff`. Without a cutoff, every pair of particles is normally computed directly, so that
+     * the cost grows with the square of the number of particles. With this option, the particles are
+     * sorted into an octree whose nodes keep one multipole expansion per subset: charge, dipole, and
+     * quadrupole for Coulomb, and the sums of epsilon times the powers of sigma for Lennard-Jones.
+     * Each particle interacts with a distant node through the expansions of all subsets, which gives
+     * the energies of its slices and the forces scaled by their parameters, and with the particles of
+     * the nearby nodes directly. The cost then grows as N log N, and the accuracy is controlled by
+     * :func:`setTreeCodeOpeningAngle`. The option is implemented by the Reference and CPU platforms
+     * only, and creating a context on another platform throws an exception when it is set together
+     * with `NoCutoff`. It is ignored by the other nonbonded methods, and it must be set before the
+     * context is created.
+     *
+     * Parameters
+     * ----------
+     *     use : bool
+     *         whether to use a tree code
+     */
+    void setUseTreeCode(bool use);
+    /**
+     * Get the opening angle of the tree code. The default value is 0.3.
+     */
+    double getTreeCodeOpeningAngle() const;
+    /**
+     * Set the opening angle of the tree code, which is the largest ratio between the size of a node
+     * and its distance to a particle for which the multipole expansions of the node are used. A
+     * smaller angle makes the results closer to those of the direct sum, at a higher cost. It must
+     * be set before the context is created.
+     *
+     * Parameters
+     * ----------
+     *     angle : float
+     *         the opening angle, which must be greater than 0 and at most 1
+     */
+    void setTreeCodeOpeningAngle(double angle);
+    /**
+     * Get the configurations stored from previous PME grid tuning and FFT library selection, one per
+     * line. The default value is an empty string.
+     */
+    const std::string& getTunedConfiguration() const;
+    /**
+     * Set the configurations stored from previous PME grid tuning and FFT library selection, usually
+     * obtained with :func:`getTunedConfigurationInContext`. Each configuration records the device, the
+     * numbers of particles and subsets, the separation parameters, the tuned grid dimensions, and the
+     * selected FFT library. When a context is created with :func:`setAutotunePME` or
+     * :func:`setAutoselectFFT` enabled, a configuration matching its device and system is used instead
+     * of timing the transforms. A stored grid is only used if none of its dimensions is smaller than the
+     * one computed for the context, so that it never reduces the accuracy. This value is serialized with
+     * the force.
+     *
+     * Parameters
+     * ----------
+     *     configuration : str
+     *         the stored configurations
+     */
+    void setTunedConfiguration(const std::string& configuration);
+    /**
+     * Get the maximum number of charged particles in a subset whose reciprocal space sums are
+     * computed without a grid. The default value is 0, which means that every subset with charged
+     * particles has its own grid.
+     */
+    int getSmallSubsetThreshold() const;
+    /**
+     * Set the maximum number of charged particles in a subset whose reciprocal space sums are
+     * computed without a grid. In the CUDA and OpenCL platforms, every subset normally has its own PME
+     * grid, which is spread, transformed forward and backward, and interpolated, even if it only
+     * contains a few particles, such as a ligand in a free energy calculation. The transform of the
+     * grid of a small subset can instead be obtained directly from the B-spline coefficients of its
+     * particles, and the forces on them can be computed from the transformed potential, so that
+     * this subset needs neither charge spreading nor fast Fourier transforms. The potentials felt
+     * by all subsets are combined before the inverse transforms, which are then applied to the
+     * grids of the other subsets only. The results are the same as with standard PME, apart from
+     * rounding errors. Only particles with charges or charge offsets are counted, so that a subset
+     * without any, such as a group of uncharged dummy atoms, never has a grid, whatever the
+     * threshold. The small subsets are identified when the context is created, and the subset with
+     * the most charged particles always keeps its grid. This option only affects the Coulomb sums
+     * of the PME method and must be set before the context is created. In the CUDA and OpenCL
+     * platforms, with LJPME, a subset whose particles have neither epsilons nor epsilon offsets when
+     * the context is created never has a dispersion grid either, whatever the threshold, and
+     * :func:`updateParametersInContext` and :func:`reassignSubsetsInContext` then fail if they would
+     * give that subset a particle with an epsilon.
+     *
+     * Parameters
+     * ----------
+     *     threshold : int
+     *         the maximum number of charged particles in a small subset, or 0 for only the
+     *         uncharged subsets
+     */
+    void setSmallSubsetThreshold(int threshold);
+    /**
+     * Get the order of the B-splines used to interpolate charges and forces in PME and LJPME. The
+     * default value is 5, as in NonbondedForce.
+     */
+    int getPMEInterpolationOrder() const;
+    /**
+     * Set the order of the B-splines used to interpolate charges and forces in PME and LJPME. A
+     * higher order makes spreading and interpolation more expensive, but it reduces the error of a
+     * grid with a given spacing. Since the cost of the fast Fourier transforms grows with the number
+     * of subsets, a higher order with a coarser grid is often faster for sliced forces. When the grid
+     * dimensions are chosen automatically, NonbondedForce's fifth order grid is scaled to the smallest
+     * one whose estimated reciprocal space force error, summed over the aliases of every grid frequency,
+     * does not exceed that of the fifth order grid, so that lower orders get finer grids. The Reference and CPU platforms accept any order from 3 on, whereas the
+     * CUDA and OpenCL platforms accept orders from 3 to 8. It must be set before the context is
+     * created.
+     *
+     * Parameters
+     * ----------
+     *     order : int
+     *         the interpolation order, which must be at least 3
+     */
+    void setPMEInterpolationOrder(int order);
+    /**
+     * Get the number of steps between consecutive slice energy reports. The value 0, which is the
+     * default, means that no reports are produced.
+     */
+    int getSliceEnergyReportInterval() const;
+    /**
+     * Set the number of steps between consecutive slice energy reports. At every step that is a
+     * multiple of this interval, the first evaluation of this force copies the values of all requested
+     * scaling parameter derivatives, which are the energies of the slices scaled by each parameter,
+     * to the host without blocking the simulation. They are then written to the file specified with
+     * :func:`setSliceEnergyReportFile` by a background thread. This only takes effect for contexts
+     * created afterwards and is not supported with multiple devices.
+     *
+     * Parameters
+     * ----------
+     *     steps : int
+     *         the number of steps between reports, or 0 for no reports
+     */
+    void setSliceEnergyReportInterval(int steps);
+    /**
+     * Get the file to which slice energy reports are written.
+     */
+    const std::string& getSliceEnergyReportFile() const;
+    /**
+     * Set the file to which slice energy reports are written. The file starts with the characters
+     * `NBSE`, a 32-bit integer N, and the N names of the reported derivatives, each one stored as a
+     * 32-bit length followed by its characters. Every report is then stored as a 64-bit step index
+     * followed by N double precision values. The file is complete once the context is deleted.
+     *
+     * Parameters
+     * ----------
+     *     file : str
+     *         the path of the file
+     */
+    void setSliceEnergyReportFile(const std::string& file);
+
+    /*
+     * Add bulk accessors that read and write contiguous arrays.
+    */
+
+    %extend {
+        void _copyParticleSubsets(PyObject* array) const {
+            ContiguousBuffer buffer(array, sizeof(int), self->getNumParticles(), true);
+            vector<int> subsets = self->getParticleSubsets();
+            std::copy(subsets.begin(), subsets.end(), buffer.data<int>());
+        }
+
+        void _setParticleSubsets(PyObject* array) {
+            ContiguousBuffer buffer(array, sizeof(int), self->getNumParticles(), false);
+            int* data = buffer.data<int>();
+            self->setParticleSubsets(vector<int>(data, data+self->getNumParticles()));
+        }
+
+        void _copyParticleParameters(PyObject* array) const {
+            ContiguousBuffer buffer(array, sizeof(double), 3*self->getNumParticles(), true);
+            double* data = buffer.data<double>();
+            for (int i = 0; i < self->getNumParticles(); i++)
+                self->getParticleParameters(i, data[3*i], data[3*i+1], data[3*i+2]);
+        }
+
+        void _setParticleParameters(PyObject* array) {
+            ContiguousBuffer buffer(array, sizeof(double), 3*self->getNumParticles(), false);
+            double* data = buffer.data<double>();
+            for (int i = 0; i < self->getNumParticles(); i++)
+                self->setParticleParameters(i, data[3*i], data[3*i+1], data[3*i+2]);
+        }
+
+        void _copyExceptionParameters(PyObject* particles, PyObject* parameters) const {
+            ContiguousBuffer particleBuffer(particles, sizeof(int), 2*self->getNumExceptions(), true);
+            ContiguousBuffer parameterBuffer(parameters, sizeof(double), 3*self->getNumExceptions(), true);
+            int* p = particleBuffer.data<int>();
+            double* data = parameterBuffer.data<double>();
+            for (int i = 0; i < self->getNumExceptions(); i++)
+                self->getExceptionParameters(i, p[2*i], p[2*i+1], data[3*i], data[3*i+1], data[3*i+2]);
+        }
+
+        void _setExceptionParameters(PyObject* parameters) {
+            ContiguousBuffer buffer(parameters, sizeof(double), 3*self->getNumExceptions(), false);
+            double* data = buffer.data<double>();
+            for (int i = 0; i < self->getNumExceptions(); i++) {
+                int particle1, particle2;
+                double chargeProd, sigma, epsilon;
+                self->getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
+                self->setExceptionParameters(i, particle1, particle2, data[3*i], data[3*i+1], data[3*i+2]);
+            }
+        }
+
+        void _computeStateEnergiesInContext(OpenMM::Context& context, const std::vector<std::string>& parameters, PyObject* states,
+                                            int numStates, PyObject* energies) {
+            int numParams = parameters.size();
+            ContiguousBuffer stateBuffer(states, sizeof(double), numStates*numParams, false);
+            ContiguousBuffer energyBuffer(energies, sizeof(double), numStates, true);
+            double* data = stateBuffer.data<double>();
+            vector<vector<double>> stateValues(numStates);
+            for (int i = 0; i < numStates; i++)
+                stateValues[i].assign(data+i*numParams, data+(i+1)*numParams);
+            vector<double> result = self->computeStateEnergiesInContext(context, parameters, stateValues);
+            std::copy(result.begin(), result.end(), energyBuffer.data<double>());
+        }
+    }
+
+    %pythoncode %{
+    def getParticleSubsetsArray(self):
+        """
+        Get the subsets of all particles as a NumPy array.
+
+        Returns
+        -------
+            subsets : numpy.ndarray
+                the subset of every particle, with dtype int32 and shape (nparticles,)
+        """
+        import numpy as np
+        subsets = np.empty(self.getNumParticles(), dtype=np.intc)
+        self._copyParticleSubsets(subsets)
+        return subsets
+
+    def setParticleSubsetsArray(self, subsets):
+        """
+        Set the subsets of all particles from an array.  No copy is made if the array is already contiguous
+        and of dtype int32.
+
+        Parameters
+        ----------
+            subsets : array_like
+                the subset of every particle, with shape (nparticles,)
+        """
+        import numpy as np
+        self._setParticleSubsets(np.ascontiguousarray(subsets, dtype=np.intc))
+
+    def getParticleParametersArray(self):
+        """
+        Get the nonbonded parameters of all particles as a NumPy array.
+
+        Returns
+        -------
+            parameters : numpy.ndarray
+                the charge (in elementary charge units), sigma (in nm), and epsilon (in kJ/mol) of every
+                particle, with shape (nparticles, 3)
+        """
+        import numpy as np
+        parameters = np.empty((self.getNumParticles(), 3), dtype=np.float64)
+        self._copyParticleParameters(parameters)
+        return parameters
+
+    def setParticleParametersArray(self, parameters):
+        """
+        Set the nonbonded parameters of all existing particles from an array.
+
+        Parameters
+        ----------
+            parameters : array_like
+                the charge (in elementary charge units), sigma (in nm), and epsilon (in kJ/mol) of every
+                particle, with shape (nparticles, 3)
+        """
+        import numpy as np
+        self._setParticleParameters(np.ascontiguousarray(parameters, dtype=np.float64))
+
+    def getExceptionParametersArray(self):
+        """
+        Get the particles and parameters of all exceptions as NumPy arrays.
+
+        Returns
+        -------
+            particles : numpy.ndarray
+                the indices of the two particles of every exception, with dtype int32 and shape (nexceptions, 2)
+            parameters : numpy.ndarray
+                the charge product (in squared elementary charge units), sigma (in nm), and epsilon (in kJ/mol)
+                of every exception, with shape (nexceptions, 3)
+        """
+        import numpy as np
+        particles = np.empty((self.getNumExceptions(), 2), dtype=np.intc)
+        parameters = np.empty((self.getNumExceptions(), 3), dtype=np.float64)
+        self._copyExceptionParameters(particles, parameters)
+        return particles, parameters
+
+    def setExceptionParametersArray(self, parameters):
+        """
+        Set the parameters of all existing exceptions from an array.  The particles of each exception are
+        not changed.
+
+        Parameters
+        ----------
+            parameters : array_like
+                the charge product (in squared elementary charge units), sigma (in nm), and epsilon (in kJ/mol)
+                of every exception, with shape (nexceptions, 3)
+        """
+        import numpy as np
+        self._setExceptionParameters(np.ascontiguousarray(parameters, dtype=np.float64))
+
+    def computeStateEnergiesInContextArray(self, context, parameters, states):
+        """
+        Same as :func:`computeStateEnergiesInContext`, but with the states given as an array of shape
+        (nstates, nparameters) and the energies (in kJ/mol) returned as a NumPy array of shape (nstates,).
+        """
+        import numpy as np
+        states = np.ascontiguousarray(states, dtype=np.float64).reshape(-1, len(parameters))
+        energies = np.empty(states.shape[0], dtype=np.float64)
+        self._computeStateEnergiesInContext(context, list(parameters), states, states.shape[0], energies)
+        return energies
+    %}
 
     /*
      * Add methods for casting a Force to a SlicedNonbondedForce.
@@ -431,4 +1395,204 @@ public:
 %clear bool& includeLJ;
 %clear bool& includeCoulomb;
 
+/**
+ * This class computes the Coulomb and Lennard-Jones energies of every slice of a SlicedNonbondedForce for
+ * many frames of a trajectory.  It owns a private :OpenMM:`Context` that contains nothing but a copy of the
+ * force, in which each contribution of each slice is multiplied by its own scaling parameter with value 1.
+ * The slice energies are then obtained as derivatives, without computing any forces.  On the CUDA and OpenCL
+ * platforms, the positions of each frame are copied to the device on a separate stream or queue while the
+ * previous frame is computed.  The computed energies are not multiplied by the scaling parameters of the
+ * original force.
+ */
+class SliceEnergyAnalyzer {
+public:
+    /**
+     * Create a SliceEnergyAnalyzer.
+     *
+     * Parameters
+     * ----------
+     *     system : System
+     *         the System that contains the force
+     *     force : SlicedNonbondedForce
+     *         the force whose slice energies are to be computed
+     *     platform : Platform
+     *         the Platform to use for the calculations
+     *     properties : dict
+     *         a set of values for platform-specific properties
+     */
+    SliceEnergyAnalyzer(const OpenMM::System& system, const SlicedNonbondedForce& force, OpenMM::Platform& platform,
+                        const std::map<std::string, std::string>& properties=std::map<std::string, std::string>());
+    /**
+     * Get the number of particles in each frame.
+     */
+    int getNumParticles() const;
+    /**
+     * Get the number of slices of the force.
+     */
+    int getNumSlices() const;
+    /**
+     * Set the value of a global parameter of the force, such as one used in parameter offsets.
+     *
+     * Parameters
+     * ----------
+     *     name : str
+     *         the name of the parameter
+     *     value : float
+     *         the value of the parameter
+     */
+    void setParameter(const std::string& name, double value);
+    /**
+     * Compute the slice energies for a set of frames given as flat lists.  See :func:`analyze` for a
+     * version that accepts and returns NumPy arrays.
+     *
+     * Parameters
+     * ----------
+     *     positions : list(float)
+     *         the coordinates of all particles in all frames, in nm, frame after frame
+     *     boxVectors : list(float)
+     *         the nine box vector components of each frame, in nm, or an empty list for the default box
+     *
+     * Returns
+     * -------
+     *     energies : list(float)
+     *         the Coulomb and Lennard-Jones energies of each slice of each frame, in kJ/mol
+     */
+    std::vector<double> computeSliceEnergies(const std::vector<double>& positions, const std::vector<double>& boxVectors=std::vector<double>());
+
+    /*
+     * Add an entry point that reads and writes contiguous arrays.
+    */
+
+    %extend {
+        void _analyze(PyObject* positions, PyObject* boxVectors, int numFrames, PyObject* energies) {
+            ContiguousBuffer positionBuffer(positions, sizeof(double), 3*self->getNumParticles()*numFrames, false);
+            ContiguousBuffer energyBuffer(energies, sizeof(double), 2*self->getNumSlices()*numFrames, true);
+            if (boxVectors == Py_None)
+                self->computeSliceEnergies(numFrames, positionBuffer.data<double>(), NULL, energyBuffer.data<double>());
+            else {
+                ContiguousBuffer boxBuffer(boxVectors, sizeof(double), 9*numFrames, false);
+                self->computeSliceEnergies(numFrames, positionBuffer.data<double>(), boxBuffer.data<double>(), energyBuffer.data<double>());
+            }
+        }
+    }
+
+    %pythoncode %{
+    def analyze(self, positions, boxVectors=None):
+        """
+        Compute the slice energies for a set of frames.
+
+        Parameters
+        ----------
+            positions : array_like
+                the particle positions, with shape (nframes, nparticles, 3), in nm if not a Quantity
+            boxVectors : array_like, optional
+                the periodic box vectors, with shape (nframes, 3, 3), in nm if not a Quantity
+
+        Returns
+        -------
+            energies : numpy.ndarray
+                the Coulomb (index 0) and Lennard-Jones (index 1) energies of each slice, with shape
+                (nframes, nslices, 2), in kJ/mol
+        """
+        import numpy as np
+        if unit.is_quantity(positions):
+            positions = positions.value_in_unit(unit.nanometers)
+        positions = np.ascontiguousarray(positions, dtype=np.float64).reshape(-1, self.getNumParticles(), 3)
+        numFrames = positions.shape[0]
+        boxes = None
+        if boxVectors is not None:
+            if unit.is_quantity(boxVectors):
+                boxVectors = boxVectors.value_in_unit(unit.nanometers)
+            boxes = np.ascontiguousarray(boxVectors, dtype=np.float64).reshape(numFrames, 3, 3)
+        energies = np.empty((numFrames, self.getNumSlices(), 2), dtype=np.float64)
+        self._analyze(positions, boxes, numFrames, energies)
+        return energies
+    %}
+};
+
+
+/**
+ * This class packs several replicas of a SlicedNonbondedForce, which share the same particles and exceptions
+ * but have their own positions and parameter values, into a single force that can be evaluated in one
+ * :OpenMM:`Context`. This keeps a GPU busy when each replica is too small to do it on its own, since the
+ * grids of all replicas are transformed in a single batch. All replicas share the same periodic box.
+ *
+ * Replica :math:`r` contains the particles with indices from :math:`rN` to :math:`(r+1)N-1`, where
+ * :math:`N` is the number of particles of the original force, and subset :math:`s` of the original force
+ * becomes subset :math:`rn+s`, where :math:`n` is the original number of subsets. Every global parameter
+ * of the original force becomes one global parameter per replica, named by :func:`getParameterName`.
+ * The slices that involve two different replicas are multiplied by an extra scaling parameter fixed at
+ * zero, and the skipping of decoupled slices is enabled, so that replicas do not interact. The energy
+ * of each replica can be obtained with :func:`getReplicaEnergies`.
+ *
+ * Only the SlicedNonbondedForce is replicated. The particles and any other forces of the System must be
+ * replicated by the caller, in the same order.
+ */
+class SlicedNonbondedReplicaBatch {
+public:
+    /**
+     * Create a SlicedNonbondedReplicaBatch.
+     *
+     * Parameters
+     * ----------
+     *     force : SlicedNonbondedForce
+     *         the force to replicate
+     *     numReplicas : int
+     *         the number of replicas
+     */
+    SlicedNonbondedReplicaBatch(const SlicedNonbondedForce& force, int numReplicas);
+    /**
+     * Get the number of replicas.
+     */
+    int getNumReplicas() const;
+    /**
+     * Get the number of particles of each replica.
+     */
+    int getNumParticlesPerReplica() const;
+    /**
+     * Get the index, in the batched force, of a particle of a replica.
+     *
+     * Parameters
+     * ----------
+     *     replica : int
+     *         the index of the replica
+     *     particle : int
+     *         the index of the particle in the original force
+     */
+    int getParticleIndex(int replica, int particle) const;
+    /**
+     * Get the name of the global parameter that stands for a global parameter of the original force in a
+     * replica.
+     *
+     * Parameters
+     * ----------
+     *     replica : int
+     *         the index of the replica
+     *     parameter : str
+     *         the name of the global parameter in the original force
+     */
+    std::string getParameterName(int replica, const std::string& parameter) const;
+    /**
+     * Create a new SlicedNonbondedForce that contains all replicas, usually to be added to a System.
+     */
+    %newobject createForce;
+    SlicedNonbondedForce* createForce() const;
+    /**
+     * Get the energy of each replica from a :OpenMM:`State` created by a Context that contains the batched
+     * force. The State must have been created with ``getParameters=True`` and
+     * ``getParameterDerivatives=True``. Only the energy of the batched force is included.
+     *
+     * Parameters
+     * ----------
+     *     state : State
+     *         the State
+     *
+     * Returns
+     * -------
+     *     energies : list(float)
+     *         the potential energy of each replica, in kJ/mol
+     */
+    std::vector<double> getReplicaEnergies(const OpenMM::State& state) const;
+};
+
 }
@@ -156,6 +156,10 @@ def testLargeSystem(platformName, precision):
 
     assert nonbonded.getParticleSubset(0) == 0
     assert nonbonded.getParticleSubset(1) == 1
+    subsets = nonbonded.getParticleSubsets()
+    assert len(subsets) == nonbonded.getNumParticles()
+    assert tuple(subsets[:2]) == (0, 1)
+    nonbonded.setParticleSubsets(subsets)
 
     system.addForce(nonbonded)
     integrator1 = mm.VerletIntegrator(0.01)
@@ -178,3 +182,62 @@ def testLargeSystem(platformName, precision):
         ASSERT_EQUAL_VEC(state.getVelocities()[i], referenceState.getVelocities()[i], tol)
         ASSERT_EQUAL_VEC(state.getForces()[i], referenceState.getForces()[i], tol)
     ASSERT_EQUAL_TOL(state.getPotentialEnergy(), referenceState.getPotentialEnergy(), tol)
+
+
+@pytest.mark.parametrize('platformName', ['Reference', 'CUDA', 'OpenCL'])
+def testSliceEnergyAnalyzer(platformName):
+    numParticles = 60
+    numFrames = 4
+    boxSize = 3.0
+    system = mm.System()
+    system.setDefaultPeriodicBoxVectors(
+        mm.Vec3(boxSize, 0, 0),
+        mm.Vec3(0, boxSize, 0),
+        mm.Vec3(0, 0, boxSize),
+    )
+    force = plugin.SlicedNonbondedForce(2)
+    force.setNonbondedMethod(plugin.SlicedNonbondedForce.PME)
+    for i in range(numParticles):
+        system.addParticle(1.0)
+        force.addParticle(1.0 if i % 2 == 0 else -1.0, 0.3, 0.5)
+        force.setParticleSubset(i, i % 2)
+    system.addForce(force)
+    platform = mm.Platform.getPlatformByName(platformName)
+    analyzer = plugin.SliceEnergyAnalyzer(system, force, platform)
+    rng = np.random.default_rng(0)
+    positions = rng.random((numFrames, numParticles, 3))*boxSize
+    energies = analyzer.analyze(positions)
+    assert energies.shape == (numFrames, 3, 2)
+    context = mm.Context(system, mm.VerletIntegrator(0.001), platform)
+    for frame in range(numFrames):
+        context.setPositions(positions[frame])
+        energy = value(context.getState(getEnergy=True).getPotentialEnergy())
+        ASSERT_EQUAL_TOL(energy, energies[frame].sum(), 1e-4)
+    boxes = np.tile(np.eye(3)*boxSize, (numFrames, 1, 1))
+    assert np.allclose(energies, analyzer.analyze(positions, boxes), rtol=1e-4, atol=1e-4)
+
+
+def testBulkArrayAccessors():
+    numParticles = 100
+    force = plugin.SlicedNonbondedForce(3)
+    for i in range(numParticles):
+        force.addParticle(0.0, 1.0, 0.0)
+    for i in range(0, numParticles-1, 2):
+        force.addException(i, i+1, 0.0, 1.0, 0.0)
+    rng = np.random.default_rng(1)
+    subsets = rng.integers(0, 3, numParticles)
+    force.setParticleSubsetsArray(subsets)
+    assert np.array_equal(force.getParticleSubsetsArray(), subsets)
+    assert list(force.getParticleSubsets()) == subsets.tolist()
+    parameters = rng.random((numParticles, 3))
+    force.setParticleParametersArray(parameters)
+    assert np.array_equal(force.getParticleParametersArray(), parameters)
+    ASSERT_EQUAL_TOL(parameters[7, 1], value(force.getParticleParameters(7)[1]), 1e-15)
+    exceptionParameters = rng.random((force.getNumExceptions(), 3))
+    force.setExceptionParametersArray(exceptionParameters)
+    particles, found = force.getExceptionParametersArray()
+    assert np.array_equal(particles[:, 0], np.arange(0, numParticles-1, 2))
+    assert np.array_equal(particles[:, 1], np.arange(1, numParticles, 2))
+    assert np.array_equal(found, exceptionParameters)
+    with pytest.raises(Exception):
+        force.setParticleSubsetsArray(subsets[1:])
@@ -12,6 +12,9 @@
 #include "SlicedNonbondedForce.h"
 #include "openmm/serialization/SerializationNode.h"
 #include "openmm/Force.h"
+#include "openmm/OpenMMException.h"
+#include <cstdint>
+#include <cstring>
 #include <sstream>
 
 using namespace NonbondedSlicing;
@@ -21,8 +24,89 @@ using namespace std;
 SlicedNonbondedForceProxy::SlicedNonbondedForceProxy() : SerializationProxy("SlicedNonbondedForce") {
 }
 
+/**
+ * Version 2 stores the per-particle and per-exception data as base64-encoded arrays of raw values
+ * in the byte order of the host, which is little-endian on every platform OpenMM supports, rather
+ * than one node per item.  This is much more compact and much faster to parse for large systems,
+ * and it also reproduces every value exactly.  Version 3 adds the force groups of individual slices, and
+ * version 4 the configurations found by PME grid tuning and FFT library selection, together with
+ * every other option that affects the results or the quantities a context can provide: the PME
+ * interpolation order, the tree code settings, the small subset threshold, the influence function,
+ * grid tuning and FFT selection, on-demand derivatives, and slice forces and energies.  Options
+ * that only affect performance or memory on particular hardware (cuFFT, skipping decoupled slices,
+ * CUDA graphs, stage profiling, compact grids, the energy cache, PME on the CPU, concurrent LJPME,
+ * load balancing, and cached B-splines) and the slice energy reports, which belong to a run rather
+ * than to the model, are deliberately left out, so a deserialized force gets their default values.
+ */
+
+static const char* base64Chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static string encodeBase64(const void* data, size_t size) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    string encoded;
+    encoded.reserve(4*((size+2)/3));
+    for (size_t i = 0; i < size; i += 3) {
+        unsigned int block = bytes[i] << 16;
+        if (i+1 < size)
+            block |= bytes[i+1] << 8;
+        if (i+2 < size)
+            block |= bytes[i+2];
+        encoded += base64Chars[(block>>18)&63];
+        encoded += base64Chars[(block>>12)&63];
+        encoded += (i+1 < size ? base64Chars[(block>>6)&63] : '=');
+        encoded += (i+2 < size ? base64Chars[block&63] : '=');
+    }
+    return encoded;
+}
+
+static void decodeBase64(const string& encoded, void* data, size_t size, const string& name) {
+    static int values[256];
+    static bool initialized = false;
+    if (!initialized) {
+        for (int i = 0; i < 256; i++)
+            values[i] = -1;
+        for (int i = 0; i < 64; i++)
+            values[(unsigned char) base64Chars[i]] = i;
+        initialized = true;
+    }
+    if (encoded.size() != 4*((size+2)/3))
+        throw OpenMMException("Wrong size of encoded data in "+name);
+    unsigned char* bytes = reinterpret_cast<unsigned char*>(data);
+    for (size_t i = 0, j = 0; j < size; i += 4, j += 3) {
+        unsigned int block = 0;
+        for (int k = 0; k < 4; k++) {
+            unsigned char c = encoded[i+k];
+            int value = (c == '=' && j+k > size ? 0 : values[c]);
+            if (value < 0)
+                throw OpenMMException("Invalid character in encoded data in "+name);
+            block = (block<<6) | value;
+        }
+        bytes[j] = (block>>16)&255;
+        if (j+1 < size)
+            bytes[j+1] = (block>>8)&255;
+        if (j+2 < size)
+            bytes[j+2] = block&255;
+    }
+}
+
+template <class T>
+static void setArrayProperty(SerializationNode& node, const vector<T>& array) {
+    node.setIntProperty("size", array.size());
+    node.setStringProperty("data", encodeBase64(array.data(), array.size()*sizeof(T)));
+}
+
+template <class T>
+static vector<T> getArrayProperty(const SerializationNode& node, const string& name) {
+    int size = node.getIntProperty("size");
+    if (size < 0)
+        throw OpenMMException("Negative array size in "+name);
+    vector<T> array(size);
+    decodeBase64(node.getStringProperty("data"), array.data(), size*sizeof(T), name);
+    return array;
+}
+
 void SlicedNonbondedForceProxy::serialize(const void* object, SerializationNode& node) const {
-    node.setIntProperty("version", 1);
+    node.setIntProperty("version", 4);
     const SlicedNonbondedForce& force = *reinterpret_cast<const SlicedNonbondedForce*>(object);
     node.setIntProperty("numSubsets", force.getNumSubsets());
     node.setIntProperty("forceGroup", force.getForceGroup());
@@ -49,6 +133,16 @@ void SlicedNonbondedForceProxy::serialize(const void* object, SerializationNode&
     node.setIntProperty("ljny", ny);
     node.setIntProperty("ljnz", nz);
     node.setIntProperty("recipForceGroup", force.getReciprocalSpaceForceGroup());
+    node.setIntProperty("pmeInterpolationOrder", force.getPMEInterpolationOrder());
+    node.setBoolProperty("useTreeCode", force.getUseTreeCode());
+    node.setDoubleProperty("treeCodeOpeningAngle", force.getTreeCodeOpeningAngle());
+    node.setIntProperty("smallSubsetThreshold", force.getSmallSubsetThreshold());
+    node.setBoolProperty("useOptimalInfluenceFunction", force.getUseOptimalInfluenceFunction());
+    node.setBoolProperty("autotunePME", force.getAutotunePME());
+    node.setBoolProperty("autoselectFFT", force.getAutoselectFFT());
+    node.setBoolProperty("useDerivativesOnDemand", force.getUseDerivativesOnDemand());
+    node.setBoolProperty("useSliceForces", force.getUseSliceForces());
+    node.setBoolProperty("useSliceEnergies", force.getUseSliceEnergies());
     SerializationNode& globalParams = node.createChildNode("GlobalParameters");
     for (int i = 0; i < force.getNumGlobalParameters(); i++)
         globalParams.createChildNode("Parameter").setStringProperty("name", force.getGlobalParameterName(i)).setDoubleProperty("default", force.getGlobalParameterDefaultValue(i));
@@ -68,25 +162,37 @@ void SlicedNonbondedForceProxy::serialize(const void* object, SerializationNode&
         force.getExceptionParameterOffset(i, parameter, exception, chargeProdScale, sigmaScale, epsilonScale);
         exceptionOffsets.createChildNode("Offset").setStringProperty("parameter", parameter).setIntProperty("exception", exception).setDoubleProperty("q", chargeProdScale).setDoubleProperty("sig", sigmaScale).setDoubleProperty("eps", epsilonScale);
     }
-    SerializationNode& particles = node.createChildNode("Particles");
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        double charge, sigma, epsilon;
-        force.getParticleParameters(i, charge, sigma, epsilon);
-        particles.createChildNode("Particle").setDoubleProperty("q", charge).setDoubleProperty("sig", sigma).setDoubleProperty("eps", epsilon);
-    }
-    SerializationNode& exceptions = node.createChildNode("Exceptions");
-    for (int i = 0; i < force.getNumExceptions(); i++) {
+    int numParticles = force.getNumParticles();
+    vector<double> particleParams(3*numParticles);
+    for (int i = 0; i < numParticles; i++)
+        force.getParticleParameters(i, particleParams[3*i], particleParams[3*i+1], particleParams[3*i+2]);
+    setArrayProperty(node.createChildNode("Particles"), particleParams);
+    int numExceptions = force.getNumExceptions();
+    vector<int32_t> exceptionParticles(2*numExceptions);
+    vector<double> exceptionParams(3*numExceptions);
+    for (int i = 0; i < numExceptions; i++) {
         int particle1, particle2;
-        double chargeProd, sigma, epsilon;
-        force.getExceptionParameters(i, particle1, particle2, chargeProd, sigma, epsilon);
-        exceptions.createChildNode("Exception").setIntProperty("p1", particle1).setIntProperty("p2", particle2).setDoubleProperty("q", chargeProd).setDoubleProperty("sig", sigma).setDoubleProperty("eps", epsilon);
+        force.getExceptionParameters(i, particle1, particle2, exceptionParams[3*i], exceptionParams[3*i+1], exceptionParams[3*i+2]);
+        exceptionParticles[2*i] = particle1;
+        exceptionParticles[2*i+1] = particle2;
     }
-    SerializationNode& subsets = node.createChildNode("Subsets");
-    for (int i = 0; i < force.getNumParticles(); i++) {
-        int subset = force.getParticleSubset(i);
-        if (subset != 0)
-            subsets.createChildNode("Subset").setIntProperty("index", i).setIntProperty("subset", subset);
+    setArrayProperty(node.createChildNode("ExceptionParticles"), exceptionParticles);
+    setArrayProperty(node.createChildNode("Exceptions"), exceptionParams);
+
+    // Subsets are usually assigned to long runs of consecutive particles, so they are stored as
+    // (subset, run length) pairs.
+
+    vector<int32_t> subsetRuns;
+    vector<int> particleSubsets = force.getParticleSubsets();
+    for (int i = 0; i < particleSubsets.size(); i++) {
+        if (i > 0 && particleSubsets[i] == particleSubsets[i-1])
+            subsetRuns.back()++;
+        else {
+            subsetRuns.push_back(particleSubsets[i]);
+            subsetRuns.push_back(1);
+        }
     }
+    setArrayProperty(node.createChildNode("Subsets"), subsetRuns);
     SerializationNode& scalingParameters = node.createChildNode("scalingParameters");
     for (int i = 0; i < force.getNumScalingParameters(); i++) {
         string parameter;
@@ -98,11 +204,27 @@ void SlicedNonbondedForceProxy::serialize(const void* object, SerializationNode&
     SerializationNode& scalingParameterDerivatives = node.createChildNode("scalingParameterDerivatives");
     for (int i = 0; i < force.getNumScalingParameterDerivatives(); i++)
         scalingParameterDerivatives.createChildNode("scalingParameterDerivative").setStringProperty("parameter", force.getScalingParameterDerivativeName(i));
+    SerializationNode& sliceForceGroups = node.createChildNode("sliceForceGroups");
+    for (int slice = 0; slice < force.getNumSlices(); slice++) {
+        int group = force.getSliceForceGroup(slice);
+        int recipGroup = force.getSliceReciprocalSpaceForceGroup(slice);
+        if (group != -1 || recipGroup != -1)
+            sliceForceGroups.createChildNode("slice").setIntProperty("index", slice).setIntProperty("group", group).setIntProperty("recipGroup", recipGroup);
+    }
+
+    // Each tuned configuration is a line of text, stored in a node of its own.
+
+    SerializationNode& tunedConfigurations = node.createChildNode("tunedConfigurations");
+    stringstream lines(force.getTunedConfiguration());
+    string line;
+    while (getline(lines, line))
+        if (!line.empty())
+            tunedConfigurations.createChildNode("configuration").setStringProperty("value", line);
 }
 
 void* SlicedNonbondedForceProxy::deserialize(const SerializationNode& node) const {
     int version = node.getIntProperty("version");
-    if (version != 1)
+    if (version < 1 || version > 4)
         throw OpenMMException("Unsupported version number");
     SlicedNonbondedForce* force = new SlicedNonbondedForce(node.getIntProperty("numSubsets"));
     try {
@@ -128,6 +250,16 @@ void* SlicedNonbondedForceProxy::deserialize(const SerializationNode& node) cons
         nz = node.getIntProperty("ljnz", 0);
         force->setLJPMEParameters(alpha, nx, ny, nz);
         force->setReciprocalSpaceForceGroup(node.getIntProperty("recipForceGroup", -1));
+        force->setPMEInterpolationOrder(node.getIntProperty("pmeInterpolationOrder", 5));
+        force->setUseTreeCode(node.getBoolProperty("useTreeCode", false));
+        force->setTreeCodeOpeningAngle(node.getDoubleProperty("treeCodeOpeningAngle", 0.3));
+        force->setSmallSubsetThreshold(node.getIntProperty("smallSubsetThreshold", 0));
+        force->setUseOptimalInfluenceFunction(node.getBoolProperty("useOptimalInfluenceFunction", false));
+        force->setAutotunePME(node.getBoolProperty("autotunePME", false));
+        force->setAutoselectFFT(node.getBoolProperty("autoselectFFT", false));
+        force->setUseDerivativesOnDemand(node.getBoolProperty("useDerivativesOnDemand", false));
+        force->setUseSliceForces(node.getBoolProperty("useSliceForces", false));
+        force->setUseSliceEnergies(node.getBoolProperty("useSliceEnergies", false));
         const SerializationNode& globalParams = node.getChildNode("GlobalParameters");
         for (auto& parameter : globalParams.getChildren())
             force->addGlobalParameter(parameter.getStringProperty("name"), parameter.getDoubleProperty("default"));
@@ -138,21 +270,69 @@ void* SlicedNonbondedForceProxy::deserialize(const SerializationNode& node) cons
         for (auto& offset : exceptionOffsets.getChildren())
             force->addExceptionParameterOffset(offset.getStringProperty("parameter"), offset.getIntProperty("exception"), offset.getDoubleProperty("q"), offset.getDoubleProperty("sig"), offset.getDoubleProperty("eps"));
         force->setExceptionsUsePeriodicBoundaryConditions(node.getIntProperty("exceptionsUsePeriodic"));
-        const SerializationNode& particles = node.getChildNode("Particles");
-        for (auto& particle : particles.getChildren())
-            force->addParticle(particle.getDoubleProperty("q"), particle.getDoubleProperty("sig"), particle.getDoubleProperty("eps"));
-        const SerializationNode& exceptions = node.getChildNode("Exceptions");
-        for (auto& exception : exceptions.getChildren())
-            force->addException(exception.getIntProperty("p1"), exception.getIntProperty("p2"), exception.getDoubleProperty("q"), exception.getDoubleProperty("sig"), exception.getDoubleProperty("eps"));
-        const SerializationNode& subsets = node.getChildNode("Subsets");
-        for (auto& subset : subsets.getChildren())
-            force->setParticleSubset(subset.getIntProperty("index"), subset.getIntProperty("subset"));
+        if (version == 1) {
+            const SerializationNode& particles = node.getChildNode("Particles");
+            for (auto& particle : particles.getChildren())
+                force->addParticle(particle.getDoubleProperty("q"), particle.getDoubleProperty("sig"), particle.getDoubleProperty("eps"));
+            const SerializationNode& exceptions = node.getChildNode("Exceptions");
+            for (auto& exception : exceptions.getChildren())
+                force->addException(exception.getIntProperty("p1"), exception.getIntProperty("p2"), exception.getDoubleProperty("q"), exception.getDoubleProperty("sig"), exception.getDoubleProperty("eps"));
+            const SerializationNode& subsets = node.getChildNode("Subsets");
+            vector<int> particleSubsets(force->getNumParticles(), 0);
+            for (auto& subset : subsets.getChildren()) {
+                int index = subset.getIntProperty("index");
+                if (index < 0 || index >= particleSubsets.size())
+                    throw OpenMMException("Particle index out of range in Subsets");
+                particleSubsets[index] = subset.getIntProperty("subset");
+            }
+            force->setParticleSubsets(particleSubsets);
+        }
+        else {
+            vector<double> particleParams = getArrayProperty<double>(node.getChildNode("Particles"), "Particles");
+            if (particleParams.size()%3 != 0)
+                throw OpenMMException("Wrong number of values in Particles");
+            int numParticles = particleParams.size()/3;
+            for (int i = 0; i < numParticles; i++)
+                force->addParticle(particleParams[3*i], particleParams[3*i+1], particleParams[3*i+2]);
+            vector<int32_t> exceptionParticles = getArrayProperty<int32_t>(node.getChildNode("ExceptionParticles"), "ExceptionParticles");
+            vector<double> exceptionParams = getArrayProperty<double>(node.getChildNode("Exceptions"), "Exceptions");
+            if (exceptionParams.size()%3 != 0 || 2*exceptionParams.size() != 3*exceptionParticles.size())
+                throw OpenMMException("Wrong number of values in Exceptions");
+            int numExceptions = exceptionParticles.size()/2;
+            for (int i = 0; i < numExceptions; i++)
+                force->addException(exceptionParticles[2*i], exceptionParticles[2*i+1], exceptionParams[3*i], exceptionParams[3*i+1], exceptionParams[3*i+2]);
+            vector<int32_t> subsetRuns = getArrayProperty<int32_t>(node.getChildNode("Subsets"), "Subsets");
+            if (subsetRuns.size()%2 != 0)
+                throw OpenMMException("Wrong number of values in Subsets");
+            vector<int> particleSubsets;
+            particleSubsets.reserve(numParticles);
+            for (int i = 0; i < subsetRuns.size(); i += 2) {
+                if (subsetRuns[i+1] < 0 || particleSubsets.size()+subsetRuns[i+1] > numParticles)
+                    throw OpenMMException("Particle index out of range in Subsets");
+                particleSubsets.insert(particleSubsets.end(), subsetRuns[i+1], subsetRuns[i]);
+            }
+            particleSubsets.resize(numParticles, 0);
+            force->setParticleSubsets(particleSubsets);
+        }
         const SerializationNode& scalingParameters = node.getChildNode("scalingParameters");
         for (auto& param : scalingParameters.getChildren())
             force->addScalingParameter(param.getStringProperty("parameter"), param.getIntProperty("subset1"), param.getIntProperty("subset2"), param.getBoolProperty("includeCoulomb"), param.getBoolProperty("includeLJ"));
         const SerializationNode& scalingParameterDerivatives = node.getChildNode("scalingParameterDerivatives");
         for (auto& param : scalingParameterDerivatives.getChildren())
             force->addScalingParameterDerivative(param.getStringProperty("parameter"));
+        if (version >= 3) {
+            const SerializationNode& sliceForceGroups = node.getChildNode("sliceForceGroups");
+            for (auto& slice : sliceForceGroups.getChildren()) {
+                force->setSliceForceGroup(slice.getIntProperty("index"), slice.getIntProperty("group"));
+                force->setSliceReciprocalSpaceForceGroup(slice.getIntProperty("index"), slice.getIntProperty("recipGroup"));
+            }
+        }
+        if (version >= 4) {
+            string configurations;
+            for (auto& configuration : node.getChildNode("tunedConfigurations").getChildren())
+                configurations += configuration.getStringProperty("value")+"\n";
+            force->setTunedConfiguration(configurations);
+        }
     }
     catch (...) {
         delete force;
@@ -12,6 +12,7 @@
 #include "openmm/NonbondedForce.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/serialization/XmlSerializer.h"
+#include <cmath>
 #include <iostream>
 #include <sstream>
 
@@ -40,6 +41,17 @@ void testSerialization() {
     double dalpha = 0.8;
     int dnx = 4, dny = 6, dnz = 7;
     force.setLJPMEParameters(dalpha, dnx, dny, dnz);
+    force.setPMEInterpolationOrder(6);
+    force.setUseTreeCode(true);
+    force.setTreeCodeOpeningAngle(0.6);
+    force.setSmallSubsetThreshold(4);
+    force.setUseOptimalInfluenceFunction(true);
+    force.setAutotunePME(true);
+    force.setAutoselectFFT(true);
+    force.setUseDerivativesOnDemand(true);
+    force.setUseSliceForces(true);
+    force.setUseSliceEnergies(true);
+    force.setReciprocalSpaceForceGroup(5);
     force.addParticle(1, 0.1, 0.01);
     force.addParticle(0.5, 0.2, 0.02);
     force.addParticle(-0.5, 0.3, 0.03);
@@ -55,6 +67,9 @@ void testSerialization() {
     force.addScalingParameter("lambda", 0, 1, true, true);
     force.addScalingParameter("lambda", 1, 1, false, true);
     force.addScalingParameterDerivative("lambda");
+    force.setSliceForceGroup(1, 2);
+    force.setSliceReciprocalSpaceForceGroup(2, 3);
+    force.setTunedConfiguration("device=A;particles=3;subsets=3;alpha=0.5;grid=8,9,10\ndevice=B C;particles=3;subsets=3;vendorFFT=1;registerBoost=2\n");
 
     // Serialize and then deserialize it.
 
@@ -65,6 +80,8 @@ void testSerialization() {
     // Compare the two forces to see if they are identical.
 
     SlicedNonbondedForce& force2 = *copy;
+    ASSERT_EQUAL(force.getNumSubsets(), force2.getNumSubsets());
+    ASSERT_EQUAL(force.getNumSlices(), force2.getNumSlices());
     ASSERT_EQUAL(force.getForceGroup(), force2.getForceGroup());
     ASSERT_EQUAL(force.getName(), force2.getName());
     ASSERT_EQUAL(force.getNonbondedMethod(), force2.getNonbondedMethod());
@@ -81,6 +98,7 @@ void testSerialization() {
     ASSERT_EQUAL(force.getNumParticleParameterOffsets(), force2.getNumParticleParameterOffsets());
     ASSERT_EQUAL(force.getNumExceptionParameterOffsets(), force2.getNumExceptionParameterOffsets());
     ASSERT_EQUAL(force.getIncludeDirectSpace(), force2.getIncludeDirectSpace());
+    ASSERT_EQUAL(force.getReciprocalSpaceForceGroup(), force2.getReciprocalSpaceForceGroup());
     double alpha2;
     int nx2, ny2, nz2;
     force2.getPMEParameters(alpha2, nx2, ny2, nz2);
@@ -95,6 +113,31 @@ void testSerialization() {
     ASSERT_EQUAL(dnx, dnx2);
     ASSERT_EQUAL(dny, dny2);
     ASSERT_EQUAL(dnz, dnz2);
+    ASSERT_EQUAL(force.getPMEInterpolationOrder(), force2.getPMEInterpolationOrder());
+    ASSERT_EQUAL(force.getUseTreeCode(), force2.getUseTreeCode());
+    ASSERT_EQUAL(force.getTreeCodeOpeningAngle(), force2.getTreeCodeOpeningAngle());
+    ASSERT_EQUAL(force.getSmallSubsetThreshold(), force2.getSmallSubsetThreshold());
+    ASSERT_EQUAL(force.getUseOptimalInfluenceFunction(), force2.getUseOptimalInfluenceFunction());
+    ASSERT_EQUAL(force.getAutotunePME(), force2.getAutotunePME());
+    ASSERT_EQUAL(force.getAutoselectFFT(), force2.getAutoselectFFT());
+    ASSERT_EQUAL(force.getUseDerivativesOnDemand(), force2.getUseDerivativesOnDemand());
+    ASSERT_EQUAL(force.getUseSliceForces(), force2.getUseSliceForces());
+    ASSERT_EQUAL(force.getUseSliceEnergies(), force2.getUseSliceEnergies());
+
+    // The options that are not serialized keep their default values.
+
+    ASSERT_EQUAL(force.getUseCudaFFT(), force2.getUseCudaFFT());
+    ASSERT_EQUAL(force.getSkipDecoupledSlices(), force2.getSkipDecoupledSlices());
+    ASSERT_EQUAL(force.getUseCudaGraphs(), force2.getUseCudaGraphs());
+    ASSERT_EQUAL(force.getProfileStages(), force2.getProfileStages());
+    ASSERT_EQUAL(force.getUseCompactPMEGrids(), force2.getUseCompactPMEGrids());
+    ASSERT_EQUAL(force.getUseEnergyCache(), force2.getUseEnergyCache());
+    ASSERT_EQUAL(force.getUseCpuPme(), force2.getUseCpuPme());
+    ASSERT_EQUAL(force.getUseConcurrentLJPME(), force2.getUseConcurrentLJPME());
+    ASSERT_EQUAL(force.getUseLoadBalancing(), force2.getUseLoadBalancing());
+    ASSERT_EQUAL(force.getUseCachedBSplines(), force2.getUseCachedBSplines());
+    ASSERT_EQUAL(force.getSliceEnergyReportInterval(), force2.getSliceEnergyReportInterval());
+    ASSERT_EQUAL(force.getSliceEnergyReportFile(), force2.getSliceEnergyReportFile());
     for (int i = 0; i < force.getNumGlobalParameters(); i++) {
         ASSERT_EQUAL(force.getGlobalParameterName(i), force2.getGlobalParameterName(i));
         ASSERT_EQUAL(force.getGlobalParameterDefaultValue(i), force2.getGlobalParameterDefaultValue(i));
@@ -106,7 +149,7 @@ void testSerialization() {
         double charge2, sigma2, epsilon2;
         force.getParticleParameterOffset(i, param1, index1, charge1, sigma1, epsilon1);
         force2.getParticleParameterOffset(i, param2, index2, charge2, sigma2, epsilon2);
-        ASSERT_EQUAL(index1, index1);
+        ASSERT_EQUAL(index1, index2);
         ASSERT_EQUAL(param1, param2);
         ASSERT_EQUAL(charge1, charge2);
         ASSERT_EQUAL(sigma1, sigma2);
@@ -119,7 +162,7 @@ void testSerialization() {
         double charge2, sigma2, epsilon2;
         force.getExceptionParameterOffset(i, param1, index1, charge1, sigma1, epsilon1);
         force2.getExceptionParameterOffset(i, param2, index2, charge2, sigma2, epsilon2);
-        ASSERT_EQUAL(index1, index1);
+        ASSERT_EQUAL(index1, index2);
         ASSERT_EQUAL(param1, param2);
         ASSERT_EQUAL(charge1, charge2);
         ASSERT_EQUAL(sigma1, sigma2);
@@ -166,11 +209,105 @@ void testSerialization() {
     ASSERT_EQUAL(force.getNumScalingParameterDerivatives(), force2.getNumScalingParameterDerivatives());
     for (int i = 0; i < force.getNumScalingParameterDerivatives(); i++)
         ASSERT_EQUAL(force.getScalingParameterDerivativeName(i), force2.getScalingParameterDerivativeName(i))
+    for (int slice = 0; slice < force.getNumSlices(); slice++) {
+        ASSERT_EQUAL(force.getSliceForceGroup(slice), force2.getSliceForceGroup(slice));
+        ASSERT_EQUAL(force.getSliceReciprocalSpaceForceGroup(slice), force2.getSliceReciprocalSpaceForceGroup(slice));
+    }
+    ASSERT_EQUAL(force.getTunedConfiguration(), force2.getTunedConfiguration());
+    delete copy;
+}
+
+void testLargeSystem() {
+    // Particles are assigned to subsets in runs of varying length, and parameters are
+    // irrational numbers, so that both the run-length encoding and exact reproduction of
+    // values are exercised.
+
+    int numParticles = 1000;
+    SlicedNonbondedForce force(4);
+    for (int i = 0; i < numParticles; i++)
+        force.addParticle(sin(i), 0.1+0.01*sqrt(i), 0.1*exp(-0.01*i));
+    for (int i = 0; i < numParticles; i++)
+        force.setParticleSubset(i, (i/(1+i%7))%4);
+    for (int i = 0; i < numParticles-1; i += 3)
+        force.addException(i, i+1, cos(i), 0.2+0.001*i, log(1.0+i));
+    stringstream buffer;
+    XmlSerializer::serialize<SlicedNonbondedForce>(&force, "Force", buffer);
+    SlicedNonbondedForce* copy = XmlSerializer::deserialize<SlicedNonbondedForce>(buffer);
+    ASSERT_EQUAL(force.getNumParticles(), copy->getNumParticles());
+    ASSERT_EQUAL(force.getNumExceptions(), copy->getNumExceptions());
+    for (int i = 0; i < numParticles; i++) {
+        double charge1, sigma1, epsilon1;
+        double charge2, sigma2, epsilon2;
+        force.getParticleParameters(i, charge1, sigma1, epsilon1);
+        copy->getParticleParameters(i, charge2, sigma2, epsilon2);
+        ASSERT_EQUAL(charge1, charge2);
+        ASSERT_EQUAL(sigma1, sigma2);
+        ASSERT_EQUAL(epsilon1, epsilon2);
+        ASSERT_EQUAL(force.getParticleSubset(i), copy->getParticleSubset(i));
+    }
+    for (int i = 0; i < force.getNumExceptions(); i++) {
+        int a1, a2, b1, b2;
+        double charge1, sigma1, epsilon1;
+        double charge2, sigma2, epsilon2;
+        force.getExceptionParameters(i, a1, b1, charge1, sigma1, epsilon1);
+        copy->getExceptionParameters(i, a2, b2, charge2, sigma2, epsilon2);
+        ASSERT_EQUAL(a1, a2);
+        ASSERT_EQUAL(b1, b2);
+        ASSERT_EQUAL(charge1, charge2);
+        ASSERT_EQUAL(sigma1, sigma2);
+        ASSERT_EQUAL(epsilon1, epsilon2);
+    }
+    delete copy;
+}
+
+void testVersion1() {
+    // Forces serialized with one node per particle, exception, and subset must still be readable.
+
+    string xml =
+        "<?xml version=\"1.0\" ?>\n"
+        "<Force alpha=\"0\" cutoff=\"1\" dispersionCorrection=\"1\" ewaldTolerance=\".0005\" exceptionsUsePeriodic=\"0\" "
+        "forceGroup=\"0\" includeDirectSpace=\"1\" method=\"0\" numSubsets=\"2\" rfDielectric=\"78.3\" "
+        "type=\"SlicedNonbondedForce\" version=\"1\">\n"
+        "<GlobalParameters><Parameter default=\"0.5\" name=\"lambda\"/></GlobalParameters>\n"
+        "<ParticleOffsets/>\n"
+        "<ExceptionOffsets/>\n"
+        "<Particles><Particle eps=\"0.1\" q=\"1\" sig=\"0.3\"/><Particle eps=\"0.2\" q=\"-1\" sig=\"0.4\"/></Particles>\n"
+        "<Exceptions><Exception eps=\"0.05\" p1=\"0\" p2=\"1\" q=\"-0.5\" sig=\"0.35\"/></Exceptions>\n"
+        "<Subsets><Subset index=\"1\" subset=\"1\"/></Subsets>\n"
+        "<scalingParameters><scalingParameter includeCoulomb=\"1\" includeLJ=\"0\" parameter=\"lambda\" subset1=\"0\" subset2=\"1\"/></scalingParameters>\n"
+        "<scalingParameterDerivatives/>\n"
+        "</Force>\n";
+    stringstream buffer(xml);
+    SlicedNonbondedForce* force = XmlSerializer::deserialize<SlicedNonbondedForce>(buffer);
+    ASSERT_EQUAL(2, force->getNumParticles());
+    ASSERT_EQUAL(1, force->getNumExceptions());
+    ASSERT_EQUAL(1, force->getNumScalingParameters());
+    double charge, sigma, epsilon;
+    force->getParticleParameters(1, charge, sigma, epsilon);
+    ASSERT_EQUAL(-1.0, charge);
+    ASSERT_EQUAL(0.4, sigma);
+    ASSERT_EQUAL(0.2, epsilon);
+    int particle1, particle2;
+    force->getExceptionParameters(0, particle1, particle2, charge, sigma, epsilon);
+    ASSERT_EQUAL(0, particle1);
+    ASSERT_EQUAL(1, particle2);
+    ASSERT_EQUAL(-0.5, charge);
+    ASSERT_EQUAL(0, force->getParticleSubset(0));
+    ASSERT_EQUAL(1, force->getParticleSubset(1));
+    ASSERT_EQUAL(5, force->getPMEInterpolationOrder());
+    ASSERT_EQUAL(false, force->getUseTreeCode());
+    ASSERT_EQUAL(0.3, force->getTreeCodeOpeningAngle());
+    ASSERT_EQUAL(0, force->getSmallSubsetThreshold());
+    ASSERT_EQUAL(false, force->getUseOptimalInfluenceFunction());
+    ASSERT_EQUAL(false, force->getUseSliceEnergies());
+    delete force;
 }
 
 int main() {
     try {
         testSerialization();
+        testLargeSystem();
+        testVersion1();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
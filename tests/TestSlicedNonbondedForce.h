@@ -9,6 +9,8 @@
  * -------------------------------------------------------------------------- */
 
 #include "SlicedNonbondedForce.h"
+#include "SliceEnergyAnalyzer.h"
+#include "SlicedNonbondedReplicaBatch.h"
 #include "internal/AssertionUtilities.h"
 #include "openmm/NonbondedForce.h"
 #include "openmm/Context.h"
@@ -18,7 +20,12 @@
 #include "openmm/VerletIntegrator.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
 #include "sfmt/SFMT.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
 #include <iomanip>
+#include <mutex>
 #include <vector>
 
 using namespace NonbondedSlicing;
@@ -27,6 +34,38 @@ using namespace std;
 
 const double TOL = 1e-4;
 
+/**
+ * Get the tolerance for comparing results obtained in different ways, which is ten times larger
+ * when the platform computes in single or mixed precision.
+ */
+double getPrecisionTolerance(double tol=1e-5) {
+    if (platform.getName() == "Reference" || platform.getName() == "CPU" || platform.getPropertyDefaultValue("Precision") == string("double"))
+        return tol;
+    return 10*tol;
+}
+
+/**
+ * Add to a system, in a cubic box of side L, particles with alternating charges placed at random, and
+ * return a NonbondedForce for them in which the particles of each pair 2k and 2k+1 have an exception,
+ * with a zero charge product for every other pair.
+ */
+NonbondedForce createPairedSystem(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method, int numParticles, double L,
+                                  System& system, vector<Vec3>& positions) {
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    NonbondedForce nonbonded;
+    nonbonded.setNonbondedMethod(method);
+    nonbonded.setCutoffDistance(1.2);
+    positions.resize(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        nonbonded.addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    for (int i = 1; i < numParticles; i += 2)
+        nonbonded.addException(i-1, i, i%4 == 1 ? 0.0 : -0.5, 0.3, 0.2);
+    return nonbonded;
+}
+
 void testInstantiateFromNonbondedForce(NonbondedForce::NonbondedMethod method) {
     NonbondedForce* force = new NonbondedForce();
     force->setNonbondedMethod(method);
@@ -70,6 +109,47 @@ void testInstantiateFromNonbondedForce(NonbondedForce::NonbondedMethod method) {
     assertForcesAndEnergy(context, TOL);
 }
 
+void testParticleSubsets() {
+    NonbondedForce force;
+    force.setNonbondedMethod(NonbondedForce::CutoffPeriodic);
+    for (int i = 0; i < 6; i++)
+        force.addParticle(i%2 == 0 ? 1.0 : -1.0, 1.0, 0.5);
+    vector<int> subsets = {0, 1, 2, 0, 1, 2};
+    SlicedNonbondedForce* bulk = new SlicedNonbondedForce(force, 3, subsets);
+    SlicedNonbondedForce* single = new SlicedNonbondedForce(force, 3);
+    for (int i = 0; i < 6; i++)
+        single->setParticleSubset(i, subsets[i]);
+    vector<int> bulkSubsets = bulk->getParticleSubsets();
+    ASSERT_EQUAL(6, bulkSubsets.size());
+    for (int i = 0; i < 6; i++) {
+        ASSERT_EQUAL(subsets[i], bulkSubsets[i]);
+        ASSERT_EQUAL(subsets[i], bulk->getParticleSubset(i));
+        ASSERT_EQUAL(subsets[i], single->getParticleSubset(i));
+    }
+    bulk->addParticle(0.0, 1.0, 0.0);
+    ASSERT_EQUAL(0, bulk->getParticleSubset(6));
+    ASSERT_EQUAL(7, bulk->getParticleSubsets().size());
+    bool thrown = false;
+    try {
+        bulk->setParticleSubsets(subsets);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    subsets.push_back(3);
+    thrown = false;
+    try {
+        bulk->setParticleSubsets(subsets);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    delete bulk;
+    delete single;
+}
+
 void testCoulomb() {
     System system;
     system.addParticle(1.0);
@@ -603,7 +683,7 @@ void testDispersionCorrection() {
     int numParticles = gridSize*gridSize*gridSize;
     double boxSize = gridSize*0.7;
     double cutoff = boxSize/3;
-    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == "double") ? 1e-4 : 1e-3;
+    double tol = getPrecisionTolerance(1e-4);
     System system;
     VerletIntegrator integrator(0.01);
     SlicedNonbondedForce* sliced = new SlicedNonbondedForce(1);
@@ -664,6 +744,65 @@ void testDispersionCorrection() {
     assertEqualTo(expected, energy1-energy2, tol);
 }
 
+void testDispersionCorrectionWithOffsets(OpenMM_SFMT::SFMT& sfmt) {
+    const int numParticles = 100;
+    const double L = 3.0;
+    const double cutoff = 1.0;
+    const double tol = getPrecisionTolerance();
+
+    // Offset the LJ parameters of the particles in one of two subsets.
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(2);
+    sliced->setNonbondedMethod(SlicedNonbondedForce::CutoffPeriodic);
+    sliced->setCutoffDistance(cutoff);
+    sliced->addGlobalParameter("lambda", 1.0);
+    sliced->addGlobalParameter("p", 0.0);
+    sliced->addScalingParameter("lambda", 0, 1, true, true);
+    vector<Vec3> positions(numParticles);
+    vector<double> sigma(numParticles), epsilon(numParticles), sigmaScale(numParticles, 0.0), epsilonScale(numParticles, 0.0);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        sigma[i] = (i%3 == 0 ? 0.3 : 0.35);
+        epsilon[i] = (i%3 == 0 ? 0.5 : 0.8);
+        sliced->addParticle(0.0, sigma[i], epsilon[i]);
+        sliced->setParticleSubset(i, i%2);
+        if (i%2 == 1) {
+            sigmaScale[i] = 0.1;
+            epsilonScale[i] = -0.4;
+            sliced->addParticleParameterOffset("p", i, 0.0, sigmaScale[i], epsilonScale[i]);
+        }
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    system.addForce(sliced);
+
+    // The correction must follow the current value of the offset parameter.
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.setParameter("p", 0.5);
+    double energy1 = context1.getState(State::Energy).getPotentialEnergy();
+    sliced->setUseDispersionCorrection(false);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    context2.setParameter("p", 0.5);
+    double energy2 = context2.getState(State::Energy).getPotentialEnergy();
+    double sum1 = 0, sum2 = 0;
+    for (int i = 0; i < numParticles; i++)
+        for (int j = 0; j <= i; j++) {
+            double sigmaij = 0.5*(sigma[i]+0.5*sigmaScale[i]+sigma[j]+0.5*sigmaScale[j]);
+            double epsilonij = sqrt((epsilon[i]+0.5*epsilonScale[i])*(epsilon[j]+0.5*epsilonScale[j]));
+            sum1 += epsilonij*pow(sigmaij, 12);
+            sum2 += epsilonij*pow(sigmaij, 6);
+        }
+    double numInteractions = 0.5*numParticles*(numParticles+1);
+    double expected = 8*M_PI*numParticles*numParticles*(sum1/(9*pow(cutoff, 9))-sum2/(3*pow(cutoff, 3)))/(numInteractions*L*L*L);
+    assertEqualTo(expected, energy1-energy2, tol);
+}
+
 void testChangingParameters() {
     const int numMolecules = 600;
     const int numParticles = numMolecules*2;
@@ -705,7 +844,7 @@ void testChangingParameters() {
     nonbonded->setCutoffDistance(cutoff);
     nonbonded->setForceGroup(0);
     system.addForce(nonbonded);
-    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*nonbonded, 1);
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*nonbonded, 2);
     sliced->setForceGroup(1);
     system.addForce(sliced);
     system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
@@ -729,6 +868,13 @@ void testChangingParameters() {
     nonbonded->updateParametersInContext(context);
     sliced->updateParametersInContext(context);
     assertForcesAndEnergy(context, TOL);
+
+    // Move a few particles to another subset and see if the energies still agree.
+
+    for (int i = 0; i < numParticles; i += 7)
+        sliced->setParticleSubset(i, 1);
+    sliced->updateParametersInContext(context);
+    assertForcesAndEnergy(context, TOL);
 }
 
 void testSwitchingFunction(SlicedNonbondedForce::NonbondedMethod method) {
@@ -900,6 +1046,72 @@ void testParameterOffsets() {
     assertEqualTo(energy, context.getState(State::Energy).getPotentialEnergy(), 1e-4);
 }
 
+void testOffsetsWithScaling(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 100;
+    const double L = 4.0;
+    const double tol = getPrecisionTolerance();
+
+    System system1, system2;
+    for (System* system : {&system1, &system2})
+        system->setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    NonbondedForce nonbonded;
+    nonbonded.setNonbondedMethod(method);
+    nonbonded.setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system1.addParticle(1.0);
+        system2.addParticle(1.0);
+        nonbonded.addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+
+    // The first force has parameter offsets, while the second one has the same parameters built in.
+
+    SlicedNonbondedForce* force1 = new SlicedNonbondedForce(nonbonded, 2);
+    SlicedNonbondedForce* force2 = new SlicedNonbondedForce(nonbonded, 2);
+    for (SlicedNonbondedForce* force : {force1, force2}) {
+        for (int i = 0; i < 10; i++)
+            force->setParticleSubset(i, 1);
+        force->addGlobalParameter("lambda", 1.0);
+        force->addScalingParameter("lambda", 1, 1, true, true);
+        force->addScalingParameterDerivative("lambda");
+    }
+    force1->addGlobalParameter("p", 0.5);
+    for (int i = 0; i < 10; i++)
+        force1->addParticleParameterOffset("p", i, i%2 == 0 ? 1.0 : -1.0, 0.1, 0.2);
+    auto setBuiltInParameters = [&] (double p) {
+        for (int i = 0; i < 10; i++)
+            force2->setParticleParameters(i, (i%2 == 0 ? 1.0 : -1.0)*(0.5+p), 0.3+0.1*p, 0.5+0.2*p);
+    };
+    setBuiltInParameters(0.5);
+    system1.addForce(force1);
+    system2.addForce(force2);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system1, integrator1, platform);
+    context1.setPositions(positions);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system2, integrator2, platform);
+    context2.setPositions(positions);
+
+    // Change the scaling parameter and the offset parameter separately, and evaluate each state twice,
+    // so that cached parameters are used too.
+
+    for (auto values : vector<pair<double, double> >{{1.0, 0.5}, {0.3, 0.5}, {0.3, 0.8}, {0.7, 0.8}}) {
+        context1.setParameter("lambda", values.first);
+        context2.setParameter("lambda", values.first);
+        context1.setParameter("p", values.second);
+        setBuiltInParameters(values.second);
+        force2->updateParametersInContext(context2);
+        for (int repeat = 0; repeat < 2; repeat++) {
+            State state1 = context1.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+            State state2 = context2.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+            assertEnergy(state1, state2, tol);
+            assertForces(state1, state2, tol);
+            assertEqualTo(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), tol);
+        }
+    }
+}
+
 void testEwaldExceptions() {
     // Create a minimal system using LJPME.
 
@@ -992,7 +1204,7 @@ void testNonbondedSlicing(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMeth
     const int numParticles = numMolecules*2;
     const double cutoff = 3.5;
     const double L = exceptions ? 7.0 : 10.0;
-    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == "double") ? 1e-4 : 1e-3;
+    double tol = getPrecisionTolerance(1e-4);
 
     System system1, system2;
     for (int i = 0; i < numParticles; i++) {
@@ -1170,7 +1382,7 @@ void testScalingParameterSeparation(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::Non
     const int numParticles = numMolecules*2;
     const double cutoff = 3.5;
     const double L = exceptions ? 7.0 : 10.0;
-    double tol = (platform.getName() == "Reference" || platform.getPropertyDefaultValue("Precision") == string("double")) ? 1e-4 : 1e-3;
+    double tol = getPrecisionTolerance(1e-4);
 
     System system1, system2;
     for (int i = 0; i < numParticles; i++) {
@@ -1293,8 +1505,1623 @@ void testScalingParameterSeparation(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::Non
     assertEqualTo(derivatives1["alpha"]+derivatives1["beta"], derivatives2["gamma"], tol);
 }
 
+void testEnergyWithoutForces(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 200;
+    const double L = 6.0;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    NonbondedForce* nonbonded = new NonbondedForce();
+    nonbonded->setNonbondedMethod(method);
+    nonbonded->setCutoffDistance(1.5);
+    nonbonded->setReciprocalSpaceForceGroup(1);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        nonbonded->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*nonbonded, 2);
+    for (int i = 0; i < numParticles; i += 3)
+        sliced->setParticleSubset(i, 1);
+    sliced->addGlobalParameter("lambda", 0.5);
+    sliced->addScalingParameter("lambda", 0, 1, true, true);
+    sliced->addScalingParameterDerivative("lambda");
+    system.addForce(sliced);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // Energies and derivatives must not depend on whether forces are requested.
+
+    for (int groups : {1<<0, 1<<1, (1<<0)+(1<<1)}) {
+        State state1 = context.getState(State::Energy | State::Forces | State::ParameterDerivatives, false, groups);
+        State state2 = context.getState(State::Energy | State::ParameterDerivatives, false, groups);
+        assertEnergy(state1, state2, tol);
+        assertEqualTo(state1.getEnergyParameterDerivatives()["lambda"], state2.getEnergyParameterDerivatives()["lambda"], tol);
+        State state3 = context.getState(State::ParameterDerivatives, false, groups);
+        assertEqualTo(state1.getEnergyParameterDerivatives()["lambda"], state3.getEnergyParameterDerivatives()["lambda"], tol);
+    }
+}
+
+void testStateEnergies(OpenMM_SFMT::SFMT& sfmt) {
+    const int numParticles = 200;
+    const double L = 6.0;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(3);
+    sliced->setNonbondedMethod(SlicedNonbondedForce::PME);
+    sliced->setCutoffDistance(1.5);
+    sliced->setUseDispersionCorrection(true);
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    bonds->setForceGroup(1);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        sliced->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        sliced->setParticleSubset(i, i%3);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    for (int i = 0; i < numParticles-2; i += 10) {
+        sliced->addException(i, i+1, 0.0, 1.0, 0.0);
+        sliced->addException(i, i+2, -0.5, 0.3, 0.2);
+        bonds->addBond(i, i+1, 0.1, 100.0);
+    }
+    sliced->addGlobalParameter("lambdaCoulomb", 1.0);
+    sliced->addGlobalParameter("lambdaLJ", 1.0);
+    sliced->addGlobalParameter("beta", 1.0);
+    sliced->addScalingParameter("lambdaCoulomb", 0, 1, true, false);
+    sliced->addScalingParameter("lambdaCoulomb", 0, 2, true, false);
+    sliced->addScalingParameter("lambdaLJ", 0, 1, false, true);
+    sliced->addScalingParameter("beta", 1, 2, true, true);
+    system.addForce(sliced);
+    system.addForce(bonds);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // Slice energies must be enabled before the context is created.
+
+    bool thrown = false;
+    try {
+        sliced->computeStateEnergiesInContext(context, {"lambdaCoulomb"}, {{1.0}});
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    sliced->setUseSliceEnergies(true);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+
+    // The slice energies multiplied by the scaling factors add up to the energy of the force alone.
+
+    context2.setParameter("lambdaCoulomb", 0.4);
+    context2.setParameter("beta", 0.6);
+    vector<double> sliceEnergies = sliced->getSliceEnergiesInContext(context2);
+    ASSERT_EQUAL(2*sliced->getNumSlices(), sliceEnergies.size());
+    vector<double> coulombScale = {1.0, 0.4, 1.0, 0.4, 0.6, 1.0};
+    vector<double> ljScale = {1.0, 1.0, 1.0, 1.0, 0.6, 1.0};
+    double sum = 0.0;
+    for (int slice = 0; slice < sliced->getNumSlices(); slice++)
+        sum += coulombScale[slice]*sliceEnergies[2*slice] + ljScale[slice]*sliceEnergies[2*slice+1];
+    assertEqualTo(context2.getState(State::Energy, false, 1<<0).getPotentialEnergy(), sum, tol);
+
+    // Compare the energies computed in a single pass with those obtained by changing parameters.  The
+    // parameters that are not given keep their values in the context.
+
+    vector<vector<double>> states = {{1.0, 1.0, 1.0}, {0.0, 0.5, 0.3}, {0.2, 0.0, 1.5}, {0.7, 0.9, 0.0}};
+    vector<double> energies = sliced->computeStateEnergiesInContext(context2, {"lambdaCoulomb", "lambdaLJ", "beta"}, states);
+    vector<double> partialEnergies = sliced->computeStateEnergiesInContext(context2, {"beta"}, {{1.0}, {0.3}, {1.5}, {0.0}});
+    ASSERT_EQUAL(states.size(), energies.size());
+    ASSERT_EQUAL(states.size(), partialEnergies.size());
+    for (int k = 0; k < states.size(); k++) {
+        context2.setParameter("beta", states[k][2]);
+        assertEqualTo(context2.getState(State::Energy, false, 1<<0).getPotentialEnergy(), partialEnergies[k], tol);
+    }
+    for (int k = 0; k < states.size(); k++) {
+        context2.setParameter("lambdaCoulomb", states[k][0]);
+        context2.setParameter("lambdaLJ", states[k][1]);
+        context2.setParameter("beta", states[k][2]);
+        assertEqualTo(context2.getState(State::Energy, false, 1<<0).getPotentialEnergy(), energies[k], tol);
+    }
+}
+
+void testManySubsets(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 180;
+    const int numSubsets = 9;
+    const double L = 5.0;
+    const double tol = getPrecisionTolerance();
+
+    System system1, system2;
+    for (int i = 0; i < numParticles; i++) {
+        system1.addParticle(1.0);
+        system2.addParticle(1.0);
+    }
+    system1.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    system2.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    NonbondedForce* nonbonded = new NonbondedForce();
+    nonbonded->setNonbondedMethod(method);
+    nonbonded->setCutoffDistance(1.2);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        nonbonded->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+
+    // Give every slice its own scaling parameter, so that the number of distinct slices is large.
+
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(*nonbonded, numSubsets);
+    for (int i = 0; i < numParticles; i++)
+        sliced->setParticleSubset(i, i%numSubsets);
+    vector<string> names;
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++) {
+            string name = "lambda"+to_string(i)+"_"+to_string(j);
+            sliced->addGlobalParameter(name, 1.0);
+            sliced->addScalingParameter(name, i, j, true, true);
+            sliced->addScalingParameterDerivative(name);
+            names.push_back(name);
+        }
+
+    system1.addForce(nonbonded);
+    system2.addForce(sliced);
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    Context context1(system1, integrator1, platform);
+    Context context2(system2, integrator2, platform);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+
+    // With all parameters equal to one, the derivatives must add up to the energy.
+
+    map<string, double> derivatives = state2.getEnergyParameterDerivatives();
+    double sum = 0.0;
+    for (string name : names)
+        sum += derivatives[name];
+    assertEqualTo(state2.getPotentialEnergy(), sum, tol);
+}
+
+void testEvaluationOptions(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double tol = getPrecisionTolerance();
+    bool gpu = (platform.getName() != "Reference" && platform.getName() != "CPU");
+    bool pme = (method == NonbondedForce::PME || method == NonbondedForce::LJPME);
+
+    // Subsets 1 and 2 are small.  Two slices are decoupled, one of which has a requested derivative.
+
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce nonbonded = createPairedSystem(sfmt, method, numParticles, 5.0, system, positions);
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(nonbonded, 3);
+    for (int i = 0; i < numParticles; i++)
+        sliced->setParticleSubset(i, i < 8 ? 1 : (i < 14 ? 2 : 0));
+    sliced->addGlobalParameter("lambdaA", 0.0);
+    sliced->addGlobalParameter("lambdaB", 0.0);
+    sliced->addScalingParameter("lambdaA", 0, 1, true, true);
+    sliced->addScalingParameter("lambdaB", 0, 2, true, true);
+    sliced->addScalingParameter("lambdaB", 2, 2, true, true);
+    sliced->addScalingParameterDerivative("lambdaA");
+    system.addForce(sliced);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    ASSERT(!sliced->getSkipDecoupledSlices());
+    ASSERT_EQUAL(0, sliced->getSmallSubsetThreshold());
+    ASSERT(!sliced->getUseCpuPme());
+    ASSERT(!sliced->getUseCompactPMEGrids());
+    ASSERT(!sliced->getUseConcurrentLJPME());
+    ASSERT(!sliced->getProfileStages());
+    ASSERT_EQUAL(0, sliced->getPMEGridMemorySavingsInContext(context1));
+
+    // An option that changes how the force is evaluated must not change the results, before and after
+    // decoupled slices are recoupled and particles move between subsets.
+
+    auto testOption = [&] (function<void(bool)> setOption, function<void(Context&)> check) {
+        setOption(true);
+        VerletIntegrator integrator2(0.001);
+        Context context2(system, integrator2, platform);
+        context2.setPositions(positions);
+        auto compare = [&] () {
+            int types = State::Energy | State::Forces | State::ParameterDerivatives;
+            State state1 = context1.getState(types);
+            State state2 = context2.getState(types);
+            assertEnergy(state1, state2, tol);
+            assertForces(state1, state2, tol);
+            assertEqualTo(state1.getEnergyParameterDerivatives().at("lambdaA"), state2.getEnergyParameterDerivatives().at("lambdaA"), tol);
+        };
+        auto setParameter = [&] (const string& name, double value) {
+            context1.setParameter(name, value);
+            context2.setParameter(name, value);
+        };
+        setParameter("lambdaA", 0.0);
+        setParameter("lambdaB", 0.0);
+        compare();
+        int subset = sliced->getParticleSubset(2);
+        sliced->setParticleSubset(2, sliced->getParticleSubset(20));
+        sliced->setParticleSubset(20, subset);
+        sliced->updateParametersInContext(context1);
+        sliced->updateParametersInContext(context2);
+        compare();
+        setParameter("lambdaB", 0.5);
+        compare();
+        setParameter("lambdaA", 0.7);
+        compare();
+        check(context2);
+        setOption(false);
+    };
+    testOption([&] (bool value) {sliced->setSkipDecoupledSlices(value);}, [] (Context& context) {});
+    testOption([&] (bool value) {sliced->setSmallSubsetThreshold(value ? 10 : 0);}, [] (Context& context) {});
+    testOption([&] (bool value) {sliced->setUseCpuPme(value);}, [] (Context& context) {});
+    testOption([&] (bool value) {sliced->setUseConcurrentLJPME(value);}, [] (Context& context) {});
+    testOption([&] (bool value) {sliced->setUseCompactPMEGrids(value);}, [&] (Context& context) {
+        if (gpu && pme)
+            ASSERT(sliced->getPMEGridMemorySavingsInContext(context) > 0);
+        else
+            ASSERT_EQUAL(0, sliced->getPMEGridMemorySavingsInContext(context));
+    });
+    testOption([&] (bool value) {sliced->setProfileStages(value);}, [&] (Context& context) {
+        map<string, double> timings = sliced->getStageTimingsInContext(context);
+        for (auto& timing : timings)
+            ASSERT(timing.second >= 0.0);
+        if (gpu && (pme || method == NonbondedForce::Ewald)) {
+            ASSERT(!timings.empty());
+            bool hasPmeStage = false;
+            for (auto& timing : timings)
+                hasPmeStage = hasPmeStage || timing.first.find("pme.spread") != string::npos;
+            ASSERT(hasPmeStage || !pme);
+        }
+    });
+}
+
+void testSliceForces(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce nonbonded = createPairedSystem(sfmt, method, numParticles, 5.0, system, positions);
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(nonbonded, 3);
+    for (int i = 0; i < numParticles; i++)
+        sliced->setParticleSubset(i, (i/2)%3);
+    sliced->addGlobalParameter("lambdaA", 0.5);
+    sliced->addGlobalParameter("lambdaB", 0.3);
+    sliced->addScalingParameter("lambdaA", 0, 1, true, true);
+    sliced->addScalingParameter("lambdaB", 0, 2, true, false);
+    sliced->addScalingParameter("lambdaB", 2, 2, true, true);
+    sliced->setUseSliceForces(true);
+    system.addForce(sliced);
+
+    // Another force of the system contributes nothing to the slice forces.
+
+    HarmonicBondForce* bonds = new HarmonicBondForce();
+    for (int i = 0; i < numParticles; i += 2)
+        bonds->addBond(i, i+1, 0.1, 1000.0);
+    bonds->setForceGroup(1);
+    system.addForce(bonds);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // The slice forces of the first evaluation add up to the total force of the sliced force.
+
+    vector<Vec3> sum(numParticles);
+    for (int slice = 0; slice < sliced->getNumSlices(); slice++) {
+        vector<Vec3> forces = sliced->getSliceForcesInContext(context, slice);
+        for (int i = 0; i < numParticles; i++)
+            sum[i] += forces[i];
+    }
+    State state = context.getState(State::Forces, false, 1<<0);
+    for (int i = 0; i < numParticles; i++)
+        assertEqualVec(state.getForces()[i], sum[i], tol);
+
+    // They are taken from the last evaluation, even if it includes other forces.  The forces of a
+    // slice are proportional to its scaling parameter.
+
+    vector<Vec3> forces1 = sliced->getSliceForcesInContext(context, sliceIndex(0, 1));
+    context.setParameter("lambdaA", 1.0);
+    context.getState(State::Forces);
+    vector<Vec3> forces2 = sliced->getSliceForcesInContext(context, sliceIndex(0, 1));
+    for (int i = 0; i < numParticles; i++)
+        assertEqualVec(forces1[i]*2.0, forces2[i], tol);
+    state = context.getState(State::Forces, false, 1<<0);
+    sum = vector<Vec3>(numParticles);
+    for (int slice = 0; slice < sliced->getNumSlices(); slice++) {
+        vector<Vec3> forces = sliced->getSliceForcesInContext(context, slice);
+        for (int i = 0; i < numParticles; i++)
+            sum[i] += forces[i];
+    }
+    for (int i = 0; i < numParticles; i++)
+        assertEqualVec(state.getForces()[i], sum[i], tol);
+}
+
+void testTrivialSlicing(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce nonbonded = createPairedSystem(sfmt, method, numParticles, 5.0, system, positions);
+    nonbonded.setUseDispersionCorrection(true);
+    nonbonded.addGlobalParameter("offset", 0.5);
+    nonbonded.addParticleParameterOffset("offset", 0, 0.2, 0.0, 0.1);
+
+    // A force without scaling parameters is evaluated by the standard kernel, so compare it with one
+    // that has a unit scaling parameter and therefore uses the sliced kernel.
+
+    SlicedNonbondedForce* trivial = new SlicedNonbondedForce(nonbonded, 3);
+    SlicedNonbondedForce* scaled = new SlicedNonbondedForce(nonbonded, 3);
+    for (int i = 0; i < numParticles; i++) {
+        trivial->setParticleSubset(i, i%3);
+        scaled->setParticleSubset(i, i%3);
+    }
+    scaled->addGlobalParameter("lambda", 1.0);
+    scaled->addScalingParameter("lambda", 0, 1, true, true);
+    trivial->setForceGroup(1);
+    scaled->setForceGroup(2);
+    system.addForce(trivial);
+    system.addForce(scaled);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces, false, 1<<1);
+    State state2 = context.getState(State::Energy | State::Forces, false, 1<<2);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+
+    // An option that changes the evaluation path makes the force nontrivial even without scaling
+    // parameters.  Only the sliced kernels of GPU platforms report the memory taken by their arrays.
+
+    bool reportsMemory = (platform.getName() != "Reference" && platform.getName() != "CPU");
+    ASSERT(trivial->getMemoryUsageInContext(context).empty());
+    ASSERT(scaled->getMemoryUsageInContext(context).empty() != reportsMemory);
+    trivial->setProfileStages(true);
+    VerletIntegrator profiledIntegrator(0.001);
+    Context profiledContext(system, profiledIntegrator, platform);
+    profiledContext.setPositions(positions);
+    trivial->setProfileStages(false);
+    ASSERT(trivial->getMemoryUsageInContext(profiledContext).empty() != reportsMemory);
+    state2 = profiledContext.getState(State::Energy | State::Forces, false, 1<<1);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+
+    // Parameters can still be updated, but scaling parameters cannot be added afterwards.
+
+    trivial->setParticleParameters(1, -0.8, 0.3, 0.4);
+    scaled->setParticleParameters(1, -0.8, 0.3, 0.4);
+    trivial->updateParametersInContext(context);
+    scaled->updateParametersInContext(context);
+    state1 = context.getState(State::Energy | State::Forces, false, 1<<1);
+    state2 = context.getState(State::Energy | State::Forces, false, 1<<2);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+    trivial->addGlobalParameter("lambda2", 1.0);
+    trivial->addScalingParameter("lambda2", 0, 0, true, false);
+    bool thrown = false;
+    try {
+        trivial->updateParametersInContext(context);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
 void runPlatformTests();
 
+void testAutotunePME(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double L = 3.3;
+    const double tol = 1e-3;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    force->setEwaldErrorTolerance(1e-5);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i%5 == 0 ? 1 : 0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(force);
+
+    // Tuning may only enlarge the grids, so the results must agree with the untuned ones.
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    force->setAutotunePME(true);
+    ASSERT(force->getAutotunePME());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+    double alpha1, alpha2;
+    int grid1[3], grid2[3];
+    force->getPMEParametersInContext(context1, alpha1, grid1[0], grid1[1], grid1[2]);
+    force->getPMEParametersInContext(context2, alpha2, grid2[0], grid2[1], grid2[2]);
+    ASSERT_EQUAL(alpha1, alpha2);
+    for (int i = 0; i < 3; i++)
+        ASSERT(grid2[i] >= grid1[i]);
+    if (method == NonbondedForce::LJPME) {
+        force->getLJPMEParametersInContext(context1, alpha1, grid1[0], grid1[1], grid1[2]);
+        force->getLJPMEParametersInContext(context2, alpha2, grid2[0], grid2[1], grid2[2]);
+        ASSERT_EQUAL(alpha1, alpha2);
+        for (int i = 0; i < 3; i++)
+            ASSERT(grid2[i] >= grid1[i]);
+    }
+
+    // Explicitly set grids are never modified.
+
+    force->setPMEParameters(alpha1, 20, 21, 24);
+    VerletIntegrator integrator3(0.001);
+    Context context3(system, integrator3, platform);
+    force->getPMEParametersInContext(context3, alpha2, grid2[0], grid2[1], grid2[2]);
+    ASSERT_EQUAL(20, grid2[0]);
+    ASSERT_EQUAL(21, grid2[1]);
+    ASSERT_EQUAL(24, grid2[2]);
+}
+
+void testTunedConfiguration(OpenMM_SFMT::SFMT& sfmt) {
+    const int numParticles = 150;
+    const double L = 3.3;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(NonbondedForce::PME);
+    force->setCutoffDistance(1.0);
+    force->setEwaldErrorTolerance(1e-5);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i%5 == 0 ? 1 : 0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->setAutotunePME(true);
+    force->setAutoselectFFT(true);
+    system.addForce(force);
+
+    // Configurations stored for other devices are kept, ahead of those tuned in the context.
+
+    string other = "device=Other;particles=150;subsets=2;alpha=3;grid=30,30,30;vendorFFT=0;registerBoost=2\n";
+    force->setTunedConfiguration(other);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    string configurations = force->getTunedConfigurationInContext(context1);
+    ASSERT(configurations.find(other) == 0);
+
+    // A context created with the stored configurations gets the same grids and results.
+
+    force->setTunedConfiguration(configurations);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    ASSERT_EQUAL(configurations, force->getTunedConfigurationInContext(context2));
+    ASSERT_EQUAL(force->getFFTBackendInContext(context1), force->getFFTBackendInContext(context2));
+    double alpha1, alpha2;
+    int grid1[3], grid2[3];
+    force->getPMEParametersInContext(context1, alpha1, grid1[0], grid1[1], grid1[2]);
+    force->getPMEParametersInContext(context2, alpha2, grid2[0], grid2[1], grid2[2]);
+    ASSERT_EQUAL(alpha1, alpha2);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL(grid1[i], grid2[i]);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, 1e-5);
+    assertForces(state1, state2, 1e-5);
+
+    // Malformed configurations are rejected.
+
+    force->setTunedConfiguration("device=Other;grid=30");
+    bool thrown = false;
+    try {
+        force->getTunedConfigurationInContext(context2);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testPMEInterpolationOrder(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double L = 3.3;
+    const double tol = 1e-4;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    force->setEwaldErrorTolerance(tol);
+    force->setIncludeDirectSpace(false);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i%5 == 0 ? 1 : 0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(force);
+    ASSERT_EQUAL(5, force->getPMEInterpolationOrder());
+    bool thrown = false;
+    try {
+        force->setPMEInterpolationOrder(2);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    // Compute reference reciprocal space forces with fifth order B-splines on grids twice as fine
+    // as the automatic ones.
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    double alpha1, alpha2, dispersionAlpha1, dispersionAlpha2;
+    int grid1[3], grid2[3], dispersionGrid1[3], dispersionGrid2[3];
+    force->getPMEParametersInContext(context1, alpha1, grid1[0], grid1[1], grid1[2]);
+    force->setPMEParameters(alpha1, 2*grid1[0], 2*grid1[1], 2*grid1[2]);
+    if (method == NonbondedForce::LJPME) {
+        force->getLJPMEParametersInContext(context1, dispersionAlpha1, dispersionGrid1[0], dispersionGrid1[1], dispersionGrid1[2]);
+        force->setLJPMEParameters(dispersionAlpha1, 2*dispersionGrid1[0], 2*dispersionGrid1[1], 2*dispersionGrid1[2]);
+    }
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    vector<Vec3> referenceForces = context2.getState(State::Forces).getForces();
+    force->setPMEParameters(0.0, 0, 0, 0);
+    force->setLJPMEParameters(0.0, 0, 0, 0);
+
+    // Every order must meet the error tolerance, and higher orders must do so with coarser grids.
+
+    auto computeError = [&] (int grid[3]) {
+        VerletIntegrator integrator3(0.001);
+        Context context3(system, integrator3, platform);
+        context3.setPositions(positions);
+        vector<Vec3> forces = context3.getState(State::Forces).getForces();
+        double error = 0.0, norm = 0.0;
+        for (int i = 0; i < numParticles; i++) {
+            Vec3 delta = forces[i]-referenceForces[i];
+            error += delta.dot(delta);
+            norm += referenceForces[i].dot(referenceForces[i]);
+        }
+        force->getPMEParametersInContext(context3, alpha2, grid[0], grid[1], grid[2]);
+        ASSERT_EQUAL(alpha1, alpha2);
+        if (method == NonbondedForce::LJPME) {
+            force->getLJPMEParametersInContext(context3, dispersionAlpha2, dispersionGrid2[0], dispersionGrid2[1], dispersionGrid2[2]);
+            ASSERT_EQUAL(dispersionAlpha1, dispersionAlpha2);
+        }
+        return sqrt(error/norm);
+    };
+    for (int order : {4, 6, 7, 8}) {
+        force->setPMEInterpolationOrder(order);
+        ASSERT_EQUAL(order, force->getPMEInterpolationOrder());
+        ASSERT(computeError(grid2) < tol);
+        for (int i = 0; i < 3; i++)
+            ASSERT(order < 5 ? grid2[i] > grid1[i] : grid2[i] <= grid1[i]);
+        if (method == NonbondedForce::LJPME)
+            for (int i = 0; i < 3; i++)
+                ASSERT(order < 5 ? dispersionGrid2[i] > dispersionGrid1[i] : dispersionGrid2[i] <= dispersionGrid1[i]);
+    }
+
+    // The optimal influence function must meet the error tolerance with a coarser grid.
+
+    int grid3[3];
+    force->setPMEInterpolationOrder(7);
+    ASSERT(computeError(grid2) < tol);
+    force->setUseOptimalInfluenceFunction(true);
+    ASSERT(computeError(grid3) < tol);
+    for (int i = 0; i < 3; i++)
+        ASSERT(grid3[i] < grid2[i]);
+}
+
+void testOptimalInfluenceFunction(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double L = 3.0;
+    const double tol = 1e-4;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.2+0.01*(i%7), 0.5);
+        force->setParticleSubset(i, i%5 == 0 ? 1 : 0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(force);
+    ASSERT(!force->getUseOptimalInfluenceFunction());
+
+    // Compute reference energies with fine grids.
+
+    force->setPMEParameters(3.0, 48, 48, 48);
+    force->setLJPMEParameters(3.0, 48, 48, 48);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    double referenceEnergy = context.getState(State::Energy).getPotentialEnergy();
+
+    // With coarse grids, the optimal influence function must give more accurate energies.
+
+    force->setPMEParameters(3.0, 12, 12, 12);
+    force->setLJPMEParameters(3.0, 12, 12, 12);
+    double error[2];
+    for (int optimal = 0; optimal < 2; optimal++) {
+        force->setUseOptimalInfluenceFunction(optimal == 1);
+        ASSERT_EQUAL(optimal == 1, force->getUseOptimalInfluenceFunction());
+        VerletIntegrator coarseIntegrator(0.001);
+        Context coarseContext(system, coarseIntegrator, platform);
+        coarseContext.setPositions(positions);
+        error[optimal] = fabs(coarseContext.getState(State::Energy).getPotentialEnergy()-referenceEnergy);
+    }
+    ASSERT(error[1] < error[0]);
+
+    // The influence function must follow changes of the box.
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Energy);
+    Vec3 a(1.05*L, 0, 0), b(0.3*L, L, 0), c(-0.2*L, 0.1*L, 0.95*L);
+    context1.setPeriodicBoxVectors(a, b, c);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    system.setDefaultPeriodicBoxVectors(a, b, c);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+}
+
+void testCachedBSplines(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double L = 3.0;
+    const double tol = 1e-5;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0.2*L, L, 0), Vec3(-0.1*L, 0.3*L, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.2+0.01*(i%7), 0.5);
+        force->setParticleSubset(i, i%3);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameterDerivative("lambda");
+    system.addForce(force);
+    ASSERT(!force->getUseCachedBSplines());
+
+    // The results must not depend on whether the B-spline coefficients are cached, both when the Coulomb
+    // and dispersion grids are the same and when they differ.
+
+    for (int sameGrids = 0; sameGrids < 2; sameGrids++) {
+        force->setPMEParameters(3.0, 24, 24, 24);
+        force->setLJPMEParameters(3.0, sameGrids ? 24 : 20, sameGrids ? 24 : 20, sameGrids ? 24 : 18);
+        State state[2];
+        for (int cached = 0; cached < 2; cached++) {
+            force->setUseCachedBSplines(cached == 1);
+            ASSERT_EQUAL(cached == 1, force->getUseCachedBSplines());
+            VerletIntegrator integrator(0.001);
+            Context context(system, integrator, platform);
+            context.setPositions(positions);
+            state[cached] = context.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+        }
+        assertEnergy(state[0], state[1], tol);
+        assertForces(state[0], state[1], tol);
+        assertEqualTo(state[0].getEnergyParameterDerivatives().at("lambda"), state[1].getEnergyParameterDerivatives().at("lambda"), tol);
+        force->setUseCachedBSplines(false);
+    }
+}
+
+void testTreeCode(OpenMM_SFMT::SFMT& sfmt) {
+    const int gridSize = 8;
+    const int numParticles = gridSize*gridSize*gridSize;
+    const double spacing = 0.35;
+
+    System system;
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    force->setNonbondedMethod(NonbondedForce::NoCutoff);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i%3);
+        Vec3 jitter = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))-Vec3(0.5, 0.5, 0.5);
+        positions[i] = Vec3(i%gridSize, (i/gridSize)%gridSize, i/(gridSize*gridSize))*spacing+jitter*0.1;
+    }
+    for (int i = 1; i < numParticles; i += 3)
+        force->addException(i-1, i, 0.0, 1.0, 0.0);
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameterDerivative("lambda");
+    system.addForce(force);
+    ASSERT(!force->getUseTreeCode());
+    ASSERT_EQUAL(0.3, force->getTreeCodeOpeningAngle());
+    for (double angle : {0.0, 1.5}) {
+        bool thrown = false;
+        try {
+            force->setTreeCodeOpeningAngle(angle);
+        }
+        catch (const OpenMMException& e) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
+
+    // Only the Reference and CPU platforms implement the tree code, and the others must refuse it.
+
+    if (platform.getName() != "Reference" && platform.getName() != "CPU") {
+        force->setUseTreeCode(true);
+        VerletIntegrator integrator(0.001);
+        bool thrown = false;
+        try {
+            Context context(system, integrator, platform);
+        }
+        catch (const OpenMMException& e) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+        return;
+    }
+
+    // With a small opening angle, the tree code must reproduce the direct sum closely.
+
+    force->setTreeCodeOpeningAngle(0.15);
+    State state[2];
+    for (int tree = 0; tree < 2; tree++) {
+        force->setUseTreeCode(tree == 1);
+        ASSERT_EQUAL(tree == 1, force->getUseTreeCode());
+        VerletIntegrator integrator(0.001);
+        Context context(system, integrator, platform);
+        context.setPositions(positions);
+        state[tree] = context.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+    }
+    assertEnergy(state[0], state[1], 1e-3);
+    assertForces(state[0], state[1], 2e-2);
+    assertEqualTo(state[0].getEnergyParameterDerivatives().at("lambda"), state[1].getEnergyParameterDerivatives().at("lambda"), 1e-3);
+
+    // Without scaling parameters, the tree code must still be used rather than the standard kernel.
+    // With the largest opening angle, it departs visibly from the direct sum, but it must agree with
+    // a force whose unit scaling parameter keeps it in the sliced kernel.
+
+    System trivialSystem;
+    SlicedNonbondedForce* trivial = new SlicedNonbondedForce(3);
+    trivial->setNonbondedMethod(NonbondedForce::NoCutoff);
+    for (int i = 0; i < numParticles; i++) {
+        double charge, sigma, epsilon;
+        force->getParticleParameters(i, charge, sigma, epsilon);
+        trivialSystem.addParticle(1.0);
+        trivial->addParticle(charge, sigma, epsilon);
+        trivial->setParticleSubset(i, i%3);
+    }
+    for (int i = 1; i < numParticles; i += 3)
+        trivial->addException(i-1, i, 0.0, 1.0, 0.0);
+    trivial->setTreeCodeOpeningAngle(1.0);
+    trivialSystem.addForce(trivial);
+    force->setTreeCodeOpeningAngle(1.0);
+    force->setGlobalParameterDefaultValue(0, 1.0);
+    State treeStates[3];
+    for (int i = 0; i < 3; i++) {
+        trivial->setUseTreeCode(i > 0);
+        VerletIntegrator integrator(0.001);
+        Context context(i < 2 ? trivialSystem : system, integrator, platform);
+        context.setPositions(positions);
+        treeStates[i] = context.getState(State::Energy | State::Forces);
+    }
+    double exact = treeStates[0].getPotentialEnergy();
+    ASSERT(fabs(treeStates[1].getPotentialEnergy()-exact) > 1e-6*fabs(exact));
+    assertEnergy(treeStates[1], treeStates[2], 1e-6);
+    assertForces(treeStates[1], treeStates[2], 1e-6);
+}
+
+void testForcesWithSameGrids(OpenMM_SFMT::SFMT& sfmt) {
+    const int numParticles = 60;
+    const double L = 2.5;
+    const double tol = getPrecisionTolerance();
+
+    // Create three forces with the same PME grids, two of which distribute the particles among
+    // subsets in the same way.
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    for (int k = 0; k < 3; k++) {
+        SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+        force->setNonbondedMethod(SlicedNonbondedForce::PME);
+        force->setCutoffDistance(1.0);
+        force->setPMEParameters(3.0, 24, 24, 24);
+        for (int i = 0; i < numParticles; i++) {
+            force->addParticle((i%2 == 0 ? 1.0 : -1.0)*(k+1)*0.3, 0.3, 0.5);
+            force->setParticleSubset(i, (k < 2 ? i%2 : (i/3)%2));
+        }
+        force->addGlobalParameter("lambda"+to_string(k), 0.5);
+        force->addScalingParameter("lambda"+to_string(k), 0, 1, true, false);
+        force->setForceGroup(k);
+        system.addForce(force);
+    }
+
+    // Evaluating all forces together must give the sum of evaluating them one at a time.
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state = context.getState(State::Energy | State::Forces);
+    double energy = 0.0;
+    vector<Vec3> forces(numParticles);
+    for (int k = 0; k < 3; k++) {
+        State state1 = context.getState(State::Energy | State::Forces, false, 1<<k);
+        energy += state1.getPotentialEnergy();
+        for (int i = 0; i < numParticles; i++)
+            forces[i] += state1.getForces()[i];
+    }
+    assertEqualTo(energy, state.getPotentialEnergy(), tol);
+    for (int i = 0; i < numParticles; i++)
+        assertEqualVec(forces[i], state.getForces()[i], tol);
+}
+
+void testMemoryUsage(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 100;
+    const double L = 3.0;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i%2);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    context.getState(State::Energy);
+    map<string, long long> usage = force->getMemoryUsageInContext(context);
+    if (platform.getName() == "Reference" || platform.getName() == "CPU") {
+        ASSERT(usage.empty());
+        return;
+    }
+
+    // The estimated sizes of the arrays that do not depend on the device must be exact.
+
+    string precision = platform.getPropertyValue(context, "Precision");
+    map<string, long long> estimate = force->estimateMemoryUsage(system, precision);
+    vector<string> names = {"charges", "subsets", "sliceLambdas"};
+    if (method == NonbondedForce::Ewald)
+        names.push_back("cosSinSums");
+    else
+        names.insert(names.end(), {"pmeGrid1", "pmeGrid2", "pmeBsplineModuliX", "pmeAtomGridIndex"});
+    for (string name : names) {
+        ASSERT(estimate.find(name) != estimate.end());
+        ASSERT_EQUAL(estimate[name], usage[name]);
+    }
+    ASSERT(usage["pmeEnergyBuffer"] > 0);
+    ASSERT(estimate["pmeEnergyBuffer"] > 0);
+    ASSERT_EQUAL(0, SlicedNonbondedForce(2).estimateMemoryUsage(System()).size());
+}
+
+void testEnergyCache(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 100;
+    const double L = 3.0;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i < 10 ? 1 : 0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addGlobalParameter("offset", 0.0);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameterDerivative("lambda");
+    force->addParticleParameterOffset("offset", 0, 0.5, 0.0, 0.1);
+    system.addForce(force);
+
+    // The cached energies must not change the results, whatever changes between evaluations.
+
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    force->setUseEnergyCache(true);
+    ASSERT(force->getUseEnergyCache());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    auto compare = [&] (int types) {
+        State state1 = context1.getState(types);
+        State state2 = context2.getState(types);
+        assertEnergy(state1, state2, tol);
+        assertEqualTo(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), tol);
+        if (types & State::Forces)
+            assertForces(state1, state2, tol);
+    };
+    auto setParameter = [&] (const string& name, double value) {
+        context1.setParameter(name, value);
+        context2.setParameter(name, value);
+    };
+    for (Context* context : {&context1, &context2})
+        context->setPositions(positions);
+    compare(State::Energy | State::ParameterDerivatives);
+    for (double lambda : {0.0, 0.3, 1.0}) {
+        setParameter("lambda", lambda);
+        compare(State::Energy | State::ParameterDerivatives);
+    }
+    setParameter("offset", 0.2);
+    compare(State::Energy | State::ParameterDerivatives);
+    setParameter("lambda", 0.7);
+    compare(State::Energy | State::ParameterDerivatives);
+    positions[0] += Vec3(0.1, 0, 0);
+    for (Context* context : {&context1, &context2})
+        context->setPositions(positions);
+    compare(State::Energy | State::ParameterDerivatives);
+    setParameter("lambda", 0.4);
+    compare(State::Energy | State::Forces | State::ParameterDerivatives);
+    setParameter("lambda", 0.9);
+    compare(State::Energy | State::ParameterDerivatives);
+    for (Context* context : {&context1, &context2})
+        context->setPeriodicBoxVectors(Vec3(1.1*L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    compare(State::Energy | State::ParameterDerivatives);
+}
+
+void testDerivativesOnDemand(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 100;
+    const double L = 3.0;
+    const double tol = 1e-5;
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i%2);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameterDerivative("lambda");
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    force->setUseDerivativesOnDemand(true);
+    ASSERT(force->getUseDerivativesOnDemand());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+
+    // Evaluations of forces alone are unaffected, and the derivatives are complete whenever they are
+    // requested alone or together with the energy, including after integration steps.
+
+    State state1 = context1.getState(State::Forces);
+    State state2 = context2.getState(State::Forces);
+    assertForces(state1, state2, tol);
+    for (int step = 0; step < 2; step++) {
+        for (int types : vector<int>{State::ParameterDerivatives, State::Energy | State::ParameterDerivatives}) {
+            state1 = context1.getState(types);
+            state2 = context2.getState(types);
+            assertEqualTo(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), tol);
+        }
+        integrator1.step(5);
+        integrator2.step(5);
+    }
+    state1 = context1.getState(State::Energy);
+    state2 = context2.getState(State::Energy);
+    assertEnergy(state1, state2, tol);
+}
+
+void testSliceForceGroups(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 150;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    vector<Vec3> positions;
+    NonbondedForce nonbonded = createPairedSystem(sfmt, method, numParticles, 5.0, system, positions);
+    nonbonded.setUseDispersionCorrection(true);
+    SlicedNonbondedForce* sliced = new SlicedNonbondedForce(nonbonded, 3);
+    for (int i = 0; i < numParticles; i++)
+        sliced->setParticleSubset(i, (i/2)%3);
+    sliced->addGlobalParameter("lambdaA", 0.5);
+    sliced->addGlobalParameter("lambdaB", 0.3);
+    sliced->addScalingParameter("lambdaA", 0, 1, true, true);
+    sliced->addScalingParameter("lambdaB", 2, 2, true, true);
+    sliced->addScalingParameterDerivative("lambdaA");
+    sliced->addScalingParameterDerivative("lambdaB");
+    system.addForce(sliced);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+
+    // Distribute the direct and reciprocal space parts of some slices among other force groups.
+
+    ASSERT_EQUAL(-1, sliced->getSliceForceGroup(0));
+    ASSERT_EQUAL(-1, sliced->getSliceReciprocalSpaceForceGroup(0));
+    sliced->setSliceForceGroup(sliceIndex(0, 0), 1);
+    sliced->setSliceForceGroup(sliceIndex(0, 1), 2);
+    sliced->setSliceReciprocalSpaceForceGroup(sliceIndex(0, 1), 3);
+    sliced->setSliceForceGroup(sliceIndex(1, 2), 2);
+    ASSERT_EQUAL(2, sliced->getSliceForceGroup(sliceIndex(0, 1)));
+    ASSERT_EQUAL(3, sliced->getSliceReciprocalSpaceForceGroup(sliceIndex(0, 1)));
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+
+    // Evaluating all groups together gives the same results as without slice force groups,
+    // and so does adding up the contributions of the groups evaluated separately.
+
+    int types = State::Energy | State::Forces | State::ParameterDerivatives;
+    State state1 = context1.getState(types);
+    State state2 = context2.getState(types);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+    double energy = 0;
+    vector<Vec3> forces(numParticles);
+    map<string, double> derivatives;
+    for (int group = 0; group < 4; group++) {
+        State state = context2.getState(types, false, 1<<group);
+        energy += state.getPotentialEnergy();
+        for (int i = 0; i < numParticles; i++)
+            forces[i] += state.getForces()[i];
+        for (auto& derivative : state.getEnergyParameterDerivatives())
+            derivatives[derivative.first] += derivative.second;
+    }
+    assertEqualTo(state1.getPotentialEnergy(), energy, tol);
+    for (int i = 0; i < numParticles; i++)
+        assertEqualVec(state1.getForces()[i], forces[i], tol);
+    for (string name : {"lambdaA", "lambdaB"})
+        assertEqualTo(state1.getEnergyParameterDerivatives().at(name), derivatives[name], tol);
+
+    // Group 3 only contains the reciprocal space part of the slice scaled by lambdaA.
+
+    State state3 = context2.getState(State::Energy | State::ParameterDerivatives, false, 1<<3);
+    assertEqualTo(0.5*state3.getEnergyParameterDerivatives().at("lambdaA"), state3.getPotentialEnergy(), tol);
+    assertEqualTo(0.0, state3.getEnergyParameterDerivatives().at("lambdaB"), tol);
+}
+
+void testSubsetsWithoutGrids(OpenMM_SFMT::SFMT& sfmt, bool lj) {
+    const int numParticles = 100;
+    const double L = 3.0;
+    const double tol = getPrecisionTolerance();
+
+    // Subset 2 contains uncharged particles or, with LJPME, particles without epsilons.  In the second
+    // system, an offset of that parameter whose global parameter is zero makes the subset count as
+    // charged or dispersive, so that it keeps its grid.
+
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    System system1, system2;
+    SlicedNonbondedForce* force1 = new SlicedNonbondedForce(3);
+    SlicedNonbondedForce* force2 = new SlicedNonbondedForce(3);
+    for (System* system : {&system1, &system2}) {
+        SlicedNonbondedForce* force = (system == &system1 ? force1 : force2);
+        system->setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+        force->setNonbondedMethod(lj ? NonbondedForce::LJPME : NonbondedForce::PME);
+        force->setCutoffDistance(1.0);
+        for (int i = 0; i < numParticles; i++) {
+            int subset = (i < 10 ? 1 : (i < 70 ? 0 : 2));
+            double charge = (i%2 == 0 ? 1.0 : -1.0)*(lj ? 0.5 : 1.0);
+            system->addParticle(1.0);
+            force->addParticle(subset == 2 && !lj ? 0.0 : charge, 0.3, subset == 2 && lj ? 0.0 : 0.5);
+            force->setParticleSubset(i, subset);
+        }
+        force->addGlobalParameter("lambda", 0.5);
+        force->addScalingParameter("lambda", 0, 2, true, true);
+        force->addScalingParameterDerivative("lambda");
+        system->addForce(force);
+    }
+    force2->addGlobalParameter("offset", 0.0);
+    force2->addParticleParameterOffset("offset", 70, lj ? 0.0 : 1.0, 0.0, lj ? 1.0 : 0.0);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system1, integrator1, platform);
+    context1.setPositions(positions);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system2, integrator2, platform);
+    context2.setPositions(positions);
+    auto compare = [&] () {
+        int types = State::Energy | State::Forces | State::ParameterDerivatives;
+        State state1 = context1.getState(types);
+        State state2 = context2.getState(types);
+        assertEnergy(state1, state2, tol);
+        assertForces(state1, state2, tol);
+        assertEqualTo(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), tol);
+    };
+    compare();
+
+    // The results must still agree after particles of subset 2 acquire charges and after charged
+    // particles with the same epsilons as those of subset 2 move into it.
+
+    double epsilon = (lj ? 0.0 : 0.5);
+    for (SlicedNonbondedForce* force : {force1, force2}) {
+        force->setParticleParameters(75, 1.0, 0.3, epsilon);
+        force->setParticleParameters(76, -1.0, 0.3, epsilon);
+    }
+    force1->updateParametersInContext(context1);
+    force2->updateParametersInContext(context2);
+    compare();
+    for (SlicedNonbondedForce* force : {force1, force2})
+        for (int i : {20, 21}) {
+            force->setParticleSubset(i, 2);
+            force->setParticleParameters(i, (i%2 == 0 ? 1.0 : -1.0)*0.5, 0.3, epsilon);
+        }
+    force1->updateParametersInContext(context1);
+    force2->updateParametersInContext(context2);
+    compare();
+
+    // In the CUDA and OpenCL platforms, subset 2 of the first system has no dispersion grid, so
+    // its particles cannot acquire epsilons.
+
+    if (lj && (platform.getName() == "CUDA" || platform.getName() == "OpenCL")) {
+        force1->setParticleParameters(75, 1.0, 0.3, 0.5);
+        bool thrown = false;
+        try {
+            force1->updateParametersInContext(context1);
+        }
+        catch (const OpenMMException& e) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
+}
+
+void testScalingParameterSchedule(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 50;
+    const int numSteps = 6;
+    const double L = 3.0;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(10.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i < 5 ? 1 : 0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambdaA", 0.5);
+    force->addGlobalParameter("lambdaB", 0.3);
+    force->addScalingParameter("lambdaA", 0, 1, true, true);
+    force->addScalingParameter("lambdaB", 1, 1, true, false);
+    force->addScalingParameterDerivative("lambdaA");
+    force->addScalingParameterDerivative("lambdaB");
+    system.addForce(force);
+
+    // Follow the same protocol by setting the parameters of a second context at every step.
+
+    VerletIntegrator integrator1(0.0005);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    VerletIntegrator integrator2(0.0005);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    vector<vector<double>> schedule(numSteps);
+    for (int step = 0; step < numSteps; step++)
+        schedule[step] = {1.0-step/(numSteps-1.0), 0.3+0.1*step};
+    force->setScalingParameterScheduleInContext(context1, {"lambdaA", "lambdaB"}, schedule);
+    double expectedWork = 0.0;
+    int types = State::Energy | State::Forces | State::ParameterDerivatives;
+    for (int step = 0; step < numSteps+2; step++) {
+        vector<double> values = schedule[min(step, numSteps-1)];
+        context2.setParameter("lambdaA", values[0]);
+        context2.setParameter("lambdaB", values[1]);
+        State state1 = context1.getState(types);
+        State state2 = context2.getState(types);
+        assertEnergy(state1, state2, tol);
+        assertForces(state1, state2, tol);
+        if (step < numSteps-1) {
+            map<string, double> derivatives = state2.getEnergyParameterDerivatives();
+            expectedWork += derivatives["lambdaA"]*(schedule[step+1][0]-values[0]) + derivatives["lambdaB"]*(schedule[step+1][1]-values[1]);
+        }
+        integrator1.step(1);
+        integrator2.step(1);
+    }
+    assertEqualTo(expectedWork, force->getProtocolWorkInContext(context1), tol);
+
+    // Removing the schedule restores the values of the context parameters.
+
+    force->setScalingParameterScheduleInContext(context1, vector<string>(), vector<vector<double>>());
+    ASSERT_EQUAL(0.0, force->getProtocolWorkInContext(context1));
+    context2.setParameter("lambdaA", 0.5);
+    context2.setParameter("lambdaB", 0.3);
+    context2.setPositions(context1.getState(State::Positions).getPositions());
+    assertEnergy(context1.getState(State::Energy), context2.getState(State::Energy), tol);
+
+    // Check that invalid schedules are rejected.
+
+    bool thrown = false;
+    try {
+        force->setScalingParameterScheduleInContext(context1, {"lambdaA"}, {{0.0, 1.0}});
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    thrown = false;
+    try {
+        force->setScalingParameterScheduleInContext(context1, {"lambdaC"}, {{0.0}});
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testReplicaBatch(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 60;
+    const int numReplicas = 3;
+    const double L = 3.0;
+    const double tol = getPrecisionTolerance();
+
+    SlicedNonbondedForce force(2);
+    force.setNonbondedMethod(method);
+    force.setCutoffDistance(1.0);
+    for (int i = 0; i < numParticles; i++) {
+        force.addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force.setParticleSubset(i, i < 10 ? 1 : 0);
+    }
+    for (int i = 0; i < numParticles-1; i += 6)
+        force.addException(i, i+1, 0.2, 0.3, 0.1);
+    force.addGlobalParameter("lambda", 0.5);
+    force.addScalingParameter("lambda", 0, 1, true, true);
+    force.addScalingParameterDerivative("lambda");
+    SlicedNonbondedReplicaBatch batch(force, numReplicas);
+
+    // Each replica has its own positions and its own value of lambda.
+
+    System batchSystem;
+    batchSystem.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    for (int i = 0; i < numReplicas*numParticles; i++)
+        batchSystem.addParticle(1.0);
+    batchSystem.addForce(batch.createForce());
+    vector<Vec3> positions(numReplicas*numParticles);
+    for (int i = 0; i < numReplicas*numParticles; i++)
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    VerletIntegrator batchIntegrator(0.001);
+    Context batchContext(batchSystem, batchIntegrator, platform);
+    batchContext.setPositions(positions);
+    for (int replica = 0; replica < numReplicas; replica++)
+        batchContext.setParameter(batch.getParameterName(replica, "lambda"), 0.25*replica);
+    State batchState = batchContext.getState(State::Energy | State::Forces | State::Parameters | State::ParameterDerivatives);
+    vector<double> energies = batch.getReplicaEnergies(batchState);
+
+    // The results must match those of separate contexts.
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    for (int i = 0; i < numParticles; i++)
+        system.addParticle(1.0);
+    system.addForce(new SlicedNonbondedForce(force));
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    double totalEnergy = 0.0;
+    for (int replica = 0; replica < numReplicas; replica++) {
+        context.setPositions(vector<Vec3>(positions.begin()+replica*numParticles, positions.begin()+(replica+1)*numParticles));
+        context.setParameter("lambda", 0.25*replica);
+        State state = context.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+        assertEqualTo(state.getPotentialEnergy(), energies[replica], tol);
+        totalEnergy += state.getPotentialEnergy();
+        for (int i = 0; i < numParticles; i++)
+            assertEqualVec(state.getForces()[i], batchState.getForces()[batch.getParticleIndex(replica, i)], tol);
+        assertEqualTo(state.getEnergyParameterDerivatives().at("lambda"),
+                         batchState.getEnergyParameterDerivatives().at(batch.getParameterName(replica, "lambda")), tol);
+    }
+    assertEqualTo(totalEnergy, batchState.getPotentialEnergy(), tol);
+}
+
+void testSliceEnergyReports(OpenMM_SFMT::SFMT& sfmt) {
+    const int numParticles = 100;
+    const double L = 3.0;
+    const int interval = 4;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(2);
+    force->setNonbondedMethod(NonbondedForce::PME);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i%4 == 0 ? 1 : 0);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameterDerivative("lambda");
+    system.addForce(force);
+
+    string file = "slice_energies_"+platform.getName()+".bin";
+    vector<pair<long long, vector<double>>> reports;
+    mutex reportsMutex;
+    force->setSliceEnergyReportInterval(interval);
+    force->setSliceEnergyReportFile(file);
+    force->setSliceEnergyCallback([&] (long long step, const vector<double>& values) {
+        lock_guard<mutex> lock(reportsMutex);
+        reports.push_back(make_pair(step, values));
+    });
+    double derivative;
+    {
+        VerletIntegrator integrator(0.001);
+        Context context(system, integrator, platform);
+        context.setPositions(positions);
+        State state = context.getState(State::ParameterDerivatives);
+        derivative = state.getEnergyParameterDerivatives().at("lambda");
+        integrator.step(5*interval);
+    }
+
+    // All pending reports are delivered when the context is deleted.
+
+    ASSERT(reports.size() >= 5);
+    ASSERT_EQUAL(0, reports[0].first);
+    ASSERT_EQUAL(1, reports[0].second.size());
+    assertEqualTo(derivative, reports[0].second[0], tol);
+    for (int i = 1; i < reports.size(); i++) {
+        ASSERT_EQUAL(0, reports[i].first%interval);
+        ASSERT(reports[i].first > reports[i-1].first);
+    }
+    ifstream stream(file.c_str(), ios::binary);
+    char magic[4];
+    int32_t numValues, length;
+    stream.read(magic, 4);
+    ASSERT_EQUAL("NBSE", string(magic, 4));
+    stream.read((char*) &numValues, sizeof(int32_t));
+    ASSERT_EQUAL(1, numValues);
+    stream.read((char*) &length, sizeof(int32_t));
+    string name(length, ' ');
+    stream.read(&name[0], length);
+    ASSERT_EQUAL("lambda", name);
+    for (auto& report : reports) {
+        int64_t step;
+        double value;
+        stream.read((char*) &step, sizeof(int64_t));
+        stream.read((char*) &value, sizeof(double));
+        ASSERT(stream.good());
+        ASSERT_EQUAL(report.first, step);
+        ASSERT_EQUAL(report.second[0], value);
+    }
+    stream.close();
+    remove(file.c_str());
+}
+
+void testSliceEnergyAnalyzer(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 90;
+    const int numFrames = 3;
+    const double L = 3.0;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, 0.3, 0.5);
+        force->setParticleSubset(i, i%3);
+    }
+    for (int i = 0; i < numParticles-1; i += 2)
+        force->addException(i, i+1, 0.1, 0.3, 0.2);
+    force->addGlobalParameter("lambda", 0.3);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    system.addForce(force);
+
+    // The sum of all slice energies must be the energy of the force with all scaling parameters equal to 1.
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setParameter("lambda", 1.0);
+    SliceEnergyAnalyzer analyzer(system, *force, platform);
+    ASSERT_EQUAL(6, analyzer.getNumSlices());
+    vector<double> positions, boxVectors;
+    vector<double> expected;
+    for (int frame = 0; frame < numFrames; frame++) {
+        double size = L*(1.0+0.02*frame);
+        vector<Vec3> framePositions(numParticles);
+        for (int i = 0; i < numParticles; i++) {
+            framePositions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*size;
+            for (int k = 0; k < 3; k++)
+                positions.push_back(framePositions[i][k]);
+        }
+        Vec3 box[3] = {Vec3(size, 0, 0), Vec3(0, size, 0), Vec3(0, 0, size)};
+        for (int j = 0; j < 3; j++)
+            for (int k = 0; k < 3; k++)
+                boxVectors.push_back(box[j][k]);
+        context.setPeriodicBoxVectors(box[0], box[1], box[2]);
+        context.setPositions(framePositions);
+        expected.push_back(context.getState(State::Energy).getPotentialEnergy());
+    }
+    vector<double> energies = analyzer.computeSliceEnergies(positions, boxVectors);
+    ASSERT_EQUAL(numFrames*6*2, energies.size());
+    for (int frame = 0; frame < numFrames; frame++) {
+        double total = 0.0;
+        for (int k = 0; k < 12; k++)
+            total += energies[12*frame+k];
+        assertEqualTo(expected[frame], total, tol);
+    }
+
+    // Each frame must be computed with its own positions and box, whatever the staging buffer it goes
+    // through, so the frames in reverse order must give the energies in reverse order.
+
+    vector<double> reversedPositions, reversedBoxVectors;
+    for (int frame = numFrames-1; frame >= 0; frame--) {
+        reversedPositions.insert(reversedPositions.end(), positions.begin()+3*numParticles*frame, positions.begin()+3*numParticles*(frame+1));
+        reversedBoxVectors.insert(reversedBoxVectors.end(), boxVectors.begin()+9*frame, boxVectors.begin()+9*(frame+1));
+    }
+    vector<double> reversedEnergies = analyzer.computeSliceEnergies(reversedPositions, reversedBoxVectors);
+    for (int frame = 0; frame < numFrames; frame++)
+        for (int k = 0; k < 12; k++)
+            assertEqualTo(energies[12*frame+k], reversedEnergies[12*(numFrames-1-frame)+k], tol);
+
+    // A call without box vectors uses the default ones, even after a call that ended with a larger box.
+    // The first frame has the default box.
+
+    analyzer.computeSliceEnergies(positions, boxVectors);
+    vector<double> firstPositions(positions.begin(), positions.begin()+3*numParticles);
+    vector<double> defaultBoxEnergies = analyzer.computeSliceEnergies(firstPositions);
+    for (int k = 0; k < 12; k++)
+        assertEqualTo(energies[k], defaultBoxEnergies[k], tol);
+}
+
+void testReassignSubsets(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 60;
+    const double L = 3.0;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    force->setUseDispersionCorrection(true);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, i%3 == 0 ? 0.3 : 0.25, i%4 == 0 ? 0.5 : 0.8);
+        force->setParticleSubset(i, i < 6 ? 1 : (i < 10 ? 2 : 0));
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    for (int i = 0; i < numParticles-1; i += 5)
+        force->addException(i, i+1, 0.1, 0.3, 0.2);
+    force->addGlobalParameter("lambda", 0.5);
+    force->addGlobalParameter("delta", 0.2);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameter("lambda", 0, 2, true, false);
+    force->addScalingParameterDerivative("lambda");
+    force->addParticleParameterOffset("delta", 3, 0.2, 0.05, 0.5);
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Energy);
+
+    // Moving particles between subsets in an existing context must give the same results as creating
+    // a new context.  The moved particles include one with offsets and some involved in exceptions.
+
+    vector<int> particles = {0, 3, 6, 11, 20, 21, 22};
+    vector<int> subsets = {0, 2, 1, 1, 2, 2, 1};
+    force->reassignSubsetsInContext(context1, particles, subsets);
+    for (int k = 0; k < particles.size(); k++)
+        ASSERT_EQUAL(subsets[k], force->getParticleSubset(particles[k]));
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    int types = State::Energy | State::Forces | State::ParameterDerivatives;
+    State state1 = context1.getState(types);
+    State state2 = context2.getState(types);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+    assertEqualTo(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), tol);
+}
+
+void testRepeatedUpdates(OpenMM_SFMT::SFMT& sfmt, NonbondedForce::NonbondedMethod method) {
+    const int numParticles = 60;
+    const double L = 3.0;
+    const double tol = getPrecisionTolerance();
+
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedNonbondedForce* force = new SlicedNonbondedForce(3);
+    force->setNonbondedMethod(method);
+    force->setCutoffDistance(1.0);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 0.5 : -0.5, 0.3, 0.5);
+        force->setParticleSubset(i, i%3);
+        positions[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*L;
+    }
+    force->addGlobalParameter("lambda", 0.5);
+    force->addScalingParameter("lambda", 0, 1, true, true);
+    force->addScalingParameter("lambda", 0, 2, true, true);
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Energy);
+
+    // Change the parameters and the subsets of a few particles many times, each time with large
+    // charges whose self energies would leave rounding error behind if they were updated incrementally.
+    // The final parameters are those of a new context.
+
+    for (int step = 0; step < 200; step++) {
+        for (int i = 0; i < 4; i++) {
+            double charge = (step%2 == 0 ? 50.0+genrand_real2(sfmt) : (i%2 == 0 ? 0.5 : -0.5));
+            force->setParticleParameters(i, charge, 0.3, 0.5);
+        }
+        force->updateParametersInContext(context1);
+        vector<int> particles = {10, 11};
+        vector<int> subsets = {(step+1)%3, (step+2)%3};
+        force->reassignSubsetsInContext(context1, particles, subsets);
+        context1.getState(State::Energy);
+    }
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    assertEnergy(state1, state2, tol);
+    assertForces(state1, state2, tol);
+}
+
 int main(int argc, char* argv[]) {
     vector<NonbondedForce::NonbondedMethod> nonbondedMethods = {
         NonbondedForce::NoCutoff,
@@ -1311,6 +3138,7 @@ int main(int argc, char* argv[]) {
         initializeTests(argc, argv);
         for (auto method : nonbondedMethods)
             testInstantiateFromNonbondedForce(method);
+        testParticleSubsets();
         testCoulomb();
         testLJ();
         testExclusionsAnd14();
@@ -1321,6 +3149,7 @@ int main(int argc, char* argv[]) {
         testTriclinic();
         testLargeSystem();
         testDispersionCorrection();
+        testDispersionCorrectionWithOffsets(sfmt);
         testChangingParameters();
         testSwitchingFunction(SlicedNonbondedForce::CutoffNonPeriodic);
         testSwitchingFunction(SlicedNonbondedForce::PME);
@@ -1328,12 +3157,73 @@ int main(int argc, char* argv[]) {
         testParameterOffsets();
         testEwaldExceptions();
         testDirectAndReciprocal();
+        testEnergyWithoutForces(sfmt, NonbondedForce::Ewald);
+        testEnergyWithoutForces(sfmt, NonbondedForce::PME);
+        testEnergyWithoutForces(sfmt, NonbondedForce::LJPME);
+        testStateEnergies(sfmt);
+        testManySubsets(sfmt, NonbondedForce::Ewald);
+        testManySubsets(sfmt, NonbondedForce::PME);
+        testManySubsets(sfmt, NonbondedForce::LJPME);
+        testEvaluationOptions(sfmt, NonbondedForce::CutoffPeriodic);
+        testEvaluationOptions(sfmt, NonbondedForce::Ewald);
+        testEvaluationOptions(sfmt, NonbondedForce::PME);
+        testEvaluationOptions(sfmt, NonbondedForce::LJPME);
+        testSliceForces(sfmt, NonbondedForce::CutoffPeriodic);
+        testSliceForces(sfmt, NonbondedForce::Ewald);
+        testSliceForces(sfmt, NonbondedForce::PME);
+        testSliceForces(sfmt, NonbondedForce::LJPME);
+        testTrivialSlicing(sfmt, NonbondedForce::CutoffPeriodic);
+        testTrivialSlicing(sfmt, NonbondedForce::PME);
+        testTrivialSlicing(sfmt, NonbondedForce::LJPME);
+        testOffsetsWithScaling(sfmt, NonbondedForce::Ewald);
+        testOffsetsWithScaling(sfmt, NonbondedForce::PME);
+        testOffsetsWithScaling(sfmt, NonbondedForce::LJPME);
+        testAutotunePME(sfmt, NonbondedForce::PME);
+        testAutotunePME(sfmt, NonbondedForce::LJPME);
+        testTunedConfiguration(sfmt);
+        testPMEInterpolationOrder(sfmt, NonbondedForce::PME);
+        testPMEInterpolationOrder(sfmt, NonbondedForce::LJPME);
+        testOptimalInfluenceFunction(sfmt, NonbondedForce::PME);
+        testOptimalInfluenceFunction(sfmt, NonbondedForce::LJPME);
+        testCachedBSplines(sfmt, NonbondedForce::PME);
+        testCachedBSplines(sfmt, NonbondedForce::LJPME);
+        testTreeCode(sfmt);
+        testSliceEnergyReports(sfmt);
+        testForcesWithSameGrids(sfmt);
+        testMemoryUsage(sfmt, NonbondedForce::Ewald);
+        testMemoryUsage(sfmt, NonbondedForce::PME);
+        testEnergyCache(sfmt, NonbondedForce::PME);
+        testEnergyCache(sfmt, NonbondedForce::LJPME);
+        testDerivativesOnDemand(sfmt, NonbondedForce::Ewald);
+        testDerivativesOnDemand(sfmt, NonbondedForce::PME);
+        testDerivativesOnDemand(sfmt, NonbondedForce::LJPME);
+        testSliceForceGroups(sfmt, NonbondedForce::CutoffPeriodic);
+        testSliceForceGroups(sfmt, NonbondedForce::PME);
+        testSliceForceGroups(sfmt, NonbondedForce::LJPME);
+        testSubsetsWithoutGrids(sfmt, false);
+        testSubsetsWithoutGrids(sfmt, true);
+        testScalingParameterSchedule(sfmt, NonbondedForce::CutoffPeriodic);
+        testScalingParameterSchedule(sfmt, NonbondedForce::PME);
+        testScalingParameterSchedule(sfmt, NonbondedForce::LJPME);
+        testReplicaBatch(sfmt, NonbondedForce::CutoffPeriodic);
+        testReplicaBatch(sfmt, NonbondedForce::PME);
+        testReplicaBatch(sfmt, NonbondedForce::LJPME);
+        testSliceEnergyAnalyzer(sfmt, NonbondedForce::CutoffPeriodic);
+        testSliceEnergyAnalyzer(sfmt, NonbondedForce::PME);
+        testSliceEnergyAnalyzer(sfmt, NonbondedForce::LJPME);
+        testReassignSubsets(sfmt, NonbondedForce::CutoffPeriodic);
+        testReassignSubsets(sfmt, NonbondedForce::PME);
+        testReassignSubsets(sfmt, NonbondedForce::LJPME);
+        testRepeatedUpdates(sfmt, NonbondedForce::Ewald);
+        testRepeatedUpdates(sfmt, NonbondedForce::PME);
+        testRepeatedUpdates(sfmt, NonbondedForce::LJPME);
         for (auto method : nonbondedMethods)
             for (auto exceptions : booleanValues) {
                 for (auto lj : booleanValues)
                     testNonbondedSlicing(sfmt, method, exceptions, lj);
                 testScalingParameterSeparation(sfmt, method, exceptions);
             }
+        runPlatformTests();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;